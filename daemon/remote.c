@@ -184,6 +184,7 @@ enum
     TAG_DETAILS,
     TAG_FILES,
     TAG_LIST,
+    TAG_LIST_FIELDS,
     TAG_PEERS,
     TAG_PIECES,
     TAG_PORTTEST,
@@ -243,6 +244,8 @@ static tr_option opts[] =
     { 940, "files",                  "List the current torrent(s)' files", "f",  0, NULL },
     { 'g', "get",                    "Mark files for download", "g",  1, "<files>" },
     { 'G', "no-get",                 "Mark files for not downloading", "G",  1, "<files>" },
+    { 944, "fields",                 "Make --list print just these comma-separated torrent-get fields, tab-separated", NULL, 1, "<fields>" },
+    { 945, "revision",               "Make --list --fields print only what changed since this revision", NULL, 1, "<revision>" },
     { 'i', "info",                   "Show the current torrent(s)' details", "i",  0, NULL },
     { 940, "info-files",             "List the current torrent(s)' files", "if",  0, NULL },
     { 941, "info-peers",             "List the current torrent(s)' peers", "ip",  0, NULL },
@@ -363,6 +366,8 @@ getOptMode (int val)
       case 820: /* UseSSL */
       case 't': /* set current torrent */
       case 'V': /* show version number */
+      case 944: /* fields */
+      case 945: /* revision */
         return 0;
 
       case 'c': /* incomplete-dir */
@@ -489,6 +494,12 @@ static char * netrc = NULL;
 static char * sessionId = NULL;
 static bool UseSSL = false;
 
+/* --fields and --revision, for --list */
+static bool useListFields = false;
+static tr_quark * listFields = NULL;
+static size_t listFieldCount = 0;
+static int64_t listRevision = -1;
+
 static char*
 tr_getcwd (void)
 {
@@ -673,19 +684,27 @@ static const tr_quark details_keys[] = {
     TR_KEY_activityDate,
     TR_KEY_addedDate,
     TR_KEY_bandwidthPriority,
+    TR_KEY_cacheBytes,
     TR_KEY_comment,
     TR_KEY_corruptEver,
+    TR_KEY_cpuTime,
     TR_KEY_creator,
     TR_KEY_dateCreated,
     TR_KEY_desiredAvailable,
+    TR_KEY_diskReadBytes,
+    TR_KEY_diskReadOps,
+    TR_KEY_diskWriteBytes,
+    TR_KEY_diskWriteOps,
     TR_KEY_doneDate,
     TR_KEY_downloadDir,
     TR_KEY_downloadedEver,
     TR_KEY_downloadLimit,
     TR_KEY_downloadLimited,
+    TR_KEY_downloadStalls,
     TR_KEY_error,
     TR_KEY_errorString,
     TR_KEY_eta,
+    TR_KEY_fileOpens,
     TR_KEY_hashString,
     TR_KEY_haveUnchecked,
     TR_KEY_haveValid,
@@ -696,6 +715,7 @@ static const tr_quark details_keys[] = {
     TR_KEY_leftUntilDone,
     TR_KEY_magnetLink,
     TR_KEY_name,
+    TR_KEY_openFiles,
     TR_KEY_peersConnected,
     TR_KEY_peersGettingFromUs,
     TR_KEY_peersSendingToUs,
@@ -716,13 +736,14 @@ static const tr_quark details_keys[] = {
     TR_KEY_uploadedEver,
     TR_KEY_uploadLimit,
     TR_KEY_uploadLimited,
+    TR_KEY_uploadStalls,
+    TR_KEY_wastedBytes,
     TR_KEY_webseeds,
     TR_KEY_webseedsSendingToUs
 };
 
 static const tr_quark list_keys[] = {
     TR_KEY_error,
-    TR_KEY_errorString,
     TR_KEY_eta,
     TR_KEY_id,
     TR_KEY_isFinished,
@@ -848,6 +869,54 @@ getStatusString (tr_variant * t, char * buf, size_t buflen)
 static const char *bandwidthPriorityNames[] =
     { "Low", "Normal", "High", "Invalid" };
 
+static const struct
+{
+    tr_quark key;
+    const char * name;
+}
+stallNames[] =
+{
+    { TR_KEY_uninterested, "not interested" },
+    { TR_KEY_choked, "choked" },
+    { TR_KEY_bandwidth, "speed limit" },
+    { TR_KEY_none, "moving" },
+    { TR_KEY_noRequests, "no requests" },
+    { TR_KEY_outbuf, "buffer full" },
+    { TR_KEY_disk, "waiting on disk" },
+    { TR_KEY_peer, "waiting on peer" }
+};
+
+/* prints the share of peer time spent in each stall reason */
+static void
+printStalls (const char * label, tr_variant * t, const tr_quark key)
+{
+    size_t i;
+    int64_t n;
+    int64_t total = 0;
+    tr_variant * stalls;
+    const char * delim = "";
+
+    if (!tr_variantDictFindDict (t, key, &stalls))
+        return;
+
+    for (i = 0; i < TR_N_ELEMENTS (stallNames); ++i)
+        if (tr_variantDictFindInt (stalls, stallNames[i].key, &n))
+            total += n;
+
+    printf ("  %s: ", label);
+    if (total < 1)
+        printf ("None");
+    for (i = 0; total > 0 && i < TR_N_ELEMENTS (stallNames); ++i)
+    {
+        if (tr_variantDictFindInt (stalls, stallNames[i].key, &n) && n > 0)
+        {
+            printf ("%s%.0f%% %s", delim, (100.0 * n) / total, stallNames[i].name);
+            delim = ", ";
+        }
+    }
+    printf ("\n");
+}
+
 static void
 printDetails (tr_variant * top)
 {
@@ -941,6 +1010,11 @@ printDetails (tr_variant * top)
                 strlsize (buf, i, sizeof (buf));
                 printf ("  Corrupt DL: %s\n", buf);
             }
+            if (tr_variantDictFindInt (t, TR_KEY_wastedBytes, &i) && i)
+            {
+                strlsize (buf, i, sizeof (buf));
+                printf ("  Duplicate DL: %s\n", buf);
+            }
             if (tr_variantDictFindStr (t, TR_KEY_errorString, &str, NULL) && str && *str &&
                 tr_variantDictFindInt (t, TR_KEY_error, &i) && i)
             {
@@ -1066,6 +1140,38 @@ printDetails (tr_variant * top)
                         bandwidthPriorityNames[ (i + 1) & 3]);
 
             printf ("\n");
+
+            printf ("RESOURCES\n");
+            if (tr_variantDictFindInt (t, TR_KEY_cpuTime, &i))
+                printf ("  CPU Time: %.3f seconds\n", i / 1000.0);
+            if (tr_variantDictFindInt (t, TR_KEY_diskReadBytes, &i)
+              && tr_variantDictFindInt (t, TR_KEY_diskReadOps, &j))
+            {
+                strlsize (buf, i, sizeof (buf));
+                printf ("  Disk Reads: %s in %" PRId64 " reads\n", buf, j);
+            }
+            if (tr_variantDictFindInt (t, TR_KEY_diskWriteBytes, &i)
+              && tr_variantDictFindInt (t, TR_KEY_diskWriteOps, &j))
+            {
+                strlsize (buf, i, sizeof (buf));
+                printf ("  Disk Writes: %s in %" PRId64 " writes\n", buf, j);
+            }
+            if (tr_variantDictFindInt (t, TR_KEY_openFiles, &i)
+              && tr_variantDictFindInt (t, TR_KEY_fileOpens, &j))
+                printf ("  Open Files: %" PRId64 " (%" PRId64 " checkouts)\n", i, j);
+            if (tr_variantDictFindInt (t, TR_KEY_cacheBytes, &i))
+            {
+                strlsize (buf, i, sizeof (buf));
+                printf ("  Cached: %s\n", buf);
+            }
+
+            printf ("\n");
+
+            printf ("STALLS\n");
+            printStalls ("Downloading", t, TR_KEY_downloadStalls);
+            printStalls ("Uploading", t, TR_KEY_uploadStalls);
+
+            printf ("\n");
         }
     }
 }
@@ -1246,6 +1352,83 @@ printPortTest (tr_variant * top)
     }
 }
 
+static void
+printFieldValue (const tr_variant * v)
+{
+    const char * str;
+    size_t len;
+
+    if (tr_variantGetStr (v, &str, &len))
+    {
+        fwrite (str, 1, len, stdout);
+    }
+    else
+    {
+        int json_len;
+        char * json = tr_variantToStr (v, TR_VARIANT_FMT_JSON_LEAN, &json_len);
+        while (json_len > 0 && isspace (json[json_len-1]))
+            --json_len;
+        fwrite (json, 1, json_len, stdout);
+        tr_free (json);
+    }
+}
+
+/* for --fields: an "#id<tab>field..." header, then a line per torrent
+   with the values in the same order. With --revision, fields that didn't
+   change are left blank and two more kinds of lines tell the caller which
+   torrents went away and what revision to ask for next time */
+static void
+printTorrentFields (tr_variant * top)
+{
+    size_t j;
+    int64_t id;
+    tr_variant * args;
+    tr_variant * list;
+
+    if (!tr_variantDictFindDict (top, TR_KEY_arguments, &args))
+        return;
+
+    fputs ("#id", stdout);
+    for (j=0; j<listFieldCount; ++j)
+        printf ("\t%s", tr_quark_get_string (listFields[j], NULL));
+    putchar ('\n');
+
+    if (tr_variantDictFindList (args, TR_KEY_torrents, &list))
+    {
+        int i, n;
+
+        for (i=0, n=tr_variantListSize (list); i<n; ++i)
+        {
+            tr_variant * d = tr_variantListChild (list, i);
+
+            if (!tr_variantDictFindInt (d, TR_KEY_id, &id))
+                continue;
+
+            printf ("%"PRId64, id);
+            for (j=0; j<listFieldCount; ++j)
+            {
+                const tr_variant * v = tr_variantDictFind (d, listFields[j]);
+                putchar ('\t');
+                if (v != NULL)
+                    printFieldValue (v);
+            }
+            putchar ('\n');
+        }
+    }
+
+    if (tr_variantDictFindList (args, TR_KEY_removed, &list))
+    {
+        int i, n;
+
+        for (i=0, n=tr_variantListSize (list); i<n; ++i)
+            if (tr_variantGetInt (tr_variantListChild (list, i), &id))
+                printf ("#removed\t%"PRId64"\n", id);
+    }
+
+    if (tr_variantDictFindInt (args, TR_KEY_revision, &id))
+        printf ("#revision\t%"PRId64"\n", id);
+}
+
 static void
 printTorrentList (tr_variant * top)
 {
@@ -1673,6 +1856,13 @@ processResponse (const char * rpcurl, const void * response, size_t len)
     {
         int64_t      tag = -1;
         const char * str;
+        tr_variant * args;
+        tr_variant * torrents;
+
+        /* the torrent list is asked for in the "table" format */
+        if (tr_variantDictFindDict (&top, ARGUMENTS, &args)
+            && tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+            tr_variantListTableToDicts (torrents);
 
         if (tr_variantDictFindStr (&top, TR_KEY_result, &str, NULL))
         {
@@ -1702,6 +1892,9 @@ processResponse (const char * rpcurl, const void * response, size_t len)
             case TAG_LIST:
                 printTorrentList (&top); break;
 
+            case TAG_LIST_FIELDS:
+                printTorrentFields (&top); break;
+
             case TAG_PEERS:
                 printPeers (&top); break;
 
@@ -1935,6 +2128,34 @@ processArgs (const char * rpcurl, int argc, const char ** argv)
                     exit (0);
                     break;
 
+                case 944: /* fields */
+                {
+                    const char * walk = optarg;
+                    tr_free (listFields);
+                    listFields = NULL;
+                    listFieldCount = 0;
+                    useListFields = true;
+                    while (*walk)
+                    {
+                        const char * end = strchr (walk, ',');
+                        const size_t len = end ? (size_t)(end - walk) : strlen (walk);
+                        /* the id is always sent, and always printed first */
+                        if (len > 0 && tr_quark_new (walk, len) != TR_KEY_id)
+                        {
+                            listFields = tr_renew (tr_quark, listFields, listFieldCount + 1);
+                            listFields[listFieldCount++] = tr_quark_new (walk, len);
+                        }
+                        walk += len;
+                        if (*walk == ',')
+                            ++walk;
+                    }
+                    break;
+                }
+
+                case 945: /* revision */
+                    listRevision = numarg (optarg);
+                    break;
+
                 case TR_OPT_ERR:
                     fprintf (stderr, "invalid option\n");
                     showUsage ();
@@ -1977,9 +2198,22 @@ processArgs (const char * rpcurl, int argc, const char ** argv)
                           for (i=0; i<n; ++i) tr_variantListAddQuark (fields, details_keys[i]);
                           addIdArg (args, id, NULL);
                           break;
-                case 'l': tr_variantDictAddInt (top, TR_KEY_tag, TAG_LIST);
-                          n = TR_N_ELEMENTS (list_keys);
-                          for (i=0; i<n; ++i) tr_variantListAddQuark (fields, list_keys[i]);
+                case 'l': if (useListFields)
+                          {
+                              /* only ask for what we're going to print */
+                              tr_variantDictAddInt (top, TR_KEY_tag, TAG_LIST_FIELDS);
+                              tr_variantListAddQuark (fields, TR_KEY_id);
+                              for (i=0; i<listFieldCount; ++i) tr_variantListAddQuark (fields, listFields[i]);
+                              if (listRevision >= 0)
+                                  tr_variantDictAddInt (args, TR_KEY_revision, listRevision);
+                          }
+                          else
+                          {
+                              tr_variantDictAddInt (top, TR_KEY_tag, TAG_LIST);
+                              n = TR_N_ELEMENTS (list_keys);
+                              for (i=0; i<n; ++i) tr_variantListAddQuark (fields, list_keys[i]);
+                          }
+                          tr_variantDictAddStr (args, TR_KEY_format, "table");
                           addIdArg (args, id, "all");
                           break;
                 case 940: tr_variantDictAddInt (top, TR_KEY_tag, TAG_FILES);
@@ -11,12 +11,11 @@
   #include <sys/inotify.h>
   #include <sys/select.h>
   #include <unistd.h> /* close */
-#else
-  #include <event2/buffer.h> /* evbuffer */
 #endif
 
 #include <errno.h>
-#include <string.h> /* strlen () */
+#include <stdlib.h> /* bsearch (), qsort () */
+#include <string.h> /* strcmp (), memmove () */
 #include <stdio.h> /* perror () */
 
 #include <libtransmission/transmission.h>
@@ -25,19 +24,166 @@
 #include <libtransmission/utils.h> /* tr_buildPath (), tr_logAddInfo () */
 #include "watch.h"
 
+enum
+{
+    /* hold new files back until the directory's been quiet this long,
+       so that a big copy into it gets picked up in one batch... */
+    QUIET_MSEC = 1000,
+
+    /* ...but don't let a steady trickle hold them back forever */
+    MAX_DELAY_MSEC = 5000,
+
+    /* how many torrents to add per update, so that the daemon
+       stays responsive while it works through a big batch */
+    MAX_ADDS_PER_UPDATE = 100
+};
+
+/* a sorted set of filenames */
+struct name_set
+{
+    char ** names;
+    size_t count;
+    size_t alloc;
+};
+
 struct dtr_watchdir
 {
     tr_session * session;
     char * dir;
     dtr_watchdir_callback * callback;
+
+    /* files we've heard about but haven't added yet */
+    struct name_set pending;
+    uint64_t firstPendingMsec;
+    uint64_t lastEventMsec;
+
 #ifdef WITH_INOTIFY
     int inotify_fd;
 #else /* readdir implementation */
     time_t lastTimeChecked;
-    struct evbuffer * lastFiles;
+    struct name_set lastFiles;
 #endif
 };
 
+/***
+****
+***/
+
+/* returns the index where `name' is or would go */
+static size_t
+name_set_lower_bound (const struct name_set * set, const char * name, bool * found)
+{
+    size_t lo = 0;
+    size_t hi = set->count;
+
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int c = strcmp (set->names[mid], name);
+
+        if (c < 0)
+            lo = mid + 1;
+        else if (c > 0)
+            hi = mid;
+        else
+        {
+            *found = true;
+            return mid;
+        }
+    }
+
+    *found = false;
+    return lo;
+}
+
+static void
+name_set_reserve (struct name_set * set, size_t n)
+{
+    if (set->count + n > set->alloc)
+    {
+        set->alloc = MAX (set->alloc * 2, set->count + n);
+        set->names = tr_renew (char*, set->names, set->alloc);
+    }
+}
+
+/* returns false if `name' was already in the set */
+static bool
+name_set_add (struct name_set * set, const char * name)
+{
+    bool found;
+    const size_t pos = name_set_lower_bound (set, name, &found);
+
+    if (found)
+        return false;
+
+    name_set_reserve (set, 1);
+    memmove (set->names + pos + 1, set->names + pos, sizeof (char*) * (set->count - pos));
+    set->names[pos] = tr_strdup (name);
+    ++set->count;
+    return true;
+}
+
+static void
+name_set_clear (struct name_set * set)
+{
+    size_t i;
+
+    for (i=0; i<set->count; ++i)
+        tr_free (set->names[i]);
+
+    set->count = 0;
+}
+
+static void
+name_set_free (struct name_set * set)
+{
+    name_set_clear (set);
+    tr_free (set->names);
+    memset (set, 0, sizeof (struct name_set));
+}
+
+/***
+****
+***/
+
+static void
+queue_file (dtr_watchdir * w, const char * name)
+{
+    const uint64_t now = tr_time_msec ();
+
+    if (name_set_add (&w->pending, name) && w->pending.count == 1)
+        w->firstPendingMsec = now;
+
+    w->lastEventMsec = now;
+}
+
+static void
+add_pending_files (dtr_watchdir * w)
+{
+    size_t i;
+    size_t n;
+    const uint64_t now = tr_time_msec ();
+
+    if (w->pending.count == 0)
+        return;
+
+    if (now < w->lastEventMsec + QUIET_MSEC && now < w->firstPendingMsec + MAX_DELAY_MSEC)
+        return;
+
+    n = MIN (w->pending.count, (size_t) MAX_ADDS_PER_UPDATE);
+
+    for (i=0; i<n; ++i)
+    {
+        const char * name = w->pending.names[i];
+        tr_logAddInfo ("Found new .torrent file \"%s\" in watchdir \"%s\"", name, w->dir);
+        w->callback (w->session, w->dir, name);
+        tr_free (w->pending.names[i]);
+    }
+
+    w->pending.count -= n;
+    memmove (w->pending.names, w->pending.names + n, sizeof (char*) * w->pending.count);
+}
+
 /***
 ****  INOTIFY IMPLEMENTATION
 ***/
@@ -53,11 +199,28 @@ struct dtr_watchdir
 
 #define DTR_INOTIFY_MASK (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_ONLYDIR)
 
+/* queue every .torrent in the directory, e.g. on startup
+   or after the kernel's event queue overflowed */
+static void
+scan_dir (dtr_watchdir * w)
+{
+    tr_sys_dir_t odir;
+
+    if ((odir = tr_sys_dir_open (w->dir, NULL)) != TR_BAD_SYS_DIR)
+    {
+        const char * name;
+        while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+            if (tr_str_has_suffix (name, ".torrent")) /* skip non-torrents */
+                queue_file (w, name);
+
+        tr_sys_dir_close (odir, NULL);
+    }
+}
+
 static void
 watchdir_new_impl (dtr_watchdir * w)
 {
     int i;
-    tr_sys_dir_t odir;
     w->inotify_fd = inotify_init ();
 
     if (w->inotify_fd < 0)
@@ -74,21 +237,10 @@ watchdir_new_impl (dtr_watchdir * w)
     {
         tr_logAddError ("Unable to watch \"%s\": %s", w->dir, tr_strerror (errno));
     }
-    else if ((odir = tr_sys_dir_open (w->dir, NULL)) != TR_BAD_SYS_DIR)
+    else
     {
-        const char * name;
-        while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
-        {
-            if (!tr_str_has_suffix (name, ".torrent")) /* skip non-torrents */
-                continue;
-
-            tr_logAddInfo ("Found new .torrent file \"%s\" in watchdir \"%s\"", name, w->dir);
-            w->callback (w->session, w->dir, name);
-        }
-
-        tr_sys_dir_close (odir, NULL);
+        scan_dir (w);
     }
-
 }
 static void
 watchdir_free_impl (dtr_watchdir * w)
@@ -103,40 +255,48 @@ watchdir_free_impl (dtr_watchdir * w)
 static void
 watchdir_update_impl (dtr_watchdir * w)
 {
-    int ret;
-    fd_set rfds;
-    struct timeval time;
     const int fd = w->inotify_fd;
 
-    /* timeout after one second */
-    time.tv_sec = 1;
-    time.tv_usec = 0;
-
-    /* make the fd_set hold the inotify fd */
-    FD_ZERO (&rfds);
-    FD_SET (fd, &rfds);
-
-    /* check for added files */
-    ret = select (fd+1, &rfds, NULL, NULL, &time);
-    if (ret < 0) {
-        perror ("select");
-    } else if (!ret) {
-        /* timed out! */
-    } else if (FD_ISSET (fd, &rfds)) {
+    /* read everything that's come in since the last update.
+       this is called from a timer, so don't block waiting for more */
+    while (fd >= 0)
+    {
+        int ret;
         int i = 0;
+        int len;
+        fd_set rfds;
+        struct timeval time;
         char buf[BUF_LEN];
-        int len = read (fd, buf, sizeof (buf));
+
+        time.tv_sec = 0;
+        time.tv_usec = 0;
+
+        /* make the fd_set hold the inotify fd */
+        FD_ZERO (&rfds);
+        FD_SET (fd, &rfds);
+
+        /* check for added files */
+        ret = select (fd+1, &rfds, NULL, NULL, &time);
+        if (ret < 0)
+            perror ("select");
+        if (ret <= 0 || !FD_ISSET (fd, &rfds))
+            break;
+
+        if ((len = read (fd, buf, sizeof (buf))) <= 0)
+            break;
+
         while (i < len) {
             struct inotify_event * event = (struct inotify_event *) &buf[i];
             const char * name = event->name;
-            if (tr_str_has_suffix (name, ".torrent"))
-            {
-                tr_logAddInfo ("Found new .torrent file \"%s\" in watchdir \"%s\"", name, w->dir);
-                w->callback (w->session, w->dir, name);
-            }
+            if (event->mask & IN_Q_OVERFLOW)
+                scan_dir (w);
+            else if (event->len > 0 && tr_str_has_suffix (name, ".torrent"))
+                queue_file (w, name);
             i += EVENT_SIZE +  event->len;
         }
     }
+
+    add_pending_files (w);
 }
 
 #else /* WITH_INOTIFY */
@@ -147,45 +307,21 @@ watchdir_update_impl (dtr_watchdir * w)
 
 #define WATCHDIR_POLL_INTERVAL_SECS 10
 
-#define FILE_DELIMITER '\t'
+static int
+compare_names (const void * va, const void * vb)
+{
+    return strcmp (*(char * const *) va, *(char * const *) vb);
+}
 
 static void
 watchdir_new_impl (dtr_watchdir * w UNUSED)
 {
     tr_logAddInfo ("Using readdir to watch directory \"%s\"", w->dir);
-    w->lastFiles = evbuffer_new ();
 }
 static void
 watchdir_free_impl (dtr_watchdir * w)
 {
-    evbuffer_free (w->lastFiles);
-}
-
-static char*
-get_key_from_file (const char * filename, const size_t len)
-{
-    return tr_strdup_printf ("%c%*.*s%d", FILE_DELIMITER, (int)len, (int)len, filename, FILE_DELIMITER);
-}
-
-static void
-add_file_to_list (struct evbuffer * buf, const char * filename, size_t len)
-{
-    char * key = get_key_from_file (filename, len);
-    evbuffer_add (buf, key, strlen (key));
-    tr_free (key);
-}
-static bool
-is_file_in_list (struct evbuffer * buf, const char * filename, size_t len)
-{
-    bool in_list;
-    struct evbuffer_ptr ptr;
-    char * key = get_key_from_file (filename, len);
-
-    ptr = evbuffer_search (buf, key, strlen (key), NULL);
-    in_list = ptr.pos != -1;
-
-    tr_free (key);
-    return in_list;
+    name_set_free (&w->lastFiles);
 }
 static void
 watchdir_update_impl (dtr_watchdir * w)
@@ -194,38 +330,46 @@ watchdir_update_impl (dtr_watchdir * w)
     tr_sys_dir_t odir;
     const time_t oldTime = w->lastTimeChecked;
     const char * dirname = w->dir;
-    struct evbuffer * curFiles = evbuffer_new ();
 
     if (oldTime + WATCHDIR_POLL_INTERVAL_SECS < time (NULL) &&
         tr_sys_path_get_info (dirname, 0, &info, NULL) &&
         info.type == TR_SYS_PATH_IS_DIRECTORY &&
         (odir = tr_sys_dir_open (dirname, NULL)) != TR_BAD_SYS_DIR)
     {
+        size_t i;
         const char * name;
+        struct name_set curFiles = { NULL, 0, 0 };
+
         while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
         {
-            size_t len;
-
             if (*name == '.') /* skip dotfiles */
                 continue;
             if (!tr_str_has_suffix (name, ".torrent")) /* skip non-torrents */
                 continue;
 
-            len = strlen (name);
-            add_file_to_list (curFiles, name, len);
-
-            /* if this file wasn't here last time, try adding it */
-            if (!is_file_in_list (w->lastFiles, name, len)) {
-                tr_logAddInfo ("Found new .torrent file \"%s\" in watchdir \"%s\"", name, w->dir);
-                w->callback (w->session, w->dir, name);
-            }
+            name_set_reserve (&curFiles, 1);
+            curFiles.names[curFiles.count++] = tr_strdup (name);
         }
 
         tr_sys_dir_close (odir, NULL);
+
+        /* sort once, rather than keeping the set sorted while it's built */
+        if (curFiles.count > 1)
+            qsort (curFiles.names, curFiles.count, sizeof (char*), compare_names);
+
+        /* if a file wasn't here last time, try adding it */
+        for (i=0; i<curFiles.count; ++i)
+            if (w->lastFiles.count == 0 ||
+                bsearch (&curFiles.names[i], w->lastFiles.names, w->lastFiles.count,
+                         sizeof (char*), compare_names) == NULL)
+                queue_file (w, curFiles.names[i]);
+
         w->lastTimeChecked = time (NULL);
-        evbuffer_free (w->lastFiles);
+        name_set_free (&w->lastFiles);
         w->lastFiles = curFiles;
     }
+
+    add_pending_files (w);
 }
 
 #endif
@@ -261,6 +405,7 @@ dtr_watchdir_free (dtr_watchdir * w)
     if (w != NULL)
     {
         watchdir_free_impl (w);
+        name_set_free (&w->pending);
         tr_free (w->dir);
         tr_free (w);
     }
@@ -47,7 +47,8 @@ static GtkRadioActionEntry sort_radio_entries[] =
     { "sort-by-state",     NULL, N_("Sort by Stat_e"),     NULL, NULL, 5 },
     { "sort-by-age",       NULL, N_("Sort by A_ge"),       NULL, NULL, 6 },
     { "sort-by-time-left", NULL, N_("Sort by Time _Left"), NULL, NULL, 7 },
-    { "sort-by-size",      NULL, N_("Sort by Si_ze"),      NULL, NULL, 8 }
+    { "sort-by-size",      NULL, N_("Sort by Si_ze"),      NULL, NULL, 8 },
+    { "sort-by-cpu-time",  NULL, N_("Sort by _CPU Time"),  NULL, NULL, 9 }
 };
 
 static void
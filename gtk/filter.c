@@ -21,6 +21,7 @@
 #include "tr-core.h" /* MC_TORRENT */
 #include "util.h" /* gtr_get_host_from_url () */
 
+static GQuark COUNTS_KEY = 0;
 static GQuark DIRTY_KEY = 0;
 static GQuark SESSION_KEY = 0;
 static GQuark TEXT_KEY = 0;
@@ -74,6 +75,153 @@ get_name_from_host (const char * host)
   return name;
 }
 
+/* the ids of all the torrents in the torrent model */
+static GHashTable *
+get_torrent_ids (GtkTreeModel * tmodel)
+{
+  GtkTreeIter iter;
+  GHashTable * ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  if (gtk_tree_model_iter_nth_child (tmodel, &iter, NULL, 0)) do
+    {
+      int id;
+      gtk_tree_model_get (tmodel, &iter, MC_TORRENT_ID, &id, -1);
+      g_hash_table_add (ids, GINT_TO_POINTER (id));
+    }
+  while (gtk_tree_model_iter_next (tmodel, &iter));
+
+  return ids;
+}
+
+/* The tracker counts are kept up to date as each torrent's row changes,
+ * so refreshing the combobox doesn't mean walking every torrent's
+ * trackers and parsing their announce URLs again. */
+struct tracker_torrent
+{
+  /* the trackers list is replaced, not edited in place, when it
+     changes, so the hosts only need finding again when this moves */
+  const tr_tracker_info * trackers;
+  unsigned int trackerCount;
+
+  char ** hosts; /* NULL-terminated, without duplicates */
+};
+
+struct tracker_counts
+{
+  GHashTable * torrents; /* torrent id -> struct tracker_torrent */
+  GHashTable * hosts;    /* host -> how many torrents use it */
+  gboolean rows_deleted;
+};
+
+static void
+tracker_torrent_free (gpointer vt)
+{
+  struct tracker_torrent * t = vt;
+  g_strfreev (t->hosts);
+  g_free (t);
+}
+
+static void
+tracker_counts_free (gpointer vcounts)
+{
+  struct tracker_counts * counts = vcounts;
+  g_hash_table_destroy (counts->torrents);
+  g_hash_table_destroy (counts->hosts);
+  g_free (counts);
+}
+
+static struct tracker_counts *
+tracker_counts_new (void)
+{
+  struct tracker_counts * counts = g_new0 (struct tracker_counts, 1);
+  counts->torrents = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, tracker_torrent_free);
+  counts->hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  return counts;
+}
+
+static void
+tracker_counts_add (struct tracker_counts * counts, char ** hosts, int delta)
+{
+  for (; hosts && *hosts; ++hosts)
+    {
+      const int n = GPOINTER_TO_INT (g_hash_table_lookup (counts->hosts, *hosts)) + delta;
+
+      if (n > 0)
+        g_hash_table_replace (counts->hosts, g_strdup (*hosts), GINT_TO_POINTER (n));
+      else
+        g_hash_table_remove (counts->hosts, *hosts);
+    }
+}
+
+/* returns TRUE if the torrent's hosts changed */
+static gboolean
+tracker_counts_update_torrent (struct tracker_counts * counts, tr_torrent * tor, int id)
+{
+  unsigned int i;
+  GPtrArray * hosts;
+  const tr_info * inf = tr_torrentInfo (tor);
+  struct tracker_torrent * t = g_hash_table_lookup (counts->torrents, GINT_TO_POINTER (id));
+
+  if (t == NULL)
+    {
+      t = g_new0 (struct tracker_torrent, 1);
+      g_hash_table_insert (counts->torrents, GINT_TO_POINTER (id), t);
+    }
+  else if (t->trackers == inf->trackers && t->trackerCount == inf->trackerCount)
+    {
+      return FALSE;
+    }
+
+  hosts = g_ptr_array_new ();
+  for (i=0; i<inf->trackerCount; ++i)
+    {
+      unsigned int k;
+      char buf[1024];
+
+      gtr_get_host_from_url (buf, sizeof (buf), inf->trackers[i].announce);
+
+      for (k=0; k<hosts->len; ++k)
+        if (!g_strcmp0 (hosts->pdata[k], buf))
+          break;
+
+      if (k == hosts->len)
+        g_ptr_array_add (hosts, g_strdup (buf));
+    }
+  g_ptr_array_add (hosts, NULL);
+
+  tracker_counts_add (counts, t->hosts, -1);
+  g_strfreev (t->hosts);
+  t->hosts = (char**) g_ptr_array_free (hosts, FALSE);
+  t->trackers = inf->trackers;
+  t->trackerCount = inf->trackerCount;
+  tracker_counts_add (counts, t->hosts, 1);
+  return TRUE;
+}
+
+/* forget the torrents that have been removed from the torrent model */
+static void
+tracker_counts_prune (struct tracker_counts * counts, GtkTreeModel * tmodel)
+{
+  gpointer key;
+  gpointer value;
+  GHashTableIter iter;
+  GHashTable * ids = get_torrent_ids (tmodel);
+
+  g_hash_table_iter_init (&iter, counts->torrents);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (!g_hash_table_contains (ids, key))
+        {
+          struct tracker_torrent * t = value;
+          tracker_counts_add (counts, t->hosts, -1);
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  g_hash_table_destroy (ids);
+  counts->rows_deleted = FALSE;
+}
+
 static void
 tracker_model_update_count (GtkTreeStore * store, GtkTreeIter * iter, int n)
 {
@@ -112,76 +260,37 @@ static gboolean
 tracker_filter_model_update (gpointer gstore)
 {
   int i, n;
-  int all = 0;
+  int all;
   int store_pos;
   GtkTreeIter iter;
   GObject * o = G_OBJECT (gstore);
   GtkTreeStore * store = GTK_TREE_STORE (gstore);
   GtkTreeModel * model = GTK_TREE_MODEL (gstore);
   GPtrArray * hosts = g_ptr_array_new ();
-  GStringChunk * strings = g_string_chunk_new (4096);
-  GHashTable * hosts_hash = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
   GtkTreeModel * tmodel = GTK_TREE_MODEL (g_object_get_qdata (o, TORRENT_MODEL_KEY));
+  struct tracker_counts * counts = g_object_get_qdata (o, COUNTS_KEY);
+  GHashTable * hosts_hash = counts->hosts;
   const int first_tracker_pos = 2; /* offset past the "All" and the separator */
 
   g_object_steal_qdata (o, DIRTY_KEY);
 
-  /* Walk through all the torrents, tallying how many matches there are
-   * for the various categories. Also make a sorted list of all tracker
-   * hosts s.t. we can merge it with the existing list */
-  if (gtk_tree_model_iter_nth_child (tmodel, &iter, NULL, 0)) do
-    {
-      tr_torrent * tor;
-      const tr_info * inf;
-      int keyCount;
-      char ** keys;
-
-      gtk_tree_model_get (tmodel, &iter, MC_TORRENT, &tor, -1);
-      inf = tr_torrentInfo (tor);
-      keyCount = 0;
-      keys = g_new (char*, inf->trackerCount);
+  if (counts->rows_deleted)
+    tracker_counts_prune (counts, tmodel);
 
-      for (i=0, n=inf->trackerCount; i<n; ++i)
-        {
-          int k;
-          int * count;
-          char buf[1024];
-          char * key;
-
-          gtr_get_host_from_url (buf, sizeof (buf), inf->trackers[i].announce);
-          key = g_string_chunk_insert_const (strings, buf);
-
-          count = g_hash_table_lookup (hosts_hash, key);
-          if (count == NULL)
-            {
-              count = tr_new0 (int, 1);
-              g_hash_table_insert (hosts_hash, key, count);
-              g_ptr_array_add (hosts, key);
-            }
-
-          for (k=0; k<keyCount; ++k)
-            if (!g_strcmp0 (keys[k], key))
-              break;
-
-          if (k==keyCount)
-            keys[keyCount++] = key;
-        }
-
-      for (i=0; i<keyCount; ++i)
-        {
-          int * incrementme = g_hash_table_lookup (hosts_hash, keys[i]);
-          ++*incrementme;
-        }
-
-      g_free (keys);
-
-      ++all;
-    }
-  while (gtk_tree_model_iter_next (tmodel, &iter));
+  /* make a sorted list of all tracker hosts
+   * s.t. we can merge it with the existing list */
+  {
+    gpointer key;
+    GHashTableIter hiter;
+    g_hash_table_iter_init (&hiter, hosts_hash);
+    while (g_hash_table_iter_next (&hiter, &key, NULL))
+      g_ptr_array_add (hosts, key);
+  }
 
   qsort (hosts->pdata, hosts->len, sizeof (char*), pstrcmp);
 
   /* update the "all" count */
+  all = gtk_tree_model_iter_n_children (tmodel, NULL);
   gtk_tree_model_iter_children (model, &iter, NULL);
   tracker_model_update_count (store, &iter, all);
 
@@ -235,7 +344,7 @@ tracker_filter_model_update (gpointer gstore)
           tr_session * session = g_object_get_qdata (G_OBJECT (store), SESSION_KEY);
           const char * host = hosts->pdata[i];
           char * name = get_name_from_host (host);
-          const int count = * (int*)g_hash_table_lookup (hosts_hash, host);
+          const int count = GPOINTER_TO_INT (g_hash_table_lookup (hosts_hash, host));
           gtk_tree_store_insert_with_values (store, &add, NULL, store_pos,
                                              TRACKER_FILTER_COL_HOST, host,
                                              TRACKER_FILTER_COL_NAME, name,
@@ -253,7 +362,7 @@ tracker_filter_model_update (gpointer gstore)
       else /* update row */
         {
           const char * host = hosts->pdata[i];
-          const int count = * (int*)g_hash_table_lookup (hosts_hash, host);
+          const int count = GPOINTER_TO_INT (g_hash_table_lookup (hosts_hash, host));
           tracker_model_update_count (store, &iter, count);
           ++store_pos;
           ++i;
@@ -262,14 +371,14 @@ tracker_filter_model_update (gpointer gstore)
 
   /* cleanup */
   g_ptr_array_free (hosts, TRUE);
-  g_hash_table_unref (hosts_hash);
-  g_string_chunk_free (strings);
   return G_SOURCE_REMOVE;
 }
 
 static GtkTreeModel *
 tracker_filter_model_new (GtkTreeModel * tmodel)
 {
+  GtkTreeIter iter;
+  struct tracker_counts * counts = tracker_counts_new ();
   GtkTreeStore * store = gtk_tree_store_new (TRACKER_FILTER_N_COLS,
                                              G_TYPE_STRING,
                                              G_TYPE_INT,
@@ -285,7 +394,17 @@ tracker_filter_model_new (GtkTreeModel * tmodel)
                                      TRACKER_FILTER_COL_TYPE, TRACKER_FILTER_TYPE_SEPARATOR,
                                      -1);
 
+  if (gtk_tree_model_iter_nth_child (tmodel, &iter, NULL, 0)) do
+    {
+      int id;
+      tr_torrent * tor;
+      gtk_tree_model_get (tmodel, &iter, MC_TORRENT, &tor, MC_TORRENT_ID, &id, -1);
+      tracker_counts_update_torrent (counts, tor, id);
+    }
+  while (gtk_tree_model_iter_next (tmodel, &iter));
+
   g_object_set_qdata (G_OBJECT (store), TORRENT_MODEL_KEY, tmodel);
+  g_object_set_qdata_full (G_OBJECT (store), COUNTS_KEY, counts, tracker_counts_free);
   tracker_filter_model_update (store);
   return GTK_TREE_MODEL (store);
 }
@@ -312,11 +431,29 @@ tracker_model_update_idle (gpointer tracker_model)
 }
 
 static void
-torrent_model_row_changed (GtkTreeModel  * tmodel UNUSED,
+torrent_model_row_changed (GtkTreeModel  * tmodel,
                            GtkTreePath   * path UNUSED,
-                           GtkTreeIter   * iter UNUSED,
+                           GtkTreeIter   * iter,
                            gpointer        tracker_model)
 {
+  int id;
+  tr_torrent * tor;
+  struct tracker_counts * counts = g_object_get_qdata (G_OBJECT (tracker_model), COUNTS_KEY);
+
+  gtk_tree_model_get (tmodel, iter, MC_TORRENT, &tor, MC_TORRENT_ID, &id, -1);
+
+  if (tor != NULL && tracker_counts_update_torrent (counts, tor, id))
+    tracker_model_update_idle (tracker_model);
+}
+
+static void
+torrent_model_row_inserted (GtkTreeModel  * tmodel,
+                            GtkTreePath   * path,
+                            GtkTreeIter   * iter,
+                            gpointer        tracker_model)
+{
+  /* the "All" count has changed even if no hosts have */
+  torrent_model_row_changed (tmodel, path, iter, tracker_model);
   tracker_model_update_idle (tracker_model);
 }
 
@@ -325,6 +462,11 @@ torrent_model_row_deleted_cb (GtkTreeModel * tmodel UNUSED,
                               GtkTreePath  * path UNUSED,
                               gpointer       tracker_model)
 {
+  struct tracker_counts * counts = g_object_get_qdata (G_OBJECT (tracker_model), COUNTS_KEY);
+
+  /* the row's gone, so we can't tell which torrent it was until
+     the update compares the torrents that are left */
+  counts->rows_deleted = TRUE;
   tracker_model_update_idle (tracker_model);
 }
 
@@ -382,6 +524,7 @@ static void
 disconnect_cat_model_callbacks (gpointer tmodel, GObject * cat_model)
 {
   g_signal_handlers_disconnect_by_func (tmodel, torrent_model_row_changed, cat_model);
+  g_signal_handlers_disconnect_by_func (tmodel, torrent_model_row_inserted, cat_model);
   g_signal_handlers_disconnect_by_func (tmodel, torrent_model_row_deleted_cb, cat_model);
 }
 
@@ -424,7 +567,7 @@ tracker_combo_box_new (GtkTreeModel * tmodel)
 
   g_object_weak_ref (G_OBJECT (cat_model), disconnect_cat_model_callbacks, tmodel);
   g_signal_connect (tmodel, "row-changed", G_CALLBACK (torrent_model_row_changed), cat_model);
-  g_signal_connect (tmodel, "row-inserted", G_CALLBACK (torrent_model_row_changed), cat_model);
+  g_signal_connect (tmodel, "row-inserted", G_CALLBACK (torrent_model_row_inserted), cat_model);
   g_signal_connect (tmodel, "row-deleted", G_CALLBACK (torrent_model_row_deleted_cb), cat_model);
 
   return c;
@@ -539,6 +682,79 @@ status_model_update_count (GtkListStore * store, GtkTreeIter * iter, int n)
     gtk_list_store_set (store, iter, ACTIVITY_FILTER_COL_COUNT, n, -1);
 }
 
+/* Like the tracker counts, these are kept up to date as each
+ * torrent's row changes instead of testing every torrent again */
+struct activity_counts
+{
+  GHashTable * torrents; /* torrent id -> bitmask of the types it matches */
+  int hits[ACTIVITY_FILTER_SEPARATOR];
+  gboolean rows_deleted;
+};
+
+static void
+activity_counts_free (gpointer vcounts)
+{
+  struct activity_counts * counts = vcounts;
+  g_hash_table_destroy (counts->torrents);
+  g_free (counts);
+}
+
+static void
+activity_counts_add (struct activity_counts * counts, int types, int delta)
+{
+  int type;
+
+  for (type=0; type<ACTIVITY_FILTER_SEPARATOR; ++type)
+    if (types & (1 << type))
+      counts->hits[type] += delta;
+}
+
+/* returns TRUE if the torrent now matches different types */
+static gboolean
+activity_counts_update_torrent (struct activity_counts * counts, tr_torrent * tor, int id)
+{
+  int type;
+  int types = 0;
+  gpointer old;
+  const gboolean found = g_hash_table_lookup_extended (counts->torrents, GINT_TO_POINTER (id), NULL, &old);
+
+  for (type=0; type<ACTIVITY_FILTER_SEPARATOR; ++type)
+    if (test_torrent_activity (tor, type))
+      types |= (1 << type);
+
+  if (found && GPOINTER_TO_INT (old) == types)
+    return FALSE;
+
+  if (found)
+    activity_counts_add (counts, GPOINTER_TO_INT (old), -1);
+  activity_counts_add (counts, types, 1);
+  g_hash_table_insert (counts->torrents, GINT_TO_POINTER (id), GINT_TO_POINTER (types));
+  return TRUE;
+}
+
+/* forget the torrents that have been removed from the torrent model */
+static void
+activity_counts_prune (struct activity_counts * counts, GtkTreeModel * tmodel)
+{
+  gpointer key;
+  gpointer value;
+  GHashTableIter iter;
+  GHashTable * ids = get_torrent_ids (tmodel);
+
+  g_hash_table_iter_init (&iter, counts->torrents);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      if (!g_hash_table_contains (ids, key))
+        {
+          activity_counts_add (counts, GPOINTER_TO_INT (value), -1);
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+
+  g_hash_table_destroy (ids);
+  counts->rows_deleted = FALSE;
+}
+
 static gboolean
 activity_filter_model_update (gpointer gstore)
 {
@@ -547,28 +763,21 @@ activity_filter_model_update (gpointer gstore)
   GtkListStore * store = GTK_LIST_STORE (gstore);
   GtkTreeModel * model = GTK_TREE_MODEL (store);
   GtkTreeModel * tmodel = GTK_TREE_MODEL (g_object_get_qdata (o, TORRENT_MODEL_KEY));
+  struct activity_counts * counts = g_object_get_qdata (o, COUNTS_KEY);
 
   g_object_steal_qdata (o, DIRTY_KEY);
 
+  if (counts->rows_deleted)
+    activity_counts_prune (counts, tmodel);
+
   if (gtk_tree_model_iter_nth_child (model, &iter, NULL, 0)) do
     {
-      int hits;
       int type;
-      GtkTreeIter torrent_iter;
 
       gtk_tree_model_get (model, &iter, ACTIVITY_FILTER_COL_TYPE, &type, -1);
 
-      hits = 0;
-      if (gtk_tree_model_iter_nth_child (tmodel, &torrent_iter, NULL, 0)) do
-        {
-          tr_torrent * tor;
-          gtk_tree_model_get (tmodel, &torrent_iter, MC_TORRENT, &tor, -1);
-          if (test_torrent_activity (tor, type))
-            ++hits;
-        }
-      while (gtk_tree_model_iter_next (tmodel, &torrent_iter));
-
-      status_model_update_count (store, &iter, hits);
+      if (type != ACTIVITY_FILTER_SEPARATOR)
+        status_model_update_count (store, &iter, counts->hits[type]);
     }
   while (gtk_tree_model_iter_next (model, &iter));
 
@@ -579,6 +788,8 @@ static GtkTreeModel *
 activity_filter_model_new (GtkTreeModel * tmodel)
 {
   int i, n;
+  GtkTreeIter iter;
+  struct activity_counts * counts;
   struct {
     int type;
     const char * context;
@@ -612,7 +823,19 @@ activity_filter_model_new (GtkTreeModel * tmodel)
                                          -1);
     }
 
+  counts = g_new0 (struct activity_counts, 1);
+  counts->torrents = g_hash_table_new (g_direct_hash, g_direct_equal);
+  if (gtk_tree_model_iter_nth_child (tmodel, &iter, NULL, 0)) do
+    {
+      int id;
+      tr_torrent * tor;
+      gtk_tree_model_get (tmodel, &iter, MC_TORRENT, &tor, MC_TORRENT_ID, &id, -1);
+      activity_counts_update_torrent (counts, tor, id);
+    }
+  while (gtk_tree_model_iter_next (tmodel, &iter));
+
   g_object_set_qdata (G_OBJECT (store), TORRENT_MODEL_KEY, tmodel);
+  g_object_set_qdata_full (G_OBJECT (store), COUNTS_KEY, counts, activity_counts_free);
   activity_filter_model_update (store);
   return GTK_TREE_MODEL (store);
 }
@@ -651,12 +874,19 @@ activity_model_update_idle (gpointer activity_model)
 }
 
 static void
-activity_torrent_model_row_changed (GtkTreeModel  * tmodel UNUSED,
+activity_torrent_model_row_changed (GtkTreeModel  * tmodel,
                                     GtkTreePath   * path UNUSED,
-                                    GtkTreeIter   * iter UNUSED,
+                                    GtkTreeIter   * iter,
                                     gpointer        activity_model)
 {
-  activity_model_update_idle (activity_model);
+  int id;
+  tr_torrent * tor;
+  struct activity_counts * counts = g_object_get_qdata (G_OBJECT (activity_model), COUNTS_KEY);
+
+  gtk_tree_model_get (tmodel, iter, MC_TORRENT, &tor, MC_TORRENT_ID, &id, -1);
+
+  if (tor != NULL && activity_counts_update_torrent (counts, tor, id))
+    activity_model_update_idle (activity_model);
 }
 
 static void
@@ -664,6 +894,9 @@ activity_torrent_model_row_deleted_cb (GtkTreeModel  * tmodel UNUSED,
                                        GtkTreePath   * path UNUSED,
                                        gpointer        activity_model)
 {
+  struct activity_counts * counts = g_object_get_qdata (G_OBJECT (activity_model), COUNTS_KEY);
+
+  counts->rows_deleted = TRUE;
   activity_model_update_idle (activity_model);
 }
 
@@ -947,6 +1180,7 @@ gtr_filter_bar_new (tr_session * session, GtkTreeModel * tmodel, GtkTreeModel **
   g_assert (DIRTY_KEY == 0);
   TEXT_KEY = g_quark_from_static_string ("tr-filter-text-key");
   DIRTY_KEY = g_quark_from_static_string ("tr-filter-dirty-key");
+  COUNTS_KEY = g_quark_from_static_string ("tr-filter-counts-key");
   SESSION_KEY = g_quark_from_static_string ("tr-session-key");
   TORRENT_MODEL_KEY = g_quark_from_static_string ("tr-filter-torrent-model-key");
 
@@ -29,8 +29,6 @@
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 
-#include <event2/buffer.h>
-
 #include <libtransmission/transmission.h>
 #include <libtransmission/log.h>
 #include <libtransmission/rpcimpl.h>
@@ -82,6 +80,12 @@ struct TrCorePrivate
   GtkTreeModel * sorted_model;
   tr_session   * session;
   GStringChunk * string_chunk;
+
+  /* torrent id -> struct core_row_state */
+  GHashTable   * row_states;
+
+  /* for tr_sessionGetTorrentStats () */
+  uint64_t       stat_generation;
 };
 
 static int
@@ -113,6 +117,7 @@ core_finalize (GObject * o)
   TrCore * core = TR_CORE (o);
 
   g_string_chunk_free (core->priv->string_chunk);
+  g_hash_table_destroy (core->priv->row_states);
 
   G_OBJECT_CLASS (tr_core_parent_class)->finalize (o);
 }
@@ -220,6 +225,7 @@ tr_core_init (TrCore * core)
   p->raw_model = GTK_TREE_MODEL (store);
   p->sorted_model = gtk_tree_model_sort_new_with_model (p->raw_model);
   p->string_chunk = g_string_chunk_new (2048);
+  p->row_states = g_hash_table_new_full (NULL, NULL, NULL, g_free);
   g_object_unref (p->raw_model);
 }
 
@@ -542,6 +548,28 @@ compare_by_size (GtkTreeModel * m,
   return ret;
 }
 
+static int
+compare_by_cpu_time (GtkTreeModel * m,
+                     GtkTreeIter  * a,
+                     GtkTreeIter  * b,
+                     gpointer       u)
+{
+  int ret = 0;
+  tr_torrent *ta, *tb;
+
+  gtk_tree_model_get (m, a, MC_TORRENT, &ta, -1);
+  gtk_tree_model_get (m, b, MC_TORRENT, &tb, -1);
+
+  if (!ret)
+    ret = compare_uint64 (tr_torrentStatCached (ta)->cpuTimeMsec,
+                          tr_torrentStatCached (tb)->cpuTimeMsec);
+
+  if (!ret)
+    ret = compare_by_name (m, a, b, u);
+
+  return ret;
+}
+
 static int
 compare_by_progress (GtkTreeModel * m,
                      GtkTreeIter  * a,
@@ -634,6 +662,8 @@ core_set_sort_mode (TrCore * core, const char * mode, gboolean is_reversed)
     sort_func = compare_by_state;
   else if (!g_strcmp0 (mode, "sort-by-size"))
     sort_func = compare_by_size;
+  else if (!g_strcmp0 (mode, "sort-by-cpu-time"))
+    sort_func = compare_by_cpu_time;
   else {
     sort_func = compare_by_name;
     type = is_reversed ? GTK_SORT_DESCENDING : GTK_SORT_ASCENDING;
@@ -1368,9 +1398,14 @@ gtr_core_remove_torrent (TrCore * core, int id, gboolean delete_local_data)
       GtkTreeModel * model = core_raw_model (core);
       if (find_row_from_torrent_id (model, id, &iter))
         gtk_list_store_remove (GTK_LIST_STORE (model), &iter);
+      g_hash_table_remove (core->priv->row_states, GINT_TO_POINTER (id));
 
       /* remove the torrent */
-      tr_torrentRemove (tor, delete_local_data, gtr_file_trash_or_remove);
+      /* the files are removed from a libtransmission worker thread,
+         which mustn't look at the prefs, so decide about the trash now */
+      tr_torrentRemove (tor, delete_local_data,
+                        gtr_pref_flag_get (TR_KEY_trash_can_enabled) ? gtr_file_trash
+                                                                     : gtr_file_remove);
     }
 }
 
@@ -1400,6 +1435,7 @@ void
 gtr_core_clear (TrCore * self)
 {
   gtk_list_store_clear (GTK_LIST_STORE (core_raw_model (self)));
+  g_hash_table_remove_all (self->priv->row_states);
 }
 
 /***
@@ -1423,105 +1459,160 @@ gtr_compare_double (const double a, const double b, int decimal_places)
   return ret;
 }
 
+/* The values update_foreach () last pushed into a row. Comparing against
+ * these is much cheaper than reading a dozen columns back out of the
+ * model as GValues, which had made each refresh cost as much for an
+ * idle torrent as for a busy one. */
+struct core_row_state
+{
+  gboolean isSet;
+  gboolean active;
+  int activity;
+  int activePeerCount;
+  int downloadPeerCount;
+  int uploadPeerCount;
+  int error;
+  bool finished;
+  int queuePosition;
+  tr_priority_t priority;
+  double upSpeed;
+  double downSpeed;
+  double recheckProgress;
+
+  /* the trackers list is replaced, not edited in place, when it
+     changes, so the hash only needs rebuilding when this moves */
+  const tr_tracker_info * trackers;
+  unsigned int trackerCount;
+  unsigned int trackersHash;
+};
+
+/* `changed' maps the ids of torrents whose stats have changed to the new stats */
 static void
-update_foreach (GtkTreeModel * model, GtkTreeIter * iter)
-{
-  int oldActivity, newActivity;
-  int oldActivePeerCount, newActivePeerCount;
-  int oldError, newError;
-  bool oldFinished, newFinished;
-  int oldQueuePosition, newQueuePosition;
-  int oldDownloadPeerCount, newDownloadPeerCount;
-  int oldUploadPeerCount, newUploadPeerCount;
-  tr_priority_t oldPriority, newPriority;
-  unsigned int oldTrackers, newTrackers;
-  double oldUpSpeed, newUpSpeed;
-  double oldDownSpeed, newDownSpeed;
-  double oldRecheckProgress, newRecheckProgress;
-  gboolean oldActive, newActive;
+update_foreach (TrCore * core, GtkTreeModel * model, GtkTreeIter * iter, GHashTable * changed)
+{
+  struct core_row_state n;
+  struct core_row_state * o;
+  const tr_info * inf;
   const tr_stat * st;
   tr_torrent * tor;
+  int id;
+
+  gtk_tree_model_get (model, iter, MC_TORRENT, &tor, MC_TORRENT_ID, &id, -1);
+
+  o = g_hash_table_lookup (core->priv->row_states, GINT_TO_POINTER (id));
+  if (o == NULL)
+    {
+      o = g_new0 (struct core_row_state, 1);
+      g_hash_table_insert (core->priv->row_states, GINT_TO_POINTER (id), o);
+    }
 
-  /* get the old states */
-  gtk_tree_model_get (model, iter,
-                      MC_TORRENT,  &tor,
-                      MC_ACTIVE, &oldActive,
-                      MC_ACTIVE_PEER_COUNT, &oldActivePeerCount,
-                      MC_ACTIVE_PEERS_UP, &oldUploadPeerCount,
-                      MC_ACTIVE_PEERS_DOWN, &oldDownloadPeerCount,
-                      MC_ERROR, &oldError,
-                      MC_ACTIVITY, &oldActivity,
-                      MC_FINISHED, &oldFinished,
-                      MC_PRIORITY, &oldPriority,
-                      MC_QUEUE_POSITION, &oldQueuePosition,
-                      MC_TRACKERS, &oldTrackers,
-                      MC_SPEED_UP, &oldUpSpeed,
-                      MC_RECHECK_PROGRESS, &oldRecheckProgress,
-                      MC_SPEED_DOWN, &oldDownSpeed,
-                      -1);
+  /* rows whose torrents haven't changed can be skipped */
+  inf = tr_torrentInfo (tor);
+  st = g_hash_table_lookup (changed, GINT_TO_POINTER (id));
+  if (st == NULL && o->isSet
+                 && (o->priority == tr_torrentGetPriority (tor))
+                 && (o->trackers == inf->trackers)
+                 && (o->trackerCount == inf->trackerCount))
+    return;
+  if (st == NULL)
+    st = tr_torrentStatCached (tor);
 
   /* get the new states */
-  st = tr_torrentStat (tor);
-  newActive = is_torrent_active (st);
-  newActivity = st->activity;
-  newFinished = st->finished;
-  newPriority = tr_torrentGetPriority (tor);
-  newQueuePosition = st->queuePosition;
-  newTrackers = build_torrent_trackers_hash (tor);
-  newUpSpeed = st->pieceUploadSpeed_KBps;
-  newDownSpeed = st->pieceDownloadSpeed_KBps;
-  newRecheckProgress = st->recheckProgress;
-  newActivePeerCount = st->peersSendingToUs + st->peersGettingFromUs + st->webseedsSendingToUs;
-  newDownloadPeerCount = st->peersSendingToUs;
-  newUploadPeerCount = st->peersGettingFromUs + st->webseedsSendingToUs;
-  newError = st->error;
+  n.isSet = TRUE;
+  n.active = is_torrent_active (st);
+  n.activity = st->activity;
+  n.finished = st->finished;
+  n.priority = tr_torrentGetPriority (tor);
+  n.queuePosition = st->queuePosition;
+  n.upSpeed = st->pieceUploadSpeed_KBps;
+  n.downSpeed = st->pieceDownloadSpeed_KBps;
+  n.recheckProgress = st->recheckProgress;
+  n.activePeerCount = st->peersSendingToUs + st->peersGettingFromUs + st->webseedsSendingToUs;
+  n.downloadPeerCount = st->peersSendingToUs;
+  n.uploadPeerCount = st->peersGettingFromUs + st->webseedsSendingToUs;
+  n.error = st->error;
+  n.trackers = inf->trackers;
+  n.trackerCount = inf->trackerCount;
+  if (o->isSet && (o->trackers == n.trackers) && (o->trackerCount == n.trackerCount))
+    n.trackersHash = o->trackersHash;
+  else
+    n.trackersHash = build_torrent_trackers_hash (tor);
 
   /* updating the model triggers off resort/refresh,
      so don't do it unless something's actually changed... */
-  if ((newActive != oldActive)
-        || (newActivity  != oldActivity)
-        || (newFinished != oldFinished)
-        || (newPriority != oldPriority)
-        || (newQueuePosition != oldQueuePosition)
-        || (newError != oldError)
-        || (newActivePeerCount != oldActivePeerCount)
-        || (newDownloadPeerCount != oldDownloadPeerCount)
-        || (newUploadPeerCount != oldUploadPeerCount)
-        || (newTrackers != oldTrackers)
-        || gtr_compare_double (newUpSpeed, oldUpSpeed, 2)
-        || gtr_compare_double (newDownSpeed, oldDownSpeed, 2)
-        || gtr_compare_double (newRecheckProgress, oldRecheckProgress, 2))
+  if (!o->isSet
+        || (n.active != o->active)
+        || (n.activity  != o->activity)
+        || (n.finished != o->finished)
+        || (n.priority != o->priority)
+        || (n.queuePosition != o->queuePosition)
+        || (n.error != o->error)
+        || (n.activePeerCount != o->activePeerCount)
+        || (n.downloadPeerCount != o->downloadPeerCount)
+        || (n.uploadPeerCount != o->uploadPeerCount)
+        || (n.trackersHash != o->trackersHash)
+        || gtr_compare_double (n.upSpeed, o->upSpeed, 2)
+        || gtr_compare_double (n.downSpeed, o->downSpeed, 2)
+        || gtr_compare_double (n.recheckProgress, o->recheckProgress, 2))
     {
       gtk_list_store_set (GTK_LIST_STORE (model), iter,
-                          MC_ACTIVE, newActive,
-                          MC_ACTIVE_PEER_COUNT, newActivePeerCount,
-                          MC_ACTIVE_PEERS_UP, newUploadPeerCount,
-                          MC_ACTIVE_PEERS_DOWN, newDownloadPeerCount,
-                          MC_ERROR, newError,
-                          MC_ACTIVITY, newActivity,
-                          MC_FINISHED, newFinished,
-                          MC_PRIORITY, newPriority,
-                          MC_QUEUE_POSITION, newQueuePosition,
-                          MC_TRACKERS, newTrackers,
-                          MC_SPEED_UP, newUpSpeed,
-                          MC_SPEED_DOWN, newDownSpeed,
-                          MC_RECHECK_PROGRESS, newRecheckProgress,
+                          MC_ACTIVE, n.active,
+                          MC_ACTIVE_PEER_COUNT, n.activePeerCount,
+                          MC_ACTIVE_PEERS_UP, n.uploadPeerCount,
+                          MC_ACTIVE_PEERS_DOWN, n.downloadPeerCount,
+                          MC_ERROR, n.error,
+                          MC_ACTIVITY, n.activity,
+                          MC_FINISHED, n.finished,
+                          MC_PRIORITY, n.priority,
+                          MC_QUEUE_POSITION, n.queuePosition,
+                          MC_TRACKERS, n.trackersHash,
+                          MC_SPEED_UP, n.upSpeed,
+                          MC_SPEED_DOWN, n.downSpeed,
+                          MC_RECHECK_PROGRESS, n.recheckProgress,
                           -1);
+      *o = n;
+    }
+  else
+    {
+      o->trackers = n.trackers;
+      o->trackerCount = n.trackerCount;
     }
 }
 
 void
 gtr_core_update (TrCore * core)
 {
+  int i, n;
+  tr_stat * stats;
+  tr_torrent ** torrents;
   GtkTreeIter iter;
   GtkTreeModel * model;
+  GHashTable * changed;
 
-  /* update the model */
   model = core_raw_model (core);
+
+  /* get the stats that changed since last time, all under one lock */
+  n = 0;
+  torrents = g_new (tr_torrent *, gtk_tree_model_iter_n_children (model, NULL));
+  if (gtk_tree_model_iter_nth_child (model, &iter, NULL, 0)) do
+    gtk_tree_model_get (model, &iter, MC_TORRENT, &torrents[n++], -1);
+  while (gtk_tree_model_iter_next (model, &iter));
+  stats = g_new (tr_stat, n);
+  n = tr_sessionGetTorrentStats (gtr_core_session (core), torrents, n, stats,
+                                 &core->priv->stat_generation);
+  changed = g_hash_table_new (NULL, NULL);
+  for (i=0; i<n; ++i)
+    g_hash_table_insert (changed, GINT_TO_POINTER (stats[i].id), &stats[i]);
+
+  /* update the model */
   if (gtk_tree_model_iter_nth_child (model, &iter, NULL, 0)) do
-    update_foreach (model, &iter);
+    update_foreach (core, model, &iter, changed);
   while (gtk_tree_model_iter_next (model, &iter));
 
+  g_hash_table_destroy (changed);
+  g_free (torrents);
+  g_free (stats);
+
   /* update hibernation */
   core_maybe_inhibit_hibernation (core);
 }
@@ -1726,37 +1817,32 @@ static GHashTable * pendingRequests = NULL;
 static gboolean
 core_read_rpc_response_idle (void * vresponse)
 {
-  tr_variant top;
   int64_t intVal;
-  struct evbuffer * response = vresponse;
-
-  tr_variantFromJson (&top, evbuffer_pullup (response, -1), evbuffer_get_length (response));
+  tr_variant * response = vresponse;
 
-  if (tr_variantDictFindInt (&top, TR_KEY_tag, &intVal))
+  if (tr_variantDictFindInt (response, TR_KEY_tag, &intVal))
     {
       const int tag = (int)intVal;
       struct pending_request_data * data = g_hash_table_lookup (pendingRequests, &tag);
       if (data)
         {
           if (data->response_func)
-            (*data->response_func)(data->core, &top, data->response_func_user_data);
+            (*data->response_func)(data->core, response, data->response_func_user_data);
           g_hash_table_remove (pendingRequests, &tag);
         }
     }
 
-  tr_variantFree (&top);
-  evbuffer_free (response);
+  tr_variantFree (response);
+  tr_free (response);
   return G_SOURCE_REMOVE;
 }
 
 static void
-core_read_rpc_response (tr_session       * session UNUSED,
-                        struct evbuffer  * response,
-                        void             * unused UNUSED)
+core_read_rpc_response (tr_session  * session UNUSED,
+                        tr_variant  * response,
+                        void        * unused UNUSED)
 {
-  struct evbuffer * buf = evbuffer_new ();
-  evbuffer_add_buffer (buf, response);
-  gdk_threads_add_idle (core_read_rpc_response_idle, buf);
+  gdk_threads_add_idle (core_read_rpc_response_idle, response);
 }
 
 static void
@@ -1764,6 +1850,7 @@ core_send_rpc_request (TrCore * core, const char * json, int tag,
                        server_response_func * response_func,
                        void * response_func_user_data)
 {
+  tr_variant top;
   tr_session * session = gtr_core_session (core);
 
   if (pendingRequests == NULL)
@@ -1789,7 +1876,12 @@ core_send_rpc_request (TrCore * core, const char * json, int tag,
 #ifdef DEBUG_RPC
       g_message ("request: [%s]", json);
 #endif
-      tr_rpc_request_exec_json (session, json, strlen (json), core_read_rpc_response, GINT_TO_POINTER (tag));
+      /* the response comes back as a tr_variant, not as JSON to parse again */
+      if (!tr_variantFromJson (&top, json, strlen (json)))
+        {
+          tr_rpc_request_exec (session, &top, core_read_rpc_response, GINT_TO_POINTER (tag));
+          tr_variantFree (&top);
+        }
     }
 }
 
@@ -304,8 +304,8 @@ on_tree_view_button_released (GtkWidget *      view,
   return FALSE;
 }
 
-int
-gtr_file_trash_or_remove (const char * filename)
+static int
+file_trash_or_remove (const char * filename, gboolean use_trash)
 {
   GFile * file;
   gboolean trashed = FALSE;
@@ -314,7 +314,7 @@ gtr_file_trash_or_remove (const char * filename)
 
   file = g_file_new_for_path (filename);
 
-  if (gtr_pref_flag_get (TR_KEY_trash_can_enabled))
+  if (use_trash)
     {
       GError * err = NULL;
       trashed = g_file_trash (file, NULL, &err);
@@ -340,6 +340,24 @@ gtr_file_trash_or_remove (const char * filename)
   return 0;
 }
 
+int
+gtr_file_trash_or_remove (const char * filename)
+{
+  return file_trash_or_remove (filename, gtr_pref_flag_get (TR_KEY_trash_can_enabled));
+}
+
+int
+gtr_file_trash (const char * filename)
+{
+  return file_trash_or_remove (filename, TRUE);
+}
+
+int
+gtr_file_remove (const char * filename)
+{
+  return file_trash_or_remove (filename, FALSE);
+}
+
 const char*
 gtr_get_help_uri (void)
 {
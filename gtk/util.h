@@ -157,6 +157,11 @@ gboolean on_tree_view_button_released (GtkWidget      * view,
 /* move a file to the trashcan if GIO is available; otherwise, delete it */
 int gtr_file_trash_or_remove (const char * filename);
 
+/* like gtr_file_trash_or_remove (), but without looking at the trash-can
+   pref, so that they can be called from libtransmission's worker threads */
+int gtr_file_trash (const char * filename);
+int gtr_file_remove (const char * filename);
+
 void gtr_paste_clipboard_url_into_entry (GtkWidget * entry);
 
 /* Only call gtk_label_set_text () if the new text differs from the old.
@@ -150,6 +150,10 @@ typedef struct
   /* the tracker's announce URL */
   char * url;
 
+  /* for http trackers, the start of the announce URL: the parts that don't
+   * change between announces. See tr_tracker_http_announce_prefix_new () */
+  char * url_prefix;
+
   /* key generated by and returned from an http tracker.
    * see tr_announce_response.tracker_id_str */
   char * tracker_id_str;
@@ -223,6 +227,17 @@ tr_announce_response;
 typedef void (*tr_announce_response_func) (const tr_announce_response * response,
                                            void                       * userdata);
 
+/**
+ * Build the part of an http announce URL that stays the same until
+ * the tracker, our port, or our peer id changes, so that it can be
+ * kept between announces instead of being escaped again for each one.
+ */
+char * tr_tracker_http_announce_prefix_new (const char    * url,
+                                            const uint8_t * info_hash,
+                                            const char    * peer_id,
+                                            int             port,
+                                            int             key);
+
 void tr_tracker_http_announce (tr_session                 * session,
                                const tr_announce_request  * req,
                                tr_announce_response_func    response_func,
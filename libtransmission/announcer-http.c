@@ -51,40 +51,63 @@ get_event_string (const tr_announce_request * req)
     return tr_announce_event_get_string (req->event);
 }
 
-static char*
-announce_url_new (const tr_session * session, const tr_announce_request * req)
+char *
+tr_tracker_http_announce_prefix_new (const char    * url,
+                                     const uint8_t * info_hash,
+                                     const char    * peer_id,
+                                     int             port,
+                                     int             key)
 {
-    const char * str;
-    const unsigned char * ipv6;
     struct evbuffer * buf = evbuffer_new ();
     char escaped_info_hash[SHA_DIGEST_LENGTH*3 + 1];
 
-    tr_http_escape_sha1 (escaped_info_hash, req->info_hash);
-
-    evbuffer_expand (buf, 1024);
+    tr_http_escape_sha1 (escaped_info_hash, info_hash);
 
     evbuffer_add_printf (buf, "%s"
                               "%c"
                               "info_hash=%s"
                               "&peer_id=%*.*s"
                               "&port=%d"
-                              "&uploaded=%" PRIu64
-                              "&downloaded=%" PRIu64
-                              "&left=%" PRIu64
-                              "&numwant=%d"
                               "&key=%x"
                               "&compact=1"
                               "&supportcrypto=1",
-                              req->url,
-                              strchr (req->url, '?') ? '&' : '?',
+                              url,
+                              strchr (url, '?') ? '&' : '?',
                               escaped_info_hash,
-                              PEER_ID_LEN, PEER_ID_LEN, req->peer_id,
-                              req->port,
+                              PEER_ID_LEN, PEER_ID_LEN, peer_id,
+                              port,
+                              key);
+
+    return evbuffer_free_to_str (buf);
+}
+
+static char*
+announce_url_new (const tr_session * session, const tr_announce_request * req)
+{
+    const char * str;
+    const unsigned char * ipv6;
+    struct evbuffer * buf = evbuffer_new ();
+
+    evbuffer_expand (buf, 1024);
+
+    if (req->url_prefix != NULL)
+        evbuffer_add (buf, req->url_prefix, strlen (req->url_prefix));
+    else {
+        char * prefix = tr_tracker_http_announce_prefix_new (req->url, req->info_hash,
+                                                             req->peer_id, req->port, req->key);
+        evbuffer_add (buf, prefix, strlen (prefix));
+        tr_free (prefix);
+    }
+
+    /* only the counters change from one announce to the next */
+    evbuffer_add_printf (buf, "&uploaded=%" PRIu64
+                              "&downloaded=%" PRIu64
+                              "&left=%" PRIu64
+                              "&numwant=%d",
                               req->up,
                               req->down,
                               req->leftUntilComplete,
-                              req->numwant,
-                              req->key);
+                              req->numwant);
 
     if (session->encryptionMode == TR_ENCRYPTION_REQUIRED)
         evbuffer_add_printf (buf, "&requirecrypto=1");
@@ -207,75 +230,80 @@ on_announce_done (tr_session   * session,
     }
     else
     {
-        tr_variant benc;
-        const bool variant_loaded = !tr_variantFromBenc (&benc, msg, msglen);
+        int64_t i;
+        size_t len;
+        const void * val;
+        const uint8_t * raw;
 
         if (tr_env_key_exists ("TR_CURL_VERBOSE"))
         {
-            if (!variant_loaded)
+            tr_variant benc;
+
+            if (tr_variantFromBenc (&benc, msg, msglen))
                 fprintf (stderr, "%s", "Announce response was not in benc format\n");
             else {
-                int i, len;
-                char * str = tr_variantToStr (&benc, TR_VARIANT_FMT_JSON, &len);
+                int j, jsonlen;
+                char * str = tr_variantToStr (&benc, TR_VARIANT_FMT_JSON, &jsonlen);
                 fprintf (stderr, "%s", "Announce response:\n< ");
-                for (i=0; i<len; ++i)
-                    fputc (str[i], stderr);
+                for (j=0; j<jsonlen; ++j)
+                    fputc (str[j], stderr);
                 fputc ('\n', stderr);
                 tr_free (str);
+                tr_variantFree (&benc);
             }
         }
 
-        if (variant_loaded && tr_variantIsDict (&benc))
-        {
-            int64_t i;
-            size_t len;
-            tr_variant * tmp;
-            const char * str;
-            const uint8_t * raw;
+        /* Pick the fields straight out of the response. The compact peer
+         * lists are by far the biggest part of it, and this way they go
+         * from the response to the tr_pex arrays without being copied
+         * into a variant first. */
 
-            if (tr_variantDictFindStr (&benc, TR_KEY_failure_reason, &str, &len))
-                response->errmsg = tr_strndup (str, len);
+        if (tr_variantBencDictFindRaw (msg, msglen, TR_KEY_failure_reason, &raw, &len))
+            response->errmsg = tr_strndup (raw, len);
 
-            if (tr_variantDictFindStr (&benc, TR_KEY_warning_message, &str, &len))
-                response->warning = tr_strndup (str, len);
+        if (tr_variantBencDictFindRaw (msg, msglen, TR_KEY_warning_message, &raw, &len))
+            response->warning = tr_strndup (raw, len);
 
-            if (tr_variantDictFindInt (&benc, TR_KEY_interval, &i))
-                response->interval = i;
+        if (tr_variantBencDictFindInt (msg, msglen, TR_KEY_interval, &i))
+            response->interval = i;
 
-            if (tr_variantDictFindInt (&benc, TR_KEY_min_interval, &i))
-                response->min_interval = i;
+        if (tr_variantBencDictFindInt (msg, msglen, TR_KEY_min_interval, &i))
+            response->min_interval = i;
 
-            if (tr_variantDictFindStr (&benc, TR_KEY_tracker_id, &str, &len))
-                response->tracker_id_str = tr_strndup (str, len);
+        if (tr_variantBencDictFindRaw (msg, msglen, TR_KEY_tracker_id, &raw, &len))
+            response->tracker_id_str = tr_strndup (raw, len);
 
-            if (tr_variantDictFindInt (&benc, TR_KEY_complete, &i))
-                response->seeders = i;
+        if (tr_variantBencDictFindInt (msg, msglen, TR_KEY_complete, &i))
+            response->seeders = i;
 
-            if (tr_variantDictFindInt (&benc, TR_KEY_incomplete, &i))
-                response->leechers = i;
+        if (tr_variantBencDictFindInt (msg, msglen, TR_KEY_incomplete, &i))
+            response->leechers = i;
 
-            if (tr_variantDictFindInt (&benc, TR_KEY_downloaded, &i))
-                response->downloads = i;
+        if (tr_variantBencDictFindInt (msg, msglen, TR_KEY_downloaded, &i))
+            response->downloads = i;
 
-            if (tr_variantDictFindRaw (&benc, TR_KEY_peers6, &raw, &len)) {
-                dbgmsg (data->log_name, "got a peers6 length of %"TR_PRIuSIZE, len);
-                response->pex6 = tr_peerMgrCompact6ToPex (raw, len,
-                                              NULL, 0, &response->pex6_count);
-            }
+        if (tr_variantBencDictFindRaw (msg, msglen, TR_KEY_peers6, &raw, &len)) {
+            dbgmsg (data->log_name, "got a peers6 length of %"TR_PRIuSIZE, len);
+            response->pex6 = tr_peerMgrCompact6ToPex (raw, len,
+                                          NULL, 0, &response->pex6_count);
+        }
 
-            if (tr_variantDictFindRaw (&benc, TR_KEY_peers, &raw, &len)) {
-                dbgmsg (data->log_name, "got a compact peers length of %"TR_PRIuSIZE, len);
-                response->pex = tr_peerMgrCompactToPex (raw, len,
-                                               NULL, 0, &response->pex_count);
-            } else if (tr_variantDictFindList (&benc, TR_KEY_peers, &tmp)) {
-                response->pex = listToPex (tmp, &response->pex_count);
-                dbgmsg (data->log_name, "got a peers list with %"TR_PRIuSIZE" entries",
-                        response->pex_count);
+        if (tr_variantBencDictFindRaw (msg, msglen, TR_KEY_peers, &raw, &len)) {
+            dbgmsg (data->log_name, "got a compact peers length of %"TR_PRIuSIZE, len);
+            response->pex = tr_peerMgrCompactToPex (raw, len,
+                                           NULL, 0, &response->pex_count);
+        } else if (tr_variantBencDictFindValue (msg, msglen, TR_KEY_peers, &val, &len)) {
+            /* the old non-compact form is rare enough to parse the usual way */
+            tr_variant peers;
+            if (!tr_variantFromBenc (&peers, val, len)) {
+                if (tr_variantIsList (&peers)) {
+                    response->pex = listToPex (&peers, &response->pex_count);
+                    dbgmsg (data->log_name, "got a peers list with %"TR_PRIuSIZE" entries",
+                            response->pex_count);
+                }
+                tr_variantFree (&peers);
             }
         }
-
-        if (variant_loaded)
-            tr_variantFree (&benc);
     }
 
     tr_runInEventThread (session, on_announce_done_eventthread, data);
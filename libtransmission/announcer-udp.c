@@ -7,25 +7,35 @@
  * $Id$
  */
 
+#if defined (HAVE_SENDMMSG) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* glibc's sys/socket.h needs this to pick up sendmmsg */
+#endif
+
 #define __LIBTRANSMISSION_ANNOUNCER_MODULE___
 
 #include <errno.h> /* errno, EAFNOSUPPORT */
+#include <limits.h> /* INT_MAX */
 #include <string.h> /* memcpy (), memset () */
 
 #include <event2/buffer.h>
 #include <event2/dns.h>
+#include <event2/event.h>
 #include <event2/util.h>
 
 #include "transmission.h"
 #include "announcer.h"
 #include "announcer-common.h"
 #include "crypto.h" /* tr_cryptoRandBuf () */
+#include "dns-cache.h"
 #include "log.h"
 #include "peer-io.h"
 #include "peer-mgr.h" /* tr_peerMgrCompactToPex () */
+#include "platform.h" /* tr_sessionGetConfigDir () */
 #include "ptrarray.h"
+#include "session.h" /* tr_sessionLock () */
 #include "tr-udp.h"
 #include "utils.h"
+#include "variant.h"
 
 #define dbgmsg(name, ...) \
   do \
@@ -48,10 +58,9 @@ tau_sockaddr_setport (struct sockaddr * sa, tr_port port)
       ((struct sockaddr_in6 *)sa)->sin6_port = htons (port);
 }
 
+/* returns the shared UDP socket for this address family, or -1 */
 static int
-tau_sendto (tr_session * session,
-            struct evutil_addrinfo * ai, tr_port port,
-            const void * buf, size_t buflen)
+tau_get_socket (const tr_session * session, const struct evutil_addrinfo * ai)
 {
     int sockfd;
 
@@ -62,10 +71,21 @@ tau_sendto (tr_session * session,
     else
         sockfd = -1;
 
-    if (sockfd < 0) {
+    if (sockfd < 0)
         errno = EAFNOSUPPORT;
+
+    return sockfd;
+}
+
+static int
+tau_sendto (tr_session * session,
+            struct evutil_addrinfo * ai, tr_port port,
+            const void * buf, size_t buflen)
+{
+    const int sockfd = tau_get_socket (session, ai);
+
+    if (sockfd < 0)
         return -1;
-    }
 
     tau_sockaddr_setport (ai->ai_addr, port);
     return sendto (sockfd, buf, buflen, 0, ai->ai_addr, ai->ai_addrlen);
@@ -99,7 +119,17 @@ typedef uint64_t tau_connection_t;
 
 enum
 {
-    TAU_CONNECTION_TTL_SECS = 60
+    TAU_CONNECTION_TTL_SECS = 60,
+
+    /* Each tracker gets a token bucket so that a few hundred torrents
+       starting up at once don't all hit it (and the socket that uTP
+       shares with us) in the same instant. */
+    TAU_SEND_RATE_PER_SEC = 20,
+    TAU_SEND_BURST = 40,
+    TAU_SEND_RETRY_MSEC = 500,
+
+    /* most datagrams handed to the kernel in one sendmmsg () */
+    TAU_SEND_BATCH = 32
 };
 
 typedef uint32_t tau_transaction_t;
@@ -442,10 +472,15 @@ struct tau_tracker
 
     time_t close_at;
 
+    double send_tokens;
+    uint64_t send_tokens_refilled_at;
+
     tr_ptrArray announces;
     tr_ptrArray scrapes;
 };
 
+static void tau_schedule_send (tr_session * session, int msec);
+
 static void tau_tracker_upkeep (struct tau_tracker *);
 
 static void
@@ -507,13 +542,52 @@ tau_tracker_on_dns (int errcode, struct evutil_addrinfo *addr, void * vtracker)
     }
     else
     {
+        tr_port unused;
+        tr_address cacheme;
+        struct sockaddr_storage ss;
+
         dbgmsg (tracker->key, "DNS lookup succeeded");
         tracker->addr = addr;
         tracker->addr_expiration_time = tr_time () + (60*60); /* one hour */
+
+        /* share the result with the HTTP announcer and with our next run */
+        memset (&ss, 0, sizeof (ss));
+        memcpy (&ss, addr->ai_addr, MIN (sizeof (ss), (size_t)addr->ai_addrlen));
+        if (tr_address_from_sockaddr_storage (&cacheme, &unused, &ss))
+            tr_dnsCacheAdd (tracker->session, tracker->host, &cacheme);
+
         tau_tracker_upkeep (tracker);
     }
 }
 
+/* refill the tracker's token bucket and return how many whole tokens it has */
+static int
+tau_tracker_get_tokens (struct tau_tracker * tracker)
+{
+    const uint64_t now = tr_time_msec ();
+
+    if (tracker->send_tokens_refilled_at < now)
+    {
+        const uint64_t elapsed = now - tracker->send_tokens_refilled_at;
+        tracker->send_tokens += (elapsed * TAU_SEND_RATE_PER_SEC) / 1000.0;
+        tracker->send_tokens = MIN (tracker->send_tokens, TAU_SEND_BURST);
+        tracker->send_tokens_refilled_at = now;
+    }
+
+    return (int) tracker->send_tokens;
+}
+
+/* Requests queued in tau_tracker_send_reqs () to go out together.
+   The payloads are referenced, not copied, so they must stay alive
+   until the batch is flushed. */
+struct tau_send_batch
+{
+    int count;
+    const void * payloads[TAU_SEND_BATCH];
+    size_t payload_lens[TAU_SEND_BATCH];
+};
+
+#ifndef HAVE_SENDMMSG
 static void
 tau_tracker_send_request (struct tau_tracker  * tracker,
                           const void          * payload,
@@ -529,12 +603,88 @@ tau_tracker_send_request (struct tau_tracker  * tracker,
                 evbuffer_get_length (buf));
     evbuffer_free (buf);
 }
+#endif
+
+static void
+tau_tracker_flush_batch (struct tau_tracker * tracker, struct tau_send_batch * batch)
+{
+#ifdef HAVE_SENDMMSG
+    int i;
+    int sent;
+    const int sockfd = tau_get_socket (tracker->session, tracker->addr);
+    const uint64_t connection_id = tr_htonll (tracker->connection_id);
+    struct iovec iovs[TAU_SEND_BATCH][2];
+    struct mmsghdr msgs[TAU_SEND_BATCH];
+
+    if (batch->count < 1)
+        return;
+
+    dbgmsg (tracker->key, "sending %d requests w/connection id %"PRIu64,
+            batch->count, tracker->connection_id);
+
+    if (sockfd >= 0)
+    {
+        tau_sockaddr_setport (tracker->addr->ai_addr, tracker->port);
+
+        memset (msgs, 0, sizeof (msgs));
+        for (i=0; i<batch->count; ++i)
+        {
+            iovs[i][0].iov_base = (void*) &connection_id;
+            iovs[i][0].iov_len = sizeof (connection_id);
+            iovs[i][1].iov_base = (void*) batch->payloads[i];
+            iovs[i][1].iov_len = batch->payload_lens[i];
+            msgs[i].msg_hdr.msg_name = tracker->addr->ai_addr;
+            msgs[i].msg_hdr.msg_namelen = tracker->addr->ai_addrlen;
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 2;
+        }
+
+        for (sent=0; sent<batch->count; )
+        {
+            const int rc = sendmmsg (sockfd, msgs + sent, batch->count - sent, 0);
+
+            if (rc <= 0)
+            {
+                /* whatever didn't go out will be caught by the request timeout */
+                dbgmsg (tracker->key, "sendmmsg failed: %s", tr_strerror (errno));
+                break;
+            }
+
+            sent += rc;
+        }
+    }
+#else
+    int i;
+
+    for (i=0; i<batch->count; ++i)
+        tau_tracker_send_request (tracker, batch->payloads[i], batch->payload_lens[i]);
+#endif
+
+    tracker->send_tokens -= batch->count;
+    batch->count = 0;
+}
+
+static void
+tau_tracker_batch_add (struct tau_tracker     * tracker,
+                       struct tau_send_batch  * batch,
+                       const void             * payload,
+                       size_t                   payload_len)
+{
+    batch->payloads[batch->count] = payload;
+    batch->payload_lens[batch->count] = payload_len;
+
+    if (++batch->count == TAU_SEND_BATCH)
+        tau_tracker_flush_batch (tracker, batch);
+}
 
 static void
 tau_tracker_send_reqs (struct tau_tracker * tracker)
 {
     int i, n;
+    int tokens;
+    bool throttled = false;
     tr_ptrArray * reqs;
+    struct tau_send_batch batch;
     const time_t now = tr_time ();
 
     assert (tracker->dns_request == NULL);
@@ -542,19 +692,22 @@ tau_tracker_send_reqs (struct tau_tracker * tracker)
     assert (tracker->addr != NULL);
     assert (tracker->connection_expiration_time > now);
 
+    /* don't pace the &event=stopped messages when we're shutting down */
+    batch.count = 0;
+    tokens = tracker->close_at ? INT_MAX : tau_tracker_get_tokens (tracker);
+
     reqs = &tracker->announces;
     for (i=0, n=tr_ptrArraySize (reqs); i<n; ++i) {
         struct tau_announce_request * req = tr_ptrArrayNth (reqs, i);
         if (!req->sent_at) {
+            if (tokens < 1) {
+                throttled = true;
+                break;
+            }
             dbgmsg (tracker->key, "sending announce req %p", (void*)req);
             req->sent_at = now;
-            tau_tracker_send_request (tracker, req->payload, req->payload_len);
-            if (req->callback == NULL) {
-                tau_announce_request_free (req);
-                tr_ptrArrayRemove (reqs, i);
-                --i;
-                --n;
-            }
+            --tokens;
+            tau_tracker_batch_add (tracker, &batch, req->payload, req->payload_len);
         }
     }
 
@@ -562,17 +715,45 @@ tau_tracker_send_reqs (struct tau_tracker * tracker)
     for (i=0, n=tr_ptrArraySize (reqs); i<n; ++i) {
         struct tau_scrape_request * req = tr_ptrArrayNth (reqs, i);
         if (!req->sent_at) {
+            if (tokens < 1) {
+                throttled = true;
+                break;
+            }
             dbgmsg (tracker->key, "sending scrape req %p", (void*)req);
             req->sent_at = now;
-            tau_tracker_send_request (tracker, req->payload, req->payload_len);
-            if (req->callback == NULL) {
-                tau_scrape_request_free (req);
-                tr_ptrArrayRemove (reqs, i);
-                --i;
-                --n;
-            }
+            --tokens;
+            tau_tracker_batch_add (tracker, &batch, req->payload, req->payload_len);
+        }
+    }
+
+    tau_tracker_flush_batch (tracker, &batch);
+
+    /* now that the batch is out, drop the sent ones nobody's waiting on */
+    reqs = &tracker->announces;
+    for (i=0, n=tr_ptrArraySize (reqs); i<n; ++i) {
+        struct tau_announce_request * req = tr_ptrArrayNth (reqs, i);
+        if (req->sent_at && (req->callback == NULL)) {
+            tau_announce_request_free (req);
+            tr_ptrArrayRemove (reqs, i);
+            --i;
+            --n;
+        }
+    }
+
+    reqs = &tracker->scrapes;
+    for (i=0, n=tr_ptrArraySize (reqs); i<n; ++i) {
+        struct tau_scrape_request * req = tr_ptrArrayNth (reqs, i);
+        if (req->sent_at && (req->callback == NULL)) {
+            tau_scrape_request_free (req);
+            tr_ptrArrayRemove (reqs, i);
+            --i;
+            --n;
         }
     }
+
+    /* come back for the rest as soon as the bucket has room for them */
+    if (throttled)
+        tau_schedule_send (tracker->session, TAU_SEND_RETRY_MSEC);
 }
 
 static void
@@ -676,16 +857,38 @@ tau_tracker_upkeep (struct tau_tracker * tracker)
     /* if we don't have an address yet, try & get one now. */
     if (!tracker->addr && (tracker->dns_request == NULL))
     {
+        tr_address cached;
+        time_t expires_at;
         struct evutil_addrinfo hints;
         memset (&hints, 0, sizeof (hints));
         hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_DGRAM;
         hints.ai_protocol = IPPROTO_UDP;
-        dbgmsg (tracker->host, "Trying a new DNS lookup");
-        tracker->dns_request = evdns_getaddrinfo (tracker->session->evdns_base,
-                                                  tracker->host, NULL, &hints,
-                                                  tau_tracker_on_dns, tracker);
-        return;
+
+        /* maybe the HTTP announcer or our last run already looked it up */
+        if (tr_dnsCacheLookup (tracker->session, tracker->host, &cached, &expires_at))
+        {
+            char buf[TR_INET6_ADDRSTRLEN];
+            struct evutil_addrinfo * ai = NULL;
+            hints.ai_flags = EVUTIL_AI_NUMERICHOST;
+            tr_address_to_string_with_buf (&cached, buf, sizeof (buf));
+            if (!evutil_getaddrinfo (buf, NULL, &hints, &ai) && (ai != NULL))
+            {
+                dbgmsg (tracker->host, "Using cached DNS result %s", buf);
+                tracker->addr = ai;
+                tracker->addr_expiration_time = expires_at;
+            }
+            hints.ai_flags = 0;
+        }
+
+        if (tracker->addr == NULL)
+        {
+            dbgmsg (tracker->host, "Trying a new DNS lookup");
+            tracker->dns_request = evdns_getaddrinfo (tracker->session->evdns_base,
+                                                      tracker->host, NULL, &hints,
+                                                      tau_tracker_on_dns, tracker);
+            return;
+        }
     }
 
     dbgmsg (tracker->key, "addr %p -- connected %d (%"TR_PRIuSIZE" %"TR_PRIuSIZE") -- connecting_at %"TR_PRIuSIZE,
@@ -732,9 +935,33 @@ struct tr_announcer_udp
     /* tau_tracker */
     tr_ptrArray trackers;
 
+    /* wakes us up to send requests that a tracker's token bucket held back */
+    struct event * send_timer;
+
     tr_session * session;
 };
 
+static void
+tau_on_send_timer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vtau)
+{
+    struct tr_announcer_udp * tau = vtau;
+
+    tr_sessionLock (tau->session);
+    tr_tracker_udp_upkeep (tau->session);
+    tr_sessionUnlock (tau->session);
+}
+
+static void
+tau_schedule_send (tr_session * session, int msec)
+{
+    struct tr_announcer_udp * tau = session->announcer_udp;
+
+    if ((tau != NULL) && !evtimer_pending (tau->send_timer, NULL))
+        tr_timerAddMsec (tau->send_timer, msec);
+}
+
+static void tau_load_connections (struct tr_announcer_udp * tau);
+
 static struct tr_announcer_udp*
 announcer_udp_get (tr_session * session)
 {
@@ -746,7 +973,9 @@ announcer_udp_get (tr_session * session)
     tau = tr_new0 (struct tr_announcer_udp, 1);
     tau->trackers = TR_PTR_ARRAY_INIT;
     tau->session = session;
+    tau->send_timer = evtimer_new (session->event_base, tau_on_send_timer, tau);
     session->announcer_udp = tau;
+    tau_load_connections (tau);
     return tau;
 }
 
@@ -779,6 +1008,8 @@ tau_session_get_tracker (struct tr_announcer_udp * tau, const char * url)
         tracker->key = key;
         tracker->host = host;
         tracker->port = port;
+        tracker->send_tokens = TAU_SEND_BURST;
+        tracker->send_tokens_refilled_at = tr_time_msec ();
         tracker->scrapes = TR_PTR_ARRAY_INIT;
         tracker->announces = TR_PTR_ARRAY_INIT;
         tr_ptrArrayAppend (&tau->trackers, tracker);
@@ -793,6 +1024,87 @@ tau_session_get_tracker (struct tr_announcer_udp * tau, const char * url)
     return tracker;
 }
 
+/* A connection ID is good for a minute or so, which is about how long
+   a quick restart takes. Saving them lets us skip the connect round-trip
+   to each tracker on the way back up. */
+
+static char*
+tau_get_filename (const tr_session * session)
+{
+    return tr_buildPath (tr_sessionGetConfigDir (session), "udp-trackers.json", NULL);
+}
+
+static void
+tau_load_connections (struct tr_announcer_udp * tau)
+{
+    tr_variant top;
+    char * filename = tau_get_filename (tau->session);
+
+    if (!tr_variantFromFile (&top, TR_VARIANT_FMT_JSON, filename))
+    {
+        size_t i, n;
+        const time_t now = tr_time ();
+
+        for (i=0, n=tr_variantListSize (&top); i<n; ++i)
+        {
+            const char * host;
+            int64_t port, id, expires_at;
+            tr_variant * d = tr_variantListChild (&top, i);
+
+            if (tr_variantDictFindStr (d, TR_KEY_host, &host, NULL)
+                && tr_variantDictFindInt (d, TR_KEY_port, &port)
+                && tr_variantDictFindInt (d, TR_KEY_connection_id, &id)
+                && tr_variantDictFindInt (d, TR_KEY_expires, &expires_at)
+                && (expires_at > now)
+                && (expires_at <= now + TAU_CONNECTION_TTL_SECS))
+            {
+                char * url = tr_strdup_printf ("udp://%s:%d", host, (int)port);
+                struct tau_tracker * tracker = tau_session_get_tracker (tau, url);
+                tracker->connection_id = (tau_connection_t) id;
+                tracker->connection_expiration_time = expires_at;
+                dbgmsg (tracker->key, "Reusing saved connection ID %"PRIu64,
+                        tracker->connection_id);
+                tr_free (url);
+            }
+        }
+
+        tr_variantFree (&top);
+    }
+
+    tr_free (filename);
+}
+
+static void
+tau_save_connections (struct tr_announcer_udp * tau)
+{
+    int i, n;
+    tr_variant top;
+    char * filename;
+    const time_t now = tr_time ();
+
+    n = tr_ptrArraySize (&tau->trackers);
+    tr_variantInitList (&top, n);
+
+    for (i=0; i<n; ++i)
+    {
+        const struct tau_tracker * tracker = tr_ptrArrayNth (&tau->trackers, i);
+
+        if (tracker->connection_expiration_time > now)
+        {
+            tr_variant * d = tr_variantListAddDict (&top, 4);
+            tr_variantDictAddStr (d, TR_KEY_host, tracker->host);
+            tr_variantDictAddInt (d, TR_KEY_port, tracker->port);
+            tr_variantDictAddInt (d, TR_KEY_connection_id, (int64_t) tracker->connection_id);
+            tr_variantDictAddInt (d, TR_KEY_expires, tracker->connection_expiration_time);
+        }
+    }
+
+    filename = tau_get_filename (tau->session);
+    tr_variantToFile (&top, TR_VARIANT_FMT_JSON, filename);
+    tr_free (filename);
+    tr_variantFree (&top);
+}
+
 /****
 *****
 *****  PUBLIC API
@@ -833,6 +1145,8 @@ tr_tracker_udp_close (tr_session * session)
     if (tau != NULL)
     {
         session->announcer_udp = NULL;
+        tau_save_connections (tau);
+        event_free (tau->send_timer);
         tr_ptrArrayDestruct (&tau->trackers, (PtrArrayForeachFunc)tau_tracker_free);
         tr_free (tau);
     }
@@ -23,6 +23,7 @@
 #include "announcer-common.h"
 #include "crypto.h" /* tr_cryptoRandInt (), tr_cryptoWeakRandInt () */
 #include "log.h"
+#include "metrics.h"
 #include "peer-mgr.h" /* tr_peerMgrCompactToPex () */
 #include "ptrarray.h"
 #include "session.h"
@@ -60,6 +61,18 @@ enum
     /* how many web tasks we allow at one time */
     MAX_CONCURRENT_TASKS = 48,
 
+    /* bounds and starting point for each tracker host's share of those */
+    HOST_LIMIT_MIN = 1,
+    HOST_LIMIT_INITIAL = 4,
+    HOST_LIMIT_MAX = 16,
+
+    /* responses slower than this don't raise a host's limit */
+    HOST_SLOW_MSEC = 5000,
+
+    /* how long a due scrape may be held back waiting for more tiers
+     * with the same scrape URL to come due, so they can share a request */
+    SCRAPE_BATCH_WAIT_SECS = 30,
+
     /* the value of the 'numwant' argument passed in tracker requests. */
     NUMWANT = 80,
 
@@ -146,9 +159,97 @@ typedef struct tr_announcer
     int slotsAvailable;
     int key;
     time_t tauUpkeepAt;
+
+    /* min-heap of when tiers next need attention. see tierSchedule () */
+    struct tier_wakeup * wakeups;
+    int wakeup_count;
+    int wakeup_alloc;
+
+    tr_ptrArray hosts; /* tr_tracker_host, sorted by key */
 }
 tr_announcer;
 
+/***
+****  HOSTS
+****
+****  Requests to each tracker host share an AIMD concurrency limit:
+****  a quick successful response raises it by one, and a failure or
+****  timeout halves it. A host that stops answering is soon down to
+****  a single request in flight, so it can't hold most of the
+****  MAX_CONCURRENT_TASKS slots while announces to healthy trackers wait.
+***/
+
+typedef struct tr_tracker_host
+{
+    char * key; /* same format as tr_tracker.key */
+    int inFlight;
+    int limit;
+    int latencyMsec; /* smoothed announce round-trip time, or 0 */
+}
+tr_tracker_host;
+
+static int
+compareHostToKey (const void * va, const void * vb)
+{
+    const tr_tracker_host * a = va;
+
+    return strcmp (a->key, vb);
+}
+
+static tr_tracker_host *
+findHost (const tr_announcer * announcer, const char * key)
+{
+    return tr_ptrArrayFindSorted ((tr_ptrArray*)&announcer->hosts, key, compareHostToKey);
+}
+
+static tr_tracker_host *
+getHost (tr_announcer * announcer, const char * key)
+{
+    bool exact;
+    const int pos = tr_ptrArrayLowerBound (&announcer->hosts, key, compareHostToKey, &exact);
+    tr_tracker_host * host;
+
+    if (exact)
+        return tr_ptrArrayNth (&announcer->hosts, pos);
+
+    host = tr_new0 (tr_tracker_host, 1);
+    host->key = tr_strdup (key);
+    host->limit = HOST_LIMIT_INITIAL;
+    tr_ptrArrayInsert (&announcer->hosts, host, pos);
+    return host;
+}
+
+static void
+hostFree (void * vhost)
+{
+    tr_tracker_host * host = vhost;
+
+    tr_free (host->key);
+    tr_free (host);
+}
+
+static bool
+hostCanSend (const tr_tracker_host * host)
+{
+    return host->inFlight < host->limit;
+}
+
+/* latencyMsec is 0 if it wasn't measured */
+static void
+hostRequestDone (tr_tracker_host * host, bool responded, int latencyMsec)
+{
+    --host->inFlight;
+
+    if (!responded)
+        host->limit = MAX (HOST_LIMIT_MIN, host->limit / 2);
+    else if (latencyMsec < HOST_SLOW_MSEC)
+        host->limit = MIN (HOST_LIMIT_MAX, host->limit + 1);
+
+    if (responded && (latencyMsec > 0))
+        host->latencyMsec = host->latencyMsec ? (host->latencyMsec * 7 + latencyMsec) / 8
+                                              : latencyMsec;
+}
+
 bool
 tr_announcerHasBacklog (const struct tr_announcer * announcer)
 {
@@ -167,6 +268,7 @@ tr_announcerInit (tr_session * session)
 
     a = tr_new0 (tr_announcer, 1);
     a->stops = TR_PTR_ARRAY_INIT;
+    a->hosts = TR_PTR_ARRAY_INIT;
     a->key = tr_cryptoRandInt (INT_MAX);
     a->session = session;
     a->slotsAvailable = MAX_CONCURRENT_TASKS;
@@ -191,6 +293,8 @@ tr_announcerClose (tr_session * session)
     announcer->upkeepTimer = NULL;
 
     tr_ptrArrayDestruct (&announcer->stops, NULL);
+    tr_ptrArrayDestruct (&announcer->hosts, hostFree);
+    tr_free (announcer->wakeups);
 
     session->announcer = NULL;
     tr_free (announcer);
@@ -207,6 +311,9 @@ typedef struct
     char * announce;
     char * scrape;
 
+    /* the announce URL's host, for matching trackers by name */
+    char * host;
+
     char * tracker_id_str;
 
     int seederCount;
@@ -241,6 +348,9 @@ static void
 trackerConstruct (tr_tracker * tracker, const tr_tracker_info * inf)
 {
     memset (tracker, 0, sizeof (tr_tracker));
+    tr_urlParse (inf->announce, -1, NULL, &tracker->host, NULL, NULL);
+    if (tracker->host == NULL)
+        tracker->host = tr_strdup ("");
     tracker->key = getKey (inf->announce);
     tracker->announce = tr_strdup (inf->announce);
     tracker->scrape = tr_strdup (inf->scrape);
@@ -254,6 +364,7 @@ static void
 trackerDestruct (tr_tracker * tracker)
 {
     tr_free (tracker->tracker_id_str);
+    tr_free (tracker->host);
     tr_free (tracker->scrape);
     tr_free (tracker->announce);
     tr_free (tracker->key);
@@ -310,8 +421,18 @@ typedef struct tr_tier
     bool isScraping;
     bool wasCopied;
 
+    /* when this tier's entry in tr_announcer.wakeups comes due, or 0 */
+    time_t wakeAt;
+
     char lastAnnounceStr[128];
     char lastScrapeStr[128];
+
+    /* the current tracker's http announce URL prefix, and what it was
+     * built from. See tier_get_announce_prefix () */
+    char * announcePrefix;
+    const tr_tracker * announcePrefixTracker;
+    int announcePrefixPort;
+    char announcePrefixPeerId[PEER_ID_LEN];
 }
 tr_tier;
 
@@ -337,6 +458,101 @@ get_next_scrape_time (const tr_session * session, const tr_tier * tier, int inte
     return ret;
 }
 
+/***
+****  WAKEUPS
+****
+****  Rather than checking every tier of every torrent once a second,
+****  each tier keeps an entry in a min-heap keyed on the next time it
+****  might need to announce or scrape, and upkeep only looks at the
+****  tiers at the top of the heap. Entries are never removed early:
+****  one whose tier is gone, or which has been superseded by an
+****  earlier entry for the same tier, is just skipped when it's popped.
+***/
+
+struct tier_wakeup
+{
+    time_t at;
+    int torrentId;
+    int tierKey;
+};
+
+static void
+wakeupsPush (tr_announcer * announcer, const struct tier_wakeup * w)
+{
+    int i;
+    struct tier_wakeup * heap;
+
+    if (announcer->wakeup_count == announcer->wakeup_alloc) {
+        announcer->wakeup_alloc = MAX (64, announcer->wakeup_alloc * 2);
+        announcer->wakeups = tr_renew (struct tier_wakeup, announcer->wakeups, announcer->wakeup_alloc);
+    }
+
+    heap = announcer->wakeups;
+    for (i=announcer->wakeup_count++; i>0 && heap[(i-1)/2].at > w->at; i=(i-1)/2)
+        heap[i] = heap[(i-1)/2];
+    heap[i] = *w;
+}
+
+static void
+wakeupsPop (tr_announcer * announcer, struct tier_wakeup * setme)
+{
+    int i;
+    int child;
+    struct tier_wakeup * heap = announcer->wakeups;
+    const struct tier_wakeup last = heap[--announcer->wakeup_count];
+    const int n = announcer->wakeup_count;
+
+    *setme = heap[0];
+
+    for (i=0; (child = i*2 + 1) < n; i=child) {
+        if ((child + 1 < n) && (heap[child+1].at < heap[child].at))
+            ++child;
+        if (heap[child].at >= last.at)
+            break;
+        heap[i] = heap[child];
+    }
+    heap[i] = last;
+}
+
+/* the earliest time that tierNeedsToAnnounce () or tierNeedsToScrape ()
+ * could become true without something else changing first, or 0 */
+static time_t
+tierNextDeadline (const tr_tier * tier)
+{
+    time_t at = 0;
+
+    if (!tier->isAnnouncing && !tier->isScraping && tier->announceAt && (tier->announce_event_count > 0))
+        at = tier->announceAt;
+
+    if (!tier->isScraping && tier->scrapeAt && tier->currentTracker && tier->currentTracker->scrape)
+        at = at ? MIN (at, tier->scrapeAt) : tier->scrapeAt;
+
+    return at;
+}
+
+/* call this whenever something changes that tierNextDeadline () looks at */
+static void
+tierSchedule (tr_tier * tier)
+{
+    struct tier_wakeup w;
+    tr_announcer * announcer = tier->tor->session->announcer;
+
+    if ((announcer == NULL) || !(w.at = tierNextDeadline (tier)))
+        return;
+
+    /* upkeep only runs once a second anyway */
+    w.at = MAX (w.at, tr_time () + 1);
+
+    /* the entry we already have will fire first; we'll look again then */
+    if (tier->wakeAt && (tier->wakeAt <= w.at))
+        return;
+
+    w.torrentId = tr_torrentId (tier->tor);
+    w.tierKey = tier->key;
+    wakeupsPush (announcer, &w);
+    tier->wakeAt = w.at;
+}
+
 static void
 tierConstruct (tr_tier * tier, tr_torrent * tor)
 {
@@ -356,6 +572,7 @@ tierConstruct (tr_tier * tier, tr_torrent * tor)
 static void
 tierDestruct (tr_tier * tier)
 {
+    tr_free (tier->announcePrefix);
     tr_free (tier->announce_events);
 }
 
@@ -385,6 +602,8 @@ tierIncrementTracker (tr_tier * tier)
     tier->isScraping = false;
     tier->lastAnnounceStartTime = 0;
     tier->lastScrapeStartTime = 0;
+
+    tierSchedule (tier);
 }
 
 /***
@@ -828,6 +1047,8 @@ tier_announce_event_push (tr_tier            * tier,
 
     dbgmsg_tier_announce_queue (tier);
     dbgmsg (tier, "announcing in %d seconds", (int)difftime (announceAt,tr_time ()));
+
+    tierSchedule (tier);
 }
 
 static tr_announce_event
@@ -900,10 +1121,34 @@ tr_announcerAddBytes (tr_torrent * tor, int type, uint32_t byteCount)
 ****
 ***/
 
+/* escaping the info hash and formatting the URL for every announce adds up
+   with thousands of torrents, so keep the parts that rarely change */
+static const char *
+tier_get_announce_prefix (tr_tier * tier, int port, const char * peer_id, int key)
+{
+    const tr_tracker * tracker = tier->currentTracker;
+
+    if ((tier->announcePrefix == NULL)
+        || (tier->announcePrefixTracker != tracker)
+        || (tier->announcePrefixPort != port)
+        || memcmp (tier->announcePrefixPeerId, peer_id, PEER_ID_LEN))
+    {
+        tr_free (tier->announcePrefix);
+        tier->announcePrefix = tr_tracker_http_announce_prefix_new (tracker->announce,
+                                                                    tier->tor->info.hash,
+                                                                    peer_id, port, key);
+        tier->announcePrefixTracker = tracker;
+        tier->announcePrefixPort = port;
+        memcpy (tier->announcePrefixPeerId, peer_id, PEER_ID_LEN);
+    }
+
+    return tier->announcePrefix;
+}
+
 static tr_announce_request *
 announce_request_new (const tr_announcer  * announcer,
                       tr_torrent          * tor,
-                      const tr_tier       * tier,
+                      tr_tier             * tier,
                       tr_announce_event     event)
 {
     tr_announce_request * req = tr_new0 (tr_announce_request, 1);
@@ -922,6 +1167,8 @@ announce_request_new (const tr_announcer  * announcer,
     req->numwant = event == TR_ANNOUNCE_EVENT_STOPPED ? 0 : NUMWANT;
     req->key = announcer->key;
     req->partial_seed = tr_torrentGetCompleteness (tor) == TR_PARTIAL_SEED;
+    if (!memcmp (req->url, "http", 4))
+        req->url_prefix = tr_strdup (tier_get_announce_prefix (tier, req->port, req->peer_id, req->key));
     tier_build_log_name (tier, req->log_name, sizeof (req->log_name));
     return req;
 }
@@ -975,6 +1222,8 @@ struct announce_data
 {
     int tierId;
     time_t timeSent;
+    uint64_t timeSentMsec;
+    tr_tracker_host * host;
     tr_announce_event event;
     tr_session * session;
 
@@ -1017,7 +1266,11 @@ on_announce_done (const tr_announce_response  * response,
     const tr_announce_event event = data->event;
 
     if (announcer)
+    {
         ++announcer->slotsAvailable;
+        hostRequestDone (data->host, response->did_connect && !response->did_timeout,
+                         (int)(tr_time_msec () - data->timeSentMsec));
+    }
 
     if (tier != NULL)
     {
@@ -1181,6 +1434,8 @@ on_announce_done (const tr_announce_response  * response,
                 tier_announce_event_push (tier, TR_ANNOUNCE_EVENT_NONE, now + i);
             }
         }
+
+        tierSchedule (tier);
     }
 
     tr_free (data);
@@ -1190,6 +1445,7 @@ static void
 announce_request_free (tr_announce_request * req)
 {
     tr_free (req->tracker_id_str);
+    tr_free (req->url_prefix);
     tr_free (req->url);
     tr_free (req);
 }
@@ -1250,11 +1506,14 @@ tierAnnounce (tr_announcer * announcer, tr_tier * tier)
     data->tierId = tier->key;
     data->isRunningOnSuccess = tor->isRunning;
     data->timeSent = now;
+    data->timeSentMsec = tr_time_msec ();
+    data->host = getHost (announcer, tier->currentTracker->key);
     data->event = announce_event;
 
     tier->isAnnouncing = true;
     tier->lastAnnounceStartTime = now;
     --announcer->slotsAvailable;
+    ++data->host->inFlight;
 
     announce_request_delegate (announcer, req, on_announce_done, data);
 }
@@ -1288,6 +1547,7 @@ on_scrape_error (tr_session * session, tr_tier * tier, const char * errmsg)
     tr_logAddTorInfo (tier->tor, "Retrying scrape in %"TR_PRIuSIZE" seconds.", (size_t)interval);
     tier->lastScrapeSucceeded = false;
     tier->scrapeAt = get_next_scrape_time (session, tier, interval);
+    tierSchedule (tier);
 }
 
 static tr_tier *
@@ -1383,12 +1643,19 @@ on_scrape_done (const tr_scrape_response * response, void * vsession)
                         tracker->consecutiveFailures = 0;
                     }
                 }
+
+                tierSchedule (tier);
             }
         }
     }
 
     if (announcer)
+    {
+        char * key = getKey (response->url);
         ++announcer->slotsAvailable;
+        hostRequestDone (getHost (announcer, key), response->did_connect && !response->did_timeout, 0);
+        tr_free (key);
+    }
 }
 
 static void
@@ -1407,15 +1674,72 @@ scrape_request_delegate (tr_announcer             * announcer,
         tr_logAddError ("Unsupported url: %s", request->url);
 }
 
+/* the due tiers that share a scrape URL */
+struct scrape_group
+{
+    const char * url;
+    int tier_count;
+    time_t oldestScrapeAt;
+};
+
+static struct scrape_group *
+getScrapeGroups (tr_ptrArray * tiers, int * setme_count)
+{
+    int i;
+    int group_count = 0;
+    const int tier_count = tr_ptrArraySize (tiers);
+    struct scrape_group * groups = tr_new (struct scrape_group, tier_count);
+
+    for (i=0; i<tier_count; ++i)
+    {
+        int j;
+        const tr_tier * tier = tr_ptrArrayNth (tiers, i);
+        const char * url = tier->currentTracker->scrape;
+
+        for (j=0; j<group_count; ++j)
+            if (!strcmp (groups[j].url, url))
+                break;
+
+        if (j == group_count) {
+            groups[j].url = url;
+            groups[j].tier_count = 0;
+            groups[j].oldestScrapeAt = tier->scrapeAt;
+            ++group_count;
+        }
+
+        ++groups[j].tier_count;
+        groups[j].oldestScrapeAt = MIN (groups[j].oldestScrapeAt, tier->scrapeAt);
+    }
+
+    *setme_count = group_count;
+    return groups;
+}
+
+static bool
+isScrapeGroupReady (const struct scrape_group * groups, int group_count,
+                    const char * url, time_t now)
+{
+    int i;
+
+    for (i=0; i<group_count; ++i)
+        if (!strcmp (groups[i].url, url))
+            return (groups[i].tier_count >= TR_MULTISCRAPE_MAX)
+                || (groups[i].oldestScrapeAt + SCRAPE_BATCH_WAIT_SECS <= now);
+
+    return true;
+}
+
 static void
 multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
 {
     int i;
+    int group_count;
     int request_count = 0;
     const time_t now = tr_time ();
     const int tier_count = tr_ptrArraySize (tiers);
     const int max_request_count = MIN (announcer->slotsAvailable, tier_count);
     tr_scrape_request * requests = tr_new0 (tr_scrape_request, max_request_count);
+    struct scrape_group * groups = getScrapeGroups (tiers, &group_count);
 
     /* batch as many info_hashes into a request as we can */
     for (i=0; i<tier_count; ++i)
@@ -1425,6 +1749,11 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
         char * url = tier->currentTracker->scrape;
         const uint8_t * hash = tier->tor->info.hash;
 
+        /* give a partial batch time to fill up. announceMore ()
+         * requeues the tiers we skip, so they'll come back around */
+        if (!isScrapeGroupReady (groups, group_count, url, now))
+            continue;
+
         /* if there's a request with this scrape URL and a free slot, use it */
         for (j=0; j<request_count; ++j)
         {
@@ -1442,9 +1771,12 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
         }
 
         /* otherwise, if there's room for another request, build a new one */
-        if ((j==request_count) && (request_count < max_request_count))
+        if ((j==request_count) && (request_count < max_request_count)
+                               && hostCanSend (getHost (announcer, tier->currentTracker->key)))
         {
             tr_scrape_request * req = &requests[request_count++];
+            ++getHost (announcer, tier->currentTracker->key)->inFlight;
+            --announcer->slotsAvailable;
             req->url = url;
             tier_build_log_name (tier, req->log_name, sizeof (req->log_name));
 
@@ -1459,6 +1791,7 @@ multiscrape (tr_announcer * announcer, tr_ptrArray * tiers)
         scrape_request_delegate (announcer, &requests[i], on_scrape_done, announcer->session);
 
     /* cleanup */
+    tr_free (groups);
     tr_free (requests);
 }
 
@@ -1528,16 +1861,27 @@ announceMore (tr_announcer * announcer)
         return;
 
     /* build a list of tiers that need to be announced */
-    tor = NULL;
-    while ((tor = tr_torrentNext (announcer->session, tor))) {
-        struct tr_torrent_tiers * tt = tor->tiers;
-        for (i=0; tt && i<tt->tier_count; ++i) {
-            tr_tier * tier = &tt->tiers[i];
-            if (tierNeedsToAnnounce (tier, now))
-                tr_ptrArrayAppend (&announceMe, tier);
-            else if (tierNeedsToScrape (tier, now))
-                tr_ptrArrayAppend (&scrapeMe, tier);
-        }
+    while ((announcer->wakeup_count > 0) && (announcer->wakeups[0].at <= now)) {
+        struct tier_wakeup w;
+        tr_tier * tier = NULL;
+
+        wakeupsPop (announcer, &w);
+
+        if ((tor = tr_torrentFindFromId (announcer->session, w.torrentId)) && tor->tiers)
+            for (i=0; !tier && i<tor->tiers->tier_count; ++i)
+                if (tor->tiers->tiers[i].key == w.tierKey)
+                    tier = &tor->tiers->tiers[i];
+
+        if ((tier == NULL) || (tier->wakeAt != w.at))
+            continue;
+
+        tier->wakeAt = 0;
+        if (tierNeedsToAnnounce (tier, now))
+            tr_ptrArrayAppend (&announceMe, tier);
+        else if (tierNeedsToScrape (tier, now))
+            tr_ptrArrayAppend (&scrapeMe, tier);
+        else
+            tierSchedule (tier);
     }
 
     /* if there are more tiers than slots available, prioritize */
@@ -1545,10 +1889,12 @@ announceMore (tr_announcer * announcer)
     if (n > announcer->slotsAvailable)
         qsort (tr_ptrArrayBase (&announceMe), n, sizeof (tr_tier*), compareTiers);
 
-    /* announce some */
-    n = MIN (tr_ptrArraySize (&announceMe), announcer->slotsAvailable);
-    for (i=0; i<n; ++i) {
+    /* announce some, skipping hosts that are already at their limit */
+    n = tr_ptrArraySize (&announceMe);
+    for (i=0; i<n && announcer->slotsAvailable > 0; ++i) {
         tr_tier * tier = tr_ptrArrayNth (&announceMe, i);
+        if (!hostCanSend (getHost (announcer, tier->currentTracker->key)))
+            continue;
         tr_logAddTorDbg (tier->tor, "%s", "Announcing to tracker");
         dbgmsg (tier, "announcing tier %d of %d", i, n);
         tierAnnounce (announcer, tier);
@@ -1557,6 +1903,15 @@ announceMore (tr_announcer * announcer)
     /* scrape some */
     multiscrape (announcer, &scrapeMe);
 
+    /* requeue the tiers. those still waiting for a free slot will
+     * come up again next time, and the rest when their requests finish */
+    n = tr_ptrArraySize (&announceMe);
+    for (i=0; i<n; ++i)
+        tierSchedule (tr_ptrArrayNth (&announceMe, i));
+    n = tr_ptrArraySize (&scrapeMe);
+    for (i=0; i<n; ++i)
+        tierSchedule (tr_ptrArrayNth (&scrapeMe, i));
+
     /* cleanup */
     tr_ptrArrayDestruct (&scrapeMe, NULL);
     tr_ptrArrayDestruct (&announceMe, NULL);
@@ -1569,6 +1924,7 @@ onUpkeepTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vannouncer)
     tr_session * session = announcer->session;
     const bool is_closing = session->isClosed;
     const time_t now = tr_time ();
+    const uint64_t started = tr_metricsNow ();
 
     tr_sessionLock (session);
 
@@ -1588,6 +1944,7 @@ onUpkeepTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vannouncer)
     /* set up the next timer */
     tr_timerAdd (announcer->upkeepTimer, UPKEEP_INTERVAL_SECS, 0);
 
+    tr_metricsCallbackDone (session, TR_HISTOGRAM_ANNOUNCER_UPKEEP, started);
     tr_sessionUnlock (session);
 }
 
@@ -1595,6 +1952,122 @@ onUpkeepTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vannouncer)
 ****
 ***/
 
+static void
+getTrackerStat (const tr_torrent  * torrent,
+                const tr_tier     * tier,
+                int                 tierIndex,
+                const tr_tracker  * tracker,
+                time_t              now,
+                tr_tracker_stat   * st)
+{
+    const tr_tracker_host * host;
+
+    memset (st, 0, sizeof (tr_tracker_stat));
+
+    st->id = tracker->id;
+    tr_strlcpy (st->host, tracker->key, sizeof (st->host));
+    if ((host = findHost (torrent->session->announcer, tracker->key)))
+    {
+        st->hostAnnounceLatencyMsec = host->latencyMsec;
+        st->hostRequestsInFlight = host->inFlight;
+        st->hostRequestLimit = host->limit;
+    }
+    else
+    {
+        st->hostRequestLimit = HOST_LIMIT_INITIAL;
+    }
+    tr_strlcpy (st->announce, tracker->announce, sizeof (st->announce));
+    st->tier = tierIndex;
+    st->isBackup = tracker != tier->currentTracker;
+    st->lastScrapeStartTime = tier->lastScrapeStartTime;
+    if (tracker->scrape)
+        tr_strlcpy (st->scrape, tracker->scrape, sizeof (st->scrape));
+    else
+        st->scrape[0] = '\0';
+
+    st->seederCount = tracker->seederCount;
+    st->leecherCount = tracker->leecherCount;
+    st->downloadCount = tracker->downloadCount;
+
+    if (st->isBackup)
+    {
+        st->scrapeState = TR_TRACKER_INACTIVE;
+        st->announceState = TR_TRACKER_INACTIVE;
+        st->nextScrapeTime = 0;
+        st->nextAnnounceTime = 0;
+    }
+    else
+    {
+        if ((st->hasScraped = tier->lastScrapeTime != 0)) {
+            st->lastScrapeTime = tier->lastScrapeTime;
+            st->lastScrapeSucceeded = tier->lastScrapeSucceeded;
+            st->lastScrapeTimedOut = tier->lastScrapeTimedOut;
+            tr_strlcpy (st->lastScrapeResult, tier->lastScrapeStr,
+                        sizeof (st->lastScrapeResult));
+        }
+
+        if (tier->isScraping)
+            st->scrapeState = TR_TRACKER_ACTIVE;
+        else if (!tier->scrapeAt)
+            st->scrapeState = TR_TRACKER_INACTIVE;
+        else if (tier->scrapeAt > now)
+        {
+            st->scrapeState = TR_TRACKER_WAITING;
+            st->nextScrapeTime = tier->scrapeAt;
+        }
+        else
+            st->scrapeState = TR_TRACKER_QUEUED;
+
+        st->lastAnnounceStartTime = tier->lastAnnounceStartTime;
+
+        if ((st->hasAnnounced = tier->lastAnnounceTime != 0)) {
+            st->lastAnnounceTime = tier->lastAnnounceTime;
+            tr_strlcpy (st->lastAnnounceResult, tier->lastAnnounceStr,
+                        sizeof (st->lastAnnounceResult));
+            st->lastAnnounceSucceeded = tier->lastAnnounceSucceeded;
+            st->lastAnnounceTimedOut = tier->lastAnnounceTimedOut;
+            st->lastAnnouncePeerCount = tier->lastAnnouncePeerCount;
+        }
+
+        if (tier->isAnnouncing)
+            st->announceState = TR_TRACKER_ACTIVE;
+        else if (!torrent->isRunning || !tier->announceAt)
+            st->announceState = TR_TRACKER_INACTIVE;
+        else if (tier->announceAt > now)
+        {
+            st->announceState = TR_TRACKER_WAITING;
+            st->nextAnnounceTime = tier->announceAt;
+        }
+        else
+            st->announceState = TR_TRACKER_QUEUED;
+    }
+}
+
+void
+tr_announcerForeachStat (const tr_torrent   * torrent,
+                         tr_tracker_stat_func func,
+                         void               * user_data)
+{
+    int i, j;
+    tr_tracker_stat st;
+    const struct tr_torrent_tiers * tt;
+    const time_t now = tr_time ();
+
+    assert (tr_isTorrent (torrent));
+
+    tt = torrent->tiers;
+
+    for (i=0; i<tt->tier_count; ++i)
+    {
+        const tr_tier * const tier = &tt->tiers[i];
+        for (j=0; j<tier->tracker_count; ++j)
+        {
+            getTrackerStat (torrent, tier, i, &tier->trackers[j], now, &st);
+            func (&st, user_data);
+        }
+    }
+}
+
 tr_tracker_stat *
 tr_announcerStats (const tr_torrent * torrent, int * setmeTrackerCount)
 {
@@ -1610,7 +2083,7 @@ tr_announcerStats (const tr_torrent * torrent, int * setmeTrackerCount)
 
     /* alloc the stats */
     *setmeTrackerCount = tt->tracker_count;
-    ret = tr_new0 (tr_tracker_stat, tt->tracker_count);
+    ret = tr_new (tr_tracker_stat, tt->tracker_count);
 
     /* populate the stats */
     for (i=0; i<tt->tier_count; ++i)
@@ -1618,81 +2091,21 @@ tr_announcerStats (const tr_torrent * torrent, int * setmeTrackerCount)
         int j;
         const tr_tier * const tier = &tt->tiers[i];
         for (j=0; j<tier->tracker_count; ++j)
-        {
-            const tr_tracker * const tracker = &tier->trackers[j];
-            tr_tracker_stat * st = &ret[out++];
-
-            st->id = tracker->id;
-            tr_strlcpy (st->host, tracker->key, sizeof (st->host));
-            tr_strlcpy (st->announce, tracker->announce, sizeof (st->announce));
-            st->tier = i;
-            st->isBackup = tracker != tier->currentTracker;
-            st->lastScrapeStartTime = tier->lastScrapeStartTime;
-            if (tracker->scrape)
-                tr_strlcpy (st->scrape, tracker->scrape, sizeof (st->scrape));
-            else
-                st->scrape[0] = '\0';
-
-            st->seederCount = tracker->seederCount;
-            st->leecherCount = tracker->leecherCount;
-            st->downloadCount = tracker->downloadCount;
-
-            if (st->isBackup)
-            {
-                st->scrapeState = TR_TRACKER_INACTIVE;
-                st->announceState = TR_TRACKER_INACTIVE;
-                st->nextScrapeTime = 0;
-                st->nextAnnounceTime = 0;
-            }
-            else
-            {
-                if ((st->hasScraped = tier->lastScrapeTime != 0)) {
-                    st->lastScrapeTime = tier->lastScrapeTime;
-                    st->lastScrapeSucceeded = tier->lastScrapeSucceeded;
-                    st->lastScrapeTimedOut = tier->lastScrapeTimedOut;
-                    tr_strlcpy (st->lastScrapeResult, tier->lastScrapeStr,
-                                sizeof (st->lastScrapeResult));
-                }
-
-                if (tier->isScraping)
-                    st->scrapeState = TR_TRACKER_ACTIVE;
-                else if (!tier->scrapeAt)
-                    st->scrapeState = TR_TRACKER_INACTIVE;
-                else if (tier->scrapeAt > now)
-                {
-                    st->scrapeState = TR_TRACKER_WAITING;
-                    st->nextScrapeTime = tier->scrapeAt;
-                }
-                else
-                    st->scrapeState = TR_TRACKER_QUEUED;
+            getTrackerStat (torrent, tier, i, &tier->trackers[j], now, &ret[out++]);
+    }
 
-                st->lastAnnounceStartTime = tier->lastAnnounceStartTime;
+    return ret;
+}
 
-                if ((st->hasAnnounced = tier->lastAnnounceTime != 0)) {
-                    st->lastAnnounceTime = tier->lastAnnounceTime;
-                    tr_strlcpy (st->lastAnnounceResult, tier->lastAnnounceStr,
-                                sizeof (st->lastAnnounceResult));
-                    st->lastAnnounceSucceeded = tier->lastAnnounceSucceeded;
-                    st->lastAnnounceTimedOut = tier->lastAnnounceTimedOut;
-                    st->lastAnnouncePeerCount = tier->lastAnnouncePeerCount;
-                }
+const char *
+tr_announcerTrackerHost (const tr_torrent * torrent, int i)
+{
+    const struct tr_torrent_tiers * tt = torrent->tiers;
 
-                if (tier->isAnnouncing)
-                    st->announceState = TR_TRACKER_ACTIVE;
-                else if (!torrent->isRunning || !tier->announceAt)
-                    st->announceState = TR_TRACKER_INACTIVE;
-                else if (tier->announceAt > now)
-                {
-                    st->announceState = TR_TRACKER_WAITING;
-                    st->nextAnnounceTime = tier->announceAt;
-                }
-                else
-                    st->announceState = TR_TRACKER_QUEUED;
-            }
-        }
-    }
+    if (tt == NULL || i < 0 || i >= tt->tracker_count)
+        return NULL;
 
-    return ret;
+    return tt->trackers[i].host;
 }
 
 void
@@ -1725,6 +2138,8 @@ copy_tier_attributes_impl (struct tr_tier * tgt, int trackerIndex, const tr_tier
     tgt->announce_events = tr_memdup (src->announce_events, sizeof (tr_announce_event) * src->announce_event_count);
     tgt->announce_event_count = src->announce_event_count;
     tgt->announce_event_alloc = src->announce_event_count;
+    tgt->announcePrefix = keep.announcePrefix;
+    tgt->announcePrefixTracker = keep.announcePrefixTracker;
     tgt->currentTrackerIndex = trackerIndex;
     tgt->currentTracker = &tgt->trackers[trackerIndex];
     tgt->currentTracker->seederCount = src->currentTracker->seederCount;
@@ -1776,6 +2191,10 @@ tr_announcerResetTorrent (tr_announcer * announcer UNUSED, tr_torrent * tor)
             if (!tt->tiers[i].wasCopied)
                 tier_announce_event_push (&tt->tiers[i], TR_ANNOUNCE_EVENT_STARTED, now);
 
+    /* the copied tiers kept their old wakeups, but make sure */
+    for (i=0; i<tt->tier_count; ++i)
+        tierSchedule (&tt->tiers[i]);
+
     /* cleanup */
     tiersDestruct (&old);
 }
@@ -101,6 +101,25 @@ tr_tracker_stat * tr_announcerStats (const tr_torrent * torrent,
 void tr_announcerStatsFree (tr_tracker_stat * trackers,
                             int               trackerCount);
 
+typedef void (*tr_tracker_stat_func)(const tr_tracker_stat * stat,
+                                     void                  * user_data);
+
+/**
+ * Like tr_announcerStats (), but hands each tracker's stats to `func'
+ * in turn instead of allocating an array of them. `stat' is only valid
+ * until `func' returns.
+ */
+void tr_announcerForeachStat (const tr_torrent     * torrent,
+                              tr_tracker_stat_func   func,
+                              void                 * user_data);
+
+/**
+ * @return the host of the torrent's i'th tracker, or NULL if there's
+ *         no such tracker. Hosts are parsed once, when the trackers are
+ *         added, so this is cheap enough to call for every torrent.
+ */
+const char * tr_announcerTrackerHost (const tr_torrent * torrent, int i);
+
 /***
 ****
 ***/
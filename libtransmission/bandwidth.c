@@ -8,8 +8,11 @@
  */
 
 #include <assert.h>
+#include <math.h> /* exp () */
 #include <string.h> /* memset () */
 
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "bandwidth.h"
 #include "crypto.h" /* tr_cryptoWeakRandInt () */
@@ -29,57 +32,36 @@
 ****
 ***/
 
+static double
+decayFactor (uint64_t then, uint64_t now)
+{
+  if (now <= then)
+    return 1.0;
+
+  return exp (-(double)(now - then) / RATE_TIME_CONSTANT_MSEC);
+}
+
 static unsigned int
-getSpeed_Bps (const struct bratecontrol * r, unsigned int interval_msec, uint64_t now)
+getSpeed_Bps (const struct bratecontrol * r, uint64_t now)
 {
   if (!now)
     now = tr_time_msec ();
 
-  if (now != r->cache_time)
-    {
-      int i = r->newest;
-      uint64_t bytes = 0;
-      const uint64_t cutoff = now - interval_msec;
-      struct bratecontrol * rvolatile = (struct bratecontrol*) r;
-
-      for (;;)
-        {
-          if (r->transfers[i].date <= cutoff)
-            break;
-
-          bytes += r->transfers[i].size;
-
-          if (--i == -1)
-            i = HISTORY_SIZE - 1; /* circular history */
-
-          if (i == r->newest)
-            break; /* we've come all the way around */
-        }
-
-      rvolatile->cache_val = (unsigned int)((bytes * 1000u) / interval_msec);
-      rvolatile->cache_time = now;
-    }
-
-  return r->cache_val;
+  return (unsigned int)(r->rate_Bps * decayFactor (r->date, now));
 }
 
 static void
 bytesUsed (const uint64_t now, struct bratecontrol * r, size_t size)
 {
-  if (r->transfers[r->newest].date + GRANULARITY_MSEC >= now)
-    {
-      r->transfers[r->newest].size += size;
-    }
-  else
+  /* age the old estimate to now, then add the new bytes spread over
+     the time constant, so a steady stream converges on its true speed */
+  if (now > r->date)
     {
-      if (++r->newest == HISTORY_SIZE)
-        r->newest = 0;
-      r->transfers[r->newest].date = now;
-      r->transfers[r->newest].size = size;
+      r->rate_Bps *= decayFactor (r->date, now);
+      r->date = now;
     }
 
-  /* invalidate cache_val*/
-  r->cache_time = 0;
+  r->rate_Bps += size * 1000.0 / RATE_TIME_CONSTANT_MSEC;
 }
 
 /******
@@ -87,14 +69,23 @@ bytesUsed (const uint64_t now, struct bratecontrol * r, size_t size)
 *******
 ******/
 
-static int
-compareBandwidth (const void * va, const void * vb)
+/* the session's bandwidth has every peer as a child,
+   so its children are kept sorted with inlined comparisons */
+
+static inline const unsigned int *
+getChildKey (const tr_bandwidth * b)
+{
+  return &b->uniqueKey;
+}
+
+static inline int
+compareChildKeys (const unsigned int * a, const unsigned int * b)
 {
-  const tr_bandwidth * a = va;
-  const tr_bandwidth * b = vb;
-  return a->uniqueKey - b->uniqueKey;
+  return *a < *b ? -1 : (*a > *b ? 1 : 0);
 }
 
+TR_PTR_ARRAY_SORTED_FUNCS (children, tr_bandwidth, unsigned int, getChildKey, compareChildKeys)
+
 /***
 ****
 ***/
@@ -138,7 +129,7 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
   if (b->parent)
     {
       assert (tr_isBandwidth (b->parent));
-      tr_ptrArrayRemoveSortedPointer (&b->parent->children, b, compareBandwidth);
+      childrenRemoveSorted (&b->parent->children, b);
       b->parent = NULL;
     }
 
@@ -147,9 +138,9 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
       assert (tr_isBandwidth (parent));
       assert (parent->parent != b);
 
-      assert (tr_ptrArrayFindSorted (&parent->children, b, compareBandwidth) == NULL);
-      tr_ptrArrayInsertSorted (&parent->children, b, compareBandwidth);
-      assert (tr_ptrArrayFindSorted (&parent->children, b, compareBandwidth) == b);
+      assert (childrenFindSorted (&parent->children, &b->uniqueKey) == NULL);
+      childrenInsertSorted (&parent->children, b);
+      assert (childrenFindSorted (&parent->children, &b->uniqueKey) == b);
       b->parent = parent;
     }
 }
@@ -243,6 +234,7 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
   tr_ptrArray high = TR_PTR_ARRAY_INIT;
   tr_ptrArray normal = TR_PTR_ARRAY_INIT;
   struct tr_peerIo ** peers;
+  const uint64_t now = tr_time_msec ();
 
   /* allocateBandwidth () is a helper function with two purposes:
    * 1. allocate bandwidth to b and its subtree
@@ -258,6 +250,10 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
 
       tr_peerIoFlushOutgoingProtocolMsgs (io);
 
+      /* a peer with nothing left to send can't use any upload bandwidth */
+      if ((dir == TR_UP) && !evbuffer_get_length (io->outbuf))
+        continue;
+
       switch (io->priority)
         {
           case TR_PRI_SEQ: /* fall through */
@@ -280,7 +276,15 @@ tr_bandwidthAllocate (tr_bandwidth  * b,
    * This on-demand IO is enabled until (1) the peer runs out of bandwidth,
    * or (2) the next tr_bandwidthAllocate () call, when we start over again. */
   for (i=0; i<peerCount; ++i)
-    tr_peerIoSetEnabled (peers[i], dir, tr_peerIoHasBandwidthLeft (peers[i], dir));
+    {
+      const bool hasBandwidthLeft = tr_peerIoHasBandwidthLeft (peers[i], dir);
+
+      /* remember that the limits held this peer back, for its stall stats */
+      if (!hasBandwidthLeft)
+        peers[i]->bandwidth.band[dir].clampedAt = now;
+
+      tr_peerIoSetEnabled (peers[i], dir, hasBandwidthLeft);
+    }
 
   for (i=0; i<peerCount; ++i)
     tr_peerIoUnref (peers[i]);
@@ -316,6 +320,9 @@ bandwidthClamp (const tr_bandwidth  * b,
 
   if (b)
     {
+      if (b->band[dir].isPaused)
+        return 0;
+
       if (b->band[dir].isLimited)
         {
           byteCount = MIN (byteCount, b->band[dir].bytesLeft);
@@ -331,8 +338,8 @@ bandwidthClamp (const tr_bandwidth  * b,
               if (now == 0)
                 now = tr_time_msec ();
 
-              current = tr_bandwidthGetRawSpeed_Bps (b, now, TR_DOWN);
-              desired = tr_bandwidthGetDesiredSpeed_Bps (b, TR_DOWN);
+              current = tr_bandwidthGetRawSpeed_Bps (b, now, dir);
+              desired = tr_bandwidthGetDesiredSpeed_Bps (b, dir);
               r = desired >= 1 ? current / desired : 0;
 
                    if (r > 1.0) byteCount = 0;
@@ -362,7 +369,7 @@ tr_bandwidthGetRawSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const t
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].raw, HISTORY_MSEC, now);
+  return getSpeed_Bps (&b->band[dir].raw, now);
 }
 
 unsigned int
@@ -371,7 +378,7 @@ tr_bandwidthGetPieceSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const
   assert (tr_isBandwidth (b));
   assert (tr_isDirection (dir));
 
-  return getSpeed_Bps (&b->band[dir].piece, HISTORY_MSEC, now);
+  return getSpeed_Bps (&b->band[dir].piece, now);
 }
 
 void
@@ -31,10 +31,10 @@ struct tr_peerIo;
  * it's included in the header for inlining and composition. */
 enum
 {
-  HISTORY_MSEC = 2000u,
-  INTERVAL_MSEC = HISTORY_MSEC,
-  GRANULARITY_MSEC = 200,
-  HISTORY_SIZE = (INTERVAL_MSEC / GRANULARITY_MSEC),
+  /* time constant of the speed estimate. bytes count for 1/e as much
+     this long after they were transferred, so larger is smoother but
+     slower to follow changes. */
+  RATE_TIME_CONSTANT_MSEC = 2000u,
   BANDWIDTH_MAGIC_NUMBER = 43143
 };
 
@@ -42,10 +42,9 @@ enum
  * it's included in the header for inlining and composition. */
 struct bratecontrol
 {
-  int newest;
-  struct { uint64_t date, size; } transfers[HISTORY_SIZE];
-  uint64_t cache_time;
-  unsigned int cache_val;
+  /* exponentially-weighted moving average of the speed as of `date' */
+  double rate_Bps;
+  uint64_t date;
 };
 
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
@@ -53,9 +52,11 @@ struct bratecontrol
 struct tr_band
 {
   bool isLimited;
+  bool isPaused; /* see tr_bandwidthSetPaused () */
   bool honorParentLimits;
   unsigned int bytesLeft;
   unsigned int desiredSpeed_Bps;
+  uint64_t clampedAt; /* tr_time_msec () when its peer-io last ran out */
   struct bratecontrol raw;
   struct bratecontrol piece;
 };
@@ -91,6 +92,8 @@ struct tr_band
  *   speed and will decide how many bytes to make available over the
  *   user-specified period to reach the user-specified desired speed.
  *   If appropriate, it notifies its peer-ios that new bandwidth is available.
+ *   Peers may use their whole allotment as soon as it's handed out, so a
+ *   short period spreads rate-limited traffic more evenly.
  *
  *   tr_bandwidthAllocate () operates on the tr_bandwidth subtree, so usually
  *   you'll only need to invoke it for the top-level tr_session bandwidth.
@@ -177,6 +180,18 @@ tr_bandwidthSetLimited (tr_bandwidth  * bandwidth,
   return didChange;
 }
 
+/**
+ * @brief Stop this bandwidth subtree's peer-ios from using any bandwidth,
+ * whatever the limits are, e.g. until the disk has caught up
+ */
+static inline void
+tr_bandwidthSetPaused (tr_bandwidth  * bandwidth,
+                       tr_direction    dir,
+                       bool            isPaused)
+{
+  bandwidth->band[dir].isPaused = isPaused;
+}
+
 /**
  * @return nonzero if this bandwidth throttles its peer-ios speeds
  */
@@ -201,6 +216,18 @@ unsigned int tr_bandwidthClamp (const tr_bandwidth  * bandwidth,
                                 tr_direction          direction,
                                 unsigned int          byteCount);
 
+/**
+ * @return the tr_time_msec () of the last tr_bandwidthAllocate () period that
+ * ended with this peer bandwidth, or one of its parents, out of bytes.
+ * Zero if that's never happened.
+ */
+static inline uint64_t
+tr_bandwidthGetClampedAt (const tr_bandwidth  * bandwidth,
+                          tr_direction          dir)
+{
+  return bandwidth->band[dir].clampedAt;
+}
+
 /******
 *******
 ******/
@@ -0,0 +1,668 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/**
+ * Micro-benchmarks for libtransmission's hot paths.
+ * Run them with `make benchmarks'.
+ *
+ * Each benchmark runs BENCH_RUNS times and reports its best run,
+ * with a fixed random seed so that runs are comparable across builds.
+ * On glibc, allocations are counted by wrapping malloc () and friends.
+ */
+
+#include <stdio.h> /* printf (), remove () */
+#include <stdlib.h> /* rand (), srand () */
+#include <string.h> /* memset () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "blocklist.h"
+#include "cache.h"
+#include "crypto.h" /* tr_sha1 (), tr_cryptoRandInt () */
+#include "file.h"
+#include "net.h"
+#include "ptrarray.h"
+#include "session.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define BENCH_RUNS 3
+
+/***
+****  Allocation counting
+***/
+
+static uint64_t allocCount = 0;
+
+#if defined (__GLIBC__) && !defined (__SANITIZE_ADDRESS__)
+
+#define HAVE_ALLOC_COUNT 1
+
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+
+void *
+malloc (size_t size)
+{
+  ++allocCount;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  ++allocCount;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void * ptr, size_t size)
+{
+  ++allocCount;
+  return __libc_realloc (ptr, size);
+}
+
+#endif
+
+/***
+****  Timing
+***/
+
+struct bench
+{
+  const char * name;
+  uint64_t ops;
+  uint64_t best_usec;
+  uint64_t best_allocs;
+  uint64_t start_usec;
+  uint64_t start_allocs;
+};
+
+static uint64_t
+now_usec (void)
+{
+  struct timeval tv;
+  tr_gettimeofday (&tv);
+  return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static void
+benchInit (struct bench * b, const char * name, uint64_t ops)
+{
+  memset (b, 0, sizeof (struct bench));
+  b->name = name;
+  b->ops = ops;
+  b->best_usec = UINT64_MAX;
+}
+
+static void
+benchStart (struct bench * b)
+{
+  b->start_allocs = allocCount;
+  b->start_usec = now_usec ();
+}
+
+static void
+benchStop (struct bench * b)
+{
+  const uint64_t usec = now_usec () - b->start_usec;
+  const uint64_t allocs = allocCount - b->start_allocs;
+
+  if (b->best_usec > usec)
+    {
+      b->best_usec = usec;
+      b->best_allocs = allocs;
+    }
+}
+
+static void
+benchReport (const struct bench * b)
+{
+  const double secs = MAX (b->best_usec, 1) / 1000000.0;
+
+#ifdef HAVE_ALLOC_COUNT
+  printf ("%-40s %14.0f ops/s %12.2f allocs/op\n",
+          b->name, b->ops / secs, (double)b->best_allocs / b->ops);
+#else
+  printf ("%-40s %14.0f ops/s %12s allocs/op\n",
+          b->name, b->ops / secs, "n/a");
+#endif
+}
+
+/***
+****  tr_bitfield
+***/
+
+static void
+bench_bitfield_size (size_t bit_count, const char * label)
+{
+  int run;
+  size_t i;
+  char name[64];
+  struct bench b;
+  tr_bitfield bf;
+  tr_bitfield copy;
+  const size_t n = 1000000;
+  const size_t range_count = MAX (1, 2000000000u / bit_count / 1000);
+  size_t * bits = tr_new (size_t, n);
+  volatile size_t sink = 0;
+
+  for (i=0; i<n; ++i)
+    bits[i] = (size_t)rand () % bit_count;
+
+  tr_bitfieldConstruct (&bf, bit_count);
+  tr_bitfieldConstruct (&copy, bit_count);
+
+  tr_snprintf (name, sizeof (name), "bitfield %s add", label);
+  benchInit (&b, name, n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      tr_bitfieldSetHasNone (&bf);
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        tr_bitfieldAdd (&bf, bits[i]);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_snprintf (name, sizeof (name), "bitfield %s has", label);
+  benchInit (&b, name, n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        sink += tr_bitfieldHas (&bf, bits[i]);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_snprintf (name, sizeof (name), "bitfield %s count range", label);
+  benchInit (&b, name, range_count);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<range_count; ++i)
+        {
+          const size_t begin = MIN (bits[i], bits[i+1]);
+          const size_t end = MAX (bits[i], bits[i+1]) + 1;
+          sink += tr_bitfieldCountRange (&bf, begin, end);
+        }
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_snprintf (name, sizeof (name), "bitfield %s copy", label);
+  benchInit (&b, name, 1000);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<1000; ++i)
+        tr_bitfieldSetFromBitfield (&copy, &bf);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_bitfieldDestruct (&copy);
+  tr_bitfieldDestruct (&bf);
+  tr_free (bits);
+}
+
+static void
+bench_bitfield (void)
+{
+  bench_bitfield_size (20000, "20k bits");
+  bench_bitfield_size (2000000, "2M bits");
+}
+
+/***
+****  tr_variant
+***/
+
+/* something shaped like a large multi-file torrent */
+static void
+build_variant (tr_variant * top)
+{
+  int i;
+  tr_variant * info;
+  tr_variant * files;
+  const int file_count = 2000;
+
+  tr_variantInitDict (top, 4);
+  tr_variantDictAddStr (top, TR_KEY_announce, "http://tracker.example.com/announce");
+  tr_variantDictAddStr (top, TR_KEY_created_by, "Transmission");
+  tr_variantDictAddInt (top, TR_KEY_creation_date, 1400000000);
+  info = tr_variantDictAddDict (top, TR_KEY_info, 3);
+  tr_variantDictAddStr (info, TR_KEY_name, "benchmark");
+  tr_variantDictAddInt (info, TR_KEY_piece_length, 262144);
+  files = tr_variantDictAddList (info, TR_KEY_files, file_count);
+
+  for (i=0; i<file_count; ++i)
+    {
+      char buf[64];
+      tr_variant * file = tr_variantListAddDict (files, 2);
+      tr_variant * path;
+
+      tr_variantDictAddInt (file, TR_KEY_length, (int64_t)rand () * 16);
+      path = tr_variantDictAddList (file, TR_KEY_path, 2);
+      tr_snprintf (buf, sizeof (buf), "directory-%d", i / 100);
+      tr_variantListAddStr (path, buf);
+      tr_snprintf (buf, sizeof (buf), "file-number-%d.dat", i);
+      tr_variantListAddStr (path, buf);
+    }
+}
+
+static void
+bench_variant_fmt (const tr_variant * top, tr_variant_fmt fmt, const char * label)
+{
+  int i;
+  int run;
+  int len;
+  char name[64];
+  struct bench b;
+  char * str = tr_variantToStr (top, fmt, &len);
+  const int n = 20;
+
+  tr_snprintf (name, sizeof (name), "variant %s parse", label);
+  benchInit (&b, name, n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        {
+          tr_variant v;
+          if (!tr_variantFromBuf (&v, fmt, str, len, NULL, NULL))
+            tr_variantFree (&v);
+        }
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_snprintf (name, sizeof (name), "variant %s serialize", label);
+  benchInit (&b, name, n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        tr_free (tr_variantToStr (top, fmt, NULL));
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_free (str);
+}
+
+/* something shaped like a torrent-get response for file-heavy torrents:
+   mostly names and paths, with a few numbers per file */
+static void
+build_torrent_get (tr_variant * top)
+{
+  int i, j;
+  tr_variant * torrents;
+  const int torrent_count = 50;
+  const int file_count = 200;
+
+  tr_variantInitDict (top, 1);
+  torrents = tr_variantDictAddList (top, TR_KEY_torrents, torrent_count);
+
+  for (i=0; i<torrent_count; ++i)
+    {
+      char buf[128];
+      tr_variant * files;
+      tr_variant * tor = tr_variantListAddDict (torrents, 6);
+
+      tr_snprintf (buf, sizeof (buf), "Some.Long.Torrent.Name.%d.1080p.x264-GROUP", i);
+      tr_variantDictAddStr (tor, TR_KEY_name, buf);
+      tr_variantDictAddStr (tor, TR_KEY_errorString, i % 10 ? "" : "Tracker gave HTTP response code 404 (\"Not Found\")");
+      tr_variantDictAddReal (tor, TR_KEY_percentDone, (double)rand () / RAND_MAX);
+      tr_variantDictAddReal (tor, TR_KEY_uploadRatio, rand () % 1000 / 100.0);
+      tr_variantDictAddInt (tor, TR_KEY_rateDownload, rand ());
+      files = tr_variantDictAddList (tor, TR_KEY_files, file_count);
+
+      for (j=0; j<file_count; ++j)
+        {
+          tr_variant * file = tr_variantListAddDict (files, 3);
+          tr_snprintf (buf, sizeof (buf), "Some.Long.Torrent.Name.%d/Season %02d/Episode %03d - \"Title\".mkv", i, j / 20, j);
+          tr_variantDictAddStr (file, TR_KEY_name, buf);
+          tr_variantDictAddInt (file, TR_KEY_length, (int64_t)rand () * 64);
+          tr_variantDictAddInt (file, TR_KEY_bytesCompleted, (int64_t)rand () * 32);
+        }
+    }
+}
+
+static void
+bench_variant (void)
+{
+  int i;
+  int run;
+  tr_variant top;
+  struct bench b;
+  const int n = 20;
+
+  build_variant (&top);
+  bench_variant_fmt (&top, TR_VARIANT_FMT_BENC, "benc");
+  bench_variant_fmt (&top, TR_VARIANT_FMT_JSON, "json");
+  tr_variantFree (&top);
+
+  build_torrent_get (&top);
+  benchInit (&b, "variant json torrent-get serialize", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        {
+          evbuffer_free (tr_variantToBuf (&top, TR_VARIANT_FMT_JSON_LEAN));
+        }
+      benchStop (&b);
+    }
+  benchReport (&b);
+  tr_variantFree (&top);
+}
+
+/***
+****  tr_ptrArray
+***/
+
+static int
+compareInts (const void * va, const void * vb)
+{
+  const intptr_t a = (intptr_t) va;
+  const intptr_t b = (intptr_t) vb;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void
+bench_ptrarray (void)
+{
+  int i;
+  int run;
+  struct bench insert;
+  struct bench find;
+  struct bench remove;
+  tr_ptrArray a = TR_PTR_ARRAY_INIT;
+  const int n = 20000;
+  intptr_t * values = tr_new (intptr_t, n);
+  volatile intptr_t sink = 0;
+
+  for (i=0; i<n; ++i)
+    values[i] = (intptr_t)i * 7919 % n + 1; /* distinct, unordered */
+
+  benchInit (&insert, "ptrarray insert sorted", n);
+  benchInit (&find, "ptrarray find sorted", n);
+  benchInit (&remove, "ptrarray remove sorted", n);
+
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&insert);
+      for (i=0; i<n; ++i)
+        tr_ptrArrayInsertSorted (&a, (void*)values[i], compareInts);
+      benchStop (&insert);
+
+      benchStart (&find);
+      for (i=0; i<n; ++i)
+        sink += (intptr_t) tr_ptrArrayFindSorted (&a, (void*)values[i], compareInts);
+      benchStop (&find);
+
+      benchStart (&remove);
+      for (i=0; i<n; ++i)
+        tr_ptrArrayRemoveSortedPointer (&a, (void*)values[i], compareInts);
+      benchStop (&remove);
+    }
+
+  benchReport (&insert);
+  benchReport (&find);
+  benchReport (&remove);
+
+  tr_ptrArrayDestruct (&a, NULL);
+  tr_free (values);
+}
+
+/***
+****  Blocklists
+***/
+
+static void
+bench_blocklist (void)
+{
+  int i;
+  int run;
+  char * sandbox;
+  char * src;
+  char * bin;
+  struct bench b;
+  struct evbuffer * text;
+  tr_blocklistFile * blocklist;
+  tr_address * addrs;
+  const int rule_count = 50000;
+  const int n = 1000000;
+  volatile int sink = 0;
+
+  /* a blocklist of scattered ranges */
+  text = evbuffer_new ();
+  for (i=0; i<rule_count; ++i)
+    {
+      const uint32_t begin = (uint32_t)i * 85000u;
+      evbuffer_add_printf (text, "rule %d:%u.%u.%u.%u-%u.%u.%u.%u\n", i,
+                           begin >> 24, (begin >> 16) & 0xff, (begin >> 8) & 0xff, begin & 0xff,
+                           begin >> 24, (begin >> 16) & 0xff, (begin >> 8) & 0xff, 0xffu);
+    }
+
+  sandbox = libtest_sandbox_create ();
+  src = tr_buildPath (sandbox, "blocklist.txt", NULL);
+  bin = tr_buildPath (sandbox, "blocklist.bin", NULL);
+  libtest_create_file_with_contents (src, evbuffer_pullup (text, -1), evbuffer_get_length (text));
+  tr_blocklistCompile (src, bin);
+  blocklist = tr_blocklistFileNew (bin, true);
+
+  addrs = tr_new0 (tr_address, n);
+  for (i=0; i<n; ++i)
+    {
+      addrs[i].type = TR_AF_INET;
+      addrs[i].addr.addr4.s_addr = htonl (((uint32_t)rand () << 16) ^ (uint32_t)rand ());
+    }
+
+  benchInit (&b, "blocklist lookup (50k rules)", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        sink += tr_blocklistFileHasAddress (blocklist, &addrs[i]);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_free (addrs);
+  tr_blocklistFileFree (blocklist);
+  evbuffer_free (text);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (bin);
+  tr_free (src);
+  tr_free (sandbox);
+}
+
+/***
+****  SHA-1
+***/
+
+static void
+bench_sha1 (void)
+{
+  int i;
+  int run;
+  struct bench b;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  const int piece_size = 262144;
+  const int n = 200;
+  uint8_t * piece = tr_new (uint8_t, piece_size);
+
+  for (i=0; i<piece_size; ++i)
+    piece[i] = (uint8_t) rand ();
+
+  benchInit (&b, "sha1 256 KiB piece", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        tr_sha1 (hash, piece, piece_size, NULL);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  tr_free (piece);
+}
+
+/***
+****  Random numbers
+***/
+
+static void
+bench_random (void)
+{
+  int i;
+  int run;
+  struct bench b;
+  int sum = 0;
+  uint8_t peer_id[20];
+  const int n = 1000000;
+
+  benchInit (&b, "tr_cryptoRandInt", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        sum += tr_cryptoRandInt (4096);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  benchInit (&b, "tr_cryptoRandBuf 20 bytes", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        tr_cryptoRandBuf (peer_id, sizeof (peer_id));
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  benchInit (&b, "tr_cryptoWeakRandInt", n);
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&b);
+      for (i=0; i<n; ++i)
+        sum += tr_cryptoWeakRandInt (4096);
+      benchStop (&b);
+    }
+  benchReport (&b);
+
+  /* keep the loops from being optimized away */
+  if (sum == 42)
+    printf ("%d\n", sum + peer_id[0]);
+}
+
+/***
+****  tr_cache
+***/
+
+struct cache_bench_data
+{
+  tr_session * session;
+  tr_torrent * tor;
+  struct bench write;
+  struct bench flush;
+  bool done;
+};
+
+/* the cache may only be used from the libtransmission thread */
+static void
+bench_cache_threadfunc (void * vdata)
+{
+  int run;
+  tr_block_index_t i;
+  struct cache_bench_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = data->session->cache;
+  struct evbuffer * block = evbuffer_new ();
+  uint8_t * zeroes = tr_new0 (uint8_t, tor->blockSize);
+
+  for (run=0; run<BENCH_RUNS; ++run)
+    {
+      benchStart (&data->write);
+      for (i=0; i<tor->blockCount; ++i)
+        {
+          tr_piece_index_t piece;
+          uint32_t offset;
+          uint32_t length;
+
+          tr_torrentGetBlockLocation (tor, i, &piece, &offset, &length);
+          evbuffer_add (block, zeroes, length);
+          tr_cacheWriteBlock (cache, tor, piece, offset, length, block);
+        }
+      benchStop (&data->write);
+
+      benchStart (&data->flush);
+      tr_cacheFlushTorrent (cache, tor);
+      benchStop (&data->flush);
+    }
+
+  tr_free (zeroes);
+  evbuffer_free (block);
+  data->done = true;
+}
+
+static void
+bench_cache (void)
+{
+  struct cache_bench_data data;
+
+  data.session = libttest_session_init (NULL);
+  data.tor = libttest_zero_torrent_init (data.session);
+  libttest_zero_torrent_populate (data.tor, false);
+  tr_sessionSetCacheLimit_MB (data.session, 64);
+
+  benchInit (&data.write, "cache write block", data.tor->blockCount);
+  benchInit (&data.flush, "cache flush torrent (per block)", data.tor->blockCount);
+  data.done = false;
+  tr_runInEventThread (data.session, bench_cache_threadfunc, &data);
+  do { tr_wait_msec (50); } while (!data.done);
+  benchReport (&data.write);
+  benchReport (&data.flush);
+
+  tr_torrentRemove (data.tor, true, remove);
+  libttest_session_close (data.session);
+}
+
+/***
+****
+***/
+
+int
+main (void)
+{
+  srand (1);
+  setvbuf (stdout, NULL, _IOLBF, 0);
+
+  printf ("best of %d runs\n", BENCH_RUNS);
+  bench_bitfield ();
+  bench_variant ();
+  bench_ptrarray ();
+  bench_blocklist ();
+  bench_sha1 ();
+  bench_random ();
+  bench_cache ();
+
+  return 0;
+}
@@ -117,12 +117,200 @@ test_bitfields (void)
   return 0;
 }
 
+static int
+test_bitfield_and_not (void)
+{
+  size_t i;
+  size_t n;
+  size_t count;
+  size_t first;
+  size_t begin;
+  size_t end;
+  tr_bitfield a;
+  tr_bitfield b;
+  tr_bitfield c;
+  const size_t bitCount = 100 + tr_cryptoWeakRandInt (1000);
+
+  /* generate two random bitfields */
+  tr_bitfieldConstruct (&a, bitCount);
+  tr_bitfieldConstruct (&b, bitCount);
+  for (i=0, n=tr_cryptoWeakRandInt (bitCount); i<n; ++i)
+    tr_bitfieldAdd (&a, tr_cryptoWeakRandInt (bitCount));
+  for (i=0, n=tr_cryptoWeakRandInt (bitCount); i<n; ++i)
+    tr_bitfieldAdd (&b, tr_cryptoWeakRandInt (bitCount));
+  begin = tr_cryptoWeakRandInt (bitCount);
+  end = begin + tr_cryptoWeakRandInt (bitCount - begin) + 1;
+
+  /* test tr_bitfieldFirstAndNot, tr_bitfieldCountAndNot, tr_bitfieldFirstZero */
+  count = 0;
+  first = end;
+  for (i=begin; i<end; ++i)
+    if (tr_bitfieldHas (&a, i) && !tr_bitfieldHas (&b, i))
+      if (!count++)
+        first = i;
+  check_int_eq (first, tr_bitfieldFirstAndNot (&a, &b, begin, end));
+  check_int_eq (count, tr_bitfieldCountAndNot (&a, &b, begin, end));
+
+  for (first=begin; first<end; ++first)
+    if (tr_bitfieldHas (&a, first) && tr_bitfieldHas (&b, first))
+      break;
+  check_int_eq (first, tr_bitfieldFirstAnd (&a, &b, begin, end));
+
+  for (first=begin; first<end && tr_bitfieldHas (&a, first); ++first)
+    ;
+  check_int_eq (first, tr_bitfieldFirstZero (&a, begin, end));
+
+  /* test tr_bitfieldAnd and tr_bitfieldAndNot */
+  tr_bitfieldConstruct (&c, bitCount);
+  tr_bitfieldSetFromBitfield (&c, &a);
+  tr_bitfieldAnd (&c, &b);
+  for (i=0; i<bitCount; ++i)
+    check (tr_bitfieldHas (&c, i) == (tr_bitfieldHas (&a, i) && tr_bitfieldHas (&b, i)));
+  check_int_eq (tr_bitfieldCountRange (&c, 0, bitCount), tr_bitfieldCountTrueBits (&c));
+
+  tr_bitfieldSetFromBitfield (&c, &a);
+  tr_bitfieldAndNot (&c, &b);
+  for (i=0; i<bitCount; ++i)
+    check (tr_bitfieldHas (&c, i) == (tr_bitfieldHas (&a, i) && !tr_bitfieldHas (&b, i)));
+  check_int_eq (tr_bitfieldCountAndNot (&a, &b, 0, bitCount), tr_bitfieldCountTrueBits (&c));
+
+  /* test the have-all and have-none special cases */
+  tr_bitfieldSetHasAll (&c);
+  check_int_eq (tr_bitfieldFirstAndNot (&c, &b, 0, bitCount), tr_bitfieldFirstZero (&b, 0, bitCount));
+  tr_bitfieldAndNot (&c, &b);
+  check_int_eq (bitCount - tr_bitfieldCountTrueBits (&b), tr_bitfieldCountTrueBits (&c));
+  tr_bitfieldSetHasNone (&c);
+  check_int_eq (bitCount, tr_bitfieldFirstAndNot (&c, &b, 0, bitCount));
+
+  /* cleanup */
+  tr_bitfieldDestruct (&c);
+  tr_bitfieldDestruct (&b);
+  tr_bitfieldDestruct (&a);
+  return 0;
+}
+
+/* big enough to be kept in chunks, and not a multiple of the chunk size */
+#define CHUNKED_BIT_COUNT 300007
+
+static int
+checkChunkedBitfield (const tr_bitfield * b, const bool * flags)
+{
+  size_t i;
+  size_t count = 0;
+
+  for (i=0; i<CHUNKED_BIT_COUNT; ++i)
+    {
+      check (tr_bitfieldHas (b, i) == flags[i]);
+      count += flags[i];
+    }
+
+  check_int_eq (count, tr_bitfieldCountTrueBits (b));
+  check_int_eq (count, tr_bitfieldCountRange (b, 0, CHUNKED_BIT_COUNT));
+  return 0;
+}
+
+static int
+test_bitfield_chunked (void)
+{
+  int l;
+  int ret;
+  size_t i;
+  size_t byte_count;
+  void * raw;
+  tr_bitfield a;
+  tr_bitfield b;
+  bool * flags = tr_new0 (bool, CHUNKED_BIT_COUNT);
+  bool * flags2 = tr_new0 (bool, CHUNKED_BIT_COUNT);
+
+  tr_bitfieldConstruct (&a, CHUNKED_BIT_COUNT);
+  tr_bitfieldConstruct (&b, CHUNKED_BIT_COUNT);
+
+  /* a mix of single bits and ranges of all sizes, some spanning chunks */
+  for (l=0; l<60; ++l)
+    {
+      const int op = tr_cryptoWeakRandInt (4);
+      const size_t begin = tr_cryptoWeakRandInt (CHUNKED_BIT_COUNT);
+      const size_t len = l % 10 == 0 ? CHUNKED_BIT_COUNT - begin
+                                     : 1 + (size_t) tr_cryptoWeakRandInt (MIN (100000, CHUNKED_BIT_COUNT - begin));
+      const size_t end = begin + len;
+
+      if (op == 0)
+        {
+          tr_bitfieldAdd (&a, begin);
+          flags[begin] = true;
+        }
+      else if (op == 1)
+        {
+          tr_bitfieldRem (&a, begin);
+          flags[begin] = false;
+        }
+      else
+        {
+          if (op == 2)
+            tr_bitfieldAddRange (&a, begin, end);
+          else
+            tr_bitfieldRemRange (&a, begin, end);
+          for (i=begin; i<end; ++i)
+            flags[i] = op == 2;
+        }
+
+      if ((ret = checkChunkedBitfield (&a, flags)))
+        return ret;
+    }
+
+  /* round-trip it through the raw wire format */
+  raw = tr_bitfieldGetRaw (&a, &byte_count);
+  check_int_eq ((CHUNKED_BIT_COUNT + 7) / 8, byte_count);
+  tr_bitfieldSetRaw (&b, raw, byte_count, true);
+  tr_free (raw);
+  if ((ret = checkChunkedBitfield (&b, flags)))
+    return ret;
+
+  /* and, and not */
+  tr_bitfieldSetHasNone (&b);
+  for (i=0; i<CHUNKED_BIT_COUNT; ++i)
+    flags2[i] = false;
+  for (l=0; l<5; ++l)
+    {
+      const size_t begin = tr_cryptoWeakRandInt (CHUNKED_BIT_COUNT);
+      const size_t end = begin + tr_cryptoWeakRandInt (CHUNKED_BIT_COUNT - begin);
+      tr_bitfieldAddRange (&b, begin, end);
+      for (i=begin; i<end; ++i)
+        flags2[i] = true;
+    }
+  tr_bitfieldAdd (&b, 12345);
+  flags2[12345] = true;
+
+  tr_bitfieldAnd (&a, &b);
+  for (i=0; i<CHUNKED_BIT_COUNT; ++i)
+    flags[i] = flags[i] && flags2[i];
+  if ((ret = checkChunkedBitfield (&a, flags)))
+    return ret;
+
+  tr_bitfieldSetHasAll (&a);
+  tr_bitfieldAndNot (&a, &b);
+  for (i=0; i<CHUNKED_BIT_COUNT; ++i)
+    flags[i] = !flags2[i];
+  if ((ret = checkChunkedBitfield (&a, flags)))
+    return ret;
+
+  tr_bitfieldSetFromFlags (&b, flags, CHUNKED_BIT_COUNT);
+  if ((ret = checkChunkedBitfield (&b, flags)))
+    return ret;
+
+  tr_bitfieldDestruct (&b);
+  tr_bitfieldDestruct (&a);
+  tr_free (flags2);
+  tr_free (flags);
+  return 0;
+}
+
 int
 main (void)
 {
   int l;
   int ret;
-  const testFunc tests[] = { test_bitfields };
+  const testFunc tests[] = { test_bitfields, test_bitfield_chunked };
 
   if ((ret = runTests (tests, NUM_TESTS (tests))))
     return ret;
@@ -132,5 +320,10 @@ main (void)
     if ((ret = test_bitfield_count_range ()))
       return ret;
 
+  /* bitfield AND NOT */
+  for (l=0; l<1000; ++l)
+    if ((ret = test_bitfield_and_not ()))
+      return ret;
+
   return 0;
 }
@@ -15,40 +15,176 @@
 #include "bitfield.h"
 #include "utils.h" /* tr_new0 () */
 
-const tr_bitfield TR_BITFIELD_INIT = { NULL, 0, 0, 0, false, false };
+const tr_bitfield TR_BITFIELD_INIT = { NULL, 0, NULL, NULL, 0, 0, 0, false, false };
 
 /****
 *****
 ****/
 
-static const int8_t trueBitCount[256] =
-{
-  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-  1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-  1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-  1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-  2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-  3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-  3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-  4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
+/* The bits are stored in wire order: the first bit is the high bit of the
+ * first byte. To work on many bits at a time we load them as big-endian
+ * 64-bit words, where the first bit is the word's high bit. */
+
+enum
+{
+  WORD_BITS = 64,
+  WORD_BYTES = 8,
+
+  /* bitfields of CHUNKED_MIN_BITS or more are stored in chunks */
+  CHUNK_BYTES = 4096,
+  CHUNK_BITS = CHUNK_BYTES * 8,
+  CHUNK_WORDS = CHUNK_BYTES / WORD_BYTES,
+  CHUNKED_MIN_BITS = CHUNK_BITS * 4
 };
 
+static inline bool
+is_chunked (const tr_bitfield * b)
+{
+  return b->chunk_count != 0;
+}
+
+/* the number of bits in the nth chunk. Only the last one can be short */
+static inline size_t
+chunk_bit_count (const tr_bitfield * b, size_t n)
+{
+  return n + 1 < b->chunk_count ? CHUNK_BITS : b->bit_count - n * CHUNK_BITS;
+}
+
+static inline int
+popcount64 (uint64_t x)
+{
+#if defined (__GNUC__)
+  return __builtin_popcountll (x);
+#else
+  x = x - ((x >> 1) & UINT64_C (0x5555555555555555));
+  x = (x & UINT64_C (0x3333333333333333)) + ((x >> 2) & UINT64_C (0x3333333333333333));
+  x = (x + (x >> 4)) & UINT64_C (0x0f0f0f0f0f0f0f0f);
+  return (int)((x * UINT64_C (0x0101010101010101)) >> 56);
+#endif
+}
+
+/* the number of leading zero bits. x must be nonzero */
+static inline int
+clz64 (uint64_t x)
+{
+#if defined (__GNUC__)
+  return __builtin_clzll (x);
+#else
+  int n = 0;
+  while (!(x & (UINT64_C (1) << 63)))
+    {
+      x <<= 1;
+      ++n;
+    }
+  return n;
+#endif
+}
+
+static inline uint64_t
+load_word (const uint8_t * p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48)
+       | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32)
+       | ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16)
+       | ((uint64_t)p[6] << 8)  | ((uint64_t)p[7]);
+}
+
+static inline void
+store_word (uint8_t * p, uint64_t word)
+{
+  int i;
+
+  for (i=WORD_BYTES-1; i>=0; --i, word>>=8)
+    p[i] = (uint8_t) word;
+}
+
+/* a mask of the bits in the nth word that fall inside [begin, end) */
+static inline uint64_t
+get_range_mask (size_t n, size_t begin, size_t end)
+{
+  uint64_t mask = ~UINT64_C (0);
+  const size_t first_bit = n * WORD_BITS;
+
+  if (begin > first_bit)
+    mask >>= begin - first_bit;
+
+  if (end < first_bit + WORD_BITS)
+    mask &= ~(~UINT64_C (0) >> (end - first_bit));
+
+  return mask;
+}
+
+/* get_raw_word () for chunked bitfields */
+static inline uint64_t
+get_chunked_word (const tr_bitfield * b, size_t n)
+{
+  const size_t chunk = n / CHUNK_WORDS;
+  const uint8_t * p;
+
+  if ((b->chunks == NULL) || (n * WORD_BITS >= b->bit_count))
+    return 0;
+
+  p = b->chunks[chunk];
+
+  if (p != NULL)
+    return load_word (p + (n % CHUNK_WORDS) * WORD_BYTES);
+
+  /* the chunk's bits are all set or all unset */
+  return b->chunk_true_counts[chunk] ? get_range_mask (n, 0, b->bit_count) : 0;
+}
+
+/* get the nth 64-bit word of the bit array, treating unallocated bits as zero */
+static inline uint64_t
+get_raw_word (const tr_bitfield * b, size_t n)
+{
+  size_t i;
+  uint64_t ret = 0;
+  const size_t first_byte = n * WORD_BYTES;
+
+  if (is_chunked (b))
+    return get_chunked_word (b, n);
+
+  if (first_byte >= b->alloc_count)
+    return 0;
+
+  if (first_byte + WORD_BYTES <= b->alloc_count)
+    return load_word (b->bits + first_byte);
+
+  for (i=0; i<WORD_BYTES; ++i)
+    {
+      ret <<= 8;
+      if (first_byte + i < b->alloc_count)
+        ret |= b->bits[first_byte + i];
+    }
+
+  return ret;
+}
+
+/* like get_raw_word (), but honors the have-all hint */
+static inline uint64_t
+get_word (const tr_bitfield * b, size_t n)
+{
+  return tr_bitfieldHasAll (b) ? ~UINT64_C (0) : get_raw_word (b, n);
+}
+
 static size_t
 countArray (const tr_bitfield * b)
 {
+  size_t i;
   size_t ret = 0;
-  ssize_t i = b->alloc_count;
+  const size_t word_count = (b->alloc_count + WORD_BYTES - 1) / WORD_BYTES;
+
+  if (is_chunked (b))
+    {
+      if (b->chunks != NULL)
+        for (i=0; i<b->chunk_count; ++i)
+          ret += b->chunk_true_counts[i];
 
-  while (--i >= 0)
-    ret += trueBitCount[b->bits[i]];
+      return ret;
+    }
+
+  for (i=0; i<word_count; ++i)
+    ret += popcount64 (get_raw_word (b, i));
 
   return ret;
 }
@@ -56,62 +192,22 @@ countArray (const tr_bitfield * b)
 static size_t
 countRange (const tr_bitfield * b, size_t begin, size_t end)
 {
+  size_t i;
   size_t ret = 0;
-  const size_t first_byte = begin >> 3u;
-  const size_t last_byte = (end - 1) >> 3u;
 
   if (!b->bit_count)
     return 0;
 
-  if (first_byte >= b->alloc_count)
+  end = MIN (end, is_chunked (b) ? b->bit_count : b->alloc_count * 8);
+  if (begin >= end)
     return 0;
 
-  assert (begin < end);
-  assert (b->bits != NULL);
+  assert ((b->bits != NULL) || (b->chunks != NULL));
 
-  if (first_byte == last_byte)
-    {
-      int i;
-      uint8_t val = b->bits[first_byte];
+  for (i=begin/WORD_BITS; i<=(end-1)/WORD_BITS; ++i)
+    ret += popcount64 (get_raw_word (b, i) & get_range_mask (i, begin, end));
 
-      i = begin - (first_byte * 8);
-      val <<= i;
-      val >>= i;
-      i = (last_byte+1)*8 - end;
-      val >>= i;
-      val <<= i;
-
-      ret += trueBitCount[val];
-    }
-  else
-    {
-      size_t i;
-      uint8_t val;
-      const size_t walk_end = MIN (b->alloc_count, last_byte);
-
-      /* first byte */
-      i = begin - (first_byte * 8);
-      val = b->bits[first_byte];
-      val <<= i;
-      val >>= i;
-      ret += trueBitCount[val];
-
-      /* middle bytes */
-      for (i=first_byte+1; i<walk_end; ++i)
-        ret += trueBitCount[b->bits[i]];
-
-      /* last byte */
-      if (last_byte < b->alloc_count)
-        {
-          i = (last_byte+1)*8 - end;
-          val = b->bits[last_byte];
-          val >>= i;
-          val <<= i;
-          ret += trueBitCount[val];
-        }
-    }
-
-  assert (ret <= (begin - end));
+  assert (ret <= (end - begin));
   return ret;
 }
 
@@ -128,13 +224,84 @@ tr_bitfieldCountRange (const tr_bitfield * b, size_t begin, size_t end)
 }
 
 size_t
-tr_bitfieldFirstZero(const tr_bitfield * b, size_t begin, size_t end)
+tr_bitfieldFirstZero (const tr_bitfield * b, size_t begin, size_t end)
 {
-    size_t i;
-    for (i = begin; i < end; i++)
-        if (!tr_bitfieldHas(b, i))
-            return i;
+  size_t i;
+
+  if (tr_bitfieldHasAll (b) || begin >= end)
     return end;
+
+  for (i=begin/WORD_BITS; i<=(end-1)/WORD_BITS; ++i)
+    {
+      const uint64_t zeroes = ~get_raw_word (b, i) & get_range_mask (i, begin, end);
+
+      if (zeroes)
+        return i * WORD_BITS + clz64 (zeroes);
+    }
+
+  return end;
+}
+
+size_t
+tr_bitfieldFirstAnd (const tr_bitfield * a,
+                     const tr_bitfield * b,
+                     size_t              begin,
+                     size_t              end)
+{
+  size_t i;
+
+  if (tr_bitfieldHasNone (a) || tr_bitfieldHasNone (b) || begin >= end)
+    return end;
+
+  for (i=begin/WORD_BITS; i<=(end-1)/WORD_BITS; ++i)
+    {
+      const uint64_t bits = get_word (a, i) & get_word (b, i) & get_range_mask (i, begin, end);
+
+      if (bits)
+        return i * WORD_BITS + clz64 (bits);
+    }
+
+  return end;
+}
+
+size_t
+tr_bitfieldFirstAndNot (const tr_bitfield * a,
+                        const tr_bitfield * b,
+                        size_t              begin,
+                        size_t              end)
+{
+  size_t i;
+
+  if (tr_bitfieldHasNone (a) || tr_bitfieldHasAll (b) || begin >= end)
+    return end;
+
+  for (i=begin/WORD_BITS; i<=(end-1)/WORD_BITS; ++i)
+    {
+      const uint64_t bits = get_word (a, i) & ~get_word (b, i) & get_range_mask (i, begin, end);
+
+      if (bits)
+        return i * WORD_BITS + clz64 (bits);
+    }
+
+  return end;
+}
+
+size_t
+tr_bitfieldCountAndNot (const tr_bitfield * a,
+                        const tr_bitfield * b,
+                        size_t              begin,
+                        size_t              end)
+{
+  size_t i;
+  size_t ret = 0;
+
+  if (tr_bitfieldHasNone (a) || tr_bitfieldHasAll (b) || begin >= end)
+    return 0;
+
+  for (i=begin/WORD_BITS; i<=(end-1)/WORD_BITS; ++i)
+    ret += popcount64 (get_word (a, i) & ~get_word (b, i) & get_range_mask (i, begin, end));
+
+  return ret;
 }
 
 bool
@@ -146,6 +313,22 @@ tr_bitfieldHas (const tr_bitfield * b, size_t n)
   if (tr_bitfieldHasNone (b))
     return false;
 
+  if (is_chunked (b))
+    {
+      const size_t chunk = n / CHUNK_BITS;
+      const uint8_t * p;
+
+      if ((b->chunks == NULL) || (n >= b->bit_count))
+        return false;
+
+      p = b->chunks[chunk];
+      if (p == NULL)
+        return b->chunk_true_counts[chunk] != 0;
+
+      n %= CHUNK_BITS;
+      return (p[n>>3u] << (n & 7u) & 0x80) != 0;
+    }
+
   if (n>>3u >= b->alloc_count)
     return false;
 
@@ -161,7 +344,10 @@ tr_bitfieldIsValid (const tr_bitfield * b UNUSED)
 {
   assert (b != NULL);
   assert ((b->alloc_count == 0) == (b->bits == 0));
+  assert (!b->bits || !is_chunked (b));
+  assert ((b->chunks == NULL) == (b->chunk_true_counts == NULL));
   assert (!b->bits || (b->true_count == countArray (b)));
+  assert (!b->chunks || (b->true_count == countArray (b)));
 
   return true;
 }
@@ -194,6 +380,172 @@ set_all_true (uint8_t * array, size_t bit_count)
     }
 }
 
+/* sets bits [begin, end) of array to value */
+static void
+set_array_range (uint8_t * array, size_t begin, size_t end, bool value)
+{
+  size_t sb, eb;
+  unsigned char sm, em;
+
+  end--;
+  sb = begin >> 3;
+  sm = ~ (0xff << (8 - (begin & 7)));
+  eb = end >> 3;
+  em = 0xff << (7 - (end & 7));
+
+  if (sb == eb)
+    {
+      if (value)
+        array[sb] |= (sm & em);
+      else
+        array[sb] &= ~(sm & em);
+    }
+  else
+    {
+      if (value)
+        {
+          array[sb] |= sm;
+          array[eb] |= em;
+        }
+      else
+        {
+          array[sb] &= ~sm;
+          array[eb] &= ~em;
+        }
+
+      if (++sb < eb)
+        memset (array + sb, value ? 0xff : 0, eb - sb);
+    }
+}
+
+/***
+****  Chunks
+***/
+
+static void
+ensure_chunks (tr_bitfield * b)
+{
+  if (b->chunks == NULL)
+    {
+      const bool has_all = tr_bitfieldHasAll (b);
+
+      b->chunks = tr_new0 (uint8_t *, b->chunk_count);
+      b->chunk_true_counts = tr_new0 (uint32_t, b->chunk_count);
+
+      if (has_all)
+        {
+          size_t i;
+          for (i=0; i<b->chunk_count; ++i)
+            b->chunk_true_counts[i] = chunk_bit_count (b, i);
+        }
+    }
+}
+
+/* get the nth chunk's bits, allocating them if needed */
+static uint8_t *
+chunk_get_bits (tr_bitfield * b, size_t n)
+{
+  if (b->chunks[n] == NULL)
+    {
+      b->chunks[n] = tr_new0 (uint8_t, CHUNK_BYTES);
+
+      if (b->chunk_true_counts[n])
+        set_all_true (b->chunks[n], chunk_bit_count (b, n));
+    }
+
+  return b->chunks[n];
+}
+
+/* free the nth chunk's bits if they're all set or all unset */
+static void
+chunk_compact (tr_bitfield * b, size_t n)
+{
+  const size_t true_count = b->chunk_true_counts[n];
+
+  if ((true_count == 0) || (true_count == chunk_bit_count (b, n)))
+    {
+      tr_free (b->chunks[n]);
+      b->chunks[n] = NULL;
+    }
+}
+
+/* sets bits [begin, end) to value. They must all fall inside one chunk */
+static void
+chunk_set_range (tr_bitfield * b, size_t begin, size_t end, bool value)
+{
+  const size_t n = begin / CHUNK_BITS;
+  const size_t first_bit = n * CHUNK_BITS;
+  const size_t old_count = countRange (b, begin, end);
+
+  assert (n == (end - 1) / CHUNK_BITS);
+
+  if ((begin == first_bit) && (end - begin == chunk_bit_count (b, n)))
+    {
+      tr_free (b->chunks[n]);
+      b->chunks[n] = NULL;
+    }
+  else
+    {
+      set_array_range (chunk_get_bits (b, n), begin - first_bit, end - first_bit, value);
+    }
+
+  b->chunk_true_counts[n] -= old_count;
+  if (value)
+    b->chunk_true_counts[n] += end - begin;
+
+  chunk_compact (b, n);
+}
+
+/* sets bits [begin, end) to value, splitting the range into chunks */
+static void
+chunks_set_range (tr_bitfield * b, size_t begin, size_t end, bool value)
+{
+  ensure_chunks (b);
+
+  while (begin < end)
+    {
+      const size_t chunk_end = MIN (end, (begin / CHUNK_BITS + 1) * CHUNK_BITS);
+
+      chunk_set_range (b, begin, chunk_end, value);
+      begin = chunk_end;
+    }
+}
+
+/* the raw bits must not have any bits set past bit_count */
+static void
+chunks_set_from_raw (tr_bitfield * b, const uint8_t * bits, size_t byte_count)
+{
+  size_t n;
+  size_t true_count = 0;
+
+  assert (b->chunks == NULL);
+  assert (b->true_count == 0);
+
+  ensure_chunks (b);
+
+  for (n=0; n<b->chunk_count; ++n)
+    {
+      size_t i;
+      size_t count = 0;
+      const size_t offset = n * CHUNK_BYTES;
+      const size_t len = offset < byte_count ? MIN (CHUNK_BYTES, byte_count - offset) : 0;
+
+      for (i=0; i<len; ++i)
+        count += popcount64 (bits[offset + i]);
+
+      if ((count != 0) && (count != chunk_bit_count (b, n)))
+        {
+          b->chunks[n] = tr_new0 (uint8_t, CHUNK_BYTES);
+          memcpy (b->chunks[n], bits + offset, len);
+        }
+
+      b->chunk_true_counts[n] = count;
+      true_count += count;
+    }
+
+  b->true_count = true_count;
+}
+
 void*
 tr_bitfieldGetRaw (const tr_bitfield * b, size_t * byte_count)
 {
@@ -202,7 +554,21 @@ tr_bitfieldGetRaw (const tr_bitfield * b, size_t * byte_count)
 
   assert (b->bit_count > 0);
 
-  if (b->alloc_count)
+  if (b->chunks != NULL)
+    {
+      size_t i;
+
+      for (i=0; i<b->chunk_count; ++i)
+        {
+          const size_t offset = i * CHUNK_BYTES;
+
+          if (b->chunks[i] != NULL)
+            memcpy (bits + offset, b->chunks[i], MIN (CHUNK_BYTES, n - offset));
+          else if (b->chunk_true_counts[i])
+            set_all_true (bits + offset, chunk_bit_count (b, i));
+        }
+    }
+  else if (b->alloc_count)
     {
       assert (b->alloc_count <= n);
       memcpy (bits, b->bits, b->alloc_count);
@@ -253,6 +619,19 @@ tr_bitfieldEnsureNthBitAlloced (tr_bitfield * b, size_t nth)
 static void
 tr_bitfieldFreeArray (tr_bitfield * b)
 {
+  if (b->chunks != NULL)
+    {
+      size_t i;
+
+      for (i=0; i<b->chunk_count; ++i)
+        tr_free (b->chunks[i]);
+
+      tr_free (b->chunks);
+      tr_free (b->chunk_true_counts);
+      b->chunks = NULL;
+      b->chunk_true_counts = NULL;
+    }
+
   tr_free (b->bits);
   b->bits = NULL;
   b->alloc_count = 0;
@@ -292,6 +671,9 @@ tr_bitfieldConstruct (tr_bitfield * b, size_t bit_count)
   b->true_count = 0;
   b->bits = NULL;
   b->alloc_count = 0;
+  b->chunks = NULL;
+  b->chunk_true_counts = NULL;
+  b->chunk_count = bit_count >= CHUNKED_MIN_BITS ? (bit_count + CHUNK_BITS - 1) / CHUNK_BITS : 0;
   b->have_all_hint = false;
   b->have_none_hint = false;
 
@@ -327,6 +709,13 @@ tr_bitfieldSetFromBitfield (tr_bitfield * b, const tr_bitfield * src)
     tr_bitfieldSetHasAll (b);
   else if (tr_bitfieldHasNone (src))
     tr_bitfieldSetHasNone (b);
+  else if (is_chunked (src))
+    {
+      size_t byte_count;
+      uint8_t * raw = tr_bitfieldGetRaw (src, &byte_count);
+      tr_bitfieldSetRaw (b, raw, byte_count, true);
+      tr_free (raw);
+    }
   else
     tr_bitfieldSetRaw (b, src->bits, src->alloc_count, true);
 }
@@ -337,13 +726,18 @@ tr_bitfieldSetRaw (tr_bitfield * b, const void * bits, size_t byte_count, bool b
   tr_bitfieldFreeArray (b);
   b->true_count = 0;
 
+  /* chunks can't hold bits past bit_count */
+  if (is_chunked (b))
+    bounded = true;
+
   if (bounded)
     byte_count = MIN (byte_count, get_bytes_needed (b->bit_count));
 
   b->bits = tr_memdup (bits, byte_count);
   b->alloc_count = byte_count;
 
-  if (bounded)
+  /* a short array (e.g. from a sparse bitfield) has no excess bits */
+  if (bounded && (byte_count == get_bytes_needed (b->bit_count)))
     {
       /* ensure the excess bits are set to '0' */
       const int excess_bit_count = byte_count*8 - b->bit_count;
@@ -353,6 +747,17 @@ tr_bitfieldSetRaw (tr_bitfield * b, const void * bits, size_t byte_count, bool b
         b->bits[b->alloc_count-1] &= ((0xff) << excess_bit_count);
     }
 
+  if (is_chunked (b))
+    {
+      uint8_t * bits = b->bits;
+      const size_t n = b->alloc_count;
+
+      b->bits = NULL;
+      b->alloc_count = 0;
+      chunks_set_from_raw (b, bits, n);
+      tr_free (bits);
+    }
+
   tr_bitfieldRebuildTrueCount (b);
 }
 
@@ -363,6 +768,24 @@ tr_bitfieldSetFromFlags (tr_bitfield * b, const bool * flags, size_t n)
   size_t trueCount = 0;
 
   tr_bitfieldFreeArray (b);
+
+  if (is_chunked (b))
+    {
+      const size_t byte_count = get_bytes_needed (b->bit_count);
+      uint8_t * bits = tr_new0 (uint8_t, byte_count);
+
+      n = MIN (n, b->bit_count);
+      for (i=0; i<n; ++i)
+        if (flags[i])
+          bits[i >> 3u] |= (0x80 >> (i & 7u));
+
+      b->true_count = 0;
+      chunks_set_from_raw (b, bits, byte_count);
+      tr_free (bits);
+      tr_bitfieldRebuildTrueCount (b);
+      return;
+    }
+
   tr_bitfieldEnsureBitsAlloced (b, n);
 
   for (i=0; i<n; ++i)
@@ -377,10 +800,46 @@ tr_bitfieldSetFromFlags (tr_bitfield * b, const bool * flags, size_t n)
   tr_bitfieldSetTrueCount (b, trueCount);
 }
 
+/* set or clear the nth bit of a chunked bitfield */
+static void
+chunks_set_bit (tr_bitfield * b, size_t nth, bool value)
+{
+  uint8_t * p;
+  const size_t n = nth / CHUNK_BITS;
+
+  ensure_chunks (b);
+  p = chunk_get_bits (b, n);
+  nth %= CHUNK_BITS;
+
+  if (value)
+    {
+      p[nth >> 3u] |= (0x80 >> (nth & 7u));
+      b->chunk_true_counts[n]++;
+    }
+  else
+    {
+      p[nth >> 3u] &= ~(0x80 >> (nth & 7u));
+      b->chunk_true_counts[n]--;
+    }
+
+  chunk_compact (b, n);
+}
+
 void
 tr_bitfieldAdd (tr_bitfield * b, size_t nth)
 {
-  if (!tr_bitfieldHas (b, nth) && tr_bitfieldEnsureNthBitAlloced (b, nth))
+  if (tr_bitfieldHas (b, nth))
+    return;
+
+  if (is_chunked (b))
+    {
+      if (nth < b->bit_count)
+        {
+          chunks_set_bit (b, nth, true);
+          tr_bitfieldIncTrueCount (b, 1);
+        }
+    }
+  else if (tr_bitfieldEnsureNthBitAlloced (b, nth))
     {
       b->bits[nth >> 3u] |= (0x80 >> (nth & 7u));
       tr_bitfieldIncTrueCount (b, 1);
@@ -391,36 +850,17 @@ tr_bitfieldAdd (tr_bitfield * b, size_t nth)
 void
 tr_bitfieldAddRange (tr_bitfield * b, size_t begin, size_t end)
 {
-  size_t sb, eb;
-  unsigned char sm, em;
   const size_t diff = (end-begin) - tr_bitfieldCountRange (b, begin, end);
 
-  if (diff == 0)
+  if ((diff == 0) || (end > b->bit_count) || (begin >= end))
     return;
 
-  end--;
-  if ((end >= b->bit_count) || (begin > end))
-    return;
-
-  sb = begin >> 3;
-  sm = ~ (0xff << (8 - (begin & 7)));
-  eb = end >> 3;
-  em = 0xff << (7 - (end & 7));
-
-  if (!tr_bitfieldEnsureNthBitAlloced (b, end))
-    return;
-
-  if (sb == eb)
-    {
-      b->bits[sb] |= (sm & em);
-    }
+  if (is_chunked (b))
+    chunks_set_range (b, begin, end, true);
+  else if (tr_bitfieldEnsureNthBitAlloced (b, end - 1))
+    set_array_range (b->bits, begin, end, true);
   else
-    {
-      b->bits[sb] |= sm;
-      b->bits[eb] |= em;
-      if (++sb < eb)
-        memset (b->bits + sb, 0xff, eb - sb);
-    }
+    return;
 
   tr_bitfieldIncTrueCount (b, diff);
 }
@@ -430,7 +870,15 @@ tr_bitfieldRem (tr_bitfield * b, size_t nth)
 {
   assert (tr_bitfieldIsValid (b));
 
-  if (!tr_bitfieldHas (b, nth) && tr_bitfieldEnsureNthBitAlloced (b, nth))
+  if (!tr_bitfieldHas (b, nth))
+    return;
+
+  if (is_chunked (b))
+    {
+      chunks_set_bit (b, nth, false);
+      tr_bitfieldIncTrueCount (b, -1);
+    }
+  else if (tr_bitfieldEnsureNthBitAlloced (b, nth))
     {
       b->bits[nth >> 3u] &= (0xff7f >> (nth & 7u));
       tr_bitfieldIncTrueCount (b, -1);
@@ -441,37 +889,112 @@ tr_bitfieldRem (tr_bitfield * b, size_t nth)
 void
 tr_bitfieldRemRange (tr_bitfield * b, size_t begin, size_t end)
 {
-  size_t sb, eb;
-  unsigned char sm, em;
   const size_t diff = tr_bitfieldCountRange (b, begin, end);
 
-  if (!diff)
+  if ((diff == 0) || (end > b->bit_count) || (begin >= end))
     return;
 
-  end--;
-
-  if ((end >= b->bit_count) || (begin > end))
+  if (is_chunked (b))
+    chunks_set_range (b, begin, end, false);
+  else if (tr_bitfieldEnsureNthBitAlloced (b, end - 1))
+    set_array_range (b->bits, begin, end, false);
+  else
     return;
 
-  sb = begin >> 3;
-  sm = 0xff << (8 - (begin & 7));
-  eb = end >> 3;
-  em = ~ (0xff << (7 - (end & 7)));
+  tr_bitfieldIncTrueCount (b, -diff);
+}
 
-  if (!tr_bitfieldEnsureNthBitAlloced (b, end))
+/* combine () for chunked bitfields */
+static void
+combine_chunks (tr_bitfield * dst, const tr_bitfield * src, bool and_not)
+{
+  size_t n;
+
+  ensure_chunks (dst);
+
+  for (n=0; n<dst->chunk_count; ++n)
+    {
+      size_t i;
+      size_t count = 0;
+      uint8_t * p;
+
+      /* nothing to remove from an empty chunk */
+      if (dst->chunk_true_counts[n] == 0)
+        continue;
+
+      p = chunk_get_bits (dst, n);
+
+      for (i=0; i<CHUNK_WORDS; ++i)
+        {
+          const uint64_t s = get_word (src, n * CHUNK_WORDS + i);
+          uint64_t d = load_word (p + i * WORD_BYTES);
+
+          d = and_not ? (d & ~s) : (d & s);
+          store_word (p + i * WORD_BYTES, d);
+          count += popcount64 (d);
+        }
+
+      dst->chunk_true_counts[n] = count;
+      chunk_compact (dst, n);
+    }
+
+  tr_bitfieldRebuildTrueCount (dst);
+}
+
+/* dst = dst OP src, for bitfields of the same size */
+static void
+combine (tr_bitfield * dst, const tr_bitfield * src, bool and_not)
+{
+  size_t i;
+  const size_t n = get_bytes_needed (dst->bit_count);
+
+  assert (dst->bit_count == src->bit_count);
+
+  /* bits that src has or lacks entirely are easy */
+  if (tr_bitfieldHasNone (dst))
+    return;
+  if (and_not ? tr_bitfieldHasNone (src) : tr_bitfieldHasAll (src))
     return;
+  if (and_not ? tr_bitfieldHasAll (src) : tr_bitfieldHasNone (src))
+    {
+      tr_bitfieldSetHasNone (dst);
+      return;
+    }
 
-  if (sb == eb)
+  if (is_chunked (dst))
     {
-      b->bits[sb] &= (sm | em);
+      combine_chunks (dst, src, and_not);
+      return;
     }
-  else
+
+  tr_bitfieldEnsureBitsAlloced (dst, dst->bit_count);
+
+  /* src->alloc_count can be shorter than n; its missing bits are zero */
+  for (i=0; i+WORD_BYTES<=src->alloc_count; i+=WORD_BYTES)
     {
-      b->bits[sb] &= sm;
-      b->bits[eb] &= em;
-      if (++sb < eb)
-        memset (b->bits + sb, 0, eb - sb);
+      uint64_t d, s;
+      memcpy (&d, dst->bits + i, WORD_BYTES);
+      memcpy (&s, src->bits + i, WORD_BYTES);
+      d = and_not ? (d & ~s) : (d & s);
+      memcpy (dst->bits + i, &d, WORD_BYTES);
+    }
+  for (; i<n; ++i)
+    {
+      const uint8_t s = i < src->alloc_count ? src->bits[i] : 0;
+      dst->bits[i] = and_not ? (dst->bits[i] & ~s) : (dst->bits[i] & s);
     }
 
-  tr_bitfieldIncTrueCount (b, -diff);
+  tr_bitfieldRebuildTrueCount (dst);
+}
+
+void
+tr_bitfieldAnd (tr_bitfield * dst, const tr_bitfield * src)
+{
+  combine (dst, src, false);
+}
+
+void
+tr_bitfieldAndNot (tr_bitfield * dst, const tr_bitfield * src)
+{
+  combine (dst, src, true);
 }
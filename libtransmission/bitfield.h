@@ -22,6 +22,16 @@ typedef struct tr_bitfield
   uint8_t *  bits;
   size_t     alloc_count;
 
+  /* Large bitfields, such as a big torrent's blocks, keep their bits in
+     fixed-size chunks instead of in one array. A chunk whose bits are
+     all set or all unset isn't allocated: its entry in chunks is NULL
+     and chunk_true_counts tells which it is. This way a torrent that's
+     got long runs of blocks, or long runs of missing ones, doesn't pay
+     for them. chunk_count is zero if the bitfield isn't chunked. */
+  uint8_t ** chunks;
+  uint32_t * chunk_true_counts;
+  size_t     chunk_count;
+
   size_t     bit_count;
 
   size_t     true_count;
@@ -85,6 +95,26 @@ size_t  tr_bitfieldFirstZero (const tr_bitfield*, size_t begin, size_t end);
 
 size_t  tr_bitfieldCountTrueBits (const tr_bitfield * b);
 
+/** @brief Return the first bit in [begin, end) that's set in both a and b,
+           or end if there isn't one */
+size_t  tr_bitfieldFirstAnd (const tr_bitfield * a, const tr_bitfield * b,
+                             size_t begin, size_t end);
+
+/** @brief Return the first bit in [begin, end) that's set in a but not in b,
+           or end if there isn't one */
+size_t  tr_bitfieldFirstAndNot (const tr_bitfield * a, const tr_bitfield * b,
+                                size_t begin, size_t end);
+
+/** @brief Count the bits in [begin, end) that are set in a but not in b */
+size_t  tr_bitfieldCountAndNot (const tr_bitfield * a, const tr_bitfield * b,
+                                size_t begin, size_t end);
+
+/** @brief dst &= src. Both bitfields must have the same bit count */
+void    tr_bitfieldAnd (tr_bitfield * dst, const tr_bitfield * src);
+
+/** @brief dst &= ~src. Both bitfields must have the same bit count */
+void    tr_bitfieldAndNot (tr_bitfield * dst, const tr_bitfield * src);
+
 static inline bool
 tr_bitfieldHasAll (const tr_bitfield * b)
 {
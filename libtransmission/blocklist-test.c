@@ -12,6 +12,8 @@
 #include <string.h> /* strlen () */
 #include <unistd.h> /* sync() */
 
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "blocklist.h"
 #include "file.h"
@@ -34,6 +36,13 @@ static const char * contents2 =
   "Fox Speed Channel:216.79.131.192-216.79.131.223\n"
   "Evilcorp:216.88.88.0-216.88.88.255\n";
 
+static const char * contents3 =
+  "Austin Law Firm:216.16.1.144-216.16.1.151\n"
+  "10.0.0.0/8\n"
+  "2001:db8::/32\n"
+  "2001:db8:1::/48\n"
+  "fe80::1/128\n";
+
 static void
 create_text_file (const char * path, const char * contents)
 {
@@ -150,11 +159,143 @@ test_updating (void)
 ****
 ***/
 
+static int
+test_cidr_and_ipv6 (void)
+{
+  char * path;
+  tr_session * session;
+
+  session = libttest_session_init (NULL);
+  path = tr_buildPath (tr_sessionGetConfigDir(session), "blocklists", "level1", NULL);
+  create_text_file (path, contents3);
+  tr_free (path);
+  tr_sessionReloadBlocklists (session);
+  tr_blocklistSetEnabled (session, true);
+
+  /* 2001:db8:1::/48 is folded into 2001:db8::/32 */
+  check_int_eq (4, tr_blocklistGetRuleCount (session));
+
+  check (!address_is_blocked (session, "9.255.255.255"));
+  check ( address_is_blocked (session, "10.0.0.0"));
+  check ( address_is_blocked (session, "10.200.3.4"));
+  check ( address_is_blocked (session, "10.255.255.255"));
+  check (!address_is_blocked (session, "11.0.0.0"));
+  check ( address_is_blocked (session, "216.16.1.150"));
+
+  check (!address_is_blocked (session, "2001:db7:ffff:ffff:ffff:ffff:ffff:ffff"));
+  check ( address_is_blocked (session, "2001:db8::"));
+  check ( address_is_blocked (session, "2001:db8:1234::5"));
+  check ( address_is_blocked (session, "2001:db8:ffff:ffff:ffff:ffff:ffff:ffff"));
+  check (!address_is_blocked (session, "2001:db9::"));
+  check ( address_is_blocked (session, "fe80::1"));
+  check (!address_is_blocked (session, "fe80::2"));
+  check (!address_is_blocked (session, "::1"));
+
+  /* IPv4-mapped IPv6 addresses use the IPv4 rules */
+  check ( address_is_blocked (session, "::ffff:10.1.2.3"));
+  check (!address_is_blocked (session, "::ffff:11.1.2.3"));
+
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_many_ranges (void)
+{
+  int i;
+  int j;
+  char * path;
+  char str[64];
+  tr_session * session;
+  struct evbuffer * buf = evbuffer_new ();
+
+  /* enough rules for the lookup tree to be several levels deep */
+  for (i=0; i<4; ++i)
+    for (j=0; j<256; ++j)
+      evbuffer_add_printf (buf, "range:1.%d.%d.0-1.%d.%d.127\n", i, j, i, j);
+
+  session = libttest_session_init (NULL);
+  path = tr_buildPath (tr_sessionGetConfigDir(session), "blocklists", "level1", NULL);
+  create_text_file (path, (const char *) evbuffer_pullup (buf, -1));
+  tr_free (path);
+  tr_sessionReloadBlocklists (session);
+  tr_blocklistSetEnabled (session, true);
+  check_int_eq (1024, tr_blocklistGetRuleCount (session));
+
+  for (i=0; i<4; ++i)
+    for (j=0; j<256; ++j)
+      {
+        tr_snprintf (str, sizeof (str), "1.%d.%d.0", i, j);
+        check (address_is_blocked (session, str));
+        tr_snprintf (str, sizeof (str), "1.%d.%d.127", i, j);
+        check (address_is_blocked (session, str));
+        tr_snprintf (str, sizeof (str), "1.%d.%d.128", i, j);
+        check (!address_is_blocked (session, str));
+        tr_snprintf (str, sizeof (str), "1.%d.%d.255", i, j);
+        check (!address_is_blocked (session, str));
+      }
+
+  libttest_session_close (session);
+  evbuffer_free (buf);
+  return 0;
+}
+
+/***
+****
+***/
+
+static int
+test_multiple_lists (void)
+{
+  char * path;
+  tr_session * session;
+
+  session = libttest_session_init (NULL);
+  path = tr_buildPath (tr_sessionGetConfigDir(session), "blocklists", "level1", NULL);
+  create_text_file (path, contents1);
+  tr_free (path);
+  path = tr_buildPath (tr_sessionGetConfigDir(session), "blocklists", "level2", NULL);
+  create_text_file (path, "Overlap:216.16.1.140-216.16.1.147\n2001:db8::/32\n");
+  tr_free (path);
+  tr_sessionReloadBlocklists (session);
+  check_int_eq (6, tr_blocklistGetRuleCount (session));
+
+  /* nothing is blocked until the blocklists are enabled */
+  check (!address_is_blocked (session, "216.16.1.140"));
+  tr_blocklistSetEnabled (session, true);
+
+  /* the overlapping ranges from both lists are combined */
+  check (!address_is_blocked (session, "216.16.1.139"));
+  check ( address_is_blocked (session, "216.16.1.140"));
+  check ( address_is_blocked (session, "216.16.1.148"));
+  check ( address_is_blocked (session, "216.16.1.151"));
+  check (!address_is_blocked (session, "216.16.1.152"));
+  check ( address_is_blocked (session, "216.19.18.7"));
+  check ( address_is_blocked (session, "2001:db8::1"));
+
+  tr_blocklistSetEnabled (session, false);
+  check (!address_is_blocked (session, "216.19.18.7"));
+
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   const testFunc tests[] = { test_parsing,
-                             test_updating };
+                             test_updating,
+                             test_cidr_and_ipv6,
+                             test_many_ranges,
+                             test_multiple_lists };
 
   return runTests (tests, NUM_TESTS (tests));
 }
@@ -10,13 +10,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
-#include <stdlib.h> /* bsearch (), qsort () */
+#include <stdlib.h> /* qsort () */
 #include <string.h>
 
 #include "transmission.h"
 #include "blocklist.h"
 #include "error.h"
 #include "file.h"
+#include "list.h"
 #include "log.h"
 #include "net.h"
 #include "utils.h"
@@ -26,36 +27,83 @@
 ****  PRIVATE
 ***/
 
+/* host byte order, inclusive */
 struct tr_ipv4_range
 {
   uint32_t begin;
   uint32_t end;
 };
 
+/* network byte order, inclusive */
+struct tr_ipv6_range
+{
+  uint8_t begin[16];
+  uint8_t end[16];
+};
+
+/**
+ * The compiled .bin file is this header, followed by ipv4Count
+ * tr_ipv4_ranges and then ipv6Count tr_ipv6_ranges.
+ *
+ * Each table is stored in Eytzinger (breadth-first binary tree) order
+ * rather than sorted order: the children of element k are 2k+1 and 2k+2.
+ * A lookup walks down from the root, so the first few levels -- which
+ * every lookup touches -- share a handful of cache lines.
+ */
+struct tr_blocklist_header
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t ipv4Count;
+  uint32_t ipv6Count;
+};
+
+#define BLOCKLIST_MAGIC "TRBL"
+#define BLOCKLIST_VERSION 2
+
 struct tr_blocklistFile
 {
-  bool                   isEnabled;
-  tr_sys_file_t          fd;
-  size_t                 ruleCount;
-  uint64_t               byteCount;
-  char *                 filename;
-  struct tr_ipv4_range * rules;
+  bool                         isEnabled;
+  tr_sys_file_t                fd;
+  size_t                       ruleCount;
+  uint64_t                     byteCount;
+  char *                       filename;
+  void *                       map;
+  const struct tr_ipv4_range * rules4;
+  size_t                       ruleCount4;
+  const struct tr_ipv6_range * rules6;
+  size_t                       ruleCount6;
 };
 
 static void
 blocklistClose (tr_blocklistFile * b)
 {
-  if (b->rules != NULL)
+  if (b->map != NULL)
     {
-      tr_sys_file_unmap (b->rules, b->byteCount, NULL);
+      tr_sys_file_unmap (b->map, b->byteCount, NULL);
       tr_sys_file_close (b->fd, NULL);
-      b->rules = NULL;
+      b->map = NULL;
+      b->rules4 = NULL;
+      b->rules6 = NULL;
       b->ruleCount = 0;
+      b->ruleCount4 = 0;
+      b->ruleCount6 = 0;
       b->byteCount = 0;
       b->fd = TR_BAD_SYS_FILE;
     }
 }
 
+static bool
+isValidHeader (const struct tr_blocklist_header * h, uint64_t byteCount)
+{
+  return (byteCount >= sizeof (struct tr_blocklist_header))
+      && !memcmp (h->magic, BLOCKLIST_MAGIC, 4)
+      && (h->version == BLOCKLIST_VERSION)
+      && (byteCount == sizeof (struct tr_blocklist_header)
+                     + (uint64_t)h->ipv4Count * sizeof (struct tr_ipv4_range)
+                     + (uint64_t)h->ipv6Count * sizeof (struct tr_ipv6_range));
+}
+
 static void
 blocklistLoad (tr_blocklistFile * b)
 {
@@ -63,6 +111,7 @@ blocklistLoad (tr_blocklistFile * b)
   uint64_t byteCount;
   tr_sys_path_info info;
   char * base;
+  const struct tr_blocklist_header * header;
   tr_error * error = NULL;
   const char * err_fmt = _("Couldn't read \"%1$s\": %2$s");
 
@@ -83,8 +132,8 @@ blocklistLoad (tr_blocklistFile * b)
       return;
     }
 
-  b->rules = tr_sys_file_map_for_reading (fd, 0, byteCount, &error);
-  if (!b->rules)
+  b->map = tr_sys_file_map_for_reading (fd, 0, byteCount, &error);
+  if (!b->map)
     {
       tr_logAddError (err_fmt, b->filename, error->message);
       tr_sys_file_close (fd, NULL);
@@ -92,9 +141,23 @@ blocklistLoad (tr_blocklistFile * b)
       return;
     }
 
+  header = b->map;
+  if (!isValidHeader (header, byteCount))
+    {
+      tr_logAddError (err_fmt, b->filename, _("Unrecognized blocklist format"));
+      tr_sys_file_unmap (b->map, byteCount, NULL);
+      tr_sys_file_close (fd, NULL);
+      b->map = NULL;
+      return;
+    }
+
   b->fd = fd;
   b->byteCount = byteCount;
-  b->ruleCount = byteCount / sizeof (struct tr_ipv4_range);
+  b->rules4 = (const struct tr_ipv4_range *) (header + 1);
+  b->ruleCount4 = header->ipv4Count;
+  b->rules6 = (const struct tr_ipv6_range *) (b->rules4 + b->ruleCount4);
+  b->ruleCount6 = header->ipv6Count;
+  b->ruleCount = b->ruleCount4 + b->ruleCount6;
 
   base = tr_sys_path_basename (b->filename, NULL);
   tr_logAddInfo (_("Blocklist \"%s\" contains %"TR_PRIuSIZE" entries"), base, b->ruleCount);
@@ -104,19 +167,80 @@ blocklistLoad (tr_blocklistFile * b)
 static void
 blocklistEnsureLoaded (tr_blocklistFile * b)
 {
-  if (b->rules == NULL)
+  if (b->map == NULL)
     blocklistLoad (b);
 }
 
-static int
-compareAddressToRange (const void * va, const void * vb)
+/* the ranges don't overlap, so only the one with
+   the greatest beginning <= needle can hold it */
+static bool
+hasIPv4Address (const struct tr_ipv4_range * rules, size_t ruleCount, uint32_t needle)
 {
-  const uint32_t * a = va;
-  const struct tr_ipv4_range * b = vb;
+  size_t k = 0;
+  const struct tr_ipv4_range * best = NULL;
 
-  if (*a < b->begin) return -1;
-  if (*a > b->end) return 1;
-  return 0;
+  while (k < ruleCount)
+    {
+      const struct tr_ipv4_range * r = rules + k;
+
+      if (r->begin <= needle)
+        {
+          best = r;
+          k = 2*k + 2;
+        }
+      else
+        {
+          k = 2*k + 1;
+        }
+    }
+
+  return (best != NULL) && (needle <= best->end);
+}
+
+static bool
+hasIPv6Address (const struct tr_ipv6_range * rules, size_t ruleCount, const uint8_t * needle)
+{
+  size_t k = 0;
+  const struct tr_ipv6_range * best = NULL;
+
+  while (k < ruleCount)
+    {
+      const struct tr_ipv6_range * r = rules + k;
+
+      if (memcmp (r->begin, needle, 16) <= 0)
+        {
+          best = r;
+          k = 2*k + 2;
+        }
+      else
+        {
+          k = 2*k + 1;
+        }
+    }
+
+  return (best != NULL) && (memcmp (needle, best->end, 16) <= 0);
+}
+
+static bool
+hasAddress (const struct tr_ipv4_range * rules4, size_t ruleCount4,
+            const struct tr_ipv6_range * rules6, size_t ruleCount6,
+            const tr_address           * addr)
+{
+  const uint8_t * addr6;
+
+  if (addr->type == TR_AF_INET)
+    return hasIPv4Address (rules4, ruleCount4, ntohl (addr->addr.addr4.s_addr));
+
+  /* IPv4-mapped addresses are matched against the IPv4 rules */
+  addr6 = addr->addr.addr6.s6_addr;
+  if (IN6_IS_ADDR_V4MAPPED (&addr->addr.addr6))
+    {
+      uint32_t needle;
+      memcpy (&needle, addr6 + 12, 4);
+      return hasIPv4Address (rules4, ruleCount4, ntohl (needle));
+    }
+
+  return hasIPv6Address (rules6, ruleCount6, addr6);
 }
 
 static void
@@ -189,28 +313,126 @@ tr_blocklistFileSetEnabled (tr_blocklistFile * b, bool isEnabled)
 bool
 tr_blocklistFileHasAddress (tr_blocklistFile * b, const tr_address * addr)
 {
-  uint32_t needle;
-  const struct tr_ipv4_range * range;
-
   assert (tr_address_is_valid (addr));
 
-  if (!b->isEnabled || addr->type == TR_AF_INET6)
+  if (!b->isEnabled)
     return false;
 
   blocklistEnsureLoaded (b);
 
-  if (!b->rules || !b->ruleCount)
+  if (!b->ruleCount)
+    return false;
+
+  return hasAddress (b->rules4, b->ruleCount4, b->rules6, b->ruleCount6, addr);
+}
+
+bool
+tr_blocklistFileIsCurrent (const char * filename)
+{
+  tr_sys_file_t fd;
+  tr_sys_path_info info;
+  uint64_t bytesRead = 0;
+  struct tr_blocklist_header header;
+
+  if (!tr_sys_path_get_info (filename, 0, &info, NULL))
     return false;
 
-  needle = ntohl (addr->addr.addr4.s_addr);
+  fd = tr_sys_file_open (filename, TR_SYS_FILE_READ, 0, NULL);
+  if (fd == TR_BAD_SYS_FILE)
+    return false;
 
-  range = bsearch (&needle,
-                   b->rules,
-                   b->ruleCount,
-                   sizeof (struct tr_ipv4_range),
-                   compareAddressToRange);
+  tr_sys_file_read (fd, &header, sizeof (header), &bytesRead, NULL);
+  tr_sys_file_close (fd, NULL);
 
-  return range != NULL;
+  return (bytesRead == sizeof (header)) && isValidHeader (&header, info.size);
+}
+
+/***
+****  Parsing
+****
+****  Blocklists can have millions of lines, so these are hand-rolled:
+****  they work on [walk, end) spans of the mapped source file and never
+****  allocate.
+***/
+
+static const char *
+skipSpaces (const char * walk, const char * end)
+{
+  while (walk != end && (*walk == ' ' || *walk == '\t'))
+    ++walk;
+
+  return walk;
+}
+
+static const char *
+parseInt (const char * walk, const char * end, int maxDigits, int * setme)
+{
+  int n = 0;
+  int digits = 0;
+
+  while (walk != end && digits < maxDigits && '0' <= *walk && *walk <= '9')
+    {
+      n = n * 10 + (*walk++ - '0');
+      ++digits;
+    }
+
+  *setme = n;
+  return digits ? walk : NULL;
+}
+
+/* up to 3 digits per octet, so "000.000.000.000" works too */
+static const char *
+parseIPv4 (const char * walk, const char * end, tr_address * setme)
+{
+  int i;
+  uint32_t addr = 0;
+
+  for (i=0; i<4; ++i)
+    {
+      int octet;
+
+      if (i > 0)
+        {
+          if (walk == end || *walk != '.')
+            return NULL;
+          ++walk;
+        }
+
+      if ((walk = parseInt (walk, end, 3, &octet)) == NULL || octet > 255)
+        return NULL;
+
+      addr = (addr << 8) | octet;
+    }
+
+  setme->type = TR_AF_INET;
+  setme->addr.addr4.s_addr = htonl (addr);
+  return walk;
+}
+
+static const char *
+expectChar (const char * walk, const char * end, char ch)
+{
+  walk = skipSpaces (walk, end);
+
+  if (walk == end || *walk != ch)
+    return NULL;
+
+  return skipSpaces (walk + 1, end);
+}
+
+/* "x.x.x.x - y.y.y.y" */
+static const char *
+parseIPv4Range (const char * walk, const char * end, tr_address * begin, tr_address * last)
+{
+  walk = skipSpaces (walk, end);
+
+  if ((walk = parseIPv4 (walk, end, begin)) == NULL)
+    return NULL;
+
+  if ((walk = expectChar (walk, end, '-')) == NULL)
+    return NULL;
+
+  return parseIPv4 (walk, end, last);
 }
 
 /*
@@ -219,78 +441,110 @@ tr_blocklistFileHasAddress (tr_blocklistFile * b, const tr_address * addr)
  * http://en.wikipedia.org/wiki/PeerGuardian#P2P_plaintext_format
  */
 static bool
-parseLine1 (const char * line, struct tr_ipv4_range * range)
+parseLine1 (const char * line, const char * end, tr_address * begin, tr_address * last)
 {
-  char * walk;
-  int b[4];
-  int e[4];
-  char str[64];
-  tr_address addr;
+  const char * walk = end;
 
-  walk = strrchr (line, ':');
-  if (!walk)
-    return false;
-  ++walk; /* walk past the colon */
+  while (walk != line && walk[-1] != ':')
+    --walk;
 
-  if (sscanf (walk, "%d.%d.%d.%d-%d.%d.%d.%d",
-              &b[0], &b[1], &b[2], &b[3],
-              &e[0], &e[1], &e[2], &e[3]) != 8)
+  if (walk == line)
     return false;
 
-  tr_snprintf (str, sizeof (str), "%d.%d.%d.%d", b[0], b[1], b[2], b[3]);
-  if (!tr_address_from_string (&addr, str))
+  return parseIPv4Range (walk, end, begin, last) != NULL;
+}
+
+/*
+ * DAT format: "000.000.000.000 - 000.255.255.255 , 000 , invalid ip"
+ * http://wiki.phoenixlabs.org/wiki/DAT_Format
+ */
+static bool
+parseLine2 (const char * line, const char * end, tr_address * begin, tr_address * last)
+{
+  int unk;
+  const char * walk = line;
+
+  if ((walk = parseIPv4Range (walk, end, begin, last)) == NULL)
     return false;
-  range->begin = ntohl (addr.addr.addr4.s_addr);
 
-  tr_snprintf (str, sizeof (str), "%d.%d.%d.%d", e[0], e[1], e[2], e[3]);
-  if (!tr_address_from_string (&addr, str))
+  if ((walk = expectChar (walk, end, ',')) == NULL)
     return false;
-  range->end = ntohl (addr.addr.addr4.s_addr);
 
-  return true;
+  return parseInt (walk, end, 3, &unk) != NULL;
 }
 
 /*
- * DAT format: "000.000.000.000 - 000.255.255.255 , 000 , invalid ip"
- * http://wiki.phoenixlabs.org/wiki/DAT_Format
+ * CIDR format, IPv4 or IPv6: "x.x.x.x/nn" or "x:x::/nn"
  */
 static bool
-parseLine2 (const char * line, struct tr_ipv4_range * range)
+parseLine3 (const char * line, const char * end, tr_address * begin, tr_address * last)
 {
-  int unk;
-  int a[4];
-  int b[4];
-  char str[32];
-  tr_address addr;
-
-  if (sscanf (line, "%3d.%3d.%3d.%3d - %3d.%3d.%3d.%3d , %3d , ",
-              &a[0], &a[1], &a[2], &a[3],
-              &b[0], &b[1], &b[2], &b[3],
-              &unk) != 9)
+  int i;
+  int bits;
+  int addrLen;
+  size_t len;
+  char str[INET6_ADDRSTRLEN];
+  uint8_t * b;
+  uint8_t * e;
+  const char * walk = skipSpaces (line, end);
+  const char * slash = walk;
+
+  while (slash != end && *slash != '/')
+    ++slash;
+
+  len = slash - walk;
+  if (slash == end || len == 0 || len >= sizeof (str))
     return false;
 
-  tr_snprintf (str, sizeof (str), "%d.%d.%d.%d", a[0], a[1], a[2], a[3]);
-  if (!tr_address_from_string (&addr, str))
+  memcpy (str, walk, len);
+  str[len] = '\0';
+
+  if (!tr_address_from_string (begin, str))
     return false;
-  range->begin = ntohl (addr.addr.addr4.s_addr);
 
-  tr_snprintf (str, sizeof (str), "%d.%d.%d.%d", b[0], b[1], b[2], b[3]);
-  if (!tr_address_from_string (&addr, str))
+  if (parseInt (slash + 1, end, 3, &bits) == NULL)
     return false;
-  range->end = ntohl (addr.addr.addr4.s_addr);
+
+  if (begin->type == TR_AF_INET)
+    {
+      addrLen = 4;
+      b = (uint8_t *) &begin->addr.addr4.s_addr;
+      e = (uint8_t *) &last->addr.addr4.s_addr;
+    }
+  else
+    {
+      addrLen = 16;
+      b = begin->addr.addr6.s6_addr;
+      e = last->addr.addr6.s6_addr;
+    }
+
+  if (bits > addrLen * 8)
+    return false;
+
+  *last = *begin;
+  for (i=0; i<addrLen; ++i)
+    {
+      const int keep = MAX (0, MIN (8, bits - i*8));
+      const uint8_t mask = (uint8_t) (0xff << (8 - keep));
+      b[i] &= mask;
+      e[i] |= (uint8_t) ~mask;
+    }
 
   return true;
 }
 
 static bool
-parseLine (const char * line, struct tr_ipv4_range * range)
+parseLine (const char * line, const char * end, tr_address * begin, tr_address * last)
 {
-  return parseLine1 (line, range)
-      || parseLine2 (line, range);
+  return (parseLine1 (line, end, begin, last)
+       || parseLine2 (line, end, begin, last)
+       || parseLine3 (line, end, begin, last))
+      && (begin->type == last->type)
+      && (tr_address_compare (begin, last) <= 0);
 }
 
 static int
-compareAddressRangesByFirstAddress (const void * va, const void * vb)
+compareIPv4RangesByFirstAddress (const void * va, const void * vb)
 {
   const struct tr_ipv4_range * a = va;
   const struct tr_ipv4_range * b = vb;
@@ -299,121 +553,392 @@ compareAddressRangesByFirstAddress (const void * va, const void * vb)
   return 0;
 }
 
+static int
+compareIPv6RangesByFirstAddress (const void * va, const void * vb)
+{
+  const struct tr_ipv6_range * a = va;
+  const struct tr_ipv6_range * b = vb;
+  return memcmp (a->begin, b->begin, 16);
+}
+
+static size_t
+mergeIPv4Ranges (struct tr_ipv4_range * ranges, size_t n)
+{
+  struct tr_ipv4_range * r;
+  struct tr_ipv4_range * keep = ranges;
+  const struct tr_ipv4_range * end;
+
+  if (n == 0)
+    return 0;
+
+  qsort (ranges, n, sizeof (struct tr_ipv4_range), compareIPv4RangesByFirstAddress);
+
+  for (r=ranges+1, end=ranges+n; r!=end; ++r)
+    {
+      if (keep->end < r->begin)
+        *++keep = *r;
+      else if (keep->end < r->end)
+        keep->end = r->end;
+    }
+
+  return keep + 1 - ranges;
+}
+
+static size_t
+mergeIPv6Ranges (struct tr_ipv6_range * ranges, size_t n)
+{
+  struct tr_ipv6_range * r;
+  struct tr_ipv6_range * keep = ranges;
+  const struct tr_ipv6_range * end;
+
+  if (n == 0)
+    return 0;
+
+  qsort (ranges, n, sizeof (struct tr_ipv6_range), compareIPv6RangesByFirstAddress);
+
+  for (r=ranges+1, end=ranges+n; r!=end; ++r)
+    {
+      if (memcmp (keep->end, r->begin, 16) < 0)
+        *++keep = *r;
+      else if (memcmp (keep->end, r->end, 16) < 0)
+        memcpy (keep->end, r->end, 16);
+    }
+
+  return keep + 1 - ranges;
+}
+
+/* copy the sorted array `in' into `out' in Eytzinger order,
+   filling the subtree rooted at `k'. Returns the next unused `in' index. */
+static size_t
+eytzingerFill (const uint8_t * in, uint8_t * out, size_t size,
+               size_t i, size_t k, size_t n)
+{
+  if (k < n)
+    {
+      i = eytzingerFill (in, out, size, i, 2*k + 1, n);
+      memcpy (out + k*size, in + i*size, size);
+      ++i;
+      i = eytzingerFill (in, out, size, i, 2*k + 2, n);
+    }
+
+  return i;
+}
+
+static bool
+writeTable (tr_sys_file_t out, const void * sorted, size_t size, size_t n, tr_error ** error)
+{
+  bool ok;
+  uint8_t * tree;
+
+  if (n == 0)
+    return true;
+
+  tree = tr_malloc (size * n);
+
+  eytzingerFill (sorted, tree, size, 0, 0, n);
+  ok = tr_sys_file_write (out, tree, size * n, NULL, error);
+
+  tr_free (tree);
+  return ok;
+}
+
 int
-tr_blocklistFileSetContent (tr_blocklistFile * b, const char * filename)
+tr_blocklistCompile (const char * sourceFilename, const char * binFilename)
 {
   tr_sys_file_t in;
   tr_sys_file_t out;
   int inCount = 0;
-  char line[2048];
+  uint64_t byteCount;
+  tr_sys_path_info info;
+  const char * content = NULL;
+  const char * walk;
+  const char * end;
   const char * err_fmt = _("Couldn't read \"%1$s\": %2$s");
-  struct tr_ipv4_range * ranges = NULL;
-  size_t ranges_alloc = 0;
-  size_t ranges_count = 0;
+  struct tr_ipv4_range * ranges4 = NULL;
+  size_t ranges4_alloc = 0;
+  size_t ranges4_count = 0;
+  struct tr_ipv6_range * ranges6 = NULL;
+  size_t ranges6_alloc = 0;
+  size_t ranges6_count = 0;
+  struct tr_blocklist_header header;
+  int ret = -1;
   tr_error * error = NULL;
 
-  if (!filename)
+  if (!tr_sys_path_get_info (sourceFilename, 0, &info, &error))
     {
-      blocklistDelete (b);
-      return 0;
+      tr_logAddError (err_fmt, sourceFilename, error->message);
+      tr_error_free (error);
+      return -1;
     }
 
-  in = tr_sys_file_open (filename, TR_SYS_FILE_READ, 0, &error);
+  in = tr_sys_file_open (sourceFilename, TR_SYS_FILE_READ, 0, &error);
   if (in == TR_BAD_SYS_FILE)
     {
-      tr_logAddError (err_fmt, filename, error->message);
+      tr_logAddError (err_fmt, sourceFilename, error->message);
       tr_error_free (error);
-      return 0;
+      return -1;
     }
 
-  blocklistClose (b);
+  byteCount = info.size;
+  if (byteCount > 0)
+    {
+      content = tr_sys_file_map_for_reading (in, 0, byteCount, &error);
+      if (content == NULL)
+        {
+          tr_logAddError (err_fmt, sourceFilename, error->message);
+          tr_error_free (error);
+          tr_sys_file_close (in, NULL);
+          return -1;
+        }
+    }
 
-  out = tr_sys_file_open (b->filename,
+  out = tr_sys_file_open (binFilename,
                           TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE | TR_SYS_FILE_TRUNCATE,
                           0666, &error);
   if (out == TR_BAD_SYS_FILE)
     {
-      tr_logAddError (err_fmt, b->filename, error->message);
+      tr_logAddError (err_fmt, binFilename, error->message);
       tr_error_free (error);
+      if (content != NULL)
+        tr_sys_file_unmap (content, byteCount, NULL);
       tr_sys_file_close (in, NULL);
-      return 0;
+      return -1;
     }
 
   /* load the rules into memory */
-  while (tr_sys_file_read_line (in, line, sizeof (line), NULL))
+  for (walk=content, end=content+byteCount; walk!=end; )
     {
-      struct tr_ipv4_range range;
+      tr_address begin;
+      tr_address last;
+      const char * eol = memchr (walk, '\n', end - walk);
+      const char * next = eol ? eol + 1 : end;
+
+      if (eol == NULL)
+        eol = end;
+      if (eol != walk && eol[-1] == '\r')
+        --eol;
 
       ++inCount;
 
-      if (!parseLine (line, &range))
+      if (!parseLine (walk, eol, &begin, &last))
         {
           /* don't try to display the actual lines - it causes issues */
           tr_logAddError (_("blocklist skipped invalid address at line %d"), inCount);
-          continue;
         }
-
-      if (ranges_alloc == ranges_count)
+      else if (begin.type == TR_AF_INET)
         {
-          ranges_alloc += 4096; /* arbitrary */
-          ranges = tr_renew (struct tr_ipv4_range, ranges, ranges_alloc);
+          if (ranges4_alloc == ranges4_count)
+            {
+              ranges4_alloc += 4096; /* arbitrary */
+              ranges4 = tr_renew (struct tr_ipv4_range, ranges4, ranges4_alloc);
+            }
+
+          ranges4[ranges4_count].begin = ntohl (begin.addr.addr4.s_addr);
+          ranges4[ranges4_count].end = ntohl (last.addr.addr4.s_addr);
+          ++ranges4_count;
+        }
+      else
+        {
+          if (ranges6_alloc == ranges6_count)
+            {
+              ranges6_alloc += 1024; /* arbitrary */
+              ranges6 = tr_renew (struct tr_ipv6_range, ranges6, ranges6_alloc);
+            }
+
+          memcpy (ranges6[ranges6_count].begin, begin.addr.addr6.s6_addr, 16);
+          memcpy (ranges6[ranges6_count].end, last.addr.addr6.s6_addr, 16);
+          ++ranges6_count;
         }
 
-      ranges[ranges_count++] = range;
+      walk = next;
     }
 
-  if (ranges_count > 0) /* sort and merge */
-    {
-      struct tr_ipv4_range * r;
-      struct tr_ipv4_range * keep = ranges;
-      const struct tr_ipv4_range * end;
-
-      /* sort */
-      qsort (ranges, ranges_count, sizeof (struct tr_ipv4_range),
-             compareAddressRangesByFirstAddress);
-
-      /* merge */
-      for (r=ranges+1, end=ranges+ranges_count; r!=end; ++r) {
-        if (keep->end < r->begin)
-          *++keep = *r;
-        else if (keep->end < r->end)
-          keep->end = r->end;
-      }
+  if (content != NULL)
+    tr_sys_file_unmap (content, byteCount, NULL);
+  tr_sys_file_close (in, NULL);
 
-      ranges_count = keep + 1 - ranges;
+  /* sort and merge */
+  ranges4_count = mergeIPv4Ranges (ranges4, ranges4_count);
+  ranges6_count = mergeIPv6Ranges (ranges6, ranges6_count);
 
 #ifndef NDEBUG
-      /* sanity checks: make sure the rules are sorted
-       * in ascending order and don't overlap */
-      {
-        size_t i;
+  /* sanity checks: make sure the rules are sorted
+   * in ascending order and don't overlap */
+  {
+    size_t i;
+
+    for (i=0; i<ranges4_count; ++i)
+      assert (ranges4[i].begin <= ranges4[i].end);
 
-        for (i=0; i<ranges_count; ++i)
-          assert (ranges[i].begin <= ranges[i].end);
+    for (i=1; i<ranges4_count; ++i)
+      assert (ranges4[i-1].end < ranges4[i].begin);
 
-        for (i=1; i<ranges_count; ++i)
-          assert (ranges[i-1].end < ranges[i].begin);
-      }
+    for (i=1; i<ranges6_count; ++i)
+      assert (memcmp (ranges6[i-1].end, ranges6[i].begin, 16) < 0);
+  }
 #endif
+
+  memcpy (header.magic, BLOCKLIST_MAGIC, 4);
+  header.version = BLOCKLIST_VERSION;
+  header.ipv4Count = ranges4_count;
+  header.ipv6Count = ranges6_count;
+
+  if (!tr_sys_file_write (out, &header, sizeof (header), NULL, &error)
+      || !writeTable (out, ranges4, sizeof (struct tr_ipv4_range), ranges4_count, &error)
+      || !writeTable (out, ranges6, sizeof (struct tr_ipv6_range), ranges6_count, &error))
+    {
+      tr_logAddError (_("Couldn't save file \"%1$s\": %2$s"), binFilename, error->message);
+      tr_error_free (error);
+    }
+  else
+    {
+      ret = ranges4_count + ranges6_count;
     }
 
-  if (!tr_sys_file_write (out, ranges, sizeof (struct tr_ipv4_range) * ranges_count, NULL, &error))
+  tr_free (ranges6);
+  tr_free (ranges4);
+  tr_sys_file_close (out, NULL);
+
+  if (ret < 0)
+    tr_sys_path_remove (binFilename, NULL);
+
+  return ret;
+}
+
+int
+tr_blocklistFileInstall (tr_blocklistFile * b, const char * binFilename)
+{
+  tr_error * error = NULL;
+
+  blocklistClose (b);
+
+  if (!tr_sys_path_rename (binFilename, b->filename, &error))
     {
       tr_logAddError (_("Couldn't save file \"%1$s\": %2$s"), b->filename, error->message);
       tr_error_free (error);
     }
-  else
+
+  blocklistLoad (b);
+
+  if (b->map != NULL)
     {
       char * base = tr_sys_path_basename (b->filename, NULL);
-      tr_logAddInfo (_("Blocklist \"%s\" updated with %"TR_PRIuSIZE" entries"), base, ranges_count);
+      tr_logAddInfo (_("Blocklist \"%s\" updated with %"TR_PRIuSIZE" entries"), base, b->ruleCount);
       tr_free (base);
     }
 
-  tr_free (ranges);
-  tr_sys_file_close (out, NULL);
-  tr_sys_file_close (in, NULL);
+  return b->ruleCount;
+}
 
-  blocklistLoad (b);
+int
+tr_blocklistFileSetContent (tr_blocklistFile * b, const char * filename)
+{
+  int ruleCount = 0;
+  char * tmp;
+
+  if (!filename)
+    {
+      blocklistDelete (b);
+      return 0;
+    }
+
+  /* compile next to the live file, then swap it into place */
+  tmp = tr_strdup_printf ("%s.tmp", b->filename);
+  if (tr_blocklistCompile (filename, tmp) >= 0)
+    ruleCount = tr_blocklistFileInstall (b, tmp);
+  tr_free (tmp);
+
+  return ruleCount;
+}
+
+/***
+****  Index
+***/
+
+struct tr_blocklistIndex
+{
+  struct tr_ipv4_range * rules4;
+  size_t                 ruleCount4;
+  struct tr_ipv6_range * rules6;
+  size_t                 ruleCount6;
+};
+
+/* frees `sorted' and returns its contents in Eytzinger order */
+static void *
+toEytzinger (void * sorted, size_t size, size_t n)
+{
+  uint8_t * tree = tr_malloc (size * n);
+
+  eytzingerFill (sorted, tree, size, 0, 0, n);
+
+  tr_free (sorted);
+  return tree;
+}
+
+tr_blocklistIndex *
+tr_blocklistIndexNew (const tr_list * blocklists)
+{
+  const tr_list * l;
+  size_t n4 = 0;
+  size_t n6 = 0;
+  struct tr_ipv4_range * rules4;
+  struct tr_ipv6_range * rules6;
+  tr_blocklistIndex * index = tr_new0 (tr_blocklistIndex, 1);
+
+  for (l=blocklists; l!=NULL; l=l->next)
+    {
+      tr_blocklistFile * b = l->data;
+
+      blocklistEnsureLoaded (b);
+      n4 += b->ruleCount4;
+      n6 += b->ruleCount6;
+    }
+
+  rules4 = tr_new (struct tr_ipv4_range, n4);
+  rules6 = tr_new (struct tr_ipv6_range, n6);
+
+  n4 = n6 = 0;
+  for (l=blocklists; l!=NULL; l=l->next)
+    {
+      const tr_blocklistFile * b = l->data;
+
+      if (b->ruleCount4 > 0)
+        memcpy (rules4 + n4, b->rules4, b->ruleCount4 * sizeof (struct tr_ipv4_range));
+      if (b->ruleCount6 > 0)
+        memcpy (rules6 + n6, b->rules6, b->ruleCount6 * sizeof (struct tr_ipv6_range));
+
+      n4 += b->ruleCount4;
+      n6 += b->ruleCount6;
+    }
+
+  /* the lists may overlap each other, so sort and merge them again */
+  index->ruleCount4 = mergeIPv4Ranges (rules4, n4);
+  index->rules4 = toEytzinger (rules4, sizeof (struct tr_ipv4_range), index->ruleCount4);
+  index->ruleCount6 = mergeIPv6Ranges (rules6, n6);
+  index->rules6 = toEytzinger (rules6, sizeof (struct tr_ipv6_range), index->ruleCount6);
+
+  return index;
+}
+
+void
+tr_blocklistIndexFree (tr_blocklistIndex * index)
+{
+  if (index != NULL)
+    {
+      tr_free (index->rules6);
+      tr_free (index->rules4);
+      tr_free (index);
+    }
+}
+
+bool
+tr_blocklistIndexHasAddress (const tr_blocklistIndex * index, const tr_address * addr)
+{
+  assert (tr_address_is_valid (addr));
+
+  if (index == NULL)
+    return false;
 
-  return ranges_count;
+  return hasAddress (index->rules4, index->ruleCount4,
+                     index->rules6, index->ruleCount6, addr);
 }
@@ -15,6 +15,7 @@
 #define TR_BLOCKLIST_H
 
 struct tr_address;
+struct tr_list;
 
 typedef struct tr_blocklistFile tr_blocklistFile;
 
@@ -37,7 +38,39 @@ void               tr_blocklistFileSetEnabled   (tr_blocklistFile        * b,
 bool               tr_blocklistFileHasAddress   (tr_blocklistFile        * b,
                                                  const struct tr_address * addr);
 
+/** @brief true if `filename' is a compiled blocklist in the current format */
+bool               tr_blocklistFileIsCurrent    (const char              * filename);
+
 int                tr_blocklistFileSetContent   (tr_blocklistFile        * b,
                                                  const char              * filename);
 
+/**
+ * @brief compile the blocklist source `sourceFilename' into `binFilename'
+ *
+ * This doesn't touch any tr_blocklistFile, so it can run on a worker thread
+ * while peers are still being checked against the current rules.
+ *
+ * @return the number of rules, or -1 on error
+ */
+int                tr_blocklistCompile          (const char              * sourceFilename,
+                                                 const char              * binFilename);
+
+/** @brief replace b's rules with a file made by tr_blocklistCompile () */
+int                tr_blocklistFileInstall      (tr_blocklistFile        * b,
+                                                 const char              * binFilename);
+
+/**
+ * A single lookup table merged from a list of tr_blocklistFiles,
+ * so that one search answers for all of them.
+ * It's a snapshot: rebuild it when any of the lists change.
+ */
+typedef struct tr_blocklistIndex tr_blocklistIndex;
+
+tr_blocklistIndex * tr_blocklistIndexNew        (const struct tr_list    * blocklists);
+
+void               tr_blocklistIndexFree        (tr_blocklistIndex       * index);
+
+bool               tr_blocklistIndexHasAddress  (const tr_blocklistIndex * index,
+                                                 const struct tr_address * addr);
+
 #endif
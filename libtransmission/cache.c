@@ -7,15 +7,23 @@
  * $Id$
  */
 
+#include <errno.h> /* EAGAIN */
 #include <stdlib.h> /* qsort () */
+#include <string.h> /* memcpy () */
+
+#ifndef _WIN32
+ #include <sys/mman.h> /* madvise () */
+#endif
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
 #include "cache.h"
+#include "file.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "platform.h" /* tr_lock, tr_thread */
 #include "ptrarray.h"
 #include "torrent.h"
 #include "trevent.h"
@@ -23,220 +31,1484 @@
 
 #define MY_NAME "Cache"
 
-#define dbgmsg(...) \
-  do \
-    { \
-      if (tr_logGetDeepEnabled ()) \
-        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
-    } \
-  while (0)
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, MY_NAME, __VA_ARGS__); \
+    } \
+  while (0)
+
+/****
+*****
+****/
+
+struct cache_run;
+struct slab_slot;
+
+struct cache_block
+{
+  tr_torrent * tor;
+
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+
+  time_t time;
+  tr_block_index_t block;
+
+  /* the block's data, in a slot from the cache's slab */
+  struct slab_slot * slot;
+
+  /* next block in the same hash bucket */
+  struct cache_block * hash_next;
+
+  /* the next block in this block's run */
+  struct cache_block * run_next;
+
+  /* the run this block belongs to.
+     only valid for the first and last blocks of a run */
+  struct cache_run * run;
+};
+
+/* a run is a sequence of contiguous blocks in the same torrent */
+struct cache_run
+{
+  struct cache_block * first;
+  struct cache_block * last;
+  int len;
+
+  struct cache_run * prev;
+  struct cache_run * next;
+};
+
+/* a clean block that was recently read from disk */
+struct clean_block
+{
+  tr_torrent * tor;
+  tr_block_index_t block;
+  uint32_t length;
+
+  uint8_t * buf;
+
+  /* next block in the same hash bucket */
+  struct clean_block * hash_next;
+
+  /* neighbors in the LRU list */
+  struct clean_block * lru_prev;
+  struct clean_block * lru_next;
+};
+
+/* a run that's been flushed from the cache and is waiting to be written */
+struct cache_write
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+
+  /* byte offset of the write in the torrent */
+  uint64_t begin;
+
+  /* the run's blocks, moved here without copying them */
+  struct evbuffer * evbuf;
+
+  /* where the blocks go, worked out before the write was queued */
+  struct tr_io_write_plan * plan;
+
+  struct cache_write * next;
+};
+
+/* a queued write that failed, so the next flush of its torrent can say so */
+struct write_error
+{
+  int torrentId;
+  int err;
+  struct write_error * next;
+};
+
+/* the queued writes for one device, and the thread writing them.
+   each device gets its own so a slow disk can't hold up a fast one */
+struct write_queue
+{
+  tr_cache * cache;
+
+  /* char*, the folders known to be on this device.
+     the first one is compared against folders that aren't known yet.
+     a queue with no folders takes the writes whose device is unknown */
+  tr_ptrArray dirs;
+
+  /* a write stays at the head of the queue until it's on disk,
+     so tr_cacheReadBlock () can still find the data */
+  struct cache_write * head;
+  struct cache_write * tail;
+  size_t bytes;
+  tr_thread * writer;
+
+  struct write_queue * next;
+};
+
+struct tr_cache
+{
+  /* hash table of all the cached blocks, keyed by torrent & block index */
+  struct cache_block ** buckets;
+  size_t bucket_count;
+  int block_count;
+
+  /* list of all the runs */
+  struct cache_run * runs;
+  int run_count;
+
+  int max_blocks;
+  size_t max_bytes;
+
+  /* the per-device write queues, all protected by write_lock.
+     queues are only added from the libtransmission thread,
+     and they stay around until the cache is freed */
+  tr_lock * write_lock;
+  struct write_queue * write_queues;
+  struct write_error * write_errors;
+
+  /* where the cached blocks' data lives */
+  struct block_slab * slab;
+
+  /* hash table of the clean blocks in the read cache,
+     and an LRU list of them: most recently used first */
+  struct clean_block ** clean_buckets;
+  size_t clean_bucket_count;
+  int clean_count;
+  struct clean_block * lru_head;
+  struct clean_block * lru_tail;
+  size_t clean_bytes;
+  size_t max_clean_bytes;
+
+  /* the session's over its memory budget; see tr_cacheSetMemoryLow () */
+  bool memory_low;
+
+  uint64_t read_hits;
+  uint64_t read_misses;
+
+  /* reads made by tr_cacheReadBlocks (), and the blocks in them */
+  uint64_t merged_reads;
+  uint64_t merged_read_blocks;
+
+  size_t disk_writes;
+  size_t disk_write_blocks;
+  size_t disk_write_bytes;
+  size_t cache_writes;
+  size_t cache_write_bytes;
+};
+
+/****
+*****  Block Slab
+****/
+
+/* The cached blocks' data is kept in big chunks of MAX_BLOCK_SIZE slots
+ * instead of in an evbuffer per block. This saves a malloc () and
+ * libevent's chain overhead for every block, doesn't fragment the heap
+ * when there are tens of thousands of blocks, and lets the kernel back
+ * the chunks with huge pages. When a run is flushed, the write's evbuffer
+ * references the slots and hands them back when it's freed, which
+ * happens in the writer threads -- so the slab has its own lock. */
+
+enum
+{
+  /* the size of a transparent huge page on x86 */
+  SLAB_CHUNK_BYTES = 1024 * 1024 * 2,
+
+  SLOTS_PER_CHUNK = SLAB_CHUNK_BYTES / MAX_BLOCK_SIZE
+};
+
+struct block_slab;
+struct slab_chunk;
+
+struct slab_slot
+{
+  struct slab_chunk * chunk;
+  struct slab_slot * next_free;
+};
+
+struct slab_chunk
+{
+  struct block_slab * slab;
+  uint8_t * data;
+  int used;
+  struct slab_slot * free_head;
+  struct slab_slot slots[SLOTS_PER_CHUNK];
+
+  struct slab_chunk * prev;
+  struct slab_chunk * next;
+};
+
+struct block_slab
+{
+  tr_lock * lock;
+
+  /* chunks with free slots come before the full ones */
+  struct slab_chunk * head;
+  struct slab_chunk * tail;
+  int chunk_count;
+
+  /* one empty chunk is kept so a cache that's hovering around
+     a chunk boundary doesn't keep allocating and freeing it */
+  struct slab_chunk * spare;
+};
+
+static inline uint8_t *
+slotData (const struct slab_slot * slot)
+{
+  return slot->chunk->data + (slot - slot->chunk->slots) * MAX_BLOCK_SIZE;
+}
+
+static uint8_t *
+allocChunkData (void)
+{
+  uint8_t * data = NULL;
+
+#ifdef HAVE_POSIX_MEMALIGN
+  /* aligning to the chunk size lets a huge page cover all of it */
+  if (posix_memalign ((void **) &data, SLAB_CHUNK_BYTES, SLAB_CHUNK_BYTES))
+    data = NULL;
+#endif
+
+  if (data == NULL)
+    data = tr_valloc (SLAB_CHUNK_BYTES);
+
+#ifdef MADV_HUGEPAGE
+  if (data != NULL)
+    madvise (data, SLAB_CHUNK_BYTES, MADV_HUGEPAGE);
+#endif
+
+  return data;
+}
+
+static struct slab_chunk *
+chunkNew (struct block_slab * slab)
+{
+  int i;
+  struct slab_chunk * chunk = tr_new0 (struct slab_chunk, 1);
+
+  chunk->slab = slab;
+  chunk->data = allocChunkData ();
+  for (i=SLOTS_PER_CHUNK-1; i>=0; --i)
+    {
+      chunk->slots[i].chunk = chunk;
+      chunk->slots[i].next_free = chunk->free_head;
+      chunk->free_head = &chunk->slots[i];
+    }
+
+  return chunk;
+}
+
+static void
+chunkFree (struct slab_chunk * chunk)
+{
+  if (chunk != NULL)
+    {
+      assert (chunk->used == 0);
+      tr_free (chunk->data);
+      tr_free (chunk);
+    }
+}
+
+static void
+chunkUnlink (struct block_slab * slab, struct slab_chunk * chunk)
+{
+  if (chunk->prev != NULL)
+    chunk->prev->next = chunk->next;
+  else
+    slab->head = chunk->next;
+
+  if (chunk->next != NULL)
+    chunk->next->prev = chunk->prev;
+  else
+    slab->tail = chunk->prev;
+
+  chunk->prev = chunk->next = NULL;
+  --slab->chunk_count;
+}
+
+static void
+chunkPushFront (struct block_slab * slab, struct slab_chunk * chunk)
+{
+  chunk->prev = NULL;
+  chunk->next = slab->head;
+  if (slab->head != NULL)
+    slab->head->prev = chunk;
+  else
+    slab->tail = chunk;
+  slab->head = chunk;
+  ++slab->chunk_count;
+}
+
+static void
+chunkPushBack (struct block_slab * slab, struct slab_chunk * chunk)
+{
+  chunk->next = NULL;
+  chunk->prev = slab->tail;
+  if (slab->tail != NULL)
+    slab->tail->next = chunk;
+  else
+    slab->head = chunk;
+  slab->tail = chunk;
+  ++slab->chunk_count;
+}
+
+static struct block_slab *
+slabNew (void)
+{
+  struct block_slab * slab = tr_new0 (struct block_slab, 1);
+  slab->lock = tr_lockNew ();
+  return slab;
+}
+
+static void
+slabFree (struct block_slab * slab)
+{
+  assert (slab->head == NULL);
+
+  chunkFree (slab->spare);
+  tr_lockFree (slab->lock);
+  tr_free (slab);
+}
+
+static uint64_t
+slabGetBytes (struct block_slab * slab)
+{
+  uint64_t bytes;
+
+  tr_lockLock (slab->lock);
+  bytes = (uint64_t)(slab->chunk_count + (slab->spare != NULL ? 1 : 0)) * SLAB_CHUNK_BYTES;
+  tr_lockUnlock (slab->lock);
+
+  return bytes;
+}
+
+static struct slab_slot *
+slabAlloc (struct block_slab * slab)
+{
+  struct slab_slot * slot;
+  struct slab_chunk * chunk;
+
+  tr_lockLock (slab->lock);
+
+  chunk = slab->head;
+  if (chunk == NULL || chunk->free_head == NULL)
+    {
+      if ((chunk = slab->spare) != NULL)
+        slab->spare = NULL;
+      else
+        chunk = chunkNew (slab);
+      chunkPushFront (slab, chunk);
+    }
+
+  slot = chunk->free_head;
+  chunk->free_head = slot->next_free;
+  slot->next_free = NULL;
+  ++chunk->used;
+
+  /* keep the full chunks behind the ones that still have room */
+  if (chunk->free_head == NULL && chunk != slab->tail)
+    {
+      chunkUnlink (slab, chunk);
+      chunkPushBack (slab, chunk);
+    }
+
+  tr_lockUnlock (slab->lock);
+
+  return slot;
+}
+
+static void
+slabRelease (struct block_slab * slab, struct slab_slot * slot)
+{
+  bool was_full;
+  struct slab_chunk * chunk = slot->chunk;
+
+  tr_lockLock (slab->lock);
+
+  was_full = chunk->free_head == NULL;
+  assert (chunk->used > 0);
+  slot->next_free = chunk->free_head;
+  chunk->free_head = slot;
+  --chunk->used;
+
+  if (chunk->used == 0)
+    {
+      chunkUnlink (slab, chunk);
+      chunkFree (slab->spare);
+      slab->spare = chunk;
+    }
+  else if (was_full && chunk != slab->head)
+    {
+      chunkUnlink (slab, chunk);
+      chunkPushFront (slab, chunk);
+    }
+
+  tr_lockUnlock (slab->lock);
+}
+
+/* evbuffer_add_reference () cleanup for a flushed block */
+static void
+releaseSlotRef (const void * data UNUSED, size_t len UNUSED, void * vslot)
+{
+  struct slab_slot * slot = vslot;
+
+  slabRelease (slot->chunk->slab, slot);
+}
+
+/****
+*****  Block Index
+****/
+
+enum
+{
+  MIN_BUCKET_COUNT = 64
+};
+
+static inline size_t
+hashBlock (const tr_torrent * tor, tr_block_index_t block)
+{
+  size_t h = (size_t)tor->uniqueId * 2654435761u;
+  h ^= (size_t)block * 40503u + (h >> 7);
+  return h;
+}
+
+static inline size_t
+getBucket (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  return hashBlock (tor, block) & (cache->bucket_count - 1);
+}
+
+static struct cache_block *
+findBlockByIndex (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct cache_block * cb;
+
+  if (cache->bucket_count == 0)
+    return NULL;
+
+  for (cb=cache->buckets[getBucket (cache, tor, block)]; cb!=NULL; cb=cb->hash_next)
+    if ((cb->block == block) && (cb->tor == tor))
+      break;
+
+  return cb;
+}
+
+static void
+rehash (tr_cache * cache, size_t bucket_count)
+{
+  size_t i;
+  struct cache_block ** old_buckets = cache->buckets;
+  const size_t old_bucket_count = cache->bucket_count;
+
+  cache->buckets = tr_new0 (struct cache_block*, bucket_count);
+  cache->bucket_count = bucket_count;
+
+  for (i=0; i<old_bucket_count; ++i)
+    {
+      struct cache_block * cb = old_buckets[i];
+
+      while (cb != NULL)
+        {
+          struct cache_block * next = cb->hash_next;
+          const size_t bucket = getBucket (cache, cb->tor, cb->block);
+          cb->hash_next = cache->buckets[bucket];
+          cache->buckets[bucket] = cb;
+          cb = next;
+        }
+    }
+
+  tr_free (old_buckets);
+}
+
+static void
+indexAdd (tr_cache * cache, struct cache_block * cb)
+{
+  size_t bucket;
+
+  if ((size_t)cache->block_count >= cache->bucket_count)
+    rehash (cache, MAX (MIN_BUCKET_COUNT, cache->bucket_count * 2));
+
+  bucket = getBucket (cache, cb->tor, cb->block);
+  cb->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = cb;
+  ++cache->block_count;
+}
+
+static void
+indexRemove (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block ** walk = &cache->buckets[getBucket (cache, cb->tor, cb->block)];
+
+  while (*walk != cb)
+    walk = &(*walk)->hash_next;
+
+  *walk = cb->hash_next;
+  --cache->block_count;
+}
+
+/****
+*****  Runs
+****/
+
+static void
+runLink (tr_cache * cache, struct cache_run * run)
+{
+  run->prev = NULL;
+  run->next = cache->runs;
+  if (cache->runs != NULL)
+    cache->runs->prev = run;
+  cache->runs = run;
+  ++cache->run_count;
+}
+
+static void
+runUnlink (tr_cache * cache, struct cache_run * run)
+{
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    cache->runs = run->next;
+
+  if (run->next != NULL)
+    run->next->prev = run->prev;
+
+  --cache->run_count;
+}
+
+/* add a new block to the run structure, creating a new run for it
+ * or joining it to the runs on either side of it */
+static void
+runAddBlock (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block * prev = cb->block > 0 ? findBlockByIndex (cache, cb->tor, cb->block - 1) : NULL;
+  struct cache_block * next = findBlockByIndex (cache, cb->tor, cb->block + 1);
+
+  cb->run_next = NULL;
+
+  /* since cb wasn't cached, prev must be the end of its run,
+     and next must be the beginning of its run */
+  assert (prev == NULL || prev->run->last == prev);
+  assert (next == NULL || next->run->first == next);
+
+  if (prev != NULL && next != NULL)
+    {
+      struct cache_run * a = prev->run;
+      struct cache_run * b = next->run;
+
+      prev->run_next = cb;
+      cb->run_next = next;
+      a->last = b->last;
+      a->last->run = a;
+      a->len += 1 + b->len;
+
+      runUnlink (cache, b);
+      tr_free (b);
+    }
+  else if (prev != NULL)
+    {
+      struct cache_run * a = prev->run;
+
+      prev->run_next = cb;
+      a->last = cb;
+      cb->run = a;
+      ++a->len;
+    }
+  else if (next != NULL)
+    {
+      struct cache_run * b = next->run;
+
+      cb->run_next = next;
+      b->first = cb;
+      cb->run = b;
+      ++b->len;
+    }
+  else
+    {
+      struct cache_run * run = tr_new0 (struct cache_run, 1);
+
+      run->first = run->last = cb;
+      run->len = 1;
+      cb->run = run;
+      runLink (cache, run);
+    }
+}
+
+/****
+*****
+****/
+
+struct run_info
+{
+  struct cache_run * run;
+  int rank;
+  time_t last_block_time;
+  bool is_multi_piece;
+  bool is_piece_done;
+  unsigned len;
+};
+
+static void
+getRunInfo (struct cache_run * run, struct run_info * info)
+{
+  const struct cache_block * first = run->first;
+  const struct cache_block * last = run->last;
+
+  info->run = run;
+  info->last_block_time = last->time;
+  info->is_piece_done = tr_torrentPieceIsComplete (last->tor, last->piece);
+  info->is_multi_piece = last->piece != first->piece;
+  info->len = run->len;
+}
+
+/* higher rank comes before lower rank */
+static int
+compareRuns (const void * va, const void * vb)
+{
+  const struct run_info * a = va;
+  const struct run_info * b = vb;
+  return b->rank - a->rank;
+}
+
+enum
+{
+  MULTIFLAG   = 0x1000,
+  DONEFLAG    = 0x2000,
+  SESSIONFLAG = 0x4000
+};
+
+/* Calculte runs
+ *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
+ *     Returns number of runs.
+ */
+static int
+calcRuns (tr_cache * cache, struct run_info * runs)
+{
+  int i = 0;
+  struct cache_run * run;
+  const time_t now = tr_time ();
+
+  for (run=cache->runs; run!=NULL; run=run->next, ++i)
+    {
+      int rank;
+
+      getRunInfo (run, &runs[i]);
+      rank = runs[i].len;
+
+      /* This adds ~2 to the relative length of a run for every minute it has
+       * languished in the cache. */
+      rank += (now - runs[i].last_block_time) / 32;
+
+      /* Flushing stale blocks should be a top priority as the probability of them
+       * growing is very small, for blocks on piece boundaries, and nonexistant for
+       * blocks inside pieces. */
+      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+
+      /* Move the multi piece runs higher */
+      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+
+      runs[i].rank = rank;
+    }
+
+  assert (i == cache->run_count);
+  qsort (runs, i, sizeof (struct run_info), compareRuns);
+  return i;
+}
+
+/****
+*****  Read Cache
+****/
+
+static inline size_t
+getCleanBucket (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  return hashBlock (tor, block) & (cache->clean_bucket_count - 1);
+}
+
+static struct clean_block *
+findCleanBlock (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct clean_block * cb;
+
+  if (cache->clean_bucket_count == 0)
+    return NULL;
+
+  for (cb=cache->clean_buckets[getCleanBucket (cache, tor, block)]; cb!=NULL; cb=cb->hash_next)
+    if ((cb->block == block) && (cb->tor == tor))
+      break;
+
+  return cb;
+}
+
+static void
+cleanRehash (tr_cache * cache, size_t bucket_count)
+{
+  struct clean_block * cb;
+
+  tr_free (cache->clean_buckets);
+  cache->clean_buckets = tr_new0 (struct clean_block*, bucket_count);
+  cache->clean_bucket_count = bucket_count;
+
+  for (cb=cache->lru_head; cb!=NULL; cb=cb->lru_next)
+    {
+      const size_t bucket = getCleanBucket (cache, cb->tor, cb->block);
+      cb->hash_next = cache->clean_buckets[bucket];
+      cache->clean_buckets[bucket] = cb;
+    }
+}
+
+static void
+lruUnlink (tr_cache * cache, struct clean_block * cb)
+{
+  if (cb->lru_prev != NULL)
+    cb->lru_prev->lru_next = cb->lru_next;
+  else
+    cache->lru_head = cb->lru_next;
+
+  if (cb->lru_next != NULL)
+    cb->lru_next->lru_prev = cb->lru_prev;
+  else
+    cache->lru_tail = cb->lru_prev;
+}
+
+static void
+lruPushFront (tr_cache * cache, struct clean_block * cb)
+{
+  cb->lru_prev = NULL;
+  cb->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL)
+    cache->lru_head->lru_prev = cb;
+  else
+    cache->lru_tail = cb;
+  cache->lru_head = cb;
+}
+
+static void
+cleanRemove (tr_cache * cache, struct clean_block * cb)
+{
+  struct clean_block ** walk = &cache->clean_buckets[getCleanBucket (cache, cb->tor, cb->block)];
+
+  while (*walk != cb)
+    walk = &(*walk)->hash_next;
+  *walk = cb->hash_next;
+
+  lruUnlink (cache, cb);
+  --cache->clean_count;
+  cache->clean_bytes -= cb->length;
+  cb->tor->cacheBytes -= cb->length;
+
+  tr_free (cb->buf);
+  tr_free (cb);
+}
+
+/* evict the least recently used blocks until the read cache fits into max_bytes */
+static void
+cleanTrim (tr_cache * cache, size_t max_bytes)
+{
+  while ((cache->lru_tail != NULL) && (cache->clean_bytes > max_bytes))
+    cleanRemove (cache, cache->lru_tail);
+}
+
+/* while the session's low on memory, both caches shrink to a quarter */
+static size_t
+getCleanLimit (const tr_cache * cache)
+{
+  return cache->memory_low ? cache->max_clean_bytes / 4 : cache->max_clean_bytes;
+}
+
+static int
+getBlockLimit (const tr_cache * cache)
+{
+  return cache->memory_low ? cache->max_blocks / 4 : cache->max_blocks;
+}
+
+static void
+cleanAdd (tr_cache         * cache,
+          tr_torrent       * tor,
+          tr_block_index_t   block,
+          const uint8_t    * buf,
+          uint32_t           len)
+{
+  size_t bucket;
+  struct clean_block * cb;
+
+  const size_t max_bytes = getCleanLimit (cache);
+
+  if (len > max_bytes)
+    return;
+
+  cleanTrim (cache, max_bytes - len);
+
+  if ((size_t)cache->clean_count >= cache->clean_bucket_count)
+    cleanRehash (cache, MAX (MIN_BUCKET_COUNT, cache->clean_bucket_count * 2));
+
+  cb = tr_new (struct clean_block, 1);
+  cb->tor = tor;
+  cb->block = block;
+  cb->length = len;
+  cb->buf = tr_memdup (buf, len);
+
+  bucket = getCleanBucket (cache, tor, block);
+  cb->hash_next = cache->clean_buckets[bucket];
+  cache->clean_buckets[bucket] = cb;
+  lruPushFront (cache, cb);
+  ++cache->clean_count;
+  cache->clean_bytes += len;
+  tor->cacheBytes += len;
+}
+
+/* drop a torrent's blocks [first...last] from the read cache */
+static void
+cleanRemoveRange (tr_cache         * cache,
+                  const tr_torrent * tor,
+                  tr_block_index_t   first,
+                  tr_block_index_t   last)
+{
+  struct clean_block * cb = cache->lru_head;
+
+  while (cb != NULL)
+    {
+      struct clean_block * next = cb->lru_next;
+
+      if ((cb->tor == tor) && (first <= cb->block) && (cb->block <= last))
+        cleanRemove (cache, cb);
+
+      cb = next;
+    }
+}
+
+/* the read cache only holds whole blocks */
+static bool
+isWholeBlock (const tr_torrent * tor,
+              tr_piece_index_t   piece,
+              uint32_t           offset,
+              uint32_t           len,
+              tr_block_index_t * setme)
+{
+  const tr_block_index_t block = _tr_block (tor, piece, offset);
+
+  *setme = block;
+
+  return (tr_pieceOffset (tor, piece, offset, 0) == (uint64_t)block * tor->blockSize)
+      && (len == tr_torBlockCountBytes (tor, block));
+}
+
+/****
+*****  Hot Pieces
+****/
+
+enum
+{
+  /* how many pieces tr_cacheGetHotPieces () keeps count of */
+  MAX_HOT_CANDIDATES = 64
+};
+
+struct hot_piece
+{
+  tr_piece_index_t piece;
+  uint64_t bytes;
+};
+
+static void
+hotAdd (struct hot_piece * hot, size_t * n, tr_piece_index_t piece, uint64_t bytes)
+{
+  size_t i;
+
+  for (i=0; i<*n; ++i)
+    {
+      if (hot[i].piece == piece)
+        {
+          hot[i].bytes += bytes;
+          return;
+        }
+    }
+
+  if (*n < MAX_HOT_CANDIDATES)
+    {
+      hot[*n].piece = piece;
+      hot[*n].bytes = bytes;
+      ++*n;
+    }
+}
+
+size_t
+tr_cacheGetHotPieces (tr_cache         * cache,
+                      const tr_torrent * tor,
+                      tr_piece_index_t * setme,
+                      size_t             max)
+{
+  size_t i;
+  size_t n = 0;
+  size_t count = 0;
+  struct hot_piece hot[MAX_HOT_CANDIDATES];
+  const struct clean_block * clean;
+  const struct cache_run * run;
+  const struct write_queue * queue;
+
+  for (clean=cache->lru_head; clean!=NULL; clean=clean->lru_next)
+    if (clean->tor == tor)
+      hotAdd (hot, &n, tr_torBlockPiece (tor, clean->block), clean->length);
+
+  for (run=cache->runs; run!=NULL; run=run->next)
+    {
+      const struct cache_block * cb;
+
+      if (run->first->tor != tor)
+        continue;
+
+      for (cb=run->first; cb!=NULL; cb=cb==run->last ? NULL : cb->run_next)
+        hotAdd (hot, &n, cb->piece, cb->length);
+    }
+
+  /* a queued write can span pieces */
+  tr_lockLock (cache->write_lock);
+  for (queue=cache->write_queues; queue!=NULL; queue=queue->next)
+    {
+      const struct cache_write * w;
+
+      for (w=queue->head; w!=NULL; w=w->next)
+        {
+          uint64_t pos = w->begin;
+          const uint64_t end = w->begin + w->length;
+
+          if (w->tor != tor)
+            continue;
+
+          while (pos < end)
+            {
+              const tr_piece_index_t piece = pos / tor->info.pieceSize;
+              const uint64_t next = MIN (end, (uint64_t)(piece + 1) * tor->info.pieceSize);
+              hotAdd (hot, &n, piece, next - pos);
+              pos = next;
+            }
+        }
+    }
+  tr_lockUnlock (cache->write_lock);
+
+  for (i=0; i<n && count<max; ++i)
+    if (hot[i].bytes * 2 >= tr_torPieceCountBytes (tor, hot[i].piece))
+      setme[count++] = hot[i].piece;
+
+  return count;
+}
+
+/****
+*****  Writer Thread
+****/
+
+enum
+{
+  /* don't let the write queue grow larger than the cache itself,
+     but give it some room even if the cache is tiny */
+  MIN_WRITE_QUEUE_BYTES = 1024 * 1024 * 4,
+
+  /* the most data the writer thread hands to a single tr_ioWritePlanned () */
+  MAX_WRITE_BATCH_BYTES = 1024 * 1024 * 16
+};
+
+/* true if b picks up in the torrent right where a leaves off */
+static inline bool
+isAdjacentWrite (const struct cache_write * a, const struct cache_write * b)
+{
+  return (a->tor == b->tor) && (a->begin + a->length == b->begin);
+}
+
+static void
+addWriteError (tr_cache * cache, int torrentId, int err)
+{
+  struct write_error * e = tr_new (struct write_error, 1);
+
+  e->torrentId = torrentId;
+  e->err = err;
+
+  tr_lockLock (cache->write_lock);
+  e->next = cache->write_errors;
+  cache->write_errors = e;
+  tr_lockUnlock (cache->write_lock);
+}
+
+/* forget the failed writes of a torrent, or of all of them if tor is NULL.
+   returns the error of one of them, or 0 if there weren't any */
+static int
+takeWriteError (tr_cache * cache, const tr_torrent * tor)
+{
+  int err = 0;
+  struct write_error ** walk;
+
+  tr_lockLock (cache->write_lock);
+
+  for (walk=&cache->write_errors; *walk!=NULL; )
+    {
+      struct write_error * e = *walk;
+
+      if ((tor == NULL) || (e->torrentId == tr_torrentId (tor)))
+        {
+          err = e->err;
+          *walk = e->next;
+          tr_free (e);
+        }
+      else
+        {
+          walk = &e->next;
+        }
+    }
+
+  tr_lockUnlock (cache->write_lock);
+
+  return err;
+}
+
+/* write a batch of adjacent queued writes with a single tr_ioWritePlanned ().
+   the jobs' buffers are also read by tr_cacheReadBlock (), so rather than
+   moving their data into one buffer, reference it from a new one.
+   the torrent may change while this runs, so it's only looked at through
+   the writes' plans; the results go back to it in the libtransmission thread */
+static void
+writeBatch (tr_cache * cache, struct cache_write * first, int n)
+{
+  int i;
+  struct cache_write * w;
+  struct tr_io_write_plan * plan = first->plan;
+
+  first->plan = NULL;
+
+  if (n == 1)
+    {
+      tr_ioWritePlanned (plan, first->evbuf);
+    }
+  else
+    {
+      struct evbuffer * batch = evbuffer_new ();
+
+      /* don't look at the last write's next pointer:
+         it can change under us if it's the tail of the queue */
+      for (i=0, w=first; ; w=w->next)
+        {
+          int j, chunks;
+          struct evbuffer_iovec * iov;
+
+          chunks = evbuffer_peek (w->evbuf, -1, NULL, NULL, 0);
+          iov = tr_new (struct evbuffer_iovec, chunks);
+          chunks = evbuffer_peek (w->evbuf, -1, NULL, iov, chunks);
+          for (j=0; j<chunks; ++j)
+            evbuffer_add_reference (batch, iov[j].iov_base, iov[j].iov_len, NULL, NULL);
+          tr_free (iov);
+
+          if (w != first)
+            tr_ioWritePlanAppend (plan, w->plan);
+
+          if (++i == n)
+            break;
+        }
+
+      tr_ioWritePlanned (plan, batch);
+      evbuffer_free (batch);
+    }
+
+  if (plan->err)
+    addWriteError (cache, plan->torrentId, plan->err);
+
+  tr_runInEventThread (plan->session, tr_ioWritePlanFinish, plan);
+}
+
+static void
+writerThreadFunc (void * vqueue)
+{
+  struct write_queue * queue = vqueue;
+  tr_cache * cache = queue->cache;
+
+  for (;;)
+    {
+      int i, n;
+      uint32_t length;
+      struct cache_write * w;
+      struct cache_write * last;
+
+      /* take the head of the queue and any writes that continue it */
+      tr_lockLock (cache->write_lock);
+      w = queue->head;
+      if (w == NULL)
+        {
+          queue->writer = NULL;
+          tr_lockUnlock (cache->write_lock);
+          break;
+        }
+      n = 1;
+      length = w->length;
+      for (last=w; last->next!=NULL && isAdjacentWrite (last, last->next)
+                                    && length + last->next->length <= MAX_WRITE_BATCH_BYTES; last=last->next)
+        {
+          ++n;
+          length += last->next->length;
+        }
+      tr_lockUnlock (cache->write_lock);
+
+      writeBatch (cache, w, n);
+
+      tr_lockLock (cache->write_lock);
+      queue->head = last->next;
+      if (queue->head == NULL)
+        queue->tail = NULL;
+      queue->bytes -= length;
+      tr_lockUnlock (cache->write_lock);
+
+      for (i=0; i<n; ++i)
+        {
+          struct cache_write * next = w->next;
+          evbuffer_free (w->evbuf);
+          tr_ioWritePlanFree (w->plan);
+          tr_free (w);
+          w = next;
+        }
+    }
+}
+
+/* find the queue for a folder that's been seen before.
+   the caller must hold write_lock */
+static struct write_queue *
+findQueue (const tr_cache * cache, const char * dir)
+{
+  int i, n;
+  struct write_queue * q;
+
+  for (q=cache->write_queues; q!=NULL; q=q->next)
+    {
+      if (dir == NULL && tr_ptrArrayEmpty (&q->dirs))
+        return q;
+
+      if (dir != NULL)
+        for (i=0, n=tr_ptrArraySize (&q->dirs); i<n; ++i)
+          if (!strcmp (dir, tr_ptrArrayNth (&q->dirs, i)))
+            return q;
+    }
+
+  return NULL;
+}
+
+static struct write_queue *
+addQueue (tr_cache * cache, const char * dir)
+{
+  struct write_queue * q = tr_new0 (struct write_queue, 1);
+
+  q->cache = cache;
+  q->dirs = TR_PTR_ARRAY_INIT;
+  if (dir != NULL)
+    tr_ptrArrayAppend (&q->dirs, tr_strdup (dir));
+  q->next = cache->write_queues;
+  cache->write_queues = q;
+
+  return q;
+}
+
+/* get the queue for the device holding the torrent's data,
+   creating it if this is the first time we've seen that device */
+static struct write_queue *
+getQueue (tr_cache * cache, const tr_torrent * tor)
+{
+  struct write_queue * q;
+  const char * dir = tor->currentDir;
+
+  assert (tr_amInEventThread (tor->session));
+
+  tr_lockLock (cache->write_lock);
+  q = findQueue (cache, dir);
+  tr_lockUnlock (cache->write_lock);
+
+  if (q == NULL && dir != NULL && !tr_sys_path_exists (dir, NULL))
+    {
+      /* don't remember a folder that doesn't exist yet */
+      dir = NULL;
+      tr_lockLock (cache->write_lock);
+      q = findQueue (cache, NULL);
+      tr_lockUnlock (cache->write_lock);
+    }
+
+  if (q == NULL)
+    {
+      struct write_queue * same = NULL;
+
+      /* a queue's first folder never changes, so stat () it without the lock.
+         only this thread adds queues, so the list won't change under us */
+      if (dir != NULL)
+        for (q=cache->write_queues; same==NULL && q!=NULL; q=q->next)
+          if (!tr_ptrArrayEmpty (&q->dirs)
+              && tr_sys_path_is_same_device (dir, tr_ptrArrayNth (&q->dirs, 0), NULL))
+            same = q;
+
+      tr_lockLock (cache->write_lock);
+      if ((q = same) != NULL)
+        tr_ptrArrayAppend (&q->dirs, tr_strdup (dir));
+      else
+        q = addQueue (cache, dir);
+      tr_lockUnlock (cache->write_lock);
+
+      tr_logAddNamedDbg (MY_NAME, "Writes to \"%s\" go to %s queue",
+                         dir ? dir : "unknown folders", same ? "an existing" : "a new");
+    }
 
-/****
-*****
-****/
+  return q;
+}
 
-struct cache_block
+static void
+queueWrite (tr_cache * cache, struct cache_write * w)
 {
-  tr_torrent * tor;
+  struct write_queue * queue = getQueue (cache, w->tor);
 
-  tr_piece_index_t piece;
-  uint32_t offset;
-  uint32_t length;
+  w->next = NULL;
 
-  time_t time;
-  tr_block_index_t block;
+  tr_lockLock (cache->write_lock);
 
-  struct evbuffer * evbuf;
-};
+  if (queue->tail != NULL)
+    queue->tail->next = w;
+  else
+    queue->head = w;
+  queue->tail = w;
+  queue->bytes += w->length;
 
-struct tr_cache
+  if (queue->writer == NULL)
+    queue->writer = tr_threadNew (writerThreadFunc, queue);
+
+  tr_lockUnlock (cache->write_lock);
+}
+
+static bool
+hasQueuedWrites (tr_cache * cache, const tr_torrent * tor)
 {
-  tr_ptrArray blocks;
-  int max_blocks;
-  size_t max_bytes;
+  bool found = false;
+  const struct write_queue * q;
+  const struct cache_write * w;
 
-  size_t disk_writes;
-  size_t disk_write_bytes;
-  size_t cache_writes;
-  size_t cache_write_bytes;
-};
+  tr_lockLock (cache->write_lock);
 
-/****
-*****
-****/
+  for (q=cache->write_queues; !found && q!=NULL; q=q->next)
+    for (w=q->head; !found && w!=NULL; w=w->next)
+      found = tor == NULL || w->tor == tor;
 
-struct run_info
-{
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned len;
-};
+  tr_lockUnlock (cache->write_lock);
 
+  return found;
+}
 
-/* return a count of how many contiguous blocks there are starting at this pos */
-static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+/* true if any of the writer threads haven't exited yet */
+static bool
+hasWriters (tr_cache * cache)
 {
-  int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block ** blocks = (const struct cache_block**) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  bool found = false;
+  const struct write_queue * q;
 
-  for (i=pos; i<n; ++i, ++block)
-    {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
-        break;
-      //fprintf (stderr, "pos %d tor %d block %"TR_PRIuSIZE" time %"TR_PRIuSIZE"\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
-    }
+  tr_lockLock (cache->write_lock);
+  for (q=cache->write_queues; !found && q!=NULL; q=q->next)
+    found = q->writer != NULL;
+  tr_lockUnlock (cache->write_lock);
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  return found;
+}
 
-  if (info != NULL)
-    {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_torrentPieceIsComplete (b->tor, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece;
-      info->len = i - pos;
-      info->pos = pos;
-    }
+/* how much is waiting to be written to the device holding the torrent */
+static size_t
+getQueuedBytes (tr_cache * cache, const tr_torrent * tor)
+{
+  size_t bytes = 0;
+  const struct write_queue * q;
 
-  return i-pos;
+  tr_lockLock (cache->write_lock);
+  if ((q = findQueue (cache, tor->currentDir)) != NULL || (q = findQueue (cache, NULL)) != NULL)
+    bytes = q->bytes;
+  tr_lockUnlock (cache->write_lock);
+
+  return bytes;
 }
 
-/* higher rank comes before lower rank */
-static int
-compareRuns (const void * va, const void * vb)
+uint64_t
+tr_cacheGetSlabBytes (const tr_cache * cache)
 {
-  const struct run_info * a = va;
-  const struct run_info * b = vb;
-  return b->rank - a->rank;
+  return slabGetBytes (cache->slab);
 }
 
-enum
+const struct write_queue *
+tr_cacheGetWriteQueue (tr_cache * cache, const tr_torrent * tor)
 {
-  MULTIFLAG   = 0x1000,
-  DONEFLAG    = 0x2000,
-  SESSIONFLAG = 0x4000
-};
+  return getQueue (cache, tor);
+}
 
-/* Calculte runs
- *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
- */
-static int
-calcRuns (tr_cache * cache, struct run_info * runs)
+size_t
+tr_cacheGetWriteQueueBytes (tr_cache * cache, const struct write_queue * queue)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
-  const time_t now = tr_time ();
+  size_t bytes;
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
-    {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+  tr_lockLock (cache->write_lock);
+  bytes = queue->bytes;
+  tr_lockUnlock (cache->write_lock);
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+  return bytes;
+}
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+bool
+tr_cacheIsWriteQueueFull (tr_cache * cache, const tr_torrent * tor)
+{
+  assert (tr_amInEventThread (tor->session));
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+  return getQueuedBytes (cache, tor) > MAX (cache->max_bytes, MIN_WRITE_QUEUE_BYTES);
+}
 
-      runs[i].rank = rank;
+/* wait for the writer thread to finish writing a torrent's data,
+   or all the queued data if tor is NULL */
+static void
+waitForWrites (tr_cache * cache, const tr_torrent * tor)
+{
+  while (hasQueuedWrites (cache, tor))
+    tr_wait_msec (10);
+}
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
+/* if a queued write holds this data, copy it into setme */
+static bool
+readQueuedWrite (tr_cache         * cache,
+                 const tr_torrent * tor,
+                 tr_piece_index_t   piece,
+                 uint32_t           offset,
+                 uint32_t           len,
+                 uint8_t          * setme)
+{
+  const struct write_queue * q;
+  const struct cache_write * w;
+  const struct cache_write * match = NULL;
+  const uint64_t begin = tr_pieceOffset (tor, piece, offset, 0);
+
+  tr_lockLock (cache->write_lock);
+
+  /* use the last match, since later writes are newer.
+     a torrent's writes are only in more than one queue right after
+     it's been moved, and the move itself waits for them to finish */
+  for (q=cache->write_queues; q!=NULL; q=q->next)
+    for (w=q->head; w!=NULL; w=w->next)
+      if ((w->tor == tor) && (w->begin <= begin) && (begin + len <= w->begin + w->length))
+        match = w;
+
+  if (match != NULL)
+    {
+      struct evbuffer_ptr pos;
+      struct evbuffer_iovec iov;
+
+      /* copy len bytes starting at the block's position in the buffer */
+      evbuffer_ptr_set (match->evbuf, &pos, begin - match->begin, EVBUFFER_PTR_SET);
+      while (len > 0 && evbuffer_peek (match->evbuf, len, &pos, &iov, 1) > 0)
+        {
+          const size_t n = MIN (len, iov.iov_len);
+          memcpy (setme, iov.iov_base, n);
+          setme += n;
+          len -= n;
+          if (len > 0)
+            evbuffer_ptr_set (match->evbuf, &pos, n, EVBUFFER_PTR_ADD);
+        }
     }
 
-  //fprintf (stderr, "%d block runs\n", i);
-  qsort (runs, i, sizeof (struct run_info), compareRuns);
-  return i;
+  tr_lockUnlock (cache->write_lock);
+
+  return match != NULL;
 }
 
-static int
-flushContiguous (tr_cache * cache, int pos, int n)
+/* true if a queued write overlaps this data */
+static bool
+isQueuedWrite (tr_cache         * cache,
+               const tr_torrent * tor,
+               tr_piece_index_t   piece,
+               uint32_t           offset,
+               uint32_t           len)
 {
-  int i;
-  int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
+  bool found = false;
+  const struct write_queue * q;
+  const struct cache_write * w;
+  const uint64_t begin = tr_pieceOffset (tor, piece, offset, 0);
+
+  tr_lockLock (cache->write_lock);
+
+  for (q=cache->write_queues; !found && q!=NULL; q=q->next)
+    for (w=q->head; !found && w!=NULL; w=w->next)
+      found = (w->tor == tor) && (w->begin < begin + len) && (begin < w->begin + w->length);
+
+  tr_lockUnlock (cache->write_lock);
+
+  return found;
+}
+
+/****
+*****
+****/
 
-  struct cache_block * b = blocks[pos];
+static void
+flushRun (tr_cache * cache, struct cache_run * run)
+{
+  struct evbuffer * evbuf = evbuffer_new ();
+  struct cache_block * b = run->first;
+  struct cache_write * w = tr_new (struct cache_write, 1);
   tr_torrent * tor = b->tor;
-  const tr_piece_index_t piece = b->piece;
-  const uint32_t offset = b->offset;
+  const int blocks = run->len;
 
-  for (i=pos; i<pos+n; ++i)
+  w->tor = tor;
+  w->piece = b->piece;
+  w->offset = b->offset;
+  w->begin = tr_pieceOffset (tor, b->piece, b->offset, 0);
+
+  while (b != NULL)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
+      struct cache_block * next = b->run_next;
+      /* the slot goes back to the slab once the write's done with it */
+      evbuffer_add_reference (evbuf, slotData (b->slot), b->length, releaseSlotRef, b->slot);
+      tor->cacheBytes -= b->length;
+      indexRemove (cache, b);
       tr_free (b);
+      b = next;
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
 
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
+  runUnlink (cache, run);
+  tr_free (run);
 
+  w->length = evbuffer_get_length (evbuf);
+  w->evbuf = evbuf;
+  w->plan = tr_ioWritePlanNew (tor, w->piece, w->offset, w->length);
+
+  /* count it before queueing: the writer thread may free `w' right away */
   ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
-  return err;
+  cache->disk_write_blocks += blocks;
+  cache->disk_write_bytes += w->length;
+
+  queueWrite (cache, w);
 }
 
-static int
+static void
 flushRuns (tr_cache * cache, struct run_info * runs, int n)
 {
   int i;
-  int err = 0;
-
-  for (i=0; !err && i<n; i++)
-    {
-      int j;
-
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
-    }
-
-  return err;
+  for (i=0; i<n; i++)
+    flushRun (cache, runs[i].run);
 }
 
+/* the flushed runs are written in the background, so a failed write
+   shows up in the next call that flushes the same torrent, or in
+   tr_cacheFlushDone () */
 static int
-cacheTrim (tr_cache * cache)
+cacheTrim (tr_cache * cache, const tr_torrent * tor)
 {
-  int err = 0;
+  const int max_blocks = getBlockLimit (cache);
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+  if (cache->block_count > max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
-      const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
+      const int cacheCutoff = 1 + max_blocks / 4;
+      struct run_info * runs = tr_new (struct run_info, cache->run_count);
       int i=0, j=0;
 
       calcRuns (cache, runs);
       while (j < cacheCutoff)
         j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
+      flushRuns (cache, runs, i);
       tr_free (runs);
     }
 
-  return err;
+  return takeWriteError (cache, tor);
 }
 
 /***
@@ -260,7 +1532,7 @@ tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes)
   tr_formatter_mem_B (buf, cache->max_bytes, sizeof (buf));
   tr_logAddNamedDbg (MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
 
-  return cacheTrim (cache);
+  return cacheTrim (cache, NULL);
 }
 
 int64_t
@@ -269,11 +1541,68 @@ tr_cacheGetLimit (const tr_cache * cache)
   return cache->max_bytes;
 }
 
+void
+tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes)
+{
+  char buf[128];
+
+  cache->max_clean_bytes = max_bytes;
+
+  tr_formatter_mem_B (buf, cache->max_clean_bytes, sizeof (buf));
+  tr_logAddNamedDbg (MY_NAME, "Maximum read cache size set to %s", buf);
+
+  cleanTrim (cache, cache->max_clean_bytes);
+}
+
+int64_t
+tr_cacheGetReadLimit (const tr_cache * cache)
+{
+  return cache->max_clean_bytes;
+}
+
+int
+tr_cacheSetMemoryLow (tr_cache * cache, bool low)
+{
+  cache->memory_low = low;
+
+  cleanTrim (cache, getCleanLimit (cache));
+  return cacheTrim (cache, NULL);
+}
+
+uint64_t
+tr_cacheGetMemoryUsage (const tr_cache * cache)
+{
+  return tr_cacheGetSlabBytes (cache) + cache->clean_bytes;
+}
+
+void
+tr_cacheGetReadStats (const tr_cache * cache, uint64_t * hits, uint64_t * misses)
+{
+  *hits = cache->read_hits;
+  *misses = cache->read_misses;
+}
+
+void
+tr_cacheGetMergedReadStats (const tr_cache * cache, uint64_t * reads, uint64_t * blocks)
+{
+  *reads = cache->merged_reads;
+  *blocks = cache->merged_read_blocks;
+}
+
+void
+tr_cacheGetWriteStats (const tr_cache * cache, size_t * disk_writes, size_t * disk_write_blocks, size_t * cache_writes)
+{
+  *disk_writes = cache->disk_writes;
+  *disk_write_blocks = cache->disk_write_blocks;
+  *cache_writes = cache->cache_writes;
+}
+
 tr_cache *
 tr_cacheNew (int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->write_lock = tr_lockNew ();
+  cache->slab = slabNew ();
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
   return cache;
@@ -282,8 +1611,24 @@ tr_cacheNew (int64_t max_bytes)
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  assert (cache->block_count == 0);
+  assert (cache->runs == NULL);
+  waitForWrites (cache, NULL);
+  while (hasWriters (cache))
+    tr_wait_msec (10);
+  takeWriteError (cache, NULL);
+  while (cache->write_queues != NULL)
+    {
+      struct write_queue * q = cache->write_queues;
+      cache->write_queues = q->next;
+      tr_ptrArrayDestruct (&q->dirs, tr_free);
+      tr_free (q);
+    }
+  tr_lockFree (cache->write_lock);
+  slabFree (cache->slab);
+  cleanTrim (cache, 0);
+  tr_free (cache->clean_buckets);
+  tr_free (cache->buckets);
   tr_free (cache);
 }
 
@@ -291,34 +1636,13 @@ tr_cacheFree (tr_cache * cache)
 ****
 ***/
 
-static int
-cache_block_compare (const void * va, const void * vb)
-{
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
-
-  /* primary key: torrent id */
-  if (a->tor->uniqueId != b->tor->uniqueId)
-    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
-
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
-
-  /* they're equal */
-  return 0;
-}
-
 static struct cache_block *
 findBlock (tr_cache           * cache,
            tr_torrent         * torrent,
            tr_piece_index_t     piece,
            uint32_t             offset)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  return findBlockByIndex (cache, torrent, _tr_block (torrent, piece, offset));
 }
 
 int
@@ -330,9 +1654,14 @@ tr_cacheWriteBlock (tr_cache         * cache,
                     struct evbuffer  * writeme)
 {
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct clean_block * clean;
 
   assert (tr_amInEventThread (torrent->session));
 
+  /* the clean copy of this block is about to be stale */
+  if ((clean = findCleanBlock (cache, torrent, _tr_block (torrent, piece, offset))))
+    cleanRemove (cache, clean);
+
   if (cb == NULL)
     {
       cb = tr_new (struct cache_block, 1);
@@ -341,20 +1670,22 @@ tr_cacheWriteBlock (tr_cache         * cache,
       cb->offset = offset;
       cb->length = length;
       cb->block = _tr_block (torrent, piece, offset);
-      cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
+      cb->slot = slabAlloc (cache->slab);
+      runAddBlock (cache, cb);
+      indexAdd (cache, cb);
+      torrent->cacheBytes += length;
     }
 
   cb->time = tr_time ();
 
   assert (cb->length == length);
-  evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
-  evbuffer_remove_buffer (writeme, cb->evbuf, cb->length);
+  tr_ioHashBlock (torrent, piece, offset, length, writeme);
+  evbuffer_remove (writeme, slotData (cb->slot), cb->length);
 
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
-  return cacheTrim (cache);
+  return cacheTrim (cache, torrent);
 }
 
 int
@@ -366,16 +1697,59 @@ tr_cacheReadBlock (tr_cache         * cache,
                    uint8_t          * setme)
 {
   int err = 0;
+  tr_block_index_t block;
+  struct clean_block * clean;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  const bool whole = isWholeBlock (torrent, piece, offset, len, &block);
 
   if (cb)
-    evbuffer_copyout (cb->evbuf, setme, len);
-  else
-    err = tr_ioRead (torrent, piece, offset, len, setme);
+    {
+      memcpy (setme, slotData (cb->slot), len);
+    }
+  else if (whole && ((clean = findCleanBlock (cache, torrent, block))))
+    {
+      memcpy (setme, clean->buf, len);
+      lruUnlink (cache, clean);
+      lruPushFront (cache, clean);
+      ++cache->read_hits;
+    }
+  else if (!readQueuedWrite (cache, torrent, piece, offset, len, setme))
+    {
+      ++cache->read_misses;
+      err = tr_ioRead (torrent, piece, offset, len, setme);
+
+      if (!err && whole && cache->max_clean_bytes > 0)
+        cleanAdd (cache, torrent, block, setme, len);
+    }
 
   return err;
 }
 
+int
+tr_cacheAddBlockFile (tr_cache         * cache,
+                      tr_torrent       * torrent,
+                      tr_piece_index_t   piece,
+                      uint32_t           offset,
+                      uint32_t           len,
+                      struct evbuffer  * buf)
+{
+  tr_block_index_t first;
+  tr_block_index_t last;
+  tr_block_index_t i;
+
+  /* the newest copy of the data has to be on disk */
+  first = _tr_block (torrent, piece, offset);
+  last = _tr_block (torrent, piece, offset + len - 1);
+  for (i=first; i<=last; ++i)
+    if (findBlockByIndex (cache, torrent, i) != NULL)
+      return EAGAIN;
+
+  if (isQueuedWrite (cache, torrent, piece, offset, len))
+    return EAGAIN;
+
+  return tr_ioAddToBuffer (torrent, piece, offset, len, buf);
+}
+
 int
 tr_cachePrefetchBlock (tr_cache         * cache,
                        tr_torrent       * torrent,
@@ -384,94 +1758,207 @@ tr_cachePrefetchBlock (tr_cache         * cache,
                        uint32_t           len)
 {
   int err = 0;
+  tr_block_index_t block;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
-  if (cb == NULL)
+  if ((cb == NULL) && !(isWholeBlock (torrent, piece, offset, len, &block)
+                        && findCleanBlock (cache, torrent, block)))
     err = tr_ioPrefetch (torrent, piece, offset, len);
 
   return err;
 }
 
 /***
-****
+****  Reading ahead for uploads
 ***/
 
+enum
+{
+  /* the most that tr_cacheReadBlocks () reads in one go */
+  MAX_MERGED_READ = 1024 * 1024
+};
+
+static inline uint64_t
+getReadBegin (const struct tr_cache_read * r)
+{
+  return tr_pieceOffset (r->tor, r->piece, r->offset, 0);
+}
+
 static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
+compareReads (const void * va, const void * vb)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
+  uint64_t a_begin, b_begin;
+  const struct tr_cache_read * a = va;
+  const struct tr_cache_read * b = vb;
+
+  if (a->tor != b->tor)
+    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
+
+  a_begin = getReadBegin (a);
+  b_begin = getReadBegin (b);
+  if (a_begin != b_begin)
+    return a_begin < b_begin ? -1 : 1;
+
+  return 0;
 }
 
-int tr_cacheFlushDone (tr_cache * cache)
+/* true if tr_cacheReadBlock () would have to get this from disk */
+static bool
+readNeedsDisk (tr_cache * cache, const struct tr_cache_read * r)
 {
-  int err = 0;
+  tr_block_index_t block;
+
+  return isWholeBlock (r->tor, r->piece, r->offset, r->length, &block)
+      && findBlockByIndex (cache, r->tor, block) == NULL
+      && findCleanBlock (cache, r->tor, block) == NULL
+      && !isQueuedWrite (cache, r->tor, r->piece, r->offset, r->length);
+}
+
+void
+tr_cacheReadBlocks (tr_cache             * cache,
+                    struct tr_cache_read * reads,
+                    int                    n)
+{
+  int i, j, k;
+  int count = 0;
+  size_t budget;
+  uint8_t * buf = NULL;
+
+  if (cache->max_clean_bytes == 0 || n < 1)
+    return;
+
+  qsort (reads, n, sizeof (struct tr_cache_read), compareReads);
+
+  /* keep the ones that need the disk, once each */
+  for (i=0; i<n; ++i)
+    if ((count == 0 || compareReads (&reads[count - 1], &reads[i]) != 0)
+        && readNeedsDisk (cache, &reads[i]))
+      reads[count++] = reads[i];
+
+  /* past this, the last blocks read would evict the first ones
+     from the read cache before they could be sent */
+  budget = getCleanLimit (cache) / 2;
+
+  for (i=0; i<count; i=j)
+    {
+      size_t len = reads[i].length;
+      uint64_t end = getReadBegin (&reads[i]) + len;
+
+      /* merge the blocks that follow on from this one */
+      for (j=i+1; j<count; ++j)
+        {
+          if (reads[j].tor != reads[i].tor || getReadBegin (&reads[j]) != end)
+            break;
+          if (len + reads[j].length > MAX_MERGED_READ)
+            break;
+
+          len += reads[j].length;
+          end += reads[j].length;
+        }
+
+      if (len > budget)
+        break;
+      budget -= len;
+
+      if (buf == NULL)
+        buf = tr_malloc (MAX_MERGED_READ);
+
+      if (tr_ioRead (reads[i].tor, reads[i].piece, reads[i].offset, len, buf) != 0)
+        continue; /* the peers will find out for themselves */
+
+      for (k=i, len=0; k<j; ++k)
+        {
+          const tr_block_index_t block = _tr_block (reads[k].tor, reads[k].piece, reads[k].offset);
+          cleanAdd (cache, reads[k].tor, block, buf + len, reads[k].length);
+          len += reads[k].length;
+        }
+
+      ++cache->merged_reads;
+      cache->merged_read_blocks += j - i;
+    }
+
+  tr_free (buf);
+}
+
+/***
+****
+***/
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+int tr_cacheFlushDone (tr_cache * cache)
+{
+  if (cache->run_count > 0)
     {
       int i, n;
       struct run_info * runs;
 
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
+      runs = tr_new (struct run_info, cache->run_count);
       i = 0;
       n = calcRuns (cache, runs);
 
       while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
         runs[i++].rank |= SESSIONFLAG;
 
-      err = flushRuns (cache, runs, i);
+      flushRuns (cache, runs, i);
       tr_free (runs);
     }
 
-  return err;
+  return takeWriteError (cache, NULL);
+}
+
+/* flush every run in the torrent that touches blocks [first...last] */
+static void
+flushBlockRange (tr_cache         * cache,
+                 tr_torrent       * torrent,
+                 tr_block_index_t   first,
+                 tr_block_index_t   last)
+{
+  struct cache_run * run = cache->runs;
+
+  while (run != NULL)
+    {
+      struct cache_run * next = run->next;
+
+      if ((run->first->tor == torrent) && (run->first->block <= last)
+                                       && (run->last->block >= first))
+        flushRun (cache, run);
+
+      run = next;
+    }
 }
 
 int
 tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
 {
-  int pos;
-  int err = 0;
   tr_block_index_t first;
   tr_block_index_t last;
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%"TR_PRIuSIZE"...%"TR_PRIuSIZE"]", (int)i, (size_t)first, (size_t)last);
 
-  /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
-
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  /* flush out all the blocks in that file and wait for them to hit the disk */
+  flushBlockRange (cache, torrent, first, last);
+  waitForWrites (cache, torrent);
+  return takeWriteError (cache, torrent);
+}
 
-    return err;
+void
+tr_cacheQueueTorrentWrites (tr_cache * cache, tr_torrent * torrent)
+{
+  flushBlockRange (cache, torrent, 0, torrent->blockCount);
 }
 
 int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
-  int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
-
-  /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
-    {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
-
-      if (b->tor != torrent)
-        break;
+  /* flush out all the blocks in that torrent and wait for them to hit the disk */
+  int err;
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
-    }
+  flushBlockRange (cache, torrent, 0, torrent->blockCount);
+  waitForWrites (cache, torrent);
+  err = takeWriteError (cache, torrent);
 
+  /* the torrent is stopping or its files are going away,
+     so don't hold on to its clean blocks either */
+  cleanRemoveRange (cache, torrent, 0, torrent->blockCount);
   return err;
 }
@@ -34,6 +34,59 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+/* the read cache holds clean blocks recently read from disk,
+   and is sized separately from the write cache above */
+void tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes);
+
+int64_t tr_cacheGetReadLimit (const tr_cache *);
+
+void tr_cacheGetReadStats (const tr_cache * cache,
+                           uint64_t       * hits,
+                           uint64_t       * misses);
+
+/* reads made by tr_cacheReadBlocks (), and how many blocks they held */
+void tr_cacheGetMergedReadStats (const tr_cache * cache,
+                                 uint64_t       * reads,
+                                 uint64_t       * blocks);
+
+/* each disk write is one run of contiguous blocks, so
+   disk_write_blocks / disk_writes is the average run length */
+void tr_cacheGetWriteStats (const tr_cache * cache,
+                            size_t         * disk_writes,
+                            size_t         * disk_write_blocks,
+                            size_t         * cache_writes);
+
+/* while `low' is true, the write cache is flushed down to a quarter
+   of its limit and the read cache is kept to a quarter of its own */
+int tr_cacheSetMemoryLow (tr_cache * cache, bool low);
+
+/* the memory used by both caches */
+uint64_t tr_cacheGetMemoryUsage (const tr_cache * cache);
+
+/* how much memory is set aside for cached blocks,
+   including the ones that are being written to disk */
+uint64_t tr_cacheGetSlabBytes (const tr_cache * cache);
+
+struct write_queue;
+
+/* the write queue for the device that holds the torrent. queues live as
+   long as the cache does, so the libevent thread can look this up and
+   hand it to a worker that wants to stay out of the writer's way */
+const struct write_queue * tr_cacheGetWriteQueue (tr_cache         * cache,
+                                                  const tr_torrent * tor);
+
+/* how much is waiting to be written by that queue.
+   safe to call from any thread */
+size_t tr_cacheGetWriteQueueBytes (tr_cache                 * cache,
+                                   const struct write_queue * queue);
+
+/* true if the disk holding the torrent has fallen so far behind that
+   we should stop reading its data from the peers until it catches up.
+   this only looks at the torrent's own device, so a backlog on some
+   other disk doesn't slow this one down */
+bool tr_cacheIsWriteQueueFull (tr_cache         * cache,
+                               const tr_torrent * tor);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -48,12 +101,46 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
+/* append the block to buf as file segments so that it can be sent
+   without copying it. This fails, leaving buf unchanged, if the block
+   hasn't been written to disk yet; use tr_cacheReadBlock () instead */
+int tr_cacheAddBlockFile (tr_cache         * cache,
+                          tr_torrent       * torrent,
+                          tr_piece_index_t   piece,
+                          uint32_t           offset,
+                          uint32_t           len,
+                          struct evbuffer  * buf);
+
 int tr_cachePrefetchBlock (tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
                            uint32_t           offset,
                            uint32_t           len);
 
+struct tr_cache_read
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+};
+
+/* read blocks that peers are about to be sent into the read cache.
+   They're read in the order they are on disk, with neighboring blocks
+   merged into one read, instead of one seek per block in whatever order
+   the peers get around to them. `reads' is sorted in the process */
+void tr_cacheReadBlocks (tr_cache             * cache,
+                         struct tr_cache_read * reads,
+                         int                    n);
+
+/* fill `setme' with up to `max' of the torrent's pieces that are mostly
+   in memory: in the read cache, or written but not yet on disk. The most
+   recently read come first. @return how many of `setme' were filled in */
+size_t tr_cacheGetHotPieces (tr_cache         * cache,
+                             const tr_torrent * tor,
+                             tr_piece_index_t * setme,
+                             size_t             max);
+
 /***
 ****
 ***/
@@ -67,4 +154,9 @@ int tr_cacheFlushFile (tr_cache         * cache,
                        tr_torrent       * torrent,
                        tr_file_index_t    file);
 
+/* start writing the torrent's cached blocks without waiting for them.
+   unlike tr_cacheFlushTorrent (), its read cache is kept */
+void tr_cacheQueueTorrentWrites (tr_cache   * cache,
+                                 tr_torrent * torrent);
+
 #endif
@@ -8,9 +8,11 @@
  */
 
 #include <assert.h>
+#include <string.h> /* memset () */
 
 #include "transmission.h"
 #include "completion.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "torrent.h"
 #include "utils.h"
 #include "log.h"
@@ -19,6 +21,16 @@
 ****
 ***/
 
+/* forget the lazy forms of pieceBitfield after it changes */
+static void
+tr_cpPiecesChanged (tr_completion * cp)
+{
+  tr_free (cp->pieceBitfieldRawLazy);
+  cp->pieceBitfieldRawLazy = NULL;
+  tr_free (cp->pieceBitfieldBase64Lazy);
+  cp->pieceBitfieldBase64Lazy = NULL;
+}
+
 static void
 tr_cpReset (tr_completion * cp)
 {
@@ -26,6 +38,9 @@ tr_cpReset (tr_completion * cp)
   cp->sizeWhenDoneIsDirty = true;
   cp->haveValidIsDirty = true;
   tr_bitfieldSetHasNone (&cp->blockBitfield);
+  tr_bitfieldSetHasNone (&cp->pieceBitfield);
+  tr_cpPiecesChanged (cp);
+  memset (cp->fileBytes, 0, sizeof (uint64_t) * cp->tor->info.fileCount);
 }
 
 void
@@ -33,9 +48,89 @@ tr_cpConstruct (tr_completion * cp, tr_torrent * tor)
 {
   cp->tor = tor;
   tr_bitfieldConstruct (&cp->blockBitfield, tor->blockCount);
+  tr_bitfieldConstruct (&cp->pieceBitfield, tor->info.pieceCount);
+
+  /* a magnet link is constructed again once its metainfo arrives */
+  tr_free (cp->fileBytes);
+  cp->fileBytes = tr_new0 (uint64_t, tor->info.fileCount);
+
   tr_cpReset (cp);
 }
 
+/* count a file's bytes by walking its blocks in blockBitfield */
+static uint64_t
+countFileBytes (const tr_completion * cp, tr_file_index_t index)
+{
+  uint64_t total = 0;
+  const tr_torrent * tor = cp->tor;
+  const tr_file * f = &tor->info.files[index];
+
+  if (f->length)
+    {
+      tr_block_index_t first;
+      tr_block_index_t last;
+      tr_torGetFileBlockRange (tor, index, &first, &last);
+
+      if (first == last)
+        {
+          if (tr_cpBlockIsComplete (cp, first))
+            total = f->length;
+        }
+      else
+        {
+          /* the first block */
+          if (tr_cpBlockIsComplete (cp, first))
+            total += tor->blockSize - (f->offset % tor->blockSize);
+
+          /* the middle blocks */
+          if (first + 1 < last)
+            {
+              uint64_t u = tr_bitfieldCountRange (&cp->blockBitfield, first+1, last);
+              u *= tor->blockSize;
+              total += u;
+            }
+
+          /* the last block */
+          if (tr_cpBlockIsComplete (cp, last))
+            total += (f->offset + f->length) - ((uint64_t)tor->blockSize * last);
+        }
+    }
+
+  return total;
+}
+
+/* add or subtract a block's bytes to the files that it overlaps */
+static void
+cpFileBytesUpdate (tr_completion * cp, tr_block_index_t block, bool add)
+{
+  tr_file_index_t i;
+  uint64_t fileOffset;
+  const tr_torrent * tor = cp->tor;
+  const tr_info * inf = &tor->info;
+  const uint64_t begin = (uint64_t)block * tor->blockSize;
+  const uint64_t end = begin + tr_torBlockCountBytes (tor, block);
+  const tr_piece_index_t piece = begin / inf->pieceSize;
+
+  tr_ioFindFileLocation (tor, piece, begin - (uint64_t)piece * inf->pieceSize, &i, &fileOffset);
+
+  for (; i<inf->fileCount && inf->files[i].offset<end; ++i)
+    {
+      const tr_file * file = &inf->files[i];
+      const uint64_t a = MAX (begin, file->offset);
+      const uint64_t b = MIN (end, file->offset + file->length);
+
+      if (a < b)
+        {
+          if (add)
+            cp->fileBytes[i] += b - a;
+          else
+            cp->fileBytes[i] -= b - a;
+        }
+
+      assert (cp->fileBytes[i] <= file->length);
+    }
+}
+
 void
 tr_cpBlockInit (tr_completion * cp, const tr_bitfield * b)
 {
@@ -52,6 +147,34 @@ tr_cpBlockInit (tr_completion * cp, const tr_bitfield * b)
     cp->sizeNow -= (cp->tor->blockSize - cp->tor->lastBlockSize);
 
   assert (cp->sizeNow <= cp->tor->info.totalSize);
+
+  /* set pieceBitfield */
+  if (tr_bitfieldHasAll (&cp->blockBitfield))
+    {
+      tr_bitfieldSetHasAll (&cp->pieceBitfield);
+    }
+  else if (!tr_bitfieldHasNone (&cp->blockBitfield))
+    {
+      tr_piece_index_t i;
+      const tr_piece_index_t n = cp->tor->info.pieceCount;
+      bool * flags = tr_new (bool, n);
+
+      for (i=0; i<n; ++i)
+        flags[i] = tr_cpMissingBlocksInPiece (cp, i) == 0;
+      tr_bitfieldSetFromFlags (&cp->pieceBitfield, flags, n);
+      tr_free (flags);
+    }
+
+  /* set fileBytes */
+  if (!tr_bitfieldHasNone (&cp->blockBitfield))
+    {
+      tr_file_index_t i;
+      const tr_info * inf = &cp->tor->info;
+      const bool hasAll = tr_bitfieldHasAll (&cp->blockBitfield);
+
+      for (i=0; i<inf->fileCount; ++i)
+        cp->fileBytes[i] = hasAll ? inf->files[i].length : countFileBytes (cp, i);
+    }
 }
 
 /***
@@ -82,12 +205,23 @@ tr_cpPieceRem (tr_completion *  cp, tr_piece_index_t piece)
   tr_torGetPieceBlockRange (cp->tor, piece, &f, &l);
 
   for (i=f; i<=l; ++i)
-    if (tr_cpBlockIsComplete (cp, i))
-      cp->sizeNow -= tr_torBlockCountBytes (tor, i);
+    {
+      if (tr_cpBlockIsComplete (cp, i))
+        {
+          cp->sizeNow -= tr_torBlockCountBytes (tor, i);
+          cpFileBytesUpdate (cp, i, false);
+        }
+    }
 
   cp->haveValidIsDirty = true;
   cp->sizeWhenDoneIsDirty = true;
   tr_bitfieldRemRange (&cp->blockBitfield, f, l+1);
+
+  if (tr_bitfieldHas (&cp->pieceBitfield, piece))
+    {
+      tr_bitfieldRem (&cp->pieceBitfield, piece);
+      tr_cpPiecesChanged (cp);
+    }
 }
 
 void
@@ -111,9 +245,16 @@ tr_cpBlockAdd (tr_completion * cp, tr_block_index_t block)
 
       tr_bitfieldAdd (&cp->blockBitfield, block);
       cp->sizeNow += tr_torBlockCountBytes (tor, block);
+      cpFileBytesUpdate (cp, block, true);
 
       cp->haveValidIsDirty = true;
       cp->sizeWhenDoneIsDirty |= tor->info.pieces[piece].dnd;
+
+      if (tr_cpMissingBlocksInPiece (cp, piece) == 0)
+        {
+          tr_bitfieldAdd (&cp->pieceBitfield, piece);
+          tr_cpPiecesChanged (cp);
+        }
     }
 }
 
@@ -277,48 +418,39 @@ tr_cpMissingBytesInPiece (const tr_completion * cp, tr_piece_index_t piece)
 bool
 tr_cpFileIsComplete (const tr_completion * cp, tr_file_index_t i)
 {
-  if (cp->tor->info.files[i].length == 0)
-    {
-      return true;
-    }
-  else
-    {
-      tr_block_index_t f, l, fz;
-      tr_torGetFileBlockRange (cp->tor, i, &f, &l);
-      fz = tr_bitfieldFirstZero (&cp->blockBitfield, f, l+1);
-      return fz == l+1;
-    }
+  return cp->fileBytes[i] == cp->tor->info.files[i].length;
 }
 
-void *
-tr_cpCreatePieceBitfield (const tr_completion * cp, size_t * byte_count)
+const void *
+tr_cpGetPieceBitfield (const tr_completion * ccp, size_t * byte_count)
 {
-  void * ret;
-  tr_piece_index_t n;
-  tr_bitfield pieces;
+  tr_completion * cp = (tr_completion *) ccp; /* mutable */
 
   assert (tr_torrentHasMetadata (cp->tor));
 
-  n = cp->tor->info.pieceCount;
-  tr_bitfieldConstruct (&pieces, n);
+  if (cp->pieceBitfieldRawLazy == NULL)
+    cp->pieceBitfieldRawLazy = tr_bitfieldGetRaw (&cp->pieceBitfield, &cp->pieceBitfieldRawLazyLen);
 
-  if (tr_cpHasAll (cp))
-    {
-      tr_bitfieldSetHasAll (&pieces);
-    }
-  else if (!tr_cpHasNone (cp))
+  *byte_count = cp->pieceBitfieldRawLazyLen;
+  return cp->pieceBitfieldRawLazy;
+}
+
+const char *
+tr_cpGetPieceBitfieldBase64 (const tr_completion * ccp)
+{
+  tr_completion * cp = (tr_completion *) ccp; /* mutable */
+
+  if (cp->pieceBitfieldBase64Lazy == NULL)
     {
-      tr_piece_index_t i;
-      bool * flags = tr_new (bool, n);
-      for (i=0; i<n; ++i)
-        flags[i] = tr_cpPieceIsComplete (cp, i);
-      tr_bitfieldSetFromFlags (&pieces, flags, n);
-      tr_free (flags);
+      size_t byte_count;
+      const void * bytes = tr_cpGetPieceBitfield (cp, &byte_count);
+
+      cp->pieceBitfieldBase64Lazy = tr_base64_encode (bytes, byte_count, NULL);
+      if (cp->pieceBitfieldBase64Lazy == NULL)
+        cp->pieceBitfieldBase64Lazy = tr_strdup ("");
     }
 
-  ret = tr_bitfieldGetRaw (&pieces, byte_count);
-  tr_bitfieldDestruct (&pieces);
-  return ret;
+  return cp->pieceBitfieldBase64Lazy;
 }
 
 double
@@ -42,6 +42,21 @@ typedef struct tr_completion
 
   /* number of bytes we want or have now. [0..sizeWhenDone] */
   uint64_t sizeNow;
+
+  /* number of bytes we have in each file. [0..info.files[i].length]
+     These are kept up-to-date as blocks are added and pieces removed,
+     so that file stats don't need to walk blockBitfield */
+  uint64_t * fileBytes;
+
+  /* the pieces we have, kept in step with blockBitfield */
+  tr_bitfield pieceBitfield;
+
+  /* pieceBitfield's raw bytes and their base64 encoding, for sending to
+     peers and to RPC clients. DON'T access these directly; they're lazy
+     fields. Use tr_cpGetPieceBitfield () and tr_cpGetPieceBitfieldBase64 () */
+  uint8_t * pieceBitfieldRawLazy;
+  size_t pieceBitfieldRawLazyLen;
+  char * pieceBitfieldBase64Lazy;
 }
 tr_completion;
 
@@ -57,6 +72,10 @@ static inline void
 tr_cpDestruct (tr_completion * cp)
 {
   tr_bitfieldDestruct (&cp->blockBitfield);
+  tr_bitfieldDestruct (&cp->pieceBitfield);
+  tr_free (cp->fileBytes);
+  tr_free (cp->pieceBitfieldRawLazy);
+  tr_free (cp->pieceBitfieldBase64Lazy);
 }
 
 /**
@@ -113,7 +132,7 @@ size_t  tr_cpMissingBytesInPiece (const tr_completion *, tr_piece_index_t);
 static inline bool
 tr_cpPieceIsComplete (const tr_completion * cp, tr_piece_index_t i)
 {
-  return tr_cpMissingBlocksInPiece (cp, i) == 0;
+  return tr_bitfieldHas (&cp->pieceBitfield, i);
 }
 
 /**
@@ -134,7 +153,18 @@ tr_cpBlockIsComplete (const tr_completion * cp, tr_block_index_t i)
 
 bool  tr_cpFileIsComplete (const tr_completion * cp, tr_file_index_t);
 
-void* tr_cpCreatePieceBitfield (const tr_completion * cp, size_t * byte_count);
+static inline uint64_t
+tr_cpFileBytesCompleted (const tr_completion * cp, tr_file_index_t i)
+{
+  return cp->fileBytes[i];
+}
+
+/** @return the raw bits of the pieces we have. Don't free them;
+            they stay valid until the next piece is added or removed */
+const void * tr_cpGetPieceBitfield (const tr_completion * cp, size_t * byte_count);
+
+/** @return tr_cpGetPieceBitfield () in base64, with the same lifespan */
+const char * tr_cpGetPieceBitfieldBase64 (const tr_completion * cp);
 
 static inline void
 tr_cpInvalidateDND (tr_completion * cp)
@@ -11,11 +11,12 @@
 #include <inttypes.h> /* uint8_t */
 #include <stdarg.h>
 #include <stdlib.h> /* abs () */
-#include <string.h> /* memcpy (), memset (), strcmp () */
+#include <string.h> /* memcpy (), memmove (), memset (), strcmp () */
 
 #include <openssl/bn.h>
 #include <openssl/dh.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/rc4.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
@@ -31,22 +32,77 @@
 ***
 **/
 
+/* Going through EVP rather than the low-level SHA1_* calls lets libcrypto
+   pick its fastest implementation for this CPU at runtime, e.g. the SHA-NI
+   or ARMv8 crypto extension code paths. */
+
+tr_sha1_ctx_t
+tr_sha1_init (void)
+{
+  EVP_MD_CTX * ctx = EVP_MD_CTX_create ();
+
+  if (ctx != NULL && !EVP_DigestInit_ex (ctx, EVP_sha1 (), NULL))
+    {
+      EVP_MD_CTX_destroy (ctx);
+      ctx = NULL;
+    }
+
+  return ctx;
+}
+
+bool
+tr_sha1_update (tr_sha1_ctx_t   handle,
+                const void    * data,
+                size_t          data_length)
+{
+  assert (handle != NULL);
+
+  if (data_length == 0)
+    return true;
+
+  assert (data != NULL);
+
+  return EVP_DigestUpdate (handle, data, data_length) != 0;
+}
+
+bool
+tr_sha1_final (tr_sha1_ctx_t   handle,
+               uint8_t       * hash)
+{
+  bool ret = true;
+
+  if (hash != NULL)
+    {
+      unsigned int hash_length;
+
+      assert (handle != NULL);
+
+      ret = EVP_DigestFinal_ex (handle, hash, &hash_length) != 0;
+      assert (!ret || hash_length == SHA_DIGEST_LENGTH);
+    }
+
+  EVP_MD_CTX_destroy (handle);
+  return ret;
+}
+
 void
 tr_sha1 (uint8_t * setme, const void * content1, int content1_len, ...)
 {
   va_list vl;
-  SHA_CTX sha;
+  tr_sha1_ctx_t sha;
   const void * content;
 
-  SHA1_Init (&sha);
-  SHA1_Update (&sha, content1, content1_len);
+  if ((sha = tr_sha1_init ()) == NULL)
+    return;
+
+  tr_sha1_update (sha, content1, content1_len);
 
   va_start (vl, content1_len);
   while ((content = va_arg (vl, const void*)))
-    SHA1_Update (&sha, content, va_arg (vl, int));
+    tr_sha1_update (sha, content, va_arg (vl, int));
   va_end (vl);
 
-  SHA1_Final (setme, &sha);
+  tr_sha1_final (sha, setme);
 }
 
 /**
@@ -87,44 +143,125 @@ static const uint8_t dh_G[] = { 2 };
     } \
   } while (0)
 
-static void
-ensureKeyExists (tr_crypto * crypto)
+static DH *
+generateKey (uint8_t * publicKey)
 {
-  if (crypto->dh == NULL)
-    {
-      int len, offset;
-      DH * dh = DH_new ();
+  int len, offset;
+  DH * dh = DH_new ();
 
-      dh->p = BN_bin2bn (dh_P, sizeof (dh_P), NULL);
-      if (dh->p == NULL)
-        logErrorFromSSL ();
+  dh->p = BN_bin2bn (dh_P, sizeof (dh_P), NULL);
+  if (dh->p == NULL)
+    logErrorFromSSL ();
+
+  dh->g = BN_bin2bn (dh_G, sizeof (dh_G), NULL);
+  if (dh->g == NULL)
+    logErrorFromSSL ();
 
-      dh->g = BN_bin2bn (dh_G, sizeof (dh_G), NULL);
-      if (dh->g == NULL)
+  /* private DH value: strong random BN of DH_PRIVKEY_LEN*8 bits */
+  dh->priv_key = BN_new ();
+  do
+    {
+      if (BN_rand (dh->priv_key, DH_PRIVKEY_LEN * 8, -1, 0) != 1)
         logErrorFromSSL ();
+    }
+  while (BN_num_bits (dh->priv_key) < DH_PRIVKEY_LEN_MIN * 8);
+
+  if (!DH_generate_key (dh))
+    logErrorFromSSL ();
+
+  /* DH can generate key sizes that are smaller than the size of
+     P with exponentially decreasing probability, in which case
+     the msb's of myPublicKey need to be zeroed appropriately. */
+  len = BN_num_bytes (dh->pub_key);
+  offset = KEY_LEN - len;
+  assert (len <= KEY_LEN);
+  memset (publicKey, 0, offset);
+  BN_bn2bin (dh->pub_key, publicKey + offset);
+
+  return dh;
+}
+
+/**
+*** Generating a keypair is the most expensive part of an encrypted
+*** handshake, so keep a few of them ready ahead of time. A burst of
+*** incoming connections then only has to fall back to generating
+*** keys inline once the pool runs dry. The session tops the pool back
+*** up once a second with tr_cryptoFillKeyPool ().
+***
+*** Everything here runs in the libtransmission thread: OpenSSL before
+*** 1.1 needs locking callbacks to be used from several threads at once,
+*** and keeping libcrypto on one thread means not having to install them.
+**/
+
+enum
+{
+  DH_POOL_SIZE = 32
+};
+
+struct dh_pool_key
+{
+  DH * dh;
+  uint8_t publicKey[KEY_LEN];
+};
+
+static struct dh_pool_key dhPool[DH_POOL_SIZE];
+static int dhPoolCount = 0;
+
+/* handshake instrumentation */
+static unsigned int dhPoolHits = 0;
+static unsigned int dhPoolMisses = 0;
+static uint64_t dhPoolMissMsec = 0;
+
+void
+tr_cryptoFillKeyPool (unsigned int max_msec)
+{
+  const int oldCount = dhPoolCount;
+  const uint64_t end = tr_time_msec () + max_msec;
+
+  while (dhPoolCount < DH_POOL_SIZE)
+    {
+      struct dh_pool_key * key = &dhPool[dhPoolCount++];
+
+      key->dh = generateKey (key->publicKey);
+
+      if (tr_time_msec () >= end)
+        break;
+    }
+
+  if ((dhPoolCount == DH_POOL_SIZE) && (oldCount < DH_POOL_SIZE))
+    tr_logAddNamedDbg (MY_NAME, "DH key pool refilled; %u keys taken from the pool, "
+                                "%u generated inline in %"PRIu64" msec",
+                       dhPoolHits, dhPoolMisses, dhPoolMissMsec);
+}
+
+void
+tr_cryptoFreeKeyPool (void)
+{
+  while (dhPoolCount > 0)
+    DH_free (dhPool[--dhPoolCount].dh);
+}
 
-      /* private DH value: strong random BN of DH_PRIVKEY_LEN*8 bits */
-      dh->priv_key = BN_new ();
-      do
+static void
+ensureKeyExists (tr_crypto * crypto)
+{
+  if (crypto->dh == NULL)
+    {
+      if (dhPoolCount > 0)
         {
-          if (BN_rand (dh->priv_key, DH_PRIVKEY_LEN * 8, -1, 0) != 1)
-            logErrorFromSSL ();
+          const struct dh_pool_key * key = &dhPool[--dhPoolCount];
+          crypto->dh = key->dh;
+          memcpy (crypto->myPublicKey, key->publicKey, KEY_LEN);
+          ++dhPoolHits;
         }
-      while (BN_num_bits (dh->priv_key) < DH_PRIVKEY_LEN_MIN * 8);
-
-      if (!DH_generate_key (dh))
-        logErrorFromSSL ();
+      else
+        {
+          const uint64_t begin = tr_time_msec ();
 
-      /* DH can generate key sizes that are smaller than the size of
-         P with exponentially decreasing probability, in which case
-         the msb's of myPublicKey need to be zeroed appropriately. */
-      len = BN_num_bytes (dh->pub_key);
-      offset = KEY_LEN - len;
-      assert (len <= KEY_LEN);
-      memset (crypto->myPublicKey, 0, offset);
-      BN_bn2bin (dh->pub_key, crypto->myPublicKey + offset);
+          crypto->dh = generateKey (crypto->myPublicKey);
 
-      crypto->dh = dh;
+          ++dhPoolMisses;
+          dhPoolMissMsec += tr_time_msec () - begin;
+        }
     }
 }
 
@@ -143,6 +280,9 @@ tr_cryptoDestruct (tr_crypto * crypto)
 {
   if (crypto->dh != NULL)
     DH_free (crypto->dh);
+
+  tr_free (crypto->dec_key);
+  tr_free (crypto->enc_key);
 }
 
 /**
@@ -226,8 +366,11 @@ tr_cryptoDecryptInit (tr_crypto * crypto)
   unsigned char discard[1024];
   const char * txt = crypto->isIncoming ? "keyA" : "keyB";
 
-  initRC4 (crypto, &crypto->dec_key, txt);
-  RC4 (&crypto->dec_key, sizeof (discard), discard, discard);
+  if (crypto->dec_key == NULL)
+    crypto->dec_key = tr_new (RC4_KEY, 1);
+
+  initRC4 (crypto, crypto->dec_key, txt);
+  RC4 (crypto->dec_key, sizeof (discard), discard, discard);
 }
 
 void
@@ -236,7 +379,17 @@ tr_cryptoDecrypt (tr_crypto  * crypto,
                   const void * buf_in,
                   void       * buf_out)
 {
-  RC4 (&crypto->dec_key, buf_len,
+  /* the handshake switches the io to RC4 a little before it sets up
+     the keys. until then bytes pass through unchanged, just as an
+     all-zero RC4 state would leave them */
+  if (crypto->dec_key == NULL)
+    {
+      if (buf_in != buf_out)
+        memmove (buf_out, buf_in, buf_len);
+      return;
+    }
+
+  RC4 (crypto->dec_key, buf_len,
        (const unsigned char*)buf_in,
        (unsigned char*)buf_out);
 }
@@ -247,8 +400,11 @@ tr_cryptoEncryptInit (tr_crypto * crypto)
   unsigned char discard[1024];
   const char * txt = crypto->isIncoming ? "keyB" : "keyA";
 
-  initRC4 (crypto, &crypto->enc_key, txt);
-  RC4 (&crypto->enc_key, sizeof (discard), discard, discard);
+  if (crypto->enc_key == NULL)
+    crypto->enc_key = tr_new (RC4_KEY, 1);
+
+  initRC4 (crypto, crypto->enc_key, txt);
+  RC4 (crypto->enc_key, sizeof (discard), discard, discard);
 }
 
 void
@@ -257,7 +413,15 @@ tr_cryptoEncrypt (tr_crypto  * crypto,
                   const void * buf_in,
                   void       * buf_out)
 {
-  RC4 (&crypto->enc_key, buf_len,
+  /* see tr_cryptoDecrypt () */
+  if (crypto->enc_key == NULL)
+    {
+      if (buf_in != buf_out)
+        memmove (buf_out, buf_in, buf_len);
+      return;
+    }
+
+  RC4 (crypto->enc_key, buf_len,
        (const unsigned char*)buf_in,
        (unsigned char*)buf_out);
 }
@@ -294,47 +458,106 @@ tr_cryptoHasTorrentHash (const tr_crypto * crypto)
   return crypto->torrentHashIsSet ? 1 : 0;
 }
 
+/***
+****  Random numbers
+****
+****  Both kinds are kept per thread, so neither takes a lock. Secure bytes
+****  come out of a buffer that's refilled from libcrypto a chunk at a time,
+****  rather than calling into it for every peer id or handshake pad.
+****  Weak numbers come from a xorshift64* generator seeded from those.
+***/
+
+enum
+{
+  RAND_BUF_SIZE = 4096,
+
+  /* bigger requests skip the buffer */
+  RAND_BUF_MAX_REQUEST = RAND_BUF_SIZE / 4
+};
+
+#ifdef TR_THREAD_LOCAL
+static TR_THREAD_LOCAL uint8_t rand_buf[RAND_BUF_SIZE];
+static TR_THREAD_LOCAL size_t rand_buf_pos = RAND_BUF_SIZE;
+static TR_THREAD_LOCAL uint64_t weak_state = 0;
+#else
+static uint64_t weak_state = 0;
+#endif
+
+static void
+randBytes (void * buf, size_t len)
+{
+  if (RAND_bytes ((unsigned char*)buf, len) != 1)
+    logErrorFromSSL ();
+}
+
+void
+tr_cryptoRandBuf (void * buf, size_t len)
+{
+#ifdef TR_THREAD_LOCAL
+  if (len <= RAND_BUF_MAX_REQUEST)
+    {
+      uint8_t * walk = buf;
+
+      while (len > 0)
+        {
+          size_t n;
+
+          if (rand_buf_pos == RAND_BUF_SIZE)
+            {
+              randBytes (rand_buf, RAND_BUF_SIZE);
+              rand_buf_pos = 0;
+            }
+
+          n = MIN (len, RAND_BUF_SIZE - rand_buf_pos);
+          memcpy (walk, rand_buf + rand_buf_pos, n);
+
+          /* don't leave bytes that have been handed out lying around */
+          memset (rand_buf + rand_buf_pos, 0, n);
+          rand_buf_pos += n;
+
+          walk += n;
+          len -= n;
+        }
+
+      return;
+    }
+#endif
+
+  randBytes (buf, len);
+}
+
 int
 tr_cryptoRandInt (int upperBound)
 {
-  int noise;
-  int val;
+  unsigned int noise;
 
   assert (upperBound > 0);
 
-  if (RAND_pseudo_bytes ((unsigned char *) &noise, sizeof noise) >= 0)
-    {
-      val = abs (noise) % upperBound;
-    }
-  else /* fall back to a weaker implementation... */
-    {
-      val = tr_cryptoWeakRandInt (upperBound);
-    }
+  tr_cryptoRandBuf (&noise, sizeof (noise));
 
-  return val;
+  return noise % (unsigned int) upperBound;
 }
 
 int
 tr_cryptoWeakRandInt (int upperBound)
 {
-  static bool init = false;
+  uint64_t x = weak_state;
 
   assert (upperBound > 0);
 
-  if (!init)
+  if (x == 0)
     {
-      srand (tr_time_msec ());
-      init = true;
+      tr_cryptoRandBuf (&x, sizeof (x));
+      x |= 1; /* the state must never be zero */
     }
 
-  return rand () % upperBound;
-}
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  weak_state = x;
 
-void
-tr_cryptoRandBuf (void * buf, size_t len)
-{
-  if (RAND_pseudo_bytes ((unsigned char*)buf, len) != 1)
-    logErrorFromSSL ();
+  /* the high bits are the good ones */
+  return ((x * UINT64_C (2685821657736338717)) >> 32) % (unsigned int) upperBound;
 }
 
 /***
@@ -34,8 +34,8 @@ enum
 /** @brief Holds state information for encrypted peer communications */
 typedef struct
 {
-    RC4_KEY         dec_key;
-    RC4_KEY         enc_key;
+    RC4_KEY *       dec_key; /* allocated by tr_cryptoDecryptInit () */
+    RC4_KEY *       enc_key; /* allocated by tr_cryptoEncryptInit () */
     DH *            dh;
     uint8_t         myPublicKey[KEY_LEN];
     uint8_t         mySecret[KEY_LEN];
@@ -52,6 +52,16 @@ void tr_cryptoConstruct (tr_crypto * crypto, const uint8_t * torrentHash, bool i
 /** @brief destruct an existing tr_crypto object */
 void tr_cryptoDestruct (tr_crypto * crypto);
 
+/**
+ * @brief pregenerate DH keys for the handshakes, spending up to about
+ * max_msec on it. Like the rest of tr_crypto, only call it from the
+ * libtransmission thread.
+ */
+void tr_cryptoFillKeyPool (unsigned int max_msec);
+
+/** @brief free the pregenerated DH keys */
+void tr_cryptoFreeKeyPool (void);
+
 
 void tr_cryptoSetTorrentHash (tr_crypto * crypto, const uint8_t * torrentHash);
 
@@ -87,6 +97,19 @@ void           tr_cryptoEncrypt (tr_crypto *  crypto,
 **/
 
 
+/** @brief opaque SHA1 context used by tr_sha1_init () and friends */
+typedef void * tr_sha1_ctx_t;
+
+/** @brief start an incremental SHA1 hash. Returns NULL on failure. */
+tr_sha1_ctx_t tr_sha1_init (void);
+
+/** @brief feed more bytes into an incremental SHA1 hash */
+bool tr_sha1_update (tr_sha1_ctx_t handle, const void * data, size_t data_length);
+
+/** @brief write the digest into `hash' and free the context.
+    Pass a NULL `hash' to just free the context. */
+bool tr_sha1_final (tr_sha1_ctx_t handle, uint8_t * hash);
+
 /** @brief generate a SHA1 hash from one or more chunks of memory */
 void tr_sha1 (uint8_t    * setme,
               const void * content1,
@@ -0,0 +1,484 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <stdio.h> /* remove () */
+#include <string.h> /* strcmp () */
+#include <time.h>
+
+#ifndef _WIN32
+ #include <dirent.h>
+ #include <fcntl.h> /* openat (), AT_FDCWD */
+ #include <sys/stat.h>
+ #include <unistd.h> /* unlinkat (), close () */
+#endif
+
+#include "transmission.h"
+#include "delete.h"
+#include "file.h"
+#include "list.h"
+#include "log.h"
+#include "metrics.h"
+#include "platform.h" /* tr_lock () */
+#include "platform-quota.h" /* tr_device_info_free_space_changed () */
+#include "ptrarray.h"
+#include "session.h" /* tr_isSession () */
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+
+/***
+****
+***/
+
+enum
+{
+  /* the worker pauses after removing this many files... */
+  BATCH_FILES = 64,
+
+  /* ...or after freeing this many bytes, whichever comes first */
+  BATCH_BYTES = 1024 * 1024 * 1024,
+
+  MSEC_TO_SLEEP_BETWEEN_BATCHES = 100,
+
+  /* how long tr_deleteClose () waits for the queue to drain */
+  MAX_SECONDS_TO_DRAIN = 10
+};
+
+struct delete_job
+{
+  tr_session * session;
+  char * name;
+  char * tmpdir;
+  tr_ptrArray files;
+  tr_ptrArray folders;
+  tr_fileFunc func;
+
+  /* only used by the worker */
+  size_t batch_files;
+  uint64_t batch_bytes;
+  uint64_t unposted_files;
+  uint64_t unposted_bytes;
+
+  /* these are protected by the lock */
+  size_t files_left;
+  bool hurry;
+  bool stop;
+};
+
+static tr_list * deleteList = NULL;
+static bool workerRunning = false;
+
+static tr_lock*
+getDeleteLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static void
+freeJob (struct delete_job * job)
+{
+  tr_ptrArrayDestruct (&job->folders, tr_free);
+  tr_ptrArrayDestruct (&job->files, tr_free);
+  tr_free (job->tmpdir);
+  tr_free (job->name);
+  tr_free (job);
+}
+
+struct deleted_totals
+{
+  tr_session * session;
+  uint64_t files;
+  uint64_t bytes;
+};
+
+static void
+addDeletedTotals (void * vtotals)
+{
+  struct deleted_totals * totals = vtotals;
+
+  tr_metricsAdd (totals->session, TR_METRIC_DELETED_FILES, totals->files);
+  tr_metricsAdd (totals->session, TR_METRIC_DELETED_BYTES, totals->bytes);
+  tr_free (totals);
+}
+
+/* hand the job's uncounted removals to the metrics in the event thread */
+static void
+postDeletedTotals (struct delete_job * job)
+{
+  struct deleted_totals * totals;
+
+  if (job->unposted_files == 0)
+    return;
+
+  totals = tr_new (struct deleted_totals, 1);
+  totals->session = job->session;
+  totals->files = job->unposted_files;
+  totals->bytes = job->unposted_bytes;
+  tr_runInEventThread (job->session, addDeletedTotals, totals);
+
+  job->unposted_files = 0;
+  job->unposted_bytes = 0;
+}
+
+/**
+ * Account for a removed file and pause if this batch is full.
+ * @return false if the job's been told to stop
+ */
+static bool
+fileRemoved (struct delete_job * job, uint64_t size)
+{
+  bool hurry;
+  bool stop;
+
+  ++job->unposted_files;
+  job->unposted_bytes += size;
+
+  tr_lockLock (getDeleteLock ());
+  if (job->files_left > 0)
+    --job->files_left;
+  hurry = job->hurry;
+  stop = job->stop;
+  tr_lockUnlock (getDeleteLock ());
+
+  ++job->batch_files;
+  job->batch_bytes += size;
+
+  if (job->batch_files >= BATCH_FILES || job->batch_bytes >= BATCH_BYTES)
+    {
+      postDeletedTotals (job);
+
+      if (!hurry)
+        tr_wait_msec (MSEC_TO_SLEEP_BETWEEN_BATCHES);
+
+      job->batch_files = 0;
+      job->batch_bytes = 0;
+    }
+
+  return !stop;
+}
+
+#ifndef _WIN32
+
+/**
+ * Remove `name' and everything under it. Each folder is walked through
+ * its own descriptor, so unlinkat () doesn't have to look up the whole
+ * path again for every file.
+ * @return false if the job was told to stop before it finished
+ */
+static bool
+removeTree (struct delete_job * job, int parent_fd, const char * name)
+{
+  int fd;
+  DIR * odir;
+  struct stat sb;
+  struct dirent * d;
+  bool keep_going = true;
+
+  if (fstatat (parent_fd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1)
+    return true;
+
+  if (!S_ISDIR (sb.st_mode))
+    {
+      if (unlinkat (parent_fd, name, 0) == -1)
+        return true;
+
+      return fileRemoved (job, sb.st_size);
+    }
+
+  if ((fd = openat (parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1)
+    return true;
+
+  if ((odir = fdopendir (fd)) == NULL)
+    {
+      close (fd);
+      return true;
+    }
+
+  while (keep_going && (d = readdir (odir)) != NULL)
+    if (strcmp (d->d_name, ".") != 0 && strcmp (d->d_name, "..") != 0)
+      keep_going = removeTree (job, dirfd (odir), d->d_name);
+
+  closedir (odir);
+
+  if (keep_going)
+    unlinkat (parent_fd, name, AT_REMOVEDIR);
+
+  return keep_going;
+}
+
+#endif
+
+static bool
+removeWithFunc (struct delete_job * job, const char * filename)
+{
+  tr_sys_path_info info;
+  uint64_t size = 0;
+
+  if (tr_sys_path_get_info (filename, 0, &info, NULL) && info.type == TR_SYS_PATH_IS_FILE)
+    size = info.size;
+
+  if ((*job->func) (filename) != 0)
+    return true;
+
+  return fileRemoved (job, size);
+}
+
+/**
+ * Let the caller's removal function at the files, e.g. so the GTK+
+ * client can move them to the trash.
+ *
+ * Try the top-level files & folders first to preserve the directory
+ * hierarchy in the recycle bin. In case that fails -- for example,
+ * rmdir () doesn't delete nonempty folders -- go from the bottom up too.
+ */
+static bool
+removeFiles (struct delete_job * job)
+{
+  int i, n;
+  tr_sys_dir_t odir;
+  bool keep_going = true;
+
+  if ((odir = tr_sys_dir_open (job->tmpdir, NULL)) != TR_BAD_SYS_DIR)
+    {
+      const char * name;
+      while (keep_going && (name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+        {
+          if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+            {
+              char * file = tr_buildPath (job->tmpdir, name, NULL);
+              keep_going = removeWithFunc (job, file);
+              tr_free (file);
+            }
+        }
+      tr_sys_dir_close (odir, NULL);
+    }
+
+  for (i=0, n=tr_ptrArraySize (&job->files); keep_going && i<n; ++i)
+    {
+      char * walk = tr_strdup (tr_ptrArrayNth (&job->files, i));
+      while (keep_going && tr_sys_path_exists (walk, NULL) && !tr_sys_path_is_same (job->tmpdir, walk, NULL))
+        {
+          char * tmp = tr_sys_path_dirname (walk, NULL);
+          keep_going = removeWithFunc (job, walk);
+          tr_free (walk);
+          walk = tmp;
+        }
+      tr_free (walk);
+    }
+
+  if (keep_going)
+    tr_sys_path_remove (job->tmpdir, NULL);
+
+  return keep_going;
+}
+
+static bool
+isJunkFile (const char * base)
+{
+  int i;
+  static const char * files[] = { ".DS_Store", "desktop.ini", "Thumbs.db" };
+  static const int file_count = sizeof (files) / sizeof (files[0]);
+
+  for (i=0; i<file_count; ++i)
+    if (!strcmp (base, files[i]))
+      return true;
+
+#ifdef __APPLE__
+  /* check for resource forks. <http://support.apple.com/kb/TA20578> */
+  if (!memcmp (base, "._", 2))
+    return true;
+#endif
+
+  return false;
+}
+
+static void
+removeEmptyFoldersAndJunkFiles (const char * folder)
+{
+  tr_sys_dir_t odir;
+
+  if ((odir = tr_sys_dir_open (folder, NULL)) != TR_BAD_SYS_DIR)
+    {
+      const char * name;
+      while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+        {
+          if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+            {
+              tr_sys_path_info info;
+              char * filename = tr_buildPath (folder, name, NULL);
+
+              if (tr_sys_path_get_info (filename, 0, &info, NULL) &&
+                  info.type == TR_SYS_PATH_IS_DIRECTORY)
+                removeEmptyFoldersAndJunkFiles (filename);
+              else if (isJunkFile (name))
+                tr_sys_path_remove (filename, NULL);
+
+              tr_free (filename);
+            }
+        }
+
+      tr_sys_path_remove (folder, NULL);
+      tr_sys_dir_close (odir, NULL);
+    }
+}
+
+static void
+deleteThreadFunc (void * unused UNUSED)
+{
+  for (;;)
+    {
+      int i, n;
+      bool finished;
+      struct delete_job * job;
+
+      tr_lockLock (getDeleteLock ());
+      if (deleteList == NULL)
+        break;
+      job = deleteList->data;
+      finished = !job->stop;
+      tr_lockUnlock (getDeleteLock ());
+
+      if (finished)
+        {
+#ifndef _WIN32
+          if (job->func == remove)
+            finished = removeTree (job, AT_FDCWD, job->tmpdir);
+          else
+#endif
+            finished = removeFiles (job);
+        }
+
+      /* what's left in the torrent's folders are empty folders, junk,
+         and user-generated files. Remove the first two and leave the third. */
+      if (finished)
+        for (i=0, n=tr_ptrArraySize (&job->folders); i<n; ++i)
+          removeEmptyFoldersAndJunkFiles (tr_ptrArrayNth (&job->folders, i));
+
+      if (finished)
+        tr_logAddNamedDbg (job->name, "Finished deleting local data");
+      else
+        tr_logAddNamedError (job->name, _("Couldn't finish deleting local data; the rest is in \"%s\""), job->tmpdir);
+
+      postDeletedTotals (job);
+
+      tr_lockLock (getDeleteLock ());
+      tr_list_remove_data (&deleteList, job);
+      tr_lockUnlock (getDeleteLock ());
+
+      tr_device_info_free_space_changed ();
+      freeJob (job);
+    }
+
+  workerRunning = false;
+  tr_lockUnlock (getDeleteLock ());
+}
+
+void
+tr_deleteAdd (tr_session   * session,
+              const char   * name,
+              char         * tmpdir,
+              tr_ptrArray  * files,
+              tr_ptrArray  * folders,
+              tr_fileFunc    func)
+{
+  struct delete_job * job;
+
+  assert (tr_isSession (session));
+  assert (tmpdir != NULL);
+
+  job = tr_new0 (struct delete_job, 1);
+  job->session = session;
+  job->name = tr_strdup (name);
+  job->tmpdir = tmpdir;
+  job->files = *files;
+  job->folders = *folders;
+  job->func = func != NULL ? func : remove;
+  job->files_left = tr_ptrArraySize (files);
+
+  *files = TR_PTR_ARRAY_INIT;
+  *folders = TR_PTR_ARRAY_INIT;
+
+  tr_lockLock (getDeleteLock ());
+  tr_list_append (&deleteList, job);
+  if (!workerRunning)
+    {
+      workerRunning = true;
+      tr_threadNew (deleteThreadFunc, NULL);
+    }
+  tr_lockUnlock (getDeleteLock ());
+}
+
+void
+tr_deleteGetPending (const tr_session * session,
+                     size_t           * setme_torrents,
+                     size_t           * setme_files)
+{
+  tr_list * l;
+  size_t torrents = 0;
+  size_t files = 0;
+
+  tr_lockLock (getDeleteLock ());
+  for (l=deleteList; l!=NULL; l=l->next)
+    {
+      const struct delete_job * job = l->data;
+
+      if (job->session == session)
+        {
+          ++torrents;
+          files += job->files_left;
+        }
+    }
+  tr_lockUnlock (getDeleteLock ());
+
+  if (setme_torrents != NULL)
+    *setme_torrents = torrents;
+  if (setme_files != NULL)
+    *setme_files = files;
+}
+
+static bool
+setJobFlags (tr_session * session, bool stop)
+{
+  tr_list * l;
+  bool found = false;
+
+  tr_lockLock (getDeleteLock ());
+  for (l=deleteList; l!=NULL; l=l->next)
+    {
+      struct delete_job * job = l->data;
+
+      if (job->session == session)
+        {
+          job->hurry = true;
+          job->stop = stop;
+          found = true;
+        }
+    }
+  tr_lockUnlock (getDeleteLock ());
+
+  return found;
+}
+
+void
+tr_deleteClose (tr_session * session)
+{
+  const time_t deadline = time (NULL) + MAX_SECONDS_TO_DRAIN;
+
+  while (setJobFlags (session, false) && time (NULL) < deadline)
+    tr_wait_msec (20);
+
+  /* once told to stop, the worker gives up after its current file */
+  while (setJobFlags (session, true))
+    tr_wait_msec (20);
+}
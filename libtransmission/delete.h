@@ -0,0 +1,67 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DELETE_H
+#define TR_DELETE_H 1
+
+#include "ptrarray.h"
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Removing a torrent's local data.
+ *
+ * tr_torrentRemove () only renames the torrent's files into a temporary
+ * folder, which is quick. The real deletion is done here, by a worker
+ * thread that pauses between batches of files so that it doesn't starve
+ * the disk, and so that the libtransmission thread never waits on it.
+ */
+
+/**
+ * @brief queue `tmpdir' and everything in it for deletion.
+ *
+ * @param name     the torrent's name, for logging
+ * @param tmpdir   the temporary folder holding the torrent's files
+ * @param files    the paths of the files that were moved into `tmpdir'
+ * @param folders  folders to remove afterwards if they hold nothing but junk
+ * @param func     how to remove a file; `remove' if NULL.
+ *                 It's called from the worker thread.
+ *
+ * Takes ownership of `tmpdir' and of the strings in `files' and `folders'.
+ */
+void tr_deleteAdd (tr_session   * session,
+                   const char   * name,
+                   char         * tmpdir,
+                   tr_ptrArray  * files,
+                   tr_ptrArray  * folders,
+                   tr_fileFunc    func);
+
+/** @brief how many torrents' data, and how many of their files, are still waiting to be deleted */
+void tr_deleteGetPending (const tr_session * session,
+                          size_t           * setme_torrents,
+                          size_t           * setme_files);
+
+/**
+ * @brief finish the queued deletions without pausing between batches.
+ *
+ * Gives up after a few seconds, leaving the rest on disk, so that
+ * shutdown can't hang on a slow drive.
+ */
+void tr_deleteClose (tr_session * session);
+
+/* @} */
+
+#endif
@@ -0,0 +1,695 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/**
+ * Measures how libtransmission's own disk and hashing code does on this
+ * machine: the same tr_ioRead (), tr_ioWrite (), tr_cacheWriteBlock (),
+ * preallocation and verify code that a session uses, run against a
+ * made-up torrent in the directory being tested. That's why this is
+ * built here with the library's private headers, next to benchmark and
+ * rpc-bench, rather than with the tools in utils/. Build it with
+ * "make disk-bench".
+ */
+
+#include <stdio.h> /* printf (), remove () */
+#include <stdlib.h> /* strtoul (), EXIT_FAILURE */
+#include <string.h> /* strcmp () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h" /* tr_cacheWriteBlock (), tr_cacheFlushTorrent () */
+#include "crypto.h" /* tr_sha1 (), tr_cryptoWeakRandInt () */
+#include "error.h"
+#include "fdlimit.h" /* tr_fdTorrentClose () */
+#include "file.h"
+#include "inout.h" /* tr_ioRead (), tr_ioWrite () */
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "variant.h"
+#include "version.h"
+
+#define MY_NAME "disk-bench"
+
+#define MEM_K 1024
+#define DISK_K 1000
+#define SPEED_K 1000
+
+#define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
+
+/* the most that the random-read pass reads, and for how long */
+#define RANDOM_READ_COUNT 4096
+#define RANDOM_READ_SECS 15
+
+static const uint32_t KiB = 1024;
+static const uint64_t MiB = 1024 * 1024;
+
+static bool showVersion = false;
+static const char * dir = NULL;
+static uint32_t size_mib = 512;
+static uint32_t file_count = 1;
+static uint32_t piecesize_kib = 1024;
+
+static tr_option options[] =
+{
+  { 'd', "dir", "Where to put the test data; this is the disk being tested. Default: the current directory", "d", 1, "<directory>" },
+  { 'f', "files", "Split the torrent into this many files. Default: 1", "f", 1, "<count>" },
+  { 's', "size", "How many MiB of data to test with. Default: 512", "s", 1, "<size in MiB>" },
+  { 'p', "piecesize", "Set how many KiB each piece should be. Default: 1024", "p", 1, "<size in KiB>" },
+  { 'V', "version", "Show version number and exit", "V", 0, NULL },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int
+parseCommandLine (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'd':
+            dir = optarg;
+            break;
+
+          case 'f':
+            file_count = MAX (1, strtoul (optarg, NULL, 10));
+            break;
+
+          case 's':
+            size_mib = MAX (1, strtoul (optarg, NULL, 10));
+            break;
+
+          case 'p':
+            piecesize_kib = MAX (16, strtoul (optarg, NULL, 10));
+            break;
+
+          case 'V':
+            showVersion = true;
+            break;
+
+          default:
+            return 1;
+        }
+    }
+
+  return 0;
+}
+
+/***
+****
+***/
+
+static uint64_t
+now_usec (void)
+{
+  struct timeval tv;
+  tr_gettimeofday (&tv);
+  return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static void
+printSpeed (const char * label, uint64_t bytes, uint64_t usec)
+{
+  char buf[64];
+  const double secs = MAX (usec, 1) / 1000000.0;
+
+  tr_formatter_speed_KBps (buf, bytes / secs / SPEED_K, sizeof (buf));
+  printf ("%-46s %12s\n", label, buf);
+}
+
+/* the same incompressible bytes for a piece every time it's asked for */
+static void
+fillPiece (uint8_t * buf, uint32_t len, tr_piece_index_t piece)
+{
+  uint32_t i;
+  uint64_t x = 0x9E3779B97F4A7C15ull * (piece + 1);
+
+  for (i=0; i<len; ++i)
+    {
+      if ((i & 7) == 0)
+        {
+          x ^= x >> 12;
+          x ^= x << 25;
+          x ^= x >> 27;
+        }
+
+      buf[i] = (uint8_t)(x >> ((i & 7) * 8));
+    }
+}
+
+static uint32_t
+getPieceSize (uint64_t total_size, uint32_t piece_size, tr_piece_index_t piece)
+{
+  const uint64_t offset = (uint64_t)piece * piece_size;
+
+  return (uint32_t) MIN (piece_size, total_size - offset);
+}
+
+/**
+ * Build the torrent's metainfo, hashing its pieces on the way.
+ * @return the benc, or NULL if the hashes couldn't be made
+ */
+static char *
+makeMetainfo (uint64_t total_size, uint32_t piece_size, int * setme_len)
+{
+  uint32_t i;
+  char * ret;
+  uint8_t * hashes;
+  uint8_t * buf;
+  tr_variant top;
+  tr_variant * info;
+  uint64_t hash_usec = 0;
+  const tr_piece_index_t piece_count = (total_size + piece_size - 1) / piece_size;
+
+  buf = tr_new (uint8_t, piece_size);
+  hashes = tr_new (uint8_t, (size_t)piece_count * SHA_DIGEST_LENGTH);
+  for (i=0; i<piece_count; ++i)
+    {
+      uint64_t begin;
+      const uint32_t len = getPieceSize (total_size, piece_size, i);
+
+      fillPiece (buf, len, i);
+      begin = now_usec ();
+      tr_sha1 (hashes + (size_t)i * SHA_DIGEST_LENGTH, buf, len, NULL);
+      hash_usec += now_usec () - begin;
+    }
+  printSpeed ("hashing (SHA-1)", total_size, hash_usec);
+
+  tr_variantInitDict (&top, 2);
+  tr_variantDictAddStr (&top, TR_KEY_created_by, MY_NAME "/" LONG_VERSION_STRING);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 5);
+  tr_variantDictAddStr (info, TR_KEY_name, MY_NAME);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, piece_size);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, hashes, (size_t)piece_count * SHA_DIGEST_LENGTH);
+  tr_variantDictAddInt (info, TR_KEY_private, 1);
+
+  if (file_count == 1)
+    {
+      tr_variantDictAddInt (info, TR_KEY_length, total_size);
+    }
+  else
+    {
+      tr_variant * files = tr_variantDictAddList (info, TR_KEY_files, file_count);
+
+      for (i=0; i<file_count; ++i)
+        {
+          char name[32];
+          const uint64_t begin = total_size * i / file_count;
+          const uint64_t end = total_size * (i + 1) / file_count;
+          tr_variant * file = tr_variantListAddDict (files, 2);
+
+          tr_snprintf (name, sizeof (name), "file-%06u", i);
+          tr_variantDictAddInt (file, TR_KEY_length, end - begin);
+          tr_variantListAddStr (tr_variantDictAddList (file, TR_KEY_path, 1), name);
+        }
+    }
+
+  ret = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, setme_len);
+
+  tr_variantFree (&top);
+  tr_free (hashes);
+  tr_free (buf);
+  return ret;
+}
+
+/***
+****
+***/
+
+static void
+closeFiles (tr_torrent * tor)
+{
+  tr_sessionLock (tor->session);
+  tr_fdTorrentClose (tor->session, tr_torrentId (tor));
+  tr_sessionUnlock (tor->session);
+}
+
+/* get the torrent's data onto the disk and out of memory,
+   so that the next pass has to read it from the disk */
+static void
+syncAndDropFiles (tr_torrent * tor)
+{
+  tr_file_index_t i;
+
+  closeFiles (tor);
+
+  for (i=0; i<tor->info.fileCount; ++i)
+    {
+      tr_sys_file_t fd;
+      char * filename = tr_torrentFindFile (tor, i);
+
+      if (filename == NULL)
+        continue;
+
+      fd = tr_sys_file_open (filename, TR_SYS_FILE_WRITE, 0, NULL);
+      if (fd != TR_BAD_SYS_FILE)
+        {
+          tr_sys_file_flush (fd, NULL);
+          tr_sys_file_drop_cache (fd, 0, 0, NULL);
+          tr_sys_file_close (fd, NULL);
+        }
+
+      tr_free (filename);
+    }
+}
+
+static void
+removeFiles (tr_torrent * tor)
+{
+  tr_file_index_t i;
+
+  closeFiles (tor);
+
+  for (i=0; i<tor->info.fileCount; ++i)
+    {
+      char * filename = tr_torrentFindFile (tor, i);
+
+      if (filename != NULL)
+        tr_sys_path_remove (filename, NULL);
+
+      tr_free (filename);
+    }
+}
+
+static bool
+benchSequentialWrite (tr_torrent * tor, uint8_t * buf)
+{
+  tr_piece_index_t i;
+  uint64_t begin;
+  uint64_t usec = 0;
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    {
+      const uint32_t len = tr_torPieceCountBytes (tor, i);
+
+      fillPiece (buf, len, i);
+      begin = now_usec ();
+      if (tr_ioWrite (tor, i, 0, len, buf))
+        return false;
+      usec += now_usec () - begin;
+    }
+
+  begin = now_usec ();
+  syncAndDropFiles (tor);
+  usec += now_usec () - begin;
+
+  printSpeed ("sequential write (tr_ioWrite)", tor->info.totalSize, usec);
+  return true;
+}
+
+static bool
+benchSequentialRead (tr_torrent * tor, uint8_t * buf)
+{
+  tr_piece_index_t i;
+  const uint64_t begin = now_usec ();
+
+  for (i=0; i<tor->info.pieceCount; ++i)
+    if (tr_ioRead (tor, i, 0, tr_torPieceCountBytes (tor, i), buf))
+      return false;
+
+  printSpeed ("sequential read (tr_ioRead)", tor->info.totalSize, now_usec () - begin);
+  syncAndDropFiles (tor);
+  return true;
+}
+
+static bool
+benchRandomRead (tr_torrent * tor, uint8_t * buf)
+{
+  int i;
+  char label[64];
+  uint64_t bytes = 0;
+  const uint64_t begin = now_usec ();
+  const uint64_t deadline = begin + RANDOM_READ_SECS * 1000000u;
+
+  for (i=0; i<RANDOM_READ_COUNT && now_usec () < deadline; ++i)
+    {
+      tr_piece_index_t piece;
+      uint32_t offset;
+      uint32_t length;
+      const tr_block_index_t block = tr_cryptoWeakRandInt (tor->blockCount);
+
+      tr_torrentGetBlockLocation (tor, block, &piece, &offset, &length);
+      if (tr_ioRead (tor, piece, offset, length, buf))
+        return false;
+      bytes += length;
+    }
+
+  tr_snprintf (label, sizeof (label), "random %u KiB reads (%.0f per second)",
+               tor->blockSize / KiB, i / (MAX (now_usec () - begin, 1) / 1000000.0));
+  printSpeed (label, bytes, now_usec () - begin);
+  syncAndDropFiles (tor);
+  return true;
+}
+
+static void
+onVerifyDone (tr_torrent * tor UNUSED, bool aborted UNUSED, void * vdone)
+{
+  *(bool*)vdone = true;
+}
+
+/* @return true if all the data checked out */
+static bool
+benchVerify (tr_torrent * tor, bool mmap, uint64_t * setme_usec)
+{
+  bool done = false;
+  const uint64_t begin = now_usec ();
+
+  tr_sessionSetVerifyMmapEnabled (tor->session, mmap);
+  tr_torrentVerify (tor, onVerifyDone, &done);
+  while (!done)
+    tr_wait_msec (10);
+
+  *setme_usec = now_usec () - begin;
+  printSpeed (mmap ? "verify (mmap)" : "verify (read)", tor->info.totalSize, *setme_usec);
+  syncAndDropFiles (tor);
+  return tr_torrentStat (tor)->leftUntilDone == 0;
+}
+
+struct cache_write_data
+{
+  tr_torrent * tor;
+  tr_piece_index_t * pieces;
+  uint64_t usec;
+  int err;
+  bool done;
+};
+
+/* the cache may only be used from the libtransmission thread */
+static void
+cacheWriteThreadFunc (void * vdata)
+{
+  tr_piece_index_t i;
+  uint64_t begin;
+  struct cache_write_data * data = vdata;
+  tr_torrent * tor = data->tor;
+  tr_cache * cache = tor->session->cache;
+  struct evbuffer * block = evbuffer_new ();
+  uint8_t * buf = tr_new (uint8_t, tor->info.pieceSize);
+
+  for (i=0; !data->err && i<tor->info.pieceCount; ++i)
+    {
+      uint32_t offset;
+      const tr_piece_index_t piece = data->pieces[i];
+      const uint32_t len = tr_torPieceCountBytes (tor, piece);
+
+      fillPiece (buf, len, piece);
+      begin = now_usec ();
+      for (offset=0; !data->err && offset<len; offset+=tor->blockSize)
+        {
+          const uint32_t n = MIN (tor->blockSize, len - offset);
+
+          evbuffer_add (block, buf + offset, n);
+          data->err = tr_cacheWriteBlock (cache, tor, piece, offset, n, block);
+        }
+      data->usec += now_usec () - begin;
+    }
+
+  begin = now_usec ();
+  if (!data->err)
+    data->err = tr_cacheFlushTorrent (cache, tor);
+  data->usec += now_usec () - begin;
+
+  tr_free (buf);
+  evbuffer_free (block);
+  data->done = true;
+}
+
+/**
+ * Write the torrent from scratch through the write cache, in the
+ * random piece order of a download, the way peers' blocks are saved.
+ * @return the time it took, or 0 on error
+ */
+static uint64_t
+benchCacheWrite (tr_torrent * tor, const char * label)
+{
+  tr_piece_index_t i;
+  uint64_t begin;
+  struct cache_write_data data;
+
+  removeFiles (tor);
+
+  memset (&data, 0, sizeof (data));
+  data.tor = tor;
+  data.pieces = tr_new (tr_piece_index_t, tor->info.pieceCount);
+  for (i=0; i<tor->info.pieceCount; ++i)
+    data.pieces[i] = i;
+  for (i=tor->info.pieceCount; i>1; --i)
+    {
+      const int j = tr_cryptoWeakRandInt (i);
+      const tr_piece_index_t tmp = data.pieces[i-1];
+      data.pieces[i-1] = data.pieces[j];
+      data.pieces[j] = tmp;
+    }
+
+  tr_runInEventThread (tor->session, cacheWriteThreadFunc, &data);
+  while (!data.done)
+    tr_wait_msec (10);
+
+  begin = now_usec ();
+  syncAndDropFiles (tor);
+  data.usec += now_usec () - begin;
+
+  tr_free (data.pieces);
+  if (data.err)
+    return 0;
+
+  printSpeed (label, tor->info.totalSize, data.usec);
+  return MAX (data.usec, 1);
+}
+
+/***
+****
+***/
+
+static bool
+runBenchmarks (tr_torrent * tor)
+{
+  int i;
+  bool ok;
+  uint8_t * buf;
+  char label[64];
+  uint64_t usec;
+  uint64_t verify_read_usec;
+  uint64_t verify_mmap_usec;
+  uint64_t best_usec;
+  int best_preallocation = TR_PREALLOCATE_SPARSE;
+  int best_cache_mb = tr_sessionGetCacheLimit_MB (tor->session);
+  static const int cache_sizes_mb[] = { 4, 16, 64, 256 };
+  static const char * preallocation_names[] = { "none", "sparse", "full" };
+
+  buf = tr_new (uint8_t, tor->info.pieceSize);
+  ok = benchSequentialWrite (tor, buf)
+    && benchSequentialRead (tor, buf)
+    && benchRandomRead (tor, buf);
+  tr_free (buf);
+
+  if (!ok)
+    {
+      fprintf (stderr, "ERROR: Couldn't read or write the test data\n");
+      return false;
+    }
+
+  if (!benchVerify (tor, false, &verify_read_usec) || !benchVerify (tor, true, &verify_mmap_usec))
+    {
+      fprintf (stderr, "ERROR: The data that was written didn't verify\n");
+      return false;
+    }
+
+  /* find the preallocation mode that writes a download the fastest... */
+  best_usec = UINT64_MAX;
+  for (i=TR_PREALLOCATE_NONE; i<=TR_PREALLOCATE_FULL; ++i)
+    {
+      tr_sessionLock (tor->session);
+      tor->session->preallocationMode = (tr_preallocation_mode) i;
+      tr_sessionUnlock (tor->session);
+
+      tr_snprintf (label, sizeof (label), "download, %s preallocation, %d MiB cache",
+                   preallocation_names[i], tr_sessionGetCacheLimit_MB (tor->session));
+      if (!(usec = benchCacheWrite (tor, label)))
+        return false;
+
+      if (best_usec > usec)
+        {
+          best_usec = usec;
+          best_preallocation = i;
+        }
+    }
+
+  tr_sessionLock (tor->session);
+  tor->session->preallocationMode = (tr_preallocation_mode) best_preallocation;
+  tr_sessionUnlock (tor->session);
+
+  /* ...and then the cache size. Only pick a bigger cache if it's worth
+     the memory: at least 10% faster than the next smaller one */
+  best_usec = UINT64_MAX;
+  for (i=0; i<(int)TR_N_ELEMENTS (cache_sizes_mb); ++i)
+    {
+      const int mb = cache_sizes_mb[i];
+
+      if (i > 0 && (uint64_t)mb * MiB > tor->info.totalSize)
+        break;
+
+      tr_sessionSetCacheLimit_MB (tor->session, mb);
+      tr_snprintf (label, sizeof (label), "download, %s preallocation, %d MiB cache",
+                   preallocation_names[best_preallocation], mb);
+      if (!(usec = benchCacheWrite (tor, label)))
+        return false;
+
+      if (usec * 10 < best_usec * 9)
+        {
+          best_usec = usec;
+          best_cache_mb = mb;
+        }
+    }
+
+  printf ("\n");
+  printf ("suggested settings:\n");
+  printf ("  \"cache-size-mb\": %d,\n", best_cache_mb);
+  printf ("  \"preallocation\": %d,\n", best_preallocation);
+  printf ("  \"verify-mmap-enabled\": %s\n", verify_mmap_usec < verify_read_usec ? "true" : "false");
+  return true;
+}
+
+static void
+rm_rf (const char * killme)
+{
+  tr_sys_path_info info;
+
+  if (tr_sys_path_get_info (killme, 0, &info, NULL))
+    {
+      tr_sys_dir_t odir;
+
+      if (info.type == TR_SYS_PATH_IS_DIRECTORY &&
+          (odir = tr_sys_dir_open (killme, NULL)) != TR_BAD_SYS_DIR)
+        {
+          const char * name;
+          while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+            {
+              if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+                {
+                  char * tmp = tr_buildPath (killme, name, NULL);
+                  rm_rf (tmp);
+                  tr_free (tmp);
+                }
+            }
+          tr_sys_dir_close (odir, NULL);
+        }
+
+      tr_sys_path_remove (killme, NULL);
+    }
+}
+
+int
+main (int argc, char * argv[])
+{
+  int err = 0;
+  bool ok = false;
+  char * sandbox;
+  char * config_dir;
+  char * metainfo;
+  int metainfo_len;
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  tr_session * session;
+  tr_variant settings;
+  tr_error * error = NULL;
+  uint64_t total_size;
+
+#ifdef _WIN32
+  tr_win32_make_args_utf8 (&argc, &argv);
+#endif
+
+  tr_logSetLevel (TR_LOG_ERROR);
+  tr_formatter_mem_init (MEM_K, "KiB", "MiB", "GiB", "TiB");
+  tr_formatter_size_init (DISK_K, "kB", "MB", "GB", "TB");
+  tr_formatter_speed_init (SPEED_K, "kB/s", "MB/s", "GB/s", "TB/s");
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  if (showVersion)
+    {
+      fprintf (stderr, MY_NAME" "LONG_VERSION_STRING"\n");
+      return EXIT_SUCCESS;
+    }
+
+  /* everything goes in a scratch directory that's removed afterwards */
+  if (dir == NULL)
+    {
+      char * cwd = tr_sys_dir_get_current (NULL);
+      sandbox = tr_buildPath (cwd != NULL ? cwd : ".", MY_NAME "-XXXXXX", NULL);
+      tr_free (cwd);
+    }
+  else
+    {
+      sandbox = tr_buildPath (dir, MY_NAME "-XXXXXX", NULL);
+    }
+
+  if (!tr_sys_dir_create_temp (sandbox, &error))
+    {
+      fprintf (stderr, "ERROR: Couldn't create \"%s\": %s\n", sandbox, error->message);
+      tr_error_free (error);
+      tr_free (sandbox);
+      return EXIT_FAILURE;
+    }
+
+  config_dir = tr_buildPath (sandbox, "config", NULL);
+  tr_sys_dir_create (config_dir, 0, 0700, NULL);
+
+  tr_variantInitDict (&settings, 8);
+  tr_variantDictAddStr (&settings, TR_KEY_download_dir, sandbox);
+  tr_variantDictAddBool (&settings, TR_KEY_dht_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_port_forwarding_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_rpc_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_scrub_enabled, false);
+  tr_variantDictAddInt (&settings, TR_KEY_message_level, TR_LOG_ERROR);
+  session = tr_sessionInit (MY_NAME, config_dir, false, &settings);
+  tr_variantFree (&settings);
+
+  total_size = (uint64_t)size_mib * MiB;
+  printf (MY_NAME " " LONG_VERSION_STRING ": %u MiB in %u file%s, %u KiB pieces, in \"%s\"\n\n",
+          size_mib, file_count, file_count == 1 ? "" : "s", piecesize_kib, sandbox);
+
+  metainfo = makeMetainfo (total_size, piecesize_kib * KiB, &metainfo_len);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (const uint8_t*)metainfo, metainfo_len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tr_ctorSetDeleteSource (ctor, false);
+  tor = tr_torrentNew (ctor, &err, NULL);
+  tr_ctorFree (ctor);
+  tr_free (metainfo);
+
+  if (tor == NULL)
+    fprintf (stderr, "ERROR: Couldn't create the test torrent (error %d)\n", err);
+  else
+    ok = runBenchmarks (tor);
+
+  if (tor != NULL)
+    tr_torrentRemove (tor, true, remove);
+
+  tr_sessionClose (session);
+  rm_rf (sandbox);
+  tr_free (config_dir);
+  tr_free (sandbox);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
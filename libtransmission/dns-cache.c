@@ -0,0 +1,285 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <event2/util.h> /* evutil_ascii_strcasecmp () */
+
+#include "transmission.h"
+#include "dns-cache.h"
+#include "log.h"
+#include "platform.h" /* tr_lock, tr_sessionGetConfigDir () */
+#include "ptrarray.h"
+#include "session.h"
+#include "utils.h"
+#include "variant.h"
+
+enum
+{
+  /* neither evdns nor libcurl tells us the record's real TTL,
+     so use the same lifespan the UDP announcer has always used */
+  DNS_CACHE_TTL_SECS = 60 * 60,
+
+  DNS_CACHE_MAX_ENTRIES = 1024
+};
+
+struct dns_entry
+{
+  char * host;
+  tr_address addr;
+  time_t expires_at;
+};
+
+struct tr_dns_cache
+{
+  tr_lock * lock;
+  tr_ptrArray entries; /* dns_entry, sorted by host */
+};
+
+static int
+compareEntryToHost (const void * va, const void * vb)
+{
+  const struct dns_entry * a = va;
+
+  return evutil_ascii_strcasecmp (a->host, vb);
+}
+
+static void
+entryFree (void * ventry)
+{
+  struct dns_entry * entry = ventry;
+
+  tr_free (entry->host);
+  tr_free (entry);
+}
+
+static char*
+getFilename (const tr_session * session)
+{
+  return tr_buildPath (tr_sessionGetConfigDir (session), "dns-cache.json", NULL);
+}
+
+/* caller must hold the lock */
+static void
+setEntry (struct tr_dns_cache  * cache,
+          const char           * host,
+          const tr_address     * addr,
+          time_t                 expires_at)
+{
+  bool exact;
+  int pos;
+  struct dns_entry * entry;
+
+  pos = tr_ptrArrayLowerBound (&cache->entries, host, compareEntryToHost, &exact);
+
+  if (exact)
+    {
+      entry = tr_ptrArrayNth (&cache->entries, pos);
+    }
+  else
+    {
+      if (tr_ptrArraySize (&cache->entries) >= DNS_CACHE_MAX_ENTRIES)
+        return;
+
+      entry = tr_new0 (struct dns_entry, 1);
+      entry->host = tr_strdup (host);
+      tr_ptrArrayInsert (&cache->entries, entry, pos);
+    }
+
+  entry->addr = *addr;
+  entry->expires_at = expires_at;
+}
+
+static void
+loadCache (tr_session * session, struct tr_dns_cache * cache)
+{
+  char * filename;
+  tr_variant top;
+
+  filename = getFilename (session);
+
+  if (!tr_variantFromFile (&top, TR_VARIANT_FMT_JSON, filename))
+    {
+      size_t i;
+      const time_t now = tr_time ();
+      const size_t n = tr_variantListSize (&top);
+
+      for (i=0; i<n; ++i)
+        {
+          int64_t expires_at;
+          const char * host;
+          const char * str;
+          tr_address addr;
+          tr_variant * d = tr_variantListChild (&top, i);
+
+          if (tr_variantDictFindStr (d, TR_KEY_host, &host, NULL)
+              && tr_variantDictFindStr (d, TR_KEY_address, &str, NULL)
+              && tr_variantDictFindInt (d, TR_KEY_expires, &expires_at)
+              && (expires_at > now)
+              && (expires_at <= now + DNS_CACHE_TTL_SECS)
+              && tr_address_from_string (&addr, str))
+            setEntry (cache, host, &addr, expires_at);
+        }
+
+      tr_variantFree (&top);
+    }
+
+  tr_free (filename);
+}
+
+static void
+saveCache (tr_session * session, struct tr_dns_cache * cache)
+{
+  int i, n;
+  char * filename;
+  tr_variant top;
+  const time_t now = tr_time ();
+
+  n = tr_ptrArraySize (&cache->entries);
+  tr_variantInitList (&top, n);
+
+  for (i=0; i<n; ++i)
+    {
+      const struct dns_entry * entry = tr_ptrArrayNth (&cache->entries, i);
+
+      if (entry->expires_at > now)
+        {
+          char buf[TR_INET6_ADDRSTRLEN];
+          tr_variant * d = tr_variantListAddDict (&top, 3);
+          tr_variantDictAddStr (d, TR_KEY_host, entry->host);
+          tr_variantDictAddStr (d, TR_KEY_address,
+                                tr_address_to_string_with_buf (&entry->addr, buf, sizeof (buf)));
+          tr_variantDictAddInt (d, TR_KEY_expires, entry->expires_at);
+        }
+    }
+
+  filename = getFilename (session);
+  tr_logAddDeep (__FILE__, __LINE__, NULL, "Saving DNS cache to \"%s\"", filename);
+  tr_variantToFile (&top, TR_VARIANT_FMT_JSON, filename);
+
+  tr_free (filename);
+  tr_variantFree (&top);
+}
+
+/***
+****
+***/
+
+void
+tr_dnsCacheInit (tr_session * session)
+{
+  struct tr_dns_cache * cache = tr_new0 (struct tr_dns_cache, 1);
+
+  cache->lock = tr_lockNew ();
+  cache->entries = TR_PTR_ARRAY_INIT;
+  loadCache (session, cache);
+  session->dnsCache = cache;
+}
+
+void
+tr_dnsCacheClose (tr_session * session)
+{
+  struct tr_dns_cache * cache = session->dnsCache;
+
+  if (cache != NULL)
+    {
+      saveCache (session, cache);
+      session->dnsCache = NULL;
+      tr_ptrArrayDestruct (&cache->entries, entryFree);
+      tr_lockFree (cache->lock);
+      tr_free (cache);
+    }
+}
+
+bool
+tr_dnsCacheLookup (tr_session  * session,
+                   const char  * host,
+                   tr_address  * setme,
+                   time_t      * setme_expires)
+{
+  bool found = false;
+  struct tr_dns_cache * cache = session->dnsCache;
+
+  if ((cache != NULL) && (host != NULL))
+    {
+      struct dns_entry * entry;
+
+      tr_lockLock (cache->lock);
+
+      entry = tr_ptrArrayFindSorted (&cache->entries, host, compareEntryToHost);
+      if ((entry != NULL) && (entry->expires_at > tr_time ()))
+        {
+          found = true;
+          *setme = entry->addr;
+          if (setme_expires != NULL)
+            *setme_expires = entry->expires_at;
+        }
+
+      tr_lockUnlock (cache->lock);
+    }
+
+  return found;
+}
+
+void
+tr_dnsCacheAdd (tr_session        * session,
+                const char        * host,
+                const tr_address  * addr)
+{
+  struct tr_dns_cache * cache = session->dnsCache;
+
+  if ((cache != NULL) && (host != NULL) && tr_address_is_valid (addr))
+    {
+      const time_t now = tr_time ();
+
+      tr_lockLock (cache->lock);
+
+      /* make room by dropping anything that's gone stale */
+      if (tr_ptrArraySize (&cache->entries) >= DNS_CACHE_MAX_ENTRIES)
+        {
+          int i;
+
+          for (i=tr_ptrArraySize (&cache->entries)-1; i>=0; --i)
+            {
+              struct dns_entry * entry = tr_ptrArrayNth (&cache->entries, i);
+
+              if (entry->expires_at <= now)
+                {
+                  tr_ptrArrayRemove (&cache->entries, i);
+                  entryFree (entry);
+                }
+            }
+        }
+
+      setEntry (cache, host, addr, now + DNS_CACHE_TTL_SECS);
+
+      tr_lockUnlock (cache->lock);
+    }
+}
+
+void
+tr_dnsCacheRemove (tr_session * session, const char * host)
+{
+  struct tr_dns_cache * cache = session->dnsCache;
+
+  if ((cache != NULL) && (host != NULL))
+    {
+      bool exact;
+      int pos;
+
+      tr_lockLock (cache->lock);
+
+      pos = tr_ptrArrayLowerBound (&cache->entries, host, compareEntryToHost, &exact);
+      if (exact)
+        {
+          entryFree (tr_ptrArrayNth (&cache->entries, pos));
+          tr_ptrArrayRemove (&cache->entries, pos);
+        }
+
+      tr_lockUnlock (cache->lock);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_DNS_CACHE_H
+#define TR_DNS_CACHE_H
+
+#include "net.h" /* tr_address */
+
+/**
+ * A small hostname -> address cache shared by the HTTP and UDP announcers,
+ * so a tracker host that serves thousands of torrents is looked up once an
+ * hour instead of once per request. It's saved in the config directory when
+ * the session closes, so the first round of announces after a restart can
+ * skip DNS altogether.
+ *
+ * This is safe to call from the web thread as well as the libtransmission thread.
+ */
+
+void tr_dnsCacheInit   (tr_session * session);
+
+/* call this after the web thread has exited */
+void tr_dnsCacheClose  (tr_session * session);
+
+/** @return true if `host' has an unexpired address.
+    `setme_expires', if not NULL, is set to when that address goes stale. */
+bool tr_dnsCacheLookup (tr_session        * session,
+                        const char        * host,
+                        tr_address        * setme,
+                        time_t            * setme_expires);
+
+void tr_dnsCacheAdd    (tr_session        * session,
+                        const char        * host,
+                        const tr_address  * addr);
+
+/* forget `host', e.g. because we couldn't connect to its cached address */
+void tr_dnsCacheRemove (tr_session        * session,
+                        const char        * host);
+
+#endif
@@ -7,19 +7,30 @@
  * $Id$
  */
 
+#if defined (HAVE_ACCEPT4) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* glibc's sys/socket.h needs this to pick up accept4 */
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <string.h>
 
+#ifdef HAVE_ACCEPT4
+ #include <sys/socket.h> /* accept4 () */
+#endif
+
 #include <sys/time.h> /* getrlimit */
 #include <sys/resource.h> /* getrlimit */
 
 #include "transmission.h"
+#include "bitfield.h"
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "log.h"
+#include "metrics.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
 
@@ -98,13 +109,31 @@ preallocate_file_full (const char * filename, uint64_t length)
 ******
 *****/
 
+/* TR_PREALLOCATE_INCREMENTAL reserves space in regions of this size */
+#define RESERVE_REGION_SIZE (64 * 1024 * 1024)
+
 struct tr_cached_file
 {
   bool is_writable;
   tr_sys_file_t fd;
   int torrent_id;
   tr_file_index_t file_index;
-  time_t used_at;
+
+  /* TR_PREALLOCATE_INCREMENTAL: which of the file's regions have been
+     reserved. empty if the file wasn't opened in that mode */
+  tr_bitfield reserved;
+  uint64_t file_size;
+
+  /* drop the file from the page cache when it's closed */
+  bool drop_cache;
+
+  /* next file in the same hash bucket */
+  struct tr_cached_file * hash_next;
+
+  /* neighbors in the LRU list of open files,
+     or the next free slot if this one isn't open */
+  struct tr_cached_file * prev;
+  struct tr_cached_file * next;
 };
 
 static inline bool
@@ -120,8 +149,15 @@ cached_file_close (struct tr_cached_file * o)
 {
   assert (cached_file_is_open (o));
 
+  /* this also starts writing back whatever's still dirty */
+  if (o->drop_cache)
+    tr_sys_file_drop_cache (o->fd, 0, 0, NULL);
+
   tr_sys_file_close (o->fd, NULL);
   o->fd = TR_BAD_SYS_FILE;
+
+  tr_bitfieldDestruct (&o->reserved);
+  tr_bitfieldConstruct (&o->reserved, 0);
 }
 
 /**
@@ -197,6 +233,15 @@ cached_file_open (struct tr_cached_file  * o,
   if (writable && !already_existed && (allocation == TR_PREALLOCATE_SPARSE))
     preallocate_file_sparse (o->fd, file_size);
 
+  /* reserving space is harmless if it's already allocated,
+     so this is done for existing files too */
+  if (writable && (allocation == TR_PREALLOCATE_INCREMENTAL) && (file_size > 0))
+    {
+      tr_bitfieldDestruct (&o->reserved);
+      tr_bitfieldConstruct (&o->reserved, (file_size + RESERVE_REGION_SIZE - 1) / RESERVE_REGION_SIZE);
+      o->file_size = file_size;
+    }
+
   return 0;
 }
 
@@ -208,36 +253,140 @@ struct tr_fileset
 {
   struct tr_cached_file * begin;
   const struct tr_cached_file * end;
+
+  /* the open files, indexed by torrent id & file index */
+  struct tr_cached_file ** buckets;
+  size_t bucket_count;
+
+  /* the open files, most recently used first */
+  struct tr_cached_file * lru_head;
+  struct tr_cached_file * lru_tail;
+
+  /* the slots that aren't open */
+  struct tr_cached_file * free_slots;
 };
 
+static inline struct tr_cached_file **
+fileset_get_bucket (const struct tr_fileset * set, int torrent_id, tr_file_index_t i)
+{
+  size_t h = (size_t)torrent_id * 2654435761u;
+  h ^= (size_t)i * 40503u + (h >> 7);
+  return &set->buckets[h & (set->bucket_count - 1)];
+}
+
+static void
+fileset_lru_unlink (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->prev != NULL)
+    o->prev->next = o->next;
+  else
+    set->lru_head = o->next;
+
+  if (o->next != NULL)
+    o->next->prev = o->prev;
+  else
+    set->lru_tail = o->prev;
+}
+
+static void
+fileset_lru_push_front (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  o->prev = NULL;
+  o->next = set->lru_head;
+  if (set->lru_head != NULL)
+    set->lru_head->prev = o;
+  else
+    set->lru_tail = o;
+  set->lru_head = o;
+}
+
+/* mark an open file as the most recently used */
+static void
+fileset_touch (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (set->lru_head != o)
+    {
+      fileset_lru_unlink (set, o);
+      fileset_lru_push_front (set, o);
+    }
+}
+
+static void
+fileset_release_slot (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  o->prev = NULL;
+  o->next = set->free_slots;
+  set->free_slots = o;
+}
+
+/* add a newly-opened file to the index and the LRU list */
+static void
+fileset_add (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** bucket = fileset_get_bucket (set, o->torrent_id, o->file_index);
+
+  assert (cached_file_is_open (o));
+
+  o->hash_next = *bucket;
+  *bucket = o;
+  fileset_lru_push_front (set, o);
+}
+
+/* close an open file and return its slot to the free list */
+static void
+fileset_close_file (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** walk = fileset_get_bucket (set, o->torrent_id, o->file_index);
+
+  while (*walk != o)
+    walk = &(*walk)->hash_next;
+  *walk = o->hash_next;
+
+  fileset_lru_unlink (set, o);
+  cached_file_close (o);
+  fileset_release_slot (set, o);
+}
+
 static void
 fileset_construct (struct tr_fileset * set, int n)
 {
   struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { false, TR_BAD_SYS_FILE, 0, 0, 0 };
+  struct tr_cached_file TR_CACHED_FILE_INIT;
+
+  memset (&TR_CACHED_FILE_INIT, 0, sizeof (TR_CACHED_FILE_INIT));
+  TR_CACHED_FILE_INIT.fd = TR_BAD_SYS_FILE;
+  tr_bitfieldConstruct (&TR_CACHED_FILE_INIT.reserved, 0);
 
   set->begin = tr_new (struct tr_cached_file, n);
   set->end = set->begin + n;
 
+  for (set->bucket_count=1; set->bucket_count<(size_t)n; )
+    set->bucket_count *= 2;
+  set->buckets = tr_new0 (struct tr_cached_file*, set->bucket_count);
+
+  set->lru_head = set->lru_tail = NULL;
+  set->free_slots = NULL;
+
   for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+    {
+      *o = TR_CACHED_FILE_INIT;
+      fileset_release_slot (set, o);
+    }
 }
 
 static void
 fileset_close_all (struct tr_fileset * set)
 {
-  struct tr_cached_file * o;
-
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if (cached_file_is_open (o))
-        cached_file_close (o);
+    while (set->lru_head != NULL)
+      fileset_close_file (set, set->lru_head);
 }
 
 static void
 fileset_destruct (struct tr_fileset * set)
 {
   fileset_close_all (set);
+  tr_free (set->buckets);
   tr_free (set->begin);
   set->end = set->begin = NULL;
 }
@@ -248,9 +397,19 @@ fileset_close_torrent (struct tr_fileset * set, int torrent_id)
   struct tr_cached_file * o;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((o->torrent_id == torrent_id) && cached_file_is_open (o))
-        cached_file_close (o);
+    {
+      o = set->lru_head;
+
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->next;
+
+          if (o->torrent_id == torrent_id)
+            fileset_close_file (set, o);
+
+          o = next;
+        }
+    }
 }
 
 static struct tr_cached_file *
@@ -258,10 +417,12 @@ fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 {
   struct tr_cached_file * o;
 
-  if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((torrent_id == o->torrent_id) && (i == o->file_index) && cached_file_is_open (o))
-        return o;
+  if (set == NULL)
+    return NULL;
+
+  for (o=*fileset_get_bucket (set, torrent_id, i); o!=NULL; o=o->hash_next)
+    if ((torrent_id == o->torrent_id) && (i == o->file_index))
+      return o;
 
   return NULL;
 }
@@ -269,26 +430,16 @@ fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 static struct tr_cached_file *
 fileset_get_empty_slot (struct tr_fileset * set)
 {
-  struct tr_cached_file * cull = NULL;
-
-  if (set->begin != NULL)
-    {
-      struct tr_cached_file * o;
-
-      /* try to find an unused slot */
-      for (o=set->begin; o!=set->end; ++o)
-        if (!cached_file_is_open (o))
-          return o;
+  struct tr_cached_file * o;
 
-      /* all slots are full... recycle the least recently used */
-      for (cull=NULL, o=set->begin; o!=set->end; ++o)
-        if (!cull || o->used_at < cull->used_at)
-          cull = o;
+  /* if all the slots are full, recycle the least recently used */
+  if ((set->free_slots == NULL) && (set->lru_tail != NULL))
+    fileset_close_file (set, set->lru_tail);
 
-      cached_file_close (cull);
-    }
+  if ((o = set->free_slots))
+    set->free_slots = o->next;
 
-  return cull;
+  return o;
 }
 
 /***
@@ -301,6 +452,10 @@ struct tr_fdInfo
 {
   int peerCount;
   struct tr_fileset fileset;
+
+  /* guards the fileset. held while a checked out fd is being used
+     so that another thread can't close it out from under us */
+  tr_lock * lock;
 };
 
 static void
@@ -317,6 +472,7 @@ ensureSessionFdInfoExists (tr_session * session)
       /* Create the local file cache */
       i = tr_new0 (struct tr_fdInfo, 1);
       fileset_construct (&i->fileset, FILE_CACHE_SIZE);
+      i->lock = tr_lockNew ();
       session->fdInfo = i;
 
       /* set the open-file limit to the largest safe size wrt FD_SETSIZE */
@@ -342,11 +498,25 @@ tr_fdClose (tr_session * session)
     {
       struct tr_fdInfo * i = session->fdInfo;
       fileset_destruct (&i->fileset);
+      tr_lockFree (i->lock);
       tr_free (i);
       session->fdInfo = NULL;
     }
 }
 
+void
+tr_fdLock (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+  tr_lockLock (session->fdInfo->lock);
+}
+
+void
+tr_fdUnlock (tr_session * session)
+{
+  tr_lockUnlock (session->fdInfo->lock);
+}
+
 /***
 ****
 ***/
@@ -366,6 +536,8 @@ tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
 {
   struct tr_cached_file * o;
 
+  tr_fdLock (s);
+
   if ((o = fileset_lookup (get_fileset (s), tr_torrentId (tor), i)))
     {
       /* flush writable files so that their mtimes will be
@@ -373,19 +545,22 @@ tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
       if (o->is_writable)
         tr_sys_file_flush (o->fd, NULL);
 
-      cached_file_close (o);
+      fileset_close_file (get_fileset (s), o);
     }
+
+  tr_fdUnlock (s);
 }
 
 tr_sys_file_t
 tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
 {
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_fileset * set = get_fileset (s);
+  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
 
   if (!o || (writable && !o->is_writable))
     return TR_BAD_SYS_FILE;
 
-  o->used_at = tr_time ();
+  fileset_touch (set, o);
   return o->fd;
 }
 
@@ -394,11 +569,16 @@ tr_fdFileGetCachedMTime (tr_session * s, int torrent_id, tr_file_index_t i, time
 {
   bool success;
   tr_sys_path_info info;
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_cached_file * o;
 
+  tr_fdLock (s);
+
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
   if ((success = (o != NULL) && tr_sys_file_get_info (o->fd, &info, NULL)))
     *mtime = info.last_modified_at;
 
+  tr_fdUnlock (s);
+
   return success;
 }
 
@@ -407,7 +587,28 @@ tr_fdTorrentClose (tr_session * session, int torrent_id)
 {
   assert (tr_sessionIsLocked (session));
 
+  tr_fdLock (session);
   fileset_close_torrent (get_fileset (session), torrent_id);
+  tr_fdUnlock (session);
+}
+
+int
+tr_fdTorrentGetOpenFileCount (tr_session * session, int torrent_id)
+{
+  int n = 0;
+  const struct tr_cached_file * o;
+  struct tr_fileset * set;
+
+  tr_fdLock (session);
+
+  if ((set = get_fileset (session)) != NULL)
+    for (o=set->lru_head; o!=NULL; o=o->next)
+      if (o->torrent_id == torrent_id)
+        ++n;
+
+  tr_fdUnlock (session);
+
+  return n;
 }
 
 /* returns an fd on success, or a TR_BAD_SYS_FILE on failure and sets errno */
@@ -424,30 +625,88 @@ tr_fdFileCheckout (tr_session             * session,
   struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
 
   if (o && writable && !o->is_writable)
-    cached_file_close (o); /* close it so we can reopen in rw mode */
-  else if (!o)
-    o = fileset_get_empty_slot (set);
+    {
+      /* close it so we can reopen in rw mode */
+      fileset_close_file (set, o);
+      o = NULL;
+    }
+
+  tr_metricsAdd (session, o != NULL ? TR_METRIC_FD_CACHE_HITS : TR_METRIC_FD_CACHE_MISSES, 1);
 
-  if (!cached_file_is_open (o))
+  if (o == NULL)
     {
-      const int err = cached_file_open (o, filename, writable, allocation, file_size);
+      int err;
+
+      o = fileset_get_empty_slot (set);
+      err = cached_file_open (o, filename, writable, allocation, file_size);
       if (err)
         {
+          if (cached_file_is_open (o))
+            cached_file_close (o);
+          fileset_release_slot (set, o);
           errno = err;
           return TR_BAD_SYS_FILE;
         }
 
       dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
       o->is_writable = writable;
+      o->drop_cache = session->isPageCacheBypassEnabled;
+      o->torrent_id = torrent_id;
+      o->file_index = i;
+      fileset_add (set, o);
     }
 
   dbgmsg ("checking out '%s'", filename);
-  o->torrent_id = torrent_id;
-  o->file_index = i;
-  o->used_at = tr_time ();
+  fileset_touch (set, o);
   return o->fd;
 }
 
+void
+tr_fdFileReserve (tr_session       * session,
+                  int                torrent_id,
+                  tr_file_index_t    i,
+                  uint64_t           offset,
+                  uint64_t           length)
+{
+  size_t first;
+  size_t last;
+  tr_error * error = NULL;
+  struct tr_cached_file * o = fileset_lookup (get_fileset (session), torrent_id, i);
+
+  if (o == NULL || o->reserved.bit_count == 0 || tr_bitfieldHasAll (&o->reserved) || length == 0)
+    return;
+
+  /* the regions being written to, plus the next one so that
+     sequential writes always find it waiting for them */
+  first = offset / RESERVE_REGION_SIZE;
+  last = MIN ((offset + length - 1) / RESERVE_REGION_SIZE + 1, o->reserved.bit_count - 1);
+
+  while (first <= last && tr_bitfieldHas (&o->reserved, first))
+    ++first;
+  if (first > last)
+    return;
+  while (tr_bitfieldHas (&o->reserved, last))
+    --last;
+
+  /* the regions in between are usually unreserved too, so one call covers them */
+  {
+    const uint64_t begin = (uint64_t)first * RESERVE_REGION_SIZE;
+    const uint64_t end = MIN ((uint64_t)(last + 1) * RESERVE_REGION_SIZE, o->file_size);
+
+    if (tr_sys_file_reserve (o->fd, begin, end - begin, &error))
+      {
+        tr_bitfieldAddRange (&o->reserved, first, last + 1);
+      }
+    else
+      {
+        /* don't keep trying on file systems that can't do it */
+        dbgmsg ("couldn't reserve space: %s", error->message);
+        tr_error_free (error);
+        tr_bitfieldSetHasAll (&o->reserved);
+      }
+  }
+}
+
 /***
 ****
 ****  Sockets
@@ -508,8 +767,18 @@ tr_fdSocketAccept (tr_session * s, int sockfd, tr_address * addr, tr_port * port
   gFd = s->fdInfo;
 
   len = sizeof (struct sockaddr_storage);
+#ifdef HAVE_ACCEPT4
+  fd = accept4 (sockfd, (struct sockaddr *) &sock, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
   fd = accept (sockfd, (struct sockaddr *) &sock, &len);
 
+  if (fd >= 0 && evutil_make_socket_nonblocking (fd) < 0)
+    {
+      tr_netCloseSocket (fd);
+      fd = -1;
+    }
+#endif
+
   if (fd >= 0)
     {
       if ((gFd->peerCount < s->peerLimit)
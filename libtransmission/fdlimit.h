@@ -24,6 +24,18 @@
 ****
 ***/
 
+/**
+ * Lock the file cache.
+ *
+ * Disk I/O can happen outside of the libtransmission thread, so hold
+ * this lock while using an fd from tr_fdFileCheckout() or
+ * tr_fdFileGetCached() to keep another thread from closing it.
+ * The lock is recursive.
+ */
+void tr_fdLock (tr_session * session);
+
+void tr_fdUnlock (tr_session * session);
+
 /**
  * Returns an fd to the specified filename.
  *
@@ -47,6 +59,18 @@ tr_sys_file_t  tr_fdFileCheckout (tr_session             * session,
                                   tr_preallocation_mode    preallocation_mode,
                                   uint64_t                 preallocation_file_size);
 
+/**
+ * With TR_PREALLOCATE_INCREMENTAL, reserve space for the parts of a
+ * checked-out file that [offset, offset+length) is about to be written
+ * to, along with the part just after it. This is a no-op for files
+ * checked out in other modes, or once everything's been reserved.
+ */
+void tr_fdFileReserve (tr_session       * session,
+                       int                torrent_id,
+                       tr_file_index_t    file_num,
+                       uint64_t           offset,
+                       uint64_t           length);
+
 tr_sys_file_t tr_fdFileGetCached (tr_session             * session,
                                   int                      torrent_id,
                                   tr_file_index_t          file_num,
@@ -76,6 +100,11 @@ void tr_fdFileClose (tr_session        * session,
  */
 void tr_fdTorrentClose (tr_session * session, int torrentId);
 
+/**
+ * Returns how many of the torrent's files are currently open
+ */
+int tr_fdTorrentGetOpenFileCount (tr_session * session, int torrentId);
+
 
 /***********************************************************************
  * Sockets
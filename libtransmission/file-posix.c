@@ -39,8 +39,15 @@
 #include <sys/mman.h> /* mmap (), munmap () */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h> /* pwritev (), struct iovec */
 #include <unistd.h> /* lseek (), write (), ftruncate (), pread (), pwrite (), pathconf (), etc */
 
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h> /* FS_IOC_FIEMAP */
+ #include <linux/fiemap.h> /* struct fiemap */
+#endif
+
 #ifdef HAVE_XFS_XFS_H
  #include <xfs/xfs.h>
 #endif
@@ -79,6 +86,7 @@
 #if !TR_UCLIBC_CHECK_VERSION (0,9,28)
  #undef HAVE_PREAD
  #undef HAVE_PWRITE
+ #undef HAVE_PWRITEV
 #endif
 #endif
 
@@ -287,6 +295,25 @@ tr_sys_path_is_same (const char  * path1,
   return ret;
 }
 
+bool
+tr_sys_path_is_same_device (const char  * path1,
+                            const char  * path2,
+                            tr_error   ** error)
+{
+  bool ret = false;
+  struct stat sb1, sb2;
+
+  assert (path1 != NULL);
+  assert (path2 != NULL);
+
+  if (stat (path1, &sb1) != -1 && stat (path2, &sb2) != -1)
+    ret = sb1.st_dev == sb2.st_dev;
+  else
+    set_system_error_if_file_found (error, errno);
+
+  return ret;
+}
+
 char *
 tr_sys_path_resolve (const char  * path,
                      tr_error   ** error)
@@ -388,6 +415,24 @@ tr_sys_path_rename (const char  * src_path,
   return ret;
 }
 
+bool
+tr_sys_path_hardlink (const char  * src_path,
+                      const char  * dst_path,
+                      tr_error   ** error)
+{
+  bool ret;
+
+  assert (src_path != NULL);
+  assert (dst_path != NULL);
+
+  ret = link (src_path, dst_path) != -1;
+
+  if (!ret)
+    set_system_error (error, errno);
+
+  return ret;
+}
+
 bool
 tr_sys_path_remove (const char  * path,
                     tr_error   ** error)
@@ -709,6 +754,110 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vector_at (tr_sys_file_t              handle,
+                             const tr_sys_file_vector * vectors,
+                             size_t                     count,
+                             uint64_t                   offset,
+                             uint64_t                 * bytes_written,
+                             tr_error                ** error)
+{
+  bool ret = true;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vectors != NULL || count == 0);
+
+#ifdef HAVE_PWRITEV
+
+  {
+    enum { MAX_VECTORS = 64 };
+    struct iovec iov[MAX_VECTORS];
+    size_t i = 0;
+    uint64_t skip = 0; /* bytes of vectors[i] that are already written */
+
+    while (ret && i < count)
+      {
+        int n;
+        ssize_t my_bytes_written;
+
+        for (n=0; n<MAX_VECTORS && i+n<count; ++n)
+          {
+            iov[n].iov_base = (char*) vectors[i+n].buffer + (n == 0 ? skip : 0);
+            iov[n].iov_len = vectors[i+n].size - (n == 0 ? skip : 0);
+          }
+
+        my_bytes_written = pwritev (handle, iov, n, offset + total);
+
+        if (my_bytes_written == -1)
+          {
+            set_system_error (error, errno);
+            ret = false;
+          }
+        else
+          {
+            uint64_t left = my_bytes_written;
+
+            total += my_bytes_written;
+
+            /* advance past the vectors that were written */
+            while (i < count && left >= vectors[i].size - skip)
+              {
+                left -= vectors[i].size - skip;
+                skip = 0;
+                ++i;
+              }
+
+            skip += left;
+
+            if (my_bytes_written == 0 && i < count)
+              {
+                set_system_error (error, EIO);
+                ret = false;
+              }
+          }
+      }
+  }
+
+#else
+
+  {
+    size_t i;
+
+    for (i=0; ret && i<count; ++i)
+      {
+        uint64_t my_bytes_written;
+        const uint8_t * buffer = vectors[i].buffer;
+        uint64_t left = vectors[i].size;
+
+        while (ret && left > 0)
+          {
+            ret = tr_sys_file_write_at (handle, buffer, left, offset + total, &my_bytes_written, error);
+
+            if (ret && my_bytes_written == 0)
+              {
+                set_system_error (error, EIO);
+                ret = false;
+              }
+
+            if (ret)
+              {
+                buffer += my_bytes_written;
+                left -= my_bytes_written;
+                total += my_bytes_written;
+              }
+          }
+      }
+  }
+
+#endif
+
+  if (bytes_written != NULL)
+    *bytes_written = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -784,6 +933,38 @@ tr_sys_file_prefetch (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_drop_cache (tr_sys_file_t    handle,
+                        uint64_t         offset,
+                        uint64_t         size,
+                        tr_error      ** error)
+{
+  bool ret = false;
+
+  assert (handle != TR_BAD_SYS_FILE);
+
+#if defined (HAVE_POSIX_FADVISE) && defined (POSIX_FADV_DONTNEED)
+
+  {
+    const int code = posix_fadvise (handle, offset, size, POSIX_FADV_DONTNEED);
+
+    if (code == 0)
+      ret = true;
+    else
+      set_system_error (error, code);
+  }
+
+#else
+
+  (void) offset;
+  (void) size;
+  set_system_error (error, ENOTSUP);
+
+#endif
+
+  return ret;
+}
+
 bool
 tr_sys_file_preallocate (tr_sys_file_t    handle,
                          uint64_t         size,
@@ -865,6 +1046,90 @@ tr_sys_file_preallocate (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_reserve (tr_sys_file_t    handle,
+                     uint64_t         offset,
+                     uint64_t         size,
+                     tr_error      ** error)
+{
+  bool ret = false;
+  int code = ENOTSUP;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (size > 0);
+
+#if defined (HAVE_FALLOCATE64) && defined (FALLOC_FL_KEEP_SIZE)
+
+  ret = fallocate64 (handle, FALLOC_FL_KEEP_SIZE, offset, size) != -1;
+
+  if (!ret)
+    code = errno;
+
+#endif
+
+#ifdef HAVE_XFS_XFS_H
+
+  if (!ret && platform_test_xfs_fd (handle))
+    {
+      xfs_flock64_t fl;
+
+      fl.l_whence = 0;
+      fl.l_start = offset;
+      fl.l_len = size;
+
+      ret = xfsctl (NULL, handle, XFS_IOC_RESVSP64, &fl) != -1;
+
+      if (!ret)
+        code = errno;
+    }
+
+#endif
+
+  if (!ret)
+    set_system_error (error, code);
+
+  return ret;
+}
+
+bool
+tr_sys_file_get_extent_count (tr_sys_file_t    handle,
+                              size_t         * extent_count,
+                              tr_error      ** error)
+{
+  bool ret = false;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (extent_count != NULL);
+
+#if defined (__linux__) && defined (FS_IOC_FIEMAP)
+
+  {
+    struct fiemap fm;
+
+    /* with no room for extents, FIEMAP just counts them.
+       no FIEMAP_FLAG_SYNC: data that's still being written back
+       may not have been given its extents yet */
+    memset (&fm, 0, sizeof (fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+
+    ret = ioctl (handle, FS_IOC_FIEMAP, &fm) != -1;
+
+    if (ret)
+      *extent_count = fm.fm_mapped_extents;
+    else
+      set_system_error (error, errno);
+  }
+
+#else
+
+  (void) handle;
+  set_system_error (error, ENOTSUP);
+
+#endif
+
+  return ret;
+}
+
 void *
 tr_sys_file_map_for_reading (tr_sys_file_t    handle,
                              uint64_t         offset,
@@ -905,6 +1170,42 @@ tr_sys_file_unmap (const void  * address,
   return ret;
 }
 
+bool
+tr_sys_file_advise_map (const void               * address,
+                        uint64_t                   size,
+                        tr_sys_file_map_advice_t   advice,
+                        tr_error                ** error)
+{
+  bool ret;
+  int native_advice;
+  uintptr_t begin;
+  uintptr_t end;
+  static uintptr_t page_size = 0;
+
+  assert (address != NULL);
+  assert (size > 0);
+
+  if (page_size == 0)
+    page_size = sysconf (_SC_PAGESIZE);
+
+  begin = (uintptr_t) address & ~(page_size - 1);
+  end = (uintptr_t) address + size;
+
+  switch (advice)
+    {
+      case TR_SYS_FILE_MAP_SEQUENTIAL: native_advice = MADV_SEQUENTIAL; break;
+      case TR_SYS_FILE_MAP_WILLNEED:   native_advice = MADV_WILLNEED; break;
+      default:                         native_advice = MADV_DONTNEED; break;
+    }
+
+  ret = madvise ((void *) begin, end - begin, native_advice) != -1;
+
+  if (!ret)
+    set_system_error (error, errno);
+
+  return ret;
+}
+
 char *
 tr_sys_dir_get_current (tr_error ** error)
 {
@@ -530,6 +530,44 @@ test_path_is_same (void)
   return 0;
 }
 
+static int
+test_path_is_same_device (void)
+{
+  char * const test_dir = create_test_dir (__FUNCTION__);
+  tr_error * err = NULL;
+  char * path1, * path2;
+
+  path1 = tr_buildPath (test_dir, "a", NULL);
+  path2 = tr_buildPath (test_dir, "b", NULL);
+
+  /* Non-existent files are not on any device */
+  check (!tr_sys_path_is_same_device (path1, path2, &err));
+  check (err == NULL);
+
+  /* Existent and non-existent files are not on the same device */
+  libtest_create_file_with_string_contents (path1, "test");
+  check (!tr_sys_path_is_same_device (path1, path2, &err));
+  check (err == NULL);
+  check (!tr_sys_path_is_same_device (path2, path1, &err));
+  check (err == NULL);
+
+  /* Files in the same directory are on the same device */
+  tr_sys_dir_create (path2, 0, 0777, NULL);
+  check (tr_sys_path_is_same_device (path1, path2, &err));
+  check (err == NULL);
+  check (tr_sys_path_is_same_device (path1, test_dir, &err));
+  check (err == NULL);
+
+  tr_sys_path_remove (path2, NULL);
+  tr_sys_path_remove (path1, NULL);
+
+  tr_free (path2);
+  tr_free (path1);
+
+  tr_free (test_dir);
+  return 0;
+}
+
 static int
 test_path_resolve (void)
 {
@@ -995,6 +1033,20 @@ test_file_read_write_seek (void)
 
   check_int_eq (0, memcmp (buf, "st-ok", 5));
 
+  {
+    const tr_sys_file_vector vectors[] = { { "ab", 2 }, { "", 0 }, { "cde", 3 } };
+
+    check (tr_sys_file_write_vector_at (fd, vectors, 3, 5, &n, &err));
+    check (err == NULL);
+    check_int_eq (5, n);
+
+    check (tr_sys_file_read_at (fd, buf, sizeof (buf), 0, &n, &err));
+    check (err == NULL);
+    check_int_eq (10, n);
+
+    check_int_eq (0, memcmp (buf, "tEst-abcde", 10));
+  }
+
   tr_sys_file_close (fd, NULL);
 
   tr_sys_path_remove (path1, NULL);
@@ -1108,6 +1160,27 @@ test_file_preallocate (void)
 
   tr_sys_path_remove (path1, NULL);
 
+  fd = tr_sys_file_open (path1, TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, NULL);
+
+  /* reserving space mustn't change the file's size */
+  check (tr_sys_file_write (fd, "test", 4, NULL, NULL));
+  if (tr_sys_file_reserve (fd, 1024 * 1024, 1024 * 1024, &err))
+    {
+      check (err == NULL);
+      tr_sys_file_get_info (fd, &info, NULL);
+      check_int_eq (4, info.size);
+    }
+  else
+    {
+      check (err != NULL);
+      fprintf (stderr, "WARNING: [%s] unable to reserve space: %s (%d)\n", __FUNCTION__, err->message, err->code);
+      tr_error_clear (&err);
+    }
+
+  tr_sys_file_close (fd, NULL);
+
+  tr_sys_path_remove (path1, NULL);
+
   tr_free (path1);
 
   tr_free (test_dir);
@@ -1139,6 +1212,18 @@ test_file_map (void)
 
   check_int_eq (0, memcmp (view, "tEst", 4));
 
+#ifndef _WIN32
+  check (tr_sys_file_advise_map (view + 1, 3, TR_SYS_FILE_MAP_SEQUENTIAL, &err));
+  check (err == NULL);
+  check (tr_sys_file_advise_map (view, 4, TR_SYS_FILE_MAP_WILLNEED, &err));
+  check (err == NULL);
+
+  /* the pages come back from the file the next time they're touched */
+  check (tr_sys_file_advise_map (view, 4, TR_SYS_FILE_MAP_DONTNEED, &err));
+  check (err == NULL);
+  check_int_eq (0, memcmp (view, "tEst", 4));
+#endif
+
   check (tr_sys_file_unmap (view, 4, &err));
   check (err == NULL);
 
@@ -1399,6 +1484,7 @@ main (void)
       test_get_info,
       test_path_exists,
       test_path_is_same,
+      test_path_is_same_device,
       test_path_resolve,
       test_path_basename_dirname,
       test_path_rename,
@@ -385,6 +385,57 @@ cleanup:
   return ret;
 }
 
+bool
+tr_sys_path_is_same_device (const char  * path1,
+                            const char  * path2,
+                            tr_error   ** error)
+{
+  bool ret = false;
+  wchar_t * wide_path1 = NULL;
+  wchar_t * wide_path2 = NULL;
+  HANDLE handle1 = INVALID_HANDLE_VALUE;
+  HANDLE handle2 = INVALID_HANDLE_VALUE;
+  BY_HANDLE_FILE_INFORMATION fi1, fi2;
+
+  assert (path1 != NULL);
+  assert (path2 != NULL);
+
+  wide_path1 = tr_win32_utf8_to_native (path1, -1);
+  if (wide_path1 == NULL)
+    goto fail;
+
+  wide_path2 = tr_win32_utf8_to_native (path2, -1);
+  if (wide_path2 == NULL)
+    goto fail;
+
+  handle1 = CreateFileW (wide_path1, 0, 0, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (handle1 == INVALID_HANDLE_VALUE)
+    goto fail;
+
+  handle2 = CreateFileW (wide_path2, 0, 0, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (handle2 == INVALID_HANDLE_VALUE)
+    goto fail;
+
+  if (!GetFileInformationByHandle (handle1, &fi1) || !GetFileInformationByHandle (handle2, &fi2))
+    goto fail;
+
+  ret = fi1.dwVolumeSerialNumber == fi2.dwVolumeSerialNumber;
+
+  goto cleanup;
+
+fail:
+  set_system_error_if_file_found (error, GetLastError ());
+
+cleanup:
+  CloseHandle (handle2);
+  CloseHandle (handle1);
+
+  tr_free (wide_path2);
+  tr_free (wide_path1);
+
+  return ret;
+}
+
 char *
 tr_sys_path_resolve (const char  * path,
                      tr_error   ** error)
@@ -535,6 +586,33 @@ tr_sys_path_rename (const char  * src_path,
   return ret;
 }
 
+bool
+tr_sys_path_hardlink (const char  * src_path,
+                      const char  * dst_path,
+                      tr_error   ** error)
+{
+  bool ret = false;
+  wchar_t * wide_src_path;
+  wchar_t * wide_dst_path;
+
+  assert (src_path != NULL);
+  assert (dst_path != NULL);
+
+  wide_src_path = tr_win32_utf8_to_native (src_path, -1);
+  wide_dst_path = tr_win32_utf8_to_native (dst_path, -1);
+
+  if (wide_src_path != NULL && wide_dst_path != NULL)
+    ret = CreateHardLinkW (wide_dst_path, wide_src_path, NULL);
+
+  if (!ret)
+    set_system_error (error, GetLastError ());
+
+  tr_free (wide_dst_path);
+  tr_free (wide_src_path);
+
+  return ret;
+}
+
 bool
 tr_sys_path_remove (const char  * path,
                     tr_error   ** error)
@@ -894,6 +972,54 @@ tr_sys_file_write_at (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_write_vector_at (tr_sys_file_t              handle,
+                             const tr_sys_file_vector * vectors,
+                             size_t                     count,
+                             uint64_t                   offset,
+                             uint64_t                 * bytes_written,
+                             tr_error                ** error)
+{
+  bool ret = true;
+  size_t i;
+  uint64_t total = 0;
+
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (vectors != NULL || count == 0);
+
+  /* WriteFileGather () needs unbuffered, page-aligned I/O,
+     so just write the buffers one at a time */
+  for (i=0; ret && i<count; ++i)
+    {
+      uint64_t my_bytes_written;
+      const uint8_t * buffer = vectors[i].buffer;
+      uint64_t left = vectors[i].size;
+
+      while (ret && left > 0)
+        {
+          ret = tr_sys_file_write_at (handle, buffer, left, offset + total, &my_bytes_written, error);
+
+          if (ret && my_bytes_written == 0)
+            {
+              set_system_error (error, ERROR_WRITE_FAULT);
+              ret = false;
+            }
+
+          if (ret)
+            {
+              buffer += my_bytes_written;
+              left -= my_bytes_written;
+              total += my_bytes_written;
+            }
+        }
+    }
+
+  if (bytes_written != NULL)
+    *bytes_written = total;
+
+  return ret;
+}
+
 bool
 tr_sys_file_flush (tr_sys_file_t    handle,
                    tr_error      ** error)
@@ -946,6 +1072,18 @@ tr_sys_file_prefetch (tr_sys_file_t    handle,
   return ret;
 }
 
+bool
+tr_sys_file_drop_cache (tr_sys_file_t    handle,
+                        uint64_t         offset UNUSED,
+                        uint64_t         size UNUSED,
+                        tr_error      ** error)
+{
+  assert (handle != TR_BAD_SYS_FILE);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
 bool
 tr_sys_file_preallocate (tr_sys_file_t    handle,
                          uint64_t         size,
@@ -967,6 +1105,31 @@ tr_sys_file_preallocate (tr_sys_file_t    handle,
   return tr_sys_file_truncate (handle, size, error);
 }
 
+bool
+tr_sys_file_reserve (tr_sys_file_t    handle,
+                     uint64_t         offset UNUSED,
+                     uint64_t         size,
+                     tr_error      ** error)
+{
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (size > 0);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
+bool
+tr_sys_file_get_extent_count (tr_sys_file_t    handle,
+                              size_t         * extent_count,
+                              tr_error      ** error)
+{
+  assert (handle != TR_BAD_SYS_FILE);
+  assert (extent_count != NULL);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
 void *
 tr_sys_file_map_for_reading (tr_sys_file_t    handle,
                              uint64_t         offset,
@@ -1023,6 +1186,19 @@ tr_sys_file_unmap (const void  * address,
   return ret;
 }
 
+bool
+tr_sys_file_advise_map (const void               * address,
+                        uint64_t                   size,
+                        tr_sys_file_map_advice_t   advice UNUSED,
+                        tr_error                ** error)
+{
+  assert (address != NULL);
+  assert (size > 0);
+
+  set_system_error (error, ERROR_NOT_SUPPORTED);
+  return false;
+}
+
 char *
 tr_sys_dir_get_current (tr_error ** error)
 {
@@ -90,6 +90,14 @@ typedef enum
 }
 tr_sys_file_preallocate_flags_t;
 
+typedef enum
+{
+    TR_SYS_FILE_MAP_SEQUENTIAL,
+    TR_SYS_FILE_MAP_WILLNEED,
+    TR_SYS_FILE_MAP_DONTNEED
+}
+tr_sys_file_map_advice_t;
+
 typedef enum
 {
     TR_SYS_DIR_CREATE_PARENTS = 1 << 0
@@ -112,6 +120,13 @@ typedef struct tr_sys_path_info
 }
 tr_sys_path_info;
 
+typedef struct tr_sys_file_vector
+{
+  const void * buffer;
+  uint64_t     size;
+}
+tr_sys_file_vector;
+
 /**
  * @name Platform-specific wrapper functions
  *
@@ -173,6 +188,23 @@ bool            tr_sys_path_is_same         (const char         * path1,
                                              const char         * path2,
                                              tr_error          ** error);
 
+/**
+ * @brief Test to see if the two filenames reside on the same device.
+ *
+ * @param[in]  path1  Path to first file or directory.
+ * @param[in]  path2  Path to second file or directory.
+ * @param[out] error Pointer to error object. Optional, pass `NULL` if you are
+ *                   not interested in error details.
+ *
+ * @return `True` if two paths reside on the same device (filesystem volume),
+ *         `false` otherwise. Note that `false` will also be returned in case
+ *         of error; if you need to distinguish the two, check if `error` is
+ *         `NULL` afterwards.
+ */
+bool            tr_sys_path_is_same_device  (const char         * path1,
+                                             const char         * path2,
+                                             tr_error          ** error);
+
 /**
  * @brief Portability wrapper for `realpath ()`.
  *
@@ -234,6 +266,22 @@ bool            tr_sys_path_rename          (const char         * src_path,
                                              const char         * dst_path,
                                              tr_error          ** error);
 
+/**
+ * @brief Portability wrapper for `link ()`.
+ *
+ * @param[in]  src_path Path to existing file.
+ * @param[in]  dst_path Path to the new link.
+ * @param[out] error    Pointer to error object. Optional, pass `NULL` if you
+ *                      are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ *         Like rename, this will only succeed if both paths are on the same
+ *         partition, and then only on file systems that support hard links.
+ */
+bool            tr_sys_path_hardlink        (const char         * src_path,
+                                             const char         * dst_path,
+                                             tr_error          ** error);
+
 /**
  * @brief Portability wrapper for `remove ()`.
  *
@@ -426,6 +474,31 @@ bool            tr_sys_file_write_at        (tr_sys_file_t        handle,
                                              uint64_t           * bytes_written,
                                              tr_error          ** error);
 
+/**
+ * @brief Like `pwritev ()`, except that the position is undefined afterwards.
+ *        Not thread-safe.
+ *
+ * Unlike `pwritev ()`, this keeps writing until all the buffers are written
+ * or an error occurs.
+ *
+ * @param[in]  handle        Valid file descriptor.
+ * @param[in]  vectors       Buffers to get data being written from.
+ * @param[in]  count         Number of buffers.
+ * @param[in]  offset        File offset in bytes to start writing from.
+ * @param[out] bytes_written Number of bytes actually written. Optional, pass
+ *                           `NULL` if you are not interested.
+ * @param[out] error         Pointer to error object. Optional, pass `NULL` if you
+ *                           are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_write_vector_at (tr_sys_file_t              handle,
+                                             const tr_sys_file_vector * vectors,
+                                             size_t                     count,
+                                             uint64_t                   offset,
+                                             uint64_t                 * bytes_written,
+                                             tr_error                ** error);
+
 /**
  * @brief Portability wrapper for `fsync ()`.
  *
@@ -468,6 +541,25 @@ bool            tr_sys_file_prefetch        (tr_sys_file_t        handle,
                                              uint64_t             size,
                                              tr_error          ** error);
 
+/**
+ * @brief Tell system that some part of file won't be needed again soon.
+ *
+ * Lets the system drop those pages from its cache. Dirty pages are
+ * written back first, so it's less effective right after a write.
+ *
+ * @param[in]  handle Valid file descriptor.
+ * @param[in]  offset Offset in file to drop from.
+ * @param[in]  size   Number of bytes to drop, or 0 for the rest of the file.
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_drop_cache      (tr_sys_file_t        handle,
+                                             uint64_t             offset,
+                                             uint64_t             size,
+                                             tr_error          ** error);
+
 /**
  * @brief Preallocate file to specified size in full or sparse mode.
  *
@@ -484,6 +576,39 @@ bool            tr_sys_file_preallocate     (tr_sys_file_t        handle,
                                              int                  flags,
                                              tr_error          ** error);
 
+/**
+ * @brief Reserve disk space for part of file without changing its size.
+ *
+ * Unlike @ref tr_sys_file_preallocate, this never falls back to writing
+ * zeroes; it fails if the file system can't reserve space, e.g. on ZFS.
+ *
+ * @param[in]  handle Valid file descriptor.
+ * @param[in]  offset Offset in file to reserve from.
+ * @param[in]  size   Number of bytes to reserve.
+ * @param[out] error  Pointer to error object. Optional, pass `NULL` if you are
+ *                    not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_reserve         (tr_sys_file_t        handle,
+                                             uint64_t             offset,
+                                             uint64_t             size,
+                                             tr_error          ** error);
+
+/**
+ * @brief Get the number of contiguous extents that file's data is stored in.
+ *
+ * @param[in]  handle       Valid file descriptor.
+ * @param[out] extent_count Pointer to extent count to store.
+ * @param[out] error        Pointer to error object. Optional, pass `NULL` if
+ *                          you are not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_get_extent_count (tr_sys_file_t       handle,
+                                              size_t            * extent_count,
+                                              tr_error         ** error);
+
 /**
  * @brief Portability wrapper for `mmap ()` for files.
  *
@@ -515,6 +640,25 @@ bool            tr_sys_file_unmap           (const void         * address,
                                              uint64_t             size,
                                              tr_error          ** error);
 
+/**
+ * @brief Portability wrapper for `madvise ()` on mapped file data.
+ *
+ * The range doesn't need to be page-aligned; it's widened to whole pages.
+ *
+ * @param[in]  address Pointer into data mapped with
+ *                     @ref tr_sys_file_map_for_reading.
+ * @param[in]  size    Number of bytes the advice is for.
+ * @param[in]  advice  One of @ref tr_sys_file_map_advice_t values.
+ * @param[out] error   Pointer to error object. Optional, pass `NULL` if you are
+ *                     not interested in error details.
+ *
+ * @return `True` on success, `false` otherwise (with `error` set accordingly).
+ */
+bool            tr_sys_file_advise_map      (const void               * address,
+                                             uint64_t                   size,
+                                             tr_sys_file_map_advice_t   advice,
+                                             tr_error                ** error);
+
 /* File-related wrappers (utility) */
 
 /**
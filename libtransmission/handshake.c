@@ -19,6 +19,7 @@
 #include "crypto.h"
 #include "handshake.h"
 #include "log.h"
+#include "metrics.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "session.h"
@@ -1098,6 +1099,9 @@ tr_handshakeDone (tr_handshake * handshake, bool isOK)
   dbgmsg (handshake, "handshakeDone: %s", isOK ? "connected" : "aborting");
   tr_peerIoSetIOFuncs (handshake->io, NULL, NULL, NULL, NULL);
 
+  tr_metricsAdd (handshake->session, isOK ? TR_METRIC_HANDSHAKES_SUCCEEDED
+                                         : TR_METRIC_HANDSHAKES_FAILED, 1);
+
   success = fireDoneFunc (handshake, isOK);
 
   tr_handshakeFree (handshake);
@@ -1194,6 +1198,7 @@ tr_handshakeNew (tr_peerIo           * io,
   handshake->doneCB = doneCB;
   handshake->doneUserData = doneUserData;
   handshake->session = session;
+  tr_metricsAdd (session, TR_METRIC_HANDSHAKES_STARTED, 1);
   handshake->timeout_timer = evtimer_new (session->event_base, handshakeTimeout, handshake);
   tr_timerAdd (handshake->timeout_timer, HANDSHAKE_TIMEOUT_SEC, 0);
 
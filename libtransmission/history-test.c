@@ -22,16 +22,47 @@ test1 (void)
     memset (&h, 0, sizeof (tr_recentHistory));
 
     tr_historyAdd (&h, 10000, 1);
-    check_int_eq (0, (int)tr_historyGet (&h, 12000, 1000));
-    check_int_eq (1, (int)tr_historyGet (&h, 12000, 3000));
-    check_int_eq (1, (int)tr_historyGet (&h, 12000, 5000));
+    check_int_eq (1, (int)tr_historyGet (&h, 10005, 60));
+    check_int_eq (0, (int)tr_historyGet (&h, 12000, 60));
+    tr_historyAdd (&h, 10030, 1);
+    tr_historyAdd (&h, 10059, 1);
+    check_int_eq (3, (int)tr_historyGet (&h, 10059, 60));
+    check_int_eq (2, (int)tr_historyGet (&h, 10075, 60));
+    check_int_eq (2, (int)tr_historyGet (&h, 10065, 30));
+    check_int_eq (1, (int)tr_historyGet (&h, 10062, 5));
+
+    /* a long gap forgets everything before it */
     tr_historyAdd (&h, 20000, 1);
-    check_int_eq (0, (int)tr_historyGet (&h, 22000,  1000));
-    check_int_eq (1, (int)tr_historyGet (&h, 22000,  3000));
-    check_int_eq (2, (int)tr_historyGet (&h, 22000, 15000));
-    check_int_eq (2, (int)tr_historyGet (&h, 22000, 20000));
+    tr_historyAdd (&h, 20000, 5);
+    check_int_eq (6, (int)tr_historyGet (&h, 20000, 60));
+    check_int_eq (6, (int)tr_historyGet (&h, 20000, 5000));
+
+    return 0;
+}
+
+static int
+test_rollover (void)
+{
+    int i;
+    tr_recentHistory h;
+
+    memset (&h, 0, sizeof (tr_recentHistory));
+
+    /* the running sum mustn't drift as old buckets are reused */
+    for (i=0; i<1000; ++i)
+      tr_historyAdd (&h, 30000 + i, 1);
+    check_int_eq (TR_RECENT_HISTORY_PERIOD_SEC, (int)tr_historyGet (&h, 30999, 60));
+    check_int_eq (TR_RECENT_HISTORY_PERIOD_SEC, (int)tr_historyGet (&h, 30999, 600));
+    check_int_eq (0, (int)tr_historyGet (&h, 31100, 60));
 
     return 0;
 }
 
-MAIN_SINGLE_TEST (test1)
+int
+main (void)
+{
+  const testFunc tests[] = { test1,
+                             test_rollover };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
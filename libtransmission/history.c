@@ -14,41 +14,52 @@
 #include "history.h"
 #include "utils.h"
 
+#define BUCKET_COUNT TR_RECENT_HISTORY_BUCKET_COUNT
+#define BUCKET_SEC TR_RECENT_HISTORY_BUCKET_SEC
+
 void
 tr_historyAdd (tr_recentHistory * h, time_t now, unsigned int n)
 {
-  if (h->slices[h->newest].date == now)
+  const uint32_t bucket = (uint32_t)(now / BUCKET_SEC);
+
+  /* forget the buckets that have fallen out of the period */
+  if (bucket > h->newest && bucket - h->newest >= BUCKET_COUNT)
     {
-      h->slices[h->newest].n += n;
+      memset (h->buckets, 0, sizeof (h->buckets));
+      h->sum = 0;
+      h->newest = bucket;
     }
   else
     {
-      if (++h->newest == TR_RECENT_HISTORY_PERIOD_SEC)
-        h->newest = 0;
-      h->slices[h->newest].date = now;
-      h->slices[h->newest].n = n;
+      while (h->newest < bucket)
+        {
+          unsigned int * b = &h->buckets[++h->newest % BUCKET_COUNT];
+          h->sum -= *b;
+          *b = 0;
+        }
     }
+
+  /* if the clock went backwards, count it as happening in the newest bucket */
+  h->buckets[h->newest % BUCKET_COUNT] += n;
+  h->sum += n;
 }
 
 unsigned int
 tr_historyGet (const tr_recentHistory * h, time_t now, unsigned int sec)
 {
-  unsigned int n = 0;
+  uint32_t i;
+  unsigned int n = h->sum;
   const time_t cutoff = (now?now:tr_time ()) - sec;
-  int i = h->newest;
 
-  for (;;)
+  /* the sum is kept for the whole period, so subtract any buckets
+     that are too old, starting with the oldest one */
+  i = h->newest >= BUCKET_COUNT ? h->newest - BUCKET_COUNT + 1 : 0;
+  for (; i<=h->newest; ++i)
     {
-      if (h->slices[i].date <= cutoff)
+      if ((time_t)i * BUCKET_SEC + BUCKET_SEC - 1 > cutoff)
         break;
 
-      n += h->slices[i].n;
-
-      if (--i == -1)
-        i = TR_RECENT_HISTORY_PERIOD_SEC - 1; /* circular history */
-
-      if (i == h->newest)
-        break; /* we've come all the way around */
+      n -= h->buckets[i % BUCKET_COUNT];
     }
 
   return n;
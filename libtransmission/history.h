@@ -20,11 +20,19 @@
  *
  * For example, it could count how many are bytes transferred
  * to estimate the speed over the last N seconds.
+ *
+ * Every peer carries several of these, so it's kept small: events are
+ * counted in a handful of coarse buckets, and a count is only as precise
+ * as TR_RECENT_HISTORY_BUCKET_SEC.
  */
 
 enum
 {
-  TR_RECENT_HISTORY_PERIOD_SEC = 60
+  TR_RECENT_HISTORY_PERIOD_SEC = 60,
+
+  TR_RECENT_HISTORY_BUCKET_COUNT = 6,
+
+  TR_RECENT_HISTORY_BUCKET_SEC = TR_RECENT_HISTORY_PERIOD_SEC / TR_RECENT_HISTORY_BUCKET_COUNT
 };
 
 
@@ -33,12 +41,14 @@ typedef struct tr_recentHistory
   /* these are PRIVATE IMPLEMENTATION details included for composition only.
    * Don't access these directly! */
 
-  int newest;
+  /* the newest bucket, counted in TR_RECENT_HISTORY_BUCKET_SEC since the epoch */
+  uint32_t newest;
+
+  /* the sum of all the buckets */
+  unsigned int sum;
 
-  struct {
-    unsigned int n;
-    time_t date;
-  } slices[TR_RECENT_HISTORY_PERIOD_SEC];
+  /* bucket `i' is at buckets[i % TR_RECENT_HISTORY_BUCKET_COUNT] */
+  unsigned int buckets[TR_RECENT_HISTORY_BUCKET_COUNT];
 }
 tr_recentHistory;
 
@@ -53,6 +63,7 @@ void tr_historyAdd (tr_recentHistory *, time_t when, unsigned int n);
  * @brief count how many events have occurred in the last N seconds.
  * @param when the current time in sec, such as from tr_time ()
  * @param seconds how many seconds to count back through.
+ *                Nothing older than TR_RECENT_HISTORY_PERIOD_SEC is counted.
  */
 unsigned int tr_historyGet (const tr_recentHistory *, time_t when, unsigned int seconds);
 
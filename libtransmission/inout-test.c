@@ -0,0 +1,161 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <stdio.h> /* remove () */
+#include <string.h> /* memcmp (), memset () */
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "file.h"
+#include "inout.h"
+#include "torrent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+/* the same files as `tor', but with a different info hash */
+static tr_torrent *
+cross_seed_init (tr_session * session, const tr_torrent * tor, const char * downloadDir)
+{
+  size_t i;
+  size_t len;
+  int err = 0;
+  tr_ctor * ctor;
+  tr_torrent * ret;
+  uint8_t * metainfo = tr_loadFile (tor->info.torrent, &len);
+  static const char key[] = "7:privatei0e";
+
+  for (i=0; i+sizeof(key)-1<=len; ++i)
+    if (!memcmp (metainfo + i, key, sizeof(key)-1))
+      metainfo[i + sizeof(key) - 3] = '1';
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, metainfo, len);
+  tr_ctorSetDownloadDir (ctor, TR_FORCE, downloadDir);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  ret = tr_torrentNew (ctor, &err, NULL);
+
+  tr_ctorFree (ctor);
+  tr_free (metainfo);
+  return ret;
+}
+
+static int
+test_shared_files (void)
+{
+  tr_file_index_t i;
+  uint8_t * buf;
+  uint8_t * zeroes;
+  char * downloadDir;
+  char * filename;
+  tr_torrent * a;
+  tr_torrent * b;
+  tr_session * session = libttest_session_init (NULL);
+
+  a = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (a, true);
+
+  downloadDir = tr_buildPath (tr_sessionGetDownloadDir (session), "cross-seed", NULL);
+  tr_sys_dir_create (downloadDir, TR_SYS_DIR_CREATE_PARENTS, 0700, NULL);
+  b = cross_seed_init (session, a, downloadDir);
+  check (b != NULL);
+  check (memcmp (a->info.hash, b->info.hash, SHA_DIGEST_LENGTH));
+
+  /* b is verified when it's added. a's files are identical to b's,
+     so that links them in as b's own... */
+  libttest_blockingTorrentVerify (b);
+  check_int_eq (0, tr_torrentStat (b)->leftUntilDone);
+  for (i=0; i<b->info.fileCount; ++i)
+    {
+      struct tr_torrent * src = NULL;
+      tr_file_index_t srcIndex = ~0;
+      char * other = tr_ioFindSharedFile (b, i, &src, &srcIndex);
+      check (other != NULL);
+      check (src == a);
+      check_int_eq (i, srcIndex);
+      filename = tr_torrentFindFile (b, i);
+      check (filename != NULL);
+      check (strcmp (filename, other));
+      check (tr_sys_path_is_same (filename, other, NULL));
+      tr_free (filename);
+      tr_free (other);
+    }
+
+  /* ...so removing a's local data leaves b's alone */
+  tr_torrentRemove (a, true, remove);
+  buf = tr_new (uint8_t, b->info.pieceSize);
+  zeroes = tr_new0 (uint8_t, b->info.pieceSize);
+  memset (buf, '*', b->info.pieceSize);
+  check_int_eq (0, tr_ioRead (b, 0, 0, b->info.pieceSize, buf));
+  check (!memcmp (buf, zeroes, b->info.pieceSize));
+  libttest_blockingTorrentVerify (b);
+  check_int_eq (0, tr_torrentStat (b)->leftUntilDone);
+
+  /* cleanup */
+  tr_free (zeroes);
+  tr_free (buf);
+  tr_free (downloadDir);
+  tr_torrentRemove (b, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_resource_counters (void)
+{
+  uint8_t * buf;
+  const tr_stat * st;
+  uint64_t readOps, readBytes, writeOps, writeBytes;
+  tr_torrent * tor;
+  tr_session * session = libttest_session_init (NULL);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+
+  st = tr_torrentStat (tor);
+  readOps = st->diskReadOps;
+  readBytes = st->diskReadBytes;
+  writeOps = st->diskWriteOps;
+  writeBytes = st->diskWriteBytes;
+
+  /* a piece read and written back shows up in the counters */
+  buf = tr_new (uint8_t, tor->info.pieceSize);
+  check_int_eq (0, tr_ioRead (tor, 0, 0, tor->info.pieceSize, buf));
+  check_int_eq (0, tr_ioWrite (tor, 0, 0, tor->info.pieceSize, buf));
+  st = tr_torrentStat (tor);
+  check (st->diskReadOps > readOps);
+  check_int_eq (readBytes + tor->info.pieceSize, st->diskReadBytes);
+  check (st->diskWriteOps > writeOps);
+  check_int_eq (writeBytes + tor->info.pieceSize, st->diskWriteBytes);
+  check (st->fileOpens > 0);
+  check (st->openFiles > 0);
+  check_int_eq (0, st->cacheBytes);
+
+  /* closing the torrent's files doesn't reset what they cost */
+  tr_sessionLock (session);
+  tr_fdTorrentClose (session, tr_torrentId (tor));
+  tr_sessionUnlock (session);
+  st = tr_torrentStat (tor);
+  check_int_eq (0, st->openFiles);
+  check (st->diskReadOps > readOps);
+
+  tr_free (buf);
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_shared_files, test_resource_counters };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
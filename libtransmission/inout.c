@@ -12,28 +12,309 @@
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
 
+#ifndef _WIN32
+ #include <unistd.h> /* dup () */
+#endif
+
+#include <event2/buffer.h>
+
 #include <openssl/sha.h>
 
 #include "transmission.h"
 #include "cache.h" /* tr_cacheReadBlock () */
+#include "crypto.h" /* tr_sha1_init () */
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "inout.h"
 #include "log.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "peer-mgr.h" /* tr_peerMgrRebuildRequests () */
+#include "platform-quota.h" /* tr_device_info_bytes_written () */
 #include "stats.h" /* tr_statsFileCreated () */
 #include "torrent.h"
+#include "trevent.h" /* tr_amInEventThread () */
 #include "utils.h"
 
+#define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
+
+/****
+*****  Files shared with other torrents
+****/
+
+static bool
+filesAreIdentical (tr_torrent * a, tr_file_index_t ai,
+                   tr_torrent * b, tr_file_index_t bi)
+{
+  tr_piece_index_t i, n;
+  const tr_file * fa = &a->info.files[ai];
+  const tr_file * fb = &b->info.files[bi];
+
+  if ((fa->length != fb->length) || (a->info.pieceSize != b->info.pieceSize))
+    return false;
+
+  if ((fa->offset % a->info.pieceSize) != (fb->offset % b->info.pieceSize))
+    return false;
+
+  n = fa->lastPiece - fa->firstPiece + 1;
+  if (fb->lastPiece - fb->firstPiece + 1 != n)
+    return false;
+
+  if (!tr_torrentLoadPieceHashes (a) || !tr_torrentLoadPieceHashes (b))
+    return false;
+
+  /* the pieces at either end can hold parts of other files too,
+     but since they're at the same offsets, equal hashes mean this
+     file's part of them is equal as well */
+  for (i=0; i<n; ++i)
+    if (memcmp (tr_torrentPieceHash (a, fa->firstPiece + i),
+                tr_torrentPieceHash (b, fb->firstPiece + i),
+                SHA_DIGEST_LENGTH))
+      return false;
+
+  return true;
+}
+
+/* a file whose data can be linked by someone else */
+static char *
+findCompleteFile (tr_torrent * tor, tr_file_index_t i)
+{
+  if (!tr_torrentHasMetadata (tor) || !tr_cpFileIsComplete (&tor->completion, i))
+    return NULL;
+
+  return tr_torrentFindFile (tor, i);
+}
+
+/* every nonempty file of every torrent, sorted by the things
+   filesAreIdentical () needs to be equal before it looks at hashes */
+struct shared_candidate
+{
+  uint64_t length;
+  uint32_t pieceSize;
+  uint32_t pieceOffset;
+  int torrentId;
+  tr_file_index_t fileIndex;
+};
+
+struct tr_shared_file_index
+{
+  struct shared_candidate * candidates;
+  size_t candidateCount;
+};
+
+static int
+compareCandidates (const void * va, const void * vb)
+{
+  const struct shared_candidate * a = va;
+  const struct shared_candidate * b = vb;
+
+  if (a->length != b->length)
+    return a->length < b->length ? -1 : 1;
+  if (a->pieceSize != b->pieceSize)
+    return a->pieceSize < b->pieceSize ? -1 : 1;
+  if (a->pieceOffset != b->pieceOffset)
+    return a->pieceOffset < b->pieceOffset ? -1 : 1;
+  return 0;
+}
+
+static void
+setCandidateKey (struct shared_candidate * c, const tr_torrent * tor, tr_file_index_t i)
+{
+  const tr_file * file = &tor->info.files[i];
+
+  c->length = file->length;
+  c->pieceSize = tor->info.pieceSize;
+  c->pieceOffset = file->offset % tor->info.pieceSize;
+  c->torrentId = tor->uniqueId;
+  c->fileIndex = i;
+}
+
+static struct tr_shared_file_index *
+getSharedFileIndex (tr_session * session)
+{
+  size_t n;
+  tr_file_index_t i;
+  tr_torrent * tor = NULL;
+  struct tr_shared_file_index * index = session->sharedFileIndex;
+
+  if (index != NULL)
+    return index;
+
+  n = 0;
+  while ((tor = tr_torrentNext (session, tor)) != NULL)
+    if (tr_torrentHasMetadata (tor))
+      n += tor->info.fileCount;
+
+  index = tr_new0 (struct tr_shared_file_index, 1);
+  index->candidates = tr_new (struct shared_candidate, n);
+
+  while ((tor = tr_torrentNext (session, tor)) != NULL)
+    if (tr_torrentHasMetadata (tor))
+      for (i=0; i<tor->info.fileCount; ++i)
+        if (tor->info.files[i].length > 0)
+          setCandidateKey (&index->candidates[index->candidateCount++], tor, i);
+
+  qsort (index->candidates, index->candidateCount,
+         sizeof (struct shared_candidate), compareCandidates);
+
+  session->sharedFileIndex = index;
+  return index;
+}
+
+void
+tr_ioFreeSharedFileIndex (tr_session * session)
+{
+  struct tr_shared_file_index * index = session->sharedFileIndex;
+
+  if (index != NULL)
+    {
+      tr_free (index->candidates);
+      tr_free (index);
+      session->sharedFileIndex = NULL;
+    }
+}
+
+char *
+tr_ioFindSharedFile (tr_torrent       * tor,
+                     tr_file_index_t    fileIndex,
+                     tr_torrent      ** setme_tor,
+                     tr_file_index_t  * setme_file)
+{
+  size_t i;
+  bool exact;
+  char * filename = NULL;
+  tr_torrent * src = NULL;
+  struct tr_shared_file * shared;
+  struct shared_candidate key;
+  const struct tr_shared_file_index * index;
+
+  assert (tr_isTorrent (tor));
+  assert (fileIndex < tor->info.fileCount);
+
+  if (tor->info.files[fileIndex].length == 0)
+    return NULL;
+
+  /* first, see if what we found last time is still good */
+  shared = &tor->sharedFiles[fileIndex];
+  if ((shared->torrentId != 0)
+      && ((src = tr_torrentFindFromId (tor->session, shared->torrentId)) != NULL)
+      && (shared->fileIndex < src->info.fileCount)
+      && (src->info.files[shared->fileIndex].length == tor->info.files[fileIndex].length))
+    filename = findCompleteFile (src, shared->fileIndex);
+
+  /* if not, only compare hashes with the files that could match */
+  index = getSharedFileIndex (tor->session);
+  setCandidateKey (&key, tor, fileIndex);
+  i = tr_lowerBound (&key, index->candidates, index->candidateCount,
+                     sizeof (struct shared_candidate), compareCandidates, &exact);
+
+  for (; (filename == NULL) && (i<index->candidateCount); ++i)
+    {
+      const struct shared_candidate * c = &index->candidates[i];
+
+      if (compareCandidates (&key, c))
+        break;
+
+      if ((c->torrentId == tor->uniqueId)
+          || ((src = tr_torrentFindFromId (tor->session, c->torrentId)) == NULL)
+          || !tr_cpFileIsComplete (&src->completion, c->fileIndex))
+        continue;
+
+      if (filesAreIdentical (tor, fileIndex, src, c->fileIndex)
+          && ((filename = findCompleteFile (src, c->fileIndex)) != NULL))
+        {
+          shared->torrentId = c->torrentId;
+          shared->fileIndex = c->fileIndex;
+        }
+
+      /* nobody needs the piece hashes of a stopped torrent */
+      if (!src->isRunning && (src->verifyState == TR_VERIFY_NONE))
+        tr_torrentUnloadPieceHashes (src);
+    }
+
+  if (filename == NULL)
+    {
+      shared->torrentId = 0;
+    }
+  else
+    {
+      if (setme_tor != NULL)
+        *setme_tor = src;
+      if (setme_file != NULL)
+        *setme_file = shared->fileIndex;
+    }
+
+  return filename;
+}
+
+bool
+tr_ioLinkSharedFile (tr_torrent * tor, tr_file_index_t fileIndex)
+{
+  bool linked = false;
+  char * shared;
+
+  if (tr_torrentFindFile2 (tor, fileIndex, NULL, NULL, NULL))
+    return false;
+
+  if ((shared = tr_ioFindSharedFile (tor, fileIndex, NULL, NULL)) != NULL)
+    {
+      tr_error * error = NULL;
+      char * filename = tr_buildPath (tr_torrentGetCurrentDir (tor),
+                                      tor->info.files[fileIndex].name, NULL);
+      char * dir = tr_sys_path_dirname (filename, NULL);
+
+      if ((dir != NULL)
+          && tr_sys_dir_create (dir, TR_SYS_DIR_CREATE_PARENTS, 0777, &error)
+          && tr_sys_path_hardlink (shared, filename, &error))
+        {
+          tr_logAddTorDbg (tor, "Linked \"%s\" to \"%s\"", filename, shared);
+          linked = true;
+        }
+      else if (error != NULL)
+        {
+          /* e.g. another partition; we'll download our own copy */
+          tr_logAddTorDbg (tor, "Couldn't link \"%s\" to \"%s\": %s",
+                           filename, shared, error->message);
+          tr_error_free (error);
+        }
+
+      tr_free (dir);
+      tr_free (filename);
+      tr_free (shared);
+    }
+
+  return linked;
+}
+
 /****
 *****  Low-level IO functions
 ****/
 
+enum
+{
+  /* each block that's queued to be sent from its file holds a descriptor
+     until it's been sent. past this, blocks are copied into the peers'
+     outbufs instead, so that busy uploads don't use up the process' fds */
+  MAX_SENDFILE_SEGMENTS = 256
+};
+
+#if !defined (_WIN32) && defined (EVBUF_FS_CLOSE_ON_FREE)
+static void
+onSendFileSegmentFreed (struct evbuffer_file_segment const * seg UNUSED,
+                        int                                  flags UNUSED,
+                        void                               * vsession)
+{
+  tr_session * session = vsession;
+
+  --session->sendFileSegments;
+}
+#endif
+
 enum
 {
   TR_IO_READ,
   TR_IO_PREFETCH,
+  TR_IO_ADD_FILE,
   /* Any operations that require write access must follow TR_IO_WRITE. */
   TR_IO_WRITE
 };
@@ -102,10 +383,13 @@ readOrWriteBytes (tr_session       * session,
               tr_logAddTorErr (tor, "tr_fdFileCheckout failed for \"%s\": %s",
                          filename, tr_strerror (err));
             }
-          else if (doWrite)
+          else
             {
+              ++tor->fileOpens;
+
               /* make a note that we just created a file */
-              tr_statsFileCreated (tor->session);
+              if (doWrite)
+                tr_statsFileCreated (tor->session);
             }
 
           tr_free (filename);
@@ -122,6 +406,8 @@ readOrWriteBytes (tr_session       * session,
     {
       tr_error * error = NULL;
 
+      if (doWrite && (tor->session->preallocationMode == TR_PREALLOCATE_INCREMENTAL))
+        tr_fdFileReserve (session, tr_torrentId (tor), fileIndex, fileOffset, buflen);
       if (ioMode == TR_IO_READ)
         {
           if (!tr_sys_file_read_at (fd, buf, buflen, fileOffset, NULL, &error))
@@ -144,10 +430,67 @@ readOrWriteBytes (tr_session       * session,
         {
           tr_sys_file_prefetch (fd, fileOffset, buflen, NULL);
         }
+      else if (ioMode == TR_IO_ADD_FILE)
+        {
+#if !defined (_WIN32) && defined (EVBUF_FS_CLOSE_ON_FREE)
+          /* the segment closes its descriptor when the evbuffer's done
+             with it, so give it a duplicate of the cached one. The cleanup
+             callback lets us count how many of those are still around */
+          int dupfd;
+          struct evbuffer_file_segment * seg;
+
+          if (session->sendFileSegments >= MAX_SENDFILE_SEGMENTS)
+            {
+              err = EAGAIN;
+            }
+          else if ((dupfd = dup (fd)) == -1)
+            {
+              err = errno;
+            }
+          else if ((seg = evbuffer_file_segment_new (dupfd, fileOffset, buflen, EVBUF_FS_CLOSE_ON_FREE)) == NULL)
+            {
+              close (dupfd);
+              err = EIO;
+            }
+          else
+            {
+              ++session->sendFileSegments;
+              evbuffer_file_segment_add_cleanup_cb (seg, onSendFileSegmentFreed, session);
+              if (evbuffer_add_file_segment (buf, seg, 0, buflen) == -1)
+                err = EIO;
+
+              /* drop our reference; the buffer keeps its own */
+              evbuffer_file_segment_free (seg);
+            }
+#else
+          /* without segments' cleanup callbacks,
+             there's no telling how many descriptors are in use */
+          err = ENOTSUP;
+#endif
+        }
       else
         {
           abort ();
         }
+
+      if (!err && (ioMode == TR_IO_READ || ioMode == TR_IO_ADD_FILE))
+        {
+          ++tor->diskReadOps;
+          tor->diskReadBytes += buflen;
+        }
+      else if (!err && ioMode != TR_IO_PREFETCH)
+        {
+          ++tor->diskWriteOps;
+          tor->diskWriteBytes += buflen;
+        }
+
+      /* bypass the page cache by dropping what we've just used.
+         O_DIRECT isn't an option because the files' offsets in the
+         torrent are rarely aligned to the device's block size.
+         for writes, this just starts the writeback; the pages are
+         dropped for good when the file's closed */
+      if (!err && session->isPageCacheBypassEnabled && ioMode != TR_IO_PREFETCH)
+        tr_sys_file_drop_cache (fd, fileOffset, buflen, NULL);
     }
 
   return err;
@@ -220,7 +563,9 @@ readOrWritePiece (tr_torrent       * tor,
       const tr_file * file = &info->files[fileIndex];
       const uint64_t bytesThisPass = MIN (buflen, file->length - fileOffset);
 
+      tr_fdLock (tor->session);
       err = readOrWriteBytes (tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass);
+      tr_fdUnlock (tor->session);
       buf += bytesThisPass;
       buflen -= bytesThisPass;
       fileIndex++;
@@ -256,6 +601,57 @@ tr_ioPrefetch (tr_torrent       * tor,
   return readOrWritePiece (tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len);
 }
 
+int
+tr_ioAddToBuffer (tr_torrent       * tor,
+                  tr_piece_index_t   pieceIndex,
+                  uint32_t           begin,
+                  uint32_t           len,
+                  struct evbuffer  * buf)
+{
+  int err = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  struct evbuffer * tmp;
+  const tr_info * info = &tor->info;
+
+  if (pieceIndex >= tor->info.pieceCount)
+    return EINVAL;
+
+  /* sendfile () reads the pages after we've returned,
+     so there'd be no way to drop them afterwards */
+  if (tor->session->isPageCacheBypassEnabled)
+    return EAGAIN;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  /* build the segments in a scratch buffer so that
+     buf is left untouched if any of them fail */
+  tmp = evbuffer_new ();
+#ifdef EVBUFFER_FLAG_DRAINS_TO_FD
+  /* let libevent sendfile () the segments instead of mapping them */
+  evbuffer_set_flags (tmp, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
+  while (len && !err)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      tr_fdLock (tor->session);
+      err = readOrWriteBytes (tor->session, tor, TR_IO_ADD_FILE, fileIndex, fileOffset, tmp, bytesThisPass);
+      tr_fdUnlock (tor->session);
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  if (!err)
+    evbuffer_add_buffer (buf, tmp);
+
+  evbuffer_free (tmp);
+  return err;
+}
+
 int
 tr_ioWrite (tr_torrent       * tor,
             tr_piece_index_t   pieceIndex,
@@ -263,13 +659,376 @@ tr_ioWrite (tr_torrent       * tor,
             uint32_t           len,
             const uint8_t    * buf)
 {
+  tr_device_info_bytes_written (len);
+
   return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
 }
 
+/****
+*****  Writes planned in the libtransmission thread, done in another one
+****/
+
+struct tr_io_write_plan *
+tr_ioWritePlanNew (tr_torrent       * tor,
+                   tr_piece_index_t   pieceIndex,
+                   uint32_t           begin,
+                   uint32_t           len)
+{
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+  struct tr_io_write_plan * plan;
+  const tr_info * info = &tor->info;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+  assert (pieceIndex < info->pieceCount);
+
+  plan = tr_new0 (struct tr_io_write_plan, 1);
+  plan->session = tor->session;
+  plan->torrentId = tr_torrentId (tor);
+  plan->begin = tr_pieceOffset (tor, pieceIndex, begin, 0);
+  plan->length = len;
+  plan->reserve = tor->session->preallocationMode == TR_PREALLOCATE_INCREMENTAL;
+  plan->dropCache = tor->session->isPageCacheBypassEnabled;
+  plan->files = tr_new0 (struct tr_io_write_file, info->fileCount);
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len)
+    {
+      const tr_file * file = &info->files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (bytesThisPass > 0)
+        {
+          char * subpath = NULL;
+          const char * base;
+          struct tr_io_write_file * f = &plan->files[plan->fileCount++];
+
+          /* write to the file where it is now, or create it where it should be */
+          if (!tr_torrentFindFile2 (tor, fileIndex, &base, &subpath, NULL))
+            {
+              base = tr_torrentGetCurrentDir (tor);
+              subpath = tr_sessionIsIncompleteFileNamingEnabled (tor->session)
+                      ? tr_torrentBuildPartial (tor, fileIndex)
+                      : tr_strdup (file->name);
+            }
+
+          f->index = fileIndex;
+          f->offset = fileOffset;
+          f->length = bytesThisPass;
+          f->size = file->length;
+          f->prealloc = file->dnd ? TR_PREALLOCATE_NONE : tor->session->preallocationMode;
+          f->filename = tr_buildPath (base, subpath, NULL);
+          tr_free (subpath);
+        }
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return plan;
+}
+
+void
+tr_ioWritePlanAppend (struct tr_io_write_plan       * plan,
+                      const struct tr_io_write_plan * next)
+{
+  int i = 0;
+
+  assert (plan->torrentId == next->torrentId);
+  assert (plan->begin + plan->length == next->begin);
+
+  plan->files = tr_renew (struct tr_io_write_file, plan->files, plan->fileCount + next->fileCount);
+
+  /* the first file usually continues where the plan's last one left off */
+  if ((plan->fileCount > 0) && (next->fileCount > 0)
+                            && (plan->files[plan->fileCount - 1].index == next->files[0].index))
+    plan->files[plan->fileCount - 1].length += next->files[i++].length;
+
+  for (; i<next->fileCount; ++i)
+    {
+      struct tr_io_write_file * f = &plan->files[plan->fileCount++];
+      *f = next->files[i];
+      f->filename = tr_strdup (f->filename);
+    }
+
+  plan->length += next->length;
+}
+
+void
+tr_ioWritePlanFree (struct tr_io_write_plan * plan)
+{
+  int i;
+
+  if (plan == NULL)
+    return;
+
+  for (i=0; i<plan->fileCount; ++i)
+    tr_free (plan->files[i].filename);
+  tr_free (plan->files);
+  tr_free (plan);
+}
+
+/* returns 0 on success, or an errno on failure. the caller holds tr_fdLock () */
+static int
+writeFileVectors (struct tr_io_write_plan       * plan,
+                  const struct tr_io_write_file * f,
+                  const tr_sys_file_vector      * vectors,
+                  size_t                          count)
+{
+  tr_sys_file_t fd;
+  tr_error * error = NULL;
+  int err = 0;
+
+  fd = tr_fdFileGetCached (plan->session, plan->torrentId, f->index, true);
+  if (fd == TR_BAD_SYS_FILE)
+    {
+      fd = tr_fdFileCheckout (plan->session, plan->torrentId, f->index,
+                              f->filename, true, f->prealloc, f->size);
+      if (fd == TR_BAD_SYS_FILE)
+        return errno;
+
+      ++plan->fileOpens;
+    }
+
+  if (plan->reserve)
+    tr_fdFileReserve (plan->session, plan->torrentId, f->index, f->offset, f->length);
+
+  if (!tr_sys_file_write_vector_at (fd, vectors, count, f->offset, NULL, &error))
+    {
+      err = error->code;
+      tr_error_free (error);
+    }
+  else if (plan->dropCache)
+    {
+      /* see readOrWriteBytes () */
+      tr_sys_file_drop_cache (fd, f->offset, f->length, NULL);
+    }
+
+  return err;
+}
+
+int
+tr_ioWritePlanned (struct tr_io_write_plan * plan,
+                   struct evbuffer         * buf)
+{
+  int i;
+  int err = 0;
+  struct evbuffer_ptr pos;
+
+  assert (evbuffer_get_length (buf) >= plan->length);
+
+  tr_device_info_bytes_written (plan->length);
+
+  evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
+
+  for (i=0; !err && i<plan->fileCount; ++i)
+    {
+      int j, n;
+      uint64_t left;
+      struct evbuffer_iovec * iov;
+      tr_sys_file_vector * vectors;
+      const struct tr_io_write_file * f = &plan->files[i];
+
+      /* point the vectors at the evbuffer's chunks for this file */
+      n = evbuffer_peek (buf, f->length, &pos, NULL, 0);
+      iov = tr_new (struct evbuffer_iovec, n);
+      vectors = tr_new (tr_sys_file_vector, n);
+      n = evbuffer_peek (buf, f->length, &pos, iov, n);
+      for (j=0, left=f->length; j<n; ++j)
+        {
+          vectors[j].buffer = iov[j].iov_base;
+          vectors[j].size = MIN (left, iov[j].iov_len);
+          left -= vectors[j].size;
+        }
+
+      tr_fdLock (plan->session);
+      err = writeFileVectors (plan, f, vectors, n);
+      tr_fdUnlock (plan->session);
+      tr_free (vectors);
+      tr_free (iov);
+
+      if (err)
+        plan->errFilename = f->filename;
+      else if (i + 1 < plan->fileCount)
+        evbuffer_ptr_set (buf, &pos, f->length, EVBUFFER_PTR_ADD);
+    }
+
+  plan->err = err;
+  return err;
+}
+
+void
+tr_ioWritePlanFinish (void * vplan)
+{
+  int i;
+  struct tr_io_write_plan * plan = vplan;
+  tr_torrent * tor = tr_torrentFindFromId (plan->session, plan->torrentId);
+
+  assert (tr_amInEventThread (plan->session));
+
+  if (tor != NULL)
+    {
+      tor->fileOpens += plan->fileOpens;
+      for (i=0; i<plan->fileOpens; ++i)
+        tr_statsFileCreated (tor->session);
+
+      if (!plan->err)
+        {
+          ++tor->diskWriteOps;
+          tor->diskWriteBytes += plan->length;
+        }
+      else
+        {
+          tr_piece_index_t piece;
+          const tr_piece_index_t first = plan->begin / tor->info.pieceSize;
+          const tr_piece_index_t last = (plan->begin + plan->length - 1) / tor->info.pieceSize;
+
+          tr_logAddTorErr (tor, "write failed for \"%s\": %s", plan->errFilename, tr_strerror (plan->err));
+
+          /* the blocks were counted as ours when they went into the cache */
+          for (piece=first; piece<=last; ++piece)
+            tr_torrentSetHasPiece (tor, piece, false);
+          tr_torrentSetDirty (tor);
+          tr_torrentRecheckCompleteness (tor);
+          tr_peerMgrRebuildRequests (tor);
+
+          if (tor->error != TR_STAT_LOCAL_ERROR)
+            tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (plan->err), plan->errFilename);
+        }
+    }
+
+  tr_ioWritePlanFree (plan);
+}
+
 /****
 *****
 ****/
 
+/***
+****  Pieces are hashed as their blocks are written, so that checking a
+****  just-downloaded piece doesn't mean reading the whole thing back.
+***/
+
+enum
+{
+  /* beyond this, a torrent's pieces are read back to be hashed as before */
+  MAX_HASHERS_PER_TORRENT = 64
+};
+
+struct tr_piece_hasher
+{
+  struct tr_piece_hasher * next;
+  tr_piece_index_t piece;
+  uint32_t offset; /* how much of the piece's beginning has been hashed */
+  tr_sha1_ctx_t sha;
+};
+
+/* remove the piece's hasher from the torrent's list and return it */
+static struct tr_piece_hasher *
+takeHasher (tr_torrent * tor, tr_piece_index_t piece)
+{
+  struct tr_piece_hasher ** walk;
+
+  for (walk=&tor->pieceHashers; *walk!=NULL; walk=&(*walk)->next)
+    {
+      struct tr_piece_hasher * h = *walk;
+
+      if (h->piece == piece)
+        {
+          *walk = h->next;
+          h->next = NULL;
+          --tor->pieceHasherCount;
+          return h;
+        }
+    }
+
+  return NULL;
+}
+
+static void
+freeHasher (struct tr_piece_hasher * h)
+{
+  tr_sha1_final (h->sha, NULL);
+  tr_free (h);
+}
+
+void
+tr_ioFreeHashers (tr_torrent * tor)
+{
+  while (tor->pieceHashers != NULL)
+    freeHasher (takeHasher (tor, tor->pieceHashers->piece));
+}
+
+void
+tr_ioHashBlock (tr_torrent       * tor,
+                tr_piece_index_t   pieceIndex,
+                uint32_t           begin,
+                uint32_t           len,
+                struct evbuffer  * buf)
+{
+  int i, n;
+  size_t left;
+  struct evbuffer_iovec iovec[8];
+  struct tr_piece_hasher * h = takeHasher (tor, pieceIndex);
+
+  assert (evbuffer_get_length (buf) >= len);
+
+  if (h == NULL)
+    {
+      if (begin != 0 || tor->pieceHasherCount >= MAX_HASHERS_PER_TORRENT)
+        return;
+
+      h = tr_new0 (struct tr_piece_hasher, 1);
+      h->piece = pieceIndex;
+
+      if ((h->sha = tr_sha1_init ()) == NULL)
+        {
+          tr_free (h);
+          return;
+        }
+    }
+  else if (begin < h->offset)
+    {
+      /* part of what's been hashed is being written over */
+      freeHasher (h);
+      return;
+    }
+
+  if (begin == h->offset)
+    {
+      n = evbuffer_peek (buf, len, NULL, iovec, TR_N_ELEMENTS (iovec));
+      if (n > (int) TR_N_ELEMENTS (iovec))
+        {
+          iovec[0].iov_base = evbuffer_pullup (buf, len);
+          iovec[0].iov_len = len;
+          n = 1;
+        }
+
+      for (i=0, left=len; i<n && left>0; ++i)
+        {
+          const size_t chunk = MIN (left, iovec[i].iov_len);
+
+          if (!tr_sha1_update (h->sha, iovec[i].iov_base, chunk))
+            {
+              freeHasher (h);
+              return;
+            }
+
+          left -= chunk;
+        }
+
+      h->offset += len;
+    }
+
+  /* otherwise it's out of order; keep what's been hashed so far */
+  h->next = tor->pieceHashers;
+  tor->pieceHashers = h;
+  ++tor->pieceHasherCount;
+}
+
 static bool
 recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
 {
@@ -277,18 +1036,40 @@ recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
   uint32_t offset = 0;
   bool  success = true;
   const size_t buflen = tor->blockSize;
-  void * buffer = tr_valloc (buflen);
-  SHA_CTX  sha;
+  void * buffer;
+  tr_sha1_ctx_t sha;
+  struct tr_piece_hasher * h;
 
   assert (tor != NULL);
   assert (pieceIndex < tor->info.pieceCount);
-  assert (buffer != NULL);
   assert (buflen > 0);
   assert (setme != NULL);
 
-  SHA1_Init (&sha);
   bytesLeft = tr_torPieceCountBytes (tor, pieceIndex);
 
+  /* pick up where the blocks' running hash left off, if there is one */
+  if ((h = takeHasher (tor, pieceIndex)) != NULL && h->offset <= bytesLeft)
+    {
+      sha = h->sha;
+      offset = h->offset;
+      bytesLeft -= offset;
+      tr_free (h);
+    }
+  else
+    {
+      if (h != NULL)
+        freeHasher (h);
+
+      if ((sha = tr_sha1_init ()) == NULL)
+        return false;
+    }
+
+  if (bytesLeft == 0)
+    return tr_sha1_final (sha, setme);
+
+  buffer = tr_valloc (buflen);
+  assert (buffer != NULL);
+
   tr_ioPrefetch (tor, pieceIndex, offset, bytesLeft);
 
   while (bytesLeft)
@@ -297,13 +1078,14 @@ recalculateHash (tr_torrent * tor, tr_piece_index_t pieceIndex, uint8_t * setme)
       success = !tr_cacheReadBlock (tor->session->cache, tor, pieceIndex, offset, len, buffer);
       if (!success)
         break;
-      SHA1_Update (&sha, buffer, len);
+      success = tr_sha1_update (sha, buffer, len);
+      if (!success)
+        break;
       offset += len;
       bytesLeft -= len;
     }
 
-  if (success)
-    SHA1_Final (setme, &sha);
+  success = tr_sha1_final (sha, success ? setme : NULL) && success;
 
   tr_free (buffer);
   return success;
@@ -314,6 +1096,7 @@ tr_ioTestPiece (tr_torrent * tor, tr_piece_index_t piece)
 {
   uint8_t hash[SHA_DIGEST_LENGTH];
 
-  return recalculateHash (tor, piece, hash)
-      && !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
+  return tr_torrentLoadPieceHashes (tor)
+      && recalculateHash (tor, piece, hash)
+      && !memcmp (hash, tr_torrentPieceHash (tor, piece), SHA_DIGEST_LENGTH);
 }
@@ -14,6 +14,7 @@
 #ifndef TR_IO_H
 #define TR_IO_H 1
 
+struct evbuffer;
 struct tr_torrent;
 
 /**
@@ -36,6 +37,20 @@ int tr_ioPrefetch (tr_torrent       * tor,
                    uint32_t           begin,
                    uint32_t           len);
 
+/**
+ * Appends the block specified by the piece index, offset, and length
+ * to an evbuffer as file segments, so it can be sent without copying
+ * it through userspace. On failure, buf is left unchanged.
+ * @return 0 on success, or an errno value on failure. This is always
+ *         EAGAIN if tr_sessionIsPageCacheBypassEnabled (), or if too many
+ *         blocks are already waiting to be sent from their files.
+ */
+int tr_ioAddToBuffer (struct tr_torrent  * tor,
+                      tr_piece_index_t     pieceIndex,
+                      uint32_t             begin,
+                      uint32_t             len,
+                      struct evbuffer    * buf);
+
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -46,6 +61,88 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+/* one file's share of a tr_io_write_plan */
+struct tr_io_write_file
+{
+  tr_file_index_t index;
+  uint64_t offset; /* where in the file the write starts */
+  uint64_t length; /* how much of the write goes in this file */
+  uint64_t size; /* the file's full size, for preallocating it */
+  tr_preallocation_mode prealloc;
+  char * filename;
+};
+
+/**
+ * A write that's been worked out in the libtransmission thread, so that
+ * tr_ioWritePlanned () can do it in another thread without looking at the
+ * torrent: its files can be renamed, moved, or found elsewhere meanwhile.
+ */
+struct tr_io_write_plan
+{
+  tr_session * session;
+  int torrentId;
+  uint64_t begin; /* byte offset of the write in the torrent */
+  uint64_t length;
+  bool reserve; /* TR_PREALLOCATE_INCREMENTAL */
+  bool dropCache; /* tr_sessionIsPageCacheBypassEnabled () */
+
+  int fileCount;
+  struct tr_io_write_file * files;
+
+  /* filled in by tr_ioWritePlanned (), for tr_ioWritePlanFinish () */
+  int err;
+  const char * errFilename;
+  int fileOpens;
+};
+
+/**
+ * Work out where the block specified by the piece index, offset,
+ * and length goes. This has to be called in the libtransmission thread.
+ */
+struct tr_io_write_plan * tr_ioWritePlanNew (struct tr_torrent  * tor,
+                                             tr_piece_index_t     pieceIndex,
+                                             uint32_t             begin,
+                                             uint32_t             len);
+
+/** @brief Add a write that picks up right where plan leaves off */
+void tr_ioWritePlanAppend (struct tr_io_write_plan       * plan,
+                           const struct tr_io_write_plan * next);
+
+void tr_ioWritePlanFree (struct tr_io_write_plan * plan);
+
+/**
+ * Write the plan's data from the front of an evbuffer, with one vectored
+ * write per file. This can be called from any thread.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWritePlanned (struct tr_io_write_plan * plan,
+                       struct evbuffer         * buf);
+
+/**
+ * Pass a tr_ioWritePlanned () plan's results on to its torrent, if it's
+ * still around, and free the plan. If the write failed, the torrent gets
+ * a local error and the pieces it touched are marked as missing, so that
+ * they're downloaded again instead of being claimed without being on disk.
+ * This has to be called in the libtransmission thread.
+ */
+void tr_ioWritePlanFinish (void * plan);
+
+/**
+ * Feed a block that's about to be written to the piece's running SHA1,
+ * so that tr_ioTestPiece () needn't read it back. Blocks have to come in
+ * order, starting at the piece's beginning; later blocks that don't
+ * continue the run are read back when the piece is tested instead.
+ * @param buf holds the block at its front, and is left unchanged
+ */
+void tr_ioHashBlock (tr_torrent       * tor,
+                     tr_piece_index_t   pieceIndex,
+                     uint32_t           begin,
+                     uint32_t           len,
+                     struct evbuffer  * buf);
+
+/** @brief Forget the running hashes of all the torrent's pieces */
+void tr_ioFreeHashers (tr_torrent * tor);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -53,6 +150,45 @@ bool tr_ioTestPiece (tr_torrent       * tor,
                      tr_piece_index_t   piece);
 
 
+/* what tr_ioFindSharedFile () last found for a file */
+struct tr_shared_file
+{
+  int torrentId; /* 0 if nothing was found */
+  tr_file_index_t fileIndex;
+};
+
+/**
+ * Look for a complete file in another torrent that's identical to
+ * this torrent's file `fileIndex'.
+ *
+ * Files are identical if they're the same size, fall at the same place
+ * in pieces of the same size, and every piece they touch has the same
+ * hash in both torrents. That's usually the case when the same payload
+ * is cross-seeded under several trackers. Only files that match on the
+ * first three are compared, using an index of the session's files that's
+ * built on first use and dropped by tr_ioFreeSharedFileIndex ().
+ *
+ * @return the other file's filename, or NULL if there isn't one
+ */
+char * tr_ioFindSharedFile (struct tr_torrent   * tor,
+                            tr_file_index_t       fileIndex,
+                            struct tr_torrent  ** setme_tor,
+                            tr_file_index_t     * setme_file);
+
+/**
+ * If this torrent doesn't have file `fileIndex' but another torrent has
+ * an identical one, hard link it into this torrent's current directory.
+ * The file system keeps the data for as long as either torrent has it,
+ * so removing or moving one torrent's files leaves the other's alone.
+ *
+ * @return true if the file was linked
+ */
+bool tr_ioLinkSharedFile (struct tr_torrent * tor,
+                          tr_file_index_t     fileIndex);
+
+/** @brief Forget the index of files; call when torrents come or go */
+void tr_ioFreeSharedFileIndex (tr_session * session);
+
 /**
  * Converts a piece index + offset into a file index + offset.
  */
@@ -229,6 +229,59 @@ test_unescape (void)
     return 0;
 }
 
+static int
+check_json_value (const tr_variant * v, const char * expected)
+{
+    int len;
+    char * json = tr_variantToStr (v, TR_VARIANT_FMT_JSON_LEAN, &len);
+    char * line = tr_strdup_printf ("%s\n", expected);
+
+    check_streq (line, json);
+    check_int_eq (strlen (line), len);
+    tr_free (line);
+    tr_free (json);
+    return 0;
+}
+
+static int
+test_serialize (void)
+{
+    tr_variant v;
+
+    /* escapes at the start, the end, and across the fast path's words */
+    tr_variantInitStr (&v, "", 0);
+    check (!check_json_value (&v, "\"\""));
+    tr_variantFree (&v);
+    tr_variantInitStr (&v, "\"/usr/lib/transmission\tfoo\\bar.txt\n", -1);
+    check (!check_json_value (&v, "\"\\\"/usr/lib/transmission\\tfoo\\\\bar.txt\\n\""));
+    tr_variantFree (&v);
+    tr_variantInitStr (&v, "abcdefghLet\xc3\xb6lt\xc3\xa9sek12345678", -1);
+    check (!check_json_value (&v, "\"abcdefghLet\\u00f6lt\\u00e9sek12345678\""));
+    tr_variantFree (&v);
+
+    tr_variantInitInt (&v, 0);
+    check (!check_json_value (&v, "0"));
+    tr_variantInitInt (&v, -1234567890123LL);
+    check (!check_json_value (&v, "-1234567890123"));
+    tr_variantInitInt (&v, INT64_MAX);
+    check (!check_json_value (&v, "9223372036854775807"));
+    tr_variantInitInt (&v, INT64_MIN);
+    check (!check_json_value (&v, "-9223372036854775808"));
+
+    tr_variantInitReal (&v, 3.0);
+    check (!check_json_value (&v, "3"));
+    tr_variantInitReal (&v, 0.29);
+    check (!check_json_value (&v, "0.2900"));
+    tr_variantInitReal (&v, 1.23456789);
+    check (!check_json_value (&v, "1.2345"));
+    tr_variantInitReal (&v, -0.05);
+    check (!check_json_value (&v, "-0.0500"));
+    tr_variantInitReal (&v, 833.76);
+    check (!check_json_value (&v, "833.7600"));
+
+    return 0;
+}
+
 int
 main (void)
 {
@@ -245,7 +298,8 @@ main (void)
                              test1,
                              test2,
                              test3,
-                             test_unescape };
+                             test_unescape,
+                             test_serialize };
 
   /* run the tests in a locale with a decimal point of '.' */
   setlocale (LC_NUMERIC, "C");
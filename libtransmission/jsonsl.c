@@ -293,6 +293,16 @@ jsonsl_feed(jsonsl_t jsn, const jsonsl_char_t *bytes, size_t nbytes)
 #endif /* JSONSL_USE_WCHAR */
                     (!chrt_string_nopass[CUR_CHAR & 0xff])) {
                 INCR_METRIC(STRINGY_INSIGNIFICANT);
+#ifndef JSONSL_USE_WCHAR
+                /* swallow the rest of the run of ordinary string
+                 * characters here instead of going back through the
+                 * whole state dispatch once per byte */
+                while (nbytes > 1 && !chrt_string_nopass[c[1]]) {
+                    nbytes--;
+                    jsn->pos++;
+                    c++;
+                }
+#endif /* JSONSL_USE_WCHAR */
                 goto GT_NEXT;
             } else if (CUR_CHAR == '"') {
                 goto GT_QUOTE;
@@ -14,8 +14,27 @@
 
 static const tr_list TR_LIST_CLEAR = { NULL, NULL, NULL };
 
+/* Lists are used from every thread, so each thread keeps its own stash
+   of recycled nodes and only takes the lock to trade whole batches with
+   the shared pool. Without thread-local storage, every node goes through
+   the shared pool. */
+
+enum
+{
+  /* how many nodes move between a thread and the shared pool at a time */
+  NODE_BATCH = 64,
+
+  /* a thread keeps at most this many recycled nodes to itself */
+  MAX_LOCAL_NODES = NODE_BATCH * 2
+};
+
 static tr_list * recycled_nodes = NULL;
 
+#ifdef TR_THREAD_LOCAL
+static TR_THREAD_LOCAL tr_list * local_nodes = NULL;
+static TR_THREAD_LOCAL int local_count = 0;
+#endif
+
 static tr_lock*
 getRecycledNodesLock (void)
 {
@@ -27,20 +46,100 @@ getRecycledNodesLock (void)
   return l;
 }
 
+/* move up to `n' nodes from the front of `from' to the front of `to' */
+static int
+move_nodes (tr_list ** from, tr_list ** to, int n)
+{
+  int moved = 0;
+
+  while (moved < n && *from != NULL)
+    {
+      tr_list * node = *from;
+      *from = node->next;
+      node->next = *to;
+      *to = node;
+      ++moved;
+    }
+
+  return moved;
+}
+
+#ifdef TR_THREAD_LOCAL
+
 static tr_list*
 node_alloc (void)
 {
-  tr_list * ret = NULL;
-  tr_lock * lock = getRecycledNodesLock ();
+  tr_list * ret;
 
-  tr_lockLock (lock);
+  if (local_nodes == NULL)
+    {
+      tr_lock * lock = getRecycledNodesLock ();
+
+      tr_lockLock (lock);
+      local_count = move_nodes (&recycled_nodes, &local_nodes, NODE_BATCH);
+      tr_lockUnlock (lock);
+    }
 
-  if (recycled_nodes != NULL)
+  if (local_nodes != NULL)
+    {
+      ret = local_nodes;
+      local_nodes = ret->next;
+      --local_count;
+    }
+  else
     {
-      ret = recycled_nodes;
-      recycled_nodes = recycled_nodes->next;
+      ret = tr_new (tr_list, 1);
     }
 
+  *ret = TR_LIST_CLEAR;
+  return ret;
+}
+
+static void
+node_free (tr_list* node)
+{
+  if (node != NULL)
+    {
+      *node = TR_LIST_CLEAR;
+      node->next = local_nodes;
+      local_nodes = node;
+
+      if (++local_count > MAX_LOCAL_NODES)
+        {
+          tr_lock * lock = getRecycledNodesLock ();
+
+          tr_lockLock (lock);
+          local_count -= move_nodes (&local_nodes, &recycled_nodes, NODE_BATCH);
+          tr_lockUnlock (lock);
+        }
+    }
+}
+
+void
+tr_list_release_thread_nodes (void)
+{
+  if (local_nodes != NULL)
+    {
+      tr_lock * lock = getRecycledNodesLock ();
+
+      tr_lockLock (lock);
+      move_nodes (&local_nodes, &recycled_nodes, local_count);
+      tr_lockUnlock (lock);
+
+      local_count = 0;
+    }
+}
+
+#else
+
+static tr_list*
+node_alloc (void)
+{
+  tr_list * ret = NULL;
+  tr_lock * lock = getRecycledNodesLock ();
+
+  tr_lockLock (lock);
+  move_nodes (&recycled_nodes, &ret, 1);
   tr_lockUnlock (lock);
 
   if (ret == NULL)
@@ -67,6 +166,13 @@ node_free (tr_list* node)
     }
 }
 
+void
+tr_list_release_thread_nodes (void)
+{
+}
+
+#endif
+
 /***
 ****
 ***/
@@ -39,6 +39,12 @@ typedef void (*TrListForeachFunc)(void *);
  */
 int      tr_list_size (const tr_list * list);
 
+/**
+ * @brief give the calling thread's recycled nodes back to the shared pool
+ * @note tr_threadNew () threads call this when they finish
+ */
+void     tr_list_release_thread_nodes (void);
+
 /**
  * @brief free the specified list and set its pointer to NULL
  * @param list pointer to the list to be freed
@@ -9,7 +9,9 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h> /* memcpy (), strlen () */
 
 #include <event2/buffer.h>
 
@@ -20,6 +22,7 @@
 #include "utils.h"
 
 tr_log_level __tr_message_level  = TR_LOG_ERROR;
+int8_t __tr_log_deep_enabled = -1;
 
 static bool           myQueueEnabled = false;
 static tr_log_message *  myQueue = NULL;
@@ -159,14 +162,69 @@ tr_logGetTimeStr (char * buf, int buflen)
 }
 
 bool
-tr_logGetDeepEnabled (void)
+tr_logCheckDeepEnabled (void)
 {
-  static int8_t deepLoggingIsActive = -1;
+  if (__tr_log_deep_enabled < 0)
+    __tr_log_deep_enabled = IsDebuggerPresent () || (tr_logGetFile () != TR_BAD_SYS_FILE);
 
-  if (deepLoggingIsActive < 0)
-    deepLoggingIsActive = IsDebuggerPresent () || (tr_logGetFile () != TR_BAD_SYS_FILE);
+  return __tr_log_deep_enabled != 0;
+}
+
+/* like tr_sys_path_basename (), but without the allocation.
+   `file' is always a __FILE__ string, so this simple scan is enough */
+static const char *
+getFileBasename (const char * file)
+{
+  const char * base = file;
+
+  for (; *file != '\0'; ++file)
+    if (*file == '/' || *file == '\\')
+      base = file + 1;
+
+  return base;
+}
+
+/* format into `buf' if it fits, or into a new allocation if not.
+   when the return value differs from `buf', the caller must tr_free () it */
+static char * formatMessage (char * buf, size_t buflen, const char * prefix,
+                             const char * fmt, va_list args,
+                             const char * suffix) TR_GNUC_PRINTF (4, 0);
+
+static char *
+formatMessage (char * buf, size_t buflen, const char * prefix,
+               const char * fmt, va_list args, const char * suffix)
+{
+  va_list args2;
+  char * ret = NULL;
+  const size_t prefix_len = strlen (prefix);
+  const size_t suffix_len = strlen (suffix);
+
+  va_copy (args2, args);
+
+  if (prefix_len + suffix_len < buflen)
+    {
+      const size_t room = buflen - prefix_len - suffix_len;
+      const int n = evutil_vsnprintf (buf + prefix_len, room, fmt, args);
+
+      if (n >= 0 && (size_t)n < room)
+        {
+          memcpy (buf, prefix, prefix_len);
+          memcpy (buf + prefix_len + n, suffix, suffix_len + 1);
+          ret = buf;
+        }
+    }
 
-  return deepLoggingIsActive != 0;
+  if (ret == NULL)
+    {
+      struct evbuffer * evbuf = evbuffer_new ();
+      evbuffer_add (evbuf, prefix, strlen (prefix));
+      evbuffer_add_vprintf (evbuf, fmt, args2);
+      evbuffer_add (evbuf, suffix, strlen (suffix));
+      ret = evbuffer_free_to_str (evbuf);
+    }
+
+  va_end (args2);
+  return ret;
 }
 
 void
@@ -181,27 +239,29 @@ tr_logAddDeep (const char  * file,
     {
       va_list args;
       char timestr[64];
+      char prefix[256];
+      char suffix[128];
+      char buf[1024];
       char * message;
-      struct evbuffer * buf = evbuffer_new ();
-      char * base = tr_sys_path_basename (file, NULL);
 
-      evbuffer_add_printf (buf, "[%s] ",
-                           tr_logGetTimeStr (timestr, sizeof (timestr)));
+      tr_logGetTimeStr (timestr, sizeof (timestr));
       if (name)
-        evbuffer_add_printf (buf, "%s ", name);
+        tr_snprintf (prefix, sizeof (prefix), "[%s] %s ", timestr, name);
+      else
+        tr_snprintf (prefix, sizeof (prefix), "[%s] ", timestr);
+      tr_snprintf (suffix, sizeof (suffix), " (%s:%d)", getFileBasename (file), line);
+
       va_start (args, fmt);
-      evbuffer_add_vprintf (buf, fmt, args);
+      message = formatMessage (buf, sizeof (buf), prefix, fmt, args, suffix);
       va_end (args);
-      evbuffer_add_printf (buf, " (%s:%d)", base, line);
-      /* FIXME (libevent2) ifdef this out for nonwindows platforms */
-      message = evbuffer_free_to_str (buf);
+
       OutputDebugStringA (message);
       OutputDebugStringA (TR_NATIVE_EOL_STR);
       if (fp != TR_BAD_SYS_FILE)
         tr_sys_file_write_line (fp, message, NULL);
 
-      tr_free (message);
-      tr_free (base);
+      if (message != buf)
+        tr_free (message);
     }
 }
 
@@ -220,9 +280,9 @@ tr_logAddMessage (const char * file,
   const int err = errno; /* message logging shouldn't affect errno */
   char buf[1024];
   va_list ap;
-  tr_lockLock (getMessageLock ());
 
-  /* build the text message */
+  /* build the text message before taking the lock,
+     so that threads only wait on each other for the output */
   *buf = '\0';
   va_start (ap, fmt);
   evutil_vsnprintf (buf, sizeof (buf), fmt, ap);
@@ -230,6 +290,8 @@ tr_logAddMessage (const char * file,
 
   OutputDebugStringA (buf);
 
+  tr_lockLock (getMessageLock ());
+
   if (*buf)
     {
       if (tr_logGetQueueEnabled ())
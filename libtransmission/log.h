@@ -23,10 +23,15 @@ extern "C" {
 
 tr_log_level tr_logGetLevel (void);
 
+/* private -- read directly so that the tr_logAdd* macros
+   cost a single load and branch when their level is inactive */
+extern tr_log_level __tr_message_level;
+extern int8_t __tr_log_deep_enabled;
+
 static inline bool
 tr_logLevelIsActive (tr_log_level level)
 {
-  return tr_logGetLevel () >= level;
+  return __tr_message_level >= level;
 }
 
 void tr_logAddMessage (const char   * file,
@@ -111,8 +116,15 @@ void tr_logAddMessage (const char   * file,
 
 tr_sys_file_t tr_logGetFile (void);
 
+bool tr_logCheckDeepEnabled (void);
+
 /** @brief return true if deep logging has been enabled by the user; false otherwise */
-bool tr_logGetDeepEnabled (void);
+static inline bool
+tr_logGetDeepEnabled (void)
+{
+  /* nonzero until the first check, then 0 or 1 */
+  return __tr_log_deep_enabled != 0 && tr_logCheckDeepEnabled ();
+}
 
 void tr_logAddDeep (const char * file,
                     int          line,
@@ -293,11 +293,98 @@ test_single_directory_random_payload (void)
   return 0;
 }
 
+static int
+makeTorrent (tr_metainfo_builder * builder, const char * torrent_file, tr_info * setme)
+{
+  tr_ctor * ctor;
+  tr_parse_result parse_result;
+
+  tr_makeMetaInfo (builder, torrent_file, NULL, 0, NULL, false);
+  while (!builder->isDone)
+    tr_wait_msec (100);
+  check_int_eq (TR_MAKEMETA_OK, builder->result);
+
+  ctor = tr_ctorNew (NULL);
+  tr_ctorSetMetainfoFromFile (ctor, torrent_file);
+  parse_result = tr_torrentParse (ctor, setme);
+  check_int_eq (TR_PARSE_OK, parse_result);
+  tr_ctorFree (ctor);
+  return 0;
+}
+
+static void
+createRandomFile (const char * folder, const char * name, size_t len)
+{
+  char * filename = tr_buildPath (folder, name, NULL);
+  char * contents = tr_new (char, len);
+
+  tr_cryptoRandBuf (contents, len);
+  libtest_create_file_with_contents (filename, contents, len);
+
+  tr_free (contents);
+  tr_free (filename);
+}
+
+static int
+test_reuse_hashes (void)
+{
+  tr_info old_inf;
+  tr_info reused_inf;
+  tr_info hashed_inf;
+  tr_metainfo_builder * builder;
+  const uint32_t pieceSize = 16384;
+  char * sandbox = libtest_sandbox_create ();
+  char * top = tr_buildPath (sandbox, "folder", NULL);
+  char * torrent_file = tr_buildPath (sandbox, "test.torrent", NULL);
+
+  /* 70000 bytes in five pieces */
+  createRandomFile (top, "a", 40000);
+  createRandomFile (top, "c", 30000);
+  builder = tr_metaInfoBuilderCreate (top);
+  check (tr_metaInfoBuilderSetPieceSize (builder, pieceSize));
+  check (!makeTorrent (builder, torrent_file, &old_inf));
+  check_int_eq (5, old_inf.pieceCount);
+  tr_metaInfoBuilderFree (builder);
+
+  /* put two pieces' worth of data between the files, so that the pieces
+     around the new file change, but the ones after it still line up */
+  createRandomFile (top, "b", 2 * pieceSize);
+  builder = tr_metaInfoBuilderCreate (top);
+  check_int_eq (0, tr_metaInfoBuilderReuseInfo (builder, &old_inf));
+  check (tr_metaInfoBuilderSetPieceSize (builder, pieceSize));
+  check_int_eq (7, builder->pieceCount);
+  check_int_eq (4, tr_metaInfoBuilderReuseInfo (builder, &old_inf));
+  check (builder->isHashReused[0] && builder->isHashReused[1]);
+  check (!builder->isHashReused[2] && !builder->isHashReused[3] && !builder->isHashReused[4]);
+  check (builder->isHashReused[5] && builder->isHashReused[6]);
+  check (!makeTorrent (builder, torrent_file, &reused_inf));
+  tr_metaInfoBuilderFree (builder);
+
+  /* the hashes must be the same as if every piece had been hashed */
+  builder = tr_metaInfoBuilderCreate (top);
+  check (tr_metaInfoBuilderSetPieceSize (builder, pieceSize));
+  check (!makeTorrent (builder, torrent_file, &hashed_inf));
+  tr_metaInfoBuilderFree (builder);
+  check_int_eq (hashed_inf.pieceCount, reused_inf.pieceCount);
+  check (!memcmp (hashed_inf.pieceHashes, reused_inf.pieceHashes, SHA_DIGEST_LENGTH * hashed_inf.pieceCount));
+  check (!memcmp (hashed_inf.hash, reused_inf.hash, SHA_DIGEST_LENGTH));
+
+  tr_metainfoFree (&hashed_inf);
+  tr_metainfoFree (&reused_inf);
+  tr_metainfoFree (&old_inf);
+  tr_free (torrent_file);
+  tr_free (top);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
 int
 main (void)
 {
   const testFunc tests[] = { test_single_file,
-                             test_single_directory_random_payload };
+                             test_single_directory_random_payload,
+                             test_reuse_hashes };
 
   return runTests (tests, NUM_TESTS (tests));
 }
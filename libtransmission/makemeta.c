@@ -12,6 +12,12 @@
 #include <stdlib.h> /* qsort */
 #include <string.h> /* strcmp, strlen */
 
+#ifdef _WIN32
+ #include <windows.h> /* GetSystemInfo () */
+#else
+ #include <unistd.h> /* sysconf () */
+#endif
+
 #include <event2/util.h> /* evutil_ascii_strcasecmp () */
 
 #include "transmission.h"
@@ -21,6 +27,7 @@
 #include "log.h"
 #include "session.h"
 #include "makemeta.h"
+#include "torrent.h" /* tr_torrentLoadPieceHashes (), tr_torrentPieceIsComplete () */
 #include "platform.h" /* threads, locks */
 #include "utils.h" /* buildpath */
 #include "variant.h"
@@ -156,6 +163,15 @@ tr_metaInfoBuilderCreate (const char * topFileArg)
   return ret;
 }
 
+static void
+clearReusedHashes (tr_metainfo_builder * b)
+{
+  tr_free (b->reusedHashes);
+  b->reusedHashes = NULL;
+  tr_free (b->isHashReused);
+  b->isHashReused = NULL;
+}
+
 static bool
 isValidPieceSize (uint32_t n)
 {
@@ -180,6 +196,9 @@ tr_metaInfoBuilderSetPieceSize (tr_metainfo_builder * b,
       return false;
     }
 
+  /* the old piece size's hashes don't fit the new one */
+  clearReusedHashes (b);
+
   b->pieceSize = bytes;
 
   b->pieceCount = (int)(b->totalSize / b->pieceSize);
@@ -207,59 +226,603 @@ tr_metaInfoBuilderFree (tr_metainfo_builder * builder)
         tr_free (builder->trackers[i].announce);
       tr_free (builder->trackers);
       tr_free (builder->outputFile);
+      clearReusedHashes (builder);
       tr_free (builder);
     }
 }
 
+/****
+*****  Reusing an existing torrent's piece hashes
+****/
+
+struct reuse_file
+{
+  char * key;
+  uint64_t length;
+  tr_file_index_t index;
+};
+
+static int
+compareReuseFiles (const void * va, const void * vb)
+{
+  const struct reuse_file * a = va;
+  const struct reuse_file * b = vb;
+
+  return strcmp (a->key, b->key);
+}
+
+/**
+ * Pair each of the builder's files with the torrent file that has the
+ * same key and length.
+ * @param files the torrent's files; this sorts them
+ * @param keys the builder's files' keys
+ * @return the torrent file index for each builder file, or `noFile'
+ */
+static tr_file_index_t *
+mapFiles (const tr_metainfo_builder * b,
+          struct reuse_file         * files,
+          size_t                      fileCount,
+          char                     ** keys,
+          tr_file_index_t             noFile)
+{
+  uint32_t i;
+  tr_file_index_t * map = tr_new (tr_file_index_t, b->fileCount);
+
+  qsort (files, fileCount, sizeof (struct reuse_file), compareReuseFiles);
+
+  for (i=0; i<b->fileCount; ++i)
+    {
+      struct reuse_file key;
+      const struct reuse_file * f;
+
+      key.key = keys[i];
+      f = bsearch (&key, files, fileCount, sizeof (struct reuse_file), compareReuseFiles);
+      map[i] = f != NULL && f->length == b->files[i].size ? f->index : noFile;
+    }
+
+  return map;
+}
+
+static uint64_t
+getPieceLength (uint64_t totalSize, uint32_t pieceSize, uint32_t piece)
+{
+  return MIN (pieceSize, totalSize - (uint64_t)piece * pieceSize);
+}
+
+/**
+ * Copy the hash of each of `inf''s pieces that holds exactly the same bytes
+ * as one of the builder's pieces: contiguous in `inf', in the same order,
+ * and starting on a piece boundary.
+ * @param verified which of `inf''s pieces can be trusted, or NULL for all
+ */
+static uint32_t
+reuseHashes (tr_metainfo_builder   * b,
+             const tr_info         * inf,
+             const uint8_t         * hashes,
+             const tr_file_index_t * map,
+             const bool            * verified)
+{
+  uint32_t i;
+  uint32_t count = 0;
+  uint32_t fileIndex = 0;
+  uint64_t fileBegin = 0;
+  uint64_t * infOffsets;
+
+  clearReusedHashes (b);
+
+  if (hashes == NULL || inf->pieceSize != b->pieceSize || !b->totalSize)
+    return 0;
+
+  /* tr_torrentParse () doesn't fill in the files' offsets */
+  infOffsets = tr_new (uint64_t, inf->fileCount);
+  for (i=0; i<inf->fileCount; ++i)
+    infOffsets[i] = i > 0 ? infOffsets[i-1] + inf->files[i-1].length : 0;
+
+  b->reusedHashes = tr_new (uint8_t, SHA_DIGEST_LENGTH * (size_t)b->pieceCount);
+  b->isHashReused = tr_new0 (bool, b->pieceCount);
+
+  for (i=0; i<b->pieceCount; ++i)
+    {
+      uint32_t f;
+      bool ok = true;
+      uint64_t done = 0;
+      uint64_t infBegin = 0;
+      uint64_t thisFileBegin;
+      const uint64_t begin = (uint64_t)i * b->pieceSize;
+      const uint64_t length = getPieceLength (b->totalSize, b->pieceSize, i);
+
+      /* find the first file with bytes in this piece */
+      while (fileBegin + b->files[fileIndex].size <= begin)
+        fileBegin += b->files[fileIndex++].size;
+
+      for (f=fileIndex, thisFileBegin=fileBegin; ok && done<length; ++f)
+        {
+          uint64_t infOffset;
+          const uint64_t offset = begin + done - thisFileBegin;
+
+          if (map[f] >= inf->fileCount)
+            {
+              ok = false;
+              break;
+            }
+
+          infOffset = infOffsets[map[f]] + offset;
+
+          if (done == 0)
+            {
+              infBegin = infOffset;
+              ok = infBegin % inf->pieceSize == 0
+                && getPieceLength (inf->totalSize, inf->pieceSize, infBegin / inf->pieceSize) == length;
+            }
+          else
+            {
+              ok = infOffset == infBegin + done;
+            }
+
+          done += MIN (b->files[f].size - offset, length - done);
+          thisFileBegin += b->files[f].size;
+        }
+
+      if (ok)
+        {
+          const tr_piece_index_t piece = infBegin / inf->pieceSize;
+
+          if (verified == NULL || verified[piece])
+            {
+              memcpy (b->reusedHashes + SHA_DIGEST_LENGTH * (size_t)i,
+                      hashes + SHA_DIGEST_LENGTH * (size_t)piece,
+                      SHA_DIGEST_LENGTH);
+              b->isHashReused[i] = true;
+              ++count;
+            }
+        }
+    }
+
+  tr_free (infOffsets);
+
+  if (!count)
+    clearReusedHashes (b);
+
+  return count;
+}
+
+/* a file's path inside the torrent, without the torrent's name */
+static const char *
+getRelativePath (const char * path, bool isFolder)
+{
+  const char * walk = isFolder ? strchr (path, TR_PATH_DELIMITER) : NULL;
+
+  return walk != NULL ? walk + 1 : "";
+}
+
+static void
+freeReuseKeys (struct reuse_file * files, size_t fileCount,
+               char ** keys, size_t keyCount)
+{
+  size_t i;
+
+  for (i=0; i<fileCount; ++i)
+    tr_free (files[i].key);
+  tr_free (files);
+
+  for (i=0; i<keyCount; ++i)
+    tr_free (keys[i]);
+  tr_free (keys);
+}
+
+uint32_t
+tr_metaInfoBuilderReuseInfo (tr_metainfo_builder * b,
+                             const tr_info       * inf)
+{
+  uint32_t i;
+  uint32_t count;
+  char ** keys;
+  struct reuse_file * files;
+  tr_file_index_t * map;
+  const size_t topLen = strlen (b->top);
+
+  if (inf->isFolder != b->isFolder)
+    {
+      clearReusedHashes (b);
+      return 0;
+    }
+
+  files = tr_new (struct reuse_file, inf->fileCount);
+  for (i=0; i<inf->fileCount; ++i)
+    {
+      files[i].key = tr_strdup (getRelativePath (inf->files[i].name, inf->isFolder));
+      files[i].length = inf->files[i].length;
+      files[i].index = i;
+    }
+
+  keys = tr_new (char*, b->fileCount);
+  for (i=0; i<b->fileCount; ++i)
+    keys[i] = tr_strdup (b->isFolder ? b->files[i].filename + topLen + 1 : "");
+
+  map = mapFiles (b, files, inf->fileCount, keys, inf->fileCount);
+  count = reuseHashes (b, inf, inf->pieceHashes, map, NULL);
+
+  tr_free (map);
+  freeReuseKeys (files, inf->fileCount, keys, b->fileCount);
+  return count;
+}
+
+uint32_t
+tr_metaInfoBuilderReuseTorrent (tr_metainfo_builder * b,
+                                tr_torrent          * tor)
+{
+  tr_piece_index_t p;
+  tr_file_index_t i;
+  uint32_t count = 0;
+  size_t fileCount = 0;
+  char ** keys;
+  bool * verified;
+  bool hadHashes;
+  struct reuse_file * files;
+  tr_file_index_t * map;
+  const tr_info * inf = &tor->info;
+
+  assert (tr_isTorrent (tor));
+
+  tr_sessionLock (tor->session);
+
+  hadHashes = inf->pieceHashes != NULL;
+
+  if (tr_torrentHasMetadata (tor) && tr_torrentLoadPieceHashes (tor))
+    {
+      /* where the session has each file right now */
+      files = tr_new (struct reuse_file, inf->fileCount);
+      for (i=0; i<inf->fileCount; ++i)
+        {
+          char * found = tr_torrentFindFile (tor, i);
+          char * key = found != NULL ? tr_sys_path_resolve (found, NULL) : NULL;
+
+          if (key != NULL)
+            {
+              files[fileCount].key = key;
+              files[fileCount].length = inf->files[i].length;
+              files[fileCount].index = i;
+              ++fileCount;
+            }
+
+          tr_free (found);
+        }
+
+      /* the builder's filenames are already resolved */
+      keys = tr_new (char*, b->fileCount);
+      for (i=0; i<b->fileCount; ++i)
+        keys[i] = tr_strdup (b->files[i].filename);
+
+      verified = tr_new (bool, inf->pieceCount);
+      for (p=0; p<inf->pieceCount; ++p)
+        verified[p] = tr_torrentPieceIsComplete (tor, p);
+
+      map = mapFiles (b, files, fileCount, keys, inf->fileCount);
+      count = reuseHashes (b, inf, inf->pieceHashes, map, verified);
+
+      tr_free (map);
+      tr_free (verified);
+      freeReuseKeys (files, fileCount, keys, b->fileCount);
+
+      if (!hadHashes)
+        tr_torrentUnloadPieceHashes (tor);
+    }
+  else
+    {
+      clearReusedHashes (b);
+    }
+
+  tr_sessionUnlock (tor->session);
+  return count;
+}
+
 /****
 *****
 ****/
 
+/* pieces are read sequentially by the builder's worker thread and handed
+   off to a small pool of hashing threads. Each piece's hash is written to
+   its own slot in the result, so pieces may finish out of order. */
+
+enum
+{
+  MAX_HASH_THREADS = 16,
+
+  /* cap on how much piece data can be waiting to be hashed */
+  MAX_HASH_QUEUE_BYTES = (64 * 1024 * 1024)
+};
+
+enum hash_slot_state
+{
+  HASH_SLOT_EMPTY,
+  HASH_SLOT_READING,
+  HASH_SLOT_FULL,
+  HASH_SLOT_HASHING
+};
+
+struct hash_slot
+{
+  enum hash_slot_state state;
+  uint32_t pieceIndex;
+  uint32_t length;
+  uint8_t * buf;
+};
+
+struct hash_pool
+{
+  tr_lock * lock;
+  tr_metainfo_builder * builder;
+  uint8_t * hashes;
+  struct hash_slot * slots;
+  int slotCount;
+  int threadCount;
+  uint32_t hashedCount;
+  bool done;
+};
+
+static int
+getHashThreadCount (void)
+{
+  long n = 1;
+
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo (&info);
+  n = info.dwNumberOfProcessors;
+#elif defined (_SC_NPROCESSORS_ONLN)
+  n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+
+  return (int) MAX (1, MIN (n, MAX_HASH_THREADS));
+}
+
+static struct hash_slot *
+findHashSlot (struct hash_pool * pool, enum hash_slot_state state)
+{
+  int i;
+
+  for (i=0; i<pool->slotCount; ++i)
+    if (pool->slots[i].state == state)
+      return &pool->slots[i];
+
+  return NULL;
+}
+
+static void
+hashThreadFunc (void * vpool)
+{
+  struct hash_pool * pool = vpool;
+
+  for (;;)
+    {
+      bool done = false;
+      struct hash_slot * slot;
+
+      /* once threadCount is decremented the pool may be freed at any time,
+         so don't touch it after that */
+      tr_lockLock (pool->lock);
+      slot = findHashSlot (pool, HASH_SLOT_FULL);
+      if (slot != NULL)
+        slot->state = HASH_SLOT_HASHING;
+      else if ((done = pool->done))
+        --pool->threadCount;
+      tr_lockUnlock (pool->lock);
+
+      if (slot == NULL)
+        {
+          if (done)
+            break;
+          tr_wait_msec (1);
+          continue;
+        }
+
+      tr_sha1 (pool->hashes + SHA_DIGEST_LENGTH * (size_t)slot->pieceIndex,
+               slot->buf, slot->length, NULL);
+
+      tr_lockLock (pool->lock);
+      slot->state = HASH_SLOT_EMPTY;
+      pool->builder->pieceIndex = ++pool->hashedCount;
+      tr_lockUnlock (pool->lock);
+    }
+}
+
+/* wait for a slot that the reader can fill with the next piece */
+static struct hash_slot *
+getEmptyHashSlot (struct hash_pool * pool)
+{
+  struct hash_slot * slot;
+
+  for (;;)
+    {
+      tr_lockLock (pool->lock);
+      slot = findHashSlot (pool, HASH_SLOT_EMPTY);
+      if (slot != NULL)
+        slot->state = HASH_SLOT_READING;
+      tr_lockUnlock (pool->lock);
+
+      if (slot != NULL)
+        return slot;
+
+      tr_wait_msec (1);
+    }
+}
+
+/* tell the hashing threads there's no more input and wait for them to exit */
+static void
+hashPoolDrain (struct hash_pool * pool)
+{
+  tr_lockLock (pool->lock);
+  pool->done = true;
+  tr_lockUnlock (pool->lock);
+
+  for (;;)
+    {
+      int n;
+
+      tr_lockLock (pool->lock);
+      n = pool->threadCount;
+      tr_lockUnlock (pool->lock);
+
+      if (n == 0)
+        break;
+
+      tr_wait_msec (1);
+    }
+}
+
+static bool
+openHashFile (tr_metainfo_builder * b, uint32_t fileIndex, tr_sys_file_t * fd)
+{
+  tr_error * error = NULL;
+
+  *fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
+                          TR_SYS_FILE_SEQUENTIAL, 0, &error);
+  if (*fd == TR_BAD_SYS_FILE)
+    {
+      b->my_errno = error->code;
+      tr_strlcpy (b->errfile,
+                  b->files[fileIndex].filename,
+                  sizeof (b->errfile));
+      b->result = TR_MAKEMETA_IO_READ;
+      tr_error_free (error);
+      return false;
+    }
+
+  return true;
+}
+
+/* if the file isn't open, open it and go to where the next piece starts */
+static bool
+seekHashFile (tr_metainfo_builder * b, uint32_t fileIndex, uint64_t off, tr_sys_file_t * fd)
+{
+  tr_error * error = NULL;
+
+  if (*fd != TR_BAD_SYS_FILE)
+    return true;
+
+  if (!openHashFile (b, fileIndex, fd))
+    return false;
+
+  if (off > 0 && !tr_sys_file_seek (*fd, off, TR_SEEK_SET, NULL, &error))
+    {
+      b->my_errno = error->code;
+      tr_strlcpy (b->errfile, b->files[fileIndex].filename, sizeof (b->errfile));
+      b->result = TR_MAKEMETA_IO_READ;
+      tr_error_free (error);
+      tr_sys_file_close (*fd, NULL);
+      *fd = TR_BAD_SYS_FILE;
+      return false;
+    }
+
+  return true;
+}
+
+/* step over a piece whose hash is being reused, without reading it */
+static void
+skipHashPiece (tr_metainfo_builder * b,
+               uint32_t            * fileIndex,
+               uint64_t            * off,
+               tr_sys_file_t       * fd,
+               uint64_t              len)
+{
+  while (len > 0)
+    {
+      const uint64_t n = MIN (b->files[*fileIndex].size - *off, len);
+
+      *off += n;
+      len -= n;
+
+      if (*off == b->files[*fileIndex].size)
+        {
+          *off = 0;
+          ++*fileIndex;
+        }
+    }
+
+  if (*fd != TR_BAD_SYS_FILE)
+    {
+      tr_sys_file_close (*fd, NULL);
+      *fd = TR_BAD_SYS_FILE;
+    }
+}
+
 static uint8_t*
 getHashInfo (tr_metainfo_builder * b)
 {
+  int i;
+  int threadCount;
   uint32_t fileIndex = 0;
+  uint32_t pieceIndex = 0;
   uint8_t *ret = tr_new0 (uint8_t, SHA_DIGEST_LENGTH * b->pieceCount);
-  uint8_t *walk = ret;
-  uint8_t *buf;
   uint64_t totalRemain;
   uint64_t off = 0;
-  tr_sys_file_t fd;
-  tr_error * error = NULL;
+  tr_sys_file_t fd = TR_BAD_SYS_FILE;
+  bool ok = true;
+  struct hash_pool pool;
 
   if (!b->totalSize)
     return ret;
 
-  buf = tr_valloc (b->pieceSize);
   b->pieceIndex = 0;
   totalRemain = b->totalSize;
-  fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
-                         TR_SYS_FILE_SEQUENTIAL, 0, &error);
-  if (fd == TR_BAD_SYS_FILE)
-    {
-      b->my_errno = error->code;
-      tr_strlcpy (b->errfile,
-                  b->files[fileIndex].filename,
-                  sizeof (b->errfile));
-      b->result = TR_MAKEMETA_IO_READ;
-      tr_free (buf);
-      tr_free (ret);
-      tr_error_free (error);
-      return NULL;
-    }
 
-  while (totalRemain)
+  /* keep every thread busy with one piece while another is being read,
+     but don't let large pieces balloon the queue */
+  threadCount = getHashThreadCount ();
+  memset (&pool, 0, sizeof (pool));
+  pool.lock = tr_lockNew ();
+  pool.builder = b;
+  pool.hashes = ret;
+  pool.slotCount = MIN (threadCount * 2, (int)(MAX_HASH_QUEUE_BYTES / b->pieceSize));
+  pool.slotCount = MAX (2, pool.slotCount);
+  pool.slots = tr_new0 (struct hash_slot, pool.slotCount);
+  for (i=0; i<pool.slotCount; ++i)
+    pool.slots[i].buf = tr_valloc (b->pieceSize);
+  threadCount = MIN (threadCount, pool.slotCount);
+  pool.threadCount = threadCount;
+  for (i=0; i<threadCount; ++i)
+    tr_threadNew (hashThreadFunc, &pool);
+
+  while (ok && totalRemain)
     {
-      uint8_t * bufptr = buf;
+      struct hash_slot * slot;
+      uint8_t * bufptr;
       const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
       uint64_t leftInPiece = thisPieceSize;
 
-      assert (b->pieceIndex < b->pieceCount);
+      assert (pieceIndex < b->pieceCount);
+
+      if (b->isHashReused != NULL && b->isHashReused[pieceIndex])
+        {
+          memcpy (ret + SHA_DIGEST_LENGTH * (size_t)pieceIndex,
+                  b->reusedHashes + SHA_DIGEST_LENGTH * (size_t)pieceIndex,
+                  SHA_DIGEST_LENGTH);
+          skipHashPiece (b, &fileIndex, &off, &fd, thisPieceSize);
+
+          tr_lockLock (pool.lock);
+          b->pieceIndex = ++pool.hashedCount;
+          tr_lockUnlock (pool.lock);
+
+          totalRemain -= thisPieceSize;
+          ++pieceIndex;
+          continue;
+        }
+
+      slot = getEmptyHashSlot (&pool);
+      bufptr = slot->buf;
 
       while (leftInPiece)
         {
-          const uint64_t n_this_pass = MIN (b->files[fileIndex].size - off, leftInPiece);
+          uint64_t n_this_pass;
           uint64_t n_read = 0;
+
+          if (!seekHashFile (b, fileIndex, off, &fd))
+            {
+              ok = false;
+              break;
+            }
+
+          n_this_pass = MIN (b->files[fileIndex].size - off, leftInPiece);
           tr_sys_file_read (fd, bufptr, n_this_pass, &n_read, NULL);
           bufptr += n_read;
           off += n_read;
@@ -269,30 +832,24 @@ getHashInfo (tr_metainfo_builder * b)
               off = 0;
               tr_sys_file_close (fd, NULL);
               fd = TR_BAD_SYS_FILE;
-              if (++fileIndex < b->fileCount)
-                {
-                  fd = tr_sys_file_open (b->files[fileIndex].filename, TR_SYS_FILE_READ |
-                                         TR_SYS_FILE_SEQUENTIAL, 0, &error);
-                  if (fd == TR_BAD_SYS_FILE)
-                    {
-                      b->my_errno = error->code;
-                      tr_strlcpy (b->errfile,
-                                  b->files[fileIndex].filename,
-                                  sizeof (b->errfile));
-                      b->result = TR_MAKEMETA_IO_READ;
-                      tr_free (buf);
-                      tr_free (ret);
-                      tr_error_free (error);
-                      return NULL;
-                    }
-                }
+              ++fileIndex;
             }
         }
 
-      assert (bufptr - buf == (int)thisPieceSize);
-      assert (leftInPiece == 0);
-      tr_sha1 (walk, buf, thisPieceSize, NULL);
-      walk += SHA_DIGEST_LENGTH;
+      tr_lockLock (pool.lock);
+      if (ok)
+        {
+          assert (bufptr - slot->buf == (int)thisPieceSize);
+          assert (leftInPiece == 0);
+          slot->pieceIndex = pieceIndex;
+          slot->length = thisPieceSize;
+          slot->state = HASH_SLOT_FULL;
+        }
+      else
+        {
+          slot->state = HASH_SLOT_EMPTY;
+        }
+      tr_lockUnlock (pool.lock);
 
       if (b->abortFlag)
         {
@@ -301,17 +858,28 @@ getHashInfo (tr_metainfo_builder * b)
         }
 
       totalRemain -= thisPieceSize;
-      ++b->pieceIndex;
+      ++pieceIndex;
     }
 
-  assert (b->abortFlag
-        || (walk - ret == (int)(SHA_DIGEST_LENGTH * b->pieceCount)));
-  assert (b->abortFlag || !totalRemain);
+  hashPoolDrain (&pool);
+
+  assert (!ok || b->abortFlag || (pool.hashedCount == b->pieceCount));
+  assert (!ok || b->abortFlag || !totalRemain);
 
   if (fd != TR_BAD_SYS_FILE)
     tr_sys_file_close (fd, NULL);
 
-  tr_free (buf);
+  for (i=0; i<pool.slotCount; ++i)
+    tr_free (pool.slots[i].buf);
+  tr_free (pool.slots);
+  tr_lockFree (pool.lock);
+
+  if (!ok)
+    {
+      tr_free (ret);
+      ret = NULL;
+    }
+
   return ret;
 }
 
@@ -84,6 +84,12 @@ typedef struct tr_metainfo_builder
     **/
 
     struct tr_metainfo_builder * nextBuilder;
+
+    /* pieceCount hashes, set by tr_metaInfoBuilderReuseInfo () or
+       tr_metaInfoBuilderReuseTorrent (). Only the ones flagged in
+       isHashReused are used; the others are hashed from the files. */
+    uint8_t * reusedHashes;
+    bool * isHashReused;
 }
 tr_metainfo_builder;
 
@@ -101,6 +107,30 @@ bool tr_metaInfoBuilderSetPieceSize (tr_metainfo_builder * builder,
 
 void tr_metaInfoBuilderFree (tr_metainfo_builder*);
 
+/**
+ * Call this before tr_makeMetaInfo() to take piece hashes from an existing
+ * torrent instead of reading and hashing the files again. A piece's hash
+ * is reused if the piece holds the same bytes of the same files as one of
+ * the torrent's pieces, so only the pieces at changed files' boundaries
+ * are hashed. The piece sizes must match; see tr_metaInfoBuilderSetPieceSize().
+ *
+ * Files are matched by their path inside the torrent and their size.
+ * Their contents are NOT checked, so this is only correct if the data
+ * hasn't changed since `inf' was made from it.
+ *
+ * @return the number of pieces whose hashes will be reused
+ */
+uint32_t tr_metaInfoBuilderReuseInfo (tr_metainfo_builder * builder,
+                                      const tr_info       * inf);
+
+/**
+ * Like tr_metaInfoBuilderReuseInfo(), but for a torrent in a running session.
+ * Files are matched by where the torrent has them on disk, and only the
+ * pieces that the session has verified are reused.
+ */
+uint32_t tr_metaInfoBuilderReuseTorrent (tr_metainfo_builder * builder,
+                                         tr_torrent          * tor);
+
 /**
  * @brief create a new .torrent file
  *
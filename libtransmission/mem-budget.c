@@ -0,0 +1,132 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+
+#include "transmission.h"
+#include "cache.h" /* tr_cacheGetMemoryUsage () */
+#include "log.h"
+#include "mem-budget.h"
+#include "peer-mgr.h" /* tr_peerMgrGetBufferedBytes () */
+#include "session.h"
+#include "torrent-magnet.h" /* tr_metadataGetMemoryUsage () */
+#include "utils.h"
+
+#define MY_NAME "Memory"
+
+enum
+{
+  /* once low on memory, stay that way until usage
+     falls under this percentage of the budget */
+  LOW_WATER_PERCENT = 90
+};
+
+struct tr_mem_budget
+{
+  uint64_t limit;
+  uint64_t usage[TR_MEM_CATEGORY_COUNT];
+  bool is_low;
+};
+
+void
+tr_memBudgetInit (tr_session * session)
+{
+  assert (session->memBudget == NULL);
+
+  session->memBudget = tr_new0 (struct tr_mem_budget, 1);
+}
+
+void
+tr_memBudgetClose (tr_session * session)
+{
+  tr_free (session->memBudget);
+  session->memBudget = NULL;
+}
+
+void
+tr_memBudgetSetLimit (tr_session * session, uint64_t bytes)
+{
+  assert (tr_isSession (session));
+
+  session->memBudget->limit = bytes;
+  tr_memBudgetUpdate (session);
+}
+
+uint64_t
+tr_memBudgetGetLimit (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->memBudget->limit;
+}
+
+static uint64_t
+getTotal (const struct tr_mem_budget * b)
+{
+  int i;
+  uint64_t total = 0;
+
+  for (i=0; i<TR_MEM_CATEGORY_COUNT; ++i)
+    total += b->usage[i];
+
+  return total;
+}
+
+void
+tr_memBudgetUpdate (tr_session * session)
+{
+  bool is_low;
+  uint64_t total;
+  struct tr_mem_budget * b = session->memBudget;
+
+  assert (tr_isSession (session));
+
+  b->usage[TR_MEM_CACHE] = tr_cacheGetMemoryUsage (session->cache);
+  b->usage[TR_MEM_PEER_BUFFERS] = session->peerMgr != NULL ? tr_peerMgrGetBufferedBytes (session->peerMgr) : 0;
+  b->usage[TR_MEM_METADATA] = tr_metadataGetMemoryUsage (session);
+  total = getTotal (b);
+
+  if (b->limit == 0)
+    is_low = false;
+  else if (b->is_low)
+    is_low = total > b->limit / 100 * LOW_WATER_PERCENT;
+  else
+    is_low = total > b->limit;
+
+  if (is_low != b->is_low)
+    {
+      char used[128];
+      char limit[128];
+
+      tr_formatter_mem_B (used, total, sizeof (used));
+      tr_formatter_mem_B (limit, b->limit, sizeof (limit));
+      if (is_low)
+        tr_logAddNamedInfo (MY_NAME, _("Using %1$s of the %2$s memory budget; cutting back"), used, limit);
+      else
+        tr_logAddNamedInfo (MY_NAME, _("Using %1$s of the %2$s memory budget; back to normal"), used, limit);
+
+      b->is_low = is_low;
+      tr_cacheSetMemoryLow (session->cache, is_low);
+    }
+}
+
+bool
+tr_memBudgetIsLow (const tr_session * session)
+{
+  return session->memBudget != NULL && session->memBudget->is_low;
+}
+
+uint64_t
+tr_memBudgetGetUsage (const tr_session * session, tr_mem_category category)
+{
+  assert (tr_isSession (session));
+  assert (0 <= category && category < TR_MEM_CATEGORY_COUNT);
+
+  return session->memBudget->usage[category];
+}
@@ -0,0 +1,62 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_MEM_BUDGET_H
+#define TR_MEM_BUDGET_H
+
+#include <inttypes.h> /* uint64_t */
+
+/**
+ * A session-wide budget for the memory that grows with the swarm:
+ * cached blocks, peers' socket buffers, and metadata.
+ *
+ * Once a second the budget adds up what each of them is using. When the
+ * total goes over the limit the session is "low on memory" until it's
+ * back under 90% of it. While it's low, peers' output buffers are kept
+ * to a few blocks, the write cache is flushed down to a quarter of its
+ * size, and no new peer connections are made or accepted.
+ *
+ * These must be called from the libtransmission thread.
+ */
+
+typedef enum
+{
+  TR_MEM_CACHE,        /* write cache blocks and the read cache */
+  TR_MEM_PEER_BUFFERS, /* peers' input and output buffers */
+  TR_MEM_METADATA,     /* magnet links' half-downloaded info dicts,
+                          and the info dicts cached for ut_metadata */
+
+  TR_MEM_CATEGORY_COUNT
+}
+tr_mem_category;
+
+void     tr_memBudgetInit     (tr_session * session);
+
+void     tr_memBudgetClose    (tr_session * session);
+
+/** @param bytes the budget, or zero for no limit */
+void     tr_memBudgetSetLimit (tr_session * session, uint64_t bytes);
+
+uint64_t tr_memBudgetGetLimit (const tr_session * session);
+
+/** @brief take a new sample of each category and react to it */
+void     tr_memBudgetUpdate   (tr_session * session);
+
+/** @return true if the last sample was over budget */
+bool     tr_memBudgetIsLow    (const tr_session * session);
+
+/** @return what the category was using as of the last sample */
+uint64_t tr_memBudgetGetUsage (const tr_session * session,
+                               tr_mem_category    category);
+
+#endif
@@ -13,6 +13,7 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "ConvertUTF.h" /* tr_utf8_validate () */
 #include "crypto.h" /* tr_sha1 */
 #include "file.h"
 #include "log.h"
@@ -22,6 +23,8 @@
 #include "utils.h"
 #include "variant.h"
 
+#define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
+
 /***
 ****
 ***/
@@ -77,14 +80,16 @@ path_component_is_suspicious (const char * component)
       || (strcmp (component, "..") == 0);
 }
 
+/**
+ * Build the file's path in `buf' and, if it's usable,
+ * append it with its trailing '\0' to `names'.
+ */
 static bool
-getfile (char ** setme, const char * root, tr_variant * path, struct evbuffer * buf)
+getfile (struct evbuffer * names, const char * root, tr_variant * path, struct evbuffer * buf)
 {
   bool success = false;
   size_t root_len = 0;
 
-  *setme = NULL;
-
   /* root's already been checked by caller */
   assert (!path_component_is_suspicious (root));
 
@@ -125,13 +130,44 @@ getfile (char ** setme, const char * root, tr_variant * path, struct evbuffer *
 
   if (success)
     {
-      *setme = tr_utf8clean ((char*)evbuffer_pullup (buf, -1), evbuffer_get_length (buf));
-      /*fprintf (stderr, "[%s]\n", *setme);*/
+      const int len = evbuffer_get_length (buf);
+      const char * str = (const char*) evbuffer_pullup (buf, -1);
+
+      if (tr_utf8_validate (str, len, NULL))
+        {
+          evbuffer_add (names, str, len);
+        }
+      else
+        {
+          char * clean = tr_utf8clean (str, len);
+          evbuffer_add (names, clean, strlen (clean));
+          tr_free (clean);
+        }
+
+      evbuffer_add (names, "", 1);
     }
 
   return success;
 }
 
+/**
+ * Copy the names in `names' into inf->fileNames and point the files at them.
+ * Torrents with many files would otherwise spend a lot of memory on the
+ * overhead of allocating each name separately.
+ */
+static void
+setFileNames (tr_info * inf, struct evbuffer * names, const size_t * offsets)
+{
+  tr_file_index_t i;
+  const size_t len = evbuffer_get_length (names);
+
+  inf->fileNames = tr_new (char, len);
+  evbuffer_remove (names, inf->fileNames, len);
+
+  for (i=0; i<inf->fileCount; ++i)
+    inf->files[i].name = inf->fileNames + offsets[i];
+}
+
 static const char*
 parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
 {
@@ -143,17 +179,21 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
     {
       tr_file_index_t i;
       struct evbuffer * buf;
+      struct evbuffer * names;
+      size_t * offsets;
       const char * result;
 
       if (path_component_is_suspicious (inf->name))
         return "path";
 
       buf = evbuffer_new ();
+      names = evbuffer_new ();
       result = NULL;
 
       inf->isFolder = true;
       inf->fileCount = tr_variantListSize (files);
       inf->files = tr_new0 (tr_file, inf->fileCount);
+      offsets = tr_new (size_t, inf->fileCount);
 
       for (i=0; i<inf->fileCount; i++)
         {
@@ -174,7 +214,8 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
                 break;
               }
 
-          if (!getfile (&inf->files[i].name, inf->name, path, buf))
+          offsets[i] = evbuffer_get_length (names);
+          if (!getfile (names, inf->name, path, buf))
             {
               result = "path";
               break;
@@ -190,6 +231,11 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
           inf->totalSize      += len;
         }
 
+      if (result == NULL)
+        setFileNames (inf, names, offsets);
+
+      tr_free (offsets);
+      evbuffer_free (names);
       evbuffer_free (buf);
       return result;
     }
@@ -201,7 +247,8 @@ parseFiles (tr_info * inf, tr_variant * files, const tr_variant * length)
       inf->isFolder         = false;
       inf->fileCount        = 1;
       inf->files            = tr_new0 (tr_file, 1);
-      inf->files[0].name    = tr_strdup (inf->name);
+      inf->fileNames        = tr_strdup (inf->name);
+      inf->files[0].name    = inf->fileNames;
       inf->files[0].length  = len;
       inf->totalSize       += len;
     }
@@ -408,6 +455,61 @@ geturllist (tr_info * inf, tr_variant * meta)
     }
 }
 
+static bool
+parseName (tr_info * inf, tr_variant * infoDict)
+{
+  size_t len = 0;
+  const char * str;
+
+  if (!tr_variantDictFindStr (infoDict, TR_KEY_name_utf_8, &str, &len))
+    if (!tr_variantDictFindStr (infoDict, TR_KEY_name, &str, &len))
+      str = "";
+  if (!str || !*str)
+    return false;
+
+  tr_free (inf->name);
+  tr_free (inf->originalName);
+  inf->name = tr_utf8clean (str, len);
+  inf->originalName = tr_strdup (inf->name);
+  return true;
+}
+
+/* the comment, creator, creation date, and private flag */
+static void
+parseDetails (tr_info * inf, tr_variant * meta, tr_variant * infoDict)
+{
+  int64_t i;
+  size_t len;
+  const char * str;
+
+  /* comment */
+  len = 0;
+  if (!tr_variantDictFindStr (meta, TR_KEY_comment_utf_8, &str, &len))
+    if (!tr_variantDictFindStr (meta, TR_KEY_comment, &str, &len))
+      str = "";
+  tr_free (inf->comment);
+  inf->comment = tr_utf8clean (str, len);
+
+  /* created by */
+  len = 0;
+  if (!tr_variantDictFindStr (meta, TR_KEY_created_by_utf_8, &str, &len))
+    if (!tr_variantDictFindStr (meta, TR_KEY_created_by, &str, &len))
+      str = "";
+  tr_free (inf->creator);
+  inf->creator = tr_utf8clean (str, len);
+
+  /* creation date */
+  if (!tr_variantDictFindInt (meta, TR_KEY_creation_date, &i))
+    i = 0;
+  inf->dateCreated = i;
+
+  /* private */
+  if (!tr_variantDictFindInt (infoDict, TR_KEY_private, &i))
+    if (!tr_variantDictFindInt (meta, TR_KEY_private, &i))
+      i = 0;
+  inf->isPrivate = i != 0;
+}
+
 static const char*
 tr_metainfoParseImpl (const tr_session  * session,
                       tr_info           * inf,
@@ -468,58 +570,36 @@ tr_metainfoParseImpl (const tr_session  * session,
     }
   else
     {
-      int len;
-      char * bstr = tr_variantToStr (infoDict, TR_VARIANT_FMT_BENC, &len);
-      tr_sha1 (inf->hash, bstr, len, NULL);
+      /* hash the serialized chains directly instead of flattening them
+       * into a string first -- the info dict includes every piece hash */
+      int n;
+      struct evbuffer_ptr pos;
+      struct evbuffer_iovec iovec;
+      struct evbuffer * buf = tr_variantToBuf (infoDict, TR_VARIANT_FMT_BENC);
+      tr_sha1_ctx_t sha = tr_sha1_init ();
+
+      evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
+      while ((n = evbuffer_peek (buf, -1, &pos, &iovec, 1)) > 0)
+        {
+          tr_sha1_update (sha, iovec.iov_base, iovec.iov_len);
+          if (evbuffer_ptr_set (buf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD))
+            break;
+        }
+
+      tr_sha1_final (sha, inf->hash);
       tr_sha1_to_hex (inf->hashString, inf->hash);
 
       if (infoDictLength != NULL)
-        *infoDictLength = len;
+        *infoDictLength = evbuffer_get_length (buf);
 
-      tr_free (bstr);
+      evbuffer_free (buf);
     }
 
   /* name */
-  if (!isMagnet)
-    {
-      len = 0;
-      if (!tr_variantDictFindStr (infoDict, TR_KEY_name_utf_8, &str, &len))
-        if (!tr_variantDictFindStr (infoDict, TR_KEY_name, &str, &len))
-          str = "";
-      if (!str || !*str)
-        return "name";
-      tr_free (inf->name);
-      tr_free (inf->originalName);
-      inf->name = tr_utf8clean (str, len);
-      inf->originalName = tr_strdup (inf->name);
-    }
-
-  /* comment */
-  len = 0;
-  if (!tr_variantDictFindStr (meta, TR_KEY_comment_utf_8, &str, &len))
-    if (!tr_variantDictFindStr (meta, TR_KEY_comment, &str, &len))
-      str = "";
-  tr_free (inf->comment);
-  inf->comment = tr_utf8clean (str, len);
-
-  /* created by */
-  len = 0;
-  if (!tr_variantDictFindStr (meta, TR_KEY_created_by_utf_8, &str, &len))
-    if (!tr_variantDictFindStr (meta, TR_KEY_created_by, &str, &len))
-      str = "";
-  tr_free (inf->creator);
-  inf->creator = tr_utf8clean (str, len);
-
-  /* creation date */
-  if (!tr_variantDictFindInt (meta, TR_KEY_creation_date, &i))
-    i = 0;
-  inf->dateCreated = i;
+  if (!isMagnet && !parseName (inf, infoDict))
+    return "name";
 
-  /* private */
-  if (!tr_variantDictFindInt (infoDict, TR_KEY_private, &i))
-    if (!tr_variantDictFindInt (meta, TR_KEY_private, &i))
-      i = 0;
-  inf->isPrivate = i != 0;
+  parseDetails (inf, meta, infoDict);
 
   /* piece length */
   if (!isMagnet)
@@ -539,8 +619,7 @@ tr_metainfoParseImpl (const tr_session  * session,
 
       inf->pieceCount = len / SHA_DIGEST_LENGTH;
       inf->pieces = tr_new0 (tr_piece, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; i++)
-        memcpy (inf->pieces[i].hash, &raw[i * SHA_DIGEST_LENGTH], SHA_DIGEST_LENGTH);
+      inf->pieceHashes = tr_memdup (raw, len);
     }
 
   /* files */
@@ -594,6 +673,106 @@ tr_metainfoParse (const tr_session * session,
   return success;
 }
 
+/* parse just `key' out of the bencoded dict `benc' and add it to `dict' */
+static void
+copyBencValue (tr_variant * dict, const void * benc, size_t benc_len, const tr_quark key)
+{
+  size_t len;
+  const void * val;
+
+  if (tr_variantBencDictFindValue (benc, benc_len, key, &val, &len))
+    {
+      tr_variant * child = tr_variantDictAdd (dict, key);
+
+      if (tr_variantFromBenc (child, val, len))
+        tr_variantDictRemove (dict, key);
+    }
+}
+
+static const char*
+tr_metainfoParseBriefImpl (tr_info * inf, tr_variant * meta, const void * benc, size_t benc_len)
+{
+  size_t i;
+  size_t len;
+  int64_t length;
+  const void * info;
+  const void * val;
+  const uint8_t * raw;
+  tr_variant pieces;
+  tr_variant * infoDict;
+  static const tr_quark meta_keys[] = { TR_KEY_announce, TR_KEY_announce_list,
+                                        TR_KEY_comment, TR_KEY_comment_utf_8,
+                                        TR_KEY_created_by, TR_KEY_created_by_utf_8,
+                                        TR_KEY_creation_date, TR_KEY_private,
+                                        TR_KEY_url_list };
+  static const tr_quark info_keys[] = { TR_KEY_length, TR_KEY_name, TR_KEY_name_utf_8,
+                                        TR_KEY_piece_length, TR_KEY_private };
+
+  if (!tr_variantBencDictFindValue (benc, benc_len, TR_KEY_info, &info, &len))
+    return "info";
+
+  /* the info dict's bytes are right here; no need to re-serialize it */
+  tr_sha1 (inf->hash, info, len, NULL);
+  tr_sha1_to_hex (inf->hashString, inf->hash);
+
+  /* a stand-in for the metainfo with just the small fields in it */
+  infoDict = tr_variantDictAddDict (meta, TR_KEY_info, TR_N_ELEMENTS (info_keys));
+  for (i=0; i<TR_N_ELEMENTS (info_keys); ++i)
+    copyBencValue (infoDict, info, len, info_keys[i]);
+  for (i=0; i<TR_N_ELEMENTS (meta_keys); ++i)
+    copyBencValue (meta, benc, benc_len, meta_keys[i]);
+
+  if (!parseName (inf, infoDict))
+    return "name";
+
+  parseDetails (inf, meta, infoDict);
+
+  if (!tr_variantDictFindInt (infoDict, TR_KEY_piece_length, &length) || (length < 1))
+    return "piece length";
+  inf->pieceSize = length;
+
+  /* the piece count only needs the hashes' length, so don't copy them */
+  if (!tr_variantBencDictFindValue (info, len, TR_KEY_pieces, &val, &i))
+    return "pieces";
+  if (tr_variantFromBencInPlace (&pieces, val, i))
+    return "pieces";
+  if (!tr_variantGetRaw (&pieces, &raw, &i) || (i % SHA_DIGEST_LENGTH))
+    i = 1;
+  tr_variantFree (&pieces);
+  if (i % SHA_DIGEST_LENGTH)
+    return "pieces";
+  inf->pieceCount = i / SHA_DIGEST_LENGTH;
+
+  /* a single file's length is at hand; adding up a folder's isn't cheap */
+  inf->isFolder = tr_variantBencDictFindValue (info, len, TR_KEY_files, &val, &i);
+  if (!inf->isFolder && tr_variantDictFindInt (infoDict, TR_KEY_length, &length))
+    inf->totalSize = length;
+
+  return getannounce (inf, meta);
+}
+
+bool
+tr_metainfoParseBrief (const void * benc, size_t benc_len, tr_info * inf)
+{
+  tr_variant meta;
+  const char * badTag;
+
+  memset (inf, 0, sizeof (tr_info));
+
+  tr_variantInitDict (&meta, 10);
+  if ((badTag = tr_metainfoParseBriefImpl (inf, &meta, benc, benc_len)) == NULL)
+    geturllist (inf, &meta);
+  tr_variantFree (&meta);
+
+  if (badTag)
+    {
+      tr_logAddNamedError (inf->name, _("Invalid metadata entry \"%s\""), badTag);
+      tr_metainfoFree (inf);
+    }
+
+  return badTag == NULL;
+}
+
 void
 tr_metainfoFree (tr_info * inf)
 {
@@ -604,11 +783,14 @@ tr_metainfoFree (tr_info * inf)
     tr_free (inf->webseeds[i]);
 
   for (ff=0; ff<inf->fileCount; ff++)
+    if (inf->files[ff].is_renamed)
       tr_free (inf->files[ff].name);
 
   tr_free (inf->webseeds);
   tr_free (inf->pieces);
+  tr_free (inf->pieceHashes);
   tr_free (inf->files);
+  tr_free (inf->fileNames);
   tr_free (inf->comment);
   tr_free (inf->creator);
   tr_free (inf->torrent);
@@ -0,0 +1,546 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <string.h> /* strlen () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h" /* tr_cacheGetWriteStats () */
+#include "error.h"
+#include "file.h"
+#include "log.h"
+#include "mem-budget.h"
+#include "metrics.h"
+#include "session.h"
+#include "utils.h"
+#include "variant.h"
+
+#define HISTOGRAM_BOUND_COUNT 8
+
+#define MY_NAME "Metrics"
+
+/* counters are bumped from the verify, delete and writer threads too,
+ * so they're updated and read with atomic ops rather than a lock */
+#ifdef _MSC_VER
+ #include <windows.h>
+ #define COUNTER_ADD(ptr, n) ((uint64_t) InterlockedExchangeAdd64 ((volatile LONG64 *) (ptr), (LONG64) (n)))
+#else
+ #define COUNTER_ADD(ptr, n) __sync_fetch_and_add ((ptr), (n))
+#endif
+#define COUNTER_GET(ptr) COUNTER_ADD ((uint64_t *) (ptr), (uint64_t) 0)
+
+enum
+{
+  DEFAULT_SLOW_CALLBACK_MSEC = 500,
+  DEFAULT_TRACE_SECONDS = 10
+};
+
+struct tr_histogram
+{
+  /* buckets[i] counts the observations <= bounds[i] that didn't fit
+     in an earlier bucket. the last one counts the rest. */
+  uint64_t buckets[HISTOGRAM_BOUND_COUNT + 1];
+  uint64_t count;
+  uint64_t sum_usec;
+};
+
+struct tr_metrics
+{
+  uint64_t counters[TR_METRIC_COUNT];
+  struct tr_histogram histograms[TR_HISTOGRAM_COUNT];
+
+  uint64_t slow_callback_usec;
+
+  /* the chrome://tracing capture, if one was asked for */
+  tr_sys_file_t trace_file;
+  uint64_t trace_until;
+  bool trace_has_events;
+};
+
+struct metric_info
+{
+  const char * name;
+  const char * help;
+};
+
+static const struct metric_info counter_info[TR_METRIC_COUNT] =
+{
+  { "transmission_handshakes_started_total", "Peer handshakes started" },
+  { "transmission_handshakes_succeeded_total", "Peer handshakes that connected" },
+  { "transmission_handshakes_failed_total", "Peer handshakes that failed" },
+  { "transmission_fd_cache_hits_total", "File checkouts served by an already-open file" },
+  { "transmission_fd_cache_misses_total", "File checkouts that had to open the file" },
+  { "transmission_verify_pieces_total", "Pieces hashed while verifying local data" },
+  { "transmission_verify_bytes_total", "Bytes read while verifying local data" },
+  { "transmission_deleted_files_total", "Files removed when deleting local data" },
+  { "transmission_deleted_bytes_total", "Bytes freed when deleting local data" },
+  { "transmission_suggests_sent_total", "Pieces suggested to peers because they were in memory" },
+  { "transmission_suggests_taken_total", "Suggested pieces that the peer went on to request" },
+  { "transmission_scrub_pieces_total", "Pieces re-hashed by the background scrub" },
+  { "transmission_scrub_bytes_total", "Bytes read by the background scrub" },
+  { "transmission_scrub_failures_total", "Pieces the background scrub found corrupt" }
+};
+
+struct histogram_info
+{
+  const char * name;
+  const char * help;
+
+  /* the name used in logs and traces */
+  const char * short_name;
+
+  uint64_t bounds_usec[HISTOGRAM_BOUND_COUNT];
+};
+
+#define CALLBACK_BOUNDS { 100, 500, 1000, 5000, 10000, 50000, 100000, 500000 }
+
+static const struct histogram_info histogram_info[TR_HISTOGRAM_COUNT] =
+{
+  { "transmission_event_loop_lag_seconds",
+    "How late the once-per-second timer fired",
+    "eventLoopLag",
+    { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 } },
+
+  { "transmission_now_timer_seconds",
+    "Time spent in each run of the session's once-per-second timer",
+    "onNowTimer", CALLBACK_BOUNDS },
+
+  { "transmission_save_timer_seconds",
+    "Time spent in each run of the session's resume-saving timer",
+    "onSaveTimer", CALLBACK_BOUNDS },
+
+  { "transmission_announcer_upkeep_seconds",
+    "Time spent in each run of the announcer's upkeep timer",
+    "onUpkeepTimer", CALLBACK_BOUNDS },
+
+  { "transmission_atom_pulse_seconds",
+    "Time spent in each peer manager atom pulse",
+    "atomPulse", CALLBACK_BOUNDS },
+
+  { "transmission_bandwidth_pulse_seconds",
+    "Time spent in each bandwidth pulse, including its reconnection pulse",
+    "bandwidthPulse", CALLBACK_BOUNDS },
+
+  { "transmission_pacing_pulse_seconds",
+    "Time spent in each run of the timer that hands out bandwidth",
+    "pacingPulse", CALLBACK_BOUNDS },
+
+  { "transmission_rechoke_pulse_seconds",
+    "Time spent in each peer manager rechoke pulse",
+    "rechokePulse", CALLBACK_BOUNDS },
+
+  { "transmission_reconnect_pulse_seconds",
+    "Time spent in each peer reconnection pulse",
+    "reconnectPulse", CALLBACK_BOUNDS },
+
+  { "transmission_refill_upkeep_seconds",
+    "Time spent in each run of the peer manager's request upkeep timer",
+    "refillUpkeep", CALLBACK_BOUNDS },
+
+  { "transmission_utp_timer_seconds",
+    "Time spent in each run of the uTP timer",
+    "utpTimer", CALLBACK_BOUNDS },
+
+  { "transmission_dht_timer_seconds",
+    "Time spent in each run of the DHT timer",
+    "dhtTimer", CALLBACK_BOUNDS }
+};
+
+/* metrics owned by other modules, gathered when they're exported */
+enum
+{
+  EXTERNAL_READ_CACHE_HITS,
+  EXTERNAL_READ_CACHE_MISSES,
+  EXTERNAL_MERGED_READS,
+  EXTERNAL_MERGED_READ_BLOCKS,
+  EXTERNAL_DISK_WRITES,
+  EXTERNAL_DISK_WRITE_BLOCKS,
+  EXTERNAL_CACHE_WRITES,
+  EXTERNAL_DOWNLOADED_BYTES,
+  EXTERNAL_UPLOADED_BYTES,
+
+  EXTERNAL_COUNT
+};
+
+static const struct metric_info external_info[EXTERNAL_COUNT] =
+{
+  { "transmission_read_cache_hits_total", "Block reads served by the read cache" },
+  { "transmission_read_cache_misses_total", "Block reads that had to go to disk" },
+  { "transmission_merged_reads_total", "Disk reads made ahead of sending blocks to peers" },
+  { "transmission_merged_read_blocks_total", "Blocks in the disk reads made ahead of sending them to peers" },
+  { "transmission_disk_writes_total", "Writes queued from the cache to disk" },
+  { "transmission_disk_write_blocks_total", "Blocks in the writes queued from the cache to disk" },
+  { "transmission_cache_writes_total", "Blocks written into the cache" },
+  { "transmission_downloaded_bytes_total", "Bytes downloaded this session" },
+  { "transmission_uploaded_bytes_total", "Bytes uploaded this session" }
+};
+
+static void
+getExternalCounters (tr_session * session, uint64_t * setme)
+{
+  size_t disk_writes;
+  size_t disk_write_blocks;
+  size_t cache_writes;
+  tr_session_stats stats;
+
+  tr_sessionGetReadCacheStats (session, &setme[EXTERNAL_READ_CACHE_HITS],
+                                        &setme[EXTERNAL_READ_CACHE_MISSES]);
+  tr_cacheGetMergedReadStats (session->cache, &setme[EXTERNAL_MERGED_READS],
+                                              &setme[EXTERNAL_MERGED_READ_BLOCKS]);
+
+  tr_cacheGetWriteStats (session->cache, &disk_writes, &disk_write_blocks, &cache_writes);
+  setme[EXTERNAL_DISK_WRITES] = disk_writes;
+  setme[EXTERNAL_DISK_WRITE_BLOCKS] = disk_write_blocks;
+  setme[EXTERNAL_CACHE_WRITES] = cache_writes;
+
+  tr_sessionGetStats (session, &stats);
+  setme[EXTERNAL_DOWNLOADED_BYTES] = stats.downloadedBytes;
+  setme[EXTERNAL_UPLOADED_BYTES] = stats.uploadedBytes;
+}
+
+static const struct metric_info run_length_info =
+{
+  "transmission_disk_write_run_blocks",
+  "Average number of contiguous blocks in each write from the cache to disk"
+};
+
+static double
+getAverageRunLength (const uint64_t * external)
+{
+  if (external[EXTERNAL_DISK_WRITES] == 0)
+    return 0;
+
+  return external[EXTERNAL_DISK_WRITE_BLOCKS] / (double)external[EXTERNAL_DISK_WRITES];
+}
+
+enum
+{
+  GAUGE_CACHE_SLAB_BYTES,
+  GAUGE_MEMORY_BUDGET_BYTES,
+  GAUGE_MEMORY_CACHE_BYTES,
+  GAUGE_MEMORY_PEER_BUFFER_BYTES,
+  GAUGE_MEMORY_METADATA_BYTES,
+  GAUGE_MEMORY_LOW,
+  GAUGE_STARTUP_READY_MSEC,
+  GAUGE_STARTUP_MSEC,
+
+  GAUGE_COUNT
+};
+
+static const struct metric_info gauge_info[GAUGE_COUNT] =
+{
+  { "transmission_cache_slab_bytes", "Memory set aside for the write cache's blocks, including ones being written to disk" },
+  { "transmission_memory_budget_bytes", "The memory budget, or 0 for no limit" },
+  { "transmission_memory_cache_bytes", "Memory used by the write and read caches" },
+  { "transmission_memory_peer_buffer_bytes", "Memory used by peers' input and output buffers" },
+  { "transmission_memory_metadata_bytes", "Memory used by partial and cached info dicts" },
+  { "transmission_memory_low", "1 if the session is over its memory budget, else 0" },
+  { "transmission_startup_ready_milliseconds", "Time from startup until the torrents were loaded, or 0 if they haven't been yet" },
+  { "transmission_startup_milliseconds", "Time from startup until the blocklists, DHT, LPD and port forwarding were up, or 0 if they aren't yet" }
+};
+
+static void
+getGauges (tr_session * session, uint64_t * setme)
+{
+  setme[GAUGE_CACHE_SLAB_BYTES] = tr_cacheGetSlabBytes (session->cache);
+  setme[GAUGE_MEMORY_BUDGET_BYTES] = tr_memBudgetGetLimit (session);
+  setme[GAUGE_MEMORY_CACHE_BYTES] = tr_memBudgetGetUsage (session, TR_MEM_CACHE);
+  setme[GAUGE_MEMORY_PEER_BUFFER_BYTES] = tr_memBudgetGetUsage (session, TR_MEM_PEER_BUFFERS);
+  setme[GAUGE_MEMORY_METADATA_BYTES] = tr_memBudgetGetUsage (session, TR_MEM_METADATA);
+  setme[GAUGE_MEMORY_LOW] = tr_memBudgetIsLow (session) ? 1 : 0;
+  setme[GAUGE_STARTUP_READY_MSEC] = session->readyMsec;
+  setme[GAUGE_STARTUP_MSEC] = session->startedMsec;
+}
+
+/***
+****
+***/
+
+static void
+traceStart (struct tr_metrics * m)
+{
+  char * filename = tr_env_get_string ("TR_TRACE_FILE", NULL);
+
+  if (filename != NULL && *filename != '\0')
+    {
+      tr_error * error = NULL;
+
+      m->trace_file = tr_sys_file_open (filename, TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE | TR_SYS_FILE_TRUNCATE,
+                                        0666, &error);
+
+      if (m->trace_file == TR_BAD_SYS_FILE)
+        {
+          tr_logAddNamedError (MY_NAME, "Couldn't create trace file \"%s\": %s", filename, error->message);
+          tr_error_free (error);
+        }
+      else
+        {
+          const int seconds = tr_env_get_int ("TR_TRACE_SECONDS", DEFAULT_TRACE_SECONDS);
+          m->trace_until = tr_metricsNow () + (uint64_t)MAX (seconds, 0) * 1000000u;
+          tr_sys_file_write_line (m->trace_file, "[", NULL);
+        }
+    }
+
+  tr_free (filename);
+}
+
+static void
+traceStop (struct tr_metrics * m)
+{
+  if (m->trace_file != TR_BAD_SYS_FILE)
+    {
+      tr_sys_file_write_line (m->trace_file, "]", NULL);
+      tr_sys_file_close (m->trace_file, NULL);
+      m->trace_file = TR_BAD_SYS_FILE;
+    }
+}
+
+/* `event' is the tail of a trace event's JSON object, after its name */
+static void
+traceAdd (struct tr_metrics * m, const char * name, uint64_t now, const char * event)
+{
+  if (m->trace_file == TR_BAD_SYS_FILE)
+    return;
+
+  if (now > m->trace_until)
+    {
+      traceStop (m);
+      return;
+    }
+
+  tr_sys_file_write_fmt (m->trace_file, "%s{\"name\":\"%s\",\"pid\":1,\"tid\":1,%s}" TR_NATIVE_EOL_STR, NULL,
+                         m->trace_has_events ? "," : "", name, event);
+  m->trace_has_events = true;
+}
+
+void
+tr_metricsInit (tr_session * session)
+{
+  struct tr_metrics * m;
+
+  assert (session->metrics == NULL);
+
+  m = tr_new0 (struct tr_metrics, 1);
+  m->slow_callback_usec = (uint64_t)MAX (0, tr_env_get_int ("TR_SLOW_CALLBACK_MSEC",
+                                                         DEFAULT_SLOW_CALLBACK_MSEC)) * 1000u;
+  m->trace_file = TR_BAD_SYS_FILE;
+  traceStart (m);
+
+  session->metrics = m;
+}
+
+void
+tr_metricsClose (tr_session * session)
+{
+  if (session->metrics != NULL)
+    traceStop (session->metrics);
+
+  tr_free (session->metrics);
+  session->metrics = NULL;
+}
+
+void
+tr_metricsAdd (tr_session * session, tr_metric metric, uint64_t n)
+{
+  assert (metric < TR_METRIC_COUNT);
+
+  if (session->metrics != NULL)
+    COUNTER_ADD (&session->metrics->counters[metric], n);
+}
+
+void
+tr_metricsObserve (tr_session * session, tr_metric_histogram histogram, uint64_t usec)
+{
+  int i;
+  struct tr_histogram * h;
+  const uint64_t * bounds;
+
+  assert (histogram < TR_HISTOGRAM_COUNT);
+
+  if (session->metrics == NULL)
+    return;
+
+  h = &session->metrics->histograms[histogram];
+  bounds = histogram_info[histogram].bounds_usec;
+
+  for (i=0; i<HISTOGRAM_BOUND_COUNT; ++i)
+    if (usec <= bounds[i])
+      break;
+
+  ++h->buckets[i];
+  ++h->count;
+  h->sum_usec += usec;
+
+  if (histogram == TR_HISTOGRAM_EVENT_LOOP_LAG)
+    {
+      char event[128];
+      const uint64_t now = tr_metricsNow ();
+      tr_snprintf (event, sizeof (event), "\"ph\":\"C\",\"ts\":%" PRIu64 ",\"args\":{\"usec\":%" PRIu64 "}",
+                   now, usec);
+      traceAdd (session->metrics, histogram_info[histogram].short_name, now, event);
+    }
+}
+
+void
+tr_metricsCallbackDone (tr_session * session, tr_metric_histogram histogram, uint64_t started)
+{
+  const uint64_t now = tr_metricsNow ();
+  const uint64_t usec = now > started ? now - started : 0;
+  const char * name = histogram_info[histogram].short_name;
+  struct tr_metrics * m = session->metrics;
+
+  assert (histogram != TR_HISTOGRAM_EVENT_LOOP_LAG);
+
+  if (m == NULL)
+    return;
+
+  tr_metricsObserve (session, histogram, usec);
+
+  if (m->slow_callback_usec > 0 && usec >= m->slow_callback_usec)
+    tr_logAddNamedInfo (MY_NAME, "%s took %" PRIu64 " msec", name, usec / 1000);
+
+  if (m->trace_file != TR_BAD_SYS_FILE)
+    {
+      char event[128];
+      tr_snprintf (event, sizeof (event), "\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64,
+                   started, usec);
+      traceAdd (m, name, now, event);
+    }
+}
+
+uint64_t
+tr_metricsNow (void)
+{
+  struct timeval tv;
+
+  tr_gettimeofday (&tv);
+
+  return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+/***
+****
+***/
+
+static tr_quark
+getKey (const char * name)
+{
+  return tr_quark_new (name, strlen (name));
+}
+
+void
+tr_metricsToVariant (tr_session * session, tr_variant * dict)
+{
+  int i;
+  uint64_t external[EXTERNAL_COUNT];
+  uint64_t gauges[GAUGE_COUNT];
+  const struct tr_metrics * m = session->metrics;
+
+  assert (m != NULL);
+
+  getExternalCounters (session, external);
+  getGauges (session, gauges);
+
+  for (i=0; i<EXTERNAL_COUNT; ++i)
+    tr_variantDictAddInt (dict, getKey (external_info[i].name), external[i]);
+
+  tr_variantDictAddReal (dict, getKey (run_length_info.name), getAverageRunLength (external));
+
+  for (i=0; i<GAUGE_COUNT; ++i)
+    tr_variantDictAddInt (dict, getKey (gauge_info[i].name), gauges[i]);
+
+  for (i=0; i<TR_METRIC_COUNT; ++i)
+    tr_variantDictAddInt (dict, getKey (counter_info[i].name), COUNTER_GET (&m->counters[i]));
+
+  for (i=0; i<TR_HISTOGRAM_COUNT; ++i)
+    {
+      int j;
+      uint64_t cumulative = 0;
+      tr_variant * d;
+      tr_variant * bounds;
+      tr_variant * buckets;
+      const struct tr_histogram * h = &m->histograms[i];
+
+      d = tr_variantDictAddDict (dict, getKey (histogram_info[i].name), 4);
+      tr_variantDictAddInt (d, getKey ("count"), h->count);
+      tr_variantDictAddInt (d, getKey ("sum_usec"), h->sum_usec);
+      bounds = tr_variantDictAddList (d, getKey ("bounds_usec"), HISTOGRAM_BOUND_COUNT);
+      buckets = tr_variantDictAddList (d, getKey ("buckets"), HISTOGRAM_BOUND_COUNT);
+
+      for (j=0; j<HISTOGRAM_BOUND_COUNT; ++j)
+        {
+          cumulative += h->buckets[j];
+          tr_variantListAddInt (bounds, histogram_info[i].bounds_usec[j]);
+          tr_variantListAddInt (buckets, cumulative);
+        }
+    }
+}
+
+static void
+addCounterText (struct evbuffer * out, const struct metric_info * info, uint64_t value)
+{
+  evbuffer_add_printf (out, "# HELP %s %s\n", info->name, info->help);
+  evbuffer_add_printf (out, "# TYPE %s counter\n", info->name);
+  evbuffer_add_printf (out, "%s %" PRIu64 "\n", info->name, value);
+}
+
+void
+tr_metricsToText (tr_session * session, struct evbuffer * out)
+{
+  int i;
+  uint64_t external[EXTERNAL_COUNT];
+  uint64_t gauges[GAUGE_COUNT];
+  const struct tr_metrics * m = session->metrics;
+
+  assert (m != NULL);
+
+  getExternalCounters (session, external);
+  getGauges (session, gauges);
+
+  for (i=0; i<EXTERNAL_COUNT; ++i)
+    addCounterText (out, &external_info[i], external[i]);
+
+  evbuffer_add_printf (out, "# HELP %s %s\n", run_length_info.name, run_length_info.help);
+  evbuffer_add_printf (out, "# TYPE %s gauge\n", run_length_info.name);
+  evbuffer_add_printf (out, "%s %g\n", run_length_info.name, getAverageRunLength (external));
+
+  for (i=0; i<GAUGE_COUNT; ++i)
+    {
+      evbuffer_add_printf (out, "# HELP %s %s\n", gauge_info[i].name, gauge_info[i].help);
+      evbuffer_add_printf (out, "# TYPE %s gauge\n", gauge_info[i].name);
+      evbuffer_add_printf (out, "%s %" PRIu64 "\n", gauge_info[i].name, gauges[i]);
+    }
+
+  for (i=0; i<TR_METRIC_COUNT; ++i)
+    addCounterText (out, &counter_info[i], COUNTER_GET (&m->counters[i]));
+
+  for (i=0; i<TR_HISTOGRAM_COUNT; ++i)
+    {
+      int j;
+      uint64_t cumulative = 0;
+      const struct histogram_info * info = &histogram_info[i];
+      const struct tr_histogram * h = &m->histograms[i];
+
+      evbuffer_add_printf (out, "# HELP %s %s\n", info->name, info->help);
+      evbuffer_add_printf (out, "# TYPE %s histogram\n", info->name);
+
+      for (j=0; j<HISTOGRAM_BOUND_COUNT; ++j)
+        {
+          cumulative += h->buckets[j];
+          evbuffer_add_printf (out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n",
+                               info->name, info->bounds_usec[j] / 1000000.0, cumulative);
+        }
+
+      evbuffer_add_printf (out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", info->name, h->count);
+      evbuffer_add_printf (out, "%s_sum %g\n", info->name, h->sum_usec / 1000000.0);
+      evbuffer_add_printf (out, "%s_count %" PRIu64 "\n", info->name, h->count);
+    }
+}
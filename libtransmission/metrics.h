@@ -0,0 +1,107 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_METRICS_H
+#define TR_METRICS_H
+
+#include <inttypes.h> /* uint64_t */
+
+struct evbuffer;
+struct tr_variant;
+
+/**
+ * Counters and histograms for the session's hot paths, so that a
+ * monitoring system can scrape them from the "session-metrics" RPC
+ * method or from the Prometheus text at $RPC_URL/metrics.
+ *
+ * They're plain integers rather than atomics: each one is only written
+ * by a single thread (the verify thread for TR_METRIC_VERIFY_*, the
+ * delete thread for TR_METRIC_DELETED_*, the libtransmission thread
+ * for everything else, including TR_METRIC_SCRUB_*), so a reader can only ever see a slightly
+ * stale value.
+ */
+
+typedef enum
+{
+  TR_METRIC_HANDSHAKES_STARTED,
+  TR_METRIC_HANDSHAKES_SUCCEEDED,
+  TR_METRIC_HANDSHAKES_FAILED,
+  TR_METRIC_FD_CACHE_HITS,
+  TR_METRIC_FD_CACHE_MISSES,
+  TR_METRIC_VERIFY_PIECES,
+  TR_METRIC_VERIFY_BYTES,
+  TR_METRIC_DELETED_FILES,
+  TR_METRIC_DELETED_BYTES,
+  TR_METRIC_SUGGESTS_SENT,
+  TR_METRIC_SUGGESTS_TAKEN,
+  TR_METRIC_SCRUB_PIECES,
+  TR_METRIC_SCRUB_BYTES,
+  TR_METRIC_SCRUB_FAILURES,
+
+  TR_METRIC_COUNT
+}
+tr_metric;
+
+typedef enum
+{
+  /* how late the once-per-second timer fires */
+  TR_HISTOGRAM_EVENT_LOOP_LAG,
+
+  /* how long each of the libtransmission thread's timers takes to run.
+     these are filled in by tr_metricsCallbackDone () */
+  TR_HISTOGRAM_NOW_TIMER,
+  TR_HISTOGRAM_SAVE_TIMER,
+  TR_HISTOGRAM_ANNOUNCER_UPKEEP,
+  TR_HISTOGRAM_ATOM_PULSE,
+  TR_HISTOGRAM_BANDWIDTH_PULSE,
+  TR_HISTOGRAM_PACING_PULSE,
+  TR_HISTOGRAM_RECHOKE_PULSE,
+  TR_HISTOGRAM_RECONNECT_PULSE,
+  TR_HISTOGRAM_REFILL_UPKEEP,
+  TR_HISTOGRAM_UTP_TIMER,
+  TR_HISTOGRAM_DHT_TIMER,
+
+  TR_HISTOGRAM_COUNT
+}
+tr_metric_histogram;
+
+void tr_metricsInit  (tr_session * session);
+
+void tr_metricsClose (tr_session * session);
+
+/** @brief bump a counter. Safe to call from any thread. */
+void tr_metricsAdd   (tr_session * session, tr_metric metric, uint64_t n);
+
+/** @brief record one observation, in microseconds */
+void tr_metricsObserve (tr_session * session, tr_metric_histogram histogram, uint64_t usec);
+
+/** @return the current time in microseconds, for timing tr_metricsObserve () spans */
+uint64_t tr_metricsNow (void);
+
+/**
+ * @brief record how long a timer callback took, given its tr_metricsNow () start.
+ *
+ * Callbacks that take longer than $TR_SLOW_CALLBACK_MSEC (default 500, 0 for never)
+ * are logged. If $TR_TRACE_FILE is set, every callback for the first
+ * $TR_TRACE_SECONDS (default 10) of the session is also written there
+ * in the chrome://tracing JSON format, along with the event loop's lag.
+ */
+void tr_metricsCallbackDone (tr_session * session, tr_metric_histogram histogram, uint64_t started);
+
+/** @brief add every metric to `dict', keyed by its Prometheus name */
+void tr_metricsToVariant (tr_session * session, struct tr_variant * dict);
+
+/** @brief add every metric to `out' in the Prometheus text exposition format */
+void tr_metricsToText (tr_session * session, struct evbuffer * out);
+
+#endif
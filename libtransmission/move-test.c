@@ -18,6 +18,7 @@
 
 #include "transmission.h"
 #include "cache.h"
+#include "delete.h"
 #include "file.h"
 #include "resume.h"
 #include "trevent.h"
@@ -215,11 +216,115 @@ test_set_location (void)
 ****
 ***/
 
+static int
+test_piece_hashes (void)
+{
+  tr_torrent * tor;
+  tr_session * session;
+  const time_t deadline = time(NULL) + 5;
+
+  /* init a stopped torrent and verify it */
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+
+  /* since it's stopped, its piece hashes get dropped afterwards */
+  while ((tor->info.pieceHashes != NULL) && (time(NULL)<=deadline))
+    tr_wait_msec (50);
+  check (tor->info.pieceHashes == NULL);
+
+  /* confirm they're read back in when they're needed again */
+  libttest_blockingTorrentVerify (tor);
+  check_int_eq (0, tr_torrentStat(tor)->leftUntilDone);
+
+  /* cleanup */
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static size_t
+count_dir_entries (const char * path)
+{
+  size_t n = 0;
+  const char * name;
+  tr_sys_dir_t odir = tr_sys_dir_open (path, NULL);
+
+  while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+    if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
+      ++n;
+
+  tr_sys_dir_close (odir, NULL);
+  return n;
+}
+
+static int
+test_remove_local_data (void)
+{
+  size_t torrents;
+  size_t files;
+  char * top;
+  char * junk;
+  char * keep;
+  char * download_dir;
+  tr_torrent * tor;
+  tr_session * session;
+  const time_t deadline = time(NULL) + 5;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  libttest_blockingTorrentVerify (tor);
+  download_dir = tr_strdup (tor->currentDir);
+
+  /* the torrent's folder holds nothing but junk, so it should go too... */
+  top = tr_buildPath (download_dir, "files-filled-with-zeroes", NULL);
+  junk = tr_buildPath (top, "Thumbs.db", NULL);
+  libtest_create_file_with_string_contents (junk, "junk");
+
+  /* ...but files that aren't the torrent's are left alone */
+  keep = tr_buildPath (download_dir, "notes.txt", NULL);
+  libtest_create_file_with_string_contents (keep, "keep");
+
+  /* the deletion happens in the background */
+  tr_torrentRemove (tor, true, NULL);
+  do
+    {
+      tr_wait_msec (50);
+      tr_deleteGetPending (session, &torrents, &files);
+    }
+  while ((torrents > 0 || tr_sys_path_exists (top, NULL)) && (time(NULL)<=deadline));
+
+  check_int_eq (0, torrents);
+  check_int_eq (0, files);
+  check (!tr_sys_path_exists (top, NULL));
+  check (tr_sys_path_exists (keep, NULL));
+  check_int_eq (1, count_dir_entries (download_dir));
+
+  /* cleanup */
+  tr_free (keep);
+  tr_free (junk);
+  tr_free (top);
+  tr_free (download_dir);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   const testFunc tests[] = { test_incomplete_dir,
-                             test_set_location };
+                             test_set_location,
+                             test_piece_hashes,
+                             test_remove_local_data };
 
   return runTests (tests, NUM_TESTS (tests));
 }
@@ -36,6 +36,13 @@
  #include <netinet/tcp.h>       /* TCP_CONGESTION */
 #endif
 
+#ifdef __linux__
+ #include <linux/netlink.h>
+ #include <linux/rtnetlink.h>
+ #include <sys/socket.h>
+ #include <unistd.h> /* close () */
+#endif
+
 #include <event2/util.h>
 
 #include <libutp/utp.h>
@@ -129,18 +136,6 @@ tr_address_from_string (tr_address * dst, const char * src)
  * >0 if a > b
  * 0  if a == b
  */
-int
-tr_address_compare (const tr_address * a, const tr_address * b)
-{
-    static const int sizes[2] = { sizeof (struct in_addr), sizeof (struct in6_addr) };
-
-    /* IPv6 addresses are always "greater than" IPv4 */
-    if (a->type != b->type)
-        return a->type == TR_AF_INET ? 1 : -1;
-
-    return memcmp (&a->addr, &b->addr, sizes[a->type]);
-}
-
 /***********************************************************************
  * TCP sockets
  **********************************************************************/
@@ -167,6 +162,56 @@ tr_netSetCongestionControl (int s UNUSED, const char *algorithm UNUSED)
 #endif
 }
 
+int
+tr_netSetCork (int s UNUSED, bool corked UNUSED)
+{
+    const int optval = corked;
+#if defined (TCP_CORK)
+    return setsockopt (s, IPPROTO_TCP, TCP_CORK, &optval, sizeof (optval));
+#elif defined (TCP_NOPUSH)
+    return setsockopt (s, IPPROTO_TCP, TCP_NOPUSH, &optval, sizeof (optval));
+#else
+    (void) optval;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tr_netSetNotSentLowat (int s UNUSED, int bytes UNUSED)
+{
+#ifdef TCP_NOTSENT_LOWAT
+    return setsockopt (s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof (bytes));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int
+tr_netGetRoundTripTime (int s UNUSED, unsigned int * setme_msec UNUSED)
+{
+#if defined (__linux__) && defined (TCP_INFO)
+    struct tcp_info info;
+    socklen_t len = sizeof (info);
+
+    if (getsockopt (s, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return -1;
+
+    /* the kernel hasn't sampled it yet */
+    if (info.tcpi_rtt == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *setme_msec = (info.tcpi_rtt + 999) / 1000;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 bool
 tr_address_from_sockaddr_storage (tr_address                     * setme_addr,
                                   tr_port                        * setme_port,
@@ -309,6 +354,8 @@ tr_netOpenPeerUTPSocket (tr_session        * session,
       struct sockaddr_storage ss;
       const socklen_t sslen = setup_sockaddr (addr, port, &ss);
       ret = UTP_Create (tr_utpSendTo, session, (struct sockaddr*)&ss, sslen);
+      if (ret != NULL)
+        tr_utpWakeTimer (session);
     }
 
   return ret;
@@ -420,14 +467,8 @@ tr_netAccept (tr_session  * session,
               tr_address  * addr,
               tr_port     * port)
 {
-    int fd = tr_fdSocketAccept (session, b, addr, port);
-
-    if (fd>=0 && evutil_make_socket_nonblocking (fd)<0) {
-        tr_netClose (session, fd);
-        fd = -1;
-    }
-
-    return fd;
+    /* the socket comes back nonblocking */
+    return tr_fdSocketAccept (session, b, addr, port);
 }
 
 void
@@ -567,18 +608,90 @@ tr_globalAddress (int af, void *addr, int *addr_len)
     }
 }
 
-/* Return our global IPv6 address, with caching. */
+/* Tell whether the host's IPv6 addresses or routes may have changed since
+   the last call. On Linux, a netlink socket subscribed to those changes is
+   drained without blocking; elsewhere, this only ever says no. */
+
+#ifdef __linux__
+
+static bool
+global_addresses_changed (void)
+{
+    static int fd = -2;
+    bool changed = false;
+    char buf[4096];
+
+    if (fd == -2)
+    {
+        struct sockaddr_nl sa;
+
+        memset (&sa, 0, sizeof (sa));
+        sa.nl_family = AF_NETLINK;
+        sa.nl_groups = RTMGRP_IPV6_IFADDR | RTMGRP_IPV6_ROUTE;
+
+        fd = socket (AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (fd >= 0 && bind (fd, (struct sockaddr*)&sa, sizeof (sa)) < 0)
+        {
+            close (fd);
+            fd = -1;
+        }
+
+        if (fd < 0)
+            tr_logAddDebug ("Couldn't watch for address changes: %s", tr_strerror (errno));
+    }
+
+    if (fd < 0)
+        return false;
+
+    /* we don't care what changed; a new lookup will tell */
+    for (;;)
+    {
+        const ssize_t n = recv (fd, buf, sizeof (buf), 0);
+
+        if (n > 0)
+            changed = true;
+        else if (n < 0 && errno == ENOBUFS)
+            changed = true; /* we missed some, so assume the worst */
+        else
+            break;
+    }
+
+    return changed;
+}
+
+#else
+
+static bool
+global_addresses_changed (void)
+{
+    return false;
+}
+
+#endif
+
+/* Return our global IPv6 address, with caching.
+   This is called for every announce and handshake, so a cached answer
+   should just be returned. Looking it up means making a socket. */
 
 const unsigned char *
 tr_globalIPv6 (void)
 {
     static unsigned char ipv6[16];
     static time_t last_time = 0;
+    static time_t last_poll = 0;
     static int have_ipv6 = 0;
     const time_t now = tr_time ();
+    bool stale = false;
 
-    /* Re-check every half hour */
+    /* Re-check every half hour, or soon after the network changes */
+    if (last_poll != now)
+        stale = global_addresses_changed ();
     if (last_time < now - 1800)
+        stale = true;
+
+    last_poll = now;
+
+    if (stale)
     {
         int addrlen = 16;
         const int rc = tr_globalAddress (AF_INET6, ipv6, &addrlen);
@@ -646,6 +759,29 @@ isMartianAddr (const struct tr_address * a)
     }
 }
 
+bool
+tr_address_is_local (const tr_address * a)
+{
+    assert (tr_address_is_valid (a));
+
+    if (a->type == TR_AF_INET)
+    {
+        const unsigned char * address = (const unsigned char*)&a->addr.addr4;
+        return (address[0] == 10) ||
+               (address[0] == 127) ||
+               (address[0] == 172 && (address[1] & 0xF0) == 16) ||
+               (address[0] == 192 && address[1] == 168) ||
+               (address[0] == 169 && address[1] == 254);
+    }
+    else
+    {
+        const unsigned char * address = (const unsigned char*)&a->addr.addr6;
+        return ((address[0] & 0xFE) == 0xFC) ||
+               isIPv6LinkLocalAddress (a) ||
+               IN6_IS_ADDR_LOOPBACK (&a->addr.addr6);
+    }
+}
+
 bool
 tr_address_is_valid_for_peers (const tr_address * addr, tr_port port)
 {
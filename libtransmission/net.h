@@ -29,6 +29,8 @@
 #ifndef _TR_NET_H_
 #define _TR_NET_H_
 
+#include <string.h> /* memcmp () */
+
 #ifdef _WIN32
  #include <inttypes.h>
  #include <ws2tcpip.h>
@@ -94,8 +96,21 @@ bool tr_address_from_sockaddr_storage (tr_address                     * setme,
                                        tr_port                        * port,
                                        const struct sockaddr_storage  * src);
 
-int tr_address_compare (const tr_address * a,
-                        const tr_address * b);
+/* inline, since sorted arrays of peers and handshakes compare these a lot */
+static inline int
+tr_address_compare (const tr_address * a,
+                    const tr_address * b)
+{
+    /* IPv6 addresses are always "greater than" IPv4 */
+    if (a->type != b->type)
+        return a->type == TR_AF_INET ? 1 : -1;
+
+    return a->type == TR_AF_INET ? memcmp (&a->addr.addr4, &b->addr.addr4, sizeof (struct in_addr))
+                                 : memcmp (&a->addr.addr6, &b->addr.addr6, sizeof (struct in6_addr));
+}
+
+/** @brief true for loopback, link-local and private-network addresses */
+bool tr_address_is_local (const tr_address * a);
 
 bool tr_address_is_valid_for_peers (const tr_address  * addr,
                                     tr_port             port);
@@ -137,6 +152,18 @@ int  tr_netSetTOS (int s,
 
 int tr_netSetCongestionControl (int s, const char *algorithm);
 
+/* while corked, the kernel holds back partial segments so that
+   separate writes can share them. uncorking sends what's left. */
+int tr_netSetCork (int s, bool corked);
+
+/* only report the socket as writable while fewer than `bytes'
+   of what's been written to it are still waiting to be sent */
+int tr_netSetNotSentLowat (int s, int bytes);
+
+/* the kernel's smoothed estimate of a TCP socket's round-trip time.
+   fails with ENOSYS where the platform doesn't expose it */
+int tr_netGetRoundTripTime (int s, unsigned int * setme_msec);
+
 void tr_netClose (tr_session * session, int s);
 
 void tr_netCloseSocket (int fd);
@@ -106,6 +106,10 @@ typedef struct tr_peer
   /* number of bad pieces they've contributed to */
   uint8_t strikes;
 
+  /* unique within the session, so clients can tell peers apart
+     from one refresh to the next even if their address is reused */
+  uint32_t id;
+
   /* how many requests the peer has made that we haven't responded to yet */
   int pendingReqsToClient;
 
@@ -115,6 +119,12 @@ typedef struct tr_peer
   /* Hook to private peer-mgr information */
   struct peer_atom * atom;
 
+  /* while super-seeding, the one piece we're offering this peer, and
+     when the peer said it had that piece. NOTE: private to peer-mgr.c */
+  bool isSuperSeeded;
+  tr_piece_index_t superSeedPiece;
+  time_t superSeedPieceDoneAt;
+
   struct tr_swarm * swarm;
 
   /** how complete the peer's copy of the torrent is. [0.0...1.0] */
@@ -133,6 +143,10 @@ typedef struct tr_peer
   tr_recentHistory cancelsSentToClient;
   tr_recentHistory cancelsSentToPeer;
 
+  /* see tr_peer_stat.stallMsec. Only peer-msgs.c's BitTorrent peers
+     keep track of these; webseeds leave them at zero */
+  uint64_t stallMsec[2][TR_PEER_STALL_COUNT];
+
   const struct tr_peer_virtual_funcs * funcs;
 }
 tr_peer;
@@ -158,6 +172,7 @@ typedef struct tr_swarm_stats
   int activeWebseedCount;
   int peerCount;
   int peerFromCount[TR_PEER_FROM__MAX];
+  uint64_t wastedBytes;
 }
 tr_swarm_stats;
 
@@ -167,6 +182,9 @@ void tr_swarmGetStats (const struct tr_swarm * swarm, tr_swarm_stats * setme);
 
 void tr_swarmIncrementActivePeers (struct tr_swarm * swarm, tr_direction direction, bool is_active);
 
+/** @brief count piece data that we'd already received from someone else */
+void tr_swarmAddWastedBytes (struct tr_swarm * swarm, size_t bytes);
+
 
 /***
 ****
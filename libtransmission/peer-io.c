@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h> /* UINT_MAX */
 #include <string.h>
 
 #include <event2/event.h>
@@ -22,6 +23,7 @@
 #include "bandwidth.h"
 #include "crypto.h"
 #include "log.h"
+#include "mem-budget.h"
 #include "net.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
 #include "peer-io.h"
@@ -37,10 +39,26 @@
  #define EPIPE        WSAECONNRESET
 #endif
 
+/* The amount of read bufferring that we allow for TCP sockets. */
+
+#define TCP_READ_BUFFER_SIZE (256 * 1024)
+
 /* The amount of read bufferring that we allow for uTP sockets. */
 
 #define UTP_READ_BUFFER_SIZE (256 * 1024)
 
+/* how much written-but-unsent data we let the kernel hold for a TCP peer.
+   anything beyond this waits in our own outbuf, where protocol messages
+   can still go ahead of it and the bandwidth limits still apply */
+#define TCP_NOTSENT_LOWAT_BYTES (128 * 1024)
+
+/* how often tr_peerIoTune () looks at a TCP peer again */
+#define TUNE_INTERVAL_SECS 5
+
+/* peers at least this far away are moved to BBR, which keeps a long
+   path full without waiting on loss the way CUBIC does */
+#define BBR_MIN_RTT_MSEC 80
+
 static size_t
 guessPacketOverhead (size_t d)
 {
@@ -193,28 +211,24 @@ canReadWrapper (tr_peerIo * io)
     if (io->canRead)
     {
         const uint64_t now = tr_time_msec ();
+        size_t pieceBytes = 0;
+        size_t protocolBytes = 0;
+        size_t overheadBytes = 0;
 
         tr_sessionLock (session);
 
+        /* tally up what's been read and charge the bandwidth tree once,
+           since each charge walks up to the session's bandwidth */
         while (!done && !err)
         {
             size_t piece = 0;
             const size_t oldLen = evbuffer_get_length (io->inbuf);
             const int ret = io->canRead (io, io->userData, &piece);
             const size_t used = oldLen - evbuffer_get_length (io->inbuf);
-            const unsigned int overhead = guessPacketOverhead (used);
-
-            if (piece || (piece!=used))
-            {
-                if (piece)
-                    tr_bandwidthUsed (&io->bandwidth, TR_DOWN, piece, true, now);
-
-                if (used != piece)
-                    tr_bandwidthUsed (&io->bandwidth, TR_DOWN, used - piece, false, now);
-            }
 
-            if (overhead > 0)
-                tr_bandwidthUsed (&io->bandwidth, TR_UP, overhead, false, now);
+            pieceBytes += piece;
+            protocolBytes += used - piece;
+            overheadBytes += guessPacketOverhead (used);
 
             switch (ret)
             {
@@ -236,6 +250,15 @@ canReadWrapper (tr_peerIo * io)
             assert (tr_isPeerIo (io));
         }
 
+        if (pieceBytes > 0)
+            tr_bandwidthUsed (&io->bandwidth, TR_DOWN, pieceBytes, true, now);
+
+        if (protocolBytes > 0)
+            tr_bandwidthUsed (&io->bandwidth, TR_DOWN, protocolBytes, false, now);
+
+        if (overheadBytes > 0)
+            tr_bandwidthUsed (&io->bandwidth, TR_UP, overheadBytes, false, now);
+
         tr_sessionUnlock (session);
     }
 
@@ -249,11 +272,11 @@ event_read_cb (evutil_socket_t fd, short event UNUSED, void * vio)
     int e;
     tr_peerIo * io = vio;
 
-    /* Limit the input buffer to 256K, so it doesn't grow too large */
+    /* Limit the input buffer, so it doesn't grow too large */
     unsigned int howmuch;
     unsigned int curlen;
     const tr_direction dir = TR_DOWN;
-    const unsigned int max = 256 * 1024;
+    const unsigned int max = TCP_READ_BUFFER_SIZE;
 
     assert (tr_isPeerIo (io));
     assert (io->socket >= 0);
@@ -311,13 +334,45 @@ tr_evbuffer_write (tr_peerIo * io, int fd, size_t howmuch)
 {
     int e;
     int n;
+    size_t total = 0;
     char errstr[256];
 
-    EVUTIL_SET_SOCKET_ERROR (0);
-    n = evbuffer_write_atmost (io->outbuf, fd, howmuch);
-    e = EVUTIL_SOCKET_ERROR ();
-    dbgmsg (io, "wrote %d to peer (%s)", n, (n==-1?tr_net_strerror (errstr,sizeof (errstr),e):""));
+    /* libevent stops at each boundary between in-memory and sendfile ()
+       chains, so keep writing until `howmuch' is done or the socket is
+       full. Cork the socket meanwhile so that a piece's header and
+       payload share segments instead of the header going out alone. */
+    const bool cork = tr_peerIoCanSendFile (io)
+                   && (evbuffer_get_contiguous_space (io->outbuf) < howmuch);
+
+    if (cork)
+        tr_netSetCork (fd, true);
+
+    for (;;)
+    {
+        EVUTIL_SET_SOCKET_ERROR (0);
+        n = evbuffer_write_atmost (io->outbuf, fd, howmuch - total);
+        e = EVUTIL_SOCKET_ERROR ();
+        dbgmsg (io, "wrote %d to peer (%s)", n, (n==-1?tr_net_strerror (errstr,sizeof (errstr),e):""));
+
+        if (n <= 0)
+            break;
+
+        total += n;
+        if (total >= howmuch)
+            break;
+    }
+
+    if (cork)
+        tr_netSetCork (fd, false);
+
+    /* to the caller, this looks like a single write */
+    if (total > 0)
+    {
+        n = total;
+        e = 0;
+    }
 
+    EVUTIL_SET_SOCKET_ERROR (e);
     return n;
 }
 
@@ -385,6 +440,136 @@ event_write_cb (evutil_socket_t fd, short event UNUSED, void * vio)
         io->gotError (io, what, io->userData);
 }
 
+#ifdef TR_IOCP
+
+/* On Windows builds configured with --enable-iocp (off by default, and
+ * not yet exercised on Windows), an incoming TCP peer's socket is driven
+ * by a bufferevent. When the event base was started with IOCP, that's
+ * an asynchronous one that keeps overlapped WSARecv () and WSASend ()
+ * calls posted instead of polling the socket. The bufferevent's own
+ * buffers sit under our inbuf and outbuf, and bytes are only moved
+ * between them within the peer's bandwidth, so the speed limits work
+ * as they do for polled sockets.
+ *
+ * Outgoing peers are still polled: tr_netOpenPeerSocket () has already
+ * called connect () on the socket, and overlapped I/O needs ConnectEx (). */
+
+static int
+bufev_read (tr_peerIo * io, size_t howmuch)
+{
+    return evbuffer_remove_buffer (bufferevent_get_input (io->bufev), io->inbuf, howmuch);
+}
+
+static void
+bufev_read_cb (struct bufferevent * bufev UNUSED, void * vio)
+{
+    int res;
+    unsigned int howmuch;
+    unsigned int curlen;
+    tr_peerIo * io = vio;
+
+    assert (tr_isPeerIo (io));
+
+    curlen = evbuffer_get_length (io->inbuf);
+    howmuch = curlen >= TCP_READ_BUFFER_SIZE ? 0 : TCP_READ_BUFFER_SIZE - curlen;
+    howmuch = tr_bandwidthClamp (&io->bandwidth, TR_DOWN, howmuch);
+
+    dbgmsg (io, "the bufferevent read some data for this peer");
+
+    /* if we don't have any bandwidth left, stop reading.
+       what's already been read waits for tr_peerIoTryRead () */
+    if (howmuch < 1) {
+        tr_peerIoSetEnabled (io, TR_DOWN, false);
+        return;
+    }
+
+    res = bufev_read (io, howmuch);
+
+    /* Invoke the user callback - must always be called last */
+    if (res > 0)
+        canReadWrapper (io);
+}
+
+/* move as much of outbuf to the bufferevent as the bandwidth allows */
+static void
+bufev_write (tr_peerIo * io)
+{
+    int res;
+    size_t howmuch;
+    struct evbuffer * output = bufferevent_get_output (io->bufev);
+
+    assert (tr_isPeerIo (io));
+
+    /* once it's this far behind, we'll hear from bufev_write_cb () */
+    if (!(io->pendingEvents & EV_WRITE) || (evbuffer_get_length (output) > TCP_NOTSENT_LOWAT_BYTES))
+        return;
+
+    io->pendingEvents &= ~EV_WRITE;
+
+    howmuch = tr_bandwidthClamp (&io->bandwidth, TR_UP, evbuffer_get_length (io->outbuf));
+
+    /* if we don't have any bandwidth left, stop writing */
+    if (howmuch < 1)
+        return;
+
+    res = evbuffer_remove_buffer (io->outbuf, output, howmuch);
+
+    if (evbuffer_get_length (io->outbuf))
+        tr_peerIoSetEnabled (io, TR_UP, true);
+
+    if (res > 0)
+        didWriteWrapper (io, res);
+}
+
+static void
+bufev_write_cb (struct bufferevent * bufev UNUSED, void * vio)
+{
+    dbgmsg (vio, "the bufferevent has room for more of this peer's data");
+
+    bufev_write (vio);
+}
+
+/* tr_peerIoSetEnabled () fires this when writing's turned on, since the
+   bufferevent only calls back as its own output drains */
+static void
+bufev_write_event_cb (evutil_socket_t fd UNUSED, short event UNUSED, void * vio)
+{
+    bufev_write (vio);
+}
+
+static void
+bufev_event_cb (struct bufferevent * bufev UNUSED, short what, void * vio)
+{
+    tr_peerIo * io = vio;
+    char errstr[512];
+    const int e = EVUTIL_SOCKET_ERROR ();
+
+    assert (tr_isPeerIo (io));
+
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)))
+        return;
+
+    dbgmsg (io, "bufev_event_cb got an error. what is %hd, errno is %d (%s)",
+            what, e, tr_net_strerror (errstr, sizeof (errstr), e));
+
+    if (io->gotError != NULL)
+        io->gotError (io, what, io->userData);
+}
+
+static void
+bufev_init (tr_peerIo * io)
+{
+    /* we close the socket ourselves in io_close_socket () */
+    io->bufev = bufferevent_socket_new (io->session->event_base, io->socket, 0);
+    bufferevent_setcb (io->bufev, bufev_read_cb, bufev_write_cb, bufev_event_cb, io);
+    bufferevent_setwatermark (io->bufev, EV_READ, 0, TCP_READ_BUFFER_SIZE);
+    bufferevent_setwatermark (io->bufev, EV_WRITE, TCP_NOTSENT_LOWAT_BYTES, 0);
+    bufferevent_enable (io->bufev, EV_WRITE);
+    io->event_write = event_new (io->session->event_base, -1, 0, bufev_write_event_cb, io);
+}
+
+#endif /* TR_IOCP */
+
 /**
 ***
 **/
@@ -608,6 +793,7 @@ tr_peerIoNew (tr_session       * session,
 
     if (socket >= 0) {
         tr_netSetTOS (socket, session->peerSocketTOS);
+        tr_netSetNotSentLowat (socket, TCP_NOTSENT_LOWAT_BYTES);
         maybeSetCongestionAlgorithm (socket, session->peer_congestion_algorithm);
     }
 
@@ -630,6 +816,11 @@ tr_peerIoNew (tr_session       * session,
     dbgmsg (io, "bandwidth is %p; its parent is %p", (void*)&io->bandwidth, (void*)parent);
     dbgmsg (io, "socket is %d, utp_socket is %p", socket, (void*)utp_socket);
 
+#ifdef TR_IOCP
+    if ((io->socket >= 0) && isIncoming) {
+        bufev_init (io);
+    } else
+#endif
     if (io->socket >= 0) {
         io->event_read = event_new (session->event_base,
                                     io->socket, EV_READ, event_read_cb, io);
@@ -710,6 +901,27 @@ event_enable (tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
+#ifdef TR_IOCP
+    if (io->bufev != NULL)
+    {
+        if ((event & EV_READ) && ! (io->pendingEvents & EV_READ))
+        {
+            dbgmsg (io, "enabling the bufferevent's reads");
+            bufferevent_enable (io->bufev, EV_READ);
+            io->pendingEvents |= EV_READ;
+        }
+
+        if ((event & EV_WRITE) && ! (io->pendingEvents & EV_WRITE))
+        {
+            dbgmsg (io, "enabling writes to the bufferevent");
+            event_active (io->event_write, EV_WRITE, 1);
+            io->pendingEvents |= EV_WRITE;
+        }
+
+        return;
+    }
+#endif
+
     if (io->socket >= 0)
     {
         assert (event_initialized (io->event_read));
@@ -740,6 +952,28 @@ event_disable (struct tr_peerIo * io, short event)
     assert (io->session != NULL);
     assert (io->session->events != NULL);
 
+#ifdef TR_IOCP
+    if (io->bufev != NULL)
+    {
+        if ((event & EV_READ) && (io->pendingEvents & EV_READ))
+        {
+            dbgmsg (io, "disabling the bufferevent's reads");
+            bufferevent_disable (io->bufev, EV_READ);
+            io->pendingEvents &= ~EV_READ;
+        }
+
+        /* what's already in the bufferevent still gets sent */
+        if ((event & EV_WRITE) && (io->pendingEvents & EV_WRITE))
+        {
+            dbgmsg (io, "disabling writes to the bufferevent");
+            event_del (io->event_write);
+            io->pendingEvents &= ~EV_WRITE;
+        }
+
+        return;
+    }
+#endif
+
     if (io->socket >= 0)
     {
         assert (event_initialized (io->event_read));
@@ -787,6 +1021,14 @@ tr_peerIoSetEnabled (tr_peerIo    * io,
 static void
 io_close_socket (tr_peerIo * io)
 {
+#ifdef TR_IOCP
+    /* free it first, so that none of its callbacks run after this */
+    if (io->bufev != NULL) {
+        bufferevent_free (io->bufev);
+        io->bufev = NULL;
+    }
+#endif
+
     if (io->socket >= 0) {
         tr_netClose (io->session, io->socket);
         io->socket = -1;
@@ -936,6 +1178,9 @@ tr_peerIoReconnect (tr_peerIo * io)
     io_close_socket (io);
 
     io->socket = tr_netOpenPeerSocket (session, &io->addr, io->port, io->isSeed);
+    io->rtt_msec = 0;
+    io->tuneTime = 0;
+    io->congestionPicked = false;
     io->event_read = event_new (session->event_base, io->socket, EV_READ, event_read_cb, io);
     io->event_write = event_new (session->event_base, io->socket, EV_WRITE, event_write_cb, io);
 
@@ -943,6 +1188,7 @@ tr_peerIoReconnect (tr_peerIo * io)
     {
         event_enable (io, pendingEvents);
         tr_netSetTOS (io->socket, session->peerSocketTOS);
+        tr_netSetNotSentLowat (io->socket, TCP_NOTSENT_LOWAT_BYTES);
         maybeSetCongestionAlgorithm (io->socket, session->peer_congestion_algorithm);
         return 0;
     }
@@ -1009,9 +1255,64 @@ getDesiredOutputBufferSize (const tr_peerIo * io, uint64_t now)
     const unsigned int period = 15u; /* arbitrary */
     /* the 3 is arbitrary; the .5 is to leave room for messages */
     static const unsigned int ceiling = (unsigned int)(MAX_BLOCK_SIZE * 3.5);
+
+    /* when the session's short on memory, just keep a few blocks queued */
+    if (tr_memBudgetIsLow (io->session))
+        return ceiling;
+
+    /* with a measured RTT, a second plus a few round trips is plenty
+       to keep the socket busy between refills */
+    if (io->rtt_msec > 0)
+    {
+        const uint64_t bytes = (uint64_t)currentSpeed_Bps * (1000u + 4u * io->rtt_msec) / 1000u;
+
+        return MAX (ceiling, (unsigned int) MIN (bytes, UINT_MAX));
+    }
+
     return MAX (ceiling, currentSpeed_Bps*period);
 }
 
+void
+tr_peerIoTune (tr_peerIo * io, time_t now)
+{
+    unsigned int rtt_msec;
+
+    assert (tr_isPeerIo (io));
+
+    if ((io->socket < 0) || (now < io->tuneTime))
+        return;
+
+    io->tuneTime = now + TUNE_INTERVAL_SECS;
+
+    if (tr_netGetRoundTripTime (io->socket, &rtt_msec) < 0)
+        return;
+
+    io->rtt_msec = rtt_msec;
+
+    if (!io->congestionPicked)
+    {
+        const char * algorithm = io->session->peer_congestion_algorithm;
+
+        io->congestionPicked = true;
+
+        if ((algorithm == NULL || !*algorithm)
+            && (rtt_msec >= BBR_MIN_RTT_MSEC)
+            && !tr_address_is_local (&io->addr))
+        {
+            if (tr_netSetCongestionControl (io->socket, "bbr") < 0)
+                dbgmsg (io, "can't switch to bbr: %s", tr_strerror (errno));
+            else
+                dbgmsg (io, "switched to bbr at %u ms RTT", rtt_msec);
+        }
+    }
+
+    /* SO_SNDBUF and SO_RCVBUF are left alone: setting either turns off
+       the kernel's auto-tuning for the socket, and a size picked from a
+       connection that's still ramping up would cap it below where the
+       kernel would have taken it. TCP_NOTSENT_LOWAT and the outbuf size
+       from rtt_msec are what keep the send side from over-queueing */
+}
+
 size_t
 tr_peerIoGetWriteBufferSpace (const tr_peerIo * io, uint64_t now)
 {
@@ -1053,21 +1354,53 @@ addDatatype (tr_peerIo * io, size_t byteCount, bool isPieceData)
     peer_io_push_datatype (io, d);
 }
 
+/* run `size' bytes of `buffer', starting at `offset', through the cipher
+   in place. The chains are peeked a handful at a time so that we neither
+   copy the data nor walk the buffer once per chain. */
 static void
-maybeEncryptBuffer (tr_peerIo * io, struct evbuffer * buf)
+processBuffer (tr_crypto        * crypto,
+               struct evbuffer  * buffer,
+               size_t             offset,
+               size_t             size,
+               void            (* callback)(tr_crypto *, size_t, const void *, void *))
 {
-    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+    struct evbuffer_ptr pos;
+    struct evbuffer_iovec iovecs[4];
+    const int n_vecs = sizeof (iovecs) / sizeof (iovecs[0]);
+
+    if (size == 0)
+        return;
+
+    evbuffer_ptr_set (buffer, &pos, offset, EVBUFFER_PTR_SET);
+
+    while (size > 0)
     {
-        struct evbuffer_ptr pos;
-        struct evbuffer_iovec iovec;
-        evbuffer_ptr_set (buf, &pos, 0, EVBUFFER_PTR_SET);
-        do {
-            evbuffer_peek (buf, -1, &pos, &iovec, 1);
-            tr_cryptoEncrypt (&io->crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
-        } while (!evbuffer_ptr_set (buf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
+        int i;
+        size_t len = 0;
+        const int n = MIN (evbuffer_peek (buffer, size, &pos, iovecs, n_vecs), n_vecs);
+
+        assert (n > 0);
+
+        for (i=0; i<n && size>0; ++i)
+        {
+            const size_t chunk = MIN (iovecs[i].iov_len, size);
+            callback (crypto, chunk, iovecs[i].iov_base, iovecs[i].iov_base);
+            len += chunk;
+            size -= chunk;
+        }
+
+        if (size > 0)
+            evbuffer_ptr_set (buffer, &pos, len, EVBUFFER_PTR_ADD);
     }
 }
 
+static void
+maybeEncryptBuffer (tr_peerIo * io, struct evbuffer * buf)
+{
+    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+        processBuffer (&io->crypto, buf, 0, evbuffer_get_length (buf), &tr_cryptoEncrypt);
+}
+
 void
 tr_peerIoWriteBuf (tr_peerIo * io, struct evbuffer * buf, bool isPieceData)
 {
@@ -1131,29 +1464,27 @@ evbuffer_add_uint64 (struct evbuffer * outbuf, uint64_t addme_hll)
 void
 tr_peerIoReadBytesToBuf (tr_peerIo * io, struct evbuffer * inbuf, struct evbuffer * outbuf, size_t byteCount)
 {
-    struct evbuffer * tmp;
     const size_t old_length = evbuffer_get_length (outbuf);
 
     assert (tr_isPeerIo (io));
     assert (evbuffer_get_length (inbuf) >= byteCount);
 
     /* append it to outbuf */
-    tmp = evbuffer_new ();
-    evbuffer_remove_buffer (inbuf, tmp, byteCount);
-    evbuffer_add_buffer (outbuf, tmp);
-    evbuffer_free (tmp);
+    evbuffer_remove_buffer (inbuf, outbuf, byteCount);
 
     /* decrypt if needed */
-    if (io->encryption_type == PEER_ENCRYPTION_RC4) {
-        struct evbuffer_ptr pos;
-        struct evbuffer_iovec iovec;
-        evbuffer_ptr_set (outbuf, &pos, old_length, EVBUFFER_PTR_SET);
-        do {
-            evbuffer_peek (outbuf, byteCount, &pos, &iovec, 1);
-            tr_cryptoDecrypt (&io->crypto, iovec.iov_len, iovec.iov_base, iovec.iov_base);
-            byteCount -= iovec.iov_len;
-        } while (!evbuffer_ptr_set (outbuf, &pos, iovec.iov_len, EVBUFFER_PTR_ADD));
-    }
+    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+        processBuffer (&io->crypto, outbuf, old_length, byteCount, &tr_cryptoDecrypt);
+}
+
+void
+tr_peerIoDecryptInPlace (tr_peerIo * io, struct evbuffer * inbuf, size_t byteCount)
+{
+    assert (tr_isPeerIo (io));
+    assert (evbuffer_get_length (inbuf) >= byteCount);
+
+    if (io->encryption_type == PEER_ENCRYPTION_RC4)
+        processBuffer (&io->crypto, inbuf, 0, byteCount, &tr_cryptoDecrypt);
 }
 
 void
@@ -1236,6 +1567,16 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
         {
             int e;
 
+#ifdef TR_IOCP
+            /* the bufferevent reports its own errors to bufev_event_cb () */
+            if (io->bufev != NULL)
+            {
+                if ((res = bufev_read (io, howmuch)) > 0)
+                    canReadWrapper (io);
+                return res;
+            }
+#endif
+
             EVUTIL_SET_SOCKET_ERROR (0);
             res = evbuffer_read (io->inbuf, io->socket, (int)howmuch);
             e = EVUTIL_SOCKET_ERROR ();
@@ -1282,6 +1623,17 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
         {
             int e;
 
+#ifdef TR_IOCP
+            /* the bufferevent reports its own errors to bufev_event_cb () */
+            if (io->bufev != NULL)
+            {
+                n = evbuffer_remove_buffer (io->outbuf, bufferevent_get_output (io->bufev), howmuch);
+                if (n > 0)
+                    didWriteWrapper (io, n);
+                return n;
+            }
+#endif
+
             EVUTIL_SET_SOCKET_ERROR (0);
             n = tr_evbuffer_write (io, io->socket, howmuch);
             e = EVUTIL_SOCKET_ERROR ();
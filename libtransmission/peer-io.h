@@ -94,6 +94,11 @@ typedef struct tr_peerIo
     uint8_t               peerId[SHA_DIGEST_LENGTH];
     time_t                timeCreated;
 
+    /* per-peer TCP tuning. see tr_peerIoTune () */
+    unsigned int          rtt_msec; /* 0 if the kernel hasn't told us */
+    time_t                tuneTime;
+    bool                  congestionPicked;
+
     tr_session          * session;
 
     tr_address            addr;
@@ -112,6 +117,11 @@ typedef struct tr_peerIo
 
     struct event        * event_read;
     struct event        * event_write;
+
+#ifdef TR_IOCP
+    /* an incoming TCP peer's overlapped reads and writes. see peer-io.c */
+    struct bufferevent  * bufev;
+#endif
 }
 tr_peerIo;
 
@@ -292,6 +302,14 @@ tr_peerIoIsEncrypted (const tr_peerIo * io)
     return (io != NULL) && (io->encryption_type == PEER_ENCRYPTION_RC4);
 }
 
+/* true if data written to this io goes to the socket unchanged,
+   so it can be sent straight from a file with sendfile () */
+static inline bool
+tr_peerIoCanSendFile (const tr_peerIo * io)
+{
+    return (io != NULL) && (io->utp_socket == NULL) && !tr_peerIoIsEncrypted (io);
+}
+
 void evbuffer_add_uint8 (struct evbuffer * outbuf, uint8_t byte);
 void evbuffer_add_uint16 (struct evbuffer * outbuf, uint16_t hs);
 void evbuffer_add_uint32 (struct evbuffer * outbuf, uint32_t hl);
@@ -323,6 +341,12 @@ void tr_peerIoReadBytes (tr_peerIo        * io,
                          void             * bytes,
                          size_t             byteCount);
 
+/* decrypts the first byteCount bytes of inbuf where they sit,
+   so the caller can move them on without copying them out first */
+void tr_peerIoDecryptInPlace (tr_peerIo        * io,
+                              struct evbuffer  * inbuf,
+                              size_t             byteCount);
+
 static inline void tr_peerIoReadUint8 (tr_peerIo        * io,
                                           struct evbuffer  * inbuf,
                                           uint8_t          * setme)
@@ -348,6 +372,19 @@ void      tr_peerIoDrain (tr_peerIo        * io,
 
 size_t    tr_peerIoGetWriteBufferSpace (const tr_peerIo * io, uint64_t now);
 
+/**
+ * @brief fit a TCP peer's socket to its measured round-trip time and speed.
+ *
+ * At most every few seconds, this reads the kernel's RTT estimate, which
+ * sizes the outbuf that tr_peerIoGetWriteBufferSpace () aims for. The
+ * socket buffers are left to the kernel's auto-tuning. On the first
+ * sample, distant peers on public addresses are
+ * switched to BBR unless the session names its own peer congestion
+ * algorithm; LAN peers keep the system default. Cheap enough to call
+ * on every peer pulse.
+ */
+void      tr_peerIoTune (tr_peerIo * io, time_t now);
+
 static inline void tr_peerIoSetParent (tr_peerIo            * io,
                                           struct tr_bandwidth  * parent)
 {
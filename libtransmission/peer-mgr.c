@@ -27,6 +27,8 @@
 #include "crypto.h"
 #include "handshake.h"
 #include "log.h"
+#include "mem-budget.h"
+#include "metrics.h"
 #include "net.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
@@ -51,9 +53,17 @@ enum
      for this many calls to rechokeUploads (). */
   OPTIMISTIC_UNCHOKE_MULTIPLIER = 4,
 
-  /* how frequently to reallocate bandwidth */
+  /* how frequently to run the bandwidth pulse's upkeep */
   BANDWIDTH_PERIOD_MSEC = 500,
 
+  /* how frequently to reallocate bandwidth. Handing it out in short
+     slices keeps rate-limited peers from sending a whole half-second's
+     allotment in one burst, which fills up the router's queues */
+  PACING_PERIOD_MSEC = 50,
+
+  /* how many of each peer's pending requests to read ahead for per pulse */
+  UPLOAD_READS_PER_PEER = 8,
+
   /* how frequently to age out old piece request lists */
   REFILL_UPKEEP_PERIOD_MSEC = (10 * 1000),
 
@@ -72,6 +82,14 @@ enum
 
   MAX_CONNECTIONS_PER_PULSE = (int)(MAX_CONNECTIONS_PER_SECOND * (RECONNECT_PERIOD_MSEC/1000.0)),
 
+  /* the most handshakes we'll have in progress at once, incoming and
+   * outgoing combined. each holds a socket and usually a DH key exchange,
+   * so this keeps a flood of incoming connections from piling up */
+  MAX_CONCURRENT_HANDSHAKES = 64,
+
+  /* outgoing handshakes leave this many slots free for incoming ones */
+  INCOMING_HANDSHAKE_RESERVE = 16,
+
   /* number of bad pieces a peer is allowed to send before we ban them */
   MAX_BAD_PIECES_PER_PEER = 5,
 
@@ -87,20 +105,47 @@ enum
    * if they try to connect to us it's okay */
   MYFLAG_UNREACHABLE = 2,
 
+  /* use for bitwise operations w/peer_atom.flags2 */
+  /* our last outgoing handshake with this peer ended up in plaintext
+   * even though we asked for encryption */
+  MYFLAG_PLAINTEXT = 4,
+
+  /* how long one torrent's PEX peer list is shared between its peers */
+  PEX_SNAPSHOT_TTL_SECS = 5,
+
+  /* how long one torrent's peer stats are shared between callers */
+  PEER_STAT_SNAPSHOT_TTL_SECS = 1,
+
   /* the minimum we'll wait before attempting to reconnect to a peer */
   MINIMUM_RECONNECT_INTERVAL_SECS = 5,
 
   /** how long we'll let requests we've made linger before we cancel them */
   REQUEST_TTL_SECS = 90,
 
+  /* smallest table for looking up a swarm's requests by block */
+  MIN_REQUEST_BUCKET_COUNT = 64,
+
   NO_BLOCKS_CANCEL_HISTORY = 120,
 
+  /* how many atoms to allocate at a time */
+  ATOM_CHUNK_SIZE = 64,
+
+  /* smallest table for looking up a swarm's atoms by address */
+  MIN_ATOM_BUCKET_COUNT = 32,
+
+  /* the longest we'll go without rescanning a swarm for peer candidates */
+  MAX_CANDIDATE_RESCAN_SECS = 30,
+
+  /* a peer with fewer than 1/SPARSE_PEER_DIVISOR of the pieces we want
+     only has those pieces walked; see pieceWalkPushShared () */
+  SPARSE_PEER_DIVISOR = 8,
+
   CANCEL_HISTORY_SEC = 60
 };
 
 const tr_peer_event TR_PEER_EVENT_INIT = { 0, 0, NULL, 0, 0, 0, 0 };
 
-const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0, 0 } };
+const tr_swarm_stats TR_SWARM_STATS_INIT = { { 0, 0 }, 0, 0, { 0, 0, 0, 0, 0, 0, 0 }, 0 };
 
 /**
 ***
@@ -122,11 +167,14 @@ struct peer_atom
   uint8_t     flags;              /* these match the added_f flags */
   uint8_t     flags2;             /* flags that aren't defined in added_f */
   int8_t      seedProbability;    /* how likely is this to be a seed... [0..100] or -1 for unknown */
-  int8_t      blocklisted;        /* -1 for unknown, true for blocklisted, false for not blocklisted */
+  bool        blocklisted;        /* only valid if blocklistGeneration matches the session's */
+  bool        utp_failed;         /* We recently failed to connect over uTP */
+  uint32_t    blocklistGeneration;
 
   tr_port     port;
-  bool        utp_failed;         /* We recently failed to connect over uTP */
   uint16_t    numFails;
+  tr_address  addr;
+
   time_t      time;               /* when the peer's connection status last changed */
   time_t      piece_data_time;
 
@@ -137,7 +185,10 @@ struct peer_atom
    * if the swarm is small, the atom will be kept past this date. */
   time_t      shelf_date;
   tr_peer   * peer;               /* will be NULL if not connected */
-  tr_address  addr;
+
+  /* next atom in the same tr_swarm::atomBuckets chain,
+   * or in tr_peerMgr::atomFreeList once it's been freed */
+  struct peer_atom * hash_next;
 };
 
 #ifdef NDEBUG
@@ -164,6 +215,11 @@ struct block_request
   tr_block_index_t block;
   tr_peer * peer;
   time_t sentAt;
+  int next; /* next request in the same bucket, or -1 */
+
+  /* neighbors in tr_swarm's list of requests by age, or -1 */
+  int older;
+  int newer;
 };
 
 struct weighted_piece
@@ -176,8 +232,7 @@ struct weighted_piece
 enum piece_sort_state
 {
   PIECES_UNSORTED,
-  PIECES_SORTED_BY_INDEX,
-  PIECES_SORTED_BY_WEIGHT
+  PIECES_SORTED_BY_WEIGHT /* tr_swarm::pieces is a valid heap */
 };
 
 /** @brief Opaque, per-torrent data structure for peer connection information */
@@ -187,6 +242,16 @@ typedef struct tr_swarm
 
   tr_ptrArray                outgoingHandshakes; /* tr_handshake */
   tr_ptrArray                pool; /* struct peer_atom */
+  struct peer_atom        ** atomBuckets; /* `pool' hashed by address */
+  int                        atomBucketCount;
+
+  /* getPeerCandidates () won't look at the pool again before this time
+     unless something happens that might make a new candidate */
+  time_t                     nextCandidateAt;
+
+  /* neighbors in tr_peerMgr::activeSwarms, if we have any peers */
+  struct tr_swarm          * activePrev;
+  struct tr_swarm          * activeNext;
   tr_ptrArray                peers; /* tr_peerMsgs */
   tr_ptrArray                webseeds; /* tr_webseed */
 
@@ -196,17 +261,37 @@ typedef struct tr_swarm
   tr_peerMsgs              * optimistic; /* the optimistic peer, or NULL if none */
   int                        optimisticUnchokeTimeScaler;
 
+  /* true if any peer was interested in us at the last rechoke */
+  bool                       peersWereInterested;
+
   bool                       isRunning;
   bool                       needsCompletenessCheck;
 
   struct block_request     * requests;
   int                        requestCount;
   int                        requestAlloc;
+  int                      * requestBuckets; /* heads of block_request::next chains */
+  int                        requestBucketCount;
+  int                        oldestRequest; /* ends of the block_request::older/newer list, or -1 */
+  int                        newestRequest;
 
   struct weighted_piece    * pieces;
   int                        pieceCount;
   enum piece_sort_state      pieceSortState;
 
+  /* In sequential mode, pieces [streamBegin, streamEnd) are the
+     read-ahead window. They go before all others, in order. */
+  tr_piece_index_t           streamBegin;
+  tr_piece_index_t           streamEnd;
+
+  /* An array of tor->info.pieceCount items holding each piece's position
+     in `pieces', or -1 if it's not there. */
+  int                      * piecePositions;
+
+  /* The same thing as a bitfield, so it can be intersected with a peer's
+     `have' bitfield a word at a time. */
+  tr_bitfield                piecesInList;
+
   /* An array of pieceCount items stating how many peers have each piece.
      This is used to help us for downloading pieces "rarest first."
      This may be NULL if we don't have metainfo yet, or if we're not
@@ -214,15 +299,35 @@ typedef struct tr_swarm
   uint16_t                 * pieceReplication;
   size_t                     pieceReplicationSize;
 
+  /* While super-seeding, an array of pieceCount items stating how many
+     peers each piece is on offer to. NULL otherwise. */
+  uint16_t                 * superSeedOffers;
+
   int                        interestedCount;
   int                        maxPeers;
   time_t                     lastCancel;
 
-  /* Before the endgame this should be 0. In endgame, is contains the average
-   * number of pending requests per peer. Only peers which have more pending
-   * requests are considered 'fast' are allowed to request a block that's
-   * already been requested from another (slower?) peer. */
-  int                        endgame;
+  /* In the endgame, a block that's already been requested may also be
+   * requested from a second peer, but only one that's been sending us
+   * piece data faster than the first. Whoever loses the race has the
+   * request cancelled as soon as the winner's copy arrives. */
+  bool                       endgame;
+
+  /* The connected peers as of pexSnapshotAt, sorted for tr_set_compare ().
+   * Every peer's PEX timer wants this list, so it's built once and shared
+   * for a few seconds instead of being rebuilt and resorted per peer. */
+  tr_pex                   * pexSnapshot;
+  tr_pex                   * pexSnapshot6;
+  int                        pexSnapshotCount;
+  int                        pexSnapshotCount6;
+  int                        pexSnapshotMax;
+  time_t                     pexSnapshotAt;
+
+  /* The peer stats as of peerStatSnapshotAt. Each client refresh asks
+   * for these, so several asking at once only fill them in once. */
+  tr_peer_stat             * peerStatSnapshot;
+  int                        peerStatSnapshotCount;
+  time_t                     peerStatSnapshotAt;
 }
 tr_swarm;
 
@@ -230,10 +335,31 @@ struct tr_peerMgr
 {
   tr_session    * session;
   tr_ptrArray     incomingHandshakes; /* tr_handshake */
+
+  /* the handshakes in all the swarms' outgoingHandshakes */
+  int             outgoingHandshakeCount;
   struct event  * bandwidthTimer;
+  struct event  * pacingTimer;
   struct event  * rechokeTimer;
   struct event  * refillUpkeepTimer;
   struct event  * atomTimer;
+
+  /* the swarms with at least one peer. Periodic per-peer work only
+     walks these, so swarms with no peers don't cost anything */
+  tr_swarm         * activeSwarms;
+
+  /* every swarm's atoms are carved out of these chunks */
+  tr_ptrArray        atomChunks;
+  struct peer_atom * atomFreeList;
+
+  /* scratch space for rechokePulse (), kept between pulses */
+  struct ChokeData       * choke;
+  int                      chokeAlloc;
+  struct tr_rechoke_info * rechoke;
+  int                      rechokeAlloc;
+
+  /* the last tr_peer.id handed out */
+  uint32_t                 lastPeerId;
 };
 
 #define tordbg(t, ...) \
@@ -297,6 +423,7 @@ tr_peerConstruct (tr_peer * peer, const tr_torrent * tor)
 
   memset (peer, 0, sizeof (tr_peer));
 
+  peer->id = ++tor->session->peerMgr->lastPeerId;
   peer->client = TR_KEY_NONE;
   peer->swarm = tor->swarm;
   tr_bitfieldConstruct (&peer->have, tor->info.pieceCount);
@@ -358,18 +485,21 @@ swarmIsLocked (const tr_swarm * swarm)
 ***
 **/
 
-static int
-handshakeCompareToAddr (const void * va, const void * vb)
+static inline const tr_address *
+getHandshakeAddr (const tr_handshake * h)
 {
-  const tr_handshake * a = va;
-
-  return tr_address_compare (tr_handshakeGetAddr (a, NULL), vb);
+  return tr_handshakeGetAddr (h, NULL);
 }
 
-static int
-handshakeCompare (const void * a, const void * b)
+/* handshakes are sorted by address. These are searched each time
+   we consider connecting to an atom, so the comparisons are inlined. */
+TR_PTR_ARRAY_SORTED_FUNCS (handshakes, tr_handshake, tr_address, getHandshakeAddr, tr_address_compare)
+
+/* how many handshakes are in progress across the whole session */
+static inline int
+getHandshakeCount (const tr_peerMgr * mgr)
 {
-  return handshakeCompareToAddr (a, tr_handshakeGetAddr (b, NULL));
+  return tr_ptrArraySize (&mgr->incomingHandshakes) + mgr->outgoingHandshakeCount;
 }
 
 static inline tr_handshake*
@@ -378,25 +508,7 @@ getExistingHandshake (tr_ptrArray * handshakes, const tr_address * addr)
   if (tr_ptrArrayEmpty (handshakes))
     return NULL;
 
-  return tr_ptrArrayFindSorted (handshakes, addr, handshakeCompareToAddr);
-}
-
-static int
-comparePeerAtomToAddress (const void * va, const void * vb)
-{
-  const struct peer_atom * a = va;
-
-  return tr_address_compare (&a->addr, vb);
-}
-
-static int
-compareAtomsByAddress (const void * va, const void * vb)
-{
-  const struct peer_atom * b = vb;
-
-  assert (tr_isAtom (b));
-
-  return comparePeerAtomToAddress (va, &b->addr);
+  return handshakesFindSorted (handshakes, addr);
 }
 
 /**
@@ -418,18 +530,179 @@ getExistingSwarm (tr_peerMgr *    manager,
   return tor == NULL ? NULL : tor->swarm;
 }
 
-static int
-peerCompare (const void * a, const void * b)
+/* a swarm's peers are sorted by address */
+TR_PTR_ARRAY_SORTED_FUNCS (peers, tr_peer, tr_address, tr_peerAddress, tr_address_compare)
+
+/**
+*** Atoms are allocated in chunks to keep them close together and to
+*** save malloc's per-allocation overhead; freed atoms are recycled.
+**/
+
+static struct peer_atom *
+atomNew (tr_peerMgr * mgr)
+{
+  struct peer_atom * atom;
+
+  if (mgr->atomFreeList == NULL)
+    {
+      int i;
+      struct peer_atom * chunk = tr_new (struct peer_atom, ATOM_CHUNK_SIZE);
+
+      tr_ptrArrayAppend (&mgr->atomChunks, chunk);
+
+      for (i=0; i<ATOM_CHUNK_SIZE; ++i)
+        {
+          chunk[i].hash_next = mgr->atomFreeList;
+          mgr->atomFreeList = &chunk[i];
+        }
+    }
+
+  atom = mgr->atomFreeList;
+  mgr->atomFreeList = atom->hash_next;
+  memset (atom, 0, sizeof (struct peer_atom));
+  return atom;
+}
+
+static void
+atomFree (tr_peerMgr * mgr, struct peer_atom * atom)
+{
+  atom->hash_next = mgr->atomFreeList;
+  mgr->atomFreeList = atom;
+}
+
+static size_t
+hashAddress (const tr_address * addr)
+{
+  size_t i;
+  size_t len;
+  const uint8_t * walk;
+  size_t h = 2166136261u;
+
+  if (addr->type == TR_AF_INET)
+    {
+      walk = (const uint8_t *) &addr->addr.addr4;
+      len = sizeof (addr->addr.addr4);
+    }
+  else
+    {
+      walk = (const uint8_t *) &addr->addr.addr6;
+      len = sizeof (addr->addr.addr6);
+    }
+
+  for (i=0; i<len; ++i)
+    h = (h ^ walk[i]) * 16777619u;
+
+  return h;
+}
+
+static inline struct peer_atom **
+getAtomBucket (const tr_swarm * s, const tr_address * addr)
+{
+  return &s->atomBuckets[hashAddress (addr) & (s->atomBucketCount - 1)];
+}
+
+/* rebuild the address index from tr_swarm::pool with a new bucket count */
+static void
+atomIndexRehash (tr_swarm * s, int bucketCount)
+{
+  int i;
+  const int n = tr_ptrArraySize (&s->pool);
+
+  tr_free (s->atomBuckets);
+  s->atomBuckets = tr_new0 (struct peer_atom *, bucketCount);
+  s->atomBucketCount = bucketCount;
+
+  for (i=0; i<n; ++i)
+    {
+      struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
+      struct peer_atom ** bucket = getAtomBucket (s, &atom->addr);
+      atom->hash_next = *bucket;
+      *bucket = atom;
+    }
+}
+
+static void
+atomIndexAdd (tr_swarm * s, struct peer_atom * atom)
 {
-  return tr_address_compare (tr_peerAddress (a), tr_peerAddress (b));
+  struct peer_atom ** bucket;
+
+  tr_ptrArrayAppend (&s->pool, atom);
+
+  if (tr_ptrArraySize (&s->pool) > s->atomBucketCount)
+    {
+      atomIndexRehash (s, MAX (MIN_ATOM_BUCKET_COUNT, s->atomBucketCount * 2));
+    }
+  else
+    {
+      bucket = getAtomBucket (s, &atom->addr);
+      atom->hash_next = *bucket;
+      *bucket = atom;
+    }
+}
+
+/* grow the address index once to fit `n' more atoms, rather than
+   doubling it over and over while they're added one at a time */
+static void
+atomIndexReserve (tr_swarm * s, size_t n)
+{
+  const size_t want = tr_ptrArraySize (&s->pool) + n;
+  int bucketCount = MAX (MIN_ATOM_BUCKET_COUNT, s->atomBucketCount);
+
+  while ((size_t)bucketCount < want)
+    bucketCount *= 2;
+
+  if (bucketCount != s->atomBucketCount)
+    atomIndexRehash (s, bucketCount);
 }
 
 static struct peer_atom*
-getExistingAtom (const tr_swarm   * cswarm,
+getExistingAtom (const tr_swarm   * s,
                  const tr_address * addr)
 {
-  tr_swarm * swarm = (tr_swarm*) cswarm;
-  return tr_ptrArrayFindSorted (&swarm->pool, addr, comparePeerAtomToAddress);
+  struct peer_atom * atom;
+
+  if (s->atomBucketCount == 0)
+    return NULL;
+
+  for (atom=*getAtomBucket (s, addr); atom!=NULL; atom=atom->hash_next)
+    if (!tr_address_compare (&atom->addr, addr))
+      return atom;
+
+  return NULL;
+}
+
+static void
+swarmSetActive (tr_swarm * s, bool active)
+{
+  tr_peerMgr * mgr = s->manager;
+
+  if (active)
+    {
+      s->activePrev = NULL;
+      s->activeNext = mgr->activeSwarms;
+      if (mgr->activeSwarms != NULL)
+        mgr->activeSwarms->activePrev = s;
+      mgr->activeSwarms = s;
+    }
+  else
+    {
+      if (s->activePrev != NULL)
+        s->activePrev->activeNext = s->activeNext;
+      else
+        mgr->activeSwarms = s->activeNext;
+
+      if (s->activeNext != NULL)
+        s->activeNext->activePrev = s->activePrev;
+
+      s->activePrev = s->activeNext = NULL;
+    }
+}
+
+/* something happened that might've made one of the atoms a peer candidate */
+static inline void
+invalidatePeerCandidates (tr_swarm * s)
+{
+  s->nextCandidateAt = 0;
 }
 
 static bool
@@ -486,6 +759,19 @@ replicationNew (tr_swarm * s)
     }
 }
 
+/* Once built, the replication counts are kept current by the peers'
+ * have/bitfield events until the swarm is stopped. */
+static const uint16_t *
+replicationGet (tr_swarm * s)
+{
+  assert (tr_torrentHasMetadata (s->tor));
+
+  if (!replicationExists (s))
+    replicationNew (s);
+
+  return s->pieceReplication;
+}
+
 static void
 swarmFree (void * vs)
 {
@@ -498,7 +784,10 @@ swarmFree (void * vs)
   assert (tr_ptrArrayEmpty (&s->peers));
 
   tr_ptrArrayDestruct (&s->webseeds, (PtrArrayForeachFunc)tr_peerFree);
-  tr_ptrArrayDestruct (&s->pool, (PtrArrayForeachFunc)tr_free);
+  while (!tr_ptrArrayEmpty (&s->pool))
+    atomFree (s->manager, tr_ptrArrayPop (&s->pool));
+  tr_ptrArrayDestruct (&s->pool, NULL);
+  tr_free (s->atomBuckets);
   tr_ptrArrayDestruct (&s->outgoingHandshakes, NULL);
   tr_ptrArrayDestruct (&s->peers, NULL);
   s->stats = TR_SWARM_STATS_INIT;
@@ -506,7 +795,13 @@ swarmFree (void * vs)
   replicationFree (s);
 
   tr_free (s->requests);
+  tr_free (s->requestBuckets);
   tr_free (s->pieces);
+  tr_free (s->piecePositions);
+  tr_bitfieldDestruct (&s->piecesInList);
+  tr_free (s->pexSnapshot);
+  tr_free (s->pexSnapshot6);
+  tr_free (s->peerStatSnapshot);
   tr_free (s);
 }
 
@@ -543,6 +838,8 @@ swarmNew (tr_peerMgr * manager, tr_torrent * tor)
   s->peers = TR_PTR_ARRAY_INIT;
   s->webseeds = TR_PTR_ARRAY_INIT;
   s->outgoingHandshakes = TR_PTR_ARRAY_INIT;
+  s->oldestRequest = -1;
+  s->newestRequest = -1;
 
   rebuildWebseedArray (s, tor);
 
@@ -557,6 +854,7 @@ tr_peerMgrNew (tr_session * session)
   tr_peerMgr * m = tr_new0 (tr_peerMgr, 1);
   m->session = session;
   m->incomingHandshakes = TR_PTR_ARRAY_INIT;
+  m->atomChunks = TR_PTR_ARRAY_INIT;
   ensureMgrTimersExist (m);
   return m;
 }
@@ -576,6 +874,7 @@ deleteTimers (struct tr_peerMgr * m)
 {
   deleteTimer (&m->atomTimer);
   deleteTimer (&m->bandwidthTimer);
+  deleteTimer (&m->pacingTimer);
   deleteTimer (&m->rechokeTimer);
   deleteTimer (&m->refillUpkeepTimer);
 }
@@ -593,6 +892,9 @@ tr_peerMgrFree (tr_peerMgr * manager)
     tr_handshakeAbort (tr_ptrArrayNth (&manager->incomingHandshakes, 0));
 
   tr_ptrArrayDestruct (&manager->incomingHandshakes, NULL);
+  tr_ptrArrayDestruct (&manager->atomChunks, tr_free);
+  tr_free (manager->choke);
+  tr_free (manager->rechoke);
 
   managerUnlock (manager);
   tr_free (manager);
@@ -608,28 +910,21 @@ tr_peerMgrOnBlocklistChanged (tr_peerMgr * mgr)
   tr_torrent * tor = NULL;
   tr_session * session = mgr->session;
 
-  /* we cache whether or not a peer is blocklisted...
-     since the blocklist has changed, erase that cached value */
+  /* the atoms' cached verdicts went stale with the session's
+     blocklist generation, but the candidate lists were built from them */
   while ((tor = tr_torrentNext (session, tor)))
-    {
-      int i;
-      tr_swarm * s = tor->swarm;
-      const int n = tr_ptrArraySize (&s->pool);
-      for (i=0; i<n; ++i)
-        {
-          struct peer_atom * atom = tr_ptrArrayNth (&s->pool, i);
-          atom->blocklisted = -1;
-        }
-    }
+    invalidatePeerCandidates (tor->swarm);
 }
 
 static bool
 isAtomBlocklisted (tr_session * session, struct peer_atom * atom)
 {
-  if (atom->blocklisted < 0)
-    atom->blocklisted = tr_sessionIsAddressBlocked (session, &atom->addr);
+  if (atom->blocklistGeneration != session->blocklistGeneration)
+    {
+      atom->blocklisted = tr_sessionIsAddressBlocked (session, &atom->addr);
+      atom->blocklistGeneration = session->blocklistGeneration;
+    }
 
-  assert (tr_isBool (atom->blocklisted));
   return atom->blocklisted;
 }
 
@@ -708,41 +1003,81 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***
 *** There are two data structures associated with managing block requests:
 ***
-*** 1. tr_swarm::requests, an array of "struct block_request" which keeps
+*** 1. tr_swarm::requests, a table of "struct block_request" which keeps
 ***    track of which blocks have been requested, and when, and by which peers.
 ***    This is list is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
-*** 2. tr_swarm::pieces, an array of "struct weighted_piece" which lists the
+*** 2. tr_swarm::pieces, a heap of "struct weighted_piece" which lists the
 ***    pieces that we want to request. It's used to decide which blocks to
 ***    return next when tr_peerMgrGetBlockRequests () is called.
 **/
 
 /**
 *** struct block_request
+***
+*** The requests live unordered in tr_swarm::requests. They're also
+*** chained by block into tr_swarm::requestBuckets so that finding the
+*** requests for a block doesn't depend on how many requests are pending,
+*** and kept in a list from oldest to newest. Requests are only ever added
+*** at the new end, so refillUpkeep () finds the ones that have timed out
+*** without looking at the rest.
 **/
 
-static int
-compareReqByBlock (const void * va, const void * vb)
+static inline int
+getRequestBucket (const tr_swarm * s, tr_block_index_t block)
+{
+  return ((size_t)block * 2654435761u) & (s->requestBucketCount - 1);
+}
+
+static void
+requestListLink (tr_swarm * s, int pos)
 {
-  const struct block_request * a = va;
-  const struct block_request * b = vb;
+  struct block_request * req = &s->requests[pos];
+  int * bucket = &s->requestBuckets[getRequestBucket (s, req->block)];
 
-  /* primary key: block */
-  if (a->block < b->block) return -1;
-  if (a->block > b->block) return 1;
+  req->next = *bucket;
+  *bucket = pos;
+}
 
-  /* secondary key: peer */
-  if (a->peer < b->peer) return -1;
-  if (a->peer > b->peer) return 1;
+/* rebuild the buckets from tr_swarm::requests with a new bucket count */
+static void
+requestListRehash (tr_swarm * s, int bucketCount)
+{
+  int i;
 
-  return 0;
+  tr_free (s->requestBuckets);
+  s->requestBuckets = tr_new (int, bucketCount);
+  s->requestBucketCount = bucketCount;
+
+  for (i=0; i<bucketCount; ++i)
+    s->requestBuckets[i] = -1;
+
+  for (i=0; i<s->requestCount; ++i)
+    requestListLink (s, i);
+}
+
+static struct block_request *
+requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
+{
+  int pos;
+
+  if (s->requestBucketCount == 0)
+    return NULL;
+
+  for (pos=s->requestBuckets[getRequestBucket (s, block)]; pos>=0; pos=s->requests[pos].next)
+    if ((s->requests[pos].block == block) && (s->requests[pos].peer == peer))
+      return &s->requests[pos];
+
+  return NULL;
 }
 
 static void
 requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
 {
-  struct block_request key;
+  struct block_request * req;
+
+  assert (requestListLookup (s, block, peer) == NULL);
 
   /* ensure enough room is available... */
   if (s->requestCount + 1 >= s->requestAlloc)
@@ -753,23 +1088,23 @@ requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
                               s->requests, s->requestAlloc);
     }
 
-  /* populate the record we're inserting */
-  key.block = block;
-  key.peer = peer;
-  key.sentAt = tr_time ();
+  /* keep the chains short */
+  if (s->requestCount >= s->requestBucketCount)
+    requestListRehash (s, MAX (MIN_REQUEST_BUCKET_COUNT, s->requestBucketCount * 2));
 
-  /* insert the request to our array... */
-  {
-    bool exact;
-    const int pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                                   sizeof (struct block_request),
-                                   compareReqByBlock, &exact);
-    assert (!exact);
-    memmove (s->requests + pos + 1,
-             s->requests + pos,
-             sizeof (struct block_request) * (s->requestCount++ - pos));
-    s->requests[pos] = key;
-  }
+  /* populate the record we're inserting */
+  req = &s->requests[s->requestCount];
+  req->block = block;
+  req->peer = peer;
+  req->sentAt = tr_time ();
+  req->older = s->newestRequest;
+  req->newer = -1;
+  if (s->newestRequest >= 0)
+    s->requests[s->newestRequest].newer = s->requestCount;
+  else
+    s->oldestRequest = s->requestCount;
+  s->newestRequest = s->requestCount;
+  requestListLink (s, s->requestCount++);
 
   if (peer != NULL)
     {
@@ -781,18 +1116,6 @@ requestListAdd (tr_swarm * s, tr_block_index_t block, tr_peer * peer)
                      (unsigned long)block, tr_atomAddrStr (peer->atom), s->requestCount); */
 }
 
-static struct block_request *
-requestListLookup (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
-{
-  struct block_request key;
-  key.block = block;
-  key.peer = (tr_peer*) peer;
-
-  return bsearch (&key, s->requests, s->requestCount,
-                  sizeof (struct block_request),
-                  compareReqByBlock);
-}
-
 /**
  * Find the peers are we currently requesting the block
  * with index @a block from and append them to @a peerArr.
@@ -801,24 +1124,14 @@ static void
 getBlockRequestPeers (tr_swarm * s, tr_block_index_t block,
                       tr_ptrArray * peerArr)
 {
-  bool exact;
-  int i, pos;
-  struct block_request key;
-
-  key.block = block;
-  key.peer = NULL;
-  pos = tr_lowerBound (&key, s->requests, s->requestCount,
-                       sizeof (struct block_request),
-                       compareReqByBlock, &exact);
+  int pos;
 
-  assert (!exact); /* shouldn't have a request with .peer == NULL */
+  if (s->requestBucketCount == 0)
+    return;
 
-  for (i=pos; i<s->requestCount; ++i)
-    {
-      if (s->requests[i].block != block)
-        break;
-      tr_ptrArrayAppend (peerArr, s->requests[i].peer);
-    }
+  for (pos=s->requestBuckets[getRequestBucket (s, block)]; pos>=0; pos=s->requests[pos].next)
+    if (s->requests[pos].block == block)
+      tr_ptrArrayAppend (peerArr, s->requests[pos].peer);
 }
 
 static void
@@ -829,6 +1142,60 @@ decrementPendingReqCount (const struct block_request * b)
       --b->peer->pendingReqsToPeer;
 }
 
+/* find the link that points at the request in position `pos' */
+static int *
+requestListFindLink (tr_swarm * s, int pos)
+{
+  int * link = &s->requestBuckets[getRequestBucket (s, s->requests[pos].block)];
+
+  while (*link != pos)
+    {
+      assert (*link >= 0);
+      link = &s->requests[*link].next;
+    }
+
+  return link;
+}
+
+/* find the age list's links to the request in position `pos' */
+static inline int *
+requestListOlderLink (tr_swarm * s, int pos)
+{
+  const int newer = s->requests[pos].newer;
+  return newer >= 0 ? &s->requests[newer].older : &s->newestRequest;
+}
+
+static inline int *
+requestListNewerLink (tr_swarm * s, int pos)
+{
+  const int older = s->requests[pos].older;
+  return older >= 0 ? &s->requests[older].newer : &s->oldestRequest;
+}
+
+/* remove the request in position `pos', filling its slot with the last request */
+static void
+requestListRemoveAt (tr_swarm * s, int pos)
+{
+  const int last = s->requestCount - 1;
+  struct block_request * b = &s->requests[pos];
+
+  assert (0 <= pos && pos < s->requestCount);
+
+  *requestListFindLink (s, pos) = b->next;
+  *requestListOlderLink (s, pos) = b->older;
+  *requestListNewerLink (s, pos) = b->newer;
+
+  if (pos != last)
+    {
+      *requestListFindLink (s, last) = pos;
+      *requestListOlderLink (s, last) = pos;
+      *requestListNewerLink (s, last) = pos;
+      s->requests[pos] = s->requests[last];
+    }
+
+  --s->requestCount;
+}
+
 static void
 requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 {
@@ -836,15 +1203,8 @@ requestListRemove (tr_swarm * s, tr_block_index_t block, const tr_peer * peer)
 
   if (b != NULL)
     {
-      const int pos = b - s->requests;
-      assert (pos < s->requestCount);
-
       decrementPendingReqCount (b);
-
-      tr_removeElementFromArray (s->requests,
-                                 pos,
-                                 sizeof (struct block_request),
-                                 s->requestCount--);
+      requestListRemoveAt (s, b - s->requests);
 
       /*fprintf (stderr, "removing request of block %lu from peer %s... "
                          "there are now %d block requests left\n",
@@ -885,31 +1245,7 @@ updateEndgame (tr_swarm * s)
 {
   assert (s->requestCount >= 0);
 
-  if (!testForEndgame (s))
-    {
-      /* not in endgame */
-      s->endgame = 0;
-    }
-  else if (!s->endgame) /* only recalculate when endgame first begins */
-    {
-      int i;
-      int numDownloading = 0;
-      const int n = tr_ptrArraySize (&s->peers);
-
-      /* add the active bittorrent peers... */
-      for (i=0; i<n; ++i)
-        {
-          const tr_peer * p = tr_ptrArrayNth (&s->peers, i);
-          if (p->pendingReqsToPeer > 0)
-            ++numDownloading;
-        }
-
-      /* add the active webseeds... */
-      numDownloading += countActiveWebseeds (s);
-
-      /* average number of pending requests per downloading peer */
-      s->endgame = s->requestCount / MAX (numDownloading, 1);
-    }
+  s->endgame = testForEndgame (s);
 }
 
 
@@ -917,6 +1253,13 @@ updateEndgame (tr_swarm * s)
 *****
 *****  Piece List Manipulation / Accessors
 *****
+*****  tr_swarm::pieces is kept as a binary min-heap ordered by
+*****  comparePieceByWeight (), and tr_swarm::piecePositions maps each
+*****  piece index to its slot in the heap (or -1 if we don't want it).
+*****  Changing one piece's weight costs O(log n); events that change many
+*****  weights at once just invalidate the heap, which is rebuilt in O(n)
+*****  the next time it's needed.
+*****
 ****/
 
 static inline void
@@ -929,14 +1272,83 @@ static const tr_torrent * weightTorrent;
 
 static const uint16_t * weightReplication;
 
+static bool weightLocality;
+
+static tr_piece_index_t weightStreamBegin;
+
+static tr_piece_index_t weightStreamEnd;
+
 static void
 setComparePieceByWeightTorrent (tr_swarm * s)
 {
-  if (!replicationExists (s))
-    replicationNew (s);
-
   weightTorrent = s->tor;
-  weightReplication = s->pieceReplication;
+  weightReplication = replicationGet (s);
+  weightLocality = tr_sessionIsPieceLocalityEnabled (s->manager->session);
+  weightStreamBegin = s->streamBegin;
+  weightStreamEnd = s->streamEnd;
+}
+
+/* slide the read-ahead window to the first piece we still need
+   at or after the streaming position */
+static void
+updateStreamingWindow (tr_swarm * s)
+{
+  tr_piece_index_t i;
+  uint64_t pieces;
+  const tr_torrent * tor = s->tor;
+  const tr_info * inf = &tor->info;
+
+  s->streamBegin = s->streamEnd = 0;
+
+  if (!tor->isSequential || inf->pieceCount == 0)
+    return;
+
+  i = MIN (tor->streamingPosition / inf->pieceSize, inf->pieceCount - 1);
+  while (i < inf->pieceCount && (inf->pieces[i].dnd || tr_torrentPieceIsComplete (tor, i)))
+    ++i;
+
+  pieces = (tor->streamingWindow + inf->pieceSize - 1) / inf->pieceSize;
+  pieces = MAX (pieces, 1);
+
+  s->streamBegin = i;
+  s->streamEnd = MIN (inf->pieceCount, i + pieces);
+}
+
+static inline bool
+pieceIsInStreamingWindow (tr_piece_index_t i)
+{
+  return weightStreamBegin <= i && i < weightStreamEnd;
+}
+
+static struct weighted_piece * pieceListLookup (tr_swarm * s, tr_piece_index_t index);
+
+/* true if we have some of the piece or are waiting on blocks in it */
+static bool
+pieceIsStarted (const tr_torrent * tor, tr_piece_index_t i)
+{
+  const struct weighted_piece * p;
+  const size_t blockCount = i + 1 == tor->info.pieceCount ? tor->blockCountInLastPiece
+                                                          : tor->blockCountInPiece;
+
+  if ((p = pieceListLookup (tor->swarm, i)) != NULL && p->requestCount > 0)
+    return true;
+
+  return tr_torrentMissingBlocksInPiece (tor, i) < blockCount;
+}
+
+/* how many of the piece's neighbors are started. Downloading next to them
+ * lets the cache flush longer runs of contiguous blocks. */
+static int
+getPieceLocality (const tr_torrent * tor, tr_piece_index_t i)
+{
+  int n = 0;
+
+  if (i > 0 && pieceIsStarted (tor, i - 1))
+    ++n;
+  if (i + 1 < tor->info.pieceCount && pieceIsStarted (tor, i + 1))
+    ++n;
+
+  return n;
 }
 
 static int
@@ -960,6 +1372,19 @@ comparePieceByWeight (const void * va, const void * vb)
   const tr_torrent * tor = weightTorrent;
   const uint16_t * rep = weightReplication;
 
+  /* the read-ahead window goes first, in the order it'll be played */
+  if (weightStreamBegin < weightStreamEnd)
+    {
+      const bool aInWindow = pieceIsInStreamingWindow (a->index);
+      const bool bInWindow = pieceIsInStreamingWindow (b->index);
+
+      if (aInWindow != bInWindow)
+        return aInWindow ? -1 : 1;
+
+      if (aInWindow)
+        return comparePieceByIndex (va, vb);
+    }
+
   /* primary key: weight */
   missing = tr_torrentMissingBlocksInPiece (tor, a->index);
   pending = a->requestCount;
@@ -986,7 +1411,16 @@ comparePieceByWeight (const void * va, const void * vb)
   if (ia < ib) return -1;
   if (ia > ib) return 1;
 
-  /* quaternary key: random */
+  /* quaternary key: next to the pieces we're already working on */
+  if (weightLocality)
+    {
+      ia = getPieceLocality (tor, a->index);
+      ib = getPieceLocality (tor, b->index);
+      if (ia > ib) return -1;
+      if (ia < ib) return 1;
+    }
+
+  /* last key: random */
   if (a->salt < b->salt) return -1;
   if (a->salt > b->salt) return 1;
 
@@ -994,23 +1428,83 @@ comparePieceByWeight (const void * va, const void * vb)
   return 0;
 }
 
+static inline bool
+pieceHeapLess (const tr_swarm * s, int a, int b)
+{
+  return comparePieceByWeight (&s->pieces[a], &s->pieces[b]) < 0;
+}
+
 static void
-pieceListSort (tr_swarm * s, enum piece_sort_state state)
+pieceHeapSwap (tr_swarm * s, int a, int b)
 {
-  assert (state==PIECES_SORTED_BY_INDEX
-       || state==PIECES_SORTED_BY_WEIGHT);
+  const struct weighted_piece tmp = s->pieces[a];
+
+  s->pieces[a] = s->pieces[b];
+  s->pieces[b] = tmp;
 
-  if (state == PIECES_SORTED_BY_WEIGHT)
+  s->piecePositions[s->pieces[a].index] = a;
+  s->piecePositions[s->pieces[b].index] = b;
+}
+
+static int
+pieceHeapSiftUp (tr_swarm * s, int pos)
+{
+  while (pos > 0)
     {
-      setComparePieceByWeightTorrent (s);
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
+      const int parent = (pos - 1) / 2;
+
+      if (!pieceHeapLess (s, pos, parent))
+        break;
+
+      pieceHeapSwap (s, pos, parent);
+      pos = parent;
     }
-  else
+
+  return pos;
+}
+
+static void
+pieceHeapSiftDown (tr_swarm * s, int pos)
+{
+  for (;;)
     {
-      qsort (s->pieces, s->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
+      int best = pos;
+      const int left = 2 * pos + 1;
+      const int right = left + 1;
+
+      if (left < s->pieceCount && pieceHeapLess (s, left, best))
+        best = left;
+      if (right < s->pieceCount && pieceHeapLess (s, right, best))
+        best = right;
+
+      if (best == pos)
+        break;
+
+      pieceHeapSwap (s, pos, best);
+      pos = best;
     }
+}
 
-  s->pieceSortState = state;
+/* restore the heap property around a piece whose weight has changed */
+static void
+pieceHeapUpdate (tr_swarm * s, int pos)
+{
+  if (pieceHeapSiftUp (s, pos) == pos)
+    pieceHeapSiftDown (s, pos);
+}
+
+static void
+pieceListSort (tr_swarm * s)
+{
+  int i;
+
+  updateStreamingWindow (s);
+  setComparePieceByWeightTorrent (s);
+
+  for (i=s->pieceCount/2 - 1; i>=0; --i)
+    pieceHeapSiftDown (s, i);
+
+  s->pieceSortState = PIECES_SORTED_BY_WEIGHT;
 }
 
 /**
@@ -1022,14 +1516,16 @@ pieceListSort (tr_swarm * s, enum piece_sort_state state)
 #define assertReplicationCountIsExact(t)
 #else
 static void
-assertWeightedPiecesAreSorted (Torrent * t)
+assertWeightedPiecesAreSorted (tr_swarm * s)
 {
-    if (!t->endgame)
+  int i;
+
+  setComparePieceByWeightTorrent (s);
+
+  for (i=1; i<s->pieceCount; ++i)
     {
-        int i;
-        setComparePieceByWeightTorrent (t);
-        for (i=0; i<t->pieceCount-1; ++i)
-            assert (comparePieceByWeight (&t->pieces[i], &t->pieces[i+1]) <= 0);
+      assert (!pieceHeapLess (s, i, (i - 1) / 2));
+      assert (s->piecePositions[s->pieces[i].index] == i);
     }
 }
 static void
@@ -1065,13 +1561,28 @@ assertReplicationCountIsExact (Torrent * t)
 static struct weighted_piece *
 pieceListLookup (tr_swarm * s, tr_piece_index_t index)
 {
-  int i;
+  int pos;
 
-  for (i=0; i<s->pieceCount; ++i)
-    if (s->pieces[i].index == index)
-      return &s->pieces[i];
+  if (s->piecePositions == NULL)
+    return NULL;
 
-  return NULL;
+  assert (index < s->tor->info.pieceCount);
+
+  pos = s->piecePositions[index];
+  return pos < 0 ? NULL : &s->pieces[pos];
+}
+
+static void
+pieceListFree (tr_swarm * s)
+{
+  tr_free (s->pieces);
+  s->pieces = NULL;
+  s->pieceCount = 0;
+
+  tr_free (s->piecePositions);
+  s->piecePositions = NULL;
+
+  tr_bitfieldDestruct (&s->piecesInList);
 }
 
 static void
@@ -1080,60 +1591,53 @@ pieceListRebuild (tr_swarm * s)
   if (!tr_torrentIsSeed (s->tor))
     {
       tr_piece_index_t i;
-      tr_piece_index_t * pool;
-      tr_piece_index_t poolCount = 0;
       const tr_torrent * tor = s->tor;
       const tr_info * inf = tr_torrentInfo (tor);
       struct weighted_piece * pieces;
-      int pieceCount;
+      int * positions;
+      int pieceCount = 0;
 
       /* build the new list */
-      pool = tr_new (tr_piece_index_t, inf->pieceCount);
+      pieces = tr_new (struct weighted_piece, inf->pieceCount);
+      positions = tr_new (int, inf->pieceCount);
       for (i=0; i<inf->pieceCount; ++i)
-        if (!inf->pieces[i].dnd)
-          if (!tr_torrentPieceIsComplete (tor, i))
-            pool[poolCount++] = i;
-      pieceCount = poolCount;
-      pieces = tr_new0 (struct weighted_piece, pieceCount);
-      for (i=0; i<poolCount; ++i)
-        {
-          struct weighted_piece * piece = pieces + i;
-          piece->index = pool[i];
-          piece->requestCount = 0;
-          piece->salt = tr_cryptoWeakRandInt (4096);
-        }
-
-      /* if we already had a list of pieces, merge it into
-       * the new list so we don't lose its requestCounts */
-      if (s->pieces != NULL)
         {
-          struct weighted_piece * o = s->pieces;
-          struct weighted_piece * oend = o + s->pieceCount;
-          struct weighted_piece * n = pieces;
-          struct weighted_piece * nend = n + pieceCount;
+          positions[i] = -1;
 
-          pieceListSort (s, PIECES_SORTED_BY_INDEX);
-
-          while (o!=oend && n!=nend)
+          if (!inf->pieces[i].dnd && !tr_torrentPieceIsComplete (tor, i))
             {
-              if (o->index < n->index)
-                ++o;
-              else if (o->index > n->index)
-                ++n;
+              struct weighted_piece * piece = pieces + pieceCount;
+              const struct weighted_piece * old = pieceListLookup (s, i);
+
+              /* if we already had this piece in the list,
+               * keep it so we don't lose its requestCount */
+              if (old != NULL)
+                {
+                  *piece = *old;
+                }
               else
-                *n++ = *o++;
-            }
+                {
+                  piece->index = i;
+                  piece->requestCount = 0;
+                  piece->salt = tr_cryptoWeakRandInt (4096);
+                }
 
-          tr_free (s->pieces);
+              positions[i] = pieceCount++;
+            }
         }
 
+      pieceListFree (s);
+
       s->pieces = pieces;
       s->pieceCount = pieceCount;
+      s->piecePositions = positions;
 
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+      tr_bitfieldConstruct (&s->piecesInList, inf->pieceCount);
+      for (i=0; i<inf->pieceCount; ++i)
+        if (positions[i] >= 0)
+          tr_bitfieldAdd (&s->piecesInList, i);
 
-      /* cleanup */
-      tr_free (pool);
+      pieceListSort (s);
     }
 }
 
@@ -1145,79 +1649,209 @@ pieceListRemovePiece (tr_swarm * s, tr_piece_index_t piece)
   if ((p = pieceListLookup (s, piece)))
     {
       const int pos = p - s->pieces;
+      const int last = --s->pieceCount;
 
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
+      s->piecePositions[piece] = -1;
+      tr_bitfieldRem (&s->piecesInList, piece);
 
       if (s->pieceCount == 0)
         {
-          tr_free (s->pieces);
-          s->pieces = NULL;
+          pieceListFree (s);
+        }
+      else if (pos != last)
+        {
+          s->pieces[pos] = s->pieces[last];
+          s->piecePositions[s->pieces[pos].index] = pos;
+
+          if (s->pieceSortState == PIECES_SORTED_BY_WEIGHT)
+            {
+              setComparePieceByWeightTorrent (s);
+              pieceHeapUpdate (s, pos);
+            }
         }
     }
 }
 
 static void
 pieceListResortPiece (tr_swarm * s, struct weighted_piece * p)
+{
+  if (p == NULL)
+    return;
+
+  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+    {
+      pieceListSort (s);
+    }
+  else
+    {
+      setComparePieceByWeightTorrent (s);
+      pieceHeapUpdate (s, p - s->pieces);
+    }
+
+  assertWeightedPiecesAreSorted (s);
+}
+
+/* a piece has been started or given up on, so its neighbors' locality changed */
+static void
+pieceListResortNeighbors (tr_swarm * s, tr_piece_index_t index)
+{
+  if (!tr_sessionIsPieceLocalityEnabled (s->manager->session))
+    return;
+
+  if (index > 0)
+    pieceListResortPiece (s, pieceListLookup (s, index - 1));
+  if (index + 1 < s->tor->info.pieceCount)
+    pieceListResortPiece (s, pieceListLookup (s, index + 1));
+}
+
+static void
+pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
+{
+  struct weighted_piece * p;
+  const tr_piece_index_t index = tr_torBlockPiece (s->tor, block);
+
+  if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
+    {
+      const bool abandoned = --p->requestCount == 0;
+
+      /* this moves the piece, so `p' no longer points to it afterwards */
+      pieceListResortPiece (s, p);
+
+      if (abandoned)
+        pieceListResortNeighbors (s, index);
+    }
+}
+
+struct piece_request_count
+{
+  tr_piece_index_t index;
+  int16_t requestCount;
+};
+
+/**
+ * Visits the heap in weight order without modifying it: the next-best
+ * piece is always the best one among the children of pieces already
+ * visited, so we keep those candidates in a small heap of their own.
+ */
+struct piece_walk
+{
+  int * positions;
+  int count;
+  int alloc;
+
+  /* if true, only the pieces that were pushed are visited */
+  bool pushed_only;
+};
+
+static inline bool
+pieceWalkLess (const tr_swarm * s, const struct piece_walk * w, int a, int b)
+{
+  return pieceHeapLess (s, w->positions[a], w->positions[b]);
+}
+
+static void
+pieceWalkSwap (struct piece_walk * w, int a, int b)
+{
+  const int tmp = w->positions[a];
+  w->positions[a] = w->positions[b];
+  w->positions[b] = tmp;
+}
+
+static void
+pieceWalkPush (const tr_swarm * s, struct piece_walk * w, int heap_pos)
 {
   int pos;
-  bool isSorted = true;
 
-  if (p == NULL)
+  if (heap_pos >= s->pieceCount)
     return;
 
-  /* is the torrent already sorted? */
-  pos = p - s->pieces;
-  setComparePieceByWeightTorrent (s);
-  if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-    isSorted = false;
-  if (isSorted && (pos < s->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-    isSorted = false;
+  if (w->count == w->alloc)
+    {
+      w->alloc = w->alloc ? w->alloc * 2 : 64;
+      w->positions = tr_renew (int, w->positions, w->alloc);
+    }
 
-  if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
+  pos = w->count++;
+  w->positions[pos] = heap_pos;
+
+  while (pos > 0 && pieceWalkLess (s, w, pos, (pos - 1) / 2))
     {
-      pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
-      isSorted = true;
+      pieceWalkSwap (w, pos, (pos - 1) / 2);
+      pos = (pos - 1) / 2;
     }
+}
 
-  /* if it's not sorted, move it around */
-  if (!isSorted)
+/* returns the heap position of the next piece, or -1 when done */
+static int
+pieceWalkNext (const tr_swarm * s, struct piece_walk * w)
+{
+  int pos;
+  int heap_pos;
+
+  if (w->count == 0)
+    return -1;
+
+  heap_pos = w->positions[0];
+  w->positions[0] = w->positions[--w->count];
+
+  pos = 0;
+  for (;;)
     {
-      bool exact;
-      const struct weighted_piece tmp = *p;
+      int best = pos;
+      const int left = 2 * pos + 1;
+      const int right = left + 1;
 
-      tr_removeElementFromArray (s->pieces,
-                                 pos,
-                                 sizeof (struct weighted_piece),
-                                 s->pieceCount--);
+      if (left < w->count && pieceWalkLess (s, w, left, best))
+        best = left;
+      if (right < w->count && pieceWalkLess (s, w, right, best))
+        best = right;
 
-      pos = tr_lowerBound (&tmp, s->pieces, s->pieceCount,
-                           sizeof (struct weighted_piece),
-                           comparePieceByWeight, &exact);
+      if (best == pos)
+        break;
 
-      memmove (&s->pieces[pos + 1],
-               &s->pieces[pos],
-               sizeof (struct weighted_piece) * (s->pieceCount++ - pos));
+      pieceWalkSwap (w, pos, best);
+      pos = best;
+    }
 
-      s->pieces[pos] = tmp;
+  if (!w->pushed_only)
+    {
+      pieceWalkPush (s, w, 2 * heap_pos + 1);
+      pieceWalkPush (s, w, 2 * heap_pos + 2);
     }
 
-  assertWeightedPiecesAreSorted (s);
+  return heap_pos;
 }
 
-static void
-pieceListRemoveRequest (tr_swarm * s, tr_block_index_t block)
+/**
+ * Sets up a walk of just the pieces in the list that `have' has too.
+ * A peer missing most of the pieces we want would otherwise make the
+ * walk visit all the ones it can't give us before reaching the ones it
+ * can, so for those peers it's cheaper to find them in the bitfields.
+ * @return false, leaving the walk empty, if there are more than `limit'
+ */
+static bool
+pieceWalkPushShared (const tr_swarm        * s,
+                     struct piece_walk     * w,
+                     const tr_bitfield     * have,
+                     int                     limit)
 {
-  struct weighted_piece * p;
-  const tr_piece_index_t index = tr_torBlockPiece (s->tor, block);
+  const size_t n = s->tor->info.pieceCount;
+  size_t i = 0;
 
-  if (((p = pieceListLookup (s, index))) && (p->requestCount > 0))
+  while ((i = tr_bitfieldFirstAnd (have, &s->piecesInList, i, n)) < n)
     {
-      --p->requestCount;
-      pieceListResortPiece (s, p);
+      if (w->count == limit)
+        {
+          w->count = 0;
+          return false;
+        }
+
+      pieceWalkPush (s, w, s->piecePositions[i]);
+      ++i;
     }
+
+  w->pushed_only = true;
+  return true;
 }
 
 
@@ -1331,9 +1965,14 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
 {
   int i;
   int got;
+  int pos;
   tr_swarm * s;
-  struct weighted_piece * pieces;
+  struct piece_walk walk;
+  struct piece_request_count * touched;
+  int touchedCount = 0;
   const tr_bitfield * const have = &peer->have;
+  unsigned int peerSpeed_Bps = 0;
+  const uint64_t now = tr_time_msec ();
 
   /* sanity clause */
   assert (tr_isTorrent (tor));
@@ -1348,16 +1987,33 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
     pieceListRebuild (s);
 
   if (s->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    pieceListSort (s, PIECES_SORTED_BY_WEIGHT);
+    pieceListSort (s);
 
   assertReplicationCountIsExact (s);
   assertWeightedPiecesAreSorted (s);
 
   updateEndgame (s);
-  pieces = s->pieces;
-  for (i=0; i<s->pieceCount && got<numwant; ++i)
+
+  /* a peer that isn't sending us anything can't beat anyone to a block */
+  if (s->endgame)
+    peerSpeed_Bps = tr_peerGetPieceSpeed_Bps (peer, now, TR_DOWN);
+
+  /* every piece we touch gets at least one new interval or block */
+  touched = tr_new (struct piece_request_count, numwant);
+  memset (&walk, 0, sizeof (walk));
+  setComparePieceByWeightTorrent (s);
+  if (tr_bitfieldHasAll (have)
+      || !pieceWalkPushShared (s, &walk, have, s->pieceCount / SPARSE_PEER_DIVISOR))
+    pieceWalkPush (s, &walk, 0);
+
+  while (got<numwant && ((pos = pieceWalkNext (s, &walk)) >= 0))
     {
-      struct weighted_piece * p = pieces + i;
+      struct weighted_piece * p = s->pieces + pos;
+
+      /* outside the endgame, a piece can't have more requests than it
+         has missing blocks. If it's got that many, it's all spoken for */
+      if (!s->endgame && p->requestCount >= (int) tr_torrentMissingBlocksInPiece (tor, p->index))
+        continue;
 
       /* if the peer has this piece that we want... */
       if (tr_bitfieldHas (have, p->index))
@@ -1365,6 +2021,7 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
           tr_block_index_t b;
           tr_block_index_t first;
           tr_block_index_t last;
+          const int16_t oldRequestCount = p->requestCount;
           tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
 
           tr_torGetPieceBlockRange (tor, p->index, &first, &last);
@@ -1397,9 +2054,9 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
                     continue;
 
                   /* in the endgame allow an additional peer to download a
-                     block but only if the peer seems to be handling requests
-                     relatively fast */
-                  if (peer->pendingReqsToPeer + numwant - got < s->endgame)
+                     block but only if it's been delivering faster than
+                     the peer that already has the request */
+                  if (peerSpeed_Bps <= tr_peerGetPieceSpeed_Bps (peers[0], now, TR_DOWN))
                     continue;
                 }
 
@@ -1427,41 +2084,36 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
               ++p->requestCount;
             }
 
+          if (p->requestCount != oldRequestCount)
+            {
+              assert (touchedCount < numwant);
+              touched[touchedCount].index = p->index;
+              touched[touchedCount].requestCount = p->requestCount;
+              p->requestCount = oldRequestCount;
+              ++touchedCount;
+            }
+
           tr_ptrArrayDestruct (&peerArr, NULL);
         }
     }
 
-  /* In most cases we've just changed the weights of a small number of pieces.
-   * So rather than qsort ()ing the entire array, it's faster to apply an
-   * adaptive insertion sort algorithm. */
-  if (got > 0)
+  /* The walk needed the heap to stay put, so the new request counts were
+   * held back. Apply them one at a time now; each is an O(log n) fixup. */
+  for (i=0; i<touchedCount; ++i)
     {
-      /* not enough requests || last piece modified */
-      if (i == s->pieceCount)
-        --i;
+      struct weighted_piece * p = pieceListLookup (s, touched[i].index);
+      const bool started = p->requestCount == 0;
+      p->requestCount = touched[i].requestCount;
+      pieceHeapUpdate (s, p - s->pieces);
 
-      setComparePieceByWeightTorrent (s);
-      while (--i >= 0)
-        {
-          bool exact;
-
-          /* relative position! */
-          const int newpos = tr_lowerBound (&s->pieces[i], &s->pieces[i + 1],
-                                            s->pieceCount - (i + 1),
-                                            sizeof (struct weighted_piece),
-                                            comparePieceByWeight, &exact);
-          if (newpos > 0)
-            {
-              const struct weighted_piece piece = s->pieces[i];
-              memmove (&s->pieces[i],
-                       &s->pieces[i + 1],
-                       sizeof (struct weighted_piece) * (newpos));
-              s->pieces[i + newpos] = piece;
-            }
-        }
+      if (started)
+        pieceListResortNeighbors (s, touched[i].index);
     }
 
-  assertWeightedPiecesAreSorted (t);
+  tr_free (touched);
+  tr_free (walk.positions);
+
+  assertWeightedPiecesAreSorted (s);
   *numgot = got;
 }
 
@@ -1473,6 +2125,12 @@ tr_peerMgrDidPeerRequest (const tr_torrent  * tor,
   return requestListLookup ((tr_swarm*)tor->swarm, block, peer) != NULL;
 }
 
+bool
+tr_peerMgrIsEndgame (const tr_torrent * tor)
+{
+  return (tor->swarm != NULL) && testForEndgame (tor->swarm);
+}
+
 /* cancel requests that are too old */
 static void
 refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
@@ -1480,72 +2138,61 @@ refillUpkeep (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
     time_t now;
     time_t too_old;
     tr_torrent * tor;
-    int cancel_buflen = 0;
-    struct block_request * cancel = NULL;
     tr_peerMgr * mgr = vmgr;
+    const uint64_t started = tr_metricsNow ();
     managerLock (mgr);
 
     now = tr_time ();
     too_old = now - REQUEST_TTL_SECS;
 
-    /* alloc the temporary "cancel" buffer */
-    tor = NULL;
-    while ((tor = tr_torrentNext (mgr->session, tor)))
-        cancel_buflen = MAX (cancel_buflen, tor->swarm->requestCount);
-    if (cancel_buflen > 0)
-        cancel = tr_new (struct block_request, cancel_buflen);
-
-    /* prune requests that are too old */
+    /* prune requests that are too old.
+       they're the ones at the old end of each swarm's age list */
     tor = NULL;
     while ((tor = tr_torrentNext (mgr->session, tor)))
     {
+        int pos;
+        int expiredCount = 0;
+        int cancelCount = 0;
+        struct block_request * cancel;
+        const struct block_request * it;
+        const struct block_request * end;
         tr_swarm * s = tor->swarm;
-        const int n = s->requestCount;
-        if (n > 0)
-        {
-            int keepCount = 0;
-            int cancelCount = 0;
-            const struct block_request * it;
-            const struct block_request * end;
-
-            for (it=s->requests, end=it+n; it!=end; ++it)
-            {
-                tr_peerMsgs * msgs = PEER_MSGS(it->peer);
 
-                if ((msgs !=NULL) && (it->sentAt <= too_old) && !tr_peerMsgsIsReadingBlock (msgs, it->block))
-                    cancel[cancelCount++] = *it;
-                else
-                {
-                    if (it != &s->requests[keepCount])
-                        s->requests[keepCount] = *it;
-                    keepCount++;
-                }
-            }
+        for (pos=s->oldestRequest; pos>=0 && s->requests[pos].sentAt<=too_old; pos=s->requests[pos].newer)
+            ++expiredCount;
+        if (expiredCount == 0)
+            continue;
 
-            /* prune out the ones we aren't keeping */
-            s->requestCount = keepCount;
+        /* the blocks that are being read right now are left alone */
+        cancel = tr_new (struct block_request, expiredCount);
+        for (pos=s->oldestRequest; pos>=0 && s->requests[pos].sentAt<=too_old; pos=s->requests[pos].newer)
+        {
+            const struct block_request * req = &s->requests[pos];
+            tr_peerMsgs * msgs = PEER_MSGS(req->peer);
 
-            /* send cancel messages for all the "cancel" ones */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-            {
-              tr_peerMsgs * msgs = PEER_MSGS(it->peer);
+            if ((msgs != NULL) && !tr_peerMsgsIsReadingBlock (msgs, req->block))
+                cancel[cancelCount++] = *req;
+        }
 
-              if (msgs != NULL)
-                {
-                  tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
-                  tr_peerMsgsCancel (msgs, it->block);
-                  decrementPendingReqCount (it);
-                }
-            }
+        /* send cancel messages for all the "cancel" ones */
+        for (it=cancel, end=it+cancelCount; it!=end; ++it)
+        {
+            tr_peerMsgs * msgs = PEER_MSGS(it->peer);
 
-            /* decrement the pending request counts for the timed-out blocks */
-            for (it=cancel, end=it+cancelCount; it!=end; ++it)
-                pieceListRemoveRequest (s, it->block);
+            tr_historyAdd (&it->peer->cancelsSentToPeer, now, 1);
+            tr_peerMsgsCancel (msgs, it->block);
+            requestListRemove (s, it->block, it->peer);
         }
+
+        /* decrement the pending request counts for the timed-out blocks */
+        for (it=cancel, end=it+cancelCount; it!=end; ++it)
+            pieceListRemoveRequest (s, it->block);
+
+        tr_free (cancel);
     }
 
-    tr_free (cancel);
     tr_timerAddMsec (mgr->refillUpkeepTimer, REFILL_UPKEEP_PERIOD_MSEC);
+    tr_metricsCallbackDone (mgr->session, TR_HISTOGRAM_REFILL_UPKEEP, started);
     managerUnlock (mgr);
 }
 
@@ -1694,6 +2341,192 @@ tr_peerMgrPieceCompleted (tr_torrent * tor, tr_piece_index_t p)
   /* bookkeeping */
   pieceListRemovePiece (s, p);
   s->needsCompletenessCheck = true;
+
+  /* the read-ahead window moves on past this piece */
+  if (p == s->streamBegin && s->streamBegin < s->streamEnd)
+    invalidatePieceSorting (s);
+}
+
+/***
+****
+****  Super-seeding, as described in BEP 16.
+****
+****  A super-seeded peer is told that we have nothing, then about one
+****  piece at a time. It's offered another once its last piece has been
+****  seen at some other peer -- that is, once it's passed the piece on --
+****  so our upload goes to pieces the swarm doesn't have yet instead of
+****  to copies of ones it already does.
+****
+***/
+
+enum
+{
+  /* if nobody else picks up a super-seeded peer's piece in this long,
+     offer it another one anyway so that it doesn't sit idle */
+  SUPER_SEED_PATIENCE_SECS = 120
+};
+
+static void
+superSeedClearOffer (tr_swarm * s, tr_peer * peer)
+{
+  if (peer->superSeedPiece < s->tor->info.pieceCount)
+    --s->superSeedOffers[peer->superSeedPiece];
+
+  peer->superSeedPiece = s->tor->info.pieceCount;
+  peer->superSeedPieceDoneAt = 0;
+}
+
+/* The rarest piece that the peer doesn't have, preferring the ones
+ * that aren't on offer to other peers. The search starts at a random
+ * piece so that ties don't all go to the torrent's first pieces. */
+static tr_piece_index_t
+superSeedPickPiece (tr_swarm * s, const tr_peer * peer)
+{
+  tr_piece_index_t i;
+  const tr_piece_index_t n = s->tor->info.pieceCount;
+  const tr_piece_index_t start = tr_cryptoWeakRandInt (n);
+  const uint16_t * rep = replicationGet (s);
+  tr_piece_index_t best = n;
+  uint32_t bestScore = UINT32_MAX;
+
+  for (i=0; i<n && bestScore>0; ++i)
+    {
+      uint32_t score;
+      const tr_piece_index_t piece = start + i < n ? start + i : start + i - n;
+
+      if (tr_bitfieldHas (&peer->have, piece))
+        continue;
+
+      score = ((uint32_t)s->superSeedOffers[piece] << 16) | rep[piece];
+      if (score < bestScore)
+        {
+          best = piece;
+          bestScore = score;
+        }
+    }
+
+  return best;
+}
+
+static void
+superSeedOffer (tr_swarm * s, tr_peer * peer)
+{
+  const tr_piece_index_t piece = superSeedPickPiece (s, peer);
+
+  superSeedClearOffer (s, peer);
+
+  if (piece < s->tor->info.pieceCount)
+    {
+      peer->superSeedPiece = piece;
+      ++s->superSeedOffers[piece];
+      tr_peerMsgsHave (PEER_MSGS (peer), piece);
+      tordbg (s, "super-seeding piece %u to %s", piece, tr_atomAddrStr (peer->atom));
+    }
+}
+
+static void
+superSeedStart (tr_swarm * s, tr_peer * peer)
+{
+  if (s->superSeedOffers == NULL)
+    s->superSeedOffers = tr_new0 (uint16_t, s->tor->info.pieceCount);
+
+  peer->isSuperSeeded = true;
+  peer->superSeedPiece = s->tor->info.pieceCount;
+  superSeedOffer (s, peer);
+}
+
+/* tell the peer about everything else we have */
+static void
+superSeedStop (tr_swarm * s, tr_peer * peer)
+{
+  tr_piece_index_t i;
+
+  superSeedClearOffer (s, peer);
+  peer->isSuperSeeded = false;
+
+  for (i=0; i<s->tor->info.pieceCount; ++i)
+    if (!tr_bitfieldHas (&peer->have, i) && tr_torrentPieceIsComplete (s->tor, i))
+      tr_peerMsgsHave (PEER_MSGS (peer), i);
+}
+
+/* the peer's bitfield changed, so its offer may be one it already has */
+static void
+superSeedCheckOffer (tr_swarm * s, tr_peer * peer)
+{
+  if (tr_bitfieldHasAll (&peer->have))
+    {
+      superSeedClearOffer (s, peer);
+      peer->isSuperSeeded = false;
+    }
+  else if (peer->superSeedPiece >= s->tor->info.pieceCount
+           || tr_bitfieldHas (&peer->have, peer->superSeedPiece))
+    {
+      superSeedOffer (s, peer);
+    }
+}
+
+static void
+superSeedGotHave (tr_swarm * s, tr_peer * peer, tr_piece_index_t piece)
+{
+  int i;
+  const int n = tr_ptrArraySize (&s->peers);
+  tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
+
+  for (i=0; i<n; ++i)
+    {
+      tr_peer * p = peers[i];
+
+      if (!p->isSuperSeeded || p->superSeedPiece != piece)
+        continue;
+
+      if (p != peer)
+        {
+          /* the piece has made it to someone else */
+          superSeedOffer (s, p);
+        }
+      else if (replicationGet (s)[piece] >= n)
+        {
+          /* the peer has it, and nobody's left to pass it on to */
+          superSeedOffer (s, p);
+        }
+      else
+        {
+          p->superSeedPieceDoneAt = tr_time ();
+        }
+    }
+}
+
+static void
+superSeedPulse (tr_swarm * s)
+{
+  int i;
+  const int n = tr_ptrArraySize (&s->peers);
+  tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
+  const bool active = tr_torrentIsSuperSeedingNow (s->tor);
+  const time_t now = tr_time ();
+
+  if (s->superSeedOffers == NULL)
+    return;
+
+  for (i=0; i<n; ++i)
+    {
+      tr_peer * peer = peers[i];
+
+      if (!peer->isSuperSeeded)
+        continue;
+
+      if (!active)
+        superSeedStop (s, peer);
+      else if (peer->superSeedPieceDoneAt != 0
+               && peer->superSeedPieceDoneAt + SUPER_SEED_PATIENCE_SECS <= now)
+        superSeedOffer (s, peer);
+    }
+
+  if (!active)
+    {
+      tr_free (s->superSeedOffers);
+      s->superSeedOffers = NULL;
+    }
 }
 
 static void
@@ -1713,6 +2546,7 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           tr_torrent * tor = s->tor;
 
           tor->uploadedCur += e->length;
+          tr_torrentSeedLimitChanged (tor);
           tr_announcerAddBytes (tor, TR_ANN_UP, e->length);
           tr_torrentSetActivityDate (tor, now);
           tr_torrentSetDirty (tor);
@@ -1747,6 +2581,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
             tr_incrReplicationOfPiece (s, e->pieceIndex);
             assertReplicationCountIsExact (s);
           }
+        if (s->superSeedOffers != NULL)
+          superSeedGotHave (s, peer, e->pieceIndex);
         break;
 
       case TR_PEER_CLIENT_GOT_HAVE_ALL:
@@ -1755,6 +2591,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
             tr_incrReplication (s);
             assertReplicationCountIsExact (s);
           }
+        if (peer->isSuperSeeded)
+          superSeedCheckOffer (s, peer);
         break;
 
       case TR_PEER_CLIENT_GOT_HAVE_NONE:
@@ -1768,6 +2606,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
             tr_incrReplicationFromBitfield (s, e->bitfield);
             assertReplicationCountIsExact (s);
           }
+        if (peer->isSuperSeeded)
+          superSeedCheckOffer (s, peer);
         break;
 
       case TR_PEER_CLIENT_GOT_REJ:
@@ -1805,8 +2645,8 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vs)
           const tr_block_index_t block = _tr_block (tor, p, e->offset);
           cancelAllRequestsForBlock (s, block, peer);
           tr_historyAdd (&peer->blocksSentToClient, tr_time(), 1);
-          pieceListResortPiece (s, pieceListLookup (s, p));
           tr_torrentGotBlock (tor, block);
+          pieceListResortPiece (s, pieceListLookup (s, p));
           break;
         }
 
@@ -1867,16 +2707,17 @@ ensureAtomExists (tr_swarm          * s,
   if (a == NULL)
     {
       const int jitter = tr_cryptoWeakRandInt (60*10);
-      a = tr_new0 (struct peer_atom, 1);
+      a = atomNew (s->manager);
       a->addr = *addr;
       a->port = port;
       a->flags = flags;
       a->fromFirst = from;
       a->fromBest = from;
       a->shelf_date = tr_time () + getDefaultShelfLife (from) + jitter;
-      a->blocklisted = -1;
+      a->blocklistGeneration = 0; /* unknown */
       atomSetSeedProbability (a, seedProbability);
-      tr_ptrArrayInsertSorted (&s->pool, a, compareAtomsByAddress);
+      atomIndexAdd (s, a);
+      invalidatePeerCandidates (s);
 
       tordbg (s, "got a new atom: %s", tr_atomAddrStr (a));
     }
@@ -1926,13 +2767,17 @@ createBitTorrentPeer (tr_torrent       * tor,
   peer->client = client;
   atom->peer = peer;
 
-  tr_ptrArrayInsertSorted (&swarm->peers, peer, peerCompare);
-  ++swarm->stats.peerCount;
+  peersInsertSorted (&swarm->peers, peer);
+  if (++swarm->stats.peerCount == 1)
+    swarmSetActive (swarm, true);
   ++swarm->stats.peerFromCount[atom->fromFirst];
 
   assert (swarm->stats.peerCount == tr_ptrArraySize (&swarm->peers));
   assert (swarm->stats.peerFromCount[atom->fromFirst] <= swarm->stats.peerCount);
 
+  if (tr_torrentIsSuperSeedingNow (tor))
+    superSeedStart (swarm, peer);
+
   msgs = PEER_MSGS (peer);
   tr_peerMsgsUpdateActive (msgs, TR_UP);
   tr_peerMsgsUpdateActive (msgs, TR_DOWN);
@@ -1963,11 +2808,14 @@ myHandshakeDoneCB (tr_handshake  * handshake,
     : NULL;
 
   if (tr_peerIoIsIncoming (io))
-    tr_ptrArrayRemoveSortedPointer (&manager->incomingHandshakes,
-                                    handshake, handshakeCompare);
+    handshakesRemoveSorted (&manager->incomingHandshakes, handshake);
   else if (s)
-    tr_ptrArrayRemoveSortedPointer (&s->outgoingHandshakes,
-                                    handshake, handshakeCompare);
+    {
+      const int n = tr_ptrArraySize (&s->outgoingHandshakes);
+      handshakesRemoveSorted (&s->outgoingHandshakes, handshake);
+      manager->outgoingHandshakeCount -= n - tr_ptrArraySize (&s->outgoingHandshakes);
+      invalidatePeerCandidates (s);
+    }
 
   if (s)
     swarmLock (s);
@@ -1983,6 +2831,9 @@ myHandshakeDoneCB (tr_handshake  * handshake,
             {
               ++atom->numFails;
 
+              /* maybe it wants encryption now; try that next time */
+              atom->flags2 &= ~MYFLAG_PLAINTEXT;
+
               if (!readAnythingFromPeer)
                 {
                   tordbg (s, "marking peer %s as unreachable... numFails is %d", tr_atomAddrStr (atom), (int)atom->numFails);
@@ -2005,6 +2856,11 @@ myHandshakeDoneCB (tr_handshake  * handshake,
         {
           atom->flags |= ADDED_F_CONNECTABLE;
           atom->flags2 &= ~MYFLAG_UNREACHABLE;
+
+          if (tr_peerIoIsEncrypted (io))
+            atom->flags2 &= ~MYFLAG_PLAINTEXT;
+          else if (manager->session->encryptionMode == TR_ENCRYPTION_PREFERRED)
+            atom->flags2 |= MYFLAG_PLAINTEXT;
         }
 
       /* In principle, this flag specifies whether the peer groks uTP,
@@ -2083,6 +2939,22 @@ tr_peerMgrAddIncoming (tr_peerMgr       * manager,
       else
         UTP_Close (utp_socket);
     }
+  else if (getHandshakeCount (manager) >= MAX_CONCURRENT_HANDSHAKES)
+    {
+      tr_logAddDebug ("Too many handshakes in progress; turning away \"%s\"", tr_address_to_string (addr));
+      if (socket >= 0)
+        tr_netClose (session, socket);
+      else
+        UTP_Close (utp_socket);
+    }
+  else if (tr_memBudgetIsLow (session))
+    {
+      tr_logAddDebug ("Low on memory; turning away \"%s\"", tr_address_to_string (addr));
+      if (socket >= 0)
+        tr_netClose (session, socket);
+      else
+        UTP_Close (utp_socket);
+    }
   else /* we don't have a connection to them yet... */
     {
       tr_peerIo *    io;
@@ -2097,8 +2969,7 @@ tr_peerMgrAddIncoming (tr_peerMgr       * manager,
 
       tr_peerIoUnref (io); /* balanced by the implicit ref in tr_peerIoNewIncoming () */
 
-      tr_ptrArrayInsertSorted (&manager->incomingHandshakes, handshake,
-                               handshakeCompare);
+      handshakesInsertSorted (&manager->incomingHandshakes, handshake);
     }
 
   managerUnlock (manager);
@@ -2108,17 +2979,47 @@ void
 tr_peerMgrAddPex (tr_torrent * tor, uint8_t from,
                   const tr_pex * pex, int8_t seedProbability)
 {
-  if (tr_isPex (pex)) /* safeguard against corrupt data */
+  tr_peerMgrAddPexList (tor, from, pex, 1, NULL, seedProbability);
+}
+
+void
+tr_peerMgrAddPexList (tr_torrent     * tor,
+                      uint8_t          from,
+                      const tr_pex   * pex,
+                      size_t           pexCount,
+                      const int8_t   * seedProbabilities,
+                      int8_t           seedProbability)
+{
+  size_t i;
+  tr_swarm * s = tor->swarm;
+  const tr_session * session = s->manager->session;
+
+  if (pexCount == 0)
+    return;
+
+  managerLock (s->manager);
+
+  atomIndexReserve (s, pexCount);
+
+  for (i=0; i<pexCount; ++i)
     {
-      tr_swarm * s = tor->swarm;
-      managerLock (s->manager);
+      const tr_pex * p = pex + i;
+
+      if (!tr_isPex (p)) /* safeguard against corrupt data */
+        continue;
+
+      if (!tr_address_is_valid_for_peers (&p->addr, p->port))
+        continue;
 
-      if (!tr_sessionIsAddressBlocked (s->manager->session, &pex->addr))
-        if (tr_address_is_valid_for_peers (&pex->addr, pex->port))
-          ensureAtomExists (s, &pex->addr, pex->port, pex->flags, seedProbability, from);
+      if (tr_sessionIsAddressBlocked (session, &p->addr))
+        continue;
 
-      managerUnlock (s->manager);
+      ensureAtomExists (s, &p->addr, p->port, p->flags,
+                        seedProbabilities != NULL ? seedProbabilities[i] : seedProbability,
+                        from);
     }
+
+  managerUnlock (s->manager);
 }
 
 void
@@ -2371,8 +3272,49 @@ tr_peerMgrGetPeers (tr_torrent   * tor,
   return count;
 }
 
+int
+tr_peerMgrGetPexSnapshot (tr_torrent     * tor,
+                          uint8_t          af,
+                          int              maxCount,
+                          const tr_pex  ** setme_pex)
+{
+  int count;
+  tr_swarm * s = tor->swarm;
+  const time_t now = tr_time ();
+
+  assert (tr_isTorrent (tor));
+  assert (af==TR_AF_INET || af==TR_AF_INET6);
+
+  managerLock (s->manager);
+
+  if ((s->pexSnapshotAt + PEX_SNAPSHOT_TTL_SECS <= now) || (s->pexSnapshotMax != maxCount))
+    {
+      tr_free (s->pexSnapshot);
+      tr_free (s->pexSnapshot6);
+      s->pexSnapshotCount = tr_peerMgrGetPeers (tor, &s->pexSnapshot, TR_AF_INET, TR_PEERS_CONNECTED, maxCount);
+      s->pexSnapshotCount6 = tr_peerMgrGetPeers (tor, &s->pexSnapshot6, TR_AF_INET6, TR_PEERS_CONNECTED, maxCount);
+      s->pexSnapshotMax = maxCount;
+      s->pexSnapshotAt = now;
+    }
+
+  if (af == TR_AF_INET)
+    {
+      *setme_pex = s->pexSnapshot;
+      count = s->pexSnapshotCount;
+    }
+  else
+    {
+      *setme_pex = s->pexSnapshot6;
+      count = s->pexSnapshotCount6;
+    }
+
+  managerUnlock (s->manager);
+  return count;
+}
+
 static void atomPulse      (evutil_socket_t, short, void *);
 static void bandwidthPulse (evutil_socket_t, short, void *);
+static void pacingPulse    (evutil_socket_t, short, void *);
 static void rechokePulse   (evutil_socket_t, short, void *);
 static void reconnectPulse (evutil_socket_t, short, void *);
 
@@ -2393,6 +3335,9 @@ ensureMgrTimersExist (struct tr_peerMgr * m)
   if (m->bandwidthTimer == NULL)
     m->bandwidthTimer = createTimer (m->session, BANDWIDTH_PERIOD_MSEC, bandwidthPulse, m);
 
+  if (m->pacingTimer == NULL)
+    m->pacingTimer = createTimer (m->session, PACING_PERIOD_MSEC, pacingPulse, m);
+
   if (m->rechokeTimer == NULL)
     m->rechokeTimer = createTimer (m->session, RECHOKE_PERIOD_MSEC, rechokePulse, m);
 
@@ -2414,6 +3359,7 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
   s->isRunning = true;
   s->maxPeers = tor->maxConnectedPeers;
   s->pieceSortState = PIECES_UNSORTED;
+  invalidatePeerCandidates (s);
 
   rechokePulse (0, 0, s->manager);
 }
@@ -2430,6 +3376,9 @@ stopSwarm (tr_swarm * swarm)
 
   removeAllPeers (swarm);
 
+  tr_free (swarm->superSeedOffers);
+  swarm->superSeedOffers = NULL;
+
   /* disconnect the handshakes. handshakeAbort calls handshakeDoneCB (),
    * which removes the handshake from t->outgoingHandshakes... */
   while (!tr_ptrArrayEmpty (&swarm->outgoingHandshakes))
@@ -2541,8 +3490,7 @@ tr_peerMgrTorrentAvailability (const tr_torrent  * tor,
   if (tr_torrentHasMetadata (tor))
     {
       tr_piece_index_t i;
-      const int peerCount = tr_ptrArraySize (&tor->swarm->peers);
-      const tr_peer ** peers = (const tr_peer**) tr_ptrArrayBase (&tor->swarm->peers);
+      const uint16_t * rep = replicationGet (tor->swarm);
       const float interval = tor->info.pieceCount / (float)tabCount;
       const bool isSeed = tr_torrentGetCompleteness (tor) == TR_SEED;
 
@@ -2551,16 +3499,9 @@ tr_peerMgrTorrentAvailability (const tr_torrent  * tor,
           const int piece = i * interval;
 
           if (isSeed || tr_torrentPieceIsComplete (tor, piece))
-            {
-              tab[i] = -1;
-            }
-          else if (peerCount)
-            {
-              int j;
-              for (j=0; j<peerCount; ++j)
-                if (tr_bitfieldHas (&peers[j]->have, piece))
-                  ++tab[i];
-            }
+            tab[i] = -1;
+          else
+            tab[i] = MIN (rep[piece], INT8_MAX);
         }
     }
 }
@@ -2574,6 +3515,12 @@ tr_swarmGetStats (const tr_swarm * swarm, tr_swarm_stats * setme)
   *setme = swarm->stats;
 }
 
+void
+tr_swarmAddWastedBytes (tr_swarm * swarm, size_t bytes)
+{
+  swarm->stats.wastedBytes += bytes;
+}
+
 void
 tr_swarmIncrementActivePeers (tr_swarm * swarm, tr_direction direction, bool is_active)
 {
@@ -2609,7 +3556,8 @@ tr_peerMgrGetDesiredAvailable (const tr_torrent * tor)
   size_t i;
   size_t n;
   uint64_t desiredAvailable;
-  const tr_swarm * s;
+  const uint16_t * rep;
+  tr_swarm * s;
 
   assert (tr_isTorrent (tor));
 
@@ -2638,14 +3586,12 @@ tr_peerMgrGetDesiredAvailable (const tr_torrent * tor)
           return tr_torrentGetLeftUntilDone (tor);
     }
 
-  if (!s->pieceReplication || !s->pieceReplicationSize)
-    return 0;
-
   /* do it the hard way */
 
+  rep = replicationGet (s);
   desiredAvailable = 0;
-  for (i=0, n=MIN (tor->info.pieceCount, s->pieceReplicationSize); i<n; ++i)
-    if (!tor->info.pieces[i].dnd && (s->pieceReplication[i] > 0))
+  for (i=0, n=tor->info.pieceCount; i<n; ++i)
+    if (!tor->info.pieces[i].dnd && (rep[i] > 0))
       desiredAvailable += tr_torrentMissingBytesInPiece (tor, i);
 
   assert (desiredAvailable <= tor->info.totalSize);
@@ -2682,25 +3628,15 @@ tr_peerMgrWebSpeeds_KBps (const tr_torrent * tor)
   return ret;
 }
 
-struct tr_peer_stat *
-tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
+static void
+getPeerStats (tr_swarm * s, tr_peer_stat * ret)
 {
   int i;
-  int size = 0;
-  tr_peer_stat * ret;
-  const tr_swarm * s;
-  tr_peer ** peers;
+  const int size = tr_ptrArraySize (&s->peers);
+  tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
   const time_t now = tr_time ();
   const uint64_t now_msec = tr_time_msec ();
 
-  assert (tr_isTorrent (tor));
-  assert (tor->swarm->manager != NULL);
-
-  s = tor->swarm;
-  peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
-  size = tr_ptrArraySize (&s->peers);
-  ret = tr_new0 (tr_peer_stat, size);
-
   for (i=0; i<size; ++i)
     {
       char *                   pch;
@@ -2709,6 +3645,7 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
       const struct peer_atom * atom = peer->atom;
       tr_peer_stat *           stat = ret + i;
 
+      stat->id                  = peer->id;
       tr_address_to_string_with_buf (&atom->addr, stat->addr, sizeof (stat->addr));
       tr_strlcpy (stat->client, tr_quark_get_string(peer->client,NULL), sizeof (stat->client));
       stat->port                = ntohs (peer->atom->port);
@@ -2734,6 +3671,7 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
 
       stat->pendingReqsToPeer   = peer->pendingReqsToPeer;
       stat->pendingReqsToClient = peer->pendingReqsToClient;
+      memcpy (stat->stallMsec, peer->stallMsec, sizeof (stat->stallMsec));
 
       pch = stat->flagStr;
       if (stat->isUTP) *pch++ = 'T';
@@ -2750,8 +3688,35 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
       if (stat->isIncoming) *pch++ = 'I';
       *pch = '\0';
     }
+}
+
+struct tr_peer_stat *
+tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
+{
+  tr_swarm * s;
+  tr_peer_stat * ret;
+  const time_t now = tr_time ();
+
+  assert (tr_isTorrent (tor));
+  assert (tor->swarm->manager != NULL);
+
+  s = tor->swarm;
+  managerLock (s->manager);
+
+  if ((s->peerStatSnapshotAt + PEER_STAT_SNAPSHOT_TTL_SECS <= now)
+      || (s->peerStatSnapshotCount != tr_ptrArraySize (&s->peers)))
+    {
+      s->peerStatSnapshotCount = tr_ptrArraySize (&s->peers);
+      s->peerStatSnapshot = tr_renew (tr_peer_stat, s->peerStatSnapshot, s->peerStatSnapshotCount);
+      memset (s->peerStatSnapshot, 0, sizeof (tr_peer_stat) * s->peerStatSnapshotCount);
+      getPeerStats (s, s->peerStatSnapshot);
+      s->peerStatSnapshotAt = now;
+    }
+
+  ret = tr_memdup (s->peerStatSnapshot, sizeof (tr_peer_stat) * s->peerStatSnapshotCount);
+  *setmeCount = s->peerStatSnapshotCount;
 
-  *setmeCount = size;
+  managerUnlock (s->manager);
   return ret;
 }
 
@@ -2776,11 +3741,11 @@ tr_peerMgrClearInterest (tr_torrent * tor)
 
 /* does this peer have any pieces that we want? */
 static bool
-isPeerInteresting (tr_torrent     * const tor,
-                   const bool     * const piece_is_interesting,
-                   const tr_peer  * const peer)
+isPeerInteresting (tr_torrent        * const tor,
+                   const tr_bitfield * const interesting_pieces,
+                   const tr_peer     * const peer)
 {
-  tr_piece_index_t i, n;
+  const tr_piece_index_t n = tor->info.pieceCount;
 
   /* these cases should have already been handled by the calling code... */
   assert (!tr_torrentIsSeed (tor));
@@ -2789,11 +3754,7 @@ isPeerInteresting (tr_torrent     * const tor,
   if (tr_peerIsSeed (peer))
     return true;
 
-  for (i=0, n=tor->info.pieceCount; i<n; ++i)
-    if (piece_is_interesting[i] && tr_bitfieldHas (&peer->have, i))
-      return true;
-
-  return false;
+  return tr_bitfieldFirstAnd (interesting_pieces, &peer->have, 0, n) < n;
 }
 
 typedef enum
@@ -2830,7 +3791,7 @@ rechokeDownloads (tr_swarm * s)
   int i;
   int maxPeers = 0;
   int rechoke_count = 0;
-  struct tr_rechoke_info * rechoke = NULL;
+  struct tr_rechoke_info * rechoke;
   const int MIN_INTERESTING_PEERS = 5;
   const int peerCount = tr_ptrArraySize (&s->peers);
   const time_t now = tr_time ();
@@ -2909,23 +3870,27 @@ rechokeDownloads (tr_swarm * s)
 
   s->maxPeers = maxPeers;
 
-  if (peerCount > 0)
+  if (s->manager->rechokeAlloc < peerCount)
     {
-      bool * piece_is_interesting;
-      const tr_torrent * const tor = s->tor;
-      const int n = tor->info.pieceCount;
+      s->manager->rechokeAlloc = peerCount;
+      s->manager->rechoke = tr_renew (struct tr_rechoke_info, s->manager->rechoke, peerCount);
+    }
+  rechoke = s->manager->rechoke;
 
-      /* build a bitfield of interesting pieces... */
-      piece_is_interesting = tr_new (bool, n);
-      for (i=0; i<n; i++)
-        piece_is_interesting[i] = !tor->info.pieces[i].dnd && !tr_torrentPieceIsComplete (tor, i);
+  if (peerCount > 0)
+    {
+      /* the pieces we want are the ones in the piece list, which is
+         already kept as a bitfield, so checking each peer is a single
+         pass over the words of its bitfield */
+      if (s->pieces == NULL)
+        pieceListRebuild (s);
 
       /* decide WHICH peers to be interested in (based on their cancel-to-block ratio) */
       for (i=0; i<peerCount; ++i)
         {
           tr_peer * peer = tr_ptrArrayNth (&s->peers, i);
 
-          if (!isPeerInteresting (s->tor, piece_is_interesting, peer))
+          if (!isPeerInteresting (s->tor, &s->piecesInList, peer))
             {
               tr_peerMsgsSetInterested (PEER_MSGS(peer), false);
             }
@@ -2946,9 +3911,6 @@ rechokeDownloads (tr_swarm * s)
               else
                 rechoke_state = RECHOKE_STATE_BAD;
 
-              if (rechoke == NULL)
-                rechoke = tr_new (struct tr_rechoke_info, peerCount);
-
               rechoke[rechoke_count].peer = peer;
               rechoke[rechoke_count].rechoke_state = rechoke_state;
               rechoke[rechoke_count].salt = tr_cryptoWeakRandInt (INT_MAX);
@@ -2956,8 +3918,6 @@ rechokeDownloads (tr_swarm * s)
             }
 
         }
-
-      tr_free (piece_is_interesting);
     }
 
   /* now that we know which & how many peers to be interested in... update the peer interest */
@@ -2965,9 +3925,6 @@ rechokeDownloads (tr_swarm * s)
   s->interestedCount = MIN (maxPeers, rechoke_count);
   for (i=0; i<rechoke_count; ++i)
     tr_peerMsgsSetInterested (PEER_MSGS(rechoke[i].peer), i<s->interestedCount);
-
-  /* cleanup */
-  tr_free (rechoke);
 }
 
 /**
@@ -3002,6 +3959,59 @@ compareChoke (const void * va, const void * vb)
   return 0;
 }
 
+/**
+ * rechokeUploads () only needs the best peers up to the last of the
+ * upload slots in order, so the rest are left unsorted in a heap.
+ */
+static void
+chokeHeapSiftDown (struct ChokeData * choke, int pos, int n)
+{
+  for (;;)
+    {
+      int best = pos;
+      const int left = 2 * pos + 1;
+      const int right = left + 1;
+
+      if (left < n && compareChoke (&choke[left], &choke[best]) < 0)
+        best = left;
+      if (right < n && compareChoke (&choke[right], &choke[best]) < 0)
+        best = right;
+
+      if (best == pos)
+        break;
+
+      {
+        const struct ChokeData tmp = choke[pos];
+        choke[pos] = choke[best];
+        choke[best] = tmp;
+      }
+
+      pos = best;
+    }
+}
+
+static void
+chokeHeapMake (struct ChokeData * choke, int n)
+{
+  int i;
+
+  for (i=n/2-1; i>=0; --i)
+    chokeHeapSiftDown (choke, i, n);
+}
+
+/* moves the best peer from the heap of n to choke[n-1], shrinking the heap */
+static struct ChokeData *
+chokeHeapPop (struct ChokeData * choke, int n)
+{
+  const struct ChokeData tmp = choke[0];
+
+  choke[0] = choke[n-1];
+  choke[n-1] = tmp;
+  chokeHeapSiftDown (choke, 0, n-1);
+
+  return &choke[n-1];
+}
+
 /* is this a new connection? */
 static bool
 isNew (const tr_peerMsgs * msgs)
@@ -3051,10 +4061,10 @@ isBandwidthMaxedOut (const tr_bandwidth * b,
 static void
 rechokeUploads (tr_swarm * s, const uint64_t now)
 {
-  int i, size, unchokedInterested;
+  int i, size, unranked, unchokedInterested;
   const int peerCount = tr_ptrArraySize (&s->peers);
   tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
-  struct ChokeData * choke = tr_new0 (struct ChokeData, peerCount);
+  struct ChokeData * choke;
   const tr_session * session = s->manager->session;
   const int chokeAll = !tr_torrentIsPieceTransferAllowed (s->tor, TR_CLIENT_TO_PEER);
   const bool isMaxedOut = isBandwidthMaxedOut (&s->tor->bandwidth, now, TR_UP);
@@ -3068,7 +4078,28 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
   else
     s->optimistic = NULL;
 
-  /* sort the peers by preference and rate */
+  /* Nobody wants anything from us, so there's nothing to decide. Peers
+   * that become interested get their turn on the next pulse. */
+  if (!chokeAll && s->optimistic == NULL && !s->peersWereInterested)
+    {
+      for (i=0; i<peerCount; ++i)
+        if (tr_peerMsgsIsPeerInterested (PEER_MSGS (peers[i])))
+          break;
+
+      if (i == peerCount)
+        return;
+    }
+
+  s->peersWereInterested = false;
+
+  if (s->manager->chokeAlloc < peerCount)
+    {
+      s->manager->chokeAlloc = peerCount;
+      s->manager->choke = tr_renew (struct ChokeData, s->manager->choke, peerCount);
+    }
+  choke = s->manager->choke;
+
+  /* rank the peers by preference and rate */
   for (i=0, size=0; i<peerCount; ++i)
     {
       tr_peer * peer = peers[i];
@@ -3093,10 +4124,13 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
           n->rate         = getRate (s->tor, atom, now);
           n->salt         = tr_cryptoWeakRandInt (INT_MAX);
           n->isChoked     = true;
+
+          if (n->isInterested)
+            s->peersWereInterested = true;
         }
     }
 
-  qsort (choke, size, sizeof (struct ChokeData), compareChoke);
+  chokeHeapMake (choke, size);
 
   /**
    * Reciprocation and number of uploads capping is managed by unchoking
@@ -3114,21 +4148,22 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
    * If our bandwidth is maxed out, don't unchoke any more peers.
    */
   unchokedInterested = 0;
-  for (i=0; i<size && unchokedInterested<session->uploadSlotsPerTorrent; ++i)
+  for (unranked=size; unranked>0 && unchokedInterested<session->uploadSlotsPerTorrent; --unranked)
     {
-      choke[i].isChoked = isMaxedOut ? choke[i].wasChoked : false;
-      if (choke[i].isInterested)
+      struct ChokeData * c = chokeHeapPop (choke, unranked);
+      c->isChoked = isMaxedOut ? c->wasChoked : false;
+      if (c->isInterested)
         ++unchokedInterested;
     }
 
-  /* optimistic unchoke */
-  if (!s->optimistic && !isMaxedOut && (i<size))
+  /* optimistic unchoke. the order of the leftovers doesn't matter here */
+  if (!s->optimistic && !isMaxedOut && (unranked>0))
     {
       int n;
       struct ChokeData * c;
       tr_ptrArray randPool = TR_PTR_ARRAY_INIT;
 
-      for (; i<size; ++i)
+      for (i=0; i<unranked; ++i)
         {
           if (choke[i].isInterested)
             {
@@ -3153,35 +4188,94 @@ rechokeUploads (tr_swarm * s, const uint64_t now)
 
   for (i=0; i<size; ++i)
     tr_peerMsgsSetChoke (choke[i].msgs, choke[i].isChoked);
+}
 
-  /* cleanup */
-  tr_free (choke);
+/***
+****
+****  Suggesting pieces to peers (BEP 6) that are already in memory,
+****  so that their requests can be served without reading the disk
+****
+***/
+
+enum
+{
+  /* how many pieces to pick the suggestions from */
+  MAX_SUGGEST_CANDIDATES = 16
+};
+
+/* the complete pieces that are mostly in the block cache */
+static int
+getSuggestablePieces (tr_swarm * s, tr_piece_index_t * setme)
+{
+  size_t i, n;
+  int count = 0;
+  tr_piece_index_t hot[MAX_SUGGEST_CANDIDATES * 2];
+
+  n = tr_cacheGetHotPieces (s->manager->session->cache, s->tor, hot, MAX_SUGGEST_CANDIDATES * 2);
+
+  for (i=0; i<n && count<MAX_SUGGEST_CANDIDATES; ++i)
+    if (tr_torrentPieceIsComplete (s->tor, hot[i]))
+      setme[count++] = hot[i];
+
+  return count;
+}
+
+static void
+suggestPulse (tr_swarm * s)
+{
+  int i;
+  int n = -1;
+  tr_piece_index_t pieces[MAX_SUGGEST_CANDIDATES];
+  const int peerCount = tr_ptrArraySize (&s->peers);
+  tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&s->peers);
+
+  if (!tr_torrentHasMetadata (s->tor))
+    return;
+
+  for (i=0; i<peerCount && n!=0; ++i)
+    {
+      tr_peerMsgs * msgs = PEER_MSGS (peers[i]);
+
+      /* a super-seeded peer only hears about its own piece */
+      if (peers[i]->isSuperSeeded || !tr_peerMsgsCanSuggest (msgs))
+        continue;
+
+      /* only look in the cache once a peer wants suggestions */
+      if (n < 0)
+        n = getSuggestablePieces (s, pieces);
+
+      if (n > 0)
+        tr_peerMsgsSuggest (msgs, pieces, n);
+    }
 }
 
 static void
 rechokePulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor = NULL;
+  tr_swarm * s;
   tr_peerMgr * mgr = vmgr;
   const uint64_t now = tr_time_msec ();
+  const uint64_t started = tr_metricsNow ();
 
   managerLock (mgr);
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
     {
-      if (tor->isRunning)
+      if (s->tor->isRunning)
         {
-          tr_swarm * s = tor->swarm;
+          const uint64_t swarmStarted = tr_metricsNow ();
 
-          if (s->stats.peerCount > 0)
-            {
-              rechokeUploads (s, now);
-              rechokeDownloads (s);
-            }
+          superSeedPulse (s);
+          rechokeUploads (s, now);
+          rechokeDownloads (s);
+          suggestPulse (s);
+
+          s->tor->cpuUsec += tr_metricsNow () - swarmStarted;
         }
     }
 
   tr_timerAddMsec (mgr->rechokeTimer, RECHOKE_PERIOD_MSEC);
+  tr_metricsCallbackDone (mgr->session, TR_HISTOGRAM_RECHOKE_PULSE, started);
   managerUnlock (mgr);
 }
 
@@ -3307,14 +4401,19 @@ removePeer (tr_swarm * s, tr_peer * peer)
   assert (atom);
 
   atom->time = tr_time ();
+  invalidatePeerCandidates (s);
 
-  tr_ptrArrayRemoveSortedPointer (&s->peers, peer, peerCompare);
-  --s->stats.peerCount;
+  peersRemoveSorted (&s->peers, peer);
+  if (--s->stats.peerCount == 0)
+    swarmSetActive (s, false);
   --s->stats.peerFromCount[atom->fromFirst];
 
   if (replicationExists (s))
     tr_decrReplicationFromBitfield (s, &peer->have);
 
+  if (peer->isSuperSeeded)
+    superSeedClearOffer (s, peer);
+
   assert (s->stats.peerCount == tr_ptrArraySize (&s->peers));
   assert (s->stats.peerFromCount[atom->fromFirst] >= 0);
 
@@ -3408,67 +4507,107 @@ comparePeerLiveliness (const void * va, const void * vb)
 }
 
 static void
-sortPeersByLivelinessImpl (tr_peer  ** peers,
-                           void     ** clientData,
-                           int         n,
-                           uint64_t    now,
-                           int (*compare)(const void *va, const void *vb))
+getLiveliness (struct peer_liveliness * l,
+               tr_peer                * p,
+               void                   * clientData,
+               uint64_t                 now)
 {
-  int i;
-  struct peer_liveliness *lives, *l;
+  l->peer = p;
+  l->clientData = clientData;
+  l->doPurge = p->doPurge;
+  l->pieceDataTime = p->atom->piece_data_time;
+  l->time = p->atom->time;
+  l->speed = tr_peerGetPieceSpeed_Bps (p, now, TR_UP)
+           + tr_peerGetPieceSpeed_Bps (p, now, TR_DOWN);
+}
 
-  /* build a sortable array of peer + extra info */
-  lives = l = tr_new0 (struct peer_liveliness, n);
-  for (i=0; i<n; ++i, ++l)
-    {
-      tr_peer * p = peers[i];
-      l->peer = p;
-      l->doPurge = p->doPurge;
-      l->pieceDataTime = p->atom->piece_data_time;
-      l->time = p->atom->time;
-      l->speed = tr_peerGetPieceSpeed_Bps (p, now, TR_UP)
-               + tr_peerGetPieceSpeed_Bps (p, now, TR_DOWN);
-      if (clientData)
-        l->clientData = clientData[i];
-    }
+/**
+ * The `max' least lively peers seen so far, kept in a heap whose root is
+ * the liveliest of them. Picking k peers to close out of n this way costs
+ * O(n log k) instead of sorting all n, and k is usually just a few.
+ */
+struct dead_peers
+{
+  struct peer_liveliness * heap;
+  int count;
+  int max;
+};
+
+static void
+deadPeersSwap (struct dead_peers * d, int a, int b)
+{
+  const struct peer_liveliness tmp = d->heap[a];
+  d->heap[a] = d->heap[b];
+  d->heap[b] = tmp;
+}
 
-  /* sort 'em */
-  assert (n == (l - lives));
-  qsort (lives, n, sizeof (struct peer_liveliness), compare);
+static void
+deadPeersAdd (struct dead_peers * d, const struct peer_liveliness * l)
+{
+  int pos;
 
-  /* build the peer array */
-  for (i=0, l=lives; i<n; ++i, ++l)
+  if (d->count < d->max)
     {
-      peers[i] = l->peer;
-      if (clientData)
-        clientData[i] = l->clientData;
+      pos = d->count++;
+      d->heap[pos] = *l;
+
+      while (pos > 0 && comparePeerLiveliness (&d->heap[pos], &d->heap[(pos - 1) / 2]) < 0)
+        {
+          deadPeersSwap (d, pos, (pos - 1) / 2);
+          pos = (pos - 1) / 2;
+        }
     }
-  assert (n == (l - lives));
+  else if (d->max > 0 && comparePeerLiveliness (l, &d->heap[0]) > 0)
+    {
+      d->heap[0] = *l;
 
-  /* cleanup */
-  tr_free (lives);
-}
+      pos = 0;
+      for (;;)
+        {
+          int best = pos;
+          const int left = 2 * pos + 1;
+          const int right = left + 1;
 
-static void
-sortPeersByLiveliness (tr_peer ** peers, void ** clientData, int n, uint64_t now)
-{
-  sortPeersByLivelinessImpl (peers, clientData, n, now, comparePeerLiveliness);
-}
+          if (left < d->count && comparePeerLiveliness (&d->heap[left], &d->heap[best]) < 0)
+            best = left;
+          if (right < d->count && comparePeerLiveliness (&d->heap[right], &d->heap[best]) < 0)
+            best = right;
 
+          if (best == pos)
+            break;
+
+          deadPeersSwap (d, pos, best);
+          pos = best;
+        }
+    }
+}
 
 static void
 enforceTorrentPeerLimit (tr_swarm * s, uint64_t now)
 {
-  int n = tr_ptrArraySize (&s->peers);
+  const int n = tr_ptrArraySize (&s->peers);
   const int max = tr_torrentGetPeerLimit (s->tor);
+
   if (n > max)
     {
-      void * base = tr_ptrArrayBase (&s->peers);
-      tr_peer ** peers = tr_memdup (base, n*sizeof (tr_peer*));
-      sortPeersByLiveliness (peers, NULL, n, now);
-      while (n > max)
-        closePeer (s, peers[--n]);
-      tr_free (peers);
+      int i;
+      struct dead_peers dead;
+
+      dead.count = 0;
+      dead.max = n - max;
+      dead.heap = tr_new (struct peer_liveliness, dead.max);
+
+      for (i=0; i<n; ++i)
+        {
+          struct peer_liveliness l;
+          getLiveliness (&l, tr_ptrArrayNth (&s->peers, i), NULL, now);
+          deadPeersAdd (&dead, &l);
+        }
+
+      for (i=0; i<dead.count; ++i)
+        closePeer (s, dead.heap[i].peer);
+
+      tr_free (dead.heap);
     }
 }
 
@@ -3476,80 +4615,87 @@ static void
 enforceSessionPeerLimit (tr_session * session, uint64_t now)
 {
   int n = 0;
-  tr_torrent * tor = NULL;
+  tr_swarm * s;
   const int max = tr_sessionGetPeerLimit (session);
 
   /* count the total number of peers */
-  while ((tor = tr_torrentNext (session, tor)))
-    n += tr_ptrArraySize (&tor->swarm->peers);
+  for (s=session->peerMgr->activeSwarms; s!=NULL; s=s->activeNext)
+    n += tr_ptrArraySize (&s->peers);
 
   /* if there are too many, prune out the worst */
   if (n > max)
     {
-      tr_peer ** peers = tr_new (tr_peer*, n);
-      tr_swarm ** swarms = tr_new (tr_swarm*, n);
+      int i;
+      struct dead_peers dead;
+
+      dead.count = 0;
+      dead.max = n - max;
+      dead.heap = tr_new (struct peer_liveliness, dead.max);
 
-      /* populate the peer array */
-      n = 0;
-      tor = NULL;
-      while ((tor = tr_torrentNext (session, tor)))
+      /* find the crappiest */
+      for (s=session->peerMgr->activeSwarms; s!=NULL; s=s->activeNext)
         {
-          int i;
-          tr_swarm * s = tor->swarm;
           const int tn = tr_ptrArraySize (&s->peers);
-          for (i=0; i<tn; ++i, ++n)
+          for (i=0; i<tn; ++i)
             {
-              peers[n] = tr_ptrArrayNth (&s->peers, i);
-              swarms[n] = s;
+              struct peer_liveliness l;
+              getLiveliness (&l, tr_ptrArrayNth (&s->peers, i), s, now);
+              deadPeersAdd (&dead, &l);
             }
         }
 
-      /* sort 'em */
-      sortPeersByLiveliness (peers, (void**)swarms, n, now);
-
-      /* cull out the crappiest */
-      while (n-- > max)
-        closePeer (swarms[n], peers[n]);
+      /* cull them out */
+      for (i=0; i<dead.count; ++i)
+        closePeer (dead.heap[i].clientData, dead.heap[i].peer);
 
       /* cleanup */
-      tr_free (swarms);
-      tr_free (peers);
+      tr_free (dead.heap);
     }
 }
 
-static void makeNewPeerConnections (tr_peerMgr * mgr, const int max);
+static void makeNewPeerConnections (tr_peerMgr * mgr, int max);
 
 static void
 reconnectPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  tr_torrent * tor;
+  tr_swarm * s;
+  tr_swarm * next;
   tr_peerMgr * mgr = vmgr;
   const time_t now_sec = tr_time ();
   const uint64_t now_msec = tr_time_msec ();
+  const uint64_t started = tr_metricsNow ();
 
   /**
-  ***  enforce the per-session and per-torrent peer limits
+  ***  enforce the per-session and per-torrent peer limits.
+  ***  closing a swarm's last peer takes it out of the active list,
+  ***  so get the next one before working on each swarm.
   **/
 
   /* if we're over the per-torrent peer limits, cull some peers */
-  tor = NULL;
-  while ((tor = tr_torrentNext (mgr->session, tor)))
-    if (tor->isRunning)
-      enforceTorrentPeerLimit (tor->swarm, now_msec);
+  for (s=mgr->activeSwarms; s!=NULL; s=next)
+    {
+      next = s->activeNext;
+      if (s->tor->isRunning)
+        enforceTorrentPeerLimit (s, now_msec);
+    }
 
   /* if we're over the per-session peer limits, cull some peers */
   enforceSessionPeerLimit (mgr->session, now_msec);
 
   /* remove crappy peers */
-  tor = NULL;
-  while ((tor = tr_torrentNext (mgr->session, tor)))
-    if (!tor->swarm->isRunning)
-      removeAllPeers (tor->swarm);
-    else
-      closeBadPeers (tor->swarm, now_sec);
+  for (s=mgr->activeSwarms; s!=NULL; s=next)
+    {
+      next = s->activeNext;
+      if (!s->isRunning)
+        removeAllPeers (s);
+      else
+        closeBadPeers (s, now_sec);
+    }
 
   /* try to make new peer connections */
   makeNewPeerConnections (mgr, MAX_CONNECTIONS_PER_PULSE);
+
+  tr_metricsCallbackDone (mgr->session, TR_HISTOGRAM_RECONNECT_PULSE, started);
 }
 
 /****
@@ -3558,15 +4704,64 @@ reconnectPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 *****
 ****/
 
+/* Read the blocks that peers are about to be sent all at once, sorted
+ * by where they are on disk, rather than one at a time in whatever order
+ * the peers are pumped. Those reads then come from the read cache. */
+static void
+readUploadBlocks (tr_peerMgr * mgr)
+{
+  int n = 0;
+  int peerCount = 0;
+  tr_swarm * s;
+  struct tr_cache_read * reads;
+
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
+    peerCount += tr_ptrArraySize (&s->peers);
+
+  if (peerCount == 0)
+    return;
+
+  reads = tr_new (struct tr_cache_read, peerCount * UPLOAD_READS_PER_PEER);
+
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
+    {
+      int j;
+
+      for (j=0; j<tr_ptrArraySize (&s->peers); ++j)
+        n += tr_peerMsgsGetUploadReads (tr_ptrArrayNth (&s->peers, j), reads + n, UPLOAD_READS_PER_PEER);
+    }
+
+  tr_cacheReadBlocks (mgr->session->cache, reads, n);
+  tr_free (reads);
+}
+
+uint64_t
+tr_peerMgrGetBufferedBytes (tr_peerMgr * mgr)
+{
+  tr_swarm * s;
+  uint64_t bytes = 0;
+
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
+    {
+      int j;
+
+      for (j=0; j<tr_ptrArraySize (&s->peers); ++j)
+        bytes += tr_peerMsgsGetBufferedBytes (tr_ptrArrayNth (&s->peers, j));
+    }
+
+  return bytes;
+}
+
 static void
 pumpAllPeers (tr_peerMgr * mgr)
 {
-  tr_torrent * tor = NULL;
+  tr_swarm * s;
 
-  while ((tor = tr_torrentNext (mgr->session, tor)))
+  readUploadBlocks (mgr);
+
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
     {
       int j;
-      tr_swarm * s = tor->swarm;
 
       for (j=0; j<tr_ptrArraySize (&s->peers); ++j)
         tr_peerMsgsPulse (tr_ptrArrayNth (&s->peers, j));
@@ -3612,15 +4807,13 @@ bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
   tr_torrent * tor;
   tr_peerMgr * mgr = vmgr;
   tr_session * session = mgr->session;
+  const uint64_t started = tr_metricsNow ();
+
   managerLock (mgr);
 
   /* FIXME: this next line probably isn't necessary... */
   pumpAllPeers (mgr);
 
-  /* allocate bandwidth to the peers */
-  tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC);
-  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
-
   /* torrent upkeep */
   tor = NULL;
   while ((tor = tr_torrentNext (session, tor)))
@@ -3651,25 +4844,59 @@ bandwidthPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
   reconnectPulse (0, 0, mgr);
 
   tr_timerAddMsec (mgr->bandwidthTimer, BANDWIDTH_PERIOD_MSEC);
+  tr_metricsCallbackDone (session, TR_HISTOGRAM_BANDWIDTH_PULSE, started);
   managerUnlock (mgr);
 }
 
-/***
-****
-***/
+/* in the endgame, a peer that lost the race for a block is still sending
+   it to us. Tell it to stop now rather than at the next bandwidth pulse */
+static void
+flushEndgameCancels (tr_peerMgr * mgr)
+{
+  tr_swarm * s;
 
-static int
-compareAtomPtrsByAddress (const void * va, const void *vb)
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
+    {
+      int i;
+
+      if (!s->endgame)
+        continue;
+
+      for (i=0; i<tr_ptrArraySize (&s->peers); ++i)
+        tr_peerMsgsFlushCancels (tr_ptrArrayNth (&s->peers, i));
+    }
+}
+
+static void
+pacingPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 {
-  const struct peer_atom * a = * (const struct peer_atom**) va;
-  const struct peer_atom * b = * (const struct peer_atom**) vb;
+  tr_swarm * s;
+  tr_peerMgr * mgr = vmgr;
+  tr_session * session = mgr->session;
+  const uint64_t started = tr_metricsNow ();
 
-  assert (tr_isAtom (a));
-  assert (tr_isAtom (b));
+  managerLock (mgr);
+
+  /* don't read from the swarms whose disks are too far behind */
+  for (s=mgr->activeSwarms; s!=NULL; s=s->activeNext)
+    tr_bandwidthSetPaused (&s->tor->bandwidth, TR_DOWN,
+                           tr_cacheIsWriteQueueFull (session->cache, s->tor));
 
-  return tr_address_compare (&a->addr, &b->addr);
+  /* allocate the next slice of bandwidth to the peers */
+  tr_bandwidthAllocate (&session->bandwidth, TR_UP, PACING_PERIOD_MSEC);
+  tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, PACING_PERIOD_MSEC);
+
+  flushEndgameCancels (mgr);
+
+  tr_timerAddMsec (mgr->pacingTimer, PACING_PERIOD_MSEC);
+  tr_metricsCallbackDone (session, TR_HISTOGRAM_PACING_PULSE, started);
+  managerUnlock (mgr);
 }
 
+/***
+****
+***/
+
 /* best come first, worst go last */
 static int
 compareAtomPtrsByShelfDate (const void * va, const void *vb)
@@ -3708,6 +4935,7 @@ atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 {
   tr_torrent * tor = NULL;
   tr_peerMgr * mgr = vmgr;
+  const uint64_t started = tr_metricsNow ();
   managerLock (mgr);
 
   while ((tor = tr_torrentNext (mgr->session, tor)))
@@ -3746,14 +4974,14 @@ atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 
           /* free the culled atoms */
           while (i<testCount)
-            tr_free (test[i++]);
+            atomFree (mgr, test[i++]);
 
-          /* rebuild Torrent.pool with what's left */
+          /* rebuild Torrent.pool and its index with what's left */
           tr_ptrArrayDestruct (&s->pool, NULL);
           s->pool = TR_PTR_ARRAY_INIT;
-          qsort (keep, keepCount, sizeof (struct peer_atom *), compareAtomPtrsByAddress);
           for (i=0; i<keepCount; ++i)
             tr_ptrArrayAppend (&s->pool, keep[i]);
+          atomIndexRehash (s, s->atomBucketCount);
 
           tordbg (s, "max atom count is %d... pruned from %d to %d\n", maxAtomCount, atomCount, keepCount);
 
@@ -3764,6 +4992,7 @@ atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
     }
 
   tr_timerAddMsec (mgr->atomTimer, ATOM_PERIOD_MSEC);
+  tr_metricsCallbackDone (mgr->session, TR_HISTOGRAM_ATOM_PULSE, started);
   managerUnlock (mgr);
 }
 
@@ -3773,31 +5002,42 @@ atomPulse (evutil_socket_t foo UNUSED, short bar UNUSED, void * vmgr)
 ****
 ***/
 
-/* is this atom someone that we'd want to initiate a connection to? */
-static bool
-isPeerCandidate (const tr_torrent * tor, struct peer_atom * atom, const time_t now)
+/**
+ * When will this atom be someone that we'd want to initiate a connection to?
+ * @return a time <= now if it is already, or 0 if not until something changes.
+ */
+static time_t
+getPeerCandidateTime (const tr_torrent * tor, struct peer_atom * atom, const time_t now)
 {
+  int interval;
+  time_t when;
+
   /* not if we're both seeds */
   if (tr_torrentIsSeed (tor) && atomIsSeed (atom))
-    return false;
+    return 0;
 
   /* not if we've already got a connection to them... */
   if (peerIsInUse (tor->swarm, atom))
-    return false;
-
-  /* not if we just tried them already */
-  if ((now - atom->time) < getReconnectIntervalSecs (atom, now))
-    return false;
+    return 0;
 
   /* not if they're blocklisted */
   if (isAtomBlocklisted (tor->session, atom))
-    return false;
+    return 0;
 
   /* not if they're banned... */
   if (atom->flags2 & MYFLAG_BANNED)
-    return false;
+    return 0;
 
-  return true;
+  /* not if we just tried them already */
+  interval = getReconnectIntervalSecs (atom, now);
+  when = atom->time + interval;
+
+  /* the short interval for peers that recently sent us piece data
+     runs out soon, and the regular one that follows may be shorter */
+  if ((when > now) && (interval == MINIMUM_RECONNECT_INTERVAL_SECS))
+    when = MIN (when, atom->piece_data_time + MINIMUM_RECONNECT_INTERVAL_SECS * 2 + 1);
+
+  return MAX (when, 1);
 }
 
 struct peer_candidate
@@ -3966,6 +5206,7 @@ getPeerCandidates (tr_session * session, int * candidateCount, int max)
   while ((tor = tr_torrentNext (session, tor)))
     {
       int i, nAtoms;
+      time_t next;
       struct peer_atom ** atoms;
 
       if (!tor->swarm->isRunning)
@@ -3979,12 +5220,21 @@ getPeerCandidates (tr_session * session, int * candidateCount, int max)
       if (tr_torrentIsSeed (tor) && isBandwidthMaxedOut (&tor->bandwidth, now_msec, TR_UP))
         continue;
 
+      /* if none of this torrent's atoms can be candidates yet... */
+      if (now < tor->swarm->nextCandidateAt)
+        continue;
+
+      next = now + MAX_CANDIDATE_RESCAN_SECS;
       atoms = (struct peer_atom**) tr_ptrArrayPeek (&tor->swarm->pool, &nAtoms);
       for (i=0; i<nAtoms; ++i)
         {
           struct peer_atom * atom = atoms[i];
+          const time_t when = getPeerCandidateTime (tor, atom, now);
 
-          if (isPeerCandidate (tor, atom, now))
+          if (when == 0)
+            continue;
+
+          if (when <= now)
             {
               const uint8_t salt = tr_cryptoWeakRandInt (1024);
               walk->tor = tor;
@@ -3992,7 +5242,12 @@ getPeerCandidates (tr_session * session, int * candidateCount, int max)
               walk->score = getPeerCandidateScore (tor, atom, salt);
               ++walk;
             }
+
+          next = MIN (next, when);
         }
+
+      /* candidates we don't pick this time are still candidates next time */
+      tor->swarm->nextCandidateAt = next;
     }
 
   *candidateCount = walk - candidates;
@@ -4009,6 +5264,15 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
   tr_peerIo * io;
   const time_t now = tr_time ();
   bool utp = tr_sessionIsUTPEnabled (mgr->session) && !atom->utp_failed;
+  tr_encryption_mode encryptionMode = mgr->session->encryptionMode;
+
+  /* if this peer ended up in plaintext last time, and hasn't told us
+     since that it does encryption, skip the DH exchange and the
+     reconnect it would take to find that out again */
+  if ((encryptionMode == TR_ENCRYPTION_PREFERRED)
+      && (atom->flags2 & MYFLAG_PLAINTEXT)
+      && !(atom->flags & ADDED_F_ENCRYPTION_FLAG))
+    encryptionMode = TR_CLEAR_PREFERRED;
 
   if (atom->fromFirst == TR_PEER_FROM_PEX)
     /* PEX has explicit signalling for uTP support.  If an atom
@@ -4036,7 +5300,7 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
   else
     {
       tr_handshake * handshake = tr_handshakeNew (io,
-                                                  mgr->session->encryptionMode,
+                                                  encryptionMode,
                                                   myHandshakeDoneCB,
                                                   mgr);
 
@@ -4045,8 +5309,8 @@ initiateConnection (tr_peerMgr * mgr, tr_swarm * s, struct peer_atom * atom)
       tr_peerIoUnref (io); /* balanced by the initial ref
                               in tr_peerIoNewOutgoing () */
 
-      tr_ptrArrayInsertSorted (&s->outgoingHandshakes, handshake,
-                               handshakeCompare);
+      handshakesInsertSorted (&s->outgoingHandshakes, handshake);
+      ++mgr->outgoingHandshakeCount;
     }
 
   atom->lastConnectionAttemptAt = now;
@@ -4069,10 +5333,22 @@ initiateCandidateConnection (tr_peerMgr * mgr, struct peer_candidate * c)
 }
 
 static void
-makeNewPeerConnections (struct tr_peerMgr * mgr, const int max)
+makeNewPeerConnections (struct tr_peerMgr * mgr, int max)
 {
   int i, n;
   struct peer_candidate * candidates;
+  const int room = MAX_CONCURRENT_HANDSHAKES - INCOMING_HANDSHAKE_RESERVE
+                 - getHandshakeCount (mgr);
+
+  /* the candidates are sorted best-first, so when handshake slots
+     are scarce they go to the peers we want most */
+  max = MIN (max, room);
+  if (max <= 0)
+    return;
+
+  /* new peers would only make things worse until the memory's freed up */
+  if (tr_memBudgetIsLow (mgr->session))
+    return;
 
   candidates = getPeerCandidates (mgr->session, &n, max);
 
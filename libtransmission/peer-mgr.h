@@ -102,6 +102,9 @@ bool         tr_peerMgrDidPeerRequest       (const tr_torrent    * torrent,
                                              const tr_peer       * peer,
                                              tr_block_index_t      block);
 
+/** @brief true if everything we still need has already been requested */
+bool         tr_peerMgrIsEndgame            (const tr_torrent    * torrent);
+
 void         tr_peerMgrRebuildRequests      (tr_torrent          * torrent);
 
 void         tr_peerMgrAddIncoming          (tr_peerMgr          * manager,
@@ -134,6 +137,18 @@ void         tr_peerMgrAddPex               (tr_torrent          * tor,
                                              const tr_pex        * pex,
                                              int8_t                seedProbability);
 
+/**
+ * Like tr_peerMgrAddPex (), but for a whole list of peers at once
+ * @param seedProbabilities each peer's seedProbability,
+ *                          or NULL to use `seedProbability' for all of them
+ */
+void         tr_peerMgrAddPexList           (tr_torrent          * tor,
+                                             uint8_t               from,
+                                             const tr_pex        * pex,
+                                             size_t                pexCount,
+                                             const int8_t        * seedProbabilities,
+                                             int8_t                seedProbability);
+
 void         tr_peerMgrMarkAllAsSeeds       (tr_torrent          * tor);
 
 enum
@@ -148,6 +163,14 @@ int          tr_peerMgrGetPeers             (tr_torrent          * tor,
                                              uint8_t               peer_list_mode,
                                              int                   max_peer_count);
 
+/* Like tr_peerMgrGetPeers (tor, &pex, af, TR_PEERS_CONNECTED, max),
+   except the list is shared between callers for a few seconds and is
+   owned by the peer manager. It's valid until the next call. */
+int          tr_peerMgrGetPexSnapshot       (tr_torrent          * tor,
+                                             uint8_t               address_type,
+                                             int                   max_peer_count,
+                                             const tr_pex       ** setme_pex);
+
 void         tr_peerMgrStartTorrent         (tr_torrent          * tor);
 
 void         tr_peerMgrStopTorrent          (tr_torrent          * tor);
@@ -167,6 +190,9 @@ void         tr_peerMgrOnTorrentGotMetainfo (tr_torrent         * tor);
 
 void         tr_peerMgrOnBlocklistChanged   (tr_peerMgr         * manager);
 
+/** @return the bytes waiting in all the peers' buffers */
+uint64_t     tr_peerMgrGetBufferedBytes     (tr_peerMgr         * manager);
+
 struct tr_peer_stat * tr_peerMgrPeerStats   (const tr_torrent   * tor,
                                              int                * setmeCount);
 
@@ -9,6 +9,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h> /* INT_MAX */
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,6 +24,7 @@
 #include "crypto.h" /* tr_sha1 () */
 #include "file.h"
 #include "log.h"
+#include "metrics.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
@@ -81,6 +83,16 @@ enum
 
   METADATA_REQQ           = 64,
 
+  /* how many metadata pieces we'll ask one peer for at once */
+  METADATA_REQUESTS_PER_PEER = 8,
+
+  /* if a peer hasn't answered any of our metadata requests by now,
+     assume they were dropped and let it have some more */
+  METADATA_REQUEST_TIMEOUT_SECS = 10,
+
+  /* after a peer rejects a metadata request, leave it alone this long */
+  METADATA_REJECT_BACKOFF_SECS = 30,
+
   MAGIC_NUMBER            = 21549,
 
   /* used in lowering the outMessages queue period */
@@ -91,6 +103,12 @@ enum
   /* number of pieces we'll allow in our fast set */
   MAX_FAST_SET_SIZE = 3,
 
+  /* how many pieces we'll suggest to a peer at once, how often,
+     and how many of our suggestions we remember per peer */
+  MAX_SUGGESTS_PER_BATCH = 2,
+  SUGGEST_INTERVAL_SECS = 10,
+  SUGGEST_MEMORY = 16,
+
   /* how many blocks to keep prefetched per peer */
   PREFETCH_SIZE = 18,
 
@@ -99,6 +117,10 @@ enum
      meet our bandwidth goals for the next N seconds */
   REQUEST_BUF_SECS = 10,
 
+  /* give up on a round-trip probe that hasn't come back by now;
+     it was probably cancelled, rejected, or lost to a choke */
+  RTT_PROBE_TIMEOUT_MSEC = 30000,
+
   /* defined in BEP #9 */
   METADATA_MSG_TYPE_REQUEST = 0,
   METADATA_MSG_TYPE_DATA = 1,
@@ -194,6 +216,12 @@ struct tr_peerMsgs
   bool clientSentLtepHandshake;
   bool peerSentLtepHandshake;
 
+  /* cancels are waiting in outMessages for the next bandwidth pulse,
+   * or the next pacing pulse in the endgame. they don't go out after
+   * every write, so that an endgame run of cancels reaches this peer
+   * in one batch instead of a dozen writes */
+  bool cancelsPending;
+
   /*bool haveFastSet;*/
 
   int desiredRequestCount;
@@ -230,11 +258,20 @@ struct tr_peerMsgs
 
   struct evbuffer *      outMessages; /* all the non-piece messages */
 
-  struct peer_request    peerAskedFor[REQQ];
+  /* the requests this peer has made that we haven't answered yet.
+     this grows as needed, up to REQQ, so idle peers don't carry
+     a full-sized queue around */
+  struct peer_request  * peerAskedFor;
+  int                    peerAskedForAlloc;
 
   int peerAskedForMetadata[METADATA_REQQ];
   int peerAskedForMetadataCount;
 
+  /* our metadata requests to this peer that haven't been answered yet */
+  int metadataRequestsOutstanding;
+  time_t metadataRequestedAt;
+  time_t metadataRejectedAt;
+
   tr_pex * pex;
   tr_pex * pex6;
 
@@ -243,6 +280,9 @@ struct tr_peerMsgs
 
   time_t chokeChangedAt;
 
+  /* tr_time_msec () of updateStalls ()'s last sample, or 0 before the first */
+  uint64_t stallSampledAt;
+
   /* when we started batching the outMessages */
   time_t outMessagesBatchedAt;
 
@@ -253,6 +293,22 @@ struct tr_peerMsgs
      value is zero and should be ignored. */
   int64_t reqq;
 
+  /* our estimate of the round-trip time to this peer, or 0 if unknown.
+     it's measured by timing one request at a time (the probe) from when
+     we ask for it until the block arrives, less the time the peer spent
+     sending the blocks that were queued ahead of it. */
+  int rtt_msec;
+  bool rttProbing;
+  tr_block_index_t rttProbeBlock;
+  int rttProbeAhead;
+  uint64_t rttProbeSentAt;
+
+  /* the pieces we suggested to this peer lately, oldest first, so that
+     they're not suggested again and we can count how many were taken */
+  tr_piece_index_t suggested[SUGGEST_MEMORY];
+  int suggestedCount;
+  time_t clientSentSuggestAt;
+
   struct event * pexTimer;
 
   struct tr_peerIo * io;
@@ -268,6 +324,26 @@ getSession (struct tr_peerMsgs * msgs)
   return msgs->torrent->session;
 }
 
+/* the time spent reading and writing each torrent's peer messages is
+   added to tor->cpuUsec. handlers can nest (a uTP write calls back into
+   didWrite ()), so only the outermost one is timed */
+static int cpuTimerDepth = 0;
+static uint64_t cpuTimerStarted = 0;
+
+static void
+cpuTimerBegin (void)
+{
+  if (cpuTimerDepth++ == 0)
+    cpuTimerStarted = tr_metricsNow ();
+}
+
+static void
+cpuTimerEnd (tr_torrent * tor)
+{
+  if (--cpuTimerDepth == 0)
+    tor->cpuUsec += tr_metricsNow () - cpuTimerStarted;
+}
+
 /**
 ***
 **/
@@ -384,7 +460,7 @@ protocolSendCancel (tr_peerMsgs * msgs, const struct peer_request * req)
 
   dbgmsg (msgs, "cancelling %u:%u->%u...", req->index, req->offset, req->length);
   dbgOutMessageLen (msgs);
-  pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
+  msgs->cancelsPending = true;
 }
 
 static void
@@ -412,6 +488,22 @@ protocolSendHave (tr_peerMsgs * msgs, uint32_t index)
   pokeBatchPeriod (msgs, LOW_PRIORITY_INTERVAL_SECS);
 }
 
+static void
+protocolSendSuggest (tr_peerMsgs * msgs, uint32_t pieceIndex)
+{
+  struct evbuffer * out = msgs->outMessages;
+
+  assert (tr_peerIoSupportsFEXT (msgs->io));
+
+  evbuffer_add_uint32 (out, sizeof (uint8_t) + sizeof (uint32_t));
+  evbuffer_add_uint8 (out, BT_FEXT_SUGGEST);
+  evbuffer_add_uint32 (out, pieceIndex);
+
+  dbgmsg (msgs, "sending Suggest %u", pieceIndex);
+  dbgOutMessageLen (msgs);
+  pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
+}
+
 #if 0
 static void
 protocolSendAllowedFast (tr_peerMsgs * msgs, uint32_t pieceIndex)
@@ -876,12 +968,67 @@ tr_peerMsgsSetChoke (tr_peerMsgs * msgs, bool peer_is_choked)
 void
 tr_peerMsgsHave (tr_peerMsgs * msgs, uint32_t index)
 {
-  protocolSendHave (msgs, index);
+  /* a seed already has everything, so the HAVE would just be noise */
+  if (!tr_bitfieldHasAll (&msgs->peer.have))
+    protocolSendHave (msgs, index);
 
   /* since we have more pieces now, we might not be interested in this peer */
   updateInterest (msgs);
 }
 
+static int
+findSuggestion (const tr_peerMsgs * msgs, tr_piece_index_t piece)
+{
+  int i;
+
+  for (i=0; i<msgs->suggestedCount; ++i)
+    if (msgs->suggested[i] == piece)
+      return i;
+
+  return -1;
+}
+
+bool
+tr_peerMsgsCanSuggest (const tr_peerMsgs * msgs)
+{
+  return tr_peerIoSupportsFEXT (msgs->io)
+      && msgs->peer_is_interested
+      && !msgs->peer_is_choked
+      && msgs->clientSentSuggestAt + SUGGEST_INTERVAL_SECS <= tr_time ();
+}
+
+void
+tr_peerMsgsSuggest (tr_peerMsgs            * msgs,
+                    const tr_piece_index_t * pieces,
+                    size_t                   n)
+{
+  size_t i;
+  int sent = 0;
+
+  assert (tr_peerMsgsCanSuggest (msgs));
+
+  for (i=0; i<n && sent<MAX_SUGGESTS_PER_BATCH; ++i)
+    {
+      const tr_piece_index_t piece = pieces[i];
+
+      if (tr_bitfieldHas (&msgs->peer.have, piece) || findSuggestion (msgs, piece) >= 0)
+        continue;
+
+      if (msgs->suggestedCount == SUGGEST_MEMORY)
+        memmove (msgs->suggested, msgs->suggested + 1, --msgs->suggestedCount * sizeof (tr_piece_index_t));
+      msgs->suggested[msgs->suggestedCount++] = piece;
+
+      protocolSendSuggest (msgs, piece);
+      ++sent;
+    }
+
+  if (sent > 0)
+    {
+      msgs->clientSentSuggestAt = tr_time ();
+      tr_metricsAdd (getSession (msgs), TR_METRIC_SUGGESTS_SENT, sent);
+    }
+}
+
 /**
 ***
 **/
@@ -957,7 +1104,8 @@ sendLtepHandshake (tr_peerMsgs * msgs)
         tr_variantDictAddInt (&val, TR_KEY_metadata_size, msgs->torrent->infoDictLength);
     tr_variantDictAddInt (&val, TR_KEY_p, tr_sessionGetPublicPeerPort (getSession (msgs)));
     tr_variantDictAddInt (&val, TR_KEY_reqq, REQQ);
-    tr_variantDictAddInt (&val, TR_KEY_upload_only, tr_torrentIsSeed (msgs->torrent));
+    tr_variantDictAddInt (&val, TR_KEY_upload_only, tr_torrentIsSeed (msgs->torrent)
+                                                 && !tr_torrentIsSuperSeedingNow (msgs->torrent));
     tr_variantDictAddQuark (&val, TR_KEY_v, version_quark);
     if (allow_metadata_xfer || allow_pex) {
         tr_variant * m  = tr_variantDictAddDict (&val, TR_KEY_m, 2);
@@ -1106,9 +1254,16 @@ parseUtMetadata (tr_peerMsgs * msgs, int msglen, struct evbuffer * inbuf)
     dbgmsg (msgs, "got ut_metadata msg: type %d, piece %d, total_size %d",
           (int)msg_type, (int)piece, (int)total_size);
 
+    if ((msg_type == METADATA_MSG_TYPE_DATA) || (msg_type == METADATA_MSG_TYPE_REJECT))
+    {
+        if (msgs->metadataRequestsOutstanding > 0)
+            --msgs->metadataRequestsOutstanding;
+    }
+
     if (msg_type == METADATA_MSG_TYPE_REJECT)
     {
-        /* NOOP */
+        msgs->metadataRejectedAt = tr_time ();
+        tr_torrentMetadataPieceRejected (msgs->torrent, piece);
     }
 
     if ((msg_type == METADATA_MSG_TYPE_DATA)
@@ -1158,66 +1313,71 @@ parseUtMetadata (tr_peerMsgs * msgs, int msglen, struct evbuffer * inbuf)
     tr_free (tmp);
 }
 
+static void
+addPexList (tr_torrent * tor, const tr_pex * pex, size_t n,
+            const uint8_t * added_f, size_t added_f_len)
+{
+    size_t i;
+    int8_t seedProbabilities[MAX_PEX_PEER_COUNT];
+
+    assert (n <= MAX_PEX_PEER_COUNT);
+
+    for (i=0; i<n; ++i)
+    {
+        seedProbabilities[i] = -1;
+        if (i < added_f_len) seedProbabilities[i] = (added_f[i] & ADDED_F_SEED_FLAG) ? 100 : 0;
+    }
+
+    tr_peerMgrAddPexList (tor, TR_PEER_FROM_PEX, pex, n, seedProbabilities, -1);
+}
+
 static void
 parseUtPex (tr_peerMsgs * msgs, int msglen, struct evbuffer * inbuf)
 {
-    int loaded = 0;
     uint8_t * tmp = tr_new (uint8_t, msglen);
-    tr_variant val;
     tr_torrent * tor = msgs->torrent;
     const uint8_t * added;
     size_t added_len;
 
     tr_peerIoReadBytes (msgs->io, inbuf, tmp, msglen);
 
-    if (tr_torrentAllowsPex (tor)
-      && ((loaded = !tr_variantFromBenc (&val, tmp, msglen))))
+    /* the compact lists are read in place rather than parsing
+       the whole message into a variant */
+    if (tr_torrentAllowsPex (tor))
     {
-        if (tr_variantDictFindRaw (&val, TR_KEY_added, &added, &added_len))
+        if (tr_variantBencDictFindRaw (tmp, msglen, TR_KEY_added, &added, &added_len))
         {
             tr_pex * pex;
-            size_t i, n;
+            size_t n;
             size_t added_f_len = 0;
             const uint8_t * added_f = NULL;
 
-            tr_variantDictFindRaw (&val, TR_KEY_added_f, &added_f, &added_f_len);
+            tr_variantBencDictFindRaw (tmp, msglen, TR_KEY_added_f, &added_f, &added_f_len);
             pex = tr_peerMgrCompactToPex (added, added_len, added_f, added_f_len, &n);
 
             n = MIN (n, MAX_PEX_PEER_COUNT);
-            for (i=0; i<n; ++i)
-            {
-                int seedProbability = -1;
-                if (i < added_f_len) seedProbability = (added_f[i] & ADDED_F_SEED_FLAG) ? 100 : 0;
-                tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, pex+i, seedProbability);
-            }
+            addPexList (tor, pex, n, added_f, added_f_len);
 
             tr_free (pex);
         }
 
-        if (tr_variantDictFindRaw (&val, TR_KEY_added6, &added, &added_len))
+        if (tr_variantBencDictFindRaw (tmp, msglen, TR_KEY_added6, &added, &added_len))
         {
             tr_pex * pex;
-            size_t i, n;
+            size_t n;
             size_t added_f_len = 0;
             const uint8_t * added_f = NULL;
 
-            tr_variantDictFindRaw (&val, TR_KEY_added6_f, &added_f, &added_f_len);
+            tr_variantBencDictFindRaw (tmp, msglen, TR_KEY_added6_f, &added_f, &added_f_len);
             pex = tr_peerMgrCompact6ToPex (added, added_len, added_f, added_f_len, &n);
 
             n = MIN (n, MAX_PEX_PEER_COUNT);
-            for (i=0; i<n; ++i)
-            {
-                int seedProbability = -1;
-                if (i < added_f_len) seedProbability = (added_f[i] & ADDED_F_SEED_FLAG) ? 100 : 0;
-                tr_peerMgrAddPex (tor, TR_PEER_FROM_PEX, pex+i, seedProbability);
-            }
+            addPexList (tor, pex, n, added_f, added_f_len);
 
             tr_free (pex);
         }
     }
 
-    if (loaded)
-        tr_variantFree (&val);
     tr_free (tmp);
 }
 
@@ -1358,8 +1518,20 @@ peerMadeRequest (tr_peerMsgs * msgs, const struct peer_request * req)
         allow = true;
 
     if (allow) {
+        if (msgs->peer.pendingReqsToClient == msgs->peerAskedForAlloc) {
+            msgs->peerAskedForAlloc = MIN (REQQ, MAX (16, msgs->peerAskedForAlloc * 2));
+            msgs->peerAskedFor = tr_renew (struct peer_request, msgs->peerAskedFor, msgs->peerAskedForAlloc);
+        }
         msgs->peerAskedFor[msgs->peer.pendingReqsToClient++] = *req;
         prefetchPieces (msgs);
+
+        if (msgs->suggestedCount > 0) {
+            const int i = findSuggestion (msgs, req->index);
+            if (i >= 0) {
+                memmove (msgs->suggested + i, msgs->suggested + i + 1, (--msgs->suggestedCount - i) * sizeof (tr_piece_index_t));
+                tr_metricsAdd (getSession (msgs), TR_METRIC_SUGGESTS_TAKEN, 1);
+            }
+        }
     } else if (fext) {
         protocolSendReject (msgs, req);
     }
@@ -1437,6 +1609,32 @@ readBtPiece (tr_peerMsgs      * msgs,
         dbgmsg (msgs, "got incoming block header %u:%u->%u", req->index, req->offset, req->length);
         return READ_NOW;
     }
+    else if ((inlen >= req->length) && ((msgs->incoming.block == NULL)
+                                     || !evbuffer_get_length (msgs->incoming.block)))
+    {
+        int err;
+        size_t consumed;
+        const size_t before = evbuffer_get_length (inbuf);
+
+        /* the whole block is already here, so skip incoming.block and
+           let the cache take its chains straight from the read buffer */
+        tr_peerIoDecryptInPlace (msgs->io, inbuf, req->length);
+        fireClientGotPieceData (msgs, req->length);
+        *setme_piece_bytes_read += req->length;
+        dbgmsg (msgs, "got all of block %u:%u->%u at once", req->index, req->offset, req->length);
+
+        err = clientGotBlock (msgs, inbuf, req);
+
+        /* drop whatever the cache didn't take, e.g. blocks we didn't ask for */
+        consumed = before - evbuffer_get_length (inbuf);
+        if (consumed < req->length)
+            evbuffer_drain (inbuf, req->length - consumed);
+
+        /* cleanup */
+        req->length = 0;
+        msgs->state = AWAITING_BT_LENGTH;
+        return err ? READ_ERR : READ_NOW;
+    }
     else
     {
         int err;
@@ -1505,6 +1703,7 @@ readBtMessage (tr_peerMsgs * msgs, struct evbuffer * inbuf, size_t inlen)
         case BT_CHOKE:
             dbgmsg (msgs, "got Choke");
             msgs->client_is_choked = true;
+            msgs->rttProbing = false;
             if (!fext)
                 fireGotChoke (msgs);
             tr_peerMsgsUpdateActive (msgs, TR_PEER_TO_CLIENT);
@@ -1685,6 +1884,31 @@ assert (tr_bitfieldHasAll (&msgs->peer.have));
     return READ_NOW;
 }
 
+/* the probe request came back, so fold its round trip into our estimate */
+static void
+updateRoundTripTime (tr_peerMsgs * msgs)
+{
+    const uint64_t now = tr_time_msec ();
+    const unsigned int rate_Bps = tr_peerGetPieceSpeed_Bps (&msgs->peer, now, TR_PEER_TO_CLIENT);
+    int64_t sample = now - msgs->rttProbeSentAt;
+
+    /* don't count the time spent sending the blocks queued ahead of it */
+    if ((msgs->rttProbeAhead > 0) && (rate_Bps > 0))
+        sample -= ((int64_t)msgs->rttProbeAhead * msgs->torrent->blockSize * 1000) / rate_Bps;
+
+    msgs->rttProbing = false;
+
+    if (sample < 1)
+        sample = 1;
+
+    if (msgs->rtt_msec == 0)
+        msgs->rtt_msec = (int) sample;
+    else
+        msgs->rtt_msec = (int)((msgs->rtt_msec * 7 + sample) / 8);
+
+    dbgmsg (msgs, "round-trip sample %d msec; estimate is now %d msec", (int)sample, msgs->rtt_msec);
+}
+
 /* returns 0 on success, or an errno on failure */
 static int
 clientGotBlock (tr_peerMsgs                * msgs,
@@ -1714,10 +1938,16 @@ clientGotBlock (tr_peerMsgs                * msgs,
 
     if (!tr_peerMgrDidPeerRequest (msgs->torrent, &msgs->peer, block)) {
         dbgmsg (msgs, "we didn't ask for this message...");
+        /* most likely we cancelled it because someone else beat this peer to it */
+        if (tr_torrentBlockIsComplete (tor, block))
+            tr_swarmAddWastedBytes (tor->swarm, req->length);
         return 0;
     }
+    if (msgs->rttProbing && (msgs->rttProbeBlock == block))
+        updateRoundTripTime (msgs);
     if (tr_torrentPieceIsComplete (msgs->torrent, req->index)) {
         dbgmsg (msgs, "we did ask for this message, but the piece is already complete...");
+        tr_swarmAddWastedBytes (tor->swarm, req->length);
         return 0;
     }
 
@@ -1728,6 +1958,11 @@ clientGotBlock (tr_peerMsgs                * msgs,
     if ((err = tr_cacheWriteBlock (getSession (msgs)->cache, tor, req->index, req->offset, req->length, data)))
         return err;
 
+    /* if the disk isn't keeping up, stop reading the torrent's sockets.
+       pacingPulse () starts them again once the disk has caught up */
+    if (tr_cacheIsWriteQueueFull (getSession (msgs)->cache, tor))
+        tr_bandwidthSetPaused (&tor->bandwidth, TR_DOWN, true);
+
     tr_bitfieldAdd (&msgs->peer.blame, req->index);
     fireGotBlock (msgs, req);
     return 0;
@@ -1752,11 +1987,14 @@ canRead (tr_peerIo * io, void * vmsgs, size_t * piece)
 {
     ReadState         ret;
     tr_peerMsgs *     msgs = vmsgs;
+    tr_torrent *      tor = msgs->torrent;
     struct evbuffer * in = tr_peerIoGetReadBuffer (io);
     const size_t      inlen = evbuffer_get_length (in);
 
     dbgmsg (msgs, "canRead: inlen is %"TR_PRIuSIZE", msgs->state is %d", inlen, msgs->state);
 
+    cpuTimerBegin ();
+
     if (!inlen)
     {
         ret = READ_LATER;
@@ -1781,6 +2019,8 @@ canRead (tr_peerIo * io, void * vmsgs, size_t * piece)
             assert (0);
     }
 
+    cpuTimerEnd (tor);
+
     dbgmsg (msgs, "canRead: ret is %d", (int)ret);
 
     return ret;
@@ -1801,6 +2041,13 @@ tr_peerMsgsIsReadingBlock (const tr_peerMsgs * msgs, tr_block_index_t block)
 ***
 **/
 
+static int
+getMaxRequestCount (const tr_peerMsgs * msgs)
+{
+    /* honor the peer's maximum request count, if specified */
+    return msgs->reqq > 0 ? (int) MIN (msgs->reqq, INT_MAX) : REQQ;
+}
+
 static void
 updateDesiredRequestCount (tr_peerMsgs * msgs)
 {
@@ -1816,6 +2063,7 @@ updateDesiredRequestCount (tr_peerMsgs * msgs)
     else
     {
         int estimatedBlocksInPeriod;
+        unsigned int peer_Bps;
         unsigned int rate_Bps;
         unsigned int irate_Bps;
         const int floor = 4;
@@ -1824,7 +2072,7 @@ updateDesiredRequestCount (tr_peerMsgs * msgs)
 
         /* Get the rate limit we should use.
          * FIXME: this needs to consider all the other peers as well... */
-        rate_Bps = tr_peerGetPieceSpeed_Bps (&msgs->peer, now, TR_PEER_TO_CLIENT);
+        rate_Bps = peer_Bps = tr_peerGetPieceSpeed_Bps (&msgs->peer, now, TR_PEER_TO_CLIENT);
         if (tr_torrentUsesSpeedLimit (torrent, TR_PEER_TO_CLIENT))
             rate_Bps = MIN (rate_Bps, tr_torrentGetSpeedLimit_Bps (torrent, TR_PEER_TO_CLIENT));
 
@@ -1838,10 +2086,23 @@ updateDesiredRequestCount (tr_peerMsgs * msgs)
         estimatedBlocksInPeriod = (rate_Bps * seconds) / torrent->blockSize;
         msgs->desiredRequestCount = MAX (floor, estimatedBlocksInPeriod);
 
-        /* honor the peer's maximum request count, if specified */
-        if (msgs->reqq > 0)
-            if (msgs->desiredRequestCount > msgs->reqq)
-                msgs->desiredRequestCount = msgs->reqq;
+        /* The rate above can only be as fast as our pipeline lets it be:
+         * with N blocks in flight, a peer `rtt' away can't send us more
+         * than N blocks per round trip. If it's sending us at least half
+         * that much and no speed limit is holding it back, the pipeline
+         * is probably the bottleneck (as it is for far-away seedboxes
+         * while the rate is still ramping up), so let it double. */
+        if ((msgs->rtt_msec > 0) && (rate_Bps == peer_Bps))
+        {
+            const int pending = MAX (floor, msgs->peer.pendingReqsToPeer);
+            const uint64_t pipe_Bps = ((uint64_t)pending * torrent->blockSize * 1000u) / msgs->rtt_msec;
+
+            if ((uint64_t)peer_Bps * 2u >= pipe_Bps)
+                msgs->desiredRequestCount = MAX (msgs->desiredRequestCount,
+                                                 MIN (pending * 2, getMaxRequestCount (msgs)));
+        }
+
+        msgs->desiredRequestCount = MIN (msgs->desiredRequestCount, getMaxRequestCount (msgs));
     }
 }
 
@@ -1850,7 +2111,20 @@ updateMetadataRequests (tr_peerMsgs * msgs, time_t now)
 {
     int piece;
 
-    if (msgs->peerSupportsMetadataXfer
+    if (!msgs->peerSupportsMetadataXfer)
+        return;
+
+    if (msgs->metadataRejectedAt + METADATA_REJECT_BACKOFF_SECS > now)
+        return;
+
+    if (msgs->metadataRequestsOutstanding > 0
+        && msgs->metadataRequestedAt + METADATA_REQUEST_TIMEOUT_SECS < now)
+        msgs->metadataRequestsOutstanding = 0;
+
+    /* keep several requests in flight with each peer. Since every peer
+       is handed the least-recently-requested pieces, the pieces get
+       spread across all the peers that can send them */
+    while (msgs->metadataRequestsOutstanding < METADATA_REQUESTS_PER_PEER
         && tr_torrentGetNextMetadataRequest (msgs->torrent, now, &piece))
     {
         tr_variant tmp;
@@ -1864,6 +2138,8 @@ updateMetadataRequests (tr_peerMsgs * msgs, time_t now)
         payload = tr_variantToBuf (&tmp, TR_VARIANT_FMT_BENC);
 
         dbgmsg (msgs, "requesting metadata piece #%d", piece);
+        ++msgs->metadataRequestsOutstanding;
+        msgs->metadataRequestedAt = now;
 
         /* write it out as a LTEP message to our outMessages buffer */
         evbuffer_add_uint32 (out, 2 * sizeof (uint8_t) + evbuffer_get_length (payload));
@@ -1890,6 +2166,8 @@ updateBlockRequests (tr_peerMsgs * msgs)
         int n;
         tr_block_index_t * blocks;
         const int numwant = msgs->desiredRequestCount - msgs->peer.pendingReqsToPeer;
+        const int ahead = msgs->peer.pendingReqsToPeer;
+        const uint64_t now = tr_time_msec ();
 
         assert (tr_peerMsgsIsClientInterested (msgs));
         assert (!tr_peerMsgsIsClientChoked (msgs));
@@ -1897,6 +2175,17 @@ updateBlockRequests (tr_peerMsgs * msgs)
         blocks = tr_new (tr_block_index_t, numwant);
         tr_peerMgrGetNextRequests (msgs->torrent, &msgs->peer, numwant, blocks, &n, false);
 
+        if (msgs->rttProbing && (now - msgs->rttProbeSentAt >= RTT_PROBE_TIMEOUT_MSEC))
+            msgs->rttProbing = false;
+
+        if (!msgs->rttProbing && (n > 0))
+        {
+            msgs->rttProbing = true;
+            msgs->rttProbeBlock = blocks[0];
+            msgs->rttProbeAhead = ahead;
+            msgs->rttProbeSentAt = now;
+        }
+
         for (i=0; i<n; ++i)
         {
             struct peer_request req;
@@ -1908,6 +2197,20 @@ updateBlockRequests (tr_peerMsgs * msgs)
     }
 }
 
+static size_t
+flushOutMessages (tr_peerMsgs * msgs, time_t now)
+{
+    const size_t len = evbuffer_get_length (msgs->outMessages);
+
+    dbgmsg (msgs, "flushing outMessages... to %p (length is %"TR_PRIuSIZE")", (void*)msgs->io, len);
+    tr_peerIoWriteBuf (msgs->io, msgs->outMessages, false);
+    msgs->clientSentAnythingAt = now;
+    msgs->outMessagesBatchedAt = 0;
+    msgs->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
+    msgs->cancelsPending = false;
+    return len;
+}
+
 static size_t
 fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
 {
@@ -1928,14 +2231,7 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     }
     else if (haveMessages && ((now - msgs->outMessagesBatchedAt) >= msgs->outMessagesBatchPeriod))
     {
-        const size_t len = evbuffer_get_length (msgs->outMessages);
-        /* flush the protocol messages */
-        dbgmsg (msgs, "flushing outMessages... to %p (length is %"TR_PRIuSIZE")", (void*)msgs->io, len);
-        tr_peerIoWriteBuf (msgs->io, msgs->outMessages, false);
-        msgs->clientSentAnythingAt = now;
-        msgs->outMessagesBatchedAt = 0;
-        msgs->outMessagesBatchPeriod = LOW_PRIORITY_INTERVAL_SECS;
-        bytesWritten +=  len;
+        bytesWritten += flushOutMessages (msgs, now);
     }
 
     /**
@@ -1945,12 +2241,12 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
     if ((tr_peerIoGetWriteBufferSpace (msgs->io, now) >= METADATA_PIECE_SIZE)
         && popNextMetadataRequest (msgs, &piece))
     {
-        char * data;
         int dataLen;
         bool ok = false;
+        struct evbuffer * data = evbuffer_new ();
 
-        data = tr_torrentGetMetadataPiece (msgs->torrent, piece, &dataLen);
-        if ((dataLen > 0) && (data != NULL))
+        dataLen = tr_torrentGetMetadataPiece (msgs->torrent, piece, data);
+        if (dataLen > 0)
         {
             tr_variant tmp;
             struct evbuffer * payload;
@@ -1968,17 +2264,18 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
             evbuffer_add_uint8 (out, BT_LTEP);
             evbuffer_add_uint8 (out, msgs->ut_metadata_id);
             evbuffer_add_buffer (out, payload);
-            evbuffer_add     (out, data, dataLen);
+            evbuffer_add_buffer (out, data);
             pokeBatchPeriod (msgs, HIGH_PRIORITY_INTERVAL_SECS);
             dbgOutMessageLen (msgs);
 
             evbuffer_free (payload);
             tr_variantFree (&tmp);
-            tr_free (data);
 
             ok = true;
         }
 
+        evbuffer_free (data);
+
         if (!ok) /* send a rejection message */
         {
             tr_variant tmp;
@@ -2016,28 +2313,35 @@ fillOutputBuffer (tr_peerMsgs * msgs, time_t now)
         if (requestIsValid (msgs, &req)
             && tr_torrentPieceIsComplete (msgs->torrent, req.index))
         {
-            int err;
+            int err = 0;
             const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
             struct evbuffer * out;
-            struct evbuffer_iovec iovec[1];
+            tr_cache * cache = getSession (msgs)->cache;
+
+            /* check the piece if it needs checking... */
+            if (tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
+                if ((err = !tr_torrentCheckPiece (msgs->torrent, req.index)))
+                    tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%"TR_PRIuSIZE" is corrupt."), (size_t)req.index);
 
             out = evbuffer_new ();
-            evbuffer_expand (out, msglen);
+            evbuffer_expand (out, msglen - req.length);
 
             evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
             evbuffer_add_uint8 (out, BT_PIECE);
             evbuffer_add_uint32 (out, req.index);
             evbuffer_add_uint32 (out, req.offset);
 
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
-
-            /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
-                if ((err = !tr_torrentCheckPiece (msgs->torrent, req.index)))
-                    tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%"TR_PRIuSIZE" is corrupt."), (size_t)req.index);
+            /* send the block straight from the file if we can,
+               or fall back to copying it into the message */
+            if (!err && (!tr_peerIoCanSendFile (msgs->io)
+                         || tr_cacheAddBlockFile (cache, msgs->torrent, req.index, req.offset, req.length, out)))
+            {
+                struct evbuffer_iovec iovec[1];
+                evbuffer_reserve_space (out, req.length, iovec, 1);
+                err = tr_cacheReadBlock (cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
+                iovec[0].iov_len = req.length;
+                evbuffer_commit_space (out, iovec, 1);
+            }
 
             if (err)
             {
@@ -2094,6 +2398,8 @@ peerPulse (void * vmsgs)
     tr_peerMsgs * msgs = vmsgs;
     const time_t  now = tr_time ();
 
+    cpuTimerBegin ();
+
     if (tr_isPeerIo (msgs->io)) {
         updateDesiredRequestCount (msgs);
         updateBlockRequests (msgs);
@@ -2104,14 +2410,124 @@ peerPulse (void * vmsgs)
         if (fillOutputBuffer (msgs, now) < 1)
             break;
 
+    cpuTimerEnd (msgs->torrent);
+
     return true; /* loop forever */
 }
 
+int
+tr_peerMsgsGetUploadReads (const tr_peerMsgs    * msgs,
+                           struct tr_cache_read * setme,
+                           int                    max)
+{
+    int i;
+    int n = 0;
+
+    /* these go straight from the file to the socket, without a read of ours */
+    if (tr_peerIoCanSendFile (msgs->io) && !msgs->torrent->session->isPageCacheBypassEnabled)
+        return 0;
+
+    for (i=0; i<msgs->peer.pendingReqsToClient && n<max; ++i)
+    {
+        const struct peer_request * req = msgs->peerAskedFor + i;
+
+        if (requestIsValid (msgs, req) && tr_torrentPieceIsComplete (msgs->torrent, req->index))
+        {
+            setme[n].tor = msgs->torrent;
+            setme[n].piece = req->index;
+            setme[n].offset = req->offset;
+            setme[n].length = req->length;
+            ++n;
+        }
+    }
+
+    return n;
+}
+
+/* the first tr_peer_stall that applies to this peer in one direction.
+ * `since' is the previous sample, so a speed limit that ran out at any
+ * point in between counts even if it's been refilled by now. */
+static tr_peer_stall
+getStall (const tr_peerMsgs * msgs, tr_direction dir, uint64_t since, uint64_t now)
+{
+    const bool upload = dir == TR_CLIENT_TO_PEER;
+    const bool interested = upload ? msgs->peer_is_interested : msgs->client_is_interested;
+    const bool choked = upload ? msgs->peer_is_choked : msgs->client_is_choked;
+    const int pending = upload ? msgs->peer.pendingReqsToClient : msgs->peer.pendingReqsToPeer;
+
+    if (!interested)
+        return TR_PEER_STALL_UNINTERESTED;
+
+    if (choked)
+        return TR_PEER_STALL_CHOKED;
+
+    if (tr_bandwidthGetClampedAt (&msgs->io->bandwidth, dir) > since)
+        return TR_PEER_STALL_BANDWIDTH;
+
+    /* checked before the requests because blocks we've already
+       put in the output buffer are still being sent */
+    if (tr_peerGetPieceSpeed_Bps (&msgs->peer, now, dir) > 0)
+        return TR_PEER_STALL_NONE;
+
+    if (pending < 1)
+        return TR_PEER_STALL_NO_REQUESTS;
+
+    if (!upload)
+        return TR_PEER_STALL_PEER;
+
+    if (tr_peerIoGetWriteBufferSpace (msgs->io, tr_time ()) < msgs->torrent->blockSize)
+        return TR_PEER_STALL_OUTBUF;
+
+    return TR_PEER_STALL_DISK;
+}
+
+/* charge the time since the last sample to the state each direction is in now */
+static void
+updateStalls (tr_peerMsgs * msgs)
+{
+    const uint64_t now = tr_time_msec ();
+    const uint64_t since = msgs->stallSampledAt;
+
+    msgs->stallSampledAt = now;
+
+    if ((since != 0) && (now > since) && tr_isPeerIo (msgs->io))
+    {
+        int dir;
+
+        for (dir=TR_UP; dir<=TR_DOWN; ++dir)
+        {
+            const tr_peer_stall stall = getStall (msgs, dir, since, now);
+
+            msgs->peer.stallMsec[dir][stall] += now - since;
+            msgs->torrent->stallMsec[dir][stall] += now - since;
+        }
+    }
+}
+
 void
 tr_peerMsgsPulse (tr_peerMsgs * msgs)
 {
     if (msgs != NULL)
+    {
+        if (msgs->cancelsPending)
+        {
+            msgs->cancelsPending = false;
+            pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
+        }
+
+        if (tr_isPeerIo (msgs->io))
+            tr_peerIoTune (msgs->io, tr_time ());
+
         peerPulse (msgs);
+        updateStalls (msgs);
+    }
+}
+
+void
+tr_peerMsgsFlushCancels (tr_peerMsgs * msgs)
+{
+    if ((msgs != NULL) && msgs->cancelsPending && tr_isPeerIo (msgs->io))
+        flushOutMessages (msgs, tr_time ());
 }
 
 static void
@@ -2128,20 +2544,18 @@ gotError (tr_peerIo * io UNUSED, short what, void * vmsgs)
 static void
 sendBitfield (tr_peerMsgs * msgs)
 {
-    void * bytes;
+    const void * bytes;
     size_t byte_count = 0;
     struct evbuffer * out = msgs->outMessages;
 
     assert (tr_torrentHasMetadata (msgs->torrent));
 
-    bytes = tr_torrentCreatePieceBitfield (msgs->torrent, &byte_count);
+    bytes = tr_torrentGetPieceBitfield (msgs->torrent, &byte_count);
     evbuffer_add_uint32 (out, sizeof (uint8_t) + byte_count);
     evbuffer_add_uint8 (out, BT_BITFIELD);
     evbuffer_add     (out, bytes, byte_count);
     dbgmsg (msgs, "sending bitfield... outMessage size is now %"TR_PRIuSIZE, evbuffer_get_length (out));
     pokeBatchPeriod (msgs, IMMEDIATE_PRIORITY_INTERVAL_SECS);
-
-    tr_free (bytes);
 }
 
 static void
@@ -2149,7 +2563,13 @@ tellPeerWhatWeHave (tr_peerMsgs * msgs)
 {
     const bool fext = tr_peerIoSupportsFEXT (msgs->io);
 
-    if (fext && tr_torrentHasAll (msgs->torrent))
+    /* the peer-mgr tells super-seeded peers about pieces one at a time */
+    if (tr_torrentIsSuperSeedingNow (msgs->torrent))
+    {
+        if (fext)
+            protocolSendHaveNone (msgs);
+    }
+    else if (fext && tr_torrentHasAll (msgs->torrent))
     {
         protocolSendHaveAll (msgs);
     }
@@ -2285,6 +2705,61 @@ tr_set_compare (const void * va, size_t aCount,
 }
 
 
+/* append a bencoded "key" with the compact form of the given peers */
+static void
+pexAddCompact (struct evbuffer  * payload,
+               const char       * key,
+               const tr_pex     * pex,
+               int                count,
+               uint8_t            af)
+{
+    int i;
+    uint8_t * walk;
+    struct evbuffer_iovec iovec[1];
+    const size_t addrLen = af == TR_AF_INET ? 4 : 16;
+    const size_t len = count * (addrLen + 2);
+
+    evbuffer_add_printf (payload, "%d:%s%d:", (int)strlen (key), key, (int)len);
+
+    evbuffer_reserve_space (payload, len, iovec, 1);
+    walk = iovec[0].iov_base;
+    for (i=0; i<count; ++i)
+    {
+        if (af == TR_AF_INET)
+            memcpy (walk, &pex[i].addr.addr.addr4, 4);
+        else
+            memcpy (walk, &pex[i].addr.addr.addr6.s6_addr, 16);
+        walk += addrLen;
+        memcpy (walk, &pex[i].port, 2);
+        walk += 2;
+    }
+    assert ((size_t)(walk - (uint8_t*)iovec[0].iov_base) == len);
+    iovec[0].iov_len = len;
+    evbuffer_commit_space (payload, iovec, 1);
+}
+
+/* append a bencoded "key" with the flags of the given peers.
+ * unset each holepunch flag because we don't support it. */
+static void
+pexAddFlags (struct evbuffer  * payload,
+             const char       * key,
+             const tr_pex     * pex,
+             int                count)
+{
+    int i;
+    uint8_t * walk;
+    struct evbuffer_iovec iovec[1];
+
+    evbuffer_add_printf (payload, "%d:%s%d:", (int)strlen (key), key, count);
+
+    evbuffer_reserve_space (payload, count, iovec, 1);
+    walk = iovec[0].iov_base;
+    for (i=0; i<count; ++i)
+        *walk++ = pex[i].flags & ~ADDED_F_HOLEPUNCH;
+    iovec[0].iov_len = count;
+    evbuffer_commit_space (payload, iovec, 1);
+}
+
 static void
 sendPex (tr_peerMsgs * msgs)
 {
@@ -2292,10 +2767,10 @@ sendPex (tr_peerMsgs * msgs)
     {
         PexDiffs diffs;
         PexDiffs diffs6;
-        tr_pex * newPex = NULL;
-        tr_pex * newPex6 = NULL;
-        const int newCount = tr_peerMgrGetPeers (msgs->torrent, &newPex, TR_AF_INET, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
-        const int newCount6 = tr_peerMgrGetPeers (msgs->torrent, &newPex6, TR_AF_INET6, TR_PEERS_CONNECTED, MAX_PEX_PEER_COUNT);
+        const tr_pex * newPex = NULL;
+        const tr_pex * newPex6 = NULL;
+        const int newCount = tr_peerMgrGetPexSnapshot (msgs->torrent, TR_AF_INET, MAX_PEX_PEER_COUNT, &newPex);
+        const int newCount6 = tr_peerMgrGetPexSnapshot (msgs->torrent, TR_AF_INET6, MAX_PEX_PEER_COUNT, &newPex6);
 
         /* build the diffs */
         diffs.added = tr_new (tr_pex, newCount);
@@ -2334,9 +2809,6 @@ sendPex (tr_peerMsgs * msgs)
         }
         else
         {
-            int  i;
-            tr_variant val;
-            uint8_t * tmp, *walk;
             struct evbuffer * payload;
             struct evbuffer * out = msgs->outMessages;
 
@@ -2348,86 +2820,28 @@ sendPex (tr_peerMsgs * msgs)
             msgs->pex6 = diffs6.elements;
             msgs->pexCount6 = diffs6.elementCount;
 
-            /* build the pex payload */
-            tr_variantInitDict (&val, 3); /* ipv6 support: left as 3:
-                                         * speed vs. likelihood? */
-
+            /* build the pex payload. it's written directly rather than
+             * through a tr_variant, so the keys must be added here in
+             * the sorted order that benc requires */
+            payload = evbuffer_new ();
+            evbuffer_add (payload, "d", 1);
             if (diffs.addedCount > 0)
             {
-                /* "added" */
-                tmp = walk = tr_new (uint8_t, diffs.addedCount * 6);
-                for (i = 0; i < diffs.addedCount; ++i) {
-                    memcpy (walk, &diffs.added[i].addr.addr, 4); walk += 4;
-                    memcpy (walk, &diffs.added[i].port, 2); walk += 2;
-                }
-                assert ((walk - tmp) == diffs.addedCount * 6);
-                tr_variantDictAddRaw (&val, TR_KEY_added, tmp, walk - tmp);
-                tr_free (tmp);
-
-                /* "added.f"
-                 * unset each holepunch flag because we don't support it. */
-                tmp = walk = tr_new (uint8_t, diffs.addedCount);
-                for (i = 0; i < diffs.addedCount; ++i)
-                    *walk++ = diffs.added[i].flags & ~ADDED_F_HOLEPUNCH;
-                assert ((walk - tmp) == diffs.addedCount);
-                tr_variantDictAddRaw (&val, TR_KEY_added_f, tmp, walk - tmp);
-                tr_free (tmp);
+                pexAddCompact (payload, "added", diffs.added, diffs.addedCount, TR_AF_INET);
+                pexAddFlags (payload, "added.f", diffs.added, diffs.addedCount);
             }
-
-            if (diffs.droppedCount > 0)
-            {
-                /* "dropped" */
-                tmp = walk = tr_new (uint8_t, diffs.droppedCount * 6);
-                for (i = 0; i < diffs.droppedCount; ++i) {
-                    memcpy (walk, &diffs.dropped[i].addr.addr, 4); walk += 4;
-                    memcpy (walk, &diffs.dropped[i].port, 2); walk += 2;
-                }
-                assert ((walk - tmp) == diffs.droppedCount * 6);
-                tr_variantDictAddRaw (&val, TR_KEY_dropped, tmp, walk - tmp);
-                tr_free (tmp);
-            }
-
             if (diffs6.addedCount > 0)
             {
-                /* "added6" */
-                tmp = walk = tr_new (uint8_t, diffs6.addedCount * 18);
-                for (i = 0; i < diffs6.addedCount; ++i) {
-                    memcpy (walk, &diffs6.added[i].addr.addr.addr6.s6_addr, 16);
-                    walk += 16;
-                    memcpy (walk, &diffs6.added[i].port, 2);
-                    walk += 2;
-                }
-                assert ((walk - tmp) == diffs6.addedCount * 18);
-                tr_variantDictAddRaw (&val, TR_KEY_added6, tmp, walk - tmp);
-                tr_free (tmp);
-
-                /* "added6.f"
-                 * unset each holepunch flag because we don't support it. */
-                tmp = walk = tr_new (uint8_t, diffs6.addedCount);
-                for (i = 0; i < diffs6.addedCount; ++i)
-                    *walk++ = diffs6.added[i].flags & ~ADDED_F_HOLEPUNCH;
-                assert ((walk - tmp) == diffs6.addedCount);
-                tr_variantDictAddRaw (&val, TR_KEY_added6_f, tmp, walk - tmp);
-                tr_free (tmp);
+                pexAddCompact (payload, "added6", diffs6.added, diffs6.addedCount, TR_AF_INET6);
+                pexAddFlags (payload, "added6.f", diffs6.added, diffs6.addedCount);
             }
-
+            if (diffs.droppedCount > 0)
+                pexAddCompact (payload, "dropped", diffs.dropped, diffs.droppedCount, TR_AF_INET);
             if (diffs6.droppedCount > 0)
-            {
-                /* "dropped6" */
-                tmp = walk = tr_new (uint8_t, diffs6.droppedCount * 18);
-                for (i = 0; i < diffs6.droppedCount; ++i) {
-                    memcpy (walk, &diffs6.dropped[i].addr.addr.addr6.s6_addr, 16);
-                    walk += 16;
-                    memcpy (walk, &diffs6.dropped[i].port, 2);
-                    walk += 2;
-                }
-                assert ((walk - tmp) == diffs6.droppedCount * 18);
-                tr_variantDictAddRaw (&val, TR_KEY_dropped6, tmp, walk - tmp);
-                tr_free (tmp);
-            }
+                pexAddCompact (payload, "dropped6", diffs6.dropped, diffs6.droppedCount, TR_AF_INET6);
+            evbuffer_add (payload, "e", 1);
 
             /* write the pex message */
-            payload = tr_variantToBuf (&val, TR_VARIANT_FMT_BENC);
             evbuffer_add_uint32 (out, 2 * sizeof (uint8_t) + evbuffer_get_length (payload));
             evbuffer_add_uint8 (out, BT_LTEP);
             evbuffer_add_uint8 (out, msgs->ut_pex_id);
@@ -2437,16 +2851,13 @@ sendPex (tr_peerMsgs * msgs)
             dbgOutMessageLen (msgs);
 
             evbuffer_free (payload);
-            tr_variantFree (&val);
         }
 
         /* cleanup */
         tr_free (diffs.added);
         tr_free (diffs.dropped);
-        tr_free (newPex);
         tr_free (diffs6.added);
         tr_free (diffs6.dropped);
-        tr_free (newPex6);
 
         /*msgs->clientSentPexAt = tr_time ();*/
     }
@@ -2510,6 +2921,7 @@ peermsgs_destruct (tr_peer * peer)
     }
 
   evbuffer_free (msgs->outMessages);
+  tr_free (msgs->peerAskedFor);
   tr_free (msgs->pex6);
   tr_free (msgs->pex);
 
@@ -2584,6 +2996,24 @@ tr_peerMsgsIsEncrypted (const tr_peerMsgs * msgs)
   return tr_peerIoIsEncrypted (msgs->io);
 }
 
+size_t
+tr_peerMsgsGetBufferedBytes (const tr_peerMsgs * msgs)
+{
+  size_t bytes;
+
+  assert (tr_isPeerMsgs (msgs));
+
+  bytes = evbuffer_get_length (msgs->io->inbuf)
+        + evbuffer_get_length (msgs->io->outbuf)
+        + evbuffer_get_length (msgs->outMessages);
+
+  /* this one's only created once a block arrives in pieces */
+  if (msgs->incoming.block != NULL)
+    bytes += evbuffer_get_length (msgs->incoming.block);
+
+  return bytes;
+}
+
 bool
 tr_peerMsgsIsIncomingConnection (const tr_peerMsgs * msgs)
 {
@@ -19,6 +19,7 @@
 
 struct tr_address;
 struct tr_bitfield;
+struct tr_cache_read;
 struct tr_peer;
 struct tr_peerIo;
 struct tr_torrent;
@@ -75,8 +76,34 @@ void         tr_peerMsgsSetInterested        (tr_peerMsgs              * msgs,
 void         tr_peerMsgsHave                 (tr_peerMsgs              * msgs,
                                               uint32_t                   pieceIndex);
 
+/** @return true if the peer takes suggestions (BEP 6) and is due for more */
+bool         tr_peerMsgsCanSuggest           (const tr_peerMsgs        * msgs);
+
+/**
+ * Suggest a few of `pieces', in order, to a peer that tr_peerMsgsCanSuggest ().
+ * Pieces the peer has or was suggested lately are skipped.
+ */
+void         tr_peerMsgsSuggest              (tr_peerMsgs              * msgs,
+                                              const tr_piece_index_t   * pieces,
+                                              size_t                     n);
+
 void         tr_peerMsgsPulse                (tr_peerMsgs              * msgs);
 
+/** @brief send any cancels waiting for the next pulse right away */
+void         tr_peerMsgsFlushCancels         (tr_peerMsgs              * msgs);
+
+/**
+ * Get the blocks the peer will be sent next that we'll have to read
+ * from disk, so that they can all be read at once in disk order.
+ * @return how many of `setme' were filled in, at most `max'
+ */
+int          tr_peerMsgsGetUploadReads       (const tr_peerMsgs        * msgs,
+                                              struct tr_cache_read     * setme,
+                                              int                        max);
+
+/** @return the bytes waiting in the peer's input and output buffers */
+size_t       tr_peerMsgsGetBufferedBytes     (const tr_peerMsgs        * msgs);
+
 void         tr_peerMsgsCancel               (tr_peerMsgs              * msgs,
                                               tr_block_index_t           block);
 
@@ -60,8 +60,34 @@
 #endif
 
 #include "transmission.h"
-#include "utils.h"
+#include "platform.h" /* tr_lock, tr_threadNew () */
 #include "platform-quota.h"
+#include "utils.h"
+
+enum
+{
+  /* how long a free space answer is good for. after that the next
+     query still gets it, but a worker thread looks up a new one */
+  FREE_SPACE_TTL_SECS = 15,
+
+  /* writing this much (anywhere) makes every cached answer stale */
+  FREE_SPACE_WRITTEN_BYTES = 64 * 1024 * 1024
+};
+
+/* protects the cache fields of every tr_device_info, and these */
+static tr_lock * quotaLock = NULL;
+static int freeSpaceGeneration = 1;
+static uint64_t bytesWritten = 0;
+
+static tr_lock *
+getQuotaLock (void)
+{
+  /* created by the first tr_device_info_create (), in the libtransmission thread */
+  if (quotaLock == NULL)
+    quotaLock = tr_lockNew ();
+
+  return quotaLock;
+}
 
 /***
 ****
@@ -398,20 +424,25 @@ tr_device_info_create (const char * path)
 {
   struct tr_device_info * info;
 
+  getQuotaLock ();
+
   info = tr_new0 (struct tr_device_info, 1);
   info->path = tr_strdup (path);
 #ifndef _WIN32
   info->device = tr_strdup (getblkdev (path));
   info->fstype = tr_strdup (getfstype (path));
 #endif
+  info->refcount = 1;
+  info->free_space = -1;
 
   return info;
 }
 
-void
-tr_device_info_free (struct tr_device_info * info)
+/* the quota lock must be held */
+static void
+device_info_unref (struct tr_device_info * info)
 {
-  if (info != NULL)
+  if (--info->refcount == 0)
     {
       tr_free (info->fstype);
       tr_free (info->device);
@@ -420,27 +451,120 @@ tr_device_info_free (struct tr_device_info * info)
     }
 }
 
+void
+tr_device_info_free (struct tr_device_info * info)
+{
+  if (info != NULL)
+    {
+      tr_lockLock (getQuotaLock ());
+      device_info_unref (info);
+      tr_lockUnlock (getQuotaLock ());
+    }
+}
+
+static int64_t
+query_free_space (const struct tr_device_info * info)
+{
+  int64_t free_space = tr_getQuotaFreeSpace (info);
+
+  if (free_space < 0)
+    free_space = tr_getDiskFreeSpace (info->path);
+
+  return free_space;
+}
+
+static void
+refresh_thread_func (void * vinfo)
+{
+  struct tr_device_info * info = vinfo;
+  const int generation = info->free_space_generation;
+  const int64_t free_space = query_free_space (info);
+  const int err = errno;
+
+  tr_lockLock (getQuotaLock ());
+  info->free_space = free_space;
+  info->free_space_errno = err;
+  info->free_space_date = tr_time ();
+  info->free_space_generation = generation;
+  info->is_refreshing = false;
+  device_info_unref (info);
+  tr_lockUnlock (getQuotaLock ());
+}
+
 int64_t
-tr_device_info_get_free_space (const struct tr_device_info * info)
+tr_device_info_get_free_space (struct tr_device_info * info)
 {
+  int err;
   int64_t free_space;
+  const time_t now = tr_time ();
 
   if ((info == NULL) || (info->path == NULL))
     {
       errno = EINVAL;
-      free_space = -1;
+      return -1;
+    }
+
+  tr_lockLock (getQuotaLock ());
+
+  if (info->free_space_date == 0)
+    {
+      /* there's nothing to go on yet, so this one has to wait */
+      tr_lockUnlock (getQuotaLock ());
+      free_space = query_free_space (info);
+      err = errno;
+      tr_lockLock (getQuotaLock ());
+
+      info->free_space = free_space;
+      info->free_space_errno = err;
+      info->free_space_date = now;
+      info->free_space_generation = freeSpaceGeneration;
     }
   else
     {
-      free_space = tr_getQuotaFreeSpace (info);
+      free_space = info->free_space;
+      err = info->free_space_errno;
 
-      if (free_space < 0)
-        free_space = tr_getDiskFreeSpace (info->path);
+      if (!info->is_refreshing
+          && (info->free_space_generation != freeSpaceGeneration
+              || now - info->free_space_date >= FREE_SPACE_TTL_SECS))
+        {
+          info->is_refreshing = true;
+          info->free_space_generation = freeSpaceGeneration;
+          ++info->refcount;
+          tr_threadNew (refresh_thread_func, info);
+        }
     }
 
+  tr_lockUnlock (getQuotaLock ());
+
+  if (free_space < 0)
+    errno = err;
+
   return free_space;
 }
 
+void
+tr_device_info_free_space_changed (void)
+{
+  tr_lockLock (getQuotaLock ());
+  ++freeSpaceGeneration;
+  bytesWritten = 0;
+  tr_lockUnlock (getQuotaLock ());
+}
+
+void
+tr_device_info_bytes_written (uint64_t bytes)
+{
+  tr_lockLock (getQuotaLock ());
+  bytesWritten += bytes;
+  if (bytesWritten >= FREE_SPACE_WRITTEN_BYTES)
+    {
+      ++freeSpaceGeneration;
+      bytesWritten = 0;
+    }
+  tr_lockUnlock (getQuotaLock ());
+}
+
 /***
 ****
 ***/
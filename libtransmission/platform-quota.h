@@ -24,16 +24,37 @@ struct tr_device_info
   char * path;
   char * device;
   char * fstype;
+
+  /* the cached free space. see tr_device_info_get_free_space () */
+  int refcount;
+  int64_t free_space;
+  int free_space_errno;   /* errno, if free_space is -1 */
+  time_t free_space_date; /* 0 if it hasn't been looked up yet */
+  int free_space_generation;
+  bool is_refreshing;
 };
 
 struct tr_device_info * tr_device_info_create (const char * path);
 
-/** If the disk quota is enabled and readable, this returns how much is available in the quota.
-    Otherwise, it returns how much is available on the disk, or -1 on error. */
-int64_t tr_device_info_get_free_space (const struct tr_device_info * info);
+/**
+ * If the disk quota is enabled and readable, this returns how much is available in the quota.
+ * Otherwise, it returns how much is available on the disk, or -1 on error.
+ *
+ * Only the first call waits for the answer. After that, the last answer
+ * is returned, and a worker thread looks up a new one once it's a few
+ * seconds old or tr_device_info_free_space_changed () has been called.
+ */
+int64_t tr_device_info_get_free_space (struct tr_device_info * info);
 
+/** Safe to call while a worker is refreshing `info'; the last of them frees it. */
 void tr_device_info_free (struct tr_device_info * info);
 
+/** @brief note that a lot of data was moved or deleted, so cached free space is out of date */
+void tr_device_info_free_space_changed (void);
+
+/** @brief count bytes written to torrents' files. Past a threshold, it's the same as a change. */
+void tr_device_info_bytes_written (uint64_t bytes);
+
 /** @} */
 
 #endif
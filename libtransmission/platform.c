@@ -108,6 +108,7 @@ ThreadFunc (void * _t)
 
   t->func (t->arg);
 
+  tr_list_release_thread_nodes ();
   tr_free (t);
 #ifdef _WIN32
   _endthreadex (0);
@@ -49,6 +49,13 @@ const char * tr_getWebClientDir (const tr_session *);
 
 typedef struct tr_thread tr_thread;
 
+/** @brief storage class for per-thread variables, if the compiler has one */
+#if defined (_MSC_VER)
+ #define TR_THREAD_LOCAL __declspec (thread)
+#elif defined (__GNUC__) || defined (__clang__)
+ #define TR_THREAD_LOCAL __thread
+#endif
+
 /** @brief Instantiate a new process thread */
 tr_thread* tr_threadNew (void (*func)(void *), void * arg);
 
@@ -19,9 +19,11 @@
 #include "log.h"
 #include "net.h"
 #include "peer-mgr.h"
+#include "platform.h" /* tr_threadNew () */
 #include "port-forwarding.h"
 #include "session.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
 #include "upnp.h"
 #include "utils.h"
 
@@ -37,11 +39,32 @@ struct tr_shared
   tr_port_forwarding natpmpStatus;
   tr_port_forwarding upnpStatus;
 
+  /* only touched by the worker while a pulse is in flight */
   tr_upnp * upnp;
   tr_natpmp * natpmp;
   tr_session * session;
 
   struct event * timer;
+
+  /* miniupnpc and libnatpmp block, sometimes for seconds, so pulses run
+     in a worker thread. `pulse' holds the worker's inputs and results. */
+  bool isPulsing;
+  bool pulsePending;
+
+  /* set by tr_sharedAbandon () under getSharedLock () once the session
+     has stopped waiting for us. whoever holds `s' next frees it */
+  bool isAbandoned;
+  struct
+    {
+      tr_port private_port;
+      bool is_enabled;
+      bool do_check;
+
+      tr_port public_port;
+      tr_port_forwarding natpmpStatus;
+      tr_port_forwarding upnpStatus;
+    }
+  pulse;
 };
 
 /***
@@ -61,14 +84,39 @@ getNatStateStr (int state)
     }
 }
 
+static void set_evtimer_from_status (tr_shared * s);
+static void natPulseThreadFunc (void * vshared);
+
+static tr_lock *
+getSharedLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+/* for a tr_shared whose session is gone. a upnp handle that's
+   still mapped can't be closed, so it's left behind */
+static void
+freeAbandoned (tr_shared * s)
+{
+  tr_natpmpClose (s->natpmp);
+  if ((s->upnp != NULL) && (s->pulse.upnpStatus == TR_PORT_UNMAPPED))
+    tr_upnpClose (s->upnp);
+  tr_free (s);
+}
+
 static void
 natPulse (tr_shared * s, bool do_check)
 {
-  int oldStatus;
-  int newStatus;
-  tr_port public_peer_port;
-  const tr_port private_peer_port = s->session->private_peer_port;
-  const int is_enabled = s->isEnabled && !s->isShuttingDown;
+  if (s->isPulsing)
+    {
+      s->pulsePending = true;
+      return;
+    }
 
   if (s->natpmp == NULL)
     s->natpmp = tr_natpmpInit ();
@@ -76,13 +124,50 @@ natPulse (tr_shared * s, bool do_check)
   if (s->upnp == NULL)
     s->upnp = tr_upnpInit ();
 
-  oldStatus = tr_sharedTraversalStatus (s);
+  s->pulse.private_port = s->session->private_peer_port;
+  s->pulse.is_enabled = s->isEnabled && !s->isShuttingDown;
+  s->pulse.do_check = do_check;
 
-  s->natpmpStatus = tr_natpmpPulse (s->natpmp, private_peer_port, is_enabled, &public_peer_port);
+  s->isPulsing = true;
+  s->pulsePending = false;
+  tr_threadNew (natPulseThreadFunc, s);
+}
+
+/* back in the libtransmission thread with the worker's results */
+static void
+onNatPulseDone (void * vshared)
+{
+  tr_shared * s = vshared;
+  const int oldStatus = tr_sharedTraversalStatus (s);
+  int newStatus;
+
+  tr_lockLock (getSharedLock ());
+
+  if (s->isAbandoned)
+    {
+      tr_lockUnlock (getSharedLock ());
+      freeAbandoned (s);
+      return;
+    }
+
+  s->isPulsing = false;
+
+  s->natpmpStatus = s->pulse.natpmpStatus;
   if (s->natpmpStatus == TR_PORT_MAPPED)
-    s->session->public_peer_port = public_peer_port;
+    s->session->public_peer_port = s->pulse.public_port;
+
+  s->upnpStatus = s->pulse.upnpStatus;
 
-  s->upnpStatus = tr_upnpPulse (s->upnp, private_peer_port, is_enabled, do_check);
+  if (!s->pulse.is_enabled)
+    {
+      tr_natpmpClose (s->natpmp);
+      s->natpmp = NULL;
+      s->natpmpStatus = TR_PORT_UNMAPPED;
+
+      tr_upnpClose (s->upnp);
+      s->upnp = NULL;
+      s->upnpStatus = TR_PORT_UNMAPPED;
+    }
 
   newStatus = tr_sharedTraversalStatus (s);
 
@@ -90,6 +175,56 @@ natPulse (tr_shared * s, bool do_check)
     tr_logAddNamedInfo (getKey (), _("State changed from \"%1$s\" to \"%2$s\""),
              getNatStateStr (oldStatus),
              getNatStateStr (newStatus));
+
+  if (s->isShuttingDown)
+    {
+      /* the ports have to be unmapped before we're done */
+      if (s->pulse.is_enabled)
+        {
+          natPulse (s, false);
+        }
+      else
+        {
+          s->session->shared = NULL;
+          tr_free (s);
+        }
+    }
+  else if (s->pulsePending || s->pulse.is_enabled != s->isEnabled)
+    {
+      natPulse (s, false);
+    }
+  else
+    {
+      set_evtimer_from_status (s);
+    }
+
+  tr_lockUnlock (getSharedLock ());
+}
+
+static void
+natPulseThreadFunc (void * vshared)
+{
+  bool abandoned;
+  tr_shared * s = vshared;
+
+  s->pulse.natpmpStatus = tr_natpmpPulse (s->natpmp,
+                                          s->pulse.private_port,
+                                          s->pulse.is_enabled,
+                                          &s->pulse.public_port);
+
+  s->pulse.upnpStatus = tr_upnpPulse (s->upnp,
+                                      s->pulse.private_port,
+                                      s->pulse.is_enabled,
+                                      s->pulse.do_check);
+
+  /* if the session gave up waiting on us, it may already be freed */
+  tr_lockLock (getSharedLock ());
+  if (!(abandoned = s->isAbandoned))
+    tr_runInEventThread (s->session, onNatPulseDone, s);
+  tr_lockUnlock (getSharedLock ());
+
+  if (abandoned)
+    freeAbandoned (s);
 }
 
 static void
@@ -130,12 +265,10 @@ onTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vshared)
   assert (s);
   assert (s->timer);
 
-  /* do something */
+  /* do something. the timer is set up for
+     the next pulse when this one finishes */
   natPulse (s, s->doPortCheck);
   s->doPortCheck = false;
-
-  /* set up the timer for the next pulse */
-  set_evtimer_from_status (s);
 }
 
 /***
@@ -174,23 +307,21 @@ stop_timer (tr_shared * s)
     }
 }
 
+/* the unmapping pulse closes the natpmp and upnp handles when it's done */
 static void
 stop_forwarding (tr_shared * s)
 {
   tr_logAddNamedInfo (getKey (), "%s", _("Stopped"));
-  natPulse (s, false);
-
-  tr_natpmpClose (s->natpmp);
-  s->natpmp = NULL;
-  s->natpmpStatus = TR_PORT_UNMAPPED;
-
-  tr_upnpClose (s->upnp);
-  s->upnp = NULL;
-  s->upnpStatus = TR_PORT_UNMAPPED;
-
   stop_timer (s);
+
+  if (s->isPulsing || s->natpmp != NULL || s->upnp != NULL)
+    natPulse (s, false);
 }
 
+/**
+ * Unmapping is still in progress when this returns.
+ * session->shared is cleared once it's finished.
+ */
 void
 tr_sharedClose (tr_session * session)
 {
@@ -198,15 +329,39 @@ tr_sharedClose (tr_session * session)
 
   s->isShuttingDown = true;
   stop_forwarding (s);
-  s->session->shared = NULL;
-  tr_free (s);
+
+  if (!s->isPulsing)
+    {
+      s->session->shared = NULL;
+      tr_free (s);
+    }
+}
+
+void
+tr_sharedAbandon (tr_session * session)
+{
+  tr_lockLock (getSharedLock ());
+
+  if (session->shared != NULL)
+    {
+      tr_logAddNamedInfo (getKey (), "%s", _("Gave up waiting for the ports to be unmapped"));
+      session->shared->isAbandoned = true;
+      session->shared = NULL;
+    }
+
+  tr_lockUnlock (getSharedLock ());
 }
 
 static void
 start_timer (tr_shared * s)
 {
+  stop_timer (s);
   s->timer = evtimer_new (s->session->event_base, onTimer, s);
-  set_evtimer_from_status (s);
+
+  /* the first pulse can block for a while looking for a router,
+     so it waits for the rest of startup */
+  if (!s->isPulsing && s->session->isStarted)
+    set_evtimer_from_status (s);
 }
 
 void
@@ -223,12 +378,8 @@ tr_sharedPortChanged (tr_session * session)
 {
   tr_shared * s = session->shared;
 
-  if (s->isEnabled)
-    {
-      stop_timer (s);
-      natPulse (s, false);
-      start_timer (s);
-    }
+  if (s->isEnabled && session->isStarted)
+    natPulse (s, false);
 }
 
 bool
@@ -29,6 +29,10 @@ tr_shared* tr_sharedInit (tr_session*);
 
 void       tr_sharedClose (tr_session *);
 
+/* if unmapping is still going when the session stops waiting for it,
+   call this so the worker frees its state instead of posting back */
+void       tr_sharedAbandon (tr_session *);
+
 void       tr_sharedPortChanged (tr_session *);
 
 void       tr_sharedTraversalEnable (tr_shared *, bool isEnabled);
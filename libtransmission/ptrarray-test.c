@@ -0,0 +1,95 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include "transmission.h"
+#include "ptrarray.h"
+#include "utils.h"
+#include "libtransmission-test.h"
+
+struct item
+{
+  int key;
+};
+
+static inline const int *
+getItemKey (const struct item * item)
+{
+  return &item->key;
+}
+
+static inline int
+compareKeys (const int * a, const int * b)
+{
+  return *a - *b;
+}
+
+TR_PTR_ARRAY_SORTED_FUNCS (items, struct item, int, getItemKey, compareKeys)
+
+static int
+compareItems (const void * a, const void * b)
+{
+  return compareKeys (getItemKey (a), getItemKey (b));
+}
+
+static int
+test_sorted_funcs (void)
+{
+  int i;
+  bool match;
+  enum { N = 500 };
+  struct item items[N];
+  tr_ptrArray typed = TR_PTR_ARRAY_INIT;
+  tr_ptrArray generic = TR_PTR_ARRAY_INIT;
+
+  /* N distinct keys, inserted in a scrambled order */
+  for (i=0; i<N; ++i)
+    items[i].key = (i * 7919) % N * 2;
+
+  for (i=0; i<N; ++i)
+    {
+      check_int_eq (tr_ptrArrayInsertSorted (&generic, &items[i], compareItems),
+                    itemsInsertSorted (&typed, &items[i]));
+    }
+
+  for (i=0; i<N; ++i)
+    check (tr_ptrArrayNth (&typed, i) == tr_ptrArrayNth (&generic, i));
+
+  /* even keys are there; odd ones sort between them */
+  for (i=-1; i<=N*2; ++i)
+    {
+      const struct item key = { i };
+      check (itemsFindSorted (&typed, &i) == tr_ptrArrayFindSorted (&generic, &key, compareItems));
+      check_int_eq (tr_ptrArrayLowerBound (&generic, &key, compareItems, NULL),
+                    itemsLowerBound (&typed, &i, &match));
+      check (match == (i >= 0 && i < N*2 && i % 2 == 0));
+    }
+
+  /* remove them in yet another order */
+  for (i=0; i<N; ++i)
+    {
+      struct item * item = &items[(i * 31) % N];
+      itemsRemoveSorted (&typed, item);
+      tr_ptrArrayRemoveSortedPointer (&generic, item, compareItems);
+      check (itemsFindSorted (&typed, &item->key) == NULL);
+      check_int_eq (tr_ptrArraySize (&generic), tr_ptrArraySize (&typed));
+    }
+
+  check (tr_ptrArrayEmpty (&typed));
+  tr_ptrArrayDestruct (&typed, NULL);
+  tr_ptrArrayDestruct (&generic, NULL);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_sorted_funcs };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -139,5 +139,79 @@ void* tr_ptrArrayFindSorted (tr_ptrArray * array,
                              const void  * key,
                              int compare (const void*, const void*));
 
+/**
+ * @brief Define sorted-array functions specialized for one item type.
+ *
+ * The sorted functions above get their comparison as a function pointer,
+ * so each step of the binary search is an indirect call. For the arrays
+ * that get searched the most, this defines static inline versions that
+ * let the compiler inline the comparison instead:
+ *
+ *   int         prefix##LowerBound   (const tr_ptrArray*, const key_type*, bool* exact_match)
+ *   item_type*  prefix##FindSorted   (const tr_ptrArray*, const key_type*)
+ *   int         prefix##InsertSorted (tr_ptrArray*, item_type*)
+ *   void        prefix##RemoveSorted (tr_ptrArray*, const item_type*)
+ *
+ * @param get_key returns an item's `const key_type *'
+ * @param compare compares two `const key_type *' in the style of memcmp ()
+ *
+ * The array is still a plain tr_ptrArray, so the rest of the tr_ptrArray
+ * API works on it too. Just don't mix these with the generic sorted
+ * functions unless both sort the same way.
+ */
+#define TR_PTR_ARRAY_SORTED_FUNCS(prefix, item_type, key_type, get_key, compare) \
+  static inline int \
+  prefix##LowerBound (const tr_ptrArray * t, const key_type * key, bool * exact_match) \
+  { \
+    int lo = 0; \
+    int hi = t->n_items; \
+    while (lo < hi) \
+      { \
+        const int mid = lo + (hi - lo) / 2; \
+        const int c = compare (get_key ((const item_type *) t->items[mid]), key); \
+        if (c < 0) \
+          lo = mid + 1; \
+        else if (c > 0) \
+          hi = mid; \
+        else \
+          { \
+            if (exact_match != NULL) \
+              *exact_match = true; \
+            return mid; \
+          } \
+      } \
+    if (exact_match != NULL) \
+      *exact_match = false; \
+    return lo; \
+  } \
+  \
+  static inline item_type * \
+  prefix##FindSorted (const tr_ptrArray * t, const key_type * key) \
+  { \
+    bool match; \
+    const int pos = prefix##LowerBound (t, key, &match); \
+    return match ? (item_type *) t->items[pos] : NULL; \
+  } \
+  \
+  static inline int \
+  prefix##InsertSorted (tr_ptrArray * t, item_type * item) \
+  { \
+    bool match; \
+    const int pos = prefix##LowerBound (t, get_key (item), &match); \
+    assert (!match); \
+    return tr_ptrArrayInsert (t, item, pos); \
+  } \
+  \
+  static inline void \
+  prefix##RemoveSorted (tr_ptrArray * t, const item_type * item) \
+  { \
+    bool match; \
+    const int pos = prefix##LowerBound (t, get_key (item), &match); \
+    assert (match); \
+    assert (t->items[pos] == item); \
+    if (match) \
+      tr_ptrArrayRemove (t, pos); \
+  }
+
 /* @} */
 #endif
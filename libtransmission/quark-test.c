@@ -11,6 +11,7 @@
 
 #include "transmission.h"
 #include "quark.h"
+#include "utils.h" /* tr_snprintf() */
 #include "libtransmission-test.h"
 
 static int
@@ -41,7 +42,67 @@ test_static_quarks (void)
       check (strcmp (str1, str2) < 0);
     }
 
+  /* near misses find nothing, or another key that really matches */
+  for (i=1; i<TR_N_KEYS; i++)
+    {
+      tr_quark q;
+      size_t len;
+      char buf[64];
+      const char * str = tr_quark_get_string (i, &len);
+
+      if (tr_quark_lookup (str, len - 1, &q))
+        check_int_eq (len - 1, strlen (tr_quark_get_string (q, NULL)));
+
+      tr_snprintf (buf, sizeof (buf), "%sx", str);
+      if (tr_quark_lookup (buf, len + 1, &q))
+        check_streq (buf, tr_quark_get_string (q, NULL));
+    }
+
+  return 0;
+}
+
+static int
+test_runtime_quarks (void)
+{
+  int i;
+  tr_quark q;
+  char buf[64];
+  const int n = 5000;
+  tr_quark * quarks = tr_new (tr_quark, n);
+
+  /* enough new quarks to force the runtime index to grow several times */
+  for (i=0; i<n; i++)
+    {
+      tr_snprintf (buf, sizeof (buf), "runtime-quark-%d", i);
+      check (!tr_quark_lookup (buf, strlen (buf), &q));
+      quarks[i] = tr_quark_new (buf, -1);
+      check (quarks[i] >= TR_N_KEYS);
+      check_int_eq (quarks[i], tr_quark_new (buf, -1));
+    }
+
+  for (i=0; i<n; i++)
+    {
+      size_t len;
+
+      tr_snprintf (buf, sizeof (buf), "runtime-quark-%d", i);
+      check (tr_quark_lookup (buf, strlen (buf), &q));
+      check_int_eq (quarks[i], q);
+      check_streq (buf, tr_quark_get_string (q, &len));
+      check_int_eq (strlen (buf), len);
+    }
+
+  /* static quarks still win */
+  check_int_eq (TR_KEY_name, tr_quark_new ("name", -1));
+
+  tr_free (quarks);
   return 0;
 }
 
-MAIN_SINGLE_TEST(test_static_quarks)
+int
+main (void)
+{
+  const testFunc tests[] = { test_static_quarks,
+                             test_runtime_quarks };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -12,6 +12,7 @@
 #include <string.h> /* memcmp() */
 
 #include "transmission.h"
+#include "platform.h" /* tr_lock */
 #include "ptrarray.h"
 #include "quark.h"
 #include "utils.h" /* tr_memdup(), tr_strndup() */
@@ -46,6 +47,7 @@ static const struct tr_key_struct my_static[] =
   { "announce-list", 13 },
   { "announceState", 13 },
   { "arguments", 9 },
+  { "bandwidth", 9 },
   { "bandwidth-priority", 18 },
   { "bandwidthPriority", 17 },
   { "bind-address-ipv4", 17 },
@@ -59,6 +61,8 @@ static const struct tr_key_struct my_static[] =
   { "blocks", 6 },
   { "bytesCompleted", 14 },
   { "cache-size-mb", 13 },
+  { "cacheBytes", 10 },
+  { "choked", 6 },
   { "clientIsChoked", 14 },
   { "clientIsInterested", 18 },
   { "clientName", 10 },
@@ -67,9 +71,11 @@ static const struct tr_key_struct my_static[] =
   { "compact-view", 12 },
   { "complete", 8 },
   { "config-dir", 10 },
+  { "connection-id", 13 },
   { "cookies", 7 },
   { "corrupt", 7 },
   { "corruptEver", 11 },
+  { "cpuTime", 7 },
   { "created by", 10 },
   { "created by.utf-8", 16 },
   { "creation date", 13 },
@@ -82,6 +88,11 @@ static const struct tr_key_struct my_static[] =
   { "desiredAvailable", 16 },
   { "destination", 11 },
   { "dht-enabled", 11 },
+  { "disk", 4 },
+  { "diskReadBytes", 13 },
+  { "diskReadOps", 11 },
+  { "diskWriteBytes", 14 },
+  { "diskWriteOps", 12 },
   { "display-name", 12 },
   { "dnd", 3 },
   { "done-date", 9 },
@@ -95,6 +106,7 @@ static const struct tr_key_struct my_static[] =
   { "downloadLimit", 13 },
   { "downloadLimited", 15 },
   { "downloadSpeed", 13 },
+  { "downloadStalls", 14 },
   { "downloaded", 10 },
   { "downloaded-bytes", 16 },
   { "downloadedBytes", 15 },
@@ -110,8 +122,10 @@ static const struct tr_key_struct my_static[] =
   { "errorString", 11 },
   { "eta", 3 },
   { "etaIdle", 7 },
+  { "expires", 7 },
   { "failure reason", 14 },
   { "fields", 6 },
+  { "fileOpens", 9 },
   { "fileStats", 9 },
   { "filename", 8 },
   { "files", 5 },
@@ -119,11 +133,14 @@ static const struct tr_key_struct my_static[] =
   { "files-unwanted", 14 },
   { "files-wanted", 12 },
   { "filesAdded", 10 },
+  { "filter", 6 },
   { "filter-mode", 11 },
   { "filter-text", 11 },
   { "filter-trackers", 15 },
+  { "filterCounts", 12 },
   { "flagStr", 7 },
   { "flags", 5 },
+  { "format", 6 },
   { "fromCache", 9 },
   { "fromDht", 7 },
   { "fromIncoming", 12 },
@@ -148,6 +165,7 @@ static const struct tr_key_struct my_static[] =
   { "incomplete", 10 },
   { "incomplete-dir", 14 },
   { "incomplete-dir-enabled", 22 },
+  { "incremental", 11 },
   { "info", 4 },
   { "info_hash", 9 },
   { "inhibit-desktop-hibernation", 27 },
@@ -161,6 +179,7 @@ static const struct tr_key_struct my_static[] =
   { "isFinished", 10 },
   { "isIncoming", 10 },
   { "isPrivate", 9 },
+  { "isRelocating", 12 },
   { "isStalled", 9 },
   { "isUTP", 5 },
   { "isUploadingTo", 13 },
@@ -178,6 +197,9 @@ static const struct tr_key_struct my_static[] =
   { "leecherCount", 12 },
   { "leftUntilDone", 13 },
   { "length", 6 },
+  { "limit", 5 },
+  { "localDataDeletesPending", 23 },
+  { "localDataFilesPending", 21 },
   { "location", 8 },
   { "lpd-enabled", 11 },
   { "m", 1 },
@@ -192,6 +214,7 @@ static const struct tr_key_struct my_static[] =
   { "manualAnnounceTime", 18 },
   { "max-peers", 9 },
   { "maxConnectedPeers", 17 },
+  { "memory-budget-mb", 16 },
   { "memory-bytes", 12 },
   { "memory-units", 12 },
   { "message-level", 13 },
@@ -208,14 +231,21 @@ static const struct tr_key_struct my_static[] =
   { "name.utf-8", 10 },
   { "nextAnnounceTime", 16 },
   { "nextScrapeTime", 14 },
+  { "noRequests", 10 },
   { "nodes", 5 },
   { "nodes6", 6 },
+  { "none", 4 },
+  { "offset", 6 },
   { "open-dialog-dir", 15 },
+  { "openFiles", 9 },
+  { "outbuf", 6 },
   { "p", 1 },
+  { "page-cache-bypass-enabled", 25 },
   { "path", 4 },
   { "path.utf-8", 10 },
   { "paused", 6 },
   { "pausedTorrentCount", 18 },
+  { "peer", 4 },
   { "peer-congestion-algorithm", 25 },
   { "peer-id-ttl-hours", 17 },
   { "peer-limit", 10 },
@@ -240,6 +270,7 @@ static const struct tr_key_struct my_static[] =
   { "pex-enabled", 11 },
   { "piece", 5 },
   { "piece length", 12 },
+  { "piece-locality-enabled", 22 },
   { "pieceCount", 10 },
   { "pieceSize", 9 },
   { "pieces", 6 },
@@ -272,11 +303,15 @@ static const struct tr_key_struct my_static[] =
   { "ratio-limit", 11 },
   { "ratio-limit-enabled", 19 },
   { "ratio-mode", 10 },
+  { "read-cache-size-mb", 18 },
+  { "readCacheHits", 13 },
+  { "readCacheMisses", 15 },
   { "recent-download-dir-1", 21 },
   { "recent-download-dir-2", 21 },
   { "recent-download-dir-3", 21 },
   { "recent-download-dir-4", 21 },
   { "recheckProgress", 15 },
+  { "relocateProgress", 16 },
   { "remote-session-enabled", 22 },
   { "remote-session-host", 19 },
   { "remote-session-password", 23 },
@@ -287,6 +322,9 @@ static const struct tr_key_struct my_static[] =
   { "rename-partial-files", 20 },
   { "reqq", 4 },
   { "result", 6 },
+  { "resume-store-enabled", 20 },
+  { "reverse", 7 },
+  { "revision", 8 },
   { "rpc-authentication-required", 27 },
   { "rpc-bind-address", 16 },
   { "rpc-enabled", 11 },
@@ -303,6 +341,10 @@ static const struct tr_key_struct my_static[] =
   { "scrapeState", 11 },
   { "script-torrent-done-enabled", 27 },
   { "script-torrent-done-filename", 28 },
+  { "scrub-enabled", 13 },
+  { "scrub-piece", 11 },
+  { "scrub-speed-limit", 17 },
+  { "search", 6 },
   { "seconds-active", 14 },
   { "secondsActive", 13 },
   { "secondsDownloading", 18 },
@@ -316,6 +358,7 @@ static const struct tr_key_struct my_static[] =
   { "seedRatioMode", 13 },
   { "seederCount", 11 },
   { "seeding-time-seconds", 20 },
+  { "sequentialDownload", 18 },
   { "session-count", 13 },
   { "sessionCount", 12 },
   { "show-backup-trackers", 20 },
@@ -329,6 +372,7 @@ static const struct tr_key_struct my_static[] =
   { "size-bytes", 10 },
   { "size-units", 10 },
   { "sizeWhenDone", 12 },
+  { "sort", 4 },
   { "sort-mode", 9 },
   { "sort-reversed", 13 },
   { "speed", 5 },
@@ -344,6 +388,10 @@ static const struct tr_key_struct my_static[] =
   { "startDate", 9 },
   { "status", 6 },
   { "statusbar-stats", 15 },
+  { "streamingPosition", 17 },
+  { "streamingWindow", 15 },
+  { "superSeeding", 12 },
+  { "table", 5 },
   { "tag", 3 },
   { "tier", 4 },
   { "time-checked", 12 },
@@ -361,8 +409,10 @@ static const struct tr_key_struct my_static[] =
   { "torrentCount", 12 },
   { "torrentFile", 11 },
   { "torrents", 8 },
+  { "totalCount", 10 },
   { "totalSize", 9 },
   { "total_size", 10 },
+  { "tracker", 7 },
   { "tracker id", 10 },
   { "trackerAdd", 10 },
   { "trackerRemove", 13 },
@@ -372,12 +422,14 @@ static const struct tr_key_struct my_static[] =
   { "trash-can-enabled", 17 },
   { "trash-original-torrent-files", 28 },
   { "umask", 5 },
+  { "uninterested", 12 },
   { "units", 5 },
   { "upload-slots-per-torrent", 24 },
   { "uploadLimit", 11 },
   { "uploadLimited", 13 },
   { "uploadRatio", 11 },
   { "uploadSpeed", 11 },
+  { "uploadStalls", 12 },
   { "upload_only", 11 },
   { "uploaded", 8 },
   { "uploaded-bytes", 14 },
@@ -394,9 +446,13 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verify-mmap-enabled", 19 },
+  { "verify-threads", 14 },
   { "version", 7 },
+  { "wait", 4 },
   { "wanted", 6 },
   { "warning message", 15 },
+  { "wastedBytes", 11 },
   { "watch-dir", 9 },
   { "watch-dir-enabled", 17 },
   { "webseeds", 8 },
@@ -420,13 +476,213 @@ compareKeys (const void * va, const void * vb)
 
 static tr_ptrArray my_runtime = TR_PTR_ARRAY_INIT_STATIC;
 
+/* Open-addressed index of my_runtime so that lookups don't have to walk it.
+   This matters because every torrent's hash string becomes a runtime quark
+   in the session's metainfo lookup table, so there can be thousands of them.
+   Each slot holds a my_runtime position + 1, or 0 if the slot is empty. */
+static size_t * my_runtime_index = NULL;
+static size_t my_runtime_index_size = 0;
+
+#define RUNTIME_INDEX_MIN_SIZE 64
+
+/* JSON and benc parsing add keys they haven't seen before from whatever
+   thread they're on (e.g. the Qt client parses on its thread pool),
+   so everything that touches my_runtime holds this */
+static tr_lock *
+getRuntimeLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static size_t
+runtime_hash (const char * str, size_t len)
+{
+  size_t i;
+  size_t hash = 2166136261u; /* FNV-1a */
+
+  for (i=0; i<len; ++i)
+    {
+      hash ^= (unsigned char) str[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+static void
+runtime_index_insert (size_t pos)
+{
+  const struct tr_key_struct * key = tr_ptrArrayNth (&my_runtime, pos);
+  const size_t mask = my_runtime_index_size - 1;
+  size_t slot = runtime_hash (key->str, key->len) & mask;
+
+  while (my_runtime_index[slot] != 0)
+    slot = (slot + 1) & mask;
+
+  my_runtime_index[slot] = pos + 1;
+}
+
+static void
+runtime_index_grow (void)
+{
+  size_t i;
+  const size_t n = tr_ptrArraySize (&my_runtime);
+
+  tr_free (my_runtime_index);
+  my_runtime_index_size = MAX (RUNTIME_INDEX_MIN_SIZE, my_runtime_index_size * 2);
+  my_runtime_index = tr_new0 (size_t, my_runtime_index_size);
+
+  for (i=0; i<n; ++i)
+    runtime_index_insert (i);
+}
+
+/* A perfect hash of my_static, so that looking up a static key is one
+   hash and one comparison. The keys are split into buckets by hash, and
+   each bucket gets a seed that sends all of its keys to empty slots.
+   It's built the first time it's needed, which is when the settings are
+   parsed, before the session starts any threads. If no seeds can be found
+   for some bucket, lookups fall back to a binary search of my_static. */
+
+enum
+{
+  STATIC_BUCKETS = 256,  /* must be a power of two */
+  STATIC_SLOTS = 1024,   /* ditto, and more than twice TR_N_KEYS */
+  STATIC_MAX_SEED = 0xFFFF
+};
+
+static uint16_t my_static_seeds[STATIC_BUCKETS];
+static uint16_t my_static_slots[STATIC_SLOTS]; /* a quark + 1, or 0 if empty */
+static bool my_static_hash_built = false;
+static bool my_static_hash_ok = false;
+
+static inline size_t
+static_slot (size_t hash, uint16_t seed)
+{
+  uint64_t x = hash ^ ((uint64_t)seed * 0x9E3779B97F4A7C15ull);
+
+  x ^= x >> 29;
+  x *= 0xBF58476D1CE4E5B9ull;
+  x ^= x >> 32;
+
+  return x & (STATIC_SLOTS - 1);
+}
+
+static bool
+static_hash_build (void)
+{
+  size_t i;
+  size_t size;
+  size_t hashes[TR_N_KEYS];
+  size_t bucket_size[STATIC_BUCKETS];
+  size_t max_size = 0;
+
+  TR_STATIC_ASSERT (STATIC_SLOTS > 2 * TR_N_KEYS, "too many static quarks for the perfect hash");
+
+  memset (bucket_size, 0, sizeof (bucket_size));
+  for (i=0; i<TR_N_KEYS; ++i)
+    {
+      const size_t b = (hashes[i] = runtime_hash (my_static[i].str, my_static[i].len)) & (STATIC_BUCKETS - 1);
+      max_size = MAX (max_size, ++bucket_size[b]);
+    }
+
+  /* the fullest buckets are hardest to place, so they go first */
+  for (size=max_size; size>0; --size)
+    {
+      size_t b;
+
+      for (b=0; b<STATIC_BUCKETS; ++b)
+        {
+          unsigned int seed;
+
+          if (bucket_size[b] != size)
+            continue;
+
+          for (seed=0; seed<=STATIC_MAX_SEED; ++seed)
+            {
+              bool ok = true;
+
+              for (i=0; ok && i<TR_N_KEYS; ++i)
+                if ((hashes[i] & (STATIC_BUCKETS - 1)) == b)
+                  {
+                    const size_t slot = static_slot (hashes[i], seed);
+
+                    if (my_static_slots[slot] != 0)
+                      ok = false;
+                    else
+                      my_static_slots[slot] = i + 1;
+                  }
+
+              /* undo this seed's placements, even if it worked; they
+                 can't be told apart from earlier keys' otherwise */
+              for (i=0; i<TR_N_KEYS; ++i)
+                if ((hashes[i] & (STATIC_BUCKETS - 1)) == b)
+                  {
+                    const size_t slot = static_slot (hashes[i], seed);
+
+                    if (my_static_slots[slot] == i + 1)
+                      my_static_slots[slot] = 0;
+                  }
+
+              if (ok)
+                break;
+            }
+
+          if (seed > STATIC_MAX_SEED)
+            return false;
+
+          my_static_seeds[b] = seed;
+          for (i=0; i<TR_N_KEYS; ++i)
+            if ((hashes[i] & (STATIC_BUCKETS - 1)) == b)
+              my_static_slots[static_slot (hashes[i], seed)] = i + 1;
+        }
+    }
+
+  return true;
+}
+
+static bool
+static_lookup (const struct tr_key_struct * key, tr_quark * setme)
+{
+  const struct tr_key_struct * match;
+
+  if (!my_static_hash_built)
+    {
+      my_static_hash_ok = static_hash_build ();
+      my_static_hash_built = true;
+    }
+
+  if (my_static_hash_ok)
+    {
+      const size_t hash = runtime_hash (key->str, key->len);
+      const size_t slot = static_slot (hash, my_static_seeds[hash & (STATIC_BUCKETS - 1)]);
+      const int q = my_static_slots[slot] - 1;
+
+      if (q < 0 || compareKeys (key, &my_static[q]) != 0)
+        return false;
+
+      *setme = q;
+      return true;
+    }
+
+  match = bsearch (key, my_static, TR_N_KEYS, sizeof(struct tr_key_struct), compareKeys);
+  if (match == NULL)
+    return false;
+
+  *setme = match - my_static;
+  return true;
+}
+
 bool
 tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
 {
   struct tr_key_struct tmp;
-  struct tr_key_struct * match;
   static const size_t n_static = sizeof(my_static) / sizeof(struct tr_key_struct);
-  bool success = false;
+  bool success;
 
   assert (n_static == TR_N_KEYS);
 
@@ -434,30 +690,35 @@ tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
   tmp.len = len;
 
   /* is it in our static array? */
-  match = bsearch (&tmp, my_static, n_static, sizeof(struct tr_key_struct), compareKeys);
-  if (match != NULL)
-    {
-      *setme = match - my_static;
-      success = true;
-    }
+  if (static_lookup (&tmp, setme))
+    return true;
 
   /* was it added during runtime? */
-  if (!success && !tr_ptrArrayEmpty(&my_runtime))
+  success = false;
+  tr_lockLock (getRuntimeLock ());
+
+  if (my_runtime_index_size > 0)
     {
-      size_t i;
       struct tr_key_struct ** runtime = (struct tr_key_struct **) tr_ptrArrayBase (&my_runtime);
-      const size_t n_runtime = tr_ptrArraySize (&my_runtime);
-      for (i=0; i<n_runtime; ++i)
+      const size_t mask = my_runtime_index_size - 1;
+      size_t slot = runtime_hash (str, len) & mask;
+
+      while (my_runtime_index[slot] != 0)
         {
+          const size_t i = my_runtime_index[slot] - 1;
+
           if (compareKeys (&tmp, runtime[i]) == 0)
             {
               *setme = TR_N_KEYS + i;
               success = true;
               break;
             }
+
+          slot = (slot + 1) & mask;
         }
     }
 
+  tr_lockUnlock (getRuntimeLock ());
   return success;
 }
 
@@ -471,6 +732,13 @@ append_new_quark (const void * str, size_t len)
   tmp->len = len;
   ret = TR_N_KEYS + tr_ptrArraySize (&my_runtime);
   tr_ptrArrayAppend (&my_runtime, tmp);
+
+  /* keep the index at most half full */
+  if ((size_t) tr_ptrArraySize (&my_runtime) * 2 > my_runtime_index_size)
+    runtime_index_grow ();
+  else
+    runtime_index_insert (tr_ptrArraySize (&my_runtime) - 1);
+
   return ret;
 }
 
@@ -484,8 +752,14 @@ tr_quark_new (const void * str, size_t len)
   else if (len == (size_t)-1)
     len = strlen (str);
 
+  /* look again under the lock, so two threads can't add the same key */
   if (!tr_quark_lookup (str, len, &ret))
-    ret = append_new_quark (str, len);
+    {
+      tr_lockLock (getRuntimeLock ());
+      if (!tr_quark_lookup (str, len, &ret))
+        ret = append_new_quark (str, len);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   return ret;
 }
@@ -496,9 +770,16 @@ tr_quark_get_string (tr_quark q, size_t * len)
   const struct tr_key_struct * tmp;
 
   if (q < TR_N_KEYS)
-    tmp = &my_static[q];
+    {
+      tmp = &my_static[q];
+    }
   else
-    tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+    {
+      /* my_runtime's array can be reallocated by an append */
+      tr_lockLock (getRuntimeLock ());
+      tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   if (len != NULL)
     *len = tmp->len;
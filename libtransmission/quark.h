@@ -48,6 +48,7 @@ enum
   TR_KEY_announce_list, /* metainfo */
   TR_KEY_announceState, /* rpc */
   TR_KEY_arguments, /* rpc */
+  TR_KEY_bandwidth,
   TR_KEY_bandwidth_priority,
   TR_KEY_bandwidthPriority,
   TR_KEY_bind_address_ipv4,
@@ -61,6 +62,8 @@ enum
   TR_KEY_blocks,
   TR_KEY_bytesCompleted,
   TR_KEY_cache_size_mb,
+  TR_KEY_cacheBytes,
+  TR_KEY_choked,
   TR_KEY_clientIsChoked,
   TR_KEY_clientIsInterested,
   TR_KEY_clientName,
@@ -69,9 +72,11 @@ enum
   TR_KEY_compact_view,
   TR_KEY_complete,
   TR_KEY_config_dir,
+  TR_KEY_connection_id, /* announcer-udp */
   TR_KEY_cookies,
   TR_KEY_corrupt,
   TR_KEY_corruptEver,
+  TR_KEY_cpuTime,
   TR_KEY_created_by,
   TR_KEY_created_by_utf_8,
   TR_KEY_creation_date,
@@ -84,6 +89,11 @@ enum
   TR_KEY_desiredAvailable,
   TR_KEY_destination,
   TR_KEY_dht_enabled,
+  TR_KEY_disk,
+  TR_KEY_diskReadBytes,
+  TR_KEY_diskReadOps,
+  TR_KEY_diskWriteBytes,
+  TR_KEY_diskWriteOps,
   TR_KEY_display_name,
   TR_KEY_dnd,
   TR_KEY_done_date,
@@ -97,6 +107,7 @@ enum
   TR_KEY_downloadLimit,
   TR_KEY_downloadLimited,
   TR_KEY_downloadSpeed,
+  TR_KEY_downloadStalls,
   TR_KEY_downloaded,
   TR_KEY_downloaded_bytes,
   TR_KEY_downloadedBytes,
@@ -112,8 +123,10 @@ enum
   TR_KEY_errorString,
   TR_KEY_eta,
   TR_KEY_etaIdle,
+  TR_KEY_expires, /* dns-cache, announcer-udp */
   TR_KEY_failure_reason,
   TR_KEY_fields,
+  TR_KEY_fileOpens,
   TR_KEY_fileStats,
   TR_KEY_filename,
   TR_KEY_files,
@@ -121,11 +134,14 @@ enum
   TR_KEY_files_unwanted,
   TR_KEY_files_wanted,
   TR_KEY_filesAdded,
+  TR_KEY_filter, /* rpc */
   TR_KEY_filter_mode,
   TR_KEY_filter_text,
   TR_KEY_filter_trackers,
+  TR_KEY_filterCounts, /* rpc */
   TR_KEY_flagStr,
   TR_KEY_flags,
+  TR_KEY_format, /* rpc */
   TR_KEY_fromCache,
   TR_KEY_fromDht,
   TR_KEY_fromIncoming,
@@ -150,6 +166,7 @@ enum
   TR_KEY_incomplete,
   TR_KEY_incomplete_dir,
   TR_KEY_incomplete_dir_enabled,
+  TR_KEY_incremental, /* rpc */
   TR_KEY_info,
   TR_KEY_info_hash,
   TR_KEY_inhibit_desktop_hibernation,
@@ -163,6 +180,7 @@ enum
   TR_KEY_isFinished,
   TR_KEY_isIncoming,
   TR_KEY_isPrivate,
+  TR_KEY_isRelocating,
   TR_KEY_isStalled,
   TR_KEY_isUTP,
   TR_KEY_isUploadingTo,
@@ -180,6 +198,9 @@ enum
   TR_KEY_leecherCount,
   TR_KEY_leftUntilDone,
   TR_KEY_length,
+  TR_KEY_limit, /* rpc */
+  TR_KEY_localDataDeletesPending, /* rpc */
+  TR_KEY_localDataFilesPending, /* rpc */
   TR_KEY_location,
   TR_KEY_lpd_enabled,
   TR_KEY_m,
@@ -194,6 +215,7 @@ enum
   TR_KEY_manualAnnounceTime,
   TR_KEY_max_peers,
   TR_KEY_maxConnectedPeers,
+  TR_KEY_memory_budget_mb, /* rpc, settings */
   TR_KEY_memory_bytes,
   TR_KEY_memory_units,
   TR_KEY_message_level,
@@ -210,14 +232,21 @@ enum
   TR_KEY_name_utf_8,
   TR_KEY_nextAnnounceTime,
   TR_KEY_nextScrapeTime,
+  TR_KEY_noRequests,
   TR_KEY_nodes,
   TR_KEY_nodes6,
+  TR_KEY_none,
+  TR_KEY_offset, /* rpc */
   TR_KEY_open_dialog_dir,
+  TR_KEY_openFiles,
+  TR_KEY_outbuf,
   TR_KEY_p,
+  TR_KEY_page_cache_bypass_enabled, /* rpc, settings */
   TR_KEY_path,
   TR_KEY_path_utf_8,
   TR_KEY_paused,
   TR_KEY_pausedTorrentCount,
+  TR_KEY_peer,
   TR_KEY_peer_congestion_algorithm,
   TR_KEY_peer_id_ttl_hours,
   TR_KEY_peer_limit,
@@ -242,6 +271,7 @@ enum
   TR_KEY_pex_enabled,
   TR_KEY_piece,
   TR_KEY_piece_length,
+  TR_KEY_piece_locality_enabled, /* rpc, settings */
   TR_KEY_pieceCount,
   TR_KEY_pieceSize,
   TR_KEY_pieces,
@@ -274,11 +304,15 @@ enum
   TR_KEY_ratio_limit,
   TR_KEY_ratio_limit_enabled,
   TR_KEY_ratio_mode,
+  TR_KEY_read_cache_size_mb,
+  TR_KEY_readCacheHits, /* rpc */
+  TR_KEY_readCacheMisses, /* rpc */
   TR_KEY_recent_download_dir_1,
   TR_KEY_recent_download_dir_2,
   TR_KEY_recent_download_dir_3,
   TR_KEY_recent_download_dir_4,
   TR_KEY_recheckProgress,
+  TR_KEY_relocateProgress,
   TR_KEY_remote_session_enabled,
   TR_KEY_remote_session_host,
   TR_KEY_remote_session_password,
@@ -289,6 +323,9 @@ enum
   TR_KEY_rename_partial_files,
   TR_KEY_reqq,
   TR_KEY_result,
+  TR_KEY_resume_store_enabled,
+  TR_KEY_reverse, /* rpc */
+  TR_KEY_revision, /* rpc */
   TR_KEY_rpc_authentication_required,
   TR_KEY_rpc_bind_address,
   TR_KEY_rpc_enabled,
@@ -305,6 +342,10 @@ enum
   TR_KEY_scrapeState,
   TR_KEY_script_torrent_done_enabled,
   TR_KEY_script_torrent_done_filename,
+  TR_KEY_scrub_enabled, /* rpc, settings */
+  TR_KEY_scrub_piece,
+  TR_KEY_scrub_speed_limit, /* rpc, settings */
+  TR_KEY_search, /* rpc */
   TR_KEY_seconds_active,
   TR_KEY_secondsActive,
   TR_KEY_secondsDownloading,
@@ -318,6 +359,7 @@ enum
   TR_KEY_seedRatioMode,
   TR_KEY_seederCount,
   TR_KEY_seeding_time_seconds,
+  TR_KEY_sequentialDownload, /* rpc */
   TR_KEY_session_count,
   TR_KEY_sessionCount,
   TR_KEY_show_backup_trackers,
@@ -331,6 +373,7 @@ enum
   TR_KEY_size_bytes,
   TR_KEY_size_units,
   TR_KEY_sizeWhenDone,
+  TR_KEY_sort, /* rpc */
   TR_KEY_sort_mode,
   TR_KEY_sort_reversed,
   TR_KEY_speed,
@@ -346,6 +389,10 @@ enum
   TR_KEY_startDate,
   TR_KEY_status,
   TR_KEY_statusbar_stats,
+  TR_KEY_streamingPosition, /* rpc */
+  TR_KEY_streamingWindow, /* rpc */
+  TR_KEY_superSeeding, /* rpc */
+  TR_KEY_table, /* rpc */
   TR_KEY_tag,
   TR_KEY_tier,
   TR_KEY_time_checked,
@@ -363,8 +410,10 @@ enum
   TR_KEY_torrentCount,
   TR_KEY_torrentFile,
   TR_KEY_torrents,
+  TR_KEY_totalCount, /* rpc */
   TR_KEY_totalSize,
   TR_KEY_total_size,
+  TR_KEY_tracker, /* rpc */
   TR_KEY_tracker_id,
   TR_KEY_trackerAdd,
   TR_KEY_trackerRemove,
@@ -374,12 +423,14 @@ enum
   TR_KEY_trash_can_enabled,
   TR_KEY_trash_original_torrent_files,
   TR_KEY_umask,
+  TR_KEY_uninterested,
   TR_KEY_units,
   TR_KEY_upload_slots_per_torrent,
   TR_KEY_uploadLimit,
   TR_KEY_uploadLimited,
   TR_KEY_uploadRatio,
   TR_KEY_uploadSpeed,
+  TR_KEY_uploadStalls,
   TR_KEY_upload_only,
   TR_KEY_uploaded,
   TR_KEY_uploaded_bytes,
@@ -396,9 +447,13 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verify_mmap_enabled, /* rpc, settings */
+  TR_KEY_verify_threads, /* rpc, settings */
   TR_KEY_version,
+  TR_KEY_wait, /* rpc: torrent-get long-poll */
   TR_KEY_wanted,
   TR_KEY_warning_message,
+  TR_KEY_wastedBytes, /* rpc */
   TR_KEY_watch_dir,
   TR_KEY_watch_dir_enabled,
   TR_KEY_webseeds,
@@ -0,0 +1,150 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <string.h> /* memset() */
+
+#include "transmission.h"
+#include "crypto.h" /* SHA_DIGEST_LENGTH */
+#include "torrent.h"
+#include "utils.h" /* tr_wait_msec() */
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define NUM_TORRENTS 6
+
+static tr_session * session = NULL;
+
+static tr_torrent *
+create_torrent (int i)
+{
+  int err;
+  int len;
+  char * benc;
+  char name[32];
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  tr_variant top;
+  tr_variant * info;
+  uint8_t pieces[SHA_DIGEST_LENGTH];
+
+  /* the name is the only thing that differs, and it's enough
+     to give each of them their own info hash */
+  tr_snprintf (name, sizeof (name), "queue-test-%d", i);
+  memset (pieces, 0, sizeof (pieces));
+
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddInt (info, TR_KEY_length, 16384);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, 16384);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, sizeof (pieces));
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  tr_variantFree (&top);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (uint8_t*)benc, len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  err = 0;
+  tor = tr_torrentNew (ctor, &err, NULL);
+
+  tr_ctorFree (ctor);
+  tr_free (benc);
+  return tor;
+}
+
+/* Compare the queue to a string like "ABCDEF",
+   where 'A' is torrents[0], 'B' is torrents[1], etc. */
+static bool
+queueMatches (tr_torrent ** torrents, int n, const char * expected)
+{
+  int i;
+
+  for (i=0; i<n; ++i)
+    if (tr_torrentGetQueuePosition (torrents[i]) != (int)(strchr (expected, 'A'+i) - expected))
+      return false;
+
+  return true;
+}
+
+static int
+test_queue_moves (void)
+{
+  int i;
+  tr_torrent * torrents[NUM_TORRENTS];
+  tr_torrent * batch[2];
+
+  for (i=0; i<NUM_TORRENTS; ++i)
+    {
+      torrents[i] = create_torrent (i);
+      check (torrents[i] != NULL);
+      check_int_eq (i, tr_torrentGetQueuePosition (torrents[i]));
+    }
+
+  /* single moves, including out-of-range positions */
+  tr_torrentSetQueuePosition (torrents[4], 1);
+  check (queueMatches (torrents, NUM_TORRENTS, "AEBCDF"));
+  tr_torrentSetQueuePosition (torrents[0], 3);
+  check (queueMatches (torrents, NUM_TORRENTS, "EBCADF"));
+  tr_torrentSetQueuePosition (torrents[2], -10);
+  check (queueMatches (torrents, NUM_TORRENTS, "CEBADF"));
+  tr_torrentSetQueuePosition (torrents[2], 1000);
+  check (queueMatches (torrents, NUM_TORRENTS, "EBADFC"));
+
+  /* batch moves keep the batch in its queue order */
+  batch[0] = torrents[5];
+  batch[1] = torrents[1];
+  tr_torrentsQueueMoveTop (batch, 2);
+  check (queueMatches (torrents, NUM_TORRENTS, "BFEADC"));
+  tr_torrentsQueueMoveBottom (batch, 2);
+  check (queueMatches (torrents, NUM_TORRENTS, "EADCBF"));
+  tr_torrentsQueueMoveUp (batch, 2);
+  check (queueMatches (torrents, NUM_TORRENTS, "EADBFC"));
+  tr_torrentsQueueMoveDown (batch, 2);
+  check (queueMatches (torrents, NUM_TORRENTS, "EADCBF"));
+  tr_torrentsQueueMoveDown (batch, 2);
+  check (queueMatches (torrents, NUM_TORRENTS, "EADCFB"));
+  batch[0] = torrents[4];
+  tr_torrentsQueueMoveUp (batch, 1);
+  check (queueMatches (torrents, NUM_TORRENTS, "EADCFB"));
+
+  /* removing a torrent closes the gap */
+  tr_torrentRemove (torrents[0], false, NULL);
+  while (tr_sessionCountTorrents (session) != NUM_TORRENTS-1)
+    tr_wait_msec (10);
+  check_int_eq (0, tr_torrentGetQueuePosition (torrents[4]));
+  check_int_eq (1, tr_torrentGetQueuePosition (torrents[3]));
+  check_int_eq (2, tr_torrentGetQueuePosition (torrents[2]));
+  check_int_eq (3, tr_torrentGetQueuePosition (torrents[5]));
+  check_int_eq (4, tr_torrentGetQueuePosition (torrents[1]));
+
+  /* new torrents go to the back */
+  torrents[0] = create_torrent (0);
+  check_int_eq (NUM_TORRENTS-1, tr_torrentGetQueuePosition (torrents[0]));
+
+  for (i=0; i<NUM_TORRENTS; ++i)
+    tr_torrentRemove (torrents[i], false, NULL);
+  while (tr_sessionCountTorrents (session) != 0)
+    tr_wait_msec (10);
+
+  return 0;
+}
+
+int
+main (void)
+{
+  int ret;
+  const testFunc tests[] = { test_queue_moves };
+
+  session = libttest_session_init (NULL);
+  ret = runTests (tests, NUM_TESTS (tests));
+  libttest_session_close (session);
+
+  return ret;
+}
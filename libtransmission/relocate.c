@@ -0,0 +1,820 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#if defined (HAVE_COPY_FILE_RANGE) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* copy_file_range () */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h> /* strlen () */
+
+#ifdef HAVE_COPY_FILE_RANGE
+ #include <unistd.h>
+#endif
+
+#ifdef __linux__
+ #include <sys/ioctl.h>
+ #include <linux/fs.h> /* FICLONE */
+#endif
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "cache.h"
+#include "error.h"
+#include "fdlimit.h" /* tr_fdTorrentClose () */
+#include "file.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
+#include "list.h"
+#include "log.h"
+#include "platform.h" /* tr_lock () */
+#include "platform-quota.h" /* tr_device_info_free_space_changed () */
+#include "relocate.h"
+#include "session.h"
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "verify.h"
+
+/***
+****
+***/
+
+enum
+{
+  /* how much to copy between checks for pausing or cancelling */
+  COPY_CHUNK_SIZE = 8 * 1024 * 1024,
+
+  /* buffer size for when the kernel can't copy for us */
+  COPY_BUFFER_SIZE = 1024 * 1024,
+
+  MSEC_TO_SLEEP_WHILE_PAUSED = 100
+};
+
+/* files are copied to a temporary name, then renamed at the cut-over.
+   copies started while the torrent was a seed hold nothing but verified
+   data, so they get a name that a later move can pick up from. the
+   others can hold blocks that were still being downloaded */
+#define TEMP_SUFFIX ".moving"
+#define TEMP_SUFFIX_UNVERIFIED ".moving-unverified"
+
+typedef enum
+{
+  RELOCATE_QUEUED,
+  RELOCATE_COPYING,
+  RELOCATE_CUTOVER
+}
+tr_relocate_state;
+
+struct relocate_file
+{
+  /* whether the worker copies this file.
+     the others are tr_moveFile ()d at the cut-over */
+  bool copy;
+
+  char * oldpath;
+  char * tmppath;
+  uint64_t size;
+  uint64_t copied;
+
+  /* only used at the cut-over */
+  tr_sys_file_t in;
+  tr_sys_file_t out;
+};
+
+struct relocate_node
+{
+  /* NULL once the move's been cancelled */
+  tr_torrent * tor;
+  tr_session * session;
+
+  char * location;
+  volatile double * setme_progress;
+  volatile int * setme_state;
+
+  tr_file_index_t file_count;
+  struct relocate_file * files;
+
+  /* pieces that were written after their files were copied.
+     only used in the libtransmission thread */
+  tr_bitfield changed_pieces;
+
+  uint64_t bytes_total;
+  uint64_t bytes_done;
+
+  tr_relocate_state state;
+  bool paused;
+  bool stop;
+
+  /* the torrent was a seed when the move started,
+     so its copies can be resumed if the move's interrupted */
+  bool resumable;
+  bool keep_partial;
+  tr_error * error;
+};
+
+static tr_list * relocateList = NULL;
+static bool workerRunning = false;
+
+static tr_lock*
+getRelocateLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static struct relocate_node *
+findNode (const tr_torrent * tor)
+{
+  tr_list * l;
+
+  for (l=relocateList; l!=NULL; l=l->next)
+    {
+      struct relocate_node * node = l->data;
+
+      if (node->tor == tor)
+        return node;
+    }
+
+  return NULL;
+}
+
+static void
+freeNode (struct relocate_node * node, bool discard)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<node->file_count; ++i)
+    {
+      struct relocate_file * f = &node->files[i];
+
+      if (f->in != TR_BAD_SYS_FILE)
+        tr_sys_file_close (f->in, NULL);
+      if (f->out != TR_BAD_SYS_FILE)
+        tr_sys_file_close (f->out, NULL);
+      if (discard && f->copy)
+        tr_sys_path_remove (f->tmppath, NULL);
+
+      tr_free (f->tmppath);
+      tr_free (f->oldpath);
+    }
+
+  tr_error_free (node->error);
+  tr_bitfieldDestruct (&node->changed_pieces);
+  tr_free (node->files);
+  tr_free (node->location);
+  tr_free (node);
+}
+
+static void
+prefixError (tr_error ** error, const char * verb, const char * from, const char * to)
+{
+  tr_error * old = *error;
+
+  if (old != NULL)
+    {
+      *error = tr_error_new (old->code, "Couldn't %s \"%s\" to \"%s\": %s",
+                             verb, from, to, old->message);
+      tr_error_free (old);
+    }
+}
+
+/* call with the relocate lock held */
+static void
+setProgress (struct relocate_node * node)
+{
+  if (node->setme_progress != NULL)
+    *node->setme_progress = node->bytes_total ? (double)node->bytes_done / node->bytes_total : 1.0;
+}
+
+/***
+****  Copying
+***/
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* cleared if the kernel doesn't have copy_file_range () at all */
+static bool copy_file_range_works = true;
+#endif
+
+/* copy [offset, offset+len) from in to out, at the same offset */
+static bool
+copyRange (tr_sys_file_t    in,
+           tr_sys_file_t    out,
+           uint64_t         offset,
+           uint64_t         len,
+           void          ** buf,
+           tr_error      ** error)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  if (copy_file_range_works)
+    {
+      while (len > 0)
+        {
+          loff_t off_in = offset;
+          loff_t off_out = offset;
+          const ssize_t n = copy_file_range (in, &off_in, out, &off_out, len, 0);
+
+          if (n <= 0)
+            {
+              if (n < 0 && errno == ENOSYS)
+                copy_file_range_works = false;
+              break; /* EXDEV, EINVAL, or a short file: let read () sort it out */
+            }
+
+          offset += n;
+          len -= n;
+        }
+    }
+#endif
+
+  while (len > 0)
+    {
+      uint64_t n_read;
+      const uint64_t n = MIN (len, COPY_BUFFER_SIZE);
+
+      if (*buf == NULL)
+        *buf = tr_valloc (COPY_BUFFER_SIZE);
+
+      if (!tr_sys_file_read_at (in, *buf, n, offset, &n_read, error))
+        return false;
+
+      if (n_read == 0)
+        {
+          tr_error_set_literal (error, EIO, _("File is shorter than expected"));
+          return false;
+        }
+
+      if (!tr_sys_file_write_at (out, *buf, n_read, offset, NULL, error))
+        return false;
+
+      offset += n_read;
+      len -= n_read;
+    }
+
+  return true;
+}
+
+/* try to share the data instead of copying it, on filesystems that can */
+static bool
+cloneFile (tr_sys_file_t in UNUSED, tr_sys_file_t out UNUSED)
+{
+#if defined (__linux__) && defined (FICLONE)
+  return ioctl (out, FICLONE, in) == 0;
+#else
+  return false;
+#endif
+}
+
+static bool
+copyFile (struct relocate_node * node, struct relocate_file * f, void ** buf, tr_error ** error)
+{
+  bool ok = true;
+  tr_sys_file_t in;
+  tr_sys_file_t out;
+  char * dir;
+  int flags = TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE;
+
+  dir = tr_sys_path_dirname (f->tmppath, NULL);
+  ok = tr_sys_dir_create (dir, TR_SYS_DIR_CREATE_PARENTS, 0777, error);
+  tr_free (dir);
+  if (!ok)
+    return false;
+
+  if (f->copied == 0)
+    flags |= TR_SYS_FILE_TRUNCATE;
+
+  if ((in = tr_sys_file_open (f->oldpath, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, error)) == TR_BAD_SYS_FILE)
+    return false;
+
+  if ((out = tr_sys_file_open (f->tmppath, flags, 0666, error)) == TR_BAD_SYS_FILE)
+    {
+      tr_sys_file_close (in, NULL);
+      return false;
+    }
+
+  if (f->copied == 0 && f->size > 0 && cloneFile (in, out))
+    {
+      tr_lockLock (getRelocateLock ());
+      node->bytes_done += f->size;
+      f->copied = f->size;
+      setProgress (node);
+      tr_lockUnlock (getRelocateLock ());
+    }
+
+  while (ok && f->copied < f->size && !node->stop)
+    {
+      const uint64_t n = MIN (f->size - f->copied, COPY_CHUNK_SIZE);
+
+      if (node->paused)
+        {
+          tr_wait_msec (MSEC_TO_SLEEP_WHILE_PAUSED);
+          continue;
+        }
+
+      if ((ok = copyRange (in, out, f->copied, n, buf, error)))
+        {
+          tr_lockLock (getRelocateLock ());
+          node->bytes_done += n;
+          f->copied += n;
+          setProgress (node);
+          tr_lockUnlock (getRelocateLock ());
+        }
+    }
+
+  tr_sys_file_close (out, NULL);
+  tr_sys_file_close (in, NULL);
+  return ok;
+}
+
+static void relocateCutover (void * vnode);
+
+static void
+relocateThreadFunc (void * unused UNUSED)
+{
+  for (;;)
+    {
+      tr_list * l;
+      bool stopped;
+      void * buf = NULL;
+      tr_error * error = NULL;
+      tr_file_index_t i;
+      struct relocate_node * node = NULL;
+
+      tr_lockLock (getRelocateLock ());
+      for (l=relocateList; l!=NULL && node==NULL; l=l->next)
+        if (((struct relocate_node*)l->data)->state == RELOCATE_QUEUED)
+          node = l->data;
+      if (node == NULL)
+        break;
+      node->state = RELOCATE_COPYING;
+      tr_lockUnlock (getRelocateLock ());
+
+      for (i=0; i<node->file_count && error==NULL && !node->stop; ++i)
+        {
+          struct relocate_file * f = &node->files[i];
+
+          if (f->copy && !copyFile (node, f, &buf, &error))
+            prefixError (&error, "copy", f->oldpath, f->tmppath);
+        }
+
+      tr_free (buf);
+
+      /* hand it over to the libtransmission thread for the cut-over.
+         this is done under the lock so that it can't race tr_relocateClose () */
+      tr_lockLock (getRelocateLock ());
+      node->error = error;
+      node->state = RELOCATE_CUTOVER;
+      if ((stopped = node->stop))
+        tr_list_remove_data (&relocateList, node);
+      else
+        tr_runInEventThread (node->session, relocateCutover, node);
+      tr_lockUnlock (getRelocateLock ());
+
+      if (stopped)
+        freeNode (node, !node->keep_partial);
+    }
+
+  workerRunning = false;
+  tr_lockUnlock (getRelocateLock ());
+}
+
+/***
+****  Cut-over
+***/
+
+static bool
+openCutoverFiles (const tr_torrent * tor, struct relocate_file * f, tr_file_index_t i, tr_error ** error)
+{
+  if (f->in == TR_BAD_SYS_FILE)
+    {
+      char * sub;
+      const char * base;
+      char * oldpath = NULL;
+
+      /* the file may have been renamed, eg. when it completes */
+      if (tr_torrentFindFile2 (tor, i, &base, &sub, NULL))
+        {
+          oldpath = tr_buildPath (base, sub, NULL);
+          tr_free (sub);
+        }
+
+      if (oldpath != NULL)
+        f->in = tr_sys_file_open (oldpath, TR_SYS_FILE_READ, 0, error);
+      else
+        tr_error_set_literal (error, ENOENT, tr_strerror (ENOENT));
+      tr_free (oldpath);
+    }
+
+  if (f->in != TR_BAD_SYS_FILE && f->out == TR_BAD_SYS_FILE)
+    f->out = tr_sys_file_open (f->tmppath, TR_SYS_FILE_WRITE, 0, error);
+
+  return f->out != TR_BAD_SYS_FILE;
+}
+
+/* bring the copies up to date with what was written while they were made */
+static bool
+copyChangedData (struct relocate_node * node, tr_torrent * tor, tr_error ** error)
+{
+  tr_file_index_t i;
+  tr_piece_index_t p;
+  void * buf = NULL;
+  bool ok = true;
+
+  for (p=0; ok && p<tor->info.pieceCount; ++p)
+    {
+      tr_file_index_t fi;
+      uint64_t offset;
+      uint64_t left;
+
+      if (!tr_bitfieldHas (&node->changed_pieces, p))
+        continue;
+
+      tr_ioFindFileLocation (tor, p, 0, &fi, &offset);
+
+      for (left=tr_torPieceCountBytes (tor, p); ok && left>0 && fi<node->file_count; ++fi, offset=0)
+        {
+          struct relocate_file * f = &node->files[fi];
+          const uint64_t n = MIN (left, tor->info.files[fi].length - offset);
+
+          if (f->copy && offset < f->copied)
+            ok = openCutoverFiles (tor, f, fi, error)
+              && copyRange (f->in, f->out, offset, MIN (n, f->copied - offset), &buf, error);
+
+          left -= n;
+        }
+    }
+
+  /* and copy anything that was appended after the worker got there */
+  for (i=0; ok && i<node->file_count; ++i)
+    {
+      tr_sys_path_info info;
+      struct relocate_file * f = &node->files[i];
+
+      if (!f->copy)
+        continue;
+
+      ok = openCutoverFiles (tor, f, i, error)
+        && tr_sys_file_get_info (f->in, &info, error);
+
+      if (ok && info.size > f->copied)
+        {
+          ok = copyRange (f->in, f->out, f->copied, info.size - f->copied, &buf, error);
+          f->copied = info.size;
+        }
+    }
+
+  tr_free (buf);
+  return ok;
+}
+
+static bool
+moveFiles (struct relocate_node * node, tr_torrent * tor, tr_error ** error)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<node->file_count; ++i)
+    {
+      bool ok;
+      char * sub;
+      const char * base;
+      char * oldpath;
+      char * newpath;
+      struct relocate_file * f = &node->files[i];
+
+      if (!tr_torrentFindFile2 (tor, i, &base, &sub, NULL))
+        continue;
+
+      oldpath = tr_buildPath (base, sub, NULL);
+      newpath = tr_buildPath (node->location, sub, NULL);
+
+      if (f->copy)
+        {
+          tr_sys_file_close (f->in, NULL);
+          tr_sys_file_close (f->out, NULL);
+          f->in = f->out = TR_BAD_SYS_FILE;
+
+          if ((ok = tr_sys_path_rename (f->tmppath, newpath, error)))
+            {
+              f->copy = false;
+              tr_sys_path_remove (oldpath, NULL);
+            }
+        }
+      else if (tr_sys_path_is_same (oldpath, newpath, NULL))
+        {
+          ok = true;
+        }
+      else
+        {
+          /* this is a rename unless the file showed up after the move started */
+          tr_logAddTorInfo (tor, "moving \"%s\" to \"%s\"", oldpath, newpath);
+          errno = 0;
+          if (!(ok = tr_moveFile (oldpath, newpath, NULL) == 0))
+            tr_error_set_literal (error, errno, tr_strerror (errno));
+        }
+
+      if (!ok)
+        prefixError (error, "move", oldpath, newpath);
+
+      tr_free (newpath);
+      tr_free (oldpath);
+      tr_free (sub);
+
+      if (!ok)
+        return false;
+    }
+
+  return true;
+}
+
+static void
+relocateCutover (void * vnode)
+{
+  bool ok;
+  tr_torrent * tor;
+  tr_error * error = NULL;
+  struct relocate_node * node = vnode;
+
+  tr_lockLock (getRelocateLock ());
+  tr_list_remove_data (&relocateList, node);
+  tor = node->tor;
+  tr_lockUnlock (getRelocateLock ());
+
+  /* cancelled while it was waiting for us */
+  if (tor == NULL)
+    {
+      freeNode (node, !node->keep_partial);
+      return;
+    }
+
+  assert (tr_isTorrent (tor));
+  tr_torrentLock (tor);
+
+  /* bad idea to move files while they're being verified... */
+  tr_verifyRemove (tor);
+  tr_cacheFlushTorrent (tor->session->cache, tor);
+  tr_fdTorrentClose (tor->session, tor->uniqueId);
+
+  if (node->error != NULL)
+    {
+      error = node->error;
+      node->error = NULL;
+    }
+
+  ok = error == NULL
+    && copyChangedData (node, tor, &error)
+    && moveFiles (node, tor, &error);
+
+  if (ok)
+    {
+      tr_logAddTorInfo (tor, _("Moved to \"%s\""), node->location);
+      tr_torrentRelocated (tor, node->location);
+    }
+  else
+    {
+      tr_logAddTorErr (tor, "%s", error->message);
+      tr_torrentRelocated (tor, NULL);
+    }
+
+  tor->isRelocating = false;
+  tr_device_info_free_space_changed ();
+
+  if (node->setme_progress != NULL && ok)
+    *node->setme_progress = 1.0;
+  if (node->setme_state != NULL)
+    *node->setme_state = ok ? TR_LOC_DONE : TR_LOC_ERROR;
+
+  tr_error_free (error);
+  freeNode (node, true);
+  tr_torrentUnlock (tor);
+}
+
+/***
+****
+***/
+
+void
+tr_relocateAdd (tr_torrent       * tor,
+                const char       * location,
+                volatile double  * setme_progress,
+                volatile int     * setme_state)
+{
+  bool resume;
+  tr_file_index_t i;
+  tr_file_index_t copy_count = 0;
+  struct relocate_node * node;
+
+  assert (tr_isTorrent (tor));
+  assert (tr_amInEventThread (tor->session));
+
+  tr_relocateRemove (tor);
+
+  /* the copies start from what's on disk now.
+     anything written after this is caught up at the cut-over */
+  tr_cacheFlushTorrent (tor->session->cache, tor);
+
+  /* a seed's files don't change, so leftover copies from an
+     interrupted move can be picked up where they left off,
+     as long as that move started when the torrent was a seed too */
+  resume = tr_torrentIsSeed (tor);
+
+  node = tr_new0 (struct relocate_node, 1);
+  node->tor = tor;
+  node->session = tor->session;
+  node->location = tr_strdup (location);
+  node->setme_progress = setme_progress;
+  node->setme_state = setme_state;
+  node->file_count = tor->info.fileCount;
+  node->files = tr_new0 (struct relocate_file, node->file_count);
+  node->state = RELOCATE_QUEUED;
+  node->resumable = resume;
+  tr_bitfieldConstruct (&node->changed_pieces, tor->info.pieceCount);
+
+  for (i=0; i<node->file_count; ++i)
+    {
+      char * sub;
+      const char * base;
+      tr_sys_path_info info;
+      struct relocate_file * f = &node->files[i];
+
+      f->in = f->out = TR_BAD_SYS_FILE;
+
+      if (!tr_torrentFindFile2 (tor, i, &base, &sub, NULL))
+        continue;
+
+      f->oldpath = tr_buildPath (base, sub, NULL);
+
+      if (!tr_sys_path_is_same_device (f->oldpath, location, NULL)
+          && tr_sys_path_get_info (f->oldpath, 0, &info, NULL))
+        {
+          char * newpath = tr_buildPath (location, sub, NULL);
+
+          f->copy = true;
+          ++copy_count;
+          f->size = info.size;
+          f->tmppath = tr_strdup_printf ("%s%s", newpath, resume ? TEMP_SUFFIX : TEMP_SUFFIX_UNVERIFIED);
+          node->bytes_total += f->size;
+
+          if (resume && tr_sys_path_get_info (f->tmppath, 0, &info, NULL) && info.size <= f->size)
+            {
+              f->copied = info.size;
+              node->bytes_done += f->copied;
+            }
+
+          tr_free (newpath);
+        }
+
+      tr_free (sub);
+    }
+
+  tor->isRelocating = true;
+
+  tr_logAddTorInfo (tor, "Moving %"PRIu64" bytes to \"%s\"", node->bytes_total - node->bytes_done, location);
+
+  /* if everything can be renamed, there's no reason to wait */
+  if (copy_count == 0)
+    {
+      tr_lockLock (getRelocateLock ());
+      tr_list_append (&relocateList, node);
+      node->state = RELOCATE_CUTOVER;
+      tr_lockUnlock (getRelocateLock ());
+      relocateCutover (node);
+      return;
+    }
+
+  tr_lockLock (getRelocateLock ());
+  setProgress (node);
+  tr_list_append (&relocateList, node);
+  if (!workerRunning)
+    {
+      workerRunning = true;
+      tr_threadNew (relocateThreadFunc, NULL);
+    }
+  tr_lockUnlock (getRelocateLock ());
+}
+
+void
+tr_relocateRemove (tr_torrent * tor)
+{
+  struct relocate_node * node;
+
+  assert (tr_isTorrent (tor));
+
+  tr_lockLock (getRelocateLock ());
+
+  if ((node = findNode (tor)) != NULL)
+    {
+      tr_logAddTorInfo (tor, "%s", "Cancelling move");
+
+      if (node->setme_state != NULL)
+        *node->setme_state = TR_LOC_ERROR;
+
+      /* whoever has the node next will free it */
+      node->setme_state = NULL;
+      node->setme_progress = NULL;
+      node->tor = NULL;
+      node->stop = true;
+
+      if (node->state == RELOCATE_QUEUED)
+        tr_list_remove_data (&relocateList, node);
+      else
+        node = NULL;
+    }
+
+  tor->isRelocating = false;
+  tr_lockUnlock (getRelocateLock ());
+
+  if (node != NULL)
+    freeNode (node, true);
+}
+
+void
+tr_relocateSetPaused (tr_torrent * tor, bool paused)
+{
+  struct relocate_node * node;
+
+  tr_lockLock (getRelocateLock ());
+
+  if ((node = findNode (tor)) != NULL)
+    node->paused = paused;
+
+  tr_lockUnlock (getRelocateLock ());
+}
+
+double
+tr_relocateGetProgress (const tr_torrent * tor)
+{
+  double progress = 0;
+  const struct relocate_node * node;
+
+  tr_lockLock (getRelocateLock ());
+
+  if ((node = findNode (tor)) != NULL)
+    progress = node->bytes_total ? (double)node->bytes_done / node->bytes_total : 1.0;
+
+  tr_lockUnlock (getRelocateLock ());
+  return progress;
+}
+
+void
+tr_relocatePieceChanged (tr_torrent * tor, tr_piece_index_t piece)
+{
+  struct relocate_node * node;
+
+  assert (tr_amInEventThread (tor->session));
+
+  tr_lockLock (getRelocateLock ());
+
+  if ((node = findNode (tor)) != NULL)
+    tr_bitfieldAdd (&node->changed_pieces, piece);
+
+  tr_lockUnlock (getRelocateLock ());
+}
+
+void
+tr_relocateClose (tr_session * session)
+{
+  tr_list * l;
+  tr_list * queued = NULL;
+
+  tr_lockLock (getRelocateLock ());
+
+  for (l=relocateList; l!=NULL; l=l->next)
+    {
+      struct relocate_node * node = l->data;
+
+      if (node->session != session)
+        continue;
+
+      node->tor = NULL;
+      node->setme_state = NULL;
+      node->setme_progress = NULL;
+      node->stop = true;
+
+      /* only keep copies that a later move can trust */
+      node->keep_partial = node->resumable && tr_bitfieldHasNone (&node->changed_pieces);
+
+      if (node->state == RELOCATE_QUEUED)
+        tr_list_append (&queued, node);
+    }
+
+  for (l=queued; l!=NULL; l=l->next)
+    tr_list_remove_data (&relocateList, l->data);
+
+  tr_lockUnlock (getRelocateLock ());
+
+  while (queued != NULL)
+    {
+      struct relocate_node * node = tr_list_pop_front (&queued);
+      freeNode (node, !node->keep_partial);
+    }
+}
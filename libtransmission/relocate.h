@@ -0,0 +1,59 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_RELOCATE_H
+#define TR_RELOCATE_H 1
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Moving a torrent's data to a new location.
+ *
+ * Files that can be renamed into place are left alone until the cut-over.
+ * The others are copied by a worker thread, without holding the session
+ * lock, while the torrent keeps using the files in the old location.
+ * Pieces that are written during the copy are remembered and re-copied
+ * at the cut-over, which happens in the libtransmission thread once the
+ * bulk of the data is in place.
+ *
+ * Apart from tr_relocateGetProgress (), these must be called from
+ * the libtransmission thread.
+ */
+
+void   tr_relocateAdd          (tr_torrent        * tor,
+                                const char        * location,
+                                volatile double   * setme_progress,
+                                volatile int      * setme_state);
+
+/** @brief cancel the torrent's move, if it has one, and discard what was copied */
+void   tr_relocateRemove       (tr_torrent        * tor);
+
+void   tr_relocateSetPaused    (tr_torrent        * tor,
+                                bool                paused);
+
+/** @return how much of the torrent's data is in its new location [0..1] */
+double tr_relocateGetProgress  (const tr_torrent  * tor);
+
+/** @brief note that a piece's data changed, so it needs to be copied again */
+void   tr_relocatePieceChanged (tr_torrent        * tor,
+                                tr_piece_index_t    piece);
+
+/** @brief stop copying. Unfinished copies are kept so a later move can resume them. */
+void   tr_relocateClose        (tr_session        * session);
+
+/* @} */
+
+#endif
@@ -17,6 +17,7 @@
 #include "transmission.h"
 #include "file.h"
 #include "resume.h"
+#include "session.h" /* tr_sessionCountTorrents () */
 #include "torrent.h" /* tr_isTorrent() */
 #include "variant.h"
 
@@ -554,13 +555,59 @@ test_partial_file (void)
 ****
 ***/
 
+static int
+test_async_resume (void)
+{
+  uint64_t loaded;
+  tr_torrent * tor;
+  tr_ctor * ctor;
+
+  /* wait for the last test's zero torrent to be removed */
+  while (tr_sessionCountTorrents (session) > 0)
+    tr_wait_msec (10);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  ctor = tr_ctorNew (session);
+
+  /* a dirty torrent is serialized right away and written in the background */
+  tr_torrentSetPeerLimit (tor, 17);
+  tr_torrentSaveAsync (tor);
+  check (!tor->isDirty);
+  tr_torrentSetPeerLimit (tor, 18);
+  tr_resumeClose (session);
+  tor->maxConnectedPeers = 0;
+  loaded = tr_torrentLoadResume (tor, TR_FR_MAX_PEERS, ctor);
+  check ((loaded & TR_FR_MAX_PEERS) != 0);
+  check_int_eq (17, tor->maxConnectedPeers);
+
+  /* a synchronous save replaces a queued one */
+  tr_torrentSetPeerLimit (tor, 19);
+  tr_torrentSaveAsync (tor);
+  tr_torrentSetPeerLimit (tor, 20);
+  tr_torrentSave (tor);
+  tr_resumeClose (session);
+  tor->maxConnectedPeers = 0;
+  tr_torrentLoadResume (tor, TR_FR_MAX_PEERS, ctor);
+  check_int_eq (20, tor->maxConnectedPeers);
+
+  tr_ctorFree (ctor);
+  tr_torrentRemove (tor, false, NULL);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   int ret;
   const testFunc tests[] = { test_single_filename_torrent,
                              test_multifile_torrent,
-                             test_partial_file };
+                             test_partial_file,
+                             test_async_resume };
 
   session = libttest_session_init (NULL);
   ret = runTests (tests, NUM_TESTS (tests));
@@ -0,0 +1,161 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <string.h> /* memset () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "file.h"
+#include "resume-store.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+static int
+put (tr_resume_store * store, const uint8_t * hash, const char * str)
+{
+  int err;
+  struct evbuffer * buf = evbuffer_new ();
+
+  evbuffer_add (buf, str, strlen (str));
+  err = tr_resumeStorePut (store, hash, buf);
+  evbuffer_free (buf);
+  return err;
+}
+
+static bool
+has (tr_resume_store * store, const uint8_t * hash, const char * expected)
+{
+  size_t len = 0;
+  uint8_t * got = tr_resumeStoreGet (store, hash, &len);
+  const bool ok = got != NULL && len == strlen (expected) && !memcmp (got, expected, len);
+
+  tr_free (got);
+  return ok;
+}
+
+static int
+test_store (void)
+{
+  uint8_t a[SHA_DIGEST_LENGTH];
+  uint8_t b[SHA_DIGEST_LENGTH];
+  tr_resume_store * store;
+  char * sandbox = libtest_sandbox_create ();
+  char * filename = tr_buildPath (sandbox, "resume.store", NULL);
+
+  memset (a, 'a', sizeof (a));
+  memset (b, 'b', sizeof (b));
+
+  /* nothing is created unless asked to */
+  check (tr_resumeStoreNew (filename, false) == NULL);
+  check (!tr_sys_path_exists (filename, NULL));
+
+  store = tr_resumeStoreNew (filename, true);
+  check (store != NULL);
+  check (tr_resumeStoreGet (store, a, NULL) == NULL);
+
+  /* the latest record wins */
+  check_int_eq (0, put (store, a, "d3:fooi1ee"));
+  check_int_eq (0, put (store, b, "d3:bari2ee"));
+  check_int_eq (0, put (store, a, "d3:fooi3ee"));
+  check (has (store, a, "d3:fooi3ee"));
+  check (has (store, b, "d3:bari2ee"));
+  tr_resumeStoreRemove (store, b);
+  check (tr_resumeStoreGet (store, b, NULL) == NULL);
+  tr_resumeStoreFree (store);
+
+  /* ...and the same after loading it again */
+  store = tr_resumeStoreNew (filename, false);
+  check (store != NULL);
+  check (has (store, a, "d3:fooi3ee"));
+  check (tr_resumeStoreGet (store, b, NULL) == NULL);
+  tr_resumeStoreFree (store);
+
+  /* a record cut short by a crash is dropped, and the rest kept.
+     here that's b's tombstone, so b's last record is back */
+  {
+    size_t len;
+    uint8_t * contents = tr_loadFile (filename, &len);
+    libtest_create_file_with_contents (filename, contents, len - 3);
+    tr_free (contents);
+  }
+  store = tr_resumeStoreNew (filename, false);
+  check (store != NULL);
+  check (has (store, a, "d3:fooi3ee"));
+  check (has (store, b, "d3:bari2ee"));
+  check_int_eq (0, put (store, b, "d3:bari4ee"));
+  tr_resumeStoreFree (store);
+
+  store = tr_resumeStoreNew (filename, false);
+  check (has (store, a, "d3:fooi3ee"));
+  check (has (store, b, "d3:bari4ee"));
+  tr_resumeStoreFree (store);
+
+  tr_free (filename);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+static int
+test_compact (void)
+{
+  int i;
+  size_t len;
+  char * str;
+  uint8_t a[SHA_DIGEST_LENGTH];
+  uint8_t b[SHA_DIGEST_LENGTH];
+  tr_sys_path_info info;
+  tr_resume_store * store;
+  char * sandbox = libtest_sandbox_create ();
+  char * filename = tr_buildPath (sandbox, "resume.store", NULL);
+
+  memset (a, 'a', sizeof (a));
+  memset (b, 'b', sizeof (b));
+
+  store = tr_resumeStoreNew (filename, true);
+  check_int_eq (0, put (store, b, "d3:bari2ee"));
+
+  /* rewriting a record over and over mustn't grow the file forever */
+  str = tr_malloc0 (10000);
+  for (i=0; i<1000; ++i)
+    {
+      tr_snprintf (str, 10000, "d3:fooi%de3:pad8000:", i);
+      len = strlen (str);
+      memset (str + len, 'x', 8000);
+      str[len + 8000] = 'e';
+      check_int_eq (0, put (store, a, str));
+    }
+  check (tr_sys_path_get_info (filename, 0, &info, NULL));
+  check (info.size < 2 * 1024 * 1024 + 10000);
+  check (has (store, a, str));
+  check (has (store, b, "d3:bari2ee"));
+  tr_resumeStoreFree (store);
+
+  store = tr_resumeStoreNew (filename, false);
+  check (has (store, a, str));
+  check (has (store, b, "d3:bari2ee"));
+  tr_resumeStoreFree (store);
+
+  tr_free (str);
+  tr_free (filename);
+  libtest_sandbox_destroy (sandbox);
+  tr_free (sandbox);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_store,
+                             test_compact };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,393 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h> /* memcmp () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "error.h"
+#include "file.h"
+#include "log.h"
+#include "net.h" /* htonl () */
+#include "ptrarray.h"
+#include "resume-store.h"
+#include "utils.h"
+#include "variant.h" /* tr_variantBufToFile () */
+
+/***
+****
+***/
+
+/* The file starts with MAGIC. Each record is the torrent's info hash,
+ * the length of its resume data as a big-endian uint32, and the data.
+ * A record with no data is a tombstone. */
+
+#define MAGIC "TRRESUME1\n"
+
+enum
+{
+  MAGIC_LEN = sizeof (MAGIC) - 1,
+
+  RECORD_HEADER_LEN = SHA_DIGEST_LENGTH + 4,
+
+  /* don't bother compacting files smaller than this... */
+  COMPACT_MIN_BYTES = 1024 * 1024,
+
+  /* ...or files that aren't mostly stale records */
+  COMPACT_RATIO = 2
+};
+
+struct record
+{
+  uint8_t hash[SHA_DIGEST_LENGTH]; /* must be first; see compareRecords () */
+  uint64_t offset;                 /* where the data starts in the file */
+  uint32_t len;
+};
+
+struct tr_resume_store
+{
+  char * filename;
+  tr_sys_file_t fd;
+
+  /* struct record*, sorted by hash */
+  tr_ptrArray records;
+
+  uint64_t fileSize;
+  uint64_t liveSize; /* file bytes taken by the records in `records' */
+};
+
+#define dbgmsg(...) \
+  do \
+    { \
+      if (tr_logGetDeepEnabled ()) \
+        tr_logAddDeep (__FILE__, __LINE__, NULL, __VA_ARGS__); \
+    } \
+  while (0)
+
+/* compares two records, or a record and a hash */
+static int
+compareRecords (const void * va, const void * vb)
+{
+  return memcmp (va, vb, SHA_DIGEST_LENGTH);
+}
+
+static void
+setRecord (tr_resume_store * store,
+           const uint8_t   * hash,
+           uint64_t          offset,
+           uint32_t          len)
+{
+  struct record * r = tr_ptrArrayFindSorted (&store->records, hash, compareRecords);
+
+  if (r != NULL)
+    {
+      store->liveSize -= RECORD_HEADER_LEN + r->len;
+    }
+  else if (len > 0)
+    {
+      r = tr_new (struct record, 1);
+      memcpy (r->hash, hash, SHA_DIGEST_LENGTH);
+      tr_ptrArrayInsertSorted (&store->records, r, compareRecords);
+    }
+
+  if (len > 0)
+    {
+      r->offset = offset;
+      r->len = len;
+      store->liveSize += RECORD_HEADER_LEN + len;
+    }
+  else if (r != NULL)
+    {
+      tr_ptrArrayRemoveSortedPointer (&store->records, r, compareRecords);
+      tr_free (r);
+    }
+}
+
+/**
+ * Read the file front to back, keeping the last record of each torrent.
+ * @return how much of the file is intact. Anything after that is the
+ *         remains of a write that didn't finish.
+ */
+static uint64_t
+loadRecords (tr_resume_store * store, const uint8_t * map, size_t len)
+{
+  const uint8_t * walk = map + MAGIC_LEN;
+  const uint8_t * const end = map + len;
+
+  while (end - walk >= RECORD_HEADER_LEN)
+    {
+      uint32_t n;
+
+      memcpy (&n, walk + SHA_DIGEST_LENGTH, 4);
+      n = ntohl (n);
+
+      if ((uint64_t)(end - walk - RECORD_HEADER_LEN) < n)
+        break;
+
+      setRecord (store, walk, walk + RECORD_HEADER_LEN - map, n);
+      walk += RECORD_HEADER_LEN + n;
+    }
+
+  return walk - map;
+}
+
+static bool
+writeAt (tr_sys_file_t fd, const void * buf, uint64_t len, uint64_t offset, tr_error ** error)
+{
+  const uint8_t * walk = buf;
+
+  while (len > 0)
+    {
+      uint64_t n;
+
+      if (!tr_sys_file_write_at (fd, walk, len, offset, &n, error))
+        return false;
+
+      walk += n;
+      offset += n;
+      len -= n;
+    }
+
+  return true;
+}
+
+tr_resume_store *
+tr_resumeStoreNew (const char * filename, bool create)
+{
+  size_t len = 0;
+  tr_error * error = NULL;
+  tr_resume_store * store;
+  tr_sys_path_info info;
+  uint8_t * buf = NULL;
+  const uint8_t * map = NULL;
+  uint64_t good;
+
+  if (!create && !tr_sys_path_exists (filename, NULL))
+    return NULL;
+
+  store = tr_new0 (struct tr_resume_store, 1);
+  store->filename = tr_strdup (filename);
+  store->records = TR_PTR_ARRAY_INIT;
+  store->fd = tr_sys_file_open (filename, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE | TR_SYS_FILE_CREATE, 0600, &error);
+
+  if (store->fd == TR_BAD_SYS_FILE || !tr_sys_file_get_info (store->fd, &info, &error))
+    {
+      tr_logAddError (_("Couldn't open \"%1$s\": %2$s"), filename, error->message);
+      tr_error_free (error);
+      tr_resumeStoreFree (store);
+      return NULL;
+    }
+
+  /* the one sequential read */
+  if (info.size > 0
+      && (map = tr_mapFile (filename, &len)) == NULL
+      && (map = buf = tr_loadFile (filename, &len)) == NULL)
+    {
+      tr_logAddError (_("Couldn't read \"%1$s\": %2$s"), filename, tr_strerror (errno));
+      tr_resumeStoreFree (store);
+      return NULL;
+    }
+
+  if (len >= MAGIC_LEN && !memcmp (map, MAGIC, MAGIC_LEN))
+    {
+      good = loadRecords (store, map, len);
+      if (good < len)
+        tr_logAddError (_("\"%1$s\" ends with an unfinished record; dropping %2$"PRIu64" bytes"),
+                        filename, (uint64_t)len - good);
+    }
+  else
+    {
+      if (len > 0)
+        tr_logAddError (_("\"%s\" isn't a resume store; starting a new one"), filename);
+      good = MAGIC_LEN;
+      writeAt (store->fd, MAGIC, MAGIC_LEN, 0, NULL);
+    }
+
+  if (buf != NULL)
+    tr_free (buf);
+  else
+    tr_unmapFile (map, len);
+
+  if (good < len)
+    tr_sys_file_truncate (store->fd, good, NULL);
+
+  store->fileSize = good;
+  dbgmsg ("Loaded %d resume records from \"%s\"", tr_ptrArraySize (&store->records), filename);
+  return store;
+}
+
+void
+tr_resumeStoreFree (tr_resume_store * store)
+{
+  if (store == NULL)
+    return;
+
+  if (store->fd != TR_BAD_SYS_FILE)
+    tr_sys_file_close (store->fd, NULL);
+
+  tr_ptrArrayDestruct (&store->records, tr_free);
+  tr_free (store->filename);
+  tr_free (store);
+}
+
+uint8_t *
+tr_resumeStoreGet (tr_resume_store * store,
+                   const uint8_t   * hash,
+                   size_t          * setme_len)
+{
+  uint64_t n;
+  uint8_t * buf;
+  const struct record * r;
+
+  if (store == NULL)
+    return NULL;
+
+  if ((r = tr_ptrArrayFindSorted (&store->records, hash, compareRecords)) == NULL)
+    return NULL;
+
+  buf = tr_new (uint8_t, r->len);
+
+  if (!tr_sys_file_read_at (store->fd, buf, r->len, r->offset, &n, NULL) || n != r->len)
+    {
+      tr_free (buf);
+      return NULL;
+    }
+
+  *setme_len = r->len;
+  return buf;
+}
+
+/**
+ * Rewrite the file with only the live records.
+ * The new file replaces the old one by renaming, as tr_variantToFile () does.
+ */
+static void
+compact (tr_resume_store * store)
+{
+  int i, n;
+  int err = 0;
+  uint64_t offset;
+  struct evbuffer * buf = evbuffer_new ();
+  tr_error * error = NULL;
+  tr_sys_file_t fd;
+
+  evbuffer_add (buf, MAGIC, MAGIC_LEN);
+
+  for (i=0, n=tr_ptrArraySize (&store->records); !err && i<n; ++i)
+    {
+      uint64_t got;
+      struct evbuffer_iovec iov;
+      const struct record * r = tr_ptrArrayNth (&store->records, i);
+      const uint32_t nlen = htonl (r->len);
+
+      evbuffer_add (buf, r->hash, SHA_DIGEST_LENGTH);
+      evbuffer_add (buf, &nlen, 4);
+      evbuffer_reserve_space (buf, r->len, &iov, 1);
+      if (!tr_sys_file_read_at (store->fd, iov.iov_base, r->len, r->offset, &got, NULL) || got != r->len)
+        err = EIO;
+      iov.iov_len = r->len;
+      evbuffer_commit_space (buf, &iov, 1);
+    }
+
+  if (!err)
+    err = tr_variantBufToFile (buf, store->filename);
+
+  evbuffer_free (buf);
+
+  if (err)
+    return;
+
+  fd = tr_sys_file_open (store->filename, TR_SYS_FILE_READ | TR_SYS_FILE_WRITE, 0, &error);
+  if (fd == TR_BAD_SYS_FILE)
+    {
+      /* keep appending to the old, unlinked file; we may have better luck next time */
+      tr_logAddError (_("Couldn't open \"%1$s\": %2$s"), store->filename, error->message);
+      tr_error_free (error);
+      return;
+    }
+
+  tr_sys_file_close (store->fd, NULL);
+  store->fd = fd;
+
+  /* the records are written in the same order as they're sorted */
+  offset = MAGIC_LEN;
+  for (i=0, n=tr_ptrArraySize (&store->records); i<n; ++i)
+    {
+      struct record * r = tr_ptrArrayNth (&store->records, i);
+      r->offset = offset + RECORD_HEADER_LEN;
+      offset = r->offset + r->len;
+    }
+
+  dbgmsg ("Compacted \"%s\" from %"PRIu64" to %"PRIu64" bytes", store->filename, store->fileSize, offset);
+  store->fileSize = offset;
+  store->liveSize = offset - MAGIC_LEN;
+}
+
+static int
+appendRecord (tr_resume_store * store,
+              const uint8_t   * hash,
+              const void      * data,
+              uint32_t          len)
+{
+  uint8_t header[RECORD_HEADER_LEN];
+  const uint32_t nlen = htonl (len);
+  const uint64_t offset = store->fileSize;
+  tr_error * error = NULL;
+
+  memcpy (header, hash, SHA_DIGEST_LENGTH);
+  memcpy (header + SHA_DIGEST_LENGTH, &nlen, 4);
+
+  if (!writeAt (store->fd, header, RECORD_HEADER_LEN, offset, &error)
+      || !writeAt (store->fd, data, len, offset + RECORD_HEADER_LEN, &error))
+    {
+      const int err = error->code;
+      tr_logAddError (_("Couldn't save file \"%1$s\": %2$s"), store->filename, error->message);
+      tr_error_free (error);
+
+      /* don't leave half a record for the next load to trip over */
+      tr_sys_file_truncate (store->fd, offset, NULL);
+      return err;
+    }
+
+  store->fileSize += RECORD_HEADER_LEN + len;
+  setRecord (store, hash, offset + RECORD_HEADER_LEN, len);
+
+  if (store->fileSize >= COMPACT_MIN_BYTES
+      && store->fileSize - MAGIC_LEN > store->liveSize * COMPACT_RATIO)
+    compact (store);
+
+  return 0;
+}
+
+int
+tr_resumeStorePut (tr_resume_store * store,
+                   const uint8_t   * hash,
+                   struct evbuffer * record)
+{
+  const size_t len = evbuffer_get_length (record);
+
+  assert (store != NULL);
+  assert (len > 0);
+
+  if (len > UINT32_MAX)
+    return EFBIG;
+
+  return appendRecord (store, hash, evbuffer_pullup (record, -1), len);
+}
+
+void
+tr_resumeStoreRemove (tr_resume_store * store,
+                      const uint8_t   * hash)
+{
+  if (store != NULL && tr_ptrArrayFindSorted (&store->records, hash, compareRecords) != NULL)
+    appendRecord (store, hash, NULL, 0);
+}
@@ -0,0 +1,70 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_RESUME_STORE_H
+#define TR_RESUME_STORE_H 1
+
+struct evbuffer;
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * All of a session's resume data in a single file, instead of a
+ * .resume file per torrent.
+ *
+ * The file is a log. Saving a torrent appends its new record and
+ * removing one appends a tombstone, so a save is one small write to a
+ * file that's already open. Opening the store reads the whole file
+ * once, front to back, and remembers where each torrent's latest record
+ * is. When most of the file is stale records it's rewritten with just
+ * the live ones.
+ *
+ * Records are keyed by info hash. These must be called from the
+ * libtransmission thread.
+ */
+typedef struct tr_resume_store tr_resume_store;
+
+/**
+ * @brief open the store in `filename'.
+ * @param create whether to create the file if it doesn't exist yet
+ * @return the store, or NULL if it doesn't exist and `create' is false,
+ *         or if it couldn't be opened.
+ */
+tr_resume_store * tr_resumeStoreNew    (const char       * filename,
+                                        bool               create);
+
+void              tr_resumeStoreFree   (tr_resume_store  * store);
+
+/**
+ * @return a newly-allocated copy of the torrent's record,
+ *         or NULL if the store doesn't have one
+ */
+uint8_t *         tr_resumeStoreGet    (tr_resume_store  * store,
+                                        const uint8_t    * hash,
+                                        size_t           * setme_len);
+
+/** @return zero on success, or an errno value on failure */
+int               tr_resumeStorePut    (tr_resume_store  * store,
+                                        const uint8_t    * hash,
+                                        struct evbuffer  * record);
+
+/** @brief forget the torrent's record, if the store has one */
+void              tr_resumeStoreRemove (tr_resume_store  * store,
+                                        const uint8_t    * hash);
+
+/* @} */
+
+#endif
@@ -7,16 +7,22 @@
  * $Id$
  */
 
+#include <assert.h>
 #include <string.h>
 
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "completion.h"
+#include "crypto.h" /* tr_sha1_init () */
 #include "file.h"
+#include "list.h"
 #include "log.h"
 #include "metainfo.h" /* tr_metainfoGetBasename () */
 #include "peer-mgr.h" /* pex */
-#include "platform.h" /* tr_getResumeDir () */
+#include "platform.h" /* tr_getResumeDir (), tr_lock */
 #include "resume.h"
+#include "resume-store.h"
 #include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_buildPath */
@@ -64,19 +70,19 @@ addPeers (tr_torrent * tor, const uint8_t * buf, int buflen)
   int i;
   int numAdded = 0;
   const int count = buflen / sizeof (tr_pex);
+  tr_pex * pex = tr_new (tr_pex, MIN (count, MAX_REMEMBERED_PEERS));
 
   for (i=0; i<count && numAdded<MAX_REMEMBERED_PEERS; ++i)
     {
-      tr_pex pex;
-      memcpy (&pex, buf + (i * sizeof (tr_pex)), sizeof (tr_pex));
-      if (tr_isPex (&pex))
-        {
-          tr_peerMgrAddPex (tor, TR_PEER_FROM_RESUME, &pex, -1);
-          ++numAdded;
-        }
+      memcpy (&pex[numAdded], buf + (i * sizeof (tr_pex)), sizeof (tr_pex));
+      if (tr_isPex (&pex[numAdded]))
+        ++numAdded;
     }
 
-    return numAdded;
+  tr_peerMgrAddPexList (tor, TR_PEER_FROM_RESUME, pex, numAdded, NULL, -1);
+  tr_free (pex);
+
+  return numAdded;
 }
 
 
@@ -364,6 +370,29 @@ loadName (tr_variant * dict, tr_torrent * tor)
 ****
 ***/
 
+static void
+saveScrub (tr_variant * dict, const tr_torrent * tor)
+{
+  tr_variantDictAddInt (dict, TR_KEY_scrub_piece, tor->scrubPiece);
+}
+
+static uint64_t
+loadScrub (tr_variant * dict, tr_torrent * tor)
+{
+  int64_t i;
+
+  if (!tr_variantDictFindInt (dict, TR_KEY_scrub_piece, &i) || i < 0)
+    return 0;
+
+  /* the scrubber wraps this around if it's past the last piece */
+  tor->scrubPiece = i;
+  return TR_FR_SCRUB;
+}
+
+/***
+****
+***/
+
 static void
 saveFilenames (tr_variant * dict, const tr_torrent * tor)
 {
@@ -403,7 +432,8 @@ loadFilenames (tr_variant * dict, tr_torrent * tor)
           size_t str_len;
           if (tr_variantGetStr (tr_variantListChild (list, i), &str, &str_len) && str && str_len)
             {
-              tr_free (files[i].name);
+              if (files[i].is_renamed)
+                tr_free (files[i].name);
               files[i].name = tr_strndup (str, str_len);
               files[i].is_renamed = true;
             }
@@ -646,18 +676,24 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
 }
 
 /***
-****
+****  Writing resume files
 ***/
 
-void
-tr_torrentSaveResume (tr_torrent * tor)
+/**
+ * Build the torrent's resume file in `setme_hash'.
+ * @return the serialized file, or NULL if it hasn't changed since it was last saved
+ */
+static struct evbuffer *
+serializeResume (tr_torrent * tor, uint8_t * setme_hash)
 {
-  int err;
+  int i;
+  int n;
   tr_variant top;
-  char * filename;
+  struct evbuffer * buf;
+  struct evbuffer_iovec * vecs;
+  tr_sha1_ctx_t sha;
 
-  if (!tr_isTorrent (tor))
-    return;
+  tr_torrentUpdateActiveTime (tor);
 
   tr_variantInitDict (&top, 50); /* arbitrary "big enough" number */
   tr_variantDictAddInt (&top, TR_KEY_seeding_time_seconds, tor->secondsSeeding);
@@ -680,6 +716,7 @@ tr_torrentSaveResume (tr_torrent * tor)
       saveFilePriorities (&top, tor);
       saveDND (&top, tor);
       saveProgress (&top, tor);
+      saveScrub (&top, tor);
     }
   saveSpeedLimits (&top, tor);
   saveRatioLimits (&top, tor);
@@ -687,12 +724,396 @@ tr_torrentSaveResume (tr_torrent * tor)
   saveFilenames (&top, tor);
   saveName (&top, tor);
 
-  filename = getResumeFilename (tor);
-  if ((err = tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename)))
+  buf = tr_variantToBuf (&top, TR_VARIANT_FMT_BENC);
+  tr_variantFree (&top);
+
+  /* most of the torrents saved by the save timer haven't really changed,
+     and rewriting thousands of identical files adds up */
+  n = evbuffer_peek (buf, -1, NULL, NULL, 0);
+  vecs = tr_new (struct evbuffer_iovec, n);
+  evbuffer_peek (buf, -1, NULL, vecs, n);
+  sha = tr_sha1_init ();
+  for (i=0; i<n; ++i)
+    tr_sha1_update (sha, vecs[i].iov_base, vecs[i].iov_len);
+  tr_free (vecs);
+
+  if (!tr_sha1_final (sha, setme_hash) || !memcmp (setme_hash, tor->resumeHash, SHA_DIGEST_LENGTH))
+    {
+      evbuffer_free (buf);
+      buf = NULL;
+    }
+
+  return buf;
+}
+
+/**
+ * Resume files written by tr_torrentSaveResumeAsync () are queued for
+ * a small pool of worker threads, so a save timer tick never waits on
+ * the disk and shutdown can write many torrents' files at once.
+ *
+ * A torrent has at most one job queued and one being written. Workers
+ * skip a torrent whose file is already being written, and
+ * tr_torrentSaveResume () waits for that write before making its own,
+ * so that an older copy of the file can't land on top of a newer one.
+ */
+struct save_job
+{
+  tr_session * session;
+  int torrentId;
+  char * filename;
+  struct evbuffer * buf;
+  int err;
+};
+
+enum
+{
+  MAX_SAVE_WORKERS = 4
+};
+
+static tr_list * saveQueue = NULL;   /* jobs waiting to be written */
+static tr_list * saveWriting = NULL; /* jobs the workers are writing */
+static tr_list * failedSaves = NULL; /* jobs the workers couldn't write */
+static int saveWorkerCount = 0;
+
+static tr_lock *
+getQueueLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static void
+freeSaveJob (struct save_job * job)
+{
+  if (job->buf != NULL)
+    evbuffer_free (job->buf);
+  tr_free (job->filename);
+  tr_free (job);
+}
+
+static int
+compareSaveJobToTorrent (const void * vjob, const void * vtor)
+{
+  const struct save_job * job = vjob;
+  const tr_torrent * tor = vtor;
+
+  if (job->session == tor->session && job->torrentId == tor->uniqueId)
+    return 0;
+
+  return 1;
+}
+
+static int
+compareSaveJobs (const void * va, const void * vb)
+{
+  const struct save_job * a = va;
+  const struct save_job * b = vb;
+
+  if (a->session == b->session && a->torrentId == b->torrentId)
+    return 0;
+
+  return 1;
+}
+
+/**
+ * Drop the torrent's queued write, if it has one,
+ * and wait for the one being written. queueLock must be held.
+ */
+static void
+cancelSaveJob (const tr_torrent * tor)
+{
+  struct save_job * job;
+
+  assert (tr_lockHave (getQueueLock ()));
+
+  if ((job = tr_list_remove (&saveQueue, tor, compareSaveJobToTorrent)) != NULL)
+    freeSaveJob (job);
+
+  while (tr_list_find (saveWriting, tor, compareSaveJobToTorrent) != NULL)
+    {
+      tr_lockUnlock (getQueueLock ());
+      tr_wait_msec (1);
+      tr_lockLock (getQueueLock ());
+    }
+}
+
+/* the first queued job whose torrent isn't being written. queueLock must be held. */
+static struct save_job *
+nextSaveJob (void)
+{
+  tr_list * l;
+
+  for (l=saveQueue; l!=NULL; l=l->next)
+    if (tr_list_find (saveWriting, l->data, compareSaveJobs) == NULL)
+      return l->data;
+
+  return NULL;
+}
+
+static void
+saveThreadFunc (void * unused UNUSED)
+{
+  for (;;)
+    {
+      struct save_job * job;
+
+      /* if the only jobs left are for torrents that another worker
+         is writing, that worker will pick them up when it's done */
+      tr_lockLock (getQueueLock ());
+      if ((job = nextSaveJob ()) == NULL)
+        break;
+      tr_list_remove_data (&saveQueue, job);
+      tr_list_append (&saveWriting, job);
+      tr_lockUnlock (getQueueLock ());
+
+      job->err = tr_variantBufToFile (job->buf, job->filename);
+
+      evbuffer_free (job->buf);
+      job->buf = NULL;
+
+      tr_lockLock (getQueueLock ());
+      tr_list_remove_data (&saveWriting, job);
+      if (job->err != 0)
+        tr_list_append (&failedSaves, job);
+      tr_lockUnlock (getQueueLock ());
+
+      if (job->err == 0)
+        freeSaveJob (job);
+    }
+
+  --saveWorkerCount;
+  tr_lockUnlock (getQueueLock ());
+}
+
+/* let the torrents whose files the worker couldn't write know about it */
+static void
+processFailedSaves (tr_session * session)
+{
+  tr_list * l;
+  tr_list * failed = NULL;
+
+  tr_lockLock (getQueueLock ());
+  for (l=failedSaves; l!=NULL; )
+    {
+      struct save_job * job = l->data;
+      l = l->next;
+
+      if (job->session == session)
+        {
+          tr_list_remove_data (&failedSaves, job);
+          tr_list_append (&failed, job);
+        }
+    }
+  tr_lockUnlock (getQueueLock ());
+
+  while (failed != NULL)
+    {
+      struct save_job * job = tr_list_pop_front (&failed);
+      tr_torrent * tor = tr_torrentFindFromId (session, job->torrentId);
+
+      if (tor != NULL)
+        {
+          /* so that the next save tries again */
+          memset (tor->resumeHash, 0, SHA_DIGEST_LENGTH);
+          tr_torrentSetDirty (tor);
+          tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (job->err));
+        }
+
+      freeSaveJob (job);
+    }
+}
+
+/* the resume store's writes are cheap appends, so they're never queued */
+static void
+saveToStore (tr_torrent * tor, struct evbuffer * buf, const uint8_t * hash)
+{
+  int err;
+
+  if ((err = tr_resumeStorePut (tor->session->resumeStore, tor->info.hash, buf)))
     tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
-  tr_free (filename);
+  else
+    memcpy (tor->resumeHash, hash, SHA_DIGEST_LENGTH);
 
-  tr_variantFree (&top);
+  evbuffer_free (buf);
+}
+
+void
+tr_torrentSaveResume (tr_torrent * tor)
+{
+  int err;
+  char * filename;
+  struct evbuffer * buf;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  if (!tr_isTorrent (tor))
+    return;
+
+  if ((buf = serializeResume (tor, hash)) == NULL)
+    return;
+
+  if (tor->session->isResumeStoreEnabled)
+    {
+      saveToStore (tor, buf, hash);
+    }
+  else
+    {
+      filename = getResumeFilename (tor);
+
+      tr_lockLock (getQueueLock ());
+      cancelSaveJob (tor);
+      err = tr_variantBufToFile (buf, filename);
+      tr_lockUnlock (getQueueLock ());
+
+      if (err)
+        tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
+      else
+        memcpy (tor->resumeHash, hash, SHA_DIGEST_LENGTH);
+
+      /* the store's record, if it has one, is out of date now */
+      if (!err)
+        tr_resumeStoreRemove (tor->session->resumeStore, tor->info.hash);
+
+      tr_free (filename);
+      evbuffer_free (buf);
+    }
+}
+
+void
+tr_torrentSaveResumeAsync (tr_torrent * tor)
+{
+  struct evbuffer * buf;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  if (!tr_isTorrent (tor))
+    return;
+
+  processFailedSaves (tor->session);
+
+  if ((buf = serializeResume (tor, hash)) == NULL)
+    return;
+
+  if (tor->session->isResumeStoreEnabled)
+    {
+      saveToStore (tor, buf, hash);
+    }
+  else
+    {
+      bool backlog;
+      struct save_job * job;
+      struct save_job * old;
+
+      tr_resumeStoreRemove (tor->session->resumeStore, tor->info.hash);
+
+      /* if the write fails, processFailedSaves () clears this again */
+      memcpy (tor->resumeHash, hash, SHA_DIGEST_LENGTH);
+
+      job = tr_new0 (struct save_job, 1);
+      job->session = tor->session;
+      job->torrentId = tor->uniqueId;
+      job->filename = getResumeFilename (tor);
+      job->buf = buf;
+
+      tr_lockLock (getQueueLock ());
+      /* a slow disk could still have the previous copy waiting */
+      old = tr_list_remove (&saveQueue, tor, compareSaveJobToTorrent);
+      backlog = saveQueue != NULL;
+      tr_list_append (&saveQueue, job);
+      /* add workers while the ones we have are falling behind */
+      if (saveWorkerCount == 0 || (backlog && saveWorkerCount < MAX_SAVE_WORKERS))
+        {
+          ++saveWorkerCount;
+          tr_threadNew (saveThreadFunc, NULL);
+        }
+      tr_lockUnlock (getQueueLock ());
+
+      if (old != NULL)
+        freeSaveJob (old);
+    }
+}
+
+static bool
+hasSessionJobs (const tr_list * l, const tr_session * session)
+{
+  for (; l!=NULL; l=l->next)
+    if (((const struct save_job*)l->data)->session == session)
+      return true;
+
+  return false;
+}
+
+void
+tr_resumeClose (tr_session * session)
+{
+  for (;;)
+    {
+      bool pending;
+
+      tr_lockLock (getQueueLock ());
+      pending = hasSessionJobs (saveQueue, session) || hasSessionJobs (saveWriting, session);
+      tr_lockUnlock (getQueueLock ());
+
+      if (!pending)
+        break;
+
+      tr_wait_msec (10);
+    }
+
+  /* forget the failures */
+  processFailedSaves (session);
+}
+
+static bool
+loadFromStore (tr_torrent * tor, tr_variant * setme)
+{
+  size_t len;
+  uint8_t * benc;
+  bool loaded = false;
+
+  if ((benc = tr_resumeStoreGet (tor->session->resumeStore, tor->info.hash, &len)) != NULL)
+    {
+      loaded = !tr_variantFromBenc (setme, benc, len);
+      tr_free (benc);
+    }
+
+  return loaded;
+}
+
+/* move a torrent's resume data from its .resume file into the store */
+static void
+moveToStore (tr_torrent * tor, const tr_variant * top, const char * filename)
+{
+  struct evbuffer * buf = tr_variantToBuf (top, TR_VARIANT_FMT_BENC);
+
+  if (!tr_resumeStorePut (tor->session->resumeStore, tor->info.hash, buf))
+    tr_sys_path_remove (filename, NULL);
+
+  evbuffer_free (buf);
+}
+
+/**
+ * When the resume store is enabled, its record is the real one, and a
+ * .resume file means the torrent hasn't been moved into the store yet.
+ * Otherwise it's the other way around.
+ */
+static bool
+loadResumeData (tr_torrent * tor, tr_variant * setme, const char * filename)
+{
+  if (!tor->session->isResumeStoreEnabled)
+    return !tr_variantFromFile (setme, TR_VARIANT_FMT_BENC, filename)
+        || loadFromStore (tor, setme);
+
+  if (loadFromStore (tor, setme))
+    return true;
+
+  if (tr_variantFromFile (setme, TR_VARIANT_FMT_BENC, filename))
+    return false;
+
+  moveToStore (tor, setme, filename);
+  return true;
 }
 
 static uint64_t
@@ -711,7 +1132,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
 
   filename = getResumeFilename (tor);
 
-  if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+  if (!loadResumeData (tor, &top, filename))
     {
       tr_logAddTorDbg (tor, "Couldn't read \"%s\"", filename);
 
@@ -850,6 +1271,9 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
   if (fieldsToLoad & TR_FR_NAME)
     fieldsLoaded |= loadName (&top, tor);
 
+  if (fieldsToLoad & TR_FR_SCRUB)
+    fieldsLoaded |= loadScrub (&top, tor);
+
   /* loading the resume file triggers of a lot of changes,
    * but none of them needs to trigger a re-saving of the
    * same resume information... */
@@ -926,9 +1350,18 @@ tr_torrentLoadResume (tr_torrent *    tor,
 }
 
 void
-tr_torrentRemoveResume (const tr_torrent * tor)
+tr_torrentRemoveResume (tr_torrent * tor)
 {
   char * filename = getResumeFilename (tor);
+
+  tr_lockLock (getQueueLock ());
+  cancelSaveJob (tor);
   tr_sys_path_remove (filename, NULL);
+  tr_lockUnlock (getQueueLock ());
+
+  tr_resumeStoreRemove (tor->session->resumeStore, tor->info.hash);
   tr_free (filename);
+
+  /* so that the next save writes a new file */
+  memset (tor->resumeHash, 0, SHA_DIGEST_LENGTH);
 }
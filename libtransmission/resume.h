@@ -38,6 +38,7 @@ enum
   TR_FR_TIME_DOWNLOADING    = (1 << 19),
   TR_FR_FILENAMES           = (1 << 20),
   TR_FR_NAME                = (1 << 21),
+  TR_FR_SCRUB               = (1 << 22),
 };
 
 /**
@@ -49,7 +50,19 @@ uint64_t tr_torrentLoadResume   (tr_torrent        * tor,
 
 void     tr_torrentSaveResume   (tr_torrent        * tor);
 
-void     tr_torrentRemoveResume (const tr_torrent  * tor);
+/**
+ * @brief like tr_torrentSaveResume (), but the file is written by a worker thread.
+ *
+ * The resume data is serialized right away, so later changes to the
+ * torrent don't affect what's written. If the write fails, the torrent
+ * gets a local error and is marked dirty again.
+ */
+void     tr_torrentSaveResumeAsync (tr_torrent     * tor);
+
+/** @brief wait for the session's queued resume files to be written */
+void     tr_resumeClose         (tr_session        * session);
+
+void     tr_torrentRemoveResume (tr_torrent        * tor);
 
 int      tr_torrentRenameResume (const tr_torrent  * tor,
                                  const char        * newname);
@@ -0,0 +1,834 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/**
+ * A load test for the RPC server.
+ *
+ * This runs an in-process tr_session holding thousands of synthetic
+ * torrents -- a mix of metainfo torrents with made-up pieces and
+ * magnet links, all paused so that nothing touches the network -- and
+ * replays the clients' polling patterns against its RPC server over
+ * loopback HTTP: the same requests that the Qt client, the web client
+ * and transmission-remote send, or requests read from a file.
+ *
+ * Between polls a few torrents are made to look active, so that
+ * "recently-active" and "revision" requests have something to return.
+ *
+ * For each request it reports the p50, p99 and worst latency, the
+ * response's size on the wire and as JSON, and on glibc how many
+ * allocations the libtransmission thread made to serve it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h> /* atoi (), qsort (), rand () */
+#include <string.h> /* strstr () */
+
+#include <zlib.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "completion.h" /* tr_cpBlockInit () */
+#include "crypto.h" /* tr_cryptoWeakRandInt () */
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define MY_NAME "rpc-bench"
+
+/***
+****  Allocation counting
+***/
+
+/* only the libtransmission thread's allocations are counted, since
+   that's where the RPC server builds its responses */
+static uint64_t allocCount = 0;
+
+#if defined (__GLIBC__) && !defined (__SANITIZE_ADDRESS__)
+
+#define HAVE_ALLOC_COUNT 1
+
+static __thread bool isEventThread = false;
+
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+
+void *
+malloc (size_t size)
+{
+  if (isEventThread)
+    ++allocCount;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (isEventThread)
+    ++allocCount;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void * ptr, size_t size)
+{
+  if (isEventThread)
+    ++allocCount;
+  return __libc_realloc (ptr, size);
+}
+
+#endif
+
+/***
+****  The polling patterns
+***/
+
+/* Torrent::getStatKeys () in qt/torrent.cc */
+#define QT_STAT_FIELDS \
+  "\"id\",\"rateUpload\",\"rateDownload\",\"downloadDir\",\"status\",\"error\",\"errorString\"," \
+  "\"sizeWhenDone\",\"leftUntilDone\",\"haveUnchecked\",\"haveValid\",\"desiredAvailable\"," \
+  "\"peersGettingFromUs\",\"peersSendingToUs\",\"percentDone\",\"metadataPercentComplete\"," \
+  "\"recheckProgress\",\"peersConnected\",\"eta\",\"uploadRatio\",\"downloadedEver\",\"uploadedEver\"," \
+  "\"cpuTime\",\"trackers\",\"seedRatioLimit\",\"seedRatioMode\",\"isFinished\",\"isStalled\",\"queuePosition\""
+
+/* Torrent::getInfoKeys () */
+#define QT_INFO_FIELDS \
+  "\"id\",\"name\",\"totalSize\",\"pieceSize\",\"pieceCount\",\"addedDate\",\"dateCreated\"," \
+  "\"hashString\",\"isPrivate\",\"comment\",\"creator\",\"files\""
+
+/* Torrent::getExtraStatKeys () */
+#define QT_EXTRA_STAT_FIELDS \
+  "\"webseedsSendingToUs\",\"activityDate\",\"startDate\",\"corruptEver\",\"trackerStats\"," \
+  "\"seedIdleLimit\",\"seedIdleMode\",\"downloadLimit\",\"downloadLimited\",\"uploadLimit\"," \
+  "\"uploadLimited\",\"honorsSessionLimits\",\"peer-limit\",\"manualAnnounceTime\",\"peers\"," \
+  "\"bandwidthPriority\",\"fileStats\""
+
+/* Torrent.Fields.Stats in web/javascript/torrent.js */
+#define WEB_STAT_FIELDS \
+  "\"id\",\"cpuTime\",\"error\",\"errorString\",\"eta\",\"isFinished\",\"isStalled\",\"leftUntilDone\"," \
+  "\"metadataPercentComplete\",\"peersConnected\",\"peersGettingFromUs\",\"peersSendingToUs\"," \
+  "\"percentDone\",\"queuePosition\",\"rateDownload\",\"rateUpload\",\"recheckProgress\"," \
+  "\"seedRatioMode\",\"seedRatioLimit\",\"sizeWhenDone\",\"status\",\"trackers\",\"downloadDir\"," \
+  "\"uploadedEver\",\"uploadRatio\",\"webseedsSendingToUs\""
+
+/* list_keys in daemon/remote.c */
+#define REMOTE_LIST_FIELDS \
+  "\"error\",\"eta\",\"id\",\"isFinished\",\"leftUntilDone\",\"name\",\"peersGettingFromUs\"," \
+  "\"peersSendingToUs\",\"rateDownload\",\"rateUpload\",\"sizeWhenDone\",\"status\",\"uploadRatio\""
+
+#define TORRENT_GET(args) "{\"method\":\"torrent-get\",\"arguments\":{" args "}}"
+
+#define SESSION_STATS "{\"method\":\"session-stats\"}"
+
+/**
+ * What one client sends every time it polls.
+ * A "revision" in a request is replaced by the one
+ * that the previous response handed out.
+ */
+struct pattern
+{
+  const char * name;
+  const char * labels[4];
+  const char * requests[4];
+};
+
+static const struct pattern patterns[] =
+{
+  {
+    "qt",
+    { "qt torrent-get (revision)", "qt session-stats" },
+    { TORRENT_GET ("\"revision\":0,\"fields\":[" QT_STAT_FIELDS "]"),
+      SESSION_STATS }
+  },
+  {
+    "qt-details",
+    { "qt details torrent-get (1 torrent)" },
+    { TORRENT_GET ("\"ids\":[1],\"fields\":[" QT_STAT_FIELDS "," QT_EXTRA_STAT_FIELDS "]") }
+  },
+  {
+    "web",
+    { "web torrent-get (recently-active)", "web session-stats" },
+    { TORRENT_GET ("\"ids\":\"recently-active\",\"fields\":[" WEB_STAT_FIELDS "]"),
+      SESSION_STATS }
+  },
+  {
+    "remote",
+    { "remote -l torrent-get (all)" },
+    { TORRENT_GET ("\"fields\":[" REMOTE_LIST_FIELDS "]") }
+  },
+  {
+    "startup",
+    { "qt startup torrent-get (all)" },
+    { TORRENT_GET ("\"fields\":[" QT_INFO_FIELDS "," QT_STAT_FIELDS "]") }
+  }
+};
+
+#define PATTERN_COUNT ((int)(sizeof (patterns) / sizeof (patterns[0])))
+
+/***
+****
+***/
+
+static tr_option options[] =
+{
+  { 'a', "active", "Percent of the torrents that are active", "a", 1, "<percent>" },
+  { 'c', "calls", "How many times to poll with each pattern", "c", 1, "<count>" },
+  { 'f', "file", "Replay the requests in this file, one JSON request per line, instead of the built-in patterns", "f", 1, "<file>" },
+  { 'i', "interval", "Wait this long between polls", "i", 1, "<msec>" },
+  { 'L', "max-p99", "Exit with an error if any request's p99 latency is above this", "L", 1, "<msec>" },
+  { 'm', "magnets", "Percent of the torrents that are magnet links without metainfo", "m", 1, "<percent>" },
+  { 'n', "torrents", "Number of synthetic torrents", "n", 1, "<count>" },
+  { 'P', "pattern", "Only replay this pattern: qt, qt-details, web, remote or startup", "P", 1, "<name>" },
+  { 'p', "port", "The session's RPC port", "p", 1, "<port>" },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+static int active_percent = 5;
+static int call_count = 200;
+static const char * replay_file = NULL;
+static int interval_msec = 0;
+static int max_p99_msec = 0;
+static int magnet_percent = 10;
+static int torrent_count = 10000;
+static const char * pattern_name = NULL;
+static int rpc_port = 19091;
+
+/***
+****  Synthetic torrents
+***/
+
+static const char * const name_words[] =
+{
+  "Some", "Long", "Torrent", "Name", "Linux", "ISO", "Album", "FLAC", "1080p",
+  "x264", "Collection", "Complete", "Season", "Archive", "Backup", "Dataset"
+};
+
+static void
+makeName (char * buf, size_t buflen, int i)
+{
+  int j;
+  const int words = 2 + i % 6;
+  size_t len = 0;
+
+  for (j=0; j<words && len+1<buflen; ++j)
+    len += tr_snprintf (buf + len, buflen - len, "%s.",
+                        name_words[(i * 7 + j * 13) % (int)(sizeof (name_words) / sizeof (name_words[0]))]);
+  tr_snprintf (buf + len, buflen - len, "%d-GROUP", i);
+}
+
+/* a metainfo torrent with random pieces and up to a few dozen files */
+static char *
+makeMetainfo (int i, int * setme_len)
+{
+  int j;
+  char name[128];
+  char * ret;
+  uint8_t * pieces;
+  tr_variant top;
+  tr_variant * info;
+  tr_variant * list;
+  int64_t piece_size = 16 * 1024;
+  const int file_count = i % 4 ? 1 : 2 + tr_cryptoWeakRandInt (40);
+  const int64_t file_size = 1 + tr_cryptoWeakRandInt (1024) * (int64_t)(1024 * 1024) + tr_cryptoWeakRandInt (1024 * 1024);
+  const int64_t total_size = file_size * file_count;
+  int64_t piece_count;
+
+  /* keep the piece count modest so that 10k torrents fit in memory */
+  while (total_size / piece_size > 256)
+    piece_size *= 2;
+  piece_count = (total_size + piece_size - 1) / piece_size;
+
+  pieces = tr_new (uint8_t, piece_count * SHA_DIGEST_LENGTH);
+  for (j=0; j<piece_count * SHA_DIGEST_LENGTH; ++j)
+    pieces[j] = tr_cryptoWeakRandInt (256);
+
+  makeName (name, sizeof (name), i);
+
+  tr_variantInitDict (&top, 4);
+  tr_variantDictAddStr (&top, TR_KEY_announce, "http://tracker.invalid/announce");
+  tr_variantDictAddStr (&top, TR_KEY_comment, "synthetic torrent");
+  tr_variantDictAddStr (&top, TR_KEY_created_by, MY_NAME);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 5);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, piece_size);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, pieces, piece_count * SHA_DIGEST_LENGTH);
+
+  if (file_count == 1)
+    {
+      tr_variantDictAddInt (info, TR_KEY_length, total_size);
+    }
+  else
+    {
+      list = tr_variantDictAddList (info, TR_KEY_files, file_count);
+
+      for (j=0; j<file_count; ++j)
+        {
+          char filename[64];
+          tr_variant * file = tr_variantListAddDict (list, 2);
+          tr_variant * path = tr_variantDictAddList (file, TR_KEY_path, 2);
+
+          tr_snprintf (filename, sizeof (filename), "Disc %d", j / 10 + 1);
+          tr_variantListAddStr (path, filename);
+          tr_snprintf (filename, sizeof (filename), "%02d - Track Title Number %d.flac", j + 1, j + 1);
+          tr_variantListAddStr (path, filename);
+          tr_variantDictAddInt (file, TR_KEY_length, file_size);
+        }
+    }
+
+  ret = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, setme_len);
+
+  tr_variantFree (&top);
+  tr_free (pieces);
+  return ret;
+}
+
+static tr_torrent *
+addTorrent (tr_session * session, int i)
+{
+  tr_torrent * tor;
+  tr_ctor * ctor = tr_ctorNew (session);
+
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+
+  if (tr_cryptoWeakRandInt (100) < magnet_percent)
+    {
+      int j;
+      char name[128];
+      char magnet[512];
+      char hex[SHA_DIGEST_LENGTH * 2 + 1];
+
+      for (j=0; j<SHA_DIGEST_LENGTH * 2; ++j)
+        hex[j] = "0123456789abcdef"[tr_cryptoWeakRandInt (16)];
+      hex[j] = '\0';
+
+      makeName (name, sizeof (name), i);
+      tr_snprintf (magnet, sizeof (magnet), "magnet:?xt=urn:btih:%s&dn=%s&tr=http%%3A%%2F%%2Ftracker.invalid%%2Fannounce", hex, name);
+      tr_ctorSetMetainfoFromMagnetLink (ctor, magnet);
+    }
+  else
+    {
+      int len;
+      char * benc = makeMetainfo (i, &len);
+      tr_ctorSetMetainfo (ctor, (const uint8_t*)benc, len);
+      tr_free (benc);
+    }
+
+  tor = tr_torrentNew (ctor, NULL, NULL);
+  tr_ctorFree (ctor);
+  return tor;
+}
+
+/* give the torrents some history, so that the stats aren't all zeroes
+   and so that only the churned torrents are recently active */
+static void
+fillTorrentsThreadFunc (void * vsession)
+{
+  tr_torrent * tor = NULL;
+  tr_session * session = vsession;
+  const time_t then = tr_time () - 3600;
+
+  while ((tor = tr_torrentNext (session, tor)))
+    {
+      tr_bitfield blocks;
+
+      tor->activityDate = then;
+      tor->anyDate = then;
+
+      if (!tr_torrentHasMetadata (tor))
+        continue;
+
+      /* half of them are done, the rest are partway there */
+      tr_bitfieldConstruct (&blocks, tor->blockCount);
+      if (tr_cryptoWeakRandInt (2))
+        tr_bitfieldSetHasAll (&blocks);
+      else
+        tr_bitfieldAddRange (&blocks, 0, tr_cryptoWeakRandInt (tor->blockCount));
+      tr_cpBlockInit (&tor->completion, &blocks);
+      tr_bitfieldDestruct (&blocks);
+
+      tor->downloadedPrev = tr_cpHaveValid (&tor->completion);
+      tor->uploadedPrev = tor->downloadedPrev / 100 * tr_cryptoWeakRandInt (300);
+    }
+}
+
+struct churn_data
+{
+  tr_session * session;
+  bool done;
+};
+
+/* make the same few torrents look like they've just moved some data */
+static void
+churnThreadFunc (void * vdata)
+{
+  tr_torrent * tor = NULL;
+  struct churn_data * data = vdata;
+  const time_t now = tr_time ();
+
+  while ((tor = tr_torrentNext (data->session, tor)))
+    {
+      if (tr_torrentId (tor) % 100 >= active_percent)
+        continue;
+
+      tor->uploadedCur += 1 + tr_cryptoWeakRandInt (1024 * 1024);
+      tor->activityDate = now;
+      tor->anyDate = now;
+    }
+
+  data->done = true;
+}
+
+static void
+churn (tr_session * session)
+{
+  struct churn_data data;
+
+  data.session = session;
+  data.done = false;
+  tr_runInEventThread (session, churnThreadFunc, &data);
+  while (!data.done)
+    tr_wait_msec (1);
+}
+
+#ifdef HAVE_ALLOC_COUNT
+static void
+markEventThreadFunc (void * vdone)
+{
+  isEventThread = true;
+  *(bool*)vdone = true;
+}
+#endif
+
+/***
+****  The client
+***/
+
+struct client
+{
+  struct event_base * base;
+  struct evhttp_connection * conn;
+  struct evbuffer * body;
+  char * session_id;
+  int64_t revision;
+  int status;
+  bool gzipped;
+};
+
+static void
+onResponse (struct evhttp_request * req, void * vclient)
+{
+  struct client * client = vclient;
+
+  client->status = req ? evhttp_request_get_response_code (req) : 0;
+  client->gzipped = false;
+
+  if (req != NULL)
+    {
+      const char * str;
+      struct evkeyvalq * headers = evhttp_request_get_input_headers (req);
+
+      if (client->status == 409 && (str = evhttp_find_header (headers, TR_RPC_SESSION_ID_HEADER)))
+        {
+          tr_free (client->session_id);
+          client->session_id = tr_strdup (str);
+        }
+
+      str = evhttp_find_header (headers, "Content-Encoding");
+      client->gzipped = str && strstr (str, "gzip");
+      evbuffer_add_buffer (client->body, evhttp_request_get_input_buffer (req));
+    }
+
+  event_base_loopexit (client->base, NULL);
+}
+
+/* POST one request and wait for its response to be in client->body */
+static bool
+clientPost (struct client * client, struct evbuffer * request)
+{
+  int attempt;
+
+  for (attempt=0; attempt<2; ++attempt)
+    {
+      struct evhttp_request * req = evhttp_request_new (onResponse, client);
+      struct evkeyvalq * headers = evhttp_request_get_output_headers (req);
+
+      evhttp_add_header (headers, "Host", "127.0.0.1");
+      evhttp_add_header (headers, "Content-Type", "application/json");
+      evhttp_add_header (headers, "Accept-Encoding", "gzip");
+      if (client->session_id != NULL)
+        evhttp_add_header (headers, TR_RPC_SESSION_ID_HEADER, client->session_id);
+      evbuffer_add (evhttp_request_get_output_buffer (req),
+                    evbuffer_pullup (request, -1), evbuffer_get_length (request));
+
+      evbuffer_drain (client->body, evbuffer_get_length (client->body));
+      evhttp_make_request (client->conn, req, EVHTTP_REQ_POST, "/transmission/rpc");
+      event_base_dispatch (client->base);
+
+      if (client->status != 409)
+        break;
+    }
+
+  return client->status == 200;
+}
+
+/* the response body as JSON, inflated if it came gzipped */
+static struct evbuffer *
+getResponseJson (struct client * client)
+{
+  z_stream stream;
+  struct evbuffer * json = evbuffer_new ();
+
+  if (!client->gzipped)
+    {
+      evbuffer_add_buffer_reference (json, client->body);
+      return json;
+    }
+
+  memset (&stream, 0, sizeof (z_stream));
+  inflateInit2 (&stream, MAX_WBITS + 16);
+  stream.next_in = evbuffer_pullup (client->body, -1);
+  stream.avail_in = evbuffer_get_length (client->body);
+
+  for (;;)
+    {
+      int state;
+      struct evbuffer_iovec iovec;
+
+      evbuffer_reserve_space (json, 64 * 1024, &iovec, 1);
+      stream.next_out = iovec.iov_base;
+      stream.avail_out = iovec.iov_len;
+      state = inflate (&stream, Z_NO_FLUSH);
+      iovec.iov_len -= stream.avail_out;
+      evbuffer_commit_space (json, &iovec, 1);
+
+      if (state != Z_OK)
+        break;
+    }
+
+  inflateEnd (&stream);
+  return json;
+}
+
+/***
+****  Measuring
+***/
+
+struct call_stats
+{
+  const char * label;
+  uint64_t * usec;
+  uint64_t wire_bytes;
+  uint64_t json_bytes;
+  uint64_t allocs;
+  int count;
+  int errors;
+};
+
+static uint64_t
+now_usec (void)
+{
+  struct timeval tv;
+  tr_gettimeofday (&tv);
+  return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+static int
+compareUint64 (const void * va, const void * vb)
+{
+  const uint64_t a = *(const uint64_t*)va;
+  const uint64_t b = *(const uint64_t*)vb;
+
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static void
+makeCall (struct client * client, tr_variant * request, struct call_stats * stats)
+{
+  tr_variant * args;
+  tr_variant top;
+  struct evbuffer * buf;
+  uint64_t begin_usec;
+  uint64_t begin_allocs;
+  bool ok;
+
+  if (tr_variantDictFindDict (request, TR_KEY_arguments, &args)
+      && tr_variantDictFind (args, TR_KEY_revision) != NULL)
+    tr_variantDictAddInt (args, TR_KEY_revision, client->revision);
+
+  buf = tr_variantToBuf (request, TR_VARIANT_FMT_JSON_LEAN);
+
+  begin_allocs = allocCount;
+  begin_usec = now_usec ();
+  ok = clientPost (client, buf);
+  stats->usec[stats->count++] = now_usec () - begin_usec;
+  stats->allocs += allocCount - begin_allocs;
+  stats->wire_bytes += evbuffer_get_length (client->body);
+
+  evbuffer_free (buf);
+
+  buf = getResponseJson (client);
+  stats->json_bytes += evbuffer_get_length (buf);
+
+  if (!ok || tr_variantFromJson (&top, evbuffer_pullup (buf, -1), evbuffer_get_length (buf)))
+    {
+      ++stats->errors;
+    }
+  else
+    {
+      const char * result;
+      int64_t revision;
+
+      if (!tr_variantDictFindStr (&top, TR_KEY_result, &result, NULL) || strcmp (result, "success"))
+        ++stats->errors;
+
+      if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args)
+          && tr_variantDictFindInt (args, TR_KEY_revision, &revision))
+        client->revision = revision;
+
+      tr_variantFree (&top);
+    }
+
+  evbuffer_free (buf);
+}
+
+/* @return the p99 in usec */
+static uint64_t
+reportStats (struct call_stats * stats)
+{
+  char p50[32];
+  char p99[32];
+  char worst[32];
+  const int n = MAX (stats->count, 1);
+
+  qsort (stats->usec, stats->count, sizeof (uint64_t), compareUint64);
+  tr_snprintf (p50, sizeof (p50), "%.2f", stats->usec[(stats->count - 1) * 50 / 100] / 1000.0);
+  tr_snprintf (p99, sizeof (p99), "%.2f", stats->usec[(stats->count - 1) * 99 / 100] / 1000.0);
+  tr_snprintf (worst, sizeof (worst), "%.2f", stats->usec[stats->count - 1] / 1000.0);
+
+#ifdef HAVE_ALLOC_COUNT
+  printf ("%-36s %8s %8s %8s %10"PRIu64" %10"PRIu64" %10.0f",
+          stats->label, p50, p99, worst, stats->wire_bytes / n, stats->json_bytes / n, (double)stats->allocs / n);
+#else
+  printf ("%-36s %8s %8s %8s %10"PRIu64" %10"PRIu64" %10s",
+          stats->label, p50, p99, worst, stats->wire_bytes / n, stats->json_bytes / n, "n/a");
+#endif
+
+  if (stats->errors)
+    printf ("  (%d errors)", stats->errors);
+  printf ("\n");
+
+  return stats->usec[stats->count - 1] ? stats->usec[(stats->count - 1) * 99 / 100] : 0;
+}
+
+/**
+ * Poll call_count times, sending each of `requests' in turn every time.
+ * @return false if a request failed or took too long
+ */
+static bool
+replay (struct client * client, tr_session * session,
+        const char ** labels, const char ** requests, int n)
+{
+  int i, j;
+  bool ok = true;
+  tr_variant * parsed = tr_new0 (tr_variant, n);
+  struct call_stats * stats = tr_new0 (struct call_stats, n);
+
+  for (j=0; j<n; ++j)
+    {
+      stats[j].label = labels[j];
+      stats[j].usec = tr_new0 (uint64_t, call_count);
+
+      if (tr_variantFromJson (&parsed[j], requests[j], strlen (requests[j])))
+        {
+          fprintf (stderr, "Couldn't parse request \"%s\"\n", requests[j]);
+          tr_variantInitDict (&parsed[j], 0);
+          ok = false;
+        }
+    }
+
+  /* start the deltas from a full response, as the clients do */
+  client->revision = 0;
+
+  for (i=0; ok && i<call_count; ++i)
+    {
+      churn (session);
+
+      for (j=0; j<n; ++j)
+        makeCall (client, &parsed[j], &stats[j]);
+
+      if (interval_msec > 0)
+        tr_wait_msec (interval_msec);
+    }
+
+  for (j=0; j<n; ++j)
+    {
+      if (stats[j].count > 0)
+        {
+          const uint64_t p99 = reportStats (&stats[j]);
+
+          if (stats[j].errors || (max_p99_msec > 0 && p99 > (uint64_t)max_p99_msec * 1000))
+            ok = false;
+        }
+
+      tr_free (stats[j].usec);
+      tr_variantFree (&parsed[j]);
+    }
+
+  tr_free (stats);
+  tr_free (parsed);
+  return ok;
+}
+
+static bool
+replayFile (struct client * client, tr_session * session)
+{
+  int n = 0;
+  bool ok;
+  size_t len;
+  char * line;
+  char ** lines;
+  uint8_t * contents = tr_loadFile (replay_file, &len);
+
+  if (contents == NULL)
+    {
+      fprintf (stderr, "Couldn't read \"%s\"\n", replay_file);
+      return false;
+    }
+
+  /* one label and request for each non-blank line */
+  lines = tr_new0 (char *, len + 1);
+  for (line=strtok ((char*)contents, "\r\n"); line!=NULL; line=strtok (NULL, "\r\n"))
+    if (*line != '\0')
+      lines[n++] = line;
+
+  ok = replay (client, session, (const char**)lines, (const char**)lines, n);
+
+  tr_free (lines);
+  tr_free (contents);
+  return ok;
+}
+
+/***
+****
+***/
+
+int
+main (int argc, const char ** argv)
+{
+  int c;
+  int i;
+  bool ok = true;
+  uint64_t begin;
+  const char * optarg;
+  tr_session * session;
+  tr_variant settings;
+  struct client client;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'a': active_percent = atoi (optarg); break;
+          case 'c': call_count = MAX (1, atoi (optarg)); break;
+          case 'f': replay_file = optarg; break;
+          case 'i': interval_msec = atoi (optarg); break;
+          case 'L': max_p99_msec = atoi (optarg); break;
+          case 'm': magnet_percent = atoi (optarg); break;
+          case 'n': torrent_count = MAX (1, atoi (optarg)); break;
+          case 'P': pattern_name = optarg; break;
+          case 'p': rpc_port = atoi (optarg); break;
+
+          default:
+            tr_getopt_usage (MY_NAME, getUsage (), options);
+            return EXIT_FAILURE;
+        }
+    }
+
+  setvbuf (stdout, NULL, _IOLBF, 0);
+
+  tr_variantInitDict (&settings, 8);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_pex_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_peer_port_random_on_start, true);
+  tr_variantDictAddBool (&settings, TR_KEY_rpc_enabled, true);
+  tr_variantDictAddBool (&settings, TR_KEY_rpc_authentication_required, false);
+  tr_variantDictAddStr (&settings, TR_KEY_rpc_bind_address, "127.0.0.1");
+  tr_variantDictAddInt (&settings, TR_KEY_rpc_port, rpc_port);
+  tr_variantDictAddBool (&settings, TR_KEY_scrub_enabled, false);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+#ifdef HAVE_ALLOC_COUNT
+  {
+    bool done = false;
+    tr_runInEventThread (session, markEventThreadFunc, &done);
+    while (!done)
+      tr_wait_msec (1);
+  }
+#endif
+
+  begin = now_usec ();
+  for (i=0; i<torrent_count; ++i)
+    addTorrent (session, i);
+  tr_runInEventThread (session, fillTorrentsThreadFunc, session);
+  churn (session);
+  printf ("%d torrents (%d%% magnets) added in %.1f s; %d%% active; %d polls\n\n",
+          tr_sessionCountTorrents (session), magnet_percent,
+          (now_usec () - begin) / 1000000.0, active_percent, call_count);
+
+  memset (&client, 0, sizeof (struct client));
+  client.base = event_base_new ();
+  client.conn = evhttp_connection_base_new (client.base, NULL, "127.0.0.1", rpc_port);
+  client.body = evbuffer_new ();
+
+  printf ("%-36s %8s %8s %8s %10s %10s %10s\n",
+          "request", "p50 ms", "p99 ms", "max ms", "wire B", "json B", "allocs");
+
+  if (replay_file != NULL)
+    {
+      ok = replayFile (&client, session);
+    }
+  else for (i=0; i<PATTERN_COUNT; ++i)
+    {
+      int n = 0;
+      const struct pattern * p = &patterns[i];
+
+      if (pattern_name != NULL && strcmp (pattern_name, p->name))
+        continue;
+
+      while (n < (int)(sizeof (p->requests) / sizeof (p->requests[0])) && p->requests[n] != NULL)
+        ++n;
+
+      if (!replay (&client, session, (const char**)p->labels, (const char**)p->requests, n))
+        ok = false;
+    }
+
+  evbuffer_free (client.body);
+  evhttp_connection_free (client.conn);
+  event_base_free (client.base);
+  tr_free (client.session_id);
+
+  libttest_session_close (session);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
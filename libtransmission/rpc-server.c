@@ -8,7 +8,9 @@
  */
 
 #include <assert.h>
+#include <ctype.h> /* isdigit () */
 #include <errno.h>
+#include <stdlib.h> /* strtol () */
 #include <string.h> /* memcpy */
 
 #include <zlib.h>
@@ -21,8 +23,10 @@
 #include "transmission.h"
 #include "crypto.h" /* tr_cryptoRandBuf (), tr_ssha1_matches () */
 #include "fdlimit.h"
+#include "file.h"
 #include "list.h"
 #include "log.h"
+#include "metrics.h"
 #include "net.h"
 #include "platform.h" /* tr_getWebClientDir () */
 #include "ptrarray.h"
@@ -45,6 +49,13 @@
 #define MY_REALM "Transmission"
 #define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
 
+/* how much output space to give deflate () per call */
+#define COMPRESS_CHUNK_SIZE (16 * 1024)
+
+/* how long a keep-alive connection may sit idle. this must outlast
+ * the longest torrent-get "wait" so held-back responses get through */
+#define CONNECTION_TIMEOUT_SECONDS 120
+
 struct tr_rpc_server
 {
     bool               isEnabled;
@@ -58,7 +69,12 @@ struct tr_rpc_server
     char             * username;
     char             * password;
     char             * whitelistStr;
-    tr_list          * whitelist;
+    tr_list          * whitelist; /* patterns that couldn't be compiled */
+    struct whitelist_rule * whitelistRules;
+    int                whitelistRuleCount;
+
+    char             * authCache; /* last Authorization header we accepted */
+    tr_ptrArray        webFiles; /* struct web_file, sorted by filename */
 
     char             * sessionId;
     time_t             sessionIdExpiresAt;
@@ -319,99 +335,266 @@ mimetype_guess (const char * path)
   return "application/octet-stream";
 }
 
-static void
-add_response (struct evhttp_request * req,
-              struct tr_rpc_server  * server,
-              struct evbuffer       * out,
-              struct evbuffer       * content)
+/* gzip `content' into `gzipped'. returns false if that fails or if
+ * the compressed data would be no smaller than the original */
+static bool
+gzip_content (struct tr_rpc_server * server,
+              struct evbuffer      * content,
+              struct evbuffer      * gzipped)
 {
-  const char * key = "Accept-Encoding";
-  const char * encoding = evhttp_find_header (req->input_headers, key);
-  const int do_compress = encoding && strstr (encoding, "gzip");
-
-  if (!do_compress)
+  int i;
+  int state = Z_OK;
+  bool ok = true;
+  const size_t content_len = evbuffer_get_length (content);
+  const int n = evbuffer_peek (content, -1, NULL, NULL, 0);
+  struct evbuffer_iovec * chains = tr_new (struct evbuffer_iovec, n);
+
+  if (!server->isStreamInitialized)
     {
-      evbuffer_add_buffer (out, content);
+      int compressionLevel;
+
+      server->isStreamInitialized = true;
+      server->stream.zalloc = (alloc_func) Z_NULL;
+      server->stream.zfree = (free_func) Z_NULL;
+      server->stream.opaque = (voidpf) Z_NULL;
+
+      /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
+       * and trailer around the compressed data instead of a zlib wrapper." */
+#ifdef TR_LIGHTWEIGHT
+      compressionLevel = Z_DEFAULT_COMPRESSION;
+#else
+      compressionLevel = Z_BEST_COMPRESSION;
+#endif
+      deflateInit2 (&server->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
     }
-  else
+
+  /* deflate the content chain by chain rather than pulling it up
+   * into one contiguous block first -- large torrent-get responses
+   * would otherwise be copied in full just to be compressed.
+   * we won't use the deflated data if it's longer than the raw data,
+   * so give up as soon as it gets that big */
+  evbuffer_peek (content, -1, NULL, chains, n);
+  for (i=0; ok && i<MAX (n, 1); ++i)
     {
-      int state;
-      struct evbuffer_iovec iovec[1];
-      void * content_ptr = evbuffer_pullup (content, -1);
-      const size_t content_len = evbuffer_get_length (content);
+      const int flush = i + 1 >= n ? Z_FINISH : Z_NO_FLUSH;
 
-      if (!server->isStreamInitialized)
+      server->stream.next_in = n > 0 ? chains[i].iov_base : NULL;
+      server->stream.avail_in = n > 0 ? chains[i].iov_len : 0;
+
+      do
         {
-          int compressionLevel;
+          struct evbuffer_iovec iovec;
 
-          server->isStreamInitialized = true;
-          server->stream.zalloc = (alloc_func) Z_NULL;
-          server->stream.zfree = (free_func) Z_NULL;
-          server->stream.opaque = (voidpf) Z_NULL;
+          evbuffer_reserve_space (gzipped, COMPRESS_CHUNK_SIZE, &iovec, 1);
+          server->stream.next_out = iovec.iov_base;
+          server->stream.avail_out = iovec.iov_len;
+          state = deflate (&server->stream, flush);
+          iovec.iov_len -= server->stream.avail_out;
+          evbuffer_commit_space (gzipped, &iovec, 1);
 
-          /* zlib's manual says: "Add 16 to windowBits to write a simple gzip header
-           * and trailer around the compressed data instead of a zlib wrapper." */
-#ifdef TR_LIGHTWEIGHT
-          compressionLevel = Z_DEFAULT_COMPRESSION;
-#else
-          compressionLevel = Z_BEST_COMPRESSION;
-#endif
-          deflateInit2 (&server->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+          if (state == Z_STREAM_ERROR || evbuffer_get_length (gzipped) >= content_len)
+            ok = false;
         }
+      while (ok && server->stream.avail_out == 0);
+    }
 
-      server->stream.next_in = content_ptr;
-      server->stream.avail_in = content_len;
+  tr_free (chains);
+  deflateReset (&server->stream);
 
-      /* allocate space for the raw data and call deflate () just once --
-       * we won't use the deflated data if it's longer than the raw data,
-       * so it's okay to let deflate () run out of output buffer space */
-      evbuffer_reserve_space (out, content_len, iovec, 1);
-      server->stream.next_out = iovec[0].iov_base;
-      server->stream.avail_out = iovec[0].iov_len;
-      state = deflate (&server->stream, Z_FINISH);
+  return ok && state == Z_STREAM_END;
+}
 
-      if (state == Z_STREAM_END)
-        {
-          iovec[0].iov_len -= server->stream.avail_out;
+static bool
+accepts_gzip (struct evhttp_request * req)
+{
+  const char * encoding = evhttp_find_header (req->input_headers, "Accept-Encoding");
 
-#if 0
-          fprintf (stderr, "compressed response is %.2f of original (raw==%"TR_PRIuSIZE" bytes; compressed==%"TR_PRIuSIZE")\n",
-                   (double)evbuffer_get_length (out)/content_len,
-                   content_len, evbuffer_get_length (out));
-#endif
+  return encoding && strstr (encoding, "gzip");
+}
+
+static void
+add_response (struct evhttp_request * req,
+              struct tr_rpc_server  * server,
+              struct evbuffer       * out,
+              struct evbuffer       * content)
+{
+  if (!accepts_gzip (req))
+    {
+      evbuffer_add_buffer (out, content);
+    }
+  else
+    {
+      struct evbuffer * gzipped = evbuffer_new ();
+
+      if (gzip_content (server, content, gzipped))
+        {
           evhttp_add_header (req->output_headers,
                              "Content-Encoding", "gzip");
+          evbuffer_add_buffer (out, gzipped);
         }
       else
         {
-          memcpy (iovec[0].iov_base, content_ptr, content_len);
-          iovec[0].iov_len = content_len;
+          evbuffer_add_buffer (out, content);
         }
 
-      evbuffer_commit_space (out, iovec, 1);
-      deflateReset (&server->stream);
+      evbuffer_free (gzipped);
     }
 }
 
+static void
+format_time (char * buf, size_t buflen, time_t value)
+{
+  /* According to RFC 2616 this must follow RFC 1123's date format,
+     so use gmtime instead of localtime... */
+  struct tm tm = *gmtime (&value);
+  strftime (buf, buflen, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
 static void
 add_time_header (struct evkeyvalq  * headers,
                  const char        * key,
                  time_t              value)
 {
-  /* According to RFC 2616 this must follow RFC 1123's date format,
-     so use gmtime instead of localtime... */
   char buf[128];
-  struct tm tm = *gmtime (&value);
-  strftime (buf, sizeof (buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  format_time (buf, sizeof (buf), value);
   evhttp_add_header (headers, key, buf);
 }
 
+/***
+****  Web client files
+***/
+
+/* The web client's files are loaded and gzipped once, then kept in
+ * memory and handed to libevent by reference. An entry is reloaded
+ * when the file's size or mtime changes. Replies still being sent
+ * hold a reference, so a reload never frees data out from under them. */
+struct web_file
+{
+  int refcount;
+  char * filename;
+  uint64_t size;
+  time_t mtime;
+  char etag[64];
+  char last_modified[64];
+  void * raw;
+  size_t raw_len;
+  void * gzipped; /* NULL if gzip didn't make it any smaller */
+  size_t gzipped_len;
+};
+
 static void
-evbuffer_ref_cleanup_tr_free (const void  * data UNUSED,
-                              size_t        datalen UNUSED,
-                              void        * extra)
+web_file_unref (struct web_file * file)
+{
+  if (--file->refcount == 0)
+    {
+      tr_free (file->gzipped);
+      tr_free (file->raw);
+      tr_free (file->filename);
+      tr_free (file);
+    }
+}
+
+static void
+evbuffer_ref_cleanup_web_file (const void  * data UNUSED,
+                               size_t        datalen UNUSED,
+                               void        * vfile)
+{
+  web_file_unref (vfile);
+}
+
+static int
+compare_web_file_to_filename (const void * va, const void * vb)
+{
+  const struct web_file * a = va;
+
+  return strcmp (a->filename, vb);
+}
+
+static struct web_file *
+web_file_load (struct tr_rpc_server  * server,
+               const char            * filename,
+               const tr_sys_path_info * info)
+{
+  size_t raw_len = 0;
+  struct web_file * file;
+  struct evbuffer * content;
+  struct evbuffer * gzipped;
+  void * raw = tr_loadFile (filename, &raw_len);
+
+  if (raw == NULL)
+    return NULL;
+
+  file = tr_new0 (struct web_file, 1);
+  file->refcount = 1;
+  file->filename = tr_strdup (filename);
+  file->size = info->size;
+  file->mtime = info->last_modified_at;
+  file->raw = raw;
+  file->raw_len = raw_len;
+  tr_snprintf (file->etag, sizeof (file->etag), "\"%"PRIx64"-%"PRIx64"\"",
+               (uint64_t)file->size, (uint64_t)file->mtime);
+  format_time (file->last_modified, sizeof (file->last_modified), file->mtime);
+
+  content = evbuffer_new ();
+  gzipped = evbuffer_new ();
+  evbuffer_add_reference (content, raw, raw_len, NULL, NULL);
+  if (gzip_content (server, content, gzipped))
+    {
+      file->gzipped_len = evbuffer_get_length (gzipped);
+      file->gzipped = tr_new (char, file->gzipped_len);
+      evbuffer_remove (gzipped, file->gzipped, file->gzipped_len);
+    }
+  evbuffer_free (gzipped);
+  evbuffer_free (content);
+
+  return file;
+}
+
+/* returns the cached file, loading or reloading it first if needed */
+static struct web_file *
+web_file_get (struct tr_rpc_server * server, const char * filename)
+{
+  bool exact;
+  int pos;
+  tr_sys_path_info info;
+  struct web_file * file = NULL;
+
+  if (!tr_sys_path_get_info (filename, 0, &info, NULL) || (info.type != TR_SYS_PATH_IS_FILE))
+    return NULL;
+
+  pos = tr_ptrArrayLowerBound (&server->webFiles, filename, compare_web_file_to_filename, &exact);
+  if (exact)
+    {
+      file = tr_ptrArrayNth (&server->webFiles, pos);
+
+      if ((file->size != info.size) || (file->mtime != info.last_modified_at))
+        {
+          tr_ptrArrayErase (&server->webFiles, pos, pos + 1);
+          web_file_unref (file);
+          file = NULL;
+        }
+    }
+
+  if ((file == NULL) && ((file = web_file_load (server, filename, &info))))
+    tr_ptrArrayInsert (&server->webFiles, file, pos);
+
+  return file;
+}
+
+static bool
+is_not_modified (struct evhttp_request * req, const struct web_file * file)
 {
-  tr_free (extra);
+  const char * str;
+
+  if ((str = evhttp_find_header (req->input_headers, "If-None-Match")))
+    return strstr (str, file->etag) != NULL || !strcmp (str, "*");
+
+  /* browsers send back the Last-Modified value they were given,
+   * so there's no need to parse the date */
+  if ((str = evhttp_find_header (req->input_headers, "If-Modified-Since")))
+    return !strcmp (str, file->last_modified);
+
+  return false;
 }
 
 static void
@@ -426,40 +609,56 @@ serve_file (struct evhttp_request  * req,
     }
   else
     {
-      void * file;
-      size_t file_len;
-      struct evbuffer * content;
       const int error = errno;
+      struct web_file * file;
 
       errno = 0;
-      file_len = 0;
-      file = tr_loadFile (filename, &file_len);
-      content = evbuffer_new ();
-      evbuffer_add_reference (content, file, file_len, evbuffer_ref_cleanup_tr_free, file);
+      file = web_file_get (server, filename);
 
-      if (errno)
+      if (file == NULL)
         {
-          char * tmp = tr_strdup_printf ("%s (%s)", filename, tr_strerror (errno));
+          char * tmp = tr_strdup_printf ("%s (%s)", filename, tr_strerror (errno ? errno : ENOENT));
           send_simple_response (req, HTTP_NOTFOUND, tmp);
           tr_free (tmp);
         }
       else
         {
-          struct evbuffer * out;
           const time_t now = tr_time ();
 
           errno = error;
-          out = evbuffer_new ();
-          evhttp_add_header (req->output_headers, "Content-Type", mimetype_guess (filename));
           add_time_header (req->output_headers, "Date", now);
           add_time_header (req->output_headers, "Expires", now+ (24*60*60));
-          add_response (req, server, out, content);
-          evhttp_send_reply (req, HTTP_OK, "OK", out);
+          evhttp_add_header (req->output_headers, "ETag", file->etag);
+          evhttp_add_header (req->output_headers, "Last-Modified", file->last_modified);
+          evhttp_add_header (req->output_headers, "Vary", "Accept-Encoding");
 
-          evbuffer_free (out);
+          if (is_not_modified (req, file))
+            {
+              evhttp_send_reply (req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+            }
+          else
+            {
+              struct evbuffer * out = evbuffer_new ();
+
+              evhttp_add_header (req->output_headers, "Content-Type", mimetype_guess (filename));
+
+              ++file->refcount;
+              if (file->gzipped && accepts_gzip (req))
+                {
+                  evhttp_add_header (req->output_headers, "Content-Encoding", "gzip");
+                  evbuffer_add_reference (out, file->gzipped, file->gzipped_len,
+                                          evbuffer_ref_cleanup_web_file, file);
+                }
+              else
+                {
+                  evbuffer_add_reference (out, file->raw, file->raw_len,
+                                          evbuffer_ref_cleanup_web_file, file);
+                }
+
+              evhttp_send_reply (req, HTTP_OK, "OK", out);
+              evbuffer_free (out);
+            }
         }
-
-      evbuffer_free (content);
     }
 }
 
@@ -508,10 +707,15 @@ handle_web_client (struct evhttp_request * req,
     }
 }
 
+/* requests POSTed with this Content-Type are bencoded,
+   and so are their responses */
+#define BENC_CONTENT_TYPE "application/x-bencode"
+
 struct rpc_response_data
 {
   struct evhttp_request * req;
   struct tr_rpc_server  * server;
+  bool                    benc;
 };
 
 static void
@@ -519,31 +723,90 @@ rpc_response_func (tr_session      * session UNUSED,
                    struct evbuffer * response,
                    void            * user_data)
 {
+  struct evbuffer * buf;
   struct rpc_response_data * data = user_data;
-  struct evbuffer * buf = evbuffer_new ();
 
+  if (data->req == NULL)
+    {
+      tr_free (data);
+      return;
+    }
+
+  evhttp_connection_set_closecb (evhttp_request_get_connection (data->req), NULL, NULL);
+
+  buf = evbuffer_new ();
   add_response (data->req, data->server, buf, response);
-  evhttp_add_header (data->req->output_headers,
-                     "Content-Type", "application/json; charset=UTF-8");
+  evhttp_add_header (data->req->output_headers, "Content-Type",
+                     data->benc ? BENC_CONTENT_TYPE : "application/json; charset=UTF-8");
   evhttp_send_reply (data->req, HTTP_OK, "OK", buf);
 
   evbuffer_free (buf);
   tr_free (data);
 }
 
+/* torrent-get can hold its response back for a while, so notice when
+ * the client goes away before we get around to answering it */
 static void
-handle_rpc_from_json (struct evhttp_request * req,
-                      struct tr_rpc_server  * server,
-                      const char            * json,
-                      size_t                  json_len)
+rpc_response_closed (struct evhttp_connection * evcon UNUSED,
+                     void                     * user_data)
+{
+  struct rpc_response_data * data = user_data;
+
+  data->req = NULL;
+}
+
+static struct rpc_response_data *
+rpc_response_data_new (struct evhttp_request * req,
+                       struct tr_rpc_server  * server)
 {
-  struct rpc_response_data * data;
+  struct rpc_response_data * data = tr_new0 (struct rpc_response_data, 1);
 
-  data = tr_new0 (struct rpc_response_data, 1);
   data->req = req;
   data->server = server;
+  evhttp_connection_set_closecb (evhttp_request_get_connection (req),
+                                 rpc_response_closed, data);
+
+  return data;
+}
+
+static bool
+is_benc_request (struct evhttp_request * req)
+{
+  const char * type = evhttp_find_header (req->input_headers, "Content-Type");
+
+  return (type != NULL) && !evutil_ascii_strncasecmp (type, BENC_CONTENT_TYPE, strlen (BENC_CONTENT_TYPE));
+}
 
-  tr_rpc_request_exec_json (server->session, json, json_len, rpc_response_func, data);
+static void
+handle_rpc_from_body (struct evhttp_request * req,
+                      struct tr_rpc_server  * server)
+{
+  struct rpc_response_data * data = rpc_response_data_new (req, server);
+  const char * body = (const char *) evbuffer_pullup (req->input_buffer, -1);
+  const size_t body_len = evbuffer_get_length (req->input_buffer);
+
+  data->benc = is_benc_request (req);
+
+  if (data->benc)
+    tr_rpc_request_exec_benc (server->session, body, body_len, rpc_response_func, data);
+  else
+    tr_rpc_request_exec_json (server->session, body, body_len, rpc_response_func, data);
+}
+
+static void
+handle_metrics (struct evhttp_request * req, struct tr_rpc_server * server)
+{
+  struct evbuffer * buf = evbuffer_new ();
+  struct evbuffer * text = evbuffer_new ();
+
+  tr_metricsToText (server->session, text);
+  add_response (req, server, buf, text);
+  evhttp_add_header (req->output_headers,
+                     "Content-Type", "text/plain; version=0.0.4; charset=UTF-8");
+  evhttp_send_reply (req, HTTP_OK, "OK", buf);
+
+  evbuffer_free (text);
+  evbuffer_free (buf);
 }
 
 static void
@@ -553,15 +816,11 @@ handle_rpc (struct evhttp_request * req, struct tr_rpc_server  * server)
 
   if (req->type == EVHTTP_REQ_POST)
     {
-      handle_rpc_from_json (req, server,
-                            (const char *) evbuffer_pullup (req->input_buffer, -1),
-                            evbuffer_get_length (req->input_buffer));
+      handle_rpc_from_body (req, server);
     }
   else if ((req->type == EVHTTP_REQ_GET) && ((q = strchr (req->uri, '?'))))
     {
-      struct rpc_response_data * data = tr_new0 (struct rpc_response_data, 1);
-      data->req = req;
-      data->server = server;
+      struct rpc_response_data * data = rpc_response_data_new (req, server);
       tr_rpc_request_exec_uri (server->session, q+1, -1, rpc_response_func, data);
     }
   else
@@ -570,14 +829,85 @@ handle_rpc (struct evhttp_request * req, struct tr_rpc_server  * server)
     }
 }
 
+/* An IPv4 whitelist entry like "192.168.*.*", compiled into a mask of
+ * the octets that have to match. Entries that aren't in this form are
+ * kept as tr_wildmat () patterns in tr_rpc_server.whitelist instead. */
+struct whitelist_rule
+{
+  uint32_t addr;
+  uint32_t mask;
+};
+
+static bool
+whitelistRuleCompile (const char * pattern, struct whitelist_rule * setme)
+{
+  int i;
+  const char * walk = pattern;
+
+  setme->addr = 0;
+  setme->mask = 0;
+
+  /* tr_wildmat () lets a leading '*' match IPv6 addresses too,
+     e.g. "*" or "*.*.*.*" match "::ffff:10.0.0.1", so leave those to it */
+  if (*walk == '*')
+    return false;
+
+  for (i=0; i<4; ++i)
+    {
+      const int shift = 8 * (3 - i);
+
+      if (*walk == '*')
+        {
+          ++walk;
+
+          /* a trailing '*' matches the rest of the address */
+          if (*walk == '\0')
+            return true;
+        }
+      else
+        {
+          char * end;
+          long octet;
+
+          if (!isdigit ((unsigned char)*walk))
+            return false;
+
+          octet = strtol (walk, &end, 10);
+          /* "01" wouldn't have matched "1" as a pattern, so don't compile it */
+          if ((octet > 255) || (end - walk > 3) || ((*walk == '0') && (end - walk > 1)))
+            return false;
+
+          setme->addr |= (uint32_t)octet << shift;
+          setme->mask |= (uint32_t)0xff << shift;
+          walk = end;
+        }
+
+      if (i < 3 && *walk++ != '.')
+        return false;
+    }
+
+  return *walk == '\0';
+}
+
 static bool
 isAddressAllowed (const tr_rpc_server * server, const char * address)
 {
   tr_list * l;
+  tr_address addr;
 
   if (!server->isWhitelistEnabled)
     return true;
 
+  if (tr_address_from_string (&addr, address) && (addr.type == TR_AF_INET))
+    {
+      int i;
+      const uint32_t ip = ntohl (addr.addr.addr4.s_addr);
+
+      for (i=0; i<server->whitelistRuleCount; ++i)
+        if ((ip & server->whitelistRules[i].mask) == server->whitelistRules[i].addr)
+          return true;
+    }
+
   for (l=server->whitelist; l!=NULL; l=l->next)
     if (tr_wildmat (address, l->data))
       return true;
@@ -585,6 +915,71 @@ isAddressAllowed (const tr_rpc_server * server, const char * address)
   return false;
 }
 
+/* the time this takes depends on the lengths only, not on how much of
+   the strings match, so it can't be used to guess the cached header */
+static bool
+constantTimeEquals (const char * a, const char * b)
+{
+  size_t i;
+  const size_t alen = strlen (a);
+  const size_t blen = strlen (b);
+  unsigned char diff = alen != blen;
+
+  for (i=0; i<blen; ++i)
+    diff |= (unsigned char)((i < alen ? a[i] : '\0') ^ b[i]);
+
+  return diff == 0;
+}
+
+static void
+clearAuthCache (tr_rpc_server * server)
+{
+  tr_free (server->authCache);
+  server->authCache = NULL;
+}
+
+/* Most clients send the same Authorization header with every request,
+ * so remember the last one that passed rather than salting and hashing
+ * its password each time */
+static bool
+isAuthorized (tr_rpc_server * server, const char * auth)
+{
+  bool ok = false;
+
+  if (!server->isPasswordEnabled)
+    return true;
+
+  if (auth == NULL)
+    return false;
+
+  if ((server->authCache != NULL) && constantTimeEquals (server->authCache, auth))
+    return true;
+
+  if (!evutil_ascii_strncasecmp (auth, "basic ", 6))
+    {
+      int plen;
+      char * pass;
+      char * user = tr_base64_decode (auth + 6, 0, &plen);
+
+      if (user && plen && ((pass = strchr (user, ':'))))
+        {
+          *pass++ = '\0';
+          ok = !strcmp (server->username, user)
+            && tr_ssha1_matches (server->password, pass);
+        }
+
+      tr_free (user);
+    }
+
+  if (ok)
+    {
+      clearAuthCache (server);
+      server->authCache = tr_strdup (auth);
+    }
+
+  return ok;
+}
+
 static bool
 test_session_id (struct tr_rpc_server * server, struct evhttp_request * req)
 {
@@ -601,24 +996,8 @@ handle_request (struct evhttp_request * req, void * arg)
 
   if (req && req->evcon)
     {
-      const char * auth;
-      char * user = NULL;
-      char * pass = NULL;
-
       evhttp_add_header (req->output_headers, "Server", MY_REALM);
 
-      auth = evhttp_find_header (req->input_headers, "Authorization");
-      if (auth && !evutil_ascii_strncasecmp (auth, "basic ", 6))
-        {
-          int plen;
-          char * p = tr_base64_decode (auth + 6, 0, &plen);
-          if (p && plen && ((pass = strchr (p, ':'))))
-            {
-              user = p;
-              *pass++ = '\0';
-            }
-        }
-
       if (!isAddressAllowed (server, req->remote_host))
         {
           send_simple_response (req, 403,
@@ -627,10 +1006,7 @@ handle_request (struct evhttp_request * req, void * arg)
             "<p>If you're editing settings.json, see the 'rpc-whitelist' and 'rpc-whitelist-enabled' entries.</p>"
             "<p>If you're still using ACLs, use a whitelist instead. See the transmission-daemon manpage for details.</p>");
         }
-      else if (server->isPasswordEnabled
-                 && (!pass || !user || strcmp (server->username, user)
-                                     || !tr_ssha1_matches (server->password,
-                                                           pass)))
+      else if (!isAuthorized (server, evhttp_find_header (req->input_headers, "Authorization")))
         {
           evhttp_add_header (req->output_headers,
                              "WWW-Authenticate",
@@ -652,6 +1028,12 @@ handle_request (struct evhttp_request * req, void * arg)
         {
           handle_upload (req, server);
         }
+      /* read-only, so it doesn't need the CSRF session-id check.
+         that lets a Prometheus scraper fetch it with a plain GET */
+      else if (!strcmp (req->uri + strlen (server->url), "metrics"))
+        {
+          handle_metrics (req, server);
+        }
 #ifdef REQUIRE_SESSION_ID
       else if (!test_session_id (server, req))
         {
@@ -681,8 +1063,6 @@ handle_request (struct evhttp_request * req, void * arg)
         {
           send_simple_response (req, HTTP_NOTFOUND, req->uri);
         }
-
-      tr_free (user);
     }
 }
 
@@ -699,6 +1079,7 @@ startServer (void * vserver)
       server->httpd = evhttp_new (server->session->event_base);
       evhttp_bind_socket (server->httpd, tr_address_to_string (&addr), server->port);
       evhttp_set_gencb (server->httpd, handle_request, server);
+      evhttp_set_timeout (server->httpd, CONNECTION_TIMEOUT_SECONDS);
     }
 }
 
@@ -800,6 +1181,9 @@ tr_rpcSetWhitelist (tr_rpc_server * server, const char * whitelistStr)
   /* clear out the old whitelist entries */
   while ((tmp = tr_list_pop_front (&server->whitelist)))
     tr_free (tmp);
+  tr_free (server->whitelistRules);
+  server->whitelistRules = NULL;
+  server->whitelistRuleCount = 0;
 
   /* build the new whitelist entries */
   for (walk=whitelistStr; walk && *walk;)
@@ -807,11 +1191,23 @@ tr_rpcSetWhitelist (tr_rpc_server * server, const char * whitelistStr)
       const char * delimiters = " ,;";
       const size_t len = strcspn (walk, delimiters);
       char * token = tr_strndup (walk, len);
-      tr_list_append (&server->whitelist, token);
+      struct whitelist_rule rule;
+
+      if (whitelistRuleCompile (token, &rule))
+        {
+          server->whitelistRules = tr_renew (struct whitelist_rule, server->whitelistRules, server->whitelistRuleCount + 1);
+          server->whitelistRules[server->whitelistRuleCount++] = rule;
+        }
+      else
+        {
+          tr_list_append (&server->whitelist, tr_strdup (token));
+        }
+
       if (strcspn (token, "+-") < len)
         tr_logAddNamedInfo (MY_NAME, "Adding address to whitelist: %s (And it has a '+' or '-'!  Are you using an old ACL by mistake?)", token);
       else
         tr_logAddNamedInfo (MY_NAME, "Adding address to whitelist: %s", token);
+      tr_free (token);
 
       if (walk[len]=='\0')
         break;
@@ -852,6 +1248,7 @@ tr_rpcSetUsername (tr_rpc_server * server, const char * username)
   server->username = tr_strdup (username);
   dbgmsg ("setting our Username to [%s]", server->username);
   tr_free (tmp);
+  clearAuthCache (server);
 }
 
 const char*
@@ -870,6 +1267,7 @@ tr_rpcSetPassword (tr_rpc_server * server,
   else
     server->password = strdup (password);
   dbgmsg ("setting our Password to [%s]", server->password);
+  clearAuthCache (server);
 }
 
 const char*
@@ -882,6 +1280,7 @@ void
 tr_rpcSetPasswordEnabled (tr_rpc_server * server, bool isEnabled)
 {
   server->isPasswordEnabled = isEnabled;
+  clearAuthCache (server);
   dbgmsg ("setting 'password enabled' to %d", (int)isEnabled);
 }
 
@@ -913,6 +1312,9 @@ closeServer (void * vserver)
   stopServer (s);
   while ((tmp = tr_list_pop_front (&s->whitelist)))
     tr_free (tmp);
+  tr_free (s->whitelistRules);
+  tr_free (s->authCache);
+  tr_ptrArrayDestruct (&s->webFiles, (PtrArrayForeachFunc)web_file_unref);
   if (s->isStreamInitialized)
     deflateEnd (&s->stream);
   tr_free (s->url);
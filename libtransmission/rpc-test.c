@@ -12,7 +12,10 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "announcer.h" /* tr_announcerTrackerHost () */
 #include "rpcimpl.h"
+#include "session.h" /* tr_sessionCountTorrents () */
+#include "torrent.h"
 #include "utils.h"
 #include "variant.h"
 
@@ -82,6 +85,14 @@ rpc_response_func (tr_session      * session    UNUSED,
   tr_variantFromBuf (setme, TR_VARIANT_FMT_JSON, evbuffer_pullup(response,-1), evbuffer_get_length(response), NULL, NULL);
 }
 
+static void
+rpc_benc_response_func (tr_session      * session    UNUSED,
+                        struct evbuffer * response,
+                        void            * setme)
+{
+  tr_variantFromBuf (setme, TR_VARIANT_FMT_BENC, evbuffer_pullup(response,-1), evbuffer_get_length(response), NULL, NULL);
+}
+
 static int
 test_session_get_and_set (void)
 {
@@ -162,11 +173,438 @@ test_session_get_and_set (void)
 ****
 ***/
 
+static tr_variant *
+getTorrentsList (tr_session * session, const char * json, tr_variant * response, int64_t * revision)
+{
+  tr_variant * args;
+  tr_variant * torrents;
+
+  tr_rpc_request_exec_json (session, json, strlen(json), rpc_response_func, response);
+
+  if (!tr_variantDictFindDict (response, TR_KEY_arguments, &args)
+      || !tr_variantDictFindInt (args, TR_KEY_revision, revision)
+      || !tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+    return NULL;
+
+  return torrents;
+}
+
+static int
+test_torrent_get_revision (void)
+{
+  char json[256];
+  int64_t id;
+  int64_t revision;
+  int64_t intVal;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * removed;
+  tr_variant * torrents;
+  tr_variant * tor_dict;
+  tr_torrent * tor;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+  id = tr_torrentId (tor);
+
+  /* the first poll gets every field */
+  torrents = getTorrentsList (session, "{\"method\":\"torrent-get\",\"arguments\":{\"revision\":0,\"fields\":[\"id\",\"name\",\"downloadLimit\"]}}", &response, &revision);
+  check (torrents != NULL);
+  check_int_eq (1, tr_variantListSize (torrents));
+  tor_dict = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFindInt (tor_dict, TR_KEY_id, &intVal));
+  check_int_eq (id, intVal);
+  check (tr_variantDictFind (tor_dict, TR_KEY_name) != NULL);
+  check (tr_variantDictFind (tor_dict, TR_KEY_downloadLimit) != NULL);
+  tr_variantFree (&response);
+
+  /* nothing has changed since then */
+  tr_snprintf (json, sizeof (json), "{\"method\":\"torrent-get\",\"arguments\":{\"revision\":%"PRId64",\"fields\":[\"id\",\"name\",\"downloadLimit\"]}}", revision);
+  torrents = getTorrentsList (session, json, &response, &revision);
+  check (torrents != NULL);
+  check_int_eq (0, tr_variantListSize (torrents));
+  tr_variantFree (&response);
+
+  /* only the changed field is sent */
+  tr_torrentSetSpeedLimit_KBps (tor, TR_DOWN, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN) + 1);
+  tr_snprintf (json, sizeof (json), "{\"method\":\"torrent-get\",\"arguments\":{\"revision\":%"PRId64",\"fields\":[\"id\",\"name\",\"downloadLimit\"]}}", revision);
+  torrents = getTorrentsList (session, json, &response, &revision);
+  check (torrents != NULL);
+  check_int_eq (1, tr_variantListSize (torrents));
+  tor_dict = tr_variantListChild (torrents, 0);
+  check (tr_variantDictFindInt (tor_dict, TR_KEY_id, &intVal));
+  check_int_eq (id, intVal);
+  check (tr_variantDictFind (tor_dict, TR_KEY_name) == NULL);
+  check (tr_variantDictFind (tor_dict, TR_KEY_downloadLimit) != NULL);
+  tr_variantFree (&response);
+
+  /* a "wait" holds the response back until something changes */
+  memset (&response, 0, sizeof (tr_variant));
+  tr_snprintf (json, sizeof (json), "{\"method\":\"torrent-get\",\"arguments\":{\"revision\":%"PRId64",\"wait\":30,\"fields\":[\"id\",\"downloadLimit\"]}}", revision);
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, &response);
+  check (!tr_variantIsDict (&response));
+  tr_torrentSetSpeedLimit_KBps (tor, TR_DOWN, tr_torrentGetSpeedLimit_KBps (tor, TR_DOWN) + 1);
+  while (!tr_variantIsDict (&response))
+    tr_wait_msec (10);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindInt (args, TR_KEY_revision, &revision));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (1, tr_variantListSize (torrents));
+  tr_variantFree (&response);
+
+  /* removed torrents are reported */
+  tr_torrentRemove (tor, false, NULL);
+  while (tr_sessionCountTorrents (session) > 0)
+    tr_wait_msec (10);
+  tr_snprintf (json, sizeof (json), "{\"method\":\"torrent-get\",\"arguments\":{\"revision\":%"PRId64",\"fields\":[\"id\"]}}", revision);
+  torrents = getTorrentsList (session, json, &response, &revision);
+  check (torrents != NULL);
+  check_int_eq (0, tr_variantListSize (torrents));
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_removed, &removed));
+  check_int_eq (1, tr_variantListSize (removed));
+  check (tr_variantGetInt (tr_variantListChild (removed, 0), &intVal));
+  check_int_eq (id, intVal);
+  tr_variantFree (&response);
+
+  /* cleanup */
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_batch (void)
+{
+  const char * str;
+  int64_t intVal;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * child;
+  tr_variant * args;
+  const char * json = "[{\"method\":\"session-get\",\"tag\":1},"
+                      "{\"method\":\"no-such-method\",\"tag\":2},"
+                      "{\"method\":\"session-set\",\"arguments\":{\"peer-limit-global\":123},\"tag\":3}]";
+
+  session = libttest_session_init (NULL);
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, &response);
+
+  /* each request gets its own response, in order */
+  check (tr_variantIsList (&response));
+  check_int_eq (3, tr_variantListSize (&response));
+  child = tr_variantListChild (&response, 0);
+  check (tr_variantDictFindInt (child, TR_KEY_tag, &intVal));
+  check_int_eq (1, intVal);
+  check (tr_variantDictFindStr (child, TR_KEY_result, &str, NULL));
+  check_streq ("success", str);
+  check (tr_variantDictFindDict (child, TR_KEY_arguments, &args));
+  check (tr_variantDictFind (args, TR_KEY_version) != NULL);
+  child = tr_variantListChild (&response, 1);
+  check (tr_variantDictFindInt (child, TR_KEY_tag, &intVal));
+  check_int_eq (2, intVal);
+  check (tr_variantDictFindStr (child, TR_KEY_result, &str, NULL));
+  check_streq ("method name not recognized", str);
+  child = tr_variantListChild (&response, 2);
+  check (tr_variantDictFindInt (child, TR_KEY_tag, &intVal));
+  check_int_eq (3, intVal);
+  check (tr_variantDictFindStr (child, TR_KEY_result, &str, NULL));
+  check_streq ("success", str);
+  check_int_eq (123, tr_sessionGetPeerLimit (session));
+  tr_variantFree (&response);
+
+  /* an empty batch gets an empty response */
+  tr_rpc_request_exec_json (session, "[]", 2, rpc_response_func, &response);
+  check (tr_variantIsList (&response));
+  check_int_eq (0, tr_variantListSize (&response));
+  tr_variantFree (&response);
+
+  /* cleanup */
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+getViewCount (tr_session * session, const char * view, tr_variant * response, int64_t * totalCount)
+{
+  char json[512];
+  tr_variant * args;
+  tr_variant * torrents;
+
+  tr_snprintf (json, sizeof (json), "{\"method\":\"torrent-get\",\"arguments\":{%s,\"fields\":[\"id\"]}}", view);
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, response);
+
+  *totalCount = -1;
+  if (!tr_variantDictFindDict (response, TR_KEY_arguments, &args)
+      || !tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+    return -1;
+
+  tr_variantDictFindInt (args, TR_KEY_totalCount, totalCount);
+  return tr_variantListSize (torrents);
+}
+
+static int
+test_torrent_get_view (void)
+{
+  int64_t total;
+  int64_t intVal;
+  const char * str;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * counts;
+  tr_torrent * tor;
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+
+  /* the test torrent is paused, and its tracker is www.example.com */
+  check_int_eq (1, getViewCount (session, "\"filter\":\"paused\",\"sort\":\"name\"", &response, &total));
+  check_int_eq (1, total);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindDict (args, TR_KEY_filterCounts, &counts));
+  check (tr_variantDictFindInt (counts, tr_quark_new ("all", 3), &intVal));
+  check_int_eq (1, intVal);
+  check (tr_variantDictFindInt (counts, tr_quark_new ("seeding", 7), &intVal));
+  check_int_eq (0, intVal);
+  tr_variantFree (&response);
+
+  check_int_eq (0, getViewCount (session, "\"filter\":\"seeding\"", &response, &total));
+  check_int_eq (0, total);
+  tr_variantFree (&response);
+
+  check_int_eq (1, getViewCount (session, "\"search\":\"ZEROES\",\"tracker\":\"example.com\"", &response, &total));
+  tr_variantFree (&response);
+
+  check_int_eq (0, getViewCount (session, "\"tracker\":\"example.org\"", &response, &total));
+  tr_variantFree (&response);
+
+  /* paging leaves the total alone */
+  check_int_eq (0, getViewCount (session, "\"offset\":1,\"limit\":10", &response, &total));
+  check_int_eq (1, total);
+  tr_variantFree (&response);
+
+  check_int_eq (0, getViewCount (session, "\"limit\":0", &response, &total));
+  check_int_eq (1, total);
+  tr_variantFree (&response);
+
+  check_int_eq (0, getViewCount (session, "\"sort\":\"bogus\"", &response, &total));
+  check (tr_variantDictFindStr (&response, TR_KEY_result, &str, NULL));
+  check_streq ("invalid sort", str);
+  tr_variantFree (&response);
+
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_torrent_get_tracker_stats (void)
+{
+  size_t len;
+  int64_t intVal;
+  const char * str;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * torrents;
+  tr_variant * stats;
+  tr_variant * st;
+  tr_torrent * tor;
+  const char * json = "{\"method\":\"torrent-get\",\"arguments\":{\"fields\":[\"trackerStats\"]}}";
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+  check_int_eq (1, tr_variantListSize (torrents));
+  check (tr_variantDictFindList (tr_variantListChild (torrents, 0), TR_KEY_trackerStats, &stats));
+  check_int_eq (tor->info.trackerCount, tr_variantListSize (stats));
+  check ((st = tr_variantListChild (stats, 0)) != NULL);
+  check (tr_variantDictFindStr (st, TR_KEY_announce, &str, &len));
+  check_streq (tor->info.trackers[0].announce, str);
+  check (tr_variantDictFindInt (st, TR_KEY_tier, &intVal));
+  check_int_eq (0, intVal);
+  check (tr_variantDictFindInt (st, TR_KEY_announceState, &intVal));
+  check_int_eq (TR_TRACKER_INACTIVE, intVal);
+  tr_variantFree (&response);
+
+  check_streq ("www.example.com", tr_announcerTrackerHost (tor, 0));
+  check (tr_announcerTrackerHost (tor, tor->info.trackerCount) == NULL);
+
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+static void
+rpc_variant_response_func (tr_session * session UNUSED,
+                           tr_variant * response,
+                           void       * setme)
+{
+  *(tr_variant*)setme = *response;
+  tr_free (response);
+}
+
+static int
+test_variant (void)
+{
+  int64_t intVal;
+  const char * str;
+  tr_session * session;
+  tr_variant request;
+  tr_variant response;
+  tr_variant * child;
+
+  session = libttest_session_init (NULL);
+
+  tr_variantInitList (&request, 2);
+  child = tr_variantListAddDict (&request, 2);
+  tr_variantDictAddStr (child, TR_KEY_method, "session-get");
+  tr_variantDictAddInt (child, TR_KEY_tag, 1);
+  child = tr_variantListAddDict (&request, 1);
+  tr_variantDictAddStr (child, TR_KEY_method, "session-stats");
+
+  tr_rpc_request_exec (session, &request, rpc_variant_response_func, &response);
+  check (tr_variantIsList (&response));
+  check_int_eq (2, tr_variantListSize (&response));
+  child = tr_variantListChild (&response, 0);
+  check (tr_variantDictFindInt (child, TR_KEY_tag, &intVal));
+  check_int_eq (1, intVal);
+  check (tr_variantDictFindStr (tr_variantListChild (&response, 1), TR_KEY_result, &str, NULL));
+  check_streq ("success", str);
+  tr_variantFree (&response);
+
+  /* the request is left alone */
+  check_int_eq (2, tr_variantListSize (&request));
+  tr_variantFree (&request);
+
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_benc (void)
+{
+  int64_t intVal;
+  const char * str;
+  tr_session * session;
+  tr_variant response;
+  tr_variant * args;
+  const char * benc = "d9:argumentsd17:peer-limit-globali77ee6:method11:session-set3:tagi5ee";
+  const char * batch = "ld6:method11:session-get3:tagi1eed6:method3:foo3:tagi2eee";
+
+  session = libttest_session_init (NULL);
+
+  tr_rpc_request_exec_benc (session, benc, strlen (benc), rpc_benc_response_func, &response);
+  check (tr_variantIsDict (&response));
+  check (tr_variantDictFindStr (&response, TR_KEY_result, &str, NULL));
+  check_streq ("success", str);
+  check (tr_variantDictFindInt (&response, TR_KEY_tag, &intVal));
+  check_int_eq (5, intVal);
+  check_int_eq (77, tr_sessionGetPeerLimit (session));
+  tr_variantFree (&response);
+
+  /* batches are bencoded lists */
+  tr_rpc_request_exec_benc (session, batch, strlen (batch), rpc_benc_response_func, &response);
+  check (tr_variantIsList (&response));
+  check_int_eq (2, tr_variantListSize (&response));
+  check (tr_variantDictFindDict (tr_variantListChild (&response, 0), TR_KEY_arguments, &args));
+  check (tr_variantDictFindInt (args, TR_KEY_peer_limit_global, &intVal));
+  check_int_eq (77, intVal);
+  check (tr_variantDictFindStr (tr_variantListChild (&response, 1), TR_KEY_result, &str, NULL));
+  check_streq ("method name not recognized", str);
+  tr_variantFree (&response);
+
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
+static tr_quark
+metricKey (const char * name)
+{
+  return tr_quark_new (name, strlen (name));
+}
+
+static int
+test_session_metrics (void)
+{
+  const char * str;
+  int64_t intVal;
+  int64_t pieces;
+  int64_t bytes;
+  tr_session * session;
+  tr_torrent * tor;
+  tr_variant response;
+  tr_variant * args;
+  tr_variant * histogram;
+  tr_variant * list;
+  const char * json = "{\"method\":\"session-metrics\"}";
+
+  session = libttest_session_init (NULL);
+  tor = libttest_zero_torrent_init (session);
+  check (tor != NULL);
+  libttest_zero_torrent_populate (tor, true);
+
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, &response);
+  check (tr_variantDictFindStr (&response, TR_KEY_result, &str, NULL));
+  check_streq ("success", str);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindInt (args, metricKey ("transmission_verify_pieces_total"), &pieces));
+  check (tr_variantDictFindInt (args, metricKey ("transmission_verify_bytes_total"), &bytes));
+  tr_variantFree (&response);
+
+  /* a verify of the populated torrent reads and hashes all of it */
+  libttest_blockingTorrentVerify (tor);
+  tr_rpc_request_exec_json (session, json, strlen (json), rpc_response_func, &response);
+  check (tr_variantDictFindDict (&response, TR_KEY_arguments, &args));
+  check (tr_variantDictFindInt (args, metricKey ("transmission_verify_pieces_total"), &intVal));
+  check_int_eq (pieces + tor->info.pieceCount, intVal);
+  check (tr_variantDictFindInt (args, metricKey ("transmission_verify_bytes_total"), &intVal));
+  check_int_eq (bytes + tor->info.totalSize, intVal);
+  check (tr_variantDictFindInt (args, metricKey ("transmission_handshakes_started_total"), &intVal));
+  check_int_eq (0, intVal);
+
+  /* histograms */
+  check (tr_variantDictFindDict (args, metricKey ("transmission_event_loop_lag_seconds"), &histogram));
+  check (tr_variantDictFindInt (histogram, metricKey ("count"), &intVal));
+  check (tr_variantDictFindInt (histogram, metricKey ("sum_usec"), &intVal));
+  check (tr_variantDictFindList (histogram, metricKey ("bounds_usec"), &list));
+  check_int_eq (8, tr_variantListSize (list));
+  check (tr_variantDictFindList (histogram, metricKey ("buckets"), &list));
+  check_int_eq (8, tr_variantListSize (list));
+  tr_variantFree (&response);
+
+  /* cleanup */
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+/***
+****
+***/
+
 int
 main (void)
 {
   const testFunc tests[] = { test_list,
-                             test_session_get_and_set };
+                             test_session_get_and_set,
+                             test_torrent_get_revision,
+                             test_torrent_get_view,
+                             test_torrent_get_tracker_stats,
+                             test_batch,
+                             test_benc,
+                             test_variant,
+                             test_session_metrics };
 
   return runTests (tests, NUM_TESTS (tests));
 }
@@ -10,33 +10,45 @@
 #include <assert.h>
 #include <ctype.h> /* isdigit */
 #include <errno.h>
-#include <stdlib.h> /* strtol */
+#include <stdlib.h> /* strtol, qsort */
 #include <string.h> /* strcmp */
 
 #include <zlib.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h> /* evutil_ascii_strcasecmp () */
 
 #include "transmission.h"
+#include "announcer.h" /* tr_announcerForeachStat () */
+#include "blocklist.h" /* tr_blocklistCompile () */
 #include "completion.h"
+#include "delete.h" /* tr_deleteGetPending () */
 #include "error.h"
 #include "fdlimit.h"
 #include "file.h"
+#include "list.h"
 #include "log.h"
+#include "metrics.h"
+#include "platform.h" /* tr_threadNew () */
 #include "platform-quota.h" /* tr_device_info_get_free_space() */
 #include "rpcimpl.h"
 #include "session.h"
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h"
 #include "variant.h"
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     15
+#define RPC_VERSION     16
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
 
+/* the longest a torrent-get "wait" may hold a response back */
+#define TORRENT_GET_MAX_WAIT_SECONDS 60
+
 #define TR_N_ELEMENTS(ary)(sizeof (ary) / sizeof (*ary))
 
 #if 0
@@ -83,28 +95,21 @@ notify (tr_session * session,
  * when the task is complete */
 struct tr_rpc_idle_data
 {
- tr_session            * session;
- tr_variant            * response;
- tr_variant            * args_out;
- tr_rpc_response_func    callback;
- void                  * callback_user_data;
+ tr_session                   * session;
+ tr_variant                   * response;
+ tr_variant                   * args_out;
+ tr_rpc_response_variant_func   callback;
+ void                         * callback_user_data;
 };
 
 static void
 tr_idle_function_done (struct tr_rpc_idle_data * data, const char * result)
 {
- struct evbuffer * buf;
-
  if (result == NULL)
    result = "success";
  tr_variantDictAddStr (data->response, TR_KEY_result, result);
 
- buf = tr_variantToBuf (data->response, TR_VARIANT_FMT_JSON_LEAN);
- (*data->callback)(data->session, buf, data->callback_user_data);
- evbuffer_free (buf);
-
- tr_variantFree (data->response);
- tr_free (data->response);
+ (*data->callback)(data->session, data->response, data->callback_user_data);
  tr_free (data);
 }
 
@@ -413,14 +418,20 @@ torrentVerify (tr_session               * session,
   int i;
   int torrentCount;
   tr_torrent ** torrents;
+  bool incremental = false;
 
   assert (idle_data == NULL);
 
+  tr_variantDictFindBool (args_in, TR_KEY_incremental, &incremental);
+
   torrents = getTorrents (session, args_in, &torrentCount);
   for (i=0; i<torrentCount; ++i)
     {
       tr_torrent * tor = torrents[i];
-      tr_torrentVerify (tor, NULL, NULL);
+      if (incremental)
+        tr_torrentVerifyIncremental (tor, NULL, NULL);
+      else
+        tr_torrentVerify (tor, NULL, NULL);
       notify (session, TR_RPC_TORRENT_CHANGED, tor);
     }
 
@@ -466,7 +477,7 @@ addFiles (const tr_torrent * tor, tr_variant * list)
       tr_variant * d = tr_variantListAddDict (list, 3);
       tr_variantDictAddInt (d, TR_KEY_bytesCompleted, files[i].bytesCompleted);
       tr_variantDictAddInt (d, TR_KEY_length, file->length);
-      tr_variantDictAddStr (d, TR_KEY_name, file->name);
+      tr_variantDictAddStrView (d, TR_KEY_name, file->name);
     }
 
   tr_torrentFilesFree (files, n);
@@ -479,7 +490,7 @@ addWebseeds (const tr_info  * info,
   unsigned int i;
 
   for (i=0; i< info->webseedCount; ++i)
-    tr_variantListAddStr (webseeds, info->webseeds[i]);
+    tr_variantListAddStrView (webseeds, info->webseeds[i]);
 }
 
 static void
@@ -492,49 +503,66 @@ addTrackers (const tr_info  * info,
     {
       const tr_tracker_info * t = &info->trackers[i];
       tr_variant * d = tr_variantListAddDict (trackers, 4);
-      tr_variantDictAddStr (d, TR_KEY_announce, t->announce);
+      tr_variantDictAddStrView (d, TR_KEY_announce, t->announce);
       tr_variantDictAddInt (d, TR_KEY_id, t->id);
-      tr_variantDictAddStr (d, TR_KEY_scrape, t->scrape);
+      tr_variantDictAddStrView (d, TR_KEY_scrape, t->scrape);
       tr_variantDictAddInt (d, TR_KEY_tier, t->tier);
     }
 }
 
 static void
-addTrackerStats (const tr_tracker_stat * st, int n, tr_variant * list)
+addTrackerStat (const tr_tracker_stat * s, void * vlist)
+{
+  tr_variant * d = tr_variantListAddDict (vlist, 26);
+  tr_variantDictAddStr  (d, TR_KEY_announce, s->announce);
+  tr_variantDictAddInt  (d, TR_KEY_announceState, s->announceState);
+  tr_variantDictAddInt  (d, TR_KEY_downloadCount, s->downloadCount);
+  tr_variantDictAddBool (d, TR_KEY_hasAnnounced, s->hasAnnounced);
+  tr_variantDictAddBool (d, TR_KEY_hasScraped, s->hasScraped);
+  tr_variantDictAddStr  (d, TR_KEY_host, s->host);
+  tr_variantDictAddInt  (d, TR_KEY_id, s->id);
+  tr_variantDictAddBool (d, TR_KEY_isBackup, s->isBackup);
+  tr_variantDictAddInt  (d, TR_KEY_lastAnnouncePeerCount, s->lastAnnouncePeerCount);
+  tr_variantDictAddStr  (d, TR_KEY_lastAnnounceResult, s->lastAnnounceResult);
+  tr_variantDictAddInt  (d, TR_KEY_lastAnnounceStartTime, s->lastAnnounceStartTime);
+  tr_variantDictAddBool (d, TR_KEY_lastAnnounceSucceeded, s->lastAnnounceSucceeded);
+  tr_variantDictAddInt  (d, TR_KEY_lastAnnounceTime, s->lastAnnounceTime);
+  tr_variantDictAddBool (d, TR_KEY_lastAnnounceTimedOut, s->lastAnnounceTimedOut);
+  tr_variantDictAddStr  (d, TR_KEY_lastScrapeResult, s->lastScrapeResult);
+  tr_variantDictAddInt  (d, TR_KEY_lastScrapeStartTime, s->lastScrapeStartTime);
+  tr_variantDictAddBool (d, TR_KEY_lastScrapeSucceeded, s->lastScrapeSucceeded);
+  tr_variantDictAddInt  (d, TR_KEY_lastScrapeTime, s->lastScrapeTime);
+  tr_variantDictAddInt  (d, TR_KEY_lastScrapeTimedOut, s->lastScrapeTimedOut);
+  tr_variantDictAddInt  (d, TR_KEY_leecherCount, s->leecherCount);
+  tr_variantDictAddInt  (d, TR_KEY_nextAnnounceTime, s->nextAnnounceTime);
+  tr_variantDictAddInt  (d, TR_KEY_nextScrapeTime, s->nextScrapeTime);
+  tr_variantDictAddStr  (d, TR_KEY_scrape, s->scrape);
+  tr_variantDictAddInt  (d, TR_KEY_scrapeState, s->scrapeState);
+  tr_variantDictAddInt  (d, TR_KEY_seederCount, s->seederCount);
+  tr_variantDictAddInt  (d, TR_KEY_tier, s->tier);
+}
+
+/* in tr_peer_stall order */
+static const tr_quark stallKeys[TR_PEER_STALL_COUNT] =
+{
+  TR_KEY_uninterested,
+  TR_KEY_choked,
+  TR_KEY_bandwidth,
+  TR_KEY_none,
+  TR_KEY_noRequests,
+  TR_KEY_outbuf,
+  TR_KEY_disk,
+  TR_KEY_peer
+};
+
+static void
+addStalls (tr_variant * d, const tr_quark key, const uint64_t * msec)
 {
   int i;
+  tr_variant * stalls = tr_variantDictAddDict (d, key, TR_PEER_STALL_COUNT);
 
-  for (i=0; i<n; ++i)
-    {
-      const tr_tracker_stat * s = &st[i];
-      tr_variant * d = tr_variantListAddDict (list, 26);
-      tr_variantDictAddStr  (d, TR_KEY_announce, s->announce);
-      tr_variantDictAddInt  (d, TR_KEY_announceState, s->announceState);
-      tr_variantDictAddInt  (d, TR_KEY_downloadCount, s->downloadCount);
-      tr_variantDictAddBool (d, TR_KEY_hasAnnounced, s->hasAnnounced);
-      tr_variantDictAddBool (d, TR_KEY_hasScraped, s->hasScraped);
-      tr_variantDictAddStr  (d, TR_KEY_host, s->host);
-      tr_variantDictAddInt  (d, TR_KEY_id, s->id);
-      tr_variantDictAddBool (d, TR_KEY_isBackup, s->isBackup);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnouncePeerCount, s->lastAnnouncePeerCount);
-      tr_variantDictAddStr  (d, TR_KEY_lastAnnounceResult, s->lastAnnounceResult);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnounceStartTime, s->lastAnnounceStartTime);
-      tr_variantDictAddBool (d, TR_KEY_lastAnnounceSucceeded, s->lastAnnounceSucceeded);
-      tr_variantDictAddInt  (d, TR_KEY_lastAnnounceTime, s->lastAnnounceTime);
-      tr_variantDictAddBool (d, TR_KEY_lastAnnounceTimedOut, s->lastAnnounceTimedOut);
-      tr_variantDictAddStr  (d, TR_KEY_lastScrapeResult, s->lastScrapeResult);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeStartTime, s->lastScrapeStartTime);
-      tr_variantDictAddBool (d, TR_KEY_lastScrapeSucceeded, s->lastScrapeSucceeded);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeTime, s->lastScrapeTime);
-      tr_variantDictAddInt  (d, TR_KEY_lastScrapeTimedOut, s->lastScrapeTimedOut);
-      tr_variantDictAddInt  (d, TR_KEY_leecherCount, s->leecherCount);
-      tr_variantDictAddInt  (d, TR_KEY_nextAnnounceTime, s->nextAnnounceTime);
-      tr_variantDictAddInt  (d, TR_KEY_nextScrapeTime, s->nextScrapeTime);
-      tr_variantDictAddStr  (d, TR_KEY_scrape, s->scrape);
-      tr_variantDictAddInt  (d, TR_KEY_scrapeState, s->scrapeState);
-      tr_variantDictAddInt  (d, TR_KEY_seederCount, s->seederCount);
-      tr_variantDictAddInt  (d, TR_KEY_tier, s->tier);
-    }
+  for (i=0; i<TR_PEER_STALL_COUNT; ++i)
+    tr_variantDictAddInt (stalls, stallKeys[i], msec[i]);
 }
 
 static void
@@ -548,10 +576,12 @@ addPeers (tr_torrent * tor, tr_variant * list)
 
   for (i=0; i<peerCount; ++i)
     {
-      tr_variant * d = tr_variantListAddDict (list, 16);
+      tr_variant * d = tr_variantListAddDict (list, 20);
       const tr_peer_stat * peer = peers + i;
+      tr_variantDictAddInt  (d, TR_KEY_id, peer->id);
       tr_variantDictAddStr  (d, TR_KEY_address, peer->addr);
       tr_variantDictAddStr  (d, TR_KEY_clientName, peer->client);
+      addStalls (d, TR_KEY_downloadStalls, peer->stallMsec[TR_DOWN]);
       tr_variantDictAddBool (d, TR_KEY_clientIsChoked, peer->clientIsChoked);
       tr_variantDictAddBool (d, TR_KEY_clientIsInterested, peer->clientIsInterested);
       tr_variantDictAddStr  (d, TR_KEY_flagStr, peer->flagStr);
@@ -566,11 +596,14 @@ addPeers (tr_torrent * tor, tr_variant * list)
       tr_variantDictAddReal (d, TR_KEY_progress, peer->progress);
       tr_variantDictAddInt  (d, TR_KEY_rateToClient, toSpeedBytes (peer->rateToClient_KBps));
       tr_variantDictAddInt  (d, TR_KEY_rateToPeer, toSpeedBytes (peer->rateToPeer_KBps));
+      addStalls (d, TR_KEY_uploadStalls, peer->stallMsec[TR_UP]);
     }
 
   tr_torrentPeersFree (peers, peerCount);
 }
 
+/* The response is serialized before control returns to the event loop,
+   so strings owned by the torrent can be referenced instead of copied. */
 static void
 addField (tr_torrent       * const tor,
           const tr_info    * const inf,
@@ -594,16 +627,24 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, tr_torrentGetPriority (tor));
         break;
 
+      case TR_KEY_cacheBytes:
+        tr_variantDictAddInt (d, key, st->cacheBytes);
+        break;
+
       case TR_KEY_comment:
-        tr_variantDictAddStr (d, key, inf->comment ? inf->comment : "");
+        tr_variantDictAddStrView (d, key, inf->comment);
         break;
 
       case TR_KEY_corruptEver:
         tr_variantDictAddInt (d, key, st->corruptEver);
         break;
 
+      case TR_KEY_cpuTime:
+        tr_variantDictAddInt (d, key, st->cpuTimeMsec);
+        break;
+
       case TR_KEY_creator:
-        tr_variantDictAddStr (d, key, inf->creator ? inf->creator : "");
+        tr_variantDictAddStrView (d, key, inf->creator);
         break;
 
       case TR_KEY_dateCreated:
@@ -614,12 +655,28 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, st->desiredAvailable);
         break;
 
+      case TR_KEY_diskReadBytes:
+        tr_variantDictAddInt (d, key, st->diskReadBytes);
+        break;
+
+      case TR_KEY_diskReadOps:
+        tr_variantDictAddInt (d, key, st->diskReadOps);
+        break;
+
+      case TR_KEY_diskWriteBytes:
+        tr_variantDictAddInt (d, key, st->diskWriteBytes);
+        break;
+
+      case TR_KEY_diskWriteOps:
+        tr_variantDictAddInt (d, key, st->diskWriteOps);
+        break;
+
       case TR_KEY_doneDate:
         tr_variantDictAddInt (d, key, st->doneDate);
         break;
 
       case TR_KEY_downloadDir:
-        tr_variantDictAddStr (d, key, tr_torrentGetDownloadDir (tor));
+        tr_variantDictAddStrView (d, key, tr_torrentGetDownloadDir (tor));
         break;
 
       case TR_KEY_downloadedEver:
@@ -634,6 +691,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddBool (d, key, tr_torrentUsesSpeedLimit (tor, TR_DOWN));
         break;
 
+      case TR_KEY_downloadStalls:
+        addStalls (d, key, st->stallMsec[TR_DOWN]);
+        break;
+
       case TR_KEY_error:
         tr_variantDictAddInt (d, key, st->error);
         break;
@@ -646,6 +707,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, st->eta);
         break;
 
+      case TR_KEY_fileOpens:
+        tr_variantDictAddInt (d, key, st->fileOpens);
+        break;
+
       case TR_KEY_files:
         addFiles (tor, tr_variantDictAddList (d, key, inf->fileCount));
         break;
@@ -655,7 +720,7 @@ addField (tr_torrent       * const tor,
         break;
 
       case TR_KEY_hashString:
-        tr_variantDictAddStr (d, key, tor->info.hashString);
+        tr_variantDictAddStrView (d, key, tor->info.hashString);
         break;
 
       case TR_KEY_haveUnchecked:
@@ -682,6 +747,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddBool (d, key, tr_torrentIsPrivate (tor));
         break;
 
+      case TR_KEY_isRelocating:
+        tr_variantDictAddBool (d, key, st->isRelocating);
+        break;
+
       case TR_KEY_isStalled:
         tr_variantDictAddBool (d, key, st->isStalled);
         break;
@@ -709,7 +778,11 @@ addField (tr_torrent       * const tor,
         break;
 
       case TR_KEY_name:
-        tr_variantDictAddStr (d, key, tr_torrentName (tor));
+        tr_variantDictAddStrView (d, key, tr_torrentName (tor));
+        break;
+
+      case TR_KEY_openFiles:
+        tr_variantDictAddInt (d, key, st->openFiles);
         break;
 
       case TR_KEY_percentDone:
@@ -753,12 +826,7 @@ addField (tr_torrent       * const tor,
       case TR_KEY_pieces:
         if (tr_torrentHasMetadata (tor))
           {
-            size_t byte_count = 0;
-            void * bytes = tr_torrentCreatePieceBitfield (tor, &byte_count);
-            char * str = tr_base64_encode (bytes, byte_count, NULL);
-            tr_variantDictAddStr (d, key, str!=NULL ? str : "");
-            tr_free (str);
-            tr_free (bytes);
+            tr_variantDictAddStr (d, key, tr_torrentGetPieceBitfieldBase64 (tor));
           }
         else
           {
@@ -803,6 +871,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddReal (d, key, st->recheckProgress);
         break;
 
+      case TR_KEY_relocateProgress:
+        tr_variantDictAddReal (d, key, st->relocateProgress);
+        break;
+
       case TR_KEY_seedIdleLimit:
         tr_variantDictAddInt (d, key, tr_torrentGetIdleLimit (tor));
         break;
@@ -819,6 +891,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, tr_torrentGetRatioMode (tor));
         break;
 
+      case TR_KEY_sequentialDownload:
+        tr_variantDictAddBool (d, key, tr_torrentIsSequentialDownload (tor));
+        break;
+
       case TR_KEY_sizeWhenDone:
         tr_variantDictAddInt (d, key, st->sizeWhenDone);
         break;
@@ -831,6 +907,18 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddInt (d, key, st->activity);
         break;
 
+      case TR_KEY_streamingPosition:
+        tr_variantDictAddInt (d, key, tr_torrentGetStreamingPosition (tor));
+        break;
+
+      case TR_KEY_streamingWindow:
+        tr_variantDictAddInt (d, key, tr_torrentGetStreamingWindow (tor));
+        break;
+
+      case TR_KEY_superSeeding:
+        tr_variantDictAddBool (d, key, tr_torrentIsSuperSeeding (tor));
+        break;
+
       case TR_KEY_secondsDownloading:
         tr_variantDictAddInt (d, key, st->secondsDownloading);
         break;
@@ -844,16 +932,11 @@ addField (tr_torrent       * const tor,
         break;
 
       case TR_KEY_trackerStats:
-        {
-          int n;
-          tr_tracker_stat * s = tr_torrentTrackers (tor, &n);
-          addTrackerStats (s, n, tr_variantDictAddList (d, key, n));
-          tr_torrentTrackersFree (s, n);
-          break;
-        }
+        tr_announcerForeachStat (tor, addTrackerStat, tr_variantDictAddList (d, key, inf->trackerCount));
+        break;
 
       case TR_KEY_torrentFile:
-        tr_variantDictAddStr (d, key, inf->torrent);
+        tr_variantDictAddStrView (d, key, inf->torrent);
         break;
 
       case TR_KEY_totalSize:
@@ -876,6 +959,10 @@ addField (tr_torrent       * const tor,
         tr_variantDictAddReal (d, key, st->ratio);
         break;
 
+      case TR_KEY_uploadStalls:
+        addStalls (d, key, st->stallMsec[TR_UP]);
+        break;
+
       case TR_KEY_wanted:
         {
           tr_file_index_t i;
@@ -885,6 +972,10 @@ addField (tr_torrent       * const tor,
           break;
         }
 
+      case TR_KEY_wastedBytes:
+        tr_variantDictAddInt (d, key, st->wastedBytes);
+        break;
+
       case TR_KEY_webseeds:
         addWebseeds (inf, tr_variantDictAddList (d, key, inf->webseedCount));
         break;
@@ -909,59 +1000,636 @@ addInfo (tr_torrent * tor, tr_variant * d, tr_variant * fields)
     {
       int i;
       const tr_info * const inf = tr_torrentInfo (tor);
-      const tr_stat * const st = tr_torrentStat ((tr_torrent*)tor);
+      const tr_stat * const st = tr_torrentStatCached ((tr_torrent*)tor);
+
+      for (i=0; i<n; ++i)
+        {
+          size_t len;
+          const char * str;
+          if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
+            addField (tor, inf, st, d, tr_quark_new (str, len));
+        }
+    }
+}
+
+/* FNV-1a over the field's benc serialization */
+static int64_t
+hashField (const tr_variant * v)
+{
+  size_t i;
+  uint64_t hash = 14695981039346656037ull;
+  struct evbuffer * buf = tr_variantToBuf (v, TR_VARIANT_FMT_BENC);
+  const size_t len = evbuffer_get_length (buf);
+  const uint8_t * walk = evbuffer_pullup (buf, -1);
+
+  for (i=0; i<len; ++i)
+    {
+      hash ^= walk[i];
+      hash *= 1099511628211ull;
+    }
+
+  evbuffer_free (buf);
+  return (int64_t) hash;
+}
+
+/**
+ * Like addInfo (), but only keep the fields whose values have changed since
+ * `since'. Each torrent remembers a hash of every field it has served and
+ * the revision in which that value last changed, so that several clients
+ * polling with different revisions all get the right subset.
+ * If `trim' is false, the unchanged fields are kept too.
+ *
+ * Returns the number of changed fields.
+ */
+static int
+addChangedInfo (tr_torrent  * tor,
+                tr_variant  * d,
+                tr_variant  * fields,
+                int64_t       since,
+                int64_t       revision,
+                bool          trim)
+{
+  int i;
+  int changed = 0;
+  const int n = tr_variantListSize (fields);
+
+  addInfo (tor, d, fields);
+
+  if (!tr_variantIsDict (&tor->rpcFieldRevisions))
+    tr_variantInitDict (&tor->rpcFieldRevisions, n);
+
+  for (i=0; i<n; ++i)
+    {
+      size_t len;
+      const char * str;
+      tr_quark key;
+      tr_variant * value;
+      tr_variant * state;
+      int64_t hash;
+      int64_t oldHash;
+      int64_t changedAt;
+
+      if (!tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
+        continue;
+
+      key = tr_quark_new (str, len);
+      if (key == TR_KEY_id || (value = tr_variantDictFind (d, key)) == NULL)
+        continue;
+
+      hash = hashField (value);
+      state = tr_variantDictFind (&tor->rpcFieldRevisions, key);
+
+      if (state != NULL
+          && tr_variantGetInt (tr_variantListChild (state, 0), &oldHash)
+          && tr_variantGetInt (tr_variantListChild (state, 1), &changedAt)
+          && oldHash == hash)
+        {
+          if (changedAt <= since)
+            {
+              if (trim)
+                tr_variantDictRemove (d, key);
+              continue;
+            }
+        }
+      else
+        {
+          tr_variantDictRemove (&tor->rpcFieldRevisions, key);
+          state = tr_variantDictAddList (&tor->rpcFieldRevisions, key, 2);
+          tr_variantListAddInt (state, hash);
+          tr_variantListAddInt (state, revision);
+        }
+
+      ++changed;
+    }
+
+  /* always identify the torrent so that clients can merge the delta */
+  if (changed > 0 && tr_variantDictFind (d, TR_KEY_id) == NULL)
+    tr_variantDictAddInt (d, TR_KEY_id, tr_torrentId (tor));
+
+  return changed;
+}
+
+/**
+ * Write the "table" format's header of field names into `header'.
+ * Fields that aren't known are left out.
+ * @return the header's keys, for addTableRow ()
+ */
+static tr_quark *
+addTableHeader (tr_variant * header, tr_variant * fields, int * setme_count)
+{
+  int i;
+  int n = 0;
+  const int fieldCount = tr_variantListSize (fields);
+  tr_quark * keys = tr_new (tr_quark, fieldCount);
+
+  for (i=0; i<fieldCount; ++i)
+    {
+      size_t len;
+      const char * str;
+      tr_quark key;
+
+      if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len) && tr_quark_lookup (str, len, &key))
+        {
+          keys[n++] = key;
+          tr_variantListAddQuark (header, key);
+        }
+    }
+
+  *setme_count = n;
+  return keys;
+}
+
+/* move the values in addInfo ()'s `d' into `row', in the header's order */
+static void
+addTableRow (tr_variant * d, tr_variant * row, const tr_quark * keys, int keyCount)
+{
+  int i;
+
+  tr_variantInitList (row, keyCount);
+
+  for (i=0; i<keyCount; ++i)
+    {
+      tr_variant * child = tr_variantListAdd (row);
+      tr_variant * value = tr_variantDictFind (d, keys[i]);
+
+      if (value != NULL)
+        {
+          *child = *value;
+          child->key = 0;
+          tr_variantInitInt (value, 0);
+        }
+    }
+
+  tr_variantFree (d);
+}
+
+/***
+****  torrent-get's "filter", "search", "tracker", "sort", "offset" and "limit"
+***/
+
+/* these match the web client's filter and sort names */
+
+enum
+{
+  FILTER_ALL,
+  FILTER_ACTIVE,
+  FILTER_DOWNLOADING,
+  FILTER_SEEDING,
+  FILTER_PAUSED,
+  FILTER_FINISHED,
+  FILTER_VERIFYING,
+  FILTER_ERROR,
+  FILTER_COUNT
+};
+
+static const char * const filterNames[FILTER_COUNT] =
+{
+  "all", "active", "downloading", "seeding", "paused", "finished", "verifying", "error"
+};
+
+struct view_item;
+
+typedef int (*view_compare_func)(const struct view_item *, const struct view_item *);
+
+struct view_item
+{
+  tr_torrent * tor;
+  const tr_stat * st;
+  view_compare_func compare; /* the same in every item; for qsort () */
+};
+
+static bool
+testFilter (int filter, const tr_stat * st)
+{
+  switch (filter)
+    {
+      case FILTER_ACTIVE:
+        return st->peersGettingFromUs > 0
+            || st->peersSendingToUs > 0
+            || st->webseedsSendingToUs > 0
+            || st->activity == TR_STATUS_CHECK;
+
+      case FILTER_DOWNLOADING:
+        return st->activity == TR_STATUS_DOWNLOAD || st->activity == TR_STATUS_DOWNLOAD_WAIT;
+
+      case FILTER_SEEDING:
+        return st->activity == TR_STATUS_SEED || st->activity == TR_STATUS_SEED_WAIT;
+
+      case FILTER_PAUSED:
+        return st->activity == TR_STATUS_STOPPED;
+
+      case FILTER_FINISHED:
+        return st->finished;
+
+      case FILTER_VERIFYING:
+        return st->activity == TR_STATUS_CHECK || st->activity == TR_STATUS_CHECK_WAIT;
+
+      case FILTER_ERROR:
+        return st->error != TR_STAT_OK;
+
+      default:
+        return true;
+    }
+}
+
+/* ASCII-only, like the rest of the RPC code's case folding */
+static bool
+containsNoCase (const char * haystack, const char * needle)
+{
+  const size_t needle_len = strlen (needle);
+
+  for (; *haystack != '\0'; ++haystack)
+    if (!evutil_ascii_strncasecmp (haystack, needle, needle_len))
+      return true;
+
+  return needle_len == 0;
+}
+
+static bool
+testTracker (const tr_torrent * tor, const char * host)
+{
+  int i;
+  const char * announce_host;
+  bool found = false;
+
+  for (i=0; !found && (announce_host = tr_announcerTrackerHost (tor, i)) != NULL; ++i)
+    found = containsNoCase (announce_host, host);
+
+  return found;
+}
+
+#define COMPARE(a, b) ((a) < (b) ? -1 : ((a) > (b) ? 1 : 0))
+
+static int
+compareById (const struct view_item * a, const struct view_item * b)
+{
+  return COMPARE (a->st->id, b->st->id);
+}
+
+static int
+compareByName (const struct view_item * a, const struct view_item * b)
+{
+  const int i = evutil_ascii_strcasecmp (tr_torrentName (a->tor), tr_torrentName (b->tor));
+  return i ? i : compareById (a, b);
+}
+
+static int
+compareByQueue (const struct view_item * a, const struct view_item * b)
+{
+  return COMPARE (a->st->queuePosition, b->st->queuePosition);
+}
+
+static int
+compareByAge (const struct view_item * a, const struct view_item * b)
+{
+  const int i = COMPARE (b->st->addedDate, a->st->addedDate);
+  return i ? i : compareByQueue (a, b);
+}
+
+static int
+compareByState (const struct view_item * a, const struct view_item * b)
+{
+  const int i = COMPARE (b->st->activity, a->st->activity);
+  return i ? i : compareByQueue (a, b);
+}
+
+static int
+compareByActivity (const struct view_item * a, const struct view_item * b)
+{
+  const float aval = a->st->pieceDownloadSpeed_KBps + a->st->pieceUploadSpeed_KBps;
+  const float bval = b->st->pieceDownloadSpeed_KBps + b->st->pieceUploadSpeed_KBps;
+  const int i = COMPARE (bval, aval);
+  return i ? i : compareByState (a, b);
+}
+
+static int
+compareByRatio (const struct view_item * a, const struct view_item * b)
+{
+  const int i = COMPARE (b->st->ratio, a->st->ratio);
+  return i ? i : compareByState (a, b);
+}
+
+static int
+compareByProgress (const struct view_item * a, const struct view_item * b)
+{
+  const int i = COMPARE (a->st->percentDone, b->st->percentDone);
+  return i ? i : compareByRatio (a, b);
+}
+
+static int
+compareBySize (const struct view_item * a, const struct view_item * b)
+{
+  const int i = COMPARE (a->tor->info.totalSize, b->tor->info.totalSize);
+  return i ? i : compareByName (a, b);
+}
+
+#undef COMPARE
+
+static const struct
+{
+  const char * name;
+  view_compare_func func;
+}
+sortMethods[] =
+{
+  { "activity",          compareByActivity },
+  { "age",               compareByAge },
+  { "id",                compareById },
+  { "name",              compareByName },
+  { "percent_completed", compareByProgress },
+  { "queue_order",       compareByQueue },
+  { "ratio",             compareByRatio },
+  { "size",              compareBySize },
+  { "state",             compareByState }
+};
+
+static int
+compareViewItems (const void * va, const void * vb)
+{
+  const struct view_item * a = va;
+
+  return (*a->compare)(a, vb);
+}
+
+/**
+ * Filter, sort and page `torrents' in place as torrent-get's arguments
+ * ask, and add "totalCount" and "filterCounts" to the response.
+ * The stats are the cached ones that the fields are read from anyway.
+ */
+static const char *
+applyTorrentView (tr_variant   * args_in,
+                  tr_variant   * args_out,
+                  tr_torrent  ** torrents,
+                  int          * torrentCount)
+{
+  int i, n;
+  int64_t offset = 0;
+  int64_t limit = -1;
+  bool reverse = false;
+  int filter = FILTER_ALL;
+  const char * search = NULL;
+  const char * tracker = NULL;
+  const char * str;
+  view_compare_func compare = NULL;
+  struct view_item * items;
+  int counts[FILTER_COUNT];
+  tr_variant * d;
+
+  if (!tr_variantDictFind (args_in, TR_KEY_filter)
+      && !tr_variantDictFind (args_in, TR_KEY_search)
+      && !tr_variantDictFind (args_in, TR_KEY_tracker)
+      && !tr_variantDictFind (args_in, TR_KEY_sort)
+      && !tr_variantDictFind (args_in, TR_KEY_offset)
+      && !tr_variantDictFind (args_in, TR_KEY_limit))
+    return NULL;
+
+  if (tr_variantDictFindStr (args_in, TR_KEY_filter, &str, NULL))
+    {
+      for (filter=0; filter<FILTER_COUNT; ++filter)
+        if (!strcmp (str, filterNames[filter]))
+          break;
+      if (filter == FILTER_COUNT)
+        return "invalid filter";
+    }
+
+  if (tr_variantDictFindStr (args_in, TR_KEY_sort, &str, NULL))
+    {
+      for (i=0, n=TR_N_ELEMENTS (sortMethods); i<n; ++i)
+        if (!strcmp (str, sortMethods[i].name))
+          compare = sortMethods[i].func;
+      if (compare == NULL)
+        return "invalid sort";
+    }
+
+  tr_variantDictFindStr (args_in, TR_KEY_search, &search, NULL);
+  tr_variantDictFindStr (args_in, TR_KEY_tracker, &tracker, NULL);
+  tr_variantDictFindBool (args_in, TR_KEY_reverse, &reverse);
+  tr_variantDictFindInt (args_in, TR_KEY_offset, &offset);
+  tr_variantDictFindInt (args_in, TR_KEY_limit, &limit);
+  if (offset < 0)
+    offset = 0;
+  if (offset > *torrentCount)
+    offset = *torrentCount;
+
+  /* the search and tracker come first, so that the filter counts
+     can tell the client what each filter would show */
+  memset (counts, 0, sizeof (counts));
+  items = tr_new (struct view_item, *torrentCount);
+  for (i=n=0; i<*torrentCount; ++i)
+    {
+      int j;
+      tr_torrent * tor = torrents[i];
+      const tr_stat * st;
+
+      if (search != NULL && *search != '\0' && !containsNoCase (tr_torrentName (tor), search))
+        continue;
+      if (tracker != NULL && *tracker != '\0' && !testTracker (tor, tracker))
+        continue;
+
+      st = tr_torrentStatCached (tor);
+      for (j=0; j<FILTER_COUNT; ++j)
+        if (testFilter (j, st))
+          ++counts[j];
+
+      if (testFilter (filter, st))
+        {
+          items[n].tor = tor;
+          items[n].st = st;
+          items[n].compare = compare;
+          ++n;
+        }
+    }
+
+  if (compare != NULL)
+    qsort (items, n, sizeof (struct view_item), compareViewItems);
+
+  tr_variantDictAddInt (args_out, TR_KEY_totalCount, n);
+  d = tr_variantDictAddDict (args_out, TR_KEY_filterCounts, FILTER_COUNT);
+  for (i=0; i<FILTER_COUNT; ++i)
+    tr_variantDictAddInt (d, tr_quark_new (filterNames[i], strlen (filterNames[i])), counts[i]);
+
+  /* copy the requested page back into `torrents' */
+  *torrentCount = 0;
+  for (i=offset; i<n && (limit < 0 || *torrentCount < limit); ++i)
+    torrents[(*torrentCount)++] = items[reverse ? n - 1 - i : i].tor;
+
+  tr_free (items);
+  return NULL;
+}
+
+static const char*
+torrentGetImpl (tr_session * session,
+                tr_variant * args_in,
+                tr_variant * args_out)
+{
+  int i;
+  int torrentCount;
+  tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
+  const char * errmsg = applyTorrentView (args_in, args_out, torrents, &torrentCount);
+  tr_variant * list = tr_variantDictAddList (args_out, TR_KEY_torrents, torrentCount);
+  tr_variant * fields;
+  const char * strVal;
+  int64_t since = 0;
+  int64_t revision = 0;
+  const bool incremental = tr_variantDictFindInt (args_in, TR_KEY_revision, &since);
+  const bool table = tr_variantDictFindStr (args_in, TR_KEY_format, &strVal, NULL) && !strcmp (strVal, "table");
+
+  if (incremental)
+    {
+      int n = 0;
+      tr_variant * d;
+      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+
+      /* torrents removed after the revision was handed out */
+      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+        {
+          int64_t intVal;
+          if (tr_variantDictFindInt (d, TR_KEY_revision, &intVal) && (intVal >= since))
+            {
+              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+              tr_variantListAddInt (removed_out, intVal);
+            }
+        }
+
+      revision = ++session->torrentGetRevision;
+      tr_variantDictAddInt (args_out, TR_KEY_revision, revision);
+    }
+  else if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active"))
+    {
+      int n = 0;
+      tr_variant * d;
+      const time_t now = tr_time ();
+      const int interval = RECENTLY_ACTIVE_SECONDS;
+      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
+        {
+          int64_t intVal;
+          if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval))
+            {
+              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+              tr_variantListAddInt (removed_out, intVal);
+            }
+        }
+    }
+
+  if (errmsg != NULL)
+    {
+      /* a bad filter or sort; send no torrents */
+    }
+  else if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
+    errmsg = "no fields specified";
+  else if (table)
+    {
+      int keyCount;
+      tr_quark * keys = addTableHeader (tr_variantListAddList (list, 0), fields, &keyCount);
+
+      /* with a revision, a changed torrent gets its whole row */
+      for (i=0; i<torrentCount; ++i)
+        {
+          tr_variant d;
+
+          if (incremental && !addChangedInfo (torrents[i], &d, fields, since, revision, false))
+            tr_variantFree (&d);
+          else if (incremental)
+            addTableRow (&d, tr_variantListAdd (list), keys, keyCount);
+          else
+            {
+              addInfo (torrents[i], &d, fields);
+              addTableRow (&d, tr_variantListAdd (list), keys, keyCount);
+            }
+        }
+
+      tr_free (keys);
+    }
+  else if (incremental)
+    {
+      for (i=0; i<torrentCount; ++i)
+        if (!addChangedInfo (torrents[i], tr_variantListAdd (list), fields, since, revision, true))
+          tr_variantListRemove (list, tr_variantListSize (list) - 1);
+    }
+  else for (i=0; i<torrentCount; ++i)
+    addInfo (torrents[i], tr_variantListAdd (list), fields);
+
+  tr_free (torrents);
+  return errmsg;
+}
+
+static bool
+torrentGetHasChanges (tr_variant * args_out)
+{
+  tr_variant * list;
+
+  /* in the "table" format, the first row is the header */
+  return (tr_variantDictFindList (args_out, TR_KEY_torrents, &list)
+           && (tr_variantListSize (list) > (tr_variantIsList (tr_variantListChild (list, 0)) ? 1 : 0)))
+      || (tr_variantDictFindList (args_out, TR_KEY_removed, &list) && (tr_variantListSize (list) > 0));
+}
+
+/* A torrent-get with both "revision" and "wait" that has nothing new
+ * to report is parked here and retried once a second until something
+ * changes, the wait runs out, or the session shuts down. */
+struct torrent_get_wait
+{
+  tr_session * session;
+  tr_variant args_in;
+  time_t deadline;
+  struct event * timer;
+  struct tr_rpc_idle_data * idle_data;
+};
 
-      for (i=0; i<n; ++i)
-        {
-          size_t len;
-          const char * str;
-          if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
-            addField (tor, inf, st, d, tr_quark_new (str, len));
-        }
+static void
+onTorrentGetWaitTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vwait)
+{
+  const char * errmsg;
+  struct torrent_get_wait * wait = vwait;
+  tr_variant * args_out = wait->idle_data->args_out;
+
+  tr_variantDictRemove (args_out, TR_KEY_torrents);
+  tr_variantDictRemove (args_out, TR_KEY_removed);
+  tr_variantDictRemove (args_out, TR_KEY_revision);
+  errmsg = torrentGetImpl (wait->session, &wait->args_in, args_out);
+
+  if ((errmsg == NULL) && !torrentGetHasChanges (args_out)
+                       && (tr_time () < wait->deadline)
+                       && !wait->session->isClosing)
+    {
+      tr_timerAdd (wait->timer, 1, 0);
+      return;
     }
+
+  tr_idle_function_done (wait->idle_data, errmsg);
+  event_free (wait->timer);
+  tr_variantFree (&wait->args_in);
+  tr_free (wait);
 }
 
 static const char*
 torrentGet (tr_session               * session,
             tr_variant               * args_in,
             tr_variant               * args_out,
-            struct tr_rpc_idle_data  * idle_data UNUSED)
+            struct tr_rpc_idle_data  * idle_data)
 {
-  int i;
-  int torrentCount;
-  tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
-  tr_variant * list = tr_variantDictAddList (args_out, TR_KEY_torrents, torrentCount);
-  tr_variant * fields;
-  const char * strVal;
-  const char * errmsg = NULL;
+  int64_t seconds;
+  const char * errmsg = torrentGetImpl (session, args_in, args_out);
 
-  assert (idle_data == NULL);
-
-  if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active"))
+  if ((errmsg == NULL) && !torrentGetHasChanges (args_out)
+                       && tr_variantDictFind (args_in, TR_KEY_revision)
+                       && tr_variantDictFindInt (args_in, TR_KEY_wait, &seconds)
+                       && (seconds > 0))
     {
-      int n = 0;
-      tr_variant * d;
-      const time_t now = tr_time ();
-      const int interval = RECENTLY_ACTIVE_SECONDS;
-      tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
-      while ((d = tr_variantListChild (&session->removedTorrents, n++)))
-        {
-          int64_t intVal;
-          if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval))
-            {
-              tr_variantDictFindInt (d, TR_KEY_id, &intVal);
-              tr_variantListAddInt (removed_out, intVal);
-            }
-        }
+      struct torrent_get_wait * wait = tr_new0 (struct torrent_get_wait, 1);
+      wait->session = session;
+      wait->deadline = tr_time () + MIN (seconds, TORRENT_GET_MAX_WAIT_SECONDS);
+      wait->idle_data = idle_data;
+      tr_variantInitDict (&wait->args_in, 0);
+      tr_variantMergeDicts (&wait->args_in, args_in);
+      wait->timer = evtimer_new (session->event_base, onTorrentGetWaitTimer, wait);
+      tr_timerAdd (wait->timer, 1, 0);
+      return NULL;
     }
 
-  if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
-    errmsg = "no fields specified";
-  else for (i=0; i<torrentCount; ++i)
-    addInfo (torrents[i], tr_variantListAdd (list), fields);
-
-  tr_free (torrents);
-  return errmsg;
+  tr_idle_function_done (idle_data, errmsg);
+  return NULL;
 }
 
 /***
@@ -1319,6 +1987,18 @@ torrentSet (tr_session               * session,
       if (tr_variantDictFindInt (args_in, TR_KEY_queuePosition, &tmp))
         tr_torrentSetQueuePosition (tor, tmp);
 
+      if (tr_variantDictFindInt (args_in, TR_KEY_streamingWindow, &tmp) && tmp >= 0)
+        tr_torrentSetStreamingWindow (tor, tmp);
+
+      if (tr_variantDictFindInt (args_in, TR_KEY_streamingPosition, &tmp) && tmp >= 0)
+        tr_torrentSetStreamingPosition (tor, tmp);
+
+      if (tr_variantDictFindBool (args_in, TR_KEY_sequentialDownload, &boolVal))
+        tr_torrentSetSequentialDownload (tor, boolVal);
+
+      if (tr_variantDictFindBool (args_in, TR_KEY_superSeeding, &boolVal))
+        tr_torrentSetSuperSeeding (tor, boolVal);
+
       if (!errmsg && tr_variantDictFindList (args_in, TR_KEY_trackerAdd, &trackers))
         errmsg = addTrackerUrls (tor, trackers);
 
@@ -1470,108 +2150,271 @@ portTest (tr_session               * session,
 ****
 ***/
 
-static void
-gotNewBlocklist (tr_session       * session,
-                 bool               did_connect UNUSED,
-                 bool               did_timeout UNUSED,
-                 long               response_code,
-                 const void       * response,
-                 size_t             response_byte_count,
-                 void             * user_data)
+struct blocklist_update
 {
+  tr_session * session;
+  struct tr_rpc_idle_data * data;
+  uint8_t * response;
+  size_t response_byte_count;
+  char * filename;
+  int rule_count;
   char result[1024];
-  struct tr_rpc_idle_data * data = user_data;
 
-  *result = '\0';
+  /* protected by getBlocklistUpdateLock () */
+  bool cancelled;
+};
+
+/* the updates whose threads are still running */
+static tr_list * blocklistUpdates = NULL;
 
-  if (response_code != 200)
+static tr_lock*
+getBlocklistUpdateLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static bool
+isBlocklistUpdateCancelled (struct blocklist_update * update)
+{
+  bool cancelled;
+
+  tr_lockLock (getBlocklistUpdateLock ());
+  cancelled = update->cancelled;
+  tr_lockUnlock (getBlocklistUpdateLock ());
+
+  return cancelled;
+}
+
+/* throw away an update that's not going to be replied to */
+static void
+freeBlocklistUpdate (struct blocklist_update * update)
+{
+  if (update->filename != NULL)
+    tr_sys_path_remove (update->filename, NULL);
+
+  tr_variantFree (update->data->response);
+  tr_free (update->data->response);
+  tr_free (update->data);
+  tr_free (update->response);
+  tr_free (update->filename);
+  tr_free (update);
+}
+
+void
+tr_rpc_blocklist_close (tr_session * session)
+{
+  bool running;
+  tr_list * l;
+
+  assert (tr_amInEventThread (session));
+
+  do
     {
-      tr_snprintf (result, sizeof (result), "gotNewBlocklist: http error %ld: %s",
-                   response_code, tr_webGetResponseStr (response_code));
-    }
-  else /* successfully fetched the blocklist... */
-    {
-      tr_sys_file_t fd;
-      int err;
-      char * filename;
-      z_stream stream;
-      const char * configDir = tr_sessionGetConfigDir (session);
-      const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-      uint8_t * buf = tr_valloc (buflen);
-      tr_error * error = NULL;
-
-      /* this is an odd Magic Number required by zlib to enable gz support.
-         See zlib's inflateInit2 () documentation for a full description */
-      const int windowBits = 15 + 32;
-
-      stream.zalloc = (alloc_func) Z_NULL;
-      stream.zfree = (free_func) Z_NULL;
-      stream.opaque = (voidpf) Z_NULL;
-      stream.next_in = (void*) response;
-      stream.avail_in = response_byte_count;
-      inflateInit2 (&stream, windowBits);
-
-      filename = tr_buildPath (configDir, "blocklist.tmp.XXXXXX", NULL);
-      fd = tr_sys_file_open_temp (filename, &error);
-      if (fd == TR_BAD_SYS_FILE)
+      tr_lockLock (getBlocklistUpdateLock ());
+      running = false;
+      for (l=blocklistUpdates; l!=NULL; l=l->next)
         {
-          tr_snprintf (result, sizeof (result), _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
-          tr_error_clear (&error);
+          struct blocklist_update * update = l->data;
+
+          if (update->session == session)
+            {
+              update->cancelled = true;
+              running = true;
+            }
         }
+      tr_lockUnlock (getBlocklistUpdateLock ());
+
+      if (running)
+        tr_wait_msec (20);
+    }
+  while (running);
+}
+
+/* back on the libevent thread: swap the new rules in and reply */
+static void
+blocklistUpdateDone (void * vupdate)
+{
+  struct blocklist_update * update = vupdate;
+
+  /* the session closed after the thread was done with it */
+  if (update->session->isClosing)
+    {
+      freeBlocklistUpdate (update);
+      return;
+    }
+
+  if (*update->result)
+    {
+      tr_logAddError ("%s", update->result);
+    }
+  else
+    {
+      update->rule_count = tr_blocklistInstallCompiled (update->session, update->filename);
+      tr_variantDictAddInt (update->data->args_out, TR_KEY_blocklist_size, update->rule_count);
+      tr_snprintf (update->result, sizeof (update->result), "success");
+    }
+
+  if (update->filename != NULL)
+    tr_sys_path_remove (update->filename, NULL);
+
+  tr_idle_function_done (update->data, update->result);
+  tr_free (update->filename);
+  tr_free (update);
+}
+
+/* Uncompressing and compiling a big list takes a while, so do it on a
+   worker thread. Peers keep being checked against the old rules until
+   blocklistUpdateDone () swaps in the new ones. */
+static void
+blocklistUpdateThreadFunc (void * vupdate)
+{
+  struct blocklist_update * update = vupdate;
+  char * result = update->result;
+  const size_t result_size = sizeof (update->result);
+  tr_sys_file_t fd;
+  int err;
+  char * filename;
+  z_stream stream;
+  const char * configDir = tr_sessionGetConfigDir (update->session);
+  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
+  uint8_t * buf = tr_valloc (buflen);
+  tr_error * error = NULL;
+  bool cancelled;
+
+  /* this is an odd Magic Number required by zlib to enable gz support.
+     See zlib's inflateInit2 () documentation for a full description */
+  const int windowBits = 15 + 32;
+
+  stream.zalloc = (alloc_func) Z_NULL;
+  stream.zfree = (free_func) Z_NULL;
+  stream.opaque = (voidpf) Z_NULL;
+  stream.next_in = (void*) update->response;
+  stream.avail_in = update->response_byte_count;
+  inflateInit2 (&stream, windowBits);
+
+  filename = tr_buildPath (configDir, "blocklist.tmp.XXXXXX", NULL);
+  fd = tr_sys_file_open_temp (filename, &error);
+  if (fd == TR_BAD_SYS_FILE)
+    {
+      tr_snprintf (result, result_size, _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
+      tr_error_clear (&error);
+    }
 
-      for (;;)
+  for (;;)
+    {
+      if (isBlocklistUpdateCancelled (update))
         {
-          stream.next_out = (void*) buf;
-          stream.avail_out = buflen;
-          err = inflate (&stream, Z_NO_FLUSH);
+          tr_snprintf (result, result_size, "%s", "session closed");
+          err = Z_STREAM_END;
+          break;
+        }
 
-          if (stream.avail_out < buflen)
-            {
-              if (!tr_sys_file_write (fd, buf, buflen - stream.avail_out, NULL, &error))
-                {
-                  tr_snprintf (result, sizeof (result), _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
-                  tr_error_clear (&error);
-                  break;
-                }
-            }
+      stream.next_out = (void*) buf;
+      stream.avail_out = buflen;
+      err = inflate (&stream, Z_NO_FLUSH);
 
-          if (err != Z_OK)
+      if (stream.avail_out < buflen)
+        {
+          if (!tr_sys_file_write (fd, buf, buflen - stream.avail_out, NULL, &error))
             {
-              if ((err != Z_STREAM_END) && (err != Z_DATA_ERROR))
-                tr_snprintf (result, sizeof (result), _("Error uncompressing blocklist: %s (%d)"), zError (err), err);
+              tr_snprintf (result, result_size, _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
+              tr_error_clear (&error);
               break;
             }
         }
 
-      inflateEnd (&stream);
+      if (err != Z_OK)
+        {
+          if ((err != Z_STREAM_END) && (err != Z_DATA_ERROR))
+            tr_snprintf (result, result_size, _("Error uncompressing blocklist: %s (%d)"), zError (err), err);
+          break;
+        }
+    }
 
-      if (err == Z_DATA_ERROR) /* couldn't inflate it... it's probably already uncompressed */
-        if (!tr_sys_file_write (fd, response, response_byte_count, NULL, &error))
-          {
-            tr_snprintf (result, sizeof (result), _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
-            tr_error_clear (&error);
-          }
+  inflateEnd (&stream);
 
-      tr_sys_file_close (fd, NULL);
+  if (err == Z_DATA_ERROR) /* couldn't inflate it... it's probably already uncompressed */
+    if (!tr_sys_file_write (fd, update->response, update->response_byte_count, NULL, &error))
+      {
+        tr_snprintf (result, result_size, _("Couldn't save file \"%1$s\": %2$s"), filename, error->message);
+        tr_error_clear (&error);
+      }
 
-      if (*result)
-        {
-          tr_logAddError ("%s", result);
-        }
-      else
-        {
-          /* feed it to the session and give the client a response */
-          const int rule_count = tr_blocklistSetContent (session, filename);
-          tr_variantDictAddInt (data->args_out, TR_KEY_blocklist_size, rule_count);
-          tr_snprintf (result, sizeof (result), "success");
-        }
+  tr_sys_file_close (fd, NULL);
+
+  if (!*result)
+    {
+      update->filename = tr_strdup_printf ("%s.bin", filename);
 
-      tr_sys_path_remove (filename, NULL);
-      tr_free (filename);
-      tr_free (buf);
+      if (tr_blocklistCompile (filename, update->filename) < 0)
+        tr_snprintf (result, result_size, "%s", _("Couldn't compile blocklist"));
     }
 
-  tr_idle_function_done (data, result);
+  tr_sys_path_remove (filename, NULL);
+  tr_free (filename);
+  tr_free (buf);
+  tr_free (update->response);
+  update->response = NULL;
+
+  /* if the session's closing, tr_rpc_blocklist_close () is waiting for us
+     and the session mustn't be touched. Otherwise, queue the reply before
+     leaving the list, so the session can't close in between */
+  tr_lockLock (getBlocklistUpdateLock ());
+  cancelled = update->cancelled;
+  if (!cancelled)
+    tr_runInEventThread (update->session, blocklistUpdateDone, update);
+  tr_list_remove_data (&blocklistUpdates, update);
+  tr_lockUnlock (getBlocklistUpdateLock ());
+
+  if (cancelled)
+    freeBlocklistUpdate (update);
+}
+
+static void
+gotNewBlocklist (tr_session       * session,
+                 bool               did_connect UNUSED,
+                 bool               did_timeout UNUSED,
+                 long               response_code,
+                 const void       * response,
+                 size_t             response_byte_count,
+                 void             * user_data)
+{
+  char result[1024];
+  struct tr_rpc_idle_data * data = user_data;
+  struct blocklist_update * update;
+
+  if (response_code != 200)
+    {
+      tr_snprintf (result, sizeof (result), "gotNewBlocklist: http error %ld: %s",
+                   response_code, tr_webGetResponseStr (response_code));
+      tr_idle_function_done (data, result);
+      return;
+    }
+
+  /* tr_rpc_blocklist_close () has already run */
+  if (session->isClosing)
+    {
+      tr_idle_function_done (data, "session closed");
+      return;
+    }
+
+  /* successfully fetched the blocklist... */
+  update = tr_new0 (struct blocklist_update, 1);
+  update->session = session;
+  update->data = data;
+  update->response = tr_memdup (response, response_byte_count);
+  update->response_byte_count = response_byte_count;
+
+  tr_lockLock (getBlocklistUpdateLock ());
+  tr_list_append (&blocklistUpdates, update);
+  tr_lockUnlock (getBlocklistUpdateLock ());
+
+  tr_threadNew (blocklistUpdateThreadFunc, update);
 }
 
 static const char*
@@ -1850,6 +2693,28 @@ sessionSet (tr_session               * session,
 
   if (tr_variantDictFindInt (args_in, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (args_in, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (args_in, TR_KEY_memory_budget_mb, &i))
+    tr_sessionSetMemoryBudget_MB (session, i);
+
+  if (tr_variantDictFindInt (args_in, TR_KEY_verify_threads, &i))
+    tr_sessionSetVerifyThreadCount (session, i);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_page_cache_bypass_enabled, &boolVal))
+    tr_sessionSetPageCacheBypassEnabled (session, boolVal);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_piece_locality_enabled, &boolVal))
+    tr_sessionSetPieceLocalityEnabled (session, boolVal);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_scrub_enabled, &boolVal))
+    tr_sessionSetScrubEnabled (session, boolVal);
+
+  if (tr_variantDictFindInt (args_in, TR_KEY_scrub_speed_limit, &i))
+    tr_sessionSetScrubSpeed_KBps (session, i);
+
+  if (tr_variantDictFindBool (args_in, TR_KEY_verify_mmap_enabled, &boolVal))
+    tr_sessionSetVerifyMmapEnabled (session, boolVal);
 
   if (tr_variantDictFindInt (args_in, TR_KEY_alt_speed_up, &i))
     tr_sessionSetAltSpeed_KBps (session, TR_UP, i);
@@ -1997,6 +2862,10 @@ sessionStats (tr_session               * session,
   tr_variant * d;
   tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
   tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+  uint64_t readCacheHits;
+  uint64_t readCacheMisses;
+  size_t deletesPending;
+  size_t deleteFilesPending;
   tr_torrent * tor = NULL;
 
   assert (idle_data == NULL);
@@ -2011,10 +2880,16 @@ sessionStats (tr_session               * session,
 
   tr_sessionGetStats (session, &currentStats);
   tr_sessionGetCumulativeStats (session, &cumulativeStats);
+  tr_sessionGetReadCacheStats (session, &readCacheHits, &readCacheMisses);
+  tr_deleteGetPending (session, &deletesPending, &deleteFilesPending);
 
   tr_variantDictAddInt  (args_out, TR_KEY_activeTorrentCount, running);
   tr_variantDictAddReal (args_out, TR_KEY_downloadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_DOWN));
+  tr_variantDictAddInt  (args_out, TR_KEY_localDataDeletesPending, deletesPending);
+  tr_variantDictAddInt  (args_out, TR_KEY_localDataFilesPending, deleteFilesPending);
   tr_variantDictAddInt  (args_out, TR_KEY_pausedTorrentCount, total - running);
+  tr_variantDictAddInt  (args_out, TR_KEY_readCacheHits, readCacheHits);
+  tr_variantDictAddInt  (args_out, TR_KEY_readCacheMisses, readCacheMisses);
   tr_variantDictAddInt  (args_out, TR_KEY_torrentCount, total);
   tr_variantDictAddReal (args_out, TR_KEY_uploadSpeed, tr_sessionGetPieceSpeed_Bps (session, TR_UP));
 
@@ -2035,6 +2910,19 @@ sessionStats (tr_session               * session,
   return NULL;
 }
 
+static const char*
+sessionMetrics (tr_session               * session,
+                tr_variant               * args_in UNUSED,
+                tr_variant               * args_out,
+                struct tr_rpc_idle_data  * idle_data UNUSED)
+{
+  assert (idle_data == NULL);
+
+  tr_metricsToVariant (session, args_out);
+
+  return NULL;
+}
+
 static const char*
 sessionGet (tr_session               * s,
             tr_variant               * args_in UNUSED,
@@ -2055,6 +2943,8 @@ sessionGet (tr_session               * s,
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled, tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url, tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb, tr_sessionGetCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb, tr_sessionGetReadCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_memory_budget_mb, tr_sessionGetMemoryBudget_MB (s));
   tr_variantDictAddInt  (d, TR_KEY_blocklist_size, tr_blocklistGetRuleCount (s));
   tr_variantDictAddStr  (d, TR_KEY_config_dir, tr_sessionGetConfigDir (s));
   tr_variantDictAddStr  (d, TR_KEY_download_dir, tr_sessionGetDownloadDir (s));
@@ -2067,6 +2957,12 @@ sessionGet (tr_session               * s,
   tr_variantDictAddBool (d, TR_KEY_incomplete_dir_enabled, tr_sessionIsIncompleteDirEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_pex_enabled, tr_sessionIsPexEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_utp_enabled, tr_sessionIsUTPEnabled (s));
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads, tr_sessionGetVerifyThreadCount (s));
+  tr_variantDictAddBool (d, TR_KEY_page_cache_bypass_enabled, tr_sessionIsPageCacheBypassEnabled (s));
+  tr_variantDictAddBool (d, TR_KEY_piece_locality_enabled, tr_sessionIsPieceLocalityEnabled (s));
+  tr_variantDictAddBool (d, TR_KEY_scrub_enabled, tr_sessionIsScrubEnabled (s));
+  tr_variantDictAddInt  (d, TR_KEY_scrub_speed_limit, tr_sessionGetScrubSpeed_KBps (s));
+  tr_variantDictAddBool (d, TR_KEY_verify_mmap_enabled, tr_sessionIsVerifyMmapEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled, tr_sessionIsDHTEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled, tr_sessionIsLPDEnabled (s));
   tr_variantDictAddInt  (d, TR_KEY_peer_port, tr_sessionGetPeerPort (s));
@@ -2164,10 +3060,11 @@ methods[] =
   { "free-space",            true,  freeSpace           },
   { "session-close",         true,  sessionClose        },
   { "session-get",           true,  sessionGet          },
+  { "session-metrics",       true,  sessionMetrics      },
   { "session-set",           true,  sessionSet          },
   { "session-stats",         true,  sessionStats        },
   { "torrent-add",           false, torrentAdd          },
-  { "torrent-get",           true,  torrentGet          },
+  { "torrent-get",           false, torrentGet          },
   { "torrent-remove",        true,  torrentRemove       },
   { "torrent-rename-path",   false, torrentRenamePath   },
   { "torrent-set",           true,  torrentSet          },
@@ -2184,19 +3081,22 @@ methods[] =
 };
 
 static void
-noop_response_callback (tr_session       * session UNUSED,
-                        struct evbuffer  * response UNUSED,
-                        void             * user_data UNUSED)
+noop_response_callback (tr_session  * session UNUSED,
+                        tr_variant  * response,
+                        void        * user_data UNUSED)
 {
+  tr_variantFree (response);
+  tr_free (response);
 }
 
 static void
-request_exec (tr_session             * session,
-              tr_variant             * request,
-              tr_rpc_response_func     callback,
-              void                   * callback_user_data)
+request_exec (tr_session                   * session,
+              tr_variant                   * request,
+              tr_rpc_response_variant_func   callback,
+              void                         * callback_user_data)
 {
   int i;
+  int64_t tag;
   const char * str;
   tr_variant * args_in = tr_variantDictFind (request, TR_KEY_arguments);
   const char * result = NULL;
@@ -2224,47 +3124,34 @@ request_exec (tr_session             * session,
   /* if we couldn't figure out which method to use, return an error */
   if (result != NULL)
     {
-      int64_t tag;
-      tr_variant response;
-      struct evbuffer * buf;
+      tr_variant * response = tr_new0 (tr_variant, 1);
 
-      tr_variantInitDict (&response, 3);
-      tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
-      tr_variantDictAddStr (&response, TR_KEY_result, result);
+      tr_variantInitDict (response, 3);
+      tr_variantDictAddDict (response, TR_KEY_arguments, 0);
+      tr_variantDictAddStr (response, TR_KEY_result, result);
       if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
-        tr_variantDictAddInt (&response, TR_KEY_tag, tag);
+        tr_variantDictAddInt (response, TR_KEY_tag, tag);
 
-      buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
-      (*callback)(session, buf, callback_user_data);
-      evbuffer_free (buf);
-
-      tr_variantFree (&response);
+      (*callback)(session, response, callback_user_data);
     }
   else if (methods[i].immediate)
     {
-      int64_t tag;
-      tr_variant response;
       tr_variant * args_out;
-      struct evbuffer * buf;
+      tr_variant * response = tr_new0 (tr_variant, 1);
 
-      tr_variantInitDict (&response, 3);
-      args_out = tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
+      tr_variantInitDict (response, 3);
+      args_out = tr_variantDictAddDict (response, TR_KEY_arguments, 0);
       result = (*methods[i].func)(session, args_in, args_out, NULL);
       if (result == NULL)
         result = "success";
-      tr_variantDictAddStr (&response, TR_KEY_result, result);
+      tr_variantDictAddStr (response, TR_KEY_result, result);
       if (tr_variantDictFindInt (request, TR_KEY_tag, &tag))
-        tr_variantDictAddInt (&response, TR_KEY_tag, tag);
-
-      buf = tr_variantToBuf (&response, TR_VARIANT_FMT_JSON_LEAN);
-      (*callback)(session, buf, callback_user_data);
-      evbuffer_free (buf);
+        tr_variantDictAddInt (response, TR_KEY_tag, tag);
 
-      tr_variantFree (&response);
+      (*callback)(session, response, callback_user_data);
     }
   else
     {
-      int64_t tag;
       struct tr_rpc_idle_data * data = tr_new0 (struct tr_rpc_idle_data, 1);
       data->session = session;
       data->response = tr_new0 (tr_variant, 1);
@@ -2278,26 +3165,198 @@ request_exec (tr_session             * session,
     }
 }
 
+/***
+****  Batches
+***/
+
+/* A list of requests is run in order in a single pass through
+ * the event loop and answered with a list of their responses.
+ * Requests that finish later, like torrent-add with a URL, hold the
+ * batch's response back until they're done. */
+struct rpc_batch
+{
+  tr_session * session;
+  int pending;
+  int n;
+  tr_variant * responses;
+  struct rpc_batch_item * items;
+  tr_rpc_response_variant_func callback;
+  void * callback_user_data;
+};
+
+struct rpc_batch_item
+{
+  struct rpc_batch * batch;
+  int pos;
+};
+
+static void
+batchUnref (struct rpc_batch * batch)
+{
+  if (--batch->pending > 0)
+    return;
+
+  (*batch->callback)(batch->session, batch->responses, batch->callback_user_data);
+
+  tr_free (batch->items);
+  tr_free (batch);
+}
+
+static void
+batchResponseFunc (tr_session  * session UNUSED,
+                   tr_variant  * response,
+                   void        * vitem)
+{
+  struct rpc_batch_item * item = vitem;
+
+  /* move the response into its slot */
+  *tr_variantListChild (item->batch->responses, item->pos) = *response;
+  tr_free (response);
+
+  batchUnref (item->batch);
+}
+
+static void
+batch_exec (tr_session                   * session,
+            tr_variant                   * requests,
+            tr_rpc_response_variant_func   callback,
+            void                         * callback_user_data)
+{
+  int i;
+  struct rpc_batch * batch = tr_new0 (struct rpc_batch, 1);
+
+  batch->session = session;
+  batch->n = tr_variantListSize (requests);
+  batch->responses = tr_new0 (tr_variant, 1);
+  batch->items = tr_new (struct rpc_batch_item, batch->n);
+  batch->callback = callback ? callback : noop_response_callback;
+  batch->callback_user_data = callback_user_data;
+
+  /* hold a reference of our own so that requests which finish
+   * right away can't send the batch before the rest have started */
+  batch->pending = batch->n + 1;
+
+  tr_variantInitList (batch->responses, batch->n);
+  for (i=0; i<batch->n; ++i)
+    {
+      tr_variantListAdd (batch->responses);
+      batch->items[i].batch = batch;
+      batch->items[i].pos = i;
+    }
+
+  for (i=0; i<batch->n; ++i)
+    request_exec (session, tr_variantListChild (requests, i),
+                  batchResponseFunc, &batch->items[i]);
+
+  batchUnref (batch);
+}
+
 void
-tr_rpc_request_exec_json (tr_session            * session,
-                          const void            * request_json,
-                          int                     request_len,
-                          tr_rpc_response_func    callback,
-                          void                  * callback_user_data)
+tr_rpc_request_exec (tr_session                   * session,
+                     tr_variant                   * request,
+                     tr_rpc_response_variant_func   callback,
+                     void                         * callback_user_data)
+{
+  if (tr_variantIsList (request))
+    batch_exec (session, request, callback, callback_user_data);
+  else
+    request_exec (session, request, callback, callback_user_data);
+}
+
+/***
+****  Serialized requests & responses
+***/
+
+struct rpc_buf_data
+{
+  tr_variant_fmt fmt;
+  tr_rpc_response_func callback;
+  void * callback_user_data;
+};
+
+static void
+bufResponseFunc (tr_session  * session,
+                 tr_variant  * response,
+                 void        * vdata)
+{
+  struct rpc_buf_data * data = vdata;
+
+  if (data->callback != NULL)
+    {
+      struct evbuffer * buf = tr_variantToBuf (response, data->fmt);
+      (*data->callback)(session, buf, data->callback_user_data);
+      evbuffer_free (buf);
+    }
+
+  tr_variantFree (response);
+  tr_free (response);
+  tr_free (data);
+}
+
+/* the response is written in `fmt', the same format as the request */
+static void
+request_exec_variant (tr_session            * session,
+                      tr_variant            * request,
+                      tr_variant_fmt          fmt,
+                      tr_rpc_response_func    callback,
+                      void                  * callback_user_data)
+{
+  struct rpc_buf_data * data = tr_new (struct rpc_buf_data, 1);
+
+  data->fmt = fmt;
+  data->callback = callback;
+  data->callback_user_data = callback_user_data;
+
+  if (tr_variantIsList (request))
+    batch_exec (session, request, bufResponseFunc, data);
+  else
+    request_exec (session, request, bufResponseFunc, data);
+}
+
+static void
+request_exec_buf (tr_session            * session,
+                  tr_variant_fmt          fmt,
+                  const void            * request,
+                  int                     request_len,
+                  tr_rpc_response_func    callback,
+                  void                  * callback_user_data)
 {
   tr_variant top;
   int have_content;
 
   if (request_len < 0)
-    request_len = strlen (request_json);
+    request_len = strlen (request);
+
+  have_content = !tr_variantFromBuf (&top, fmt, request, request_len, NULL, NULL);
 
-  have_content = !tr_variantFromJson (&top, request_json, request_len);
-  request_exec (session, have_content ? &top : NULL, callback, callback_user_data);
+  request_exec_variant (session, have_content ? &top : NULL, fmt, callback, callback_user_data);
 
   if (have_content)
     tr_variantFree (&top);
 }
 
+void
+tr_rpc_request_exec_json (tr_session            * session,
+                          const void            * request_json,
+                          int                     request_len,
+                          tr_rpc_response_func    callback,
+                          void                  * callback_user_data)
+{
+  request_exec_buf (session, TR_VARIANT_FMT_JSON_LEAN, request_json, request_len,
+                    callback, callback_user_data);
+}
+
+void
+tr_rpc_request_exec_benc (tr_session            * session,
+                          const void            * request_benc,
+                          int                     request_len,
+                          tr_rpc_response_func    callback,
+                          void                  * callback_user_data)
+{
+  request_exec_buf (session, TR_VARIANT_FMT_BENC, request_benc, request_len,
+                    callback, callback_user_data);
+}
+
 /**
  * Munge the URI into a usable form.
  *
@@ -2373,7 +3432,7 @@ tr_rpc_request_exec_uri (tr_session           * session,
       pch = next ? next + 1 : NULL;
     }
 
-  request_exec (session, &top, callback, callback_user_data);
+  request_exec_variant (session, &top, TR_VARIANT_FMT_JSON_LEAN, callback, callback_user_data);
 
   /* cleanup */
   tr_variantFree (&top);
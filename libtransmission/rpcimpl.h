@@ -26,6 +26,24 @@ struct evbuffer;
 typedef void (*tr_rpc_response_func)(tr_session      * session,
                                      struct evbuffer * response,
                                      void            * user_data);
+
+/* the response was allocated with tr_new () and now belongs to the
+   callback, which has to tr_variantFree () and tr_free () it */
+typedef void (*tr_rpc_response_variant_func)(tr_session  * session,
+                                             tr_variant  * response,
+                                             void        * user_data);
+
+/**
+ * Run a request -- or a list of them, as a batch -- without a round trip
+ * through JSON, for clients running their own session. The request still
+ * belongs to the caller. The callback may be NULL, otherwise it's called
+ * once with the response, possibly later from the libtransmission thread.
+ */
+void tr_rpc_request_exec (tr_session                   * session,
+                          tr_variant                   * request,
+                          tr_rpc_response_variant_func   callback,
+                          void                         * callback_user_data);
+
 /* http://www.json.org/ */
 void tr_rpc_request_exec_json (tr_session            * session,
                                const void            * request_json,
@@ -33,6 +51,14 @@ void tr_rpc_request_exec_json (tr_session            * session,
                                tr_rpc_response_func    callback,
                                void                  * callback_user_data);
 
+/* like tr_rpc_request_exec_json (), but the request and
+   the response are bencoded instead of JSON */
+void tr_rpc_request_exec_benc (tr_session            * session,
+                               const void            * request_benc,
+                               int                     request_len,
+                               tr_rpc_response_func    callback,
+                               void                  * callback_user_data);
+
 /* see the RPC spec's "Request URI Notation" section */
 void tr_rpc_request_exec_uri (tr_session           * session,
                               const void           * request_uri,
@@ -44,6 +70,10 @@ void tr_rpc_parse_list_str (tr_variant  * setme,
                             const char  * list_str,
                             int           list_str_len);
 
+/* tell the session's "blocklist-update" threads to give up,
+   and wait for them to exit. The session calls this when closing */
+void tr_rpc_blocklist_close (tr_session * session);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,70 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <stdio.h> /* remove () */
+#include <time.h> /* time () */
+
+#include "transmission.h"
+#include "file.h"
+#include "torrent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+static int
+test_scrub_finds_corruption (void)
+{
+  time_t deadline;
+  tr_piece_index_t p;
+  tr_sys_file_t fd;
+  char * filename;
+  tr_torrent * tor;
+  tr_session * session = libttest_session_init (NULL);
+
+  tr_sessionSetScrubEnabled (session, true);
+  tr_sessionSetScrubSpeed_KBps (session, 100000);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  check_int_eq (TR_SEED, tr_torrentGetCompleteness (tor));
+
+  /* flip a byte in the middle of the second piece behind the torrent's back */
+  filename = tr_torrentFindFile (tor, 0);
+  check (filename != NULL);
+  fd = tr_sys_file_open (filename, TR_SYS_FILE_WRITE, 0, NULL);
+  check (fd != TR_BAD_SYS_FILE);
+  check (tr_sys_file_write_at (fd, "\1", 1, tor->info.pieceSize + 100, NULL, NULL));
+  tr_sys_file_close (fd, NULL);
+  tr_free (filename);
+
+  tr_torrentStart (tor);
+
+  /* the scrub marks it as missing without stopping the torrent */
+  deadline = time (NULL) + 15;
+  while (tr_torrentPieceIsComplete (tor, 1) && time (NULL) <= deadline)
+    tr_wait_msec (50);
+
+  check (!tr_torrentPieceIsComplete (tor, 1));
+  check (tor->isRunning);
+  for (p=0; p<tor->info.pieceCount; ++p)
+    if (p != 1)
+      check (tr_torrentPieceIsComplete (tor, p));
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_scrub_finds_corruption };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
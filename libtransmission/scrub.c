@@ -0,0 +1,565 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <stdlib.h> /* free () */
+#include <string.h> /* memcmp () */
+
+#include <event2/event.h>
+
+#include "transmission.h"
+#include "cache.h" /* tr_cacheGetWriteQueueBytes () */
+#include "crypto.h" /* tr_sha1_init () */
+#include "file.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
+#include "log.h"
+#include "metrics.h"
+#include "peer-mgr.h" /* tr_peerMgrRebuildRequests () */
+#include "platform.h" /* tr_lock () */
+#include "scrub.h"
+#include "session.h"
+#include "torrent.h"
+#include "utils.h"
+
+/***
+****
+***/
+
+enum
+{
+  /* how often the libtransmission thread looks for finished batches
+     and starts new ones */
+  SCRUB_TIMER_SECS = 1,
+
+  /* a batch holds about this many seconds' worth of reading... */
+  BATCH_SECONDS = 10,
+
+  /* ...but no more than this many pieces */
+  MAX_BATCH_PIECES = 64,
+
+  READ_BUFFER_SIZE = 1024 * 128,
+
+  /* if the disk is still busy with writes after this long,
+     the worker gives up on the rest of the batch */
+  MAX_MSEC_TO_WAIT_FOR_IDLE = 10 * 1000,
+  MSEC_TO_SLEEP_WHILE_BUSY = 50,
+
+  /* how long the worker sleeps at a time when it's ahead of the speed limit */
+  MAX_MSEC_TO_SLEEP_FOR_SPEED = 100
+};
+
+struct scrub_piece
+{
+  tr_piece_index_t index;
+  uint32_t length;
+  bool skip; /* we don't have it, so there's nothing to check */
+
+  /* where the piece starts */
+  tr_file_index_t file; /* relative to the batch's firstFile */
+  uint64_t fileOffset;
+
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  /* set by the worker */
+  bool checked; /* the whole piece was read */
+  bool pass;
+};
+
+struct scrub_batch
+{
+  tr_session * session;
+  uint64_t bytesPerSecond;
+
+  /* the cache's writes to the torrent's device. found in newBatch (),
+     since the torrent's folder can change under the worker */
+  const struct write_queue * writeQueue;
+
+  /* the files that the batch's pieces touch */
+  tr_file_index_t firstFile;
+  tr_file_index_t fileCount;
+  char ** filenames; /* NULL if the file isn't there */
+  uint64_t * fileLengths;
+
+  struct scrub_piece * pieces;
+  size_t pieceCount;
+
+  /* only used by the worker until `done' is set */
+  size_t piecesDone;
+  uint64_t bytesRead;
+
+  /* these are protected by the lock */
+  tr_torrent * tor; /* NULL once tr_scrubRemove () is called */
+  bool stop;
+  bool done;
+};
+
+typedef struct tr_scrubber
+{
+  tr_session * session;
+  struct event * timer;
+
+  /* the torrent whose batch was started last, so they take turns */
+  int lastTorrentId;
+
+  /* the batch the worker is on, or NULL */
+  struct scrub_batch * batch;
+}
+tr_scrubber;
+
+static tr_lock*
+getScrubLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static void
+freeBatch (struct scrub_batch * batch)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<batch->fileCount; ++i)
+    tr_free (batch->filenames[i]);
+  tr_free (batch->filenames);
+  tr_free (batch->fileLengths);
+  tr_free (batch->pieces);
+  tr_free (batch);
+}
+
+/***
+****  The worker
+***/
+
+static bool
+isStopped (struct scrub_batch * batch)
+{
+  bool stopped;
+
+  tr_lockLock (getScrubLock ());
+  stopped = batch->stop || batch->tor == NULL;
+  tr_lockUnlock (getScrubLock ());
+
+  return stopped;
+}
+
+/**
+ * Wait for the cache's queued writes to the torrent's device to drain.
+ * @return false if the batch was stopped or the disk never went idle
+ */
+static bool
+waitForIdleDisk (struct scrub_batch * batch)
+{
+  int waited = 0;
+
+  for (;;)
+    {
+      bool stopped;
+      bool busy = false;
+
+      tr_lockLock (getScrubLock ());
+      stopped = batch->stop || batch->tor == NULL;
+      if (!stopped)
+        busy = tr_cacheGetWriteQueueBytes (batch->session->cache, batch->writeQueue) > 0;
+      tr_lockUnlock (getScrubLock ());
+
+      if (stopped)
+        return false;
+      if (!busy)
+        return true;
+      if (waited >= MAX_MSEC_TO_WAIT_FOR_IDLE)
+        return false;
+
+      tr_wait_msec (MSEC_TO_SLEEP_WHILE_BUSY);
+      waited += MSEC_TO_SLEEP_WHILE_BUSY;
+    }
+}
+
+/* sleep until the bytes read so far are within the speed limit.
+   @return false if the batch was stopped while sleeping */
+static bool
+waitForSpeedLimit (struct scrub_batch * batch, uint64_t begin)
+{
+  const uint64_t due = begin + (batch->bytesRead * 1000) / batch->bytesPerSecond;
+
+  for (;;)
+    {
+      const uint64_t now = tr_time_msec ();
+
+      if (now >= due)
+        return true;
+      if (isStopped (batch))
+        return false;
+
+      tr_wait_msec (MIN (due - now, MAX_MSEC_TO_SLEEP_FOR_SPEED));
+    }
+}
+
+static void
+checkPiece (struct scrub_batch  * batch,
+            struct scrub_piece  * piece,
+            tr_sys_file_t       * fd,
+            tr_file_index_t     * fdFile,
+            uint8_t             * buffer)
+{
+  tr_sha1_ctx_t sha = tr_sha1_init ();
+  tr_file_index_t file = piece->file;
+  uint64_t fileOffset = piece->fileOffset;
+  uint32_t left = piece->length;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  while (left > 0 && file < batch->fileCount)
+    {
+      uint64_t numRead;
+      const uint64_t leftInFile = batch->fileLengths[file] - fileOffset;
+      const uint64_t bytesThisPass = MIN (MIN (leftInFile, left), READ_BUFFER_SIZE);
+
+      if (leftInFile == 0)
+        {
+          ++file;
+          fileOffset = 0;
+          continue;
+        }
+
+      if (*fdFile != file)
+        {
+          if (*fd != TR_BAD_SYS_FILE)
+            tr_sys_file_close (*fd, NULL);
+          *fdFile = file;
+          *fd = batch->filenames[file] == NULL ? TR_BAD_SYS_FILE
+              : tr_sys_file_open (batch->filenames[file], TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+        }
+
+      if (*fd == TR_BAD_SYS_FILE
+          || !tr_sys_file_read_at (*fd, buffer, bytesThisPass, fileOffset, &numRead, NULL)
+          || numRead == 0)
+        break;
+
+      tr_sha1_update (sha, buffer, numRead);
+      tr_sys_file_drop_cache (*fd, fileOffset, numRead, NULL);
+      batch->bytesRead += numRead;
+      fileOffset += numRead;
+      left -= numRead;
+    }
+
+  /* a piece that couldn't be read is left for the peers to notice;
+     only checksum mismatches count against it */
+  piece->checked = tr_sha1_final (sha, hash) && left == 0;
+  piece->pass = piece->checked && !memcmp (hash, piece->hash, SHA_DIGEST_LENGTH);
+}
+
+static void
+scrubThreadFunc (void * vbatch)
+{
+  struct scrub_batch * batch = vbatch;
+  tr_sys_file_t fd = TR_BAD_SYS_FILE;
+  tr_file_index_t fdFile = batch->fileCount;
+  uint8_t * buffer = tr_valloc (READ_BUFFER_SIZE);
+  const uint64_t begin = tr_time_msec ();
+
+  while (batch->piecesDone < batch->pieceCount)
+    {
+      struct scrub_piece * piece = &batch->pieces[batch->piecesDone];
+
+      if (!piece->skip)
+        {
+          if (!waitForIdleDisk (batch))
+            break;
+
+          checkPiece (batch, piece, &fd, &fdFile, buffer);
+        }
+
+      ++batch->piecesDone;
+
+      if (!waitForSpeedLimit (batch, begin))
+        break;
+    }
+
+  if (fd != TR_BAD_SYS_FILE)
+    tr_sys_file_close (fd, NULL);
+  free (buffer);
+
+  /* the libtransmission thread owns the batch once this is set */
+  tr_lockLock (getScrubLock ());
+  batch->done = true;
+  tr_lockUnlock (getScrubLock ());
+}
+
+/***
+****  The libtransmission thread
+***/
+
+static bool
+isScrubbable (const tr_torrent * tor)
+{
+  return tor->isRunning
+      && !tor->isStopping
+      && !tor->isRelocating
+      && tor->verifyState == TR_VERIFY_NONE
+      && tr_torrentHasMetadata (tor)
+      && tr_torrentGetCompleteness (tor) != TR_LEECH;
+}
+
+/* the next scrubbable torrent after the last one, wrapping around */
+static tr_torrent *
+pickTorrent (tr_scrubber * s)
+{
+  tr_torrent * tor = NULL;
+  tr_torrent * first = NULL;
+
+  while ((tor = tr_torrentNext (s->session, tor)) != NULL)
+    {
+      if (!isScrubbable (tor))
+        continue;
+
+      if (tor->uniqueId > s->lastTorrentId)
+        return tor;
+
+      if (first == NULL)
+        first = tor;
+    }
+
+  return first;
+}
+
+static struct scrub_batch *
+newBatch (tr_scrubber * s, tr_torrent * tor)
+{
+  size_t i;
+  tr_file_index_t lastFile;
+  uint64_t unused;
+  tr_piece_index_t first;
+  struct scrub_batch * batch;
+  const tr_info * inf = &tor->info;
+  const uint64_t bytesPerSecond = (uint64_t)tr_sessionGetScrubSpeed_KBps (s->session) * tr_speed_K;
+  size_t n = (bytesPerSecond * BATCH_SECONDS) / inf->pieceSize;
+
+  if (!tr_torrentLoadPieceHashes (tor))
+    return NULL;
+
+  if (tor->scrubPiece >= inf->pieceCount)
+    tor->scrubPiece = 0;
+  first = tor->scrubPiece;
+
+  n = MAX (1, n);
+  n = MIN (n, MAX_BATCH_PIECES);
+  n = MIN (n, inf->pieceCount - first);
+
+  batch = tr_new0 (struct scrub_batch, 1);
+  batch->session = s->session;
+  batch->tor = tor;
+  batch->bytesPerSecond = bytesPerSecond;
+  batch->writeQueue = tr_cacheGetWriteQueue (s->session->cache, tor);
+  batch->pieceCount = n;
+  batch->pieces = tr_new0 (struct scrub_piece, n);
+
+  tr_ioFindFileLocation (tor, first, 0, &batch->firstFile, &unused);
+  tr_ioFindFileLocation (tor, first + n - 1, tr_torPieceCountBytes (tor, first + n - 1) - 1, &lastFile, &unused);
+  batch->fileCount = lastFile - batch->firstFile + 1;
+  batch->filenames = tr_new0 (char *, batch->fileCount);
+  batch->fileLengths = tr_new0 (uint64_t, batch->fileCount);
+
+  for (i=0; i<batch->fileCount; ++i)
+    {
+      const tr_file_index_t f = batch->firstFile + i;
+      batch->filenames[i] = tr_torrentFindFile (tor, f);
+      batch->fileLengths[i] = inf->files[f].length;
+    }
+
+  for (i=0; i<n; ++i)
+    {
+      tr_file_index_t f;
+      struct scrub_piece * piece = &batch->pieces[i];
+
+      piece->index = first + i;
+      piece->length = tr_torPieceCountBytes (tor, piece->index);
+      piece->skip = !tr_torrentPieceIsComplete (tor, piece->index);
+      tr_ioFindFileLocation (tor, piece->index, 0, &f, &piece->fileOffset);
+      piece->file = f - batch->firstFile;
+      memcpy (piece->hash, tr_torrentPieceHash (tor, piece->index), SHA_DIGEST_LENGTH);
+    }
+
+  return batch;
+}
+
+static void
+startBatch (tr_scrubber * s)
+{
+  tr_torrent * tor;
+
+  if ((tor = pickTorrent (s)) == NULL)
+    return;
+
+  s->lastTorrentId = tor->uniqueId;
+
+  /* blocks that are still in memory would read back as garbage, so
+     queue them to be written. the worker's waitForIdleDisk () waits for
+     them; a seed has none, and keeps its read cache either way */
+  tr_cacheQueueTorrentWrites (s->session->cache, tor);
+
+  if ((s->batch = newBatch (s, tor)) != NULL)
+    tr_threadNew (scrubThreadFunc, s->batch);
+}
+
+static void
+finishBatch (tr_scrubber * s)
+{
+  size_t i;
+  bool anyFailed = false;
+  struct scrub_batch * batch = s->batch;
+  tr_torrent * tor = batch->tor;
+
+  s->batch = NULL;
+
+  if (tor == NULL)
+    {
+      freeBatch (batch);
+      return;
+    }
+
+  tr_torrentLock (tor);
+
+  tr_metricsAdd (s->session, TR_METRIC_SCRUB_BYTES, batch->bytesRead);
+
+  for (i=0; i<batch->piecesDone; ++i)
+    {
+      const struct scrub_piece * piece = &batch->pieces[i];
+
+      /* skip pieces we didn't read, or that were lost while we did */
+      if (!piece->checked || !tr_torrentPieceIsComplete (tor, piece->index))
+        continue;
+
+      tr_metricsAdd (s->session, TR_METRIC_SCRUB_PIECES, 1);
+
+      if (!piece->pass)
+        {
+          tr_metricsAdd (s->session, TR_METRIC_SCRUB_FAILURES, 1);
+          tr_logAddTorErr (tor, _("Piece %"PRIu32" failed its background check and will be downloaded again"),
+                           piece->index);
+          tr_torrentSetHasPiece (tor, piece->index, false);
+          anyFailed = true;
+        }
+
+      tr_torrentSetPieceChecked (tor, piece->index);
+    }
+
+  tor->scrubPiece += batch->piecesDone;
+  if (tor->scrubPiece >= tor->info.pieceCount)
+    {
+      tor->scrubPiece = 0;
+      tr_logAddTorDbg (tor, "%s", "Finished a background check of the whole torrent");
+    }
+  tr_torrentSetDirty (tor);
+
+  if (anyFailed)
+    {
+      tr_torrentRecheckCompleteness (tor);
+      tr_peerMgrRebuildRequests (tor);
+    }
+
+  tr_torrentUnlock (tor);
+
+  freeBatch (batch);
+}
+
+static void
+onScrubTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vs)
+{
+  tr_scrubber * s = vs;
+
+  if (s->batch != NULL)
+    {
+      bool done;
+
+      tr_lockLock (getScrubLock ());
+      done = s->batch->done;
+      tr_lockUnlock (getScrubLock ());
+
+      if (done)
+        finishBatch (s);
+    }
+
+  if (s->batch == NULL && tr_sessionIsScrubEnabled (s->session) && !s->session->isClosing)
+    startBatch (s);
+
+  tr_timerAdd (s->timer, SCRUB_TIMER_SECS, 0);
+}
+
+void
+tr_scrubInit (tr_session * session)
+{
+  tr_scrubber * s;
+
+  assert (tr_isSession (session));
+  assert (session->scrubber == NULL);
+
+  getScrubLock (); /* create it before the worker can race us to it */
+
+  s = tr_new0 (tr_scrubber, 1);
+  s->session = session;
+  s->timer = evtimer_new (session->event_base, onScrubTimer, s);
+  tr_timerAdd (s->timer, SCRUB_TIMER_SECS, 0);
+
+  session->scrubber = s;
+}
+
+void
+tr_scrubRemove (tr_torrent * tor)
+{
+  tr_scrubber * s = tor->session->scrubber;
+
+  if (s == NULL || s->batch == NULL)
+    return;
+
+  tr_lockLock (getScrubLock ());
+  if (s->batch->tor == tor)
+    s->batch->tor = NULL;
+  tr_lockUnlock (getScrubLock ());
+}
+
+void
+tr_scrubClose (tr_session * session)
+{
+  tr_scrubber * s = session->scrubber;
+
+  if (s == NULL)
+    return;
+
+  event_free (s->timer);
+
+  if (s->batch != NULL)
+    {
+      bool done;
+
+      tr_lockLock (getScrubLock ());
+      s->batch->stop = true;
+      tr_lockUnlock (getScrubLock ());
+
+      /* the worker notices within a piece's read */
+      do
+        {
+          tr_lockLock (getScrubLock ());
+          done = s->batch->done;
+          tr_lockUnlock (getScrubLock ());
+
+          if (!done)
+            tr_wait_msec (20);
+        }
+      while (!done);
+
+      /* keep what was checked; tor->scrubPiece is saved with the torrent */
+      finishBatch (s);
+    }
+
+  session->scrubber = NULL;
+  tr_free (s);
+}
@@ -0,0 +1,46 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+#error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_SCRUB_H
+#define TR_SCRUB_H 1
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * Re-hashing seeding torrents' data in the background.
+ *
+ * Unlike tr_verifyAdd (), this doesn't stop the torrent. The
+ * libtransmission thread picks the next few pieces of one seeding
+ * torrent at a time, starting at tor->scrubPiece, and a worker thread
+ * reads and hashes them no faster than tr_sessionGetScrubSpeed_KBps ().
+ * The worker waits for the cache's queued writes to the torrent's
+ * device to drain before each piece, so the scrub only uses the disk
+ * when nothing more important does. The results are applied back in
+ * the libtransmission thread: pieces that fail are marked as missing.
+ *
+ * These must be called from the libtransmission thread.
+ */
+
+void tr_scrubInit   (tr_session * session);
+
+/** @brief stop scrubbing the torrent. Its unfinished batch is discarded */
+void tr_scrubRemove (tr_torrent * tor);
+
+void tr_scrubClose  (tr_session * session);
+
+/* @} */
+
+#endif
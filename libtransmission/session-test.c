@@ -46,4 +46,54 @@ testPeerId (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (testPeerId)
+/* the stats are cached for the rest of the second */
+static void
+waitForNextSecond (void)
+{
+  const time_t now = tr_time ();
+
+  while (tr_time () == now)
+    tr_wait_msec (50);
+}
+
+static int
+testTorrentStats (void)
+{
+  tr_stat st;
+  tr_file_index_t file = 0;
+  uint64_t generation = 0;
+  tr_session * session = libttest_session_init (NULL);
+  tr_torrent * tor = libttest_zero_torrent_init (session);
+
+  libttest_blockingTorrentVerify (tor);
+
+  /* the first call gets everything */
+  check_int_eq (1, tr_sessionGetTorrentStats (session, NULL, 1, &st, &generation));
+  check_int_eq (tr_torrentId (tor), st.id);
+  check (generation > 0);
+
+  /* a paused torrent doesn't change on its own */
+  waitForNextSecond ();
+  check_int_eq (0, tr_sessionGetTorrentStats (session, NULL, 1, &st, &generation));
+
+  tr_torrentSetFileDLs (tor, &file, 1, false);
+  waitForNextSecond ();
+  check_int_eq (1, tr_sessionGetTorrentStats (session, &tor, 1, &st, &generation));
+  check (st.sizeWhenDone < tr_torrentInfo (tor)->totalSize);
+
+  /* without a generation, it's all of them */
+  check_int_eq (1, tr_sessionGetTorrentStats (session, &tor, 1, &st, NULL));
+
+  tr_torrentRemove (tor, false, NULL);
+  libttest_session_close (session);
+  return 0;
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { testPeerId,
+                             testTorrentStats };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
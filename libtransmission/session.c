@@ -29,6 +29,10 @@
 #include "blocklist.h"
 #include "cache.h"
 #include "crypto.h"
+#include "delete.h"
+#include "dns-cache.h"
+#include "mem-budget.h"
+#include "metrics.h"
 #include "fdlimit.h"
 #include "file.h"
 #include "list.h"
@@ -39,10 +43,17 @@
 #include "platform.h" /* tr_lock, tr_getTorrentDir () */
 #include "platform-quota.h" /* tr_device_info_free() */
 #include "port-forwarding.h"
+#include "ptrarray.h"
+#include "relocate.h"
+#include "resume.h" /* tr_resumeClose () */
+#include "resume-store.h"
 #include "rpc-server.h"
+#include "rpcimpl.h" /* tr_rpc_blocklist_close () */
+#include "scrub.h"
 #include "session.h"
 #include "stats.h"
 #include "torrent.h"
+#include "torrent-magnet.h" /* tr_metadataCacheFree () */
 #include "tr-dht.h" /* tr_dhtUpkeep () */
 #include "tr-udp.h"
 #include "tr-utp.h"
@@ -54,16 +65,38 @@
 #include "version.h"
 #include "web.h"
 
+#define TR_N_ELEMENTS(ary) (sizeof (ary) / sizeof (*ary))
+
 enum
 {
 #ifdef TR_LIGHTWEIGHT
   DEFAULT_CACHE_SIZE_MB = 2,
+  DEFAULT_READ_CACHE_SIZE_MB = 0,
   DEFAULT_PREFETCH_ENABLED = false,
+  DEFAULT_VERIFY_THREADS = 1,
 #else
   DEFAULT_CACHE_SIZE_MB = 4,
+  DEFAULT_READ_CACHE_SIZE_MB = 16,
   DEFAULT_PREFETCH_ENABLED = true,
+  DEFAULT_VERIFY_THREADS = 2,
 #endif
-  SAVE_INTERVAL_SECS = 360
+  /* how long a torrent's changes can go unsaved */
+  SAVE_INTERVAL_SECS = 360,
+
+  /* the save timer visits a slice of the torrents this often,
+     so that their writes are spread across SAVE_INTERVAL_SECS */
+  SAVE_TIMER_SECS = 5,
+
+  /* the most incoming connections to take per wakeup, so that a backlog
+     of them after a restart doesn't starve the rest of the event loop */
+  MAX_ACCEPTS_PER_WAKEUP = 64,
+
+  /* the second half of startup begins once the client has loaded its
+     torrents, or after this long if it doesn't */
+  START_TIMER_SECS = 2,
+
+  /* how long the once-a-second timer can spend refilling the DH key pool */
+  DH_POOL_FILL_MSEC = 10
 };
 
 
@@ -178,14 +211,22 @@ free_incoming_peer_port (tr_session * session)
 static void
 accept_incoming_peer (evutil_socket_t fd, short what UNUSED, void * vsession)
 {
-  int clientSocket;
-  tr_port clientPort;
-  tr_address clientAddr;
+  int i;
   tr_session * session = vsession;
 
-  clientSocket = tr_netAccept (session, fd, &clientAddr, &clientPort);
-  if (clientSocket > 0)
+  /* drain the backlog instead of taking one connection per wakeup.
+     we stop at the first failure: either the queue is empty, or
+     we're turning peers away and the rest can wait */
+  for (i=0; i<MAX_ACCEPTS_PER_WAKEUP; ++i)
     {
+      int clientSocket;
+      tr_port clientPort;
+      tr_address clientAddr;
+
+      clientSocket = tr_netAccept (session, fd, &clientAddr, &clientPort);
+      if (clientSocket < 0)
+        break;
+
       tr_logAddDeep (__FILE__, __LINE__, NULL, "new incoming connection %d (%s)",
                        clientSocket, tr_peerIoAddrStr (&clientAddr, clientPort));
       tr_peerMgrAddIncoming (session->peerMgr, &clientAddr, clientPort,
@@ -312,12 +353,20 @@ tr_sessionGetDefaultSettings (tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 68);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,              DEFAULT_READ_CACHE_SIZE_MB);
+  tr_variantDictAddInt  (d, TR_KEY_memory_budget_mb,                0);
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                     true);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                     true);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
+  tr_variantDictAddBool (d, TR_KEY_page_cache_bypass_enabled,       false);
+  tr_variantDictAddBool (d, TR_KEY_piece_locality_enabled,          false);
+  tr_variantDictAddBool (d, TR_KEY_scrub_enabled,                   false);
+  tr_variantDictAddInt  (d, TR_KEY_scrub_speed_limit,               1024); /* KB/s */
+  tr_variantDictAddBool (d, TR_KEY_verify_mmap_enabled,             false);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                     false);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                    tr_getDefaultDownloadDir ());
   tr_variantDictAddInt  (d, TR_KEY_speed_limit_down,                100);
@@ -347,6 +396,7 @@ tr_sessionGetDefaultSettings (tr_variant * d)
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                     2.0);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,             false);
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,            true);
+  tr_variantDictAddBool (d, TR_KEY_resume_store_enabled,            false);
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,     false);
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,                "0.0.0.0");
   tr_variantDictAddBool (d, TR_KEY_rpc_enabled,                     false);
@@ -383,12 +433,20 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 68);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,           tr_sessionGetReadCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_memory_budget_mb,             tr_sessionGetMemoryBudget_MB (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                  s->isDHTEnabled);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                  s->isUTPEnabled);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               tr_sessionGetVerifyThreadCount (s));
+  tr_variantDictAddBool (d, TR_KEY_page_cache_bypass_enabled,    tr_sessionIsPageCacheBypassEnabled (s));
+  tr_variantDictAddBool (d, TR_KEY_piece_locality_enabled,       tr_sessionIsPieceLocalityEnabled (s));
+  tr_variantDictAddBool (d, TR_KEY_scrub_enabled,                tr_sessionIsScrubEnabled (s));
+  tr_variantDictAddInt  (d, TR_KEY_scrub_speed_limit,            tr_sessionGetScrubSpeed_KBps (s));
+  tr_variantDictAddBool (d, TR_KEY_verify_mmap_enabled,          tr_sessionIsVerifyMmapEnabled (s));
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                  s->isLPDEnabled);
   tr_variantDictAddStr  (d, TR_KEY_download_dir,                 tr_sessionGetDownloadDir (s));
   tr_variantDictAddInt  (d, TR_KEY_download_queue_size,          tr_sessionGetQueueSize (s, TR_DOWN));
@@ -419,6 +477,7 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddReal (d, TR_KEY_ratio_limit,                  s->desiredRatio);
   tr_variantDictAddBool (d, TR_KEY_ratio_limit_enabled,          s->isRatioLimited);
   tr_variantDictAddBool (d, TR_KEY_rename_partial_files,         tr_sessionIsIncompleteFileNamingEnabled (s));
+  tr_variantDictAddBool (d, TR_KEY_resume_store_enabled,         s->isResumeStoreEnabled);
   tr_variantDictAddBool (d, TR_KEY_rpc_authentication_required,  tr_sessionIsRPCPasswordEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_rpc_bind_address,             tr_sessionGetRPCBindAddress (s));
   tr_variantDictAddBool (d, TR_KEY_rpc_enabled,                  tr_sessionIsRPCEnabled (s));
@@ -542,22 +601,43 @@ tr_sessionSaveSettings (tr_session       * session,
  * Periodically save the .resume files of any torrents whose
  * status has recently changed. This prevents loss of metadata
  * in the case of a crash, unclean shutdown, clumsy user, etc.
+ *
+ * Each tick picks up where the last one left off, so that every
+ * torrent is looked at once per SAVE_INTERVAL_SECS without thousands
+ * of them being serialized at once. The files are written by
+ * resume.c's worker thread.
  */
 static void
 onSaveTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
 {
+  int n;
   tr_torrent * tor = NULL;
   tr_session * session = vsession;
+  const uint64_t started = tr_metricsNow ();
+  const int ticksPerRound = SAVE_INTERVAL_SECS / SAVE_TIMER_SECS;
 
-  if (tr_cacheFlushDone (session->cache))
-    tr_logAddError ("Error while flushing completed pieces from cache");
+  if (session->saveTimerNextId != 0)
+    tor = tr_torrentFindFromId (session, session->saveTimerNextId);
 
-  while ((tor = tr_torrentNext (session, tor)))
-    tr_torrentSave (tor);
+  if (tor == NULL)
+    {
+      /* start a new round */
+      if (tr_cacheFlushDone (session->cache))
+        tr_logAddError ("Error while flushing completed pieces from cache");
+
+      tr_statsSaveDirty (session);
+
+      tor = session->torrentList;
+    }
+
+  n = (session->torrentCount + ticksPerRound - 1) / ticksPerRound;
+  for (; tor != NULL && n > 0; tor = tor->next, --n)
+    tr_torrentSaveAsync (tor);
 
-  tr_statsSaveDirty (session);
+  session->saveTimerNextId = tor != NULL ? tor->uniqueId : 0;
 
-  tr_timerAdd (session->saveTimer, SAVE_INTERVAL_SECS, 0);
+  tr_timerAdd (session->saveTimer, SAVE_TIMER_SECS, 0);
+  tr_metricsCallbackDone (session, TR_HISTOGRAM_SAVE_TIMER, started);
 }
 
 /***
@@ -591,10 +671,16 @@ tr_sessionInit (const char  * tag,
 
   /* initialize the bare skeleton of the session object */
   session = tr_new0 (tr_session, 1);
+
+  /* the first call sets tr_time_msec ()'s starting point.
+     make it here, before there are other threads to race with */
+  session->initMsec = tr_time_msec ();
   session->udp_socket = -1;
   session->udp6_socket = -1;
   session->lock = tr_lockNew ();
   session->cache = tr_cacheNew (1024*1024*2);
+  tr_metricsInit (session);
+  tr_memBudgetInit (session);
   session->tag = tr_strdup (tag);
   session->magicNumber = SESSION_MAGIC_NUMBER;
   tr_bandwidthConstruct (&session->bandwidth, session, NULL);
@@ -625,19 +711,27 @@ tr_sessionInit (const char  * tag,
 static void turtleCheckClock (tr_session * s, struct tr_turtle_info * t);
 
 static void
-onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
+onNowTimer (evutil_socket_t foo UNUSED, short what, void * vsession)
 {
   int usec;
   const int min = 100;
   const int max = 999999;
   struct timeval tv;
-  tr_torrent * tor = NULL;
   tr_session * session = vsession;
   const time_t now = time (NULL);
+  const uint64_t started = tr_metricsNow ();
 
   assert (tr_isSession (session));
   assert (session->nowTimer != NULL);
 
+  /* anything past when we asked to be woken is time the event loop was busy.
+     the timer can fire a hair early, so that counts as no lag at all */
+  if (what & EV_TIMEOUT)
+    {
+      const uint64_t due = session->nowTimerDue;
+      tr_metricsObserve (session, TR_HISTOGRAM_EVENT_LOOP_LAG, started > due ? started - due : 0);
+    }
+
   /**
   ***  tr_session things to do once per second
   **/
@@ -649,16 +743,9 @@ onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
   if (session->turtle.isClockEnabled)
     turtleCheckClock (session, &session->turtle);
 
-  while ((tor = tr_torrentNext (session, tor)))
-    {
-      if (tor->isRunning)
-        {
-          if (tr_torrentIsSeed (tor))
-            ++tor->secondsSeeding;
-          else
-            ++tor->secondsDownloading;
-        }
-    }
+  tr_memBudgetUpdate (session);
+
+  tr_cryptoFillKeyPool (DH_POOL_FILL_MSEC);
 
   /**
   ***  Set the timer
@@ -672,10 +759,65 @@ onNowTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
   if (usec < min)
     usec = min;
   tr_timerAdd (session->nowTimer, 0, usec);
+  session->nowTimerDue = (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec + usec;
+  tr_metricsCallbackDone (session, TR_HISTOGRAM_NOW_TIMER, started);
   /* fprintf (stderr, "time %"TR_PRIuSIZE" sec, %"TR_PRIuSIZE" microsec\n", (size_t)tr_time (), (size_t)tv.tv_usec); */
 }
 
+static bool updateBlocklists (tr_session * session);
 static void loadBlocklists (tr_session * session);
+static void closeBlocklists (tr_session * session);
+static void onBlocklistsChanged (tr_session * session);
+
+static void
+sessionReady (tr_session * session)
+{
+  if (session->readyMsec == 0)
+    {
+      session->readyMsec = MAX (1, tr_time_msec () - session->initMsec);
+      tr_logAddInfo (_("Ready in %"PRIu64" ms"), session->readyMsec);
+    }
+}
+
+/**
+ * The second half of startup. tr_sessionInit () brings up the RPC server
+ * and whatever loading torrents needs, so that clients can answer queries
+ * right away; this compiles changed blocklists and brings up the rest
+ * of the network once they're loaded.
+ */
+static void
+onStartTimer (evutil_socket_t foo UNUSED, short bar UNUSED, void * vsession)
+{
+  tr_session * session = vsession;
+
+  assert (tr_isSession (session));
+
+  if (session->isStarted)
+    return;
+
+  sessionReady (session);
+
+  session->isStarted = true;
+
+  if (updateBlocklists (session))
+    {
+      closeBlocklists (session);
+      loadBlocklists (session);
+      onBlocklistsChanged (session);
+    }
+
+  tr_udpInit (session);
+
+  if (session->isLPDEnabled)
+    tr_lpdInit (session, &session->public_ipv4->addr);
+
+  if (tr_sharedTraversalIsEnabled (session->shared))
+    tr_sharedTraversalEnable (session->shared, true);
+
+  session->startedMsec = MAX (1, tr_time_msec () - session->initMsec);
+  tr_logAddInfo (_("Started DHT, LPD and port forwarding in %"PRIu64" ms"),
+                 session->startedMsec - session->readyMsec);
+}
 
 static void
 tr_sessionInitImpl (void * vdata)
@@ -708,6 +850,17 @@ tr_sessionInitImpl (void * vdata)
 
   tr_setConfigDir (session, data->configDir);
 
+  /**
+  ***  Resume store
+  **/
+
+  {
+    char * filename = tr_buildPath (session->configDir, "resume.store", NULL);
+    tr_variantDictFindBool (&settings, TR_KEY_resume_store_enabled, &session->isResumeStoreEnabled);
+    session->resumeStore = tr_resumeStoreNew (filename, session->isResumeStoreEnabled);
+    tr_free (filename);
+  }
+
   session->peerMgr = tr_peerMgrNew (session);
 
   session->shared = tr_sharedInit (session);
@@ -721,14 +874,17 @@ tr_sessionInitImpl (void * vdata)
     tr_sys_dir_create (filename, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
     tr_free (filename);
     loadBlocklists (session);
+    onBlocklistsChanged (session);
   }
 
   assert (tr_isSession (session));
 
   session->saveTimer = evtimer_new (session->event_base, onSaveTimer, session);
-  tr_timerAdd (session->saveTimer, SAVE_INTERVAL_SECS, 0);
+  tr_timerAdd (session->saveTimer, SAVE_TIMER_SECS, 0);
 
+  tr_dnsCacheInit (session);
   tr_announcerInit (session);
+  tr_scrubInit (session);
 
   /* first %s is the application name
      second %s is the version number */
@@ -738,10 +894,9 @@ tr_sessionInitImpl (void * vdata)
 
   tr_sessionSet (session, &settings);
 
-  tr_udpInit (session);
-
-  if (session->isLPDEnabled)
-    tr_lpdInit (session, &session->public_ipv4->addr);
+  /* compiling blocklists, DHT, LPD and port forwarding wait for onStartTimer () */
+  session->startTimer = evtimer_new (session->event_base, onStartTimer, session);
+  tr_timerAdd (session->startTimer, START_TIMER_SECS, 0);
 
   /* cleanup */
   tr_variantFree (&settings);
@@ -780,6 +935,22 @@ sessionSetImpl (void * vdata)
   /* misc features */
   if (tr_variantDictFindInt (settings, TR_KEY_cache_size_mb, &i))
     tr_sessionSetCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_read_cache_size_mb, &i))
+    tr_sessionSetReadCacheLimit_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_memory_budget_mb, &i))
+    tr_sessionSetMemoryBudget_MB (session, i);
+  if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+    tr_sessionSetVerifyThreadCount (session, i);
+  if (tr_variantDictFindBool (settings, TR_KEY_page_cache_bypass_enabled, &boolVal))
+    tr_sessionSetPageCacheBypassEnabled (session, boolVal);
+  if (tr_variantDictFindBool (settings, TR_KEY_piece_locality_enabled, &boolVal))
+    tr_sessionSetPieceLocalityEnabled (session, boolVal);
+  if (tr_variantDictFindBool (settings, TR_KEY_scrub_enabled, &boolVal))
+    tr_sessionSetScrubEnabled (session, boolVal);
+  if (tr_variantDictFindInt (settings, TR_KEY_scrub_speed_limit, &i))
+    tr_sessionSetScrubSpeed_KBps (session, i);
+  if (tr_variantDictFindBool (settings, TR_KEY_verify_mmap_enabled, &boolVal))
+    tr_sessionSetVerifyMmapEnabled (session, boolVal);
   if (tr_variantDictFindInt (settings, TR_KEY_peer_limit_per_torrent, &i))
     tr_sessionSetPeerLimitPerTorrent (session, i);
   if (tr_variantDictFindBool (settings, TR_KEY_pex_enabled, &boolVal))
@@ -981,6 +1152,26 @@ tr_sessionGetDownloadDir (const tr_session * session)
   return dir;
 }
 
+/* clients poll this, so the folders they ask about are kept around
+   to make use of tr_device_info's free space cache */
+static struct tr_device_info *
+getFreeSpaceDir (tr_session * session, const char * dir)
+{
+  size_t i;
+  struct tr_device_info ** slot;
+  const size_t n = TR_N_ELEMENTS (session->freeSpaceDirs);
+
+  for (i=0; i<n; ++i)
+    if (session->freeSpaceDirs[i] != NULL && !strcmp (session->freeSpaceDirs[i]->path, dir))
+      return session->freeSpaceDirs[i];
+
+  slot = &session->freeSpaceDirs[session->freeSpaceDirsNext];
+  session->freeSpaceDirsNext = (session->freeSpaceDirsNext + 1) % n;
+  tr_device_info_free (*slot);
+  *slot = tr_device_info_create (dir);
+  return *slot;
+}
+
 int64_t
 tr_sessionGetDirFreeSpace (tr_session * session, const char * dir)
 {
@@ -988,8 +1179,10 @@ tr_sessionGetDirFreeSpace (tr_session * session, const char * dir)
 
   if (!tr_strcmp0 (dir, tr_sessionGetDownloadDir (session)))
     free_space = tr_device_info_get_free_space (session->downloadDir);
-  else
+  else if (dir == NULL || *dir == '\0')
     free_space = tr_getDirFreeSpace (dir);
+  else
+    free_space = tr_device_info_get_free_space (getFreeSpaceDir (session, dir));
 
   return free_space;
 }
@@ -1165,12 +1358,23 @@ tr_sessionGetPortForwarding (const tr_session * session)
 ****
 ***/
 
+/* the torrents that use the session's limits need checking again */
+static void
+seedLimitsChanged (tr_session * session)
+{
+  tr_torrent * tor = NULL;
+
+  while ((tor = tr_torrentNext (session, tor)))
+    tr_torrentSeedLimitChanged (tor);
+}
+
 void
 tr_sessionSetRatioLimited (tr_session * session, bool isLimited)
 {
   assert (tr_isSession (session));
 
   session->isRatioLimited = isLimited;
+  seedLimitsChanged (session);
 }
 
 void
@@ -1179,6 +1383,7 @@ tr_sessionSetRatioLimit (tr_session * session, double desiredRatio)
   assert (tr_isSession (session));
 
   session->desiredRatio = desiredRatio;
+  seedLimitsChanged (session);
 }
 
 bool
@@ -1207,6 +1412,7 @@ tr_sessionSetIdleLimited (tr_session * session, bool isLimited)
   assert (tr_isSession (session));
 
   session->isIdleLimited = isLimited;
+  seedLimitsChanged (session);
 }
 
 void
@@ -1215,6 +1421,7 @@ tr_sessionSetIdleLimit (tr_session * session, uint16_t idleMinutes)
   assert (tr_isSession (session));
 
   session->idleLimitMinutes = idleMinutes;
+  seedLimitsChanged (session);
 }
 
 bool
@@ -1773,7 +1980,11 @@ compareTorrentByCur (const void * va, const void * vb)
   return 0;
 }
 
-static void closeBlocklists (tr_session *);
+static int
+deadlineReached (const time_t deadline)
+{
+  return time (NULL) >= deadline;
+}
 
 static void
 sessionCloseImpl (void * vsession)
@@ -1800,6 +2011,13 @@ sessionCloseImpl (void * vsession)
   event_free (session->nowTimer);
   session->nowTimer = NULL;
 
+  tr_cryptoFreeKeyPool ();
+
+  event_free (session->startTimer);
+  session->startTimer = NULL;
+
+  tr_scrubClose (session);
+  tr_relocateClose (session);
   tr_verifyClose (session);
   tr_sharedClose (session);
   tr_rpcClose (&session->rpcServer);
@@ -1813,6 +2031,17 @@ sessionCloseImpl (void * vsession)
     tr_torrentFree (torrents[i]);
   tr_free (torrents);
 
+  /* finish writing the resume files that the save timer queued */
+  tr_resumeClose (session);
+  tr_resumeStoreFree (session->resumeStore);
+  session->resumeStore = NULL;
+
+  /* finish deleting the data of torrents removed with tr_torrentRemove () */
+  tr_deleteClose (session);
+
+  /* don't let a blocklist update finish into a session that's gone */
+  tr_rpc_blocklist_close (session);
+
   /* Close the announcer *after* closing the torrents
      so that all the &event=stopped messages will be
      queued to be sent by tr_announcerClose () */
@@ -1827,7 +2056,7 @@ sessionCloseImpl (void * vsession)
 
   /* gotta keep udp running long enough to send out all
      the &event=stopped UDP tracker messages */
-  while (!tr_tracker_udp_is_idle (session))
+  while (!tr_tracker_udp_is_idle (session) && !deadlineReached (session->closeDeadline))
     {
       tr_tracker_udp_upkeep (session);
       tr_wait_msec (100);
@@ -1841,6 +2070,7 @@ sessionCloseImpl (void * vsession)
 
   tr_statsClose (session);
   tr_peerMgrFree (session->peerMgr);
+  tr_metadataCacheFree (session);
 
   closeBlocklists (session);
 
@@ -1849,21 +2079,18 @@ sessionCloseImpl (void * vsession)
   session->isClosed = true;
 }
 
-static int
-deadlineReached (const time_t deadline)
-{
-  return time (NULL) >= deadline;
-}
-
 #define SHUTDOWN_MAX_SECONDS 20
 
 void
 tr_sessionClose (tr_session * session)
 {
+  size_t i;
   const time_t deadline = time (NULL) + SHUTDOWN_MAX_SECONDS;
 
   assert (tr_isSession (session));
 
+  session->closeDeadline = deadline;
+
   dbgmsg ("shutting down transmission session %p... now is %"TR_PRIuSIZE", deadline is %"TR_PRIuSIZE, (void*)session, (size_t)time (NULL), (size_t)deadline);
 
   /* close the session */
@@ -1886,8 +2113,12 @@ tr_sessionClose (tr_session * session)
       tr_wait_msec (50);
     }
 
+  tr_sharedAbandon (session);
   tr_webClose (session, TR_WEB_CLOSE_NOW);
 
+  /* nothing else uses the DNS cache once web and UDP trackers are closed */
+  tr_dnsCacheClose (session);
+
   /* close the libtransmission thread */
   tr_eventClose (session);
   while (session->events != NULL)
@@ -1915,12 +2146,20 @@ tr_sessionClose (tr_session * session)
   tr_bandwidthDestruct (&session->bandwidth);
   tr_bitfieldDestruct (&session->turtle.minutes);
   tr_lockFree (session->lock);
+  tr_free (session->torrentIndex.byId);
+  tr_free (session->torrentIndex.byHash);
+  tr_free (session->torrentIndex.byObfuscatedHash);
+  tr_free (session->queue);
+  tr_metricsClose (session);
+  tr_memBudgetClose (session);
   if (session->metainfoLookup)
     {
       tr_variantFree (session->metainfoLookup);
       tr_free (session->metainfoLookup);
     }
   tr_device_info_free (session->downloadDir);
+  for (i=0; i<TR_N_ELEMENTS (session->freeSpaceDirs); ++i)
+    tr_device_info_free (session->freeSpaceDirs[i]);
   tr_free (session->torrentDoneScript);
   tr_free (session->tag);
   tr_free (session->configDir);
@@ -1941,6 +2180,73 @@ struct sessionLoadTorrentsData
   bool done;
 };
 
+/* Reading thousands of .torrent files one after another leaves the
+ * event thread waiting on the disk most of the time at startup, so a
+ * few worker threads read them into memory ahead of it. Parsing still
+ * happens on the event thread, since the quark table isn't locked. */
+
+enum
+{
+  TORRENT_LOADER_THREADS = 4,
+
+  /* how many files the workers may read ahead of the event thread */
+  TORRENT_LOADER_LOOKAHEAD = 64
+};
+
+struct torrent_file
+{
+  char * path;
+  uint8_t * contents;
+  size_t len;
+  bool isRead;
+};
+
+struct torrent_loader
+{
+  struct torrent_file * files;
+  int fileCount;
+  int nextFile;
+  int consumed;
+  int threadCount;
+  tr_lock * lock;
+};
+
+static void
+torrentLoaderThreadFunc (void * vloader)
+{
+  struct torrent_loader * loader = vloader;
+
+  tr_lockLock (loader->lock);
+
+  while (loader->nextFile < loader->fileCount)
+    {
+      size_t len;
+      uint8_t * contents;
+      const int i = loader->nextFile;
+
+      if (i >= loader->consumed + TORRENT_LOADER_LOOKAHEAD)
+        {
+          tr_lockUnlock (loader->lock);
+          tr_wait_msec (10);
+          tr_lockLock (loader->lock);
+          continue;
+        }
+
+      ++loader->nextFile;
+      tr_lockUnlock (loader->lock);
+
+      contents = tr_loadFile (loader->files[i].path, &len);
+
+      tr_lockLock (loader->lock);
+      loader->files[i].contents = contents;
+      loader->files[i].len = contents != NULL ? len : 0;
+      loader->files[i].isRead = true;
+    }
+
+  --loader->threadCount;
+  tr_lockUnlock (loader->lock);
+}
+
 static void
 sessionLoadTorrents (void * vdata)
 {
@@ -1950,6 +2256,8 @@ sessionLoadTorrents (void * vdata)
   tr_sys_dir_t odir = NULL;
   tr_list * l = NULL;
   tr_list * list = NULL;
+  tr_ptrArray paths = TR_PTR_ARRAY_INIT;
+  struct torrent_loader loader;
   struct sessionLoadTorrentsData * data = vdata;
   const char * dirname = tr_getTorrentDir (data->session);
 
@@ -1963,22 +2271,64 @@ sessionLoadTorrents (void * vdata)
     {
       const char * name;
       while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+        if (tr_str_has_suffix (name, ".torrent"))
+          tr_ptrArrayAppend (&paths, tr_buildPath (dirname, name, NULL));
+      tr_sys_dir_close (odir, NULL);
+    }
+
+  memset (&loader, 0, sizeof (loader));
+  loader.fileCount = tr_ptrArraySize (&paths);
+  loader.files = tr_new0 (struct torrent_file, loader.fileCount);
+  for (i=0; i<loader.fileCount; ++i)
+    loader.files[i].path = tr_ptrArrayNth (&paths, i);
+  loader.lock = tr_lockNew ();
+
+  loader.threadCount = MIN (TORRENT_LOADER_THREADS, loader.fileCount);
+  for (i=0; i<loader.threadCount; ++i)
+    tr_threadNew (torrentLoaderThreadFunc, &loader);
+
+  for (i=0; i<loader.fileCount; ++i)
+    {
+      tr_torrent * tor;
+      struct torrent_file * file = &loader.files[i];
+
+      tr_lockLock (loader.lock);
+      while (!file->isRead)
         {
-          if (tr_str_has_suffix (name, ".torrent"))
-            {
-              tr_torrent * tor;
-              char * path = tr_buildPath (dirname, name, NULL);
-              tr_ctorSetMetainfoFromFile (data->ctor, path);
-              if ((tor = tr_torrentNew (data->ctor, NULL, NULL)))
-                {
-                  tr_list_prepend (&list, tor);
-                  ++n;
-                }
-              tr_free (path);
-            }
+          tr_lockUnlock (loader.lock);
+          tr_wait_msec (1);
+          tr_lockLock (loader.lock);
         }
-      tr_sys_dir_close (odir, NULL);
+      tr_lockUnlock (loader.lock);
+
+      tr_ctorSetMetainfoFromFileContents (data->ctor, file->path, file->contents, file->len);
+      if ((tor = tr_torrentNew (data->ctor, NULL, NULL)))
+        {
+          tr_list_prepend (&list, tor);
+          ++n;
+        }
+
+      tr_free (file->contents);
+      tr_free (file->path);
+
+      tr_lockLock (loader.lock);
+      ++loader.consumed;
+      tr_lockUnlock (loader.lock);
+    }
+
+  /* wait for the workers to notice there's nothing left */
+  tr_lockLock (loader.lock);
+  while (loader.threadCount > 0)
+    {
+      tr_lockUnlock (loader.lock);
+      tr_wait_msec (1);
+      tr_lockLock (loader.lock);
     }
+  tr_lockUnlock (loader.lock);
+
+  tr_lockFree (loader.lock);
+  tr_free (loader.files);
+  tr_ptrArrayDestruct (&paths, NULL);
 
   data->torrents = tr_new (tr_torrent *, n);
   for (i=0, l=list; l!=NULL; l=l->next)
@@ -1993,6 +2343,11 @@ sessionLoadTorrents (void * vdata)
   if (data->setmeCount)
     *data->setmeCount = n;
 
+  /* now that they're loaded, bring up the rest of the network */
+  sessionReady (data->session);
+  if (!data->session->isStarted)
+    tr_timerAdd (data->session->startTimer, 0, 0);
+
   data->done = true;
 }
 
@@ -2057,6 +2412,13 @@ toggleDHTImpl (void * data)
   tr_session * session = data;
   assert (tr_isSession (session));
 
+  /* before onStartTimer (), there's nothing to restart yet */
+  if (!session->isStarted)
+    {
+      session->isDHTEnabled = !session->isDHTEnabled;
+      return;
+    }
+
   tr_udpUninit (session);
   session->isDHTEnabled = !session->isDHTEnabled;
   tr_udpInit (session);
@@ -2123,12 +2485,12 @@ toggleLPDImpl (void * data)
   tr_session * session = data;
   assert (tr_isSession (session));
 
-  if (session->isLPDEnabled)
+  if (session->isLPDEnabled && session->isStarted)
     tr_lpdUninit (session);
 
   session->isLPDEnabled = !session->isLPDEnabled;
 
-  if (session->isLPDEnabled)
+  if (session->isLPDEnabled && session->isStarted)
     tr_lpdInit (session, &session->public_ipv4->addr);
 }
 
@@ -2176,6 +2538,153 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
   return toMemMB (tr_cacheGetLimit (session->cache));
 }
 
+void
+tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb)
+{
+  assert (tr_isSession (session));
+
+  tr_cacheSetReadLimit (session->cache, toMemBytes (MAX (0, mb)));
+}
+
+int
+tr_sessionGetReadCacheLimit_MB (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return toMemMB (tr_cacheGetReadLimit (session->cache));
+}
+
+void
+tr_sessionSetMemoryBudget_MB (tr_session * session, int mb)
+{
+  assert (tr_isSession (session));
+
+  tr_memBudgetSetLimit (session, toMemBytes (MAX (0, mb)));
+}
+
+int
+tr_sessionGetMemoryBudget_MB (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return toMemMB (tr_memBudgetGetLimit (session));
+}
+
+void
+tr_sessionGetReadCacheStats (const tr_session * session,
+                             uint64_t         * hits,
+                             uint64_t         * misses)
+{
+  assert (tr_isSession (session));
+
+  tr_cacheGetReadStats (session->cache, hits, misses);
+}
+
+void
+tr_sessionSetVerifyThreadCount (tr_session * session, int count)
+{
+  assert (tr_isSession (session));
+
+  session->verifyThreadCount = MAX (1, count);
+}
+
+int
+tr_sessionGetVerifyThreadCount (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->verifyThreadCount;
+}
+
+void
+tr_sessionSetPageCacheBypassEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isPageCacheBypassEnabled = enabled;
+}
+
+bool
+tr_sessionIsPageCacheBypassEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isPageCacheBypassEnabled;
+}
+
+void
+tr_sessionSetPieceLocalityEnabled (tr_session * session, bool enabled)
+{
+  tr_torrent * tor = NULL;
+
+  assert (tr_isSession (session));
+
+  if (session->isPieceLocalityEnabled == enabled)
+    return;
+
+  session->isPieceLocalityEnabled = enabled;
+
+  /* the pieces' order has changed */
+  while ((tor = tr_torrentNext (session, tor)))
+    tr_peerMgrRebuildRequests (tor);
+}
+
+bool
+tr_sessionIsPieceLocalityEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isPieceLocalityEnabled;
+}
+
+void
+tr_sessionSetScrubEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isScrubEnabled = enabled;
+}
+
+bool
+tr_sessionIsScrubEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isScrubEnabled;
+}
+
+void
+tr_sessionSetScrubSpeed_KBps (tr_session * session, unsigned int KBps)
+{
+  assert (tr_isSession (session));
+
+  session->scrubSpeed_KBps = MAX (1, KBps);
+}
+
+unsigned int
+tr_sessionGetScrubSpeed_KBps (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->scrubSpeed_KBps;
+}
+
+void
+tr_sessionSetVerifyMmapEnabled (tr_session * session, bool enabled)
+{
+  assert (tr_isSession (session));
+
+  session->isVerifyMmapEnabled = enabled;
+}
+
+bool
+tr_sessionIsVerifyMmapEnabled (const tr_session * session)
+{
+  assert (tr_isSession (session));
+
+  return session->isVerifyMmapEnabled;
+}
+
 /***
 ****
 ***/
@@ -2225,97 +2734,111 @@ tr_stringEndsWith (const char * str, const char * end)
   return slen >= elen && !memcmp (&str[slen - elen], end, elen);
 }
 
-static void
-loadBlocklists (tr_session * session)
+/**
+ * Compile the blocklists that are new or have changed since their .bin
+ * was made. This can take a while for a big list, so it's done in the
+ * second half of startup; until then, the old .bin files are used.
+ * @return true if any .bin file was written or removed
+ */
+static bool
+updateBlocklists (tr_session * session)
 {
   tr_sys_dir_t odir;
   char * dirname;
   const char * name;
-  tr_list * blocklists = NULL;
-  tr_ptrArray loadme = TR_PTR_ARRAY_INIT;
+  bool changed = false;
   const bool isEnabled = session->isBlocklistEnabled;
 
-  /* walk the blocklist directory... */
   dirname = tr_buildPath (session->configDir, "blocklists", NULL);
   odir = tr_sys_dir_open (dirname, NULL);
   if (odir == TR_BAD_SYS_DIR)
     {
       tr_free (dirname);
-      return;
+      return false;
     }
 
   while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
     {
       char * path;
-      char * load = NULL;
- 
-      if (name[0] == '.') /* ignore dotfiles */
+      char * binname;
+      char * basename;
+      tr_sys_path_info path_info;
+      tr_sys_path_info binname_info;
+      if (name[0] == '.' || tr_stringEndsWith (name, ".bin")) /* ignore dotfiles */
         continue;
 
       path = tr_buildPath (dirname, name, NULL);
+      basename = tr_sys_path_basename (name, NULL);
+      binname = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.bin", dirname, basename);
 
-      if (tr_stringEndsWith (path, ".bin"))
+      if (!tr_sys_path_get_info (binname, 0, &binname_info, NULL)) /* create it */
         {
-          load = tr_strdup (path);
+          tr_blocklistFile * b = tr_blocklistFileNew (binname, isEnabled);
+          if (tr_blocklistFileSetContent (b, path) > 0)
+            changed = true;
+
+          tr_blocklistFileFree (b);
         }
-      else
+      else if (!tr_blocklistFileIsCurrent (binname) ||
+               (tr_sys_path_get_info (path, 0, &path_info, NULL) &&
+                path_info.last_modified_at >= binname_info.last_modified_at)) /* update it */
         {
-          char * binname;
-          char * basename;
-          tr_sys_path_info path_info;
-          tr_sys_path_info binname_info;
-
-          basename = tr_sys_path_basename (name, NULL);
-          binname = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.bin", dirname, basename);
-
-          if (!tr_sys_path_get_info (binname, 0, &binname_info, NULL)) /* create it */
+          char * old;
+          tr_blocklistFile * b;
+
+          old = tr_strdup_printf ("%s.old", binname);
+          tr_sys_path_remove (old, NULL);
+          tr_sys_path_rename (binname, old, NULL);
+          b = tr_blocklistFileNew (binname, isEnabled);
+          if (tr_blocklistFileSetContent (b, path) > 0)
             {
-              tr_blocklistFile * b = tr_blocklistFileNew (binname, isEnabled);
-              const int n = tr_blocklistFileSetContent (b, path);
-              if (n > 0)
-                load = tr_strdup (binname);
-
-              tr_blocklistFileFree (b);
+              tr_sys_path_remove (old, NULL);
+              changed = true;
             }
-          else if (tr_sys_path_get_info (path, 0, &path_info, NULL) &&
-                   path_info.last_modified_at >= binname_info.last_modified_at) /* update it */
+          else
             {
-              char * old;
-              tr_blocklistFile * b;
-
-              old = tr_strdup_printf ("%s.old", binname);
-              tr_sys_path_remove (old, NULL);
-              tr_sys_path_rename (binname, old, NULL);
-              b = tr_blocklistFileNew (binname, isEnabled);
-              if (tr_blocklistFileSetContent (b, path) > 0)
-                {
-                  tr_sys_path_remove (old, NULL);
-                }
-              else
-                {
-                  tr_sys_path_remove (binname, NULL);
-                  tr_sys_path_rename (old, binname, NULL);
-                }
-
-              tr_blocklistFileFree (b);
-              tr_free (old);
+              tr_sys_path_remove (binname, NULL);
+              tr_sys_path_rename (old, binname, NULL);
             }
 
-          tr_free (basename);
-          tr_free (binname);
-        }
-
-      if (load != NULL)
-        {
-          if (tr_ptrArrayFindSorted (&loadme, load, (PtrArrayCompareFunc)strcmp) == NULL)
-            tr_ptrArrayInsertSorted (&loadme, load, (PtrArrayCompareFunc)strcmp);
-          else
-            tr_free (load);
+          tr_blocklistFileFree (b);
+          tr_free (old);
         }
 
+      tr_free (basename);
+      tr_free (binname);
       tr_free (path);
     }
 
+  tr_sys_dir_close (odir, NULL);
+  tr_free (dirname);
+  return changed;
+}
+
+/* load every compiled .bin blocklist */
+static void
+loadBlocklists (tr_session * session)
+{
+  tr_sys_dir_t odir;
+  char * dirname;
+  const char * name;
+  tr_list * blocklists = NULL;
+  tr_ptrArray loadme = TR_PTR_ARRAY_INIT;
+  const bool isEnabled = session->isBlocklistEnabled;
+
+  /* walk the blocklist directory... */
+  dirname = tr_buildPath (session->configDir, "blocklists", NULL);
+  odir = tr_sys_dir_open (dirname, NULL);
+  if (odir == TR_BAD_SYS_DIR)
+    {
+      tr_free (dirname);
+      return;
+    }
+
+  while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
+    if (name[0] != '.' && tr_stringEndsWith (name, ".bin")) /* ignore dotfiles */
+      tr_ptrArrayInsertSorted (&loadme, tr_buildPath (dirname, name, NULL), (PtrArrayCompareFunc)strcmp);
+
   if (!tr_ptrArrayEmpty (&loadme))
     {
       int i;
@@ -2336,16 +2859,38 @@ loadBlocklists (tr_session * session)
 static void
 closeBlocklists (tr_session * session)
 {
+  tr_blocklistIndexFree (session->blocklistIndex);
+  session->blocklistIndex = NULL;
   tr_list_free (&session->blocklists, (TrListForeachFunc)tr_blocklistFileFree);
 }
 
+/* peers cache their verdicts against blocklistGeneration,
+   so bumping it makes them all look themselves up again */
+static void
+invalidateBlocklistVerdicts (tr_session * session)
+{
+  ++session->blocklistGeneration;
+
+  if (session->peerMgr != NULL)
+    tr_peerMgrOnBlocklistChanged (session->peerMgr);
+}
+
+static void
+onBlocklistsChanged (tr_session * session)
+{
+  tr_blocklistIndexFree (session->blocklistIndex);
+  session->blocklistIndex = tr_blocklistIndexNew (session->blocklists);
+
+  invalidateBlocklistVerdicts (session);
+}
+
 void
 tr_sessionReloadBlocklists (tr_session * session)
 {
+  updateBlocklists (session);
   closeBlocklists (session);
   loadBlocklists (session);
-
-  tr_peerMgrOnBlocklistChanged (session->peerMgr);
+  onBlocklistsChanged (session);
 }
 
 int
@@ -2382,6 +2927,8 @@ tr_blocklistSetEnabled (tr_session * session, bool isEnabled)
 
   for (l=session->blocklists; l!=NULL; l=l->next)
     tr_blocklistFileSetEnabled (l->data, isEnabled);
+
+  invalidateBlocklistVerdicts (session);
 }
 
 bool
@@ -2392,14 +2939,12 @@ tr_blocklistExists (const tr_session * session)
   return session->blocklists != NULL;
 }
 
-int
-tr_blocklistSetContent (tr_session * session, const char * contentFilename)
+static tr_blocklistFile *
+getDefaultBlocklist (tr_session * session)
 {
   tr_list * l;
-  int ruleCount;
   tr_blocklistFile * b;
   const char * defaultName = DEFAULT_BLOCKLIST_FILENAME;
-  tr_sessionLock (session);
 
   for (b=NULL, l=session->blocklists; !b && l; l=l->next)
     if (tr_stringEndsWith (tr_blocklistFileGetFilename (l->data), defaultName))
@@ -2413,8 +2958,32 @@ tr_blocklistSetContent (tr_session * session, const char * contentFilename)
       tr_free (path);
     }
 
-  ruleCount = tr_blocklistFileSetContent (b, contentFilename);
+  return b;
+}
+
+int
+tr_blocklistSetContent (tr_session * session, const char * contentFilename)
+{
+  int ruleCount;
+
+  tr_sessionLock (session);
+  ruleCount = tr_blocklistFileSetContent (getDefaultBlocklist (session), contentFilename);
+  onBlocklistsChanged (session);
+  tr_sessionUnlock (session);
+
+  return ruleCount;
+}
+
+int
+tr_blocklistInstallCompiled (tr_session * session, const char * binFilename)
+{
+  int ruleCount;
+
+  tr_sessionLock (session);
+  ruleCount = tr_blocklistFileInstall (getDefaultBlocklist (session), binFilename);
+  onBlocklistsChanged (session);
   tr_sessionUnlock (session);
+
   return ruleCount;
 }
 
@@ -2422,15 +2991,12 @@ bool
 tr_sessionIsAddressBlocked (const tr_session * session,
                             const tr_address * addr)
 {
-  tr_list * l;
-
   assert (tr_isSession (session));
 
-  for (l = session->blocklists; l; l = l->next)
-    if (tr_blocklistFileHasAddress (l->data, addr))
-      return true;
+  if (!session->isBlocklistEnabled)
+    return false;
 
-  return false;
+  return tr_blocklistIndexHasAddress (session->blocklistIndex, addr);
 }
 
 void
@@ -2798,76 +3364,38 @@ tr_sessionGetQueueStalledMinutes (const tr_session * session)
   return session->queueStalledMinutes;
 }
 
-struct TorrentAndPosition
-{
-  tr_torrent * tor;
-  int position;
-};
-
-static int
-compareTorrentAndPositions (const void * va, const void * vb)
-{
-  int ret;
-  const struct TorrentAndPosition * a = va;
-  const struct TorrentAndPosition * b = vb;
-
-  if (a->position > b->position)
-    ret = 1;
-  else if (a->position < b->position)
-    ret = -1;
-  else
-    ret = 0;
-
-  return ret;
-}
-
-
 void
 tr_sessionGetNextQueuedTorrents (tr_session   * session,
                                  tr_direction   direction,
                                  size_t         num_wanted,
                                  tr_ptrArray  * setme)
 {
-  size_t i;
-  size_t n;
-  tr_torrent * tor;
-  struct TorrentAndPosition * candidates;
+  int i;
+  int seen;
+  size_t found;
 
   assert (tr_isSession (session));
   assert (tr_isDirection (direction));
 
-  /* build an array of the candidates */
-  n = tr_sessionCountTorrents (session);
-  candidates = tr_new (struct TorrentAndPosition, n);
-  i = 0;
-  tor = NULL;
-  while ((tor = tr_torrentNext (session, tor)))
+  /* session->queue is already in queue order, so take the first matches.
+     Stop once every queued torrent has been seen; the rest can't match */
+  seen = 0;
+  found = 0;
+  for (i=0; found<num_wanted && seen<session->queuedCount && i<session->torrentCount; ++i)
     {
+      tr_torrent * tor = session->queue[i];
+
       if (!tr_torrentIsQueued (tor))
         continue;
 
+      ++seen;
+
       if (direction != tr_torrentGetQueueDirection (tor))
         continue;
 
-      candidates[i].tor = tor;
-      candidates[i].position = tr_torrentGetQueuePosition (tor);
-      ++i;
+      tr_ptrArrayAppend (setme, tor);
+      ++found;
     }
-
-  /* find the best n candidates */
-  if (num_wanted > i)
-    num_wanted = i;
-  else if (num_wanted < i)
-    tr_quickfindFirstK (candidates, i,
-                        sizeof(struct TorrentAndPosition),
-                        compareTorrentAndPositions, num_wanted);
-
-  /* add them to the return array */
-  for (i=0; i<num_wanted; ++i)
-    tr_ptrArrayAppend (setme, candidates[i].tor);
-
-  /* cleanup */
-  tr_free (candidates);
 }
 
 int
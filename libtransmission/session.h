@@ -52,7 +52,11 @@ struct tr_announcer;
 struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
+struct tr_dns_cache;
 struct tr_fdInfo;
+struct tr_mem_budget;
+struct tr_metrics;
+struct tr_scrubber;
 struct tr_device_info;
 
 struct tr_turtle_info
@@ -104,9 +108,18 @@ struct tr_session
     bool                         isLPDEnabled;
     bool                         isBlocklistEnabled;
     bool                         isPrefetchEnabled;
+    bool                         isResumeStoreEnabled; /* only read at startup */
+    bool                         isPageCacheBypassEnabled;
+    bool                         isPieceLocalityEnabled;
+    bool                         isScrubEnabled;
+    bool                         isVerifyMmapEnabled;
     bool                         isTorrentDoneScriptEnabled;
+    bool                         isStarted; /* DHT, LPD & port forwarding are up */
     bool                         isClosing;
     bool                         isClosed;
+
+    /* when tr_sessionClose () stops waiting on trackers and peers */
+    time_t                       closeDeadline;
     bool                         isIncompleteFileNamingEnabled;
     bool                         isRatioLimited;
     bool                         isIdleLimited;
@@ -119,6 +132,12 @@ struct tr_session
 
     tr_variant                   removedTorrents;
 
+    /* bumped by each torrent-get that asks for changes since a revision */
+    int64_t                      torrentGetRevision;
+
+    /* bumped whenever a torrent's tr_stat changes; see tr_sessionGetTorrentStats () */
+    uint64_t                     statGeneration;
+
     bool                         stalledEnabled;
     bool                         queueEnabled[2];
     int                          queueSize[2];
@@ -133,6 +152,10 @@ struct tr_session
 
     struct tr_fdInfo           * fdInfo;
 
+    /* how many descriptors the peers' outbufs are holding for sendfile ().
+       see tr_ioAddToBuffer () */
+    int                          sendFileSegments;
+
     int                          magicNumber;
 
     tr_encryption_mode           encryptionMode;
@@ -148,6 +171,10 @@ struct tr_session
 
     int                          uploadSlotsPerTorrent;
 
+    int                          verifyThreadCount;
+
+    unsigned int                 scrubSpeed_KBps;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     int                          udp_socket;
@@ -175,6 +202,23 @@ struct tr_session
 
     int                          torrentCount;
     tr_torrent *                 torrentList;
+    tr_torrent *                 torrentListTail; /* so adding a torrent needn't walk the list */
+
+    /* hash tables of the torrents in torrentList, so that they can be
+       found by id, info hash, or obfuscated hash without walking it */
+    struct
+    {
+        tr_torrent **            byId;
+        tr_torrent **            byHash;
+        tr_torrent **            byObfuscatedHash;
+        size_t                   bucketCount;
+    }                            torrentIndex;
+
+    /* torrentList in queue order, so that queue[i]->queuePosition == i.
+       queuedCount is how many of them are currently waiting in a queue */
+    tr_torrent **                queue;
+    int                          queueAlloc;
+    int                          queuedCount;
 
     char *                       torrentDoneScript;
 
@@ -188,12 +232,23 @@ struct tr_session
 
     struct tr_device_info *      downloadDir;
 
+    /* other folders that free-space requests asked about recently */
+    struct tr_device_info *      freeSpaceDirs[4];
+    int                          freeSpaceDirsNext;
+
     struct tr_list *             blocklists;
+    struct tr_blocklistIndex *   blocklistIndex;
+    uint32_t                     blocklistGeneration; /* bumped when verdicts may change */
     struct tr_peerMgr *          peerMgr;
     struct tr_shared *           shared;
 
+    /* see tr_ioFindSharedFile () */
+    struct tr_shared_file_index * sharedFileIndex;
+
     struct tr_cache *            cache;
 
+    struct tr_scrubber *         scrubber;
+
     struct tr_lock *             lock;
 
     struct tr_web *              web;
@@ -206,11 +261,30 @@ struct tr_session
 
     struct tr_announcer        * announcer;
     struct tr_announcer_udp    * announcer_udp;
+    struct tr_dns_cache        * dnsCache;
+    struct tr_metrics          * metrics;
+    struct tr_mem_budget       * memBudget;
 
     tr_variant                 * metainfoLookup;
 
     struct event               * nowTimer;
+    uint64_t                     nowTimerDue; /* usec, for TR_HISTOGRAM_EVENT_LOOP_LAG */
     struct event               * saveTimer;
+    int                          saveTimerNextId; /* where onSaveTimer's round left off, or 0 */
+    struct event               * startTimer; /* runs the second half of startup */
+
+    /* msec from tr_sessionInit () until the torrents were loaded,
+       and until the second half of startup finished. 0 until then */
+    uint64_t                     initMsec;
+    uint64_t                     readyMsec;
+    uint64_t                     startedMsec;
+
+    /* exists if isResumeStoreEnabled, or if it was enabled in an earlier
+       run and the store still has records that haven't been moved back */
+    struct tr_resume_store     * resumeStore;
+
+    /* info dicts recently served to peers; see torrent-magnet.c */
+    struct tr_metadata_cache   * metadataCache;
 
     /* monitors the "global pool" speeds */
     struct tr_bandwidth          bandwidth;
@@ -243,6 +317,10 @@ void         tr_sessionSetTorrentFile (tr_session * session,
 bool         tr_sessionIsAddressBlocked (const tr_session        * session,
                                          const struct tr_address * addr);
 
+/* like tr_blocklistSetContent (), but takes a file made by tr_blocklistCompile () */
+int          tr_blocklistInstallCompiled (tr_session * session,
+                                          const char * binFilename);
+
 void         tr_sessionLock (tr_session *);
 
 void         tr_sessionUnlock (tr_session *);
@@ -274,7 +352,8 @@ static inline bool tr_isPreallocationMode (tr_preallocation_mode m)
 {
     return (m == TR_PREALLOCATE_NONE)
         || (m == TR_PREALLOCATE_SPARSE)
-        || (m == TR_PREALLOCATE_FULL);
+        || (m == TR_PREALLOCATE_FULL)
+        || (m == TR_PREALLOCATE_INCREMENTAL);
 }
 
 static inline bool tr_isEncryptionMode (tr_encryption_mode m)
@@ -0,0 +1,978 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+/**
+ * A synthetic swarm for end-to-end throughput testing.
+ *
+ * This runs an in-process tr_session and connects N simulated peers to
+ * it over loopback TCP. The simulated peers speak just enough of the
+ * plaintext BitTorrent wire protocol to either seed the torrent to the
+ * session (the default) or leech it from the session (-u), with a
+ * configurable latency, per-peer bandwidth and piece availability.
+ *
+ * Each simulated peer binds to its own 127.1.x.y address, since the
+ * peer manager only allows one connection per address.
+ *
+ * When it's done it reports the aggregate throughput, the CPU time
+ * spent per GB, the event loop lag, and the resident memory per peer.
+ * The memory figure includes the simulated peers' own buffers, so
+ * treat it as an upper bound.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h> /* atoi (), rand () */
+#include <string.h> /* memcpy () */
+#include <time.h> /* clock_gettime () */
+
+#ifndef _WIN32
+ #include <unistd.h> /* sysconf () */
+ #include <sys/resource.h> /* getrusage () */
+#endif
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "file.h"
+#include "makemeta.h"
+#include "metrics.h"
+#include "net.h"
+#include "peer-io.h" /* evbuffer_add_uint32 () */
+#include "platform.h" /* tr_threadNew () */
+#include "quark.h"
+#include "session.h"
+#include "torrent.h"
+#include "tr-getopt.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+#define MY_NAME "swarm-bench"
+
+enum
+{
+  BT_CHOKE = 0,
+  BT_UNCHOKE = 1,
+  BT_INTERESTED = 2,
+  BT_NOT_INTERESTED = 3,
+  BT_HAVE = 4,
+  BT_BITFIELD = 5,
+  BT_REQUEST = 6,
+  BT_PIECE = 7,
+  BT_CANCEL = 8,
+
+  HANDSHAKE_LEN = 68,
+
+  /* how often the simulated peers send their queued messages */
+  TICK_MSEC = 5,
+
+  /* how many requests a leeching peer keeps in flight */
+  PIPELINE_LEN = 32,
+
+  /* don't queue more than this in a peer's socket buffer */
+  OUTBUF_MAX = 256 * 1024,
+
+  /* the payload repeats with this (prime) period */
+  PATTERN_LEN = 65521,
+
+  BLOCK_SIZE = 16 * 1024
+};
+
+static tr_option options[] =
+{
+  { 'a', "availability", "Percent of the pieces that each peer has", "a", 1, "<percent>" },
+  { 'b', "bandwidth", "Each peer's bandwidth in KiB/s (0 for unlimited)", "b", 1, "<KiB/s>" },
+  { 'l', "latency", "One-way latency of each peer's messages in msec", "l", 1, "<msec>" },
+  { 'n', "peers", "Number of simulated peers", "n", 1, "<count>" },
+  { 'p', "port", "The session's peer port", "p", 1, "<port>" },
+  { 's', "size", "Size of the torrent in MiB", "s", 1, "<MiB>" },
+  { 't', "time", "Stop after this many seconds", "t", 1, "<seconds>" },
+  { 'u', "upload", "Have the peers leech from the session instead of seeding to it", "u", 0, NULL },
+  { 0, NULL, NULL, NULL, 0, NULL }
+};
+
+static const char *
+getUsage (void)
+{
+  return "Usage: " MY_NAME " [options]";
+}
+
+/***
+****
+***/
+
+struct sim_item
+{
+  uint64_t due_usec;
+  uint32_t piece;
+  uint32_t offset;
+  uint32_t length;
+};
+
+struct sim_peer
+{
+  int index;
+  struct swarm * swarm;
+  struct bufferevent * bev;
+  tr_bitfield have;
+
+  bool handshaken;
+  bool choked;
+
+  /* FIFO of messages waiting for their latency to pass:
+     pieces to send when seeding, or requests when leeching */
+  struct sim_item * queue;
+  size_t queue_head;
+  size_t queue_len;
+  size_t queue_alloc;
+
+  double tokens;
+  uint64_t refilled_usec;
+
+  /* leeching: the next block to ask for, and how many requests are out */
+  uint32_t cursor;
+  int outstanding;
+};
+
+struct swarm
+{
+  /* configuration */
+  int peer_count;
+  int latency_msec;
+  int bandwidth_Bps;
+  int availability;
+  int port;
+  bool upload;
+
+  /* the torrent */
+  uint8_t info_hash[SHA_DIGEST_LENGTH];
+  uint64_t total_size;
+  uint32_t piece_size;
+  uint32_t piece_count;
+  uint32_t block_count;
+
+  struct event_base * base;
+  struct event * tick;
+  struct sim_peer * peers;
+
+  /* read by the main thread */
+  volatile bool stop;
+  volatile bool done;
+  volatile int handshaken;
+  volatile int closed;
+  volatile uint64_t payload_bytes;
+  volatile uint64_t first_byte_usec;
+};
+
+static uint8_t * pattern = NULL;
+
+static uint64_t
+now_usec (void)
+{
+  struct timeval tv;
+  tr_gettimeofday (&tv);
+  return (uint64_t)tv.tv_sec * 1000000u + tv.tv_usec;
+}
+
+/* the payload byte at `offset' is pattern[offset % PATTERN_LEN].
+   pattern holds an extra block so that any block can be copied in one go */
+static void
+initPattern (void)
+{
+  int i;
+
+  pattern = tr_new (uint8_t, PATTERN_LEN + BLOCK_SIZE);
+  for (i=0; i<PATTERN_LEN + BLOCK_SIZE; ++i)
+    pattern[i] = i < PATTERN_LEN ? (uint8_t) rand () : pattern[i - PATTERN_LEN];
+}
+
+static const uint8_t *
+getPayload (const struct swarm * swarm, uint32_t piece, uint32_t offset)
+{
+  const uint64_t pos = (uint64_t)piece * swarm->piece_size + offset;
+  return pattern + (pos % PATTERN_LEN);
+}
+
+static bool
+writePayloadFile (const char * filename, uint64_t size)
+{
+  uint64_t pos;
+  FILE * fp = fopen (filename, "wb");
+
+  if (fp == NULL)
+    return false;
+
+  for (pos=0; pos<size; pos+=BLOCK_SIZE)
+    {
+      const size_t len = MIN (BLOCK_SIZE, size - pos);
+      if (fwrite (pattern + (pos % PATTERN_LEN), 1, len, fp) != len)
+        break;
+    }
+
+  return fclose (fp) == 0 && pos >= size;
+}
+
+/***
+****  Simulated peers
+***/
+
+static void
+queueAdd (struct sim_peer * peer, uint32_t piece, uint32_t offset, uint32_t length)
+{
+  struct sim_item * item;
+
+  if (peer->queue_len == peer->queue_alloc)
+    {
+      size_t i;
+      const size_t n = MAX (64, peer->queue_alloc * 2);
+      struct sim_item * q = tr_new (struct sim_item, n);
+
+      for (i=0; i<peer->queue_len; ++i)
+        q[i] = peer->queue[(peer->queue_head + i) % peer->queue_alloc];
+
+      tr_free (peer->queue);
+      peer->queue = q;
+      peer->queue_head = 0;
+      peer->queue_alloc = n;
+    }
+
+  item = &peer->queue[(peer->queue_head + peer->queue_len) % peer->queue_alloc];
+  item->due_usec = now_usec () + (uint64_t)peer->swarm->latency_msec * 1000u;
+  item->piece = piece;
+  item->offset = offset;
+  item->length = length;
+  ++peer->queue_len;
+}
+
+static void
+queuePop (struct sim_peer * peer)
+{
+  peer->queue_head = (peer->queue_head + 1) % peer->queue_alloc;
+  --peer->queue_len;
+}
+
+static void
+writeHeader (struct evbuffer * out, uint32_t len, uint8_t id)
+{
+  evbuffer_add_hton_32 (out, len);
+  evbuffer_add (out, &id, 1);
+}
+
+static void
+sendRequest (struct sim_peer * peer, const struct sim_item * item)
+{
+  struct evbuffer * out = bufferevent_get_output (peer->bev);
+
+  writeHeader (out, 13, BT_REQUEST);
+  evbuffer_add_hton_32 (out, item->piece);
+  evbuffer_add_hton_32 (out, item->offset);
+  evbuffer_add_hton_32 (out, item->length);
+}
+
+static void
+sendPiece (struct sim_peer * peer, const struct sim_item * item)
+{
+  struct swarm * swarm = peer->swarm;
+  struct evbuffer * out = bufferevent_get_output (peer->bev);
+
+  writeHeader (out, 9 + item->length, BT_PIECE);
+  evbuffer_add_hton_32 (out, item->piece);
+  evbuffer_add_hton_32 (out, item->offset);
+  evbuffer_add (out, getPayload (swarm, item->piece, item->offset), item->length);
+
+  if (!swarm->first_byte_usec)
+    swarm->first_byte_usec = now_usec ();
+  swarm->payload_bytes += item->length;
+}
+
+static void
+sendOpeningMessages (struct sim_peer * peer)
+{
+  struct evbuffer * out = bufferevent_get_output (peer->bev);
+
+  if (tr_bitfieldCountTrueBits (&peer->have) > 0)
+    {
+      size_t len;
+      void * raw = tr_bitfieldGetRaw (&peer->have, &len);
+      writeHeader (out, 1 + len, BT_BITFIELD);
+      evbuffer_add (out, raw, len);
+      tr_free (raw);
+    }
+
+  if (!peer->swarm->upload)
+    writeHeader (out, 1, BT_UNCHOKE);
+  else if (!tr_bitfieldHasAll (&peer->have))
+    writeHeader (out, 1, BT_INTERESTED);
+}
+
+/* leeching: queue requests for the blocks we don't have, round-robin */
+static void
+queueRequests (struct sim_peer * peer)
+{
+  const struct swarm * swarm = peer->swarm;
+  const uint32_t blocks_per_piece = swarm->piece_size / BLOCK_SIZE;
+
+  if (peer->choked || tr_bitfieldHasAll (&peer->have))
+    return;
+
+  while (peer->outstanding < PIPELINE_LEN)
+    {
+      const uint32_t block = peer->cursor;
+      const uint32_t piece = block / blocks_per_piece;
+      const uint32_t offset = (block % blocks_per_piece) * BLOCK_SIZE;
+      const uint64_t pos = (uint64_t)piece * swarm->piece_size + offset;
+
+      peer->cursor = (peer->cursor + 1) % swarm->block_count;
+
+      if (tr_bitfieldHas (&peer->have, piece))
+        continue;
+
+      queueAdd (peer, piece, offset, MIN (BLOCK_SIZE, swarm->total_size - pos));
+      ++peer->outstanding;
+    }
+}
+
+static void
+peerPulse (struct sim_peer * peer, uint64_t now)
+{
+  const struct swarm * swarm = peer->swarm;
+
+  if (swarm->bandwidth_Bps > 0)
+    {
+      const double max_tokens = MAX (swarm->bandwidth_Bps / 4, 2 * BLOCK_SIZE);
+      peer->tokens += swarm->bandwidth_Bps * (now - peer->refilled_usec) / 1000000.0;
+      peer->tokens = MIN (peer->tokens, max_tokens);
+      peer->refilled_usec = now;
+    }
+
+  if (swarm->upload)
+    queueRequests (peer);
+
+  while (peer->queue_len > 0)
+    {
+      const struct sim_item * item = &peer->queue[peer->queue_head];
+
+      if (item->due_usec > now)
+        break;
+
+      if (swarm->bandwidth_Bps > 0 && peer->tokens < item->length)
+        break;
+
+      if (evbuffer_get_length (bufferevent_get_output (peer->bev)) >= OUTBUF_MAX)
+        break;
+
+      if (swarm->upload)
+        sendRequest (peer, item);
+      else
+        sendPiece (peer, item);
+
+      peer->tokens -= item->length;
+      queuePop (peer);
+    }
+}
+
+static void
+onTick (evutil_socket_t fd UNUSED, short what UNUSED, void * vswarm)
+{
+  int i;
+  struct swarm * swarm = vswarm;
+  const uint64_t now = now_usec ();
+
+  for (i=0; i<swarm->peer_count; ++i)
+    if (swarm->peers[i].bev != NULL && swarm->peers[i].handshaken)
+      peerPulse (&swarm->peers[i], now);
+
+  if (swarm->stop)
+    event_base_loopbreak (swarm->base);
+}
+
+static void
+onPeerMessage (struct sim_peer * peer, uint8_t id, struct evbuffer * in, uint32_t len)
+{
+  struct swarm * swarm = peer->swarm;
+  uint32_t piece;
+  uint32_t offset;
+  uint32_t length;
+
+  switch (id)
+    {
+      case BT_CHOKE:
+        /* the session forgets our requests when it chokes us */
+        peer->choked = true;
+        peer->queue_len = 0;
+        peer->outstanding = 0;
+        break;
+
+      case BT_UNCHOKE:
+        peer->choked = false;
+        break;
+
+      case BT_REQUEST:
+        if (len == 12)
+          {
+            evbuffer_remove (in, &piece, 4);
+            evbuffer_remove (in, &offset, 4);
+            evbuffer_remove (in, &length, 4);
+            len = 0;
+            piece = ntohl (piece);
+            offset = ntohl (offset);
+            length = ntohl (length);
+            if (!swarm->upload && piece < swarm->piece_count
+                               && tr_bitfieldHas (&peer->have, piece)
+                               && length <= BLOCK_SIZE)
+              queueAdd (peer, piece, offset, length);
+          }
+        break;
+
+      case BT_PIECE:
+        if (len >= 8)
+          {
+            if (!swarm->first_byte_usec)
+              swarm->first_byte_usec = now_usec ();
+            swarm->payload_bytes += len - 8;
+            if (peer->outstanding > 0)
+              --peer->outstanding;
+          }
+        break;
+
+      default:
+        break;
+    }
+
+  evbuffer_drain (in, len);
+}
+
+static void
+onPeerRead (struct bufferevent * bev, void * vpeer)
+{
+  struct sim_peer * peer = vpeer;
+  struct evbuffer * in = bufferevent_get_input (bev);
+
+  if (!peer->handshaken)
+    {
+      if (evbuffer_get_length (in) < HANDSHAKE_LEN)
+        return;
+
+      evbuffer_drain (in, HANDSHAKE_LEN);
+      peer->handshaken = true;
+      ++peer->swarm->handshaken;
+      sendOpeningMessages (peer);
+    }
+
+  for (;;)
+    {
+      uint32_t len;
+      uint8_t id;
+
+      if (evbuffer_get_length (in) < 4)
+        break;
+
+      evbuffer_copyout (in, &len, 4);
+      len = ntohl (len);
+      if (evbuffer_get_length (in) < 4 + (size_t)len)
+        break;
+
+      evbuffer_drain (in, 4);
+      if (len == 0) /* keepalive */
+        continue;
+
+      evbuffer_remove (in, &id, 1);
+      onPeerMessage (peer, id, in, len - 1);
+    }
+}
+
+static void
+onPeerEvent (struct bufferevent * bev, short what, void * vpeer)
+{
+  struct sim_peer * peer = vpeer;
+
+  if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+    {
+      bufferevent_free (bev);
+      peer->bev = NULL;
+      ++peer->swarm->closed;
+    }
+}
+
+static void
+peerConstruct (struct swarm * swarm, struct sim_peer * peer, int index)
+{
+  uint32_t i;
+
+  memset (peer, 0, sizeof (struct sim_peer));
+  peer->index = index;
+  peer->swarm = swarm;
+  peer->choked = true;
+  peer->refilled_usec = now_usec ();
+  peer->cursor = (uint32_t)rand () % swarm->block_count;
+
+  /* when seeding, make sure that every piece is on some peer */
+  tr_bitfieldConstruct (&peer->have, swarm->piece_count);
+  for (i=0; i<swarm->piece_count; ++i)
+    if ((!swarm->upload && ((int)(i % swarm->peer_count) == index))
+                        || (rand () % 100 < swarm->availability))
+      tr_bitfieldAdd (&peer->have, i);
+}
+
+static void
+peerConnect (struct sim_peer * peer)
+{
+  evutil_socket_t fd;
+  struct sockaddr_in local;
+  struct sockaddr_in remote;
+  struct evbuffer * out;
+  char peer_id[PEER_ID_LEN + 1];
+  const struct swarm * swarm = peer->swarm;
+
+  memset (&local, 0, sizeof (local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl (0x7f010000u | ((peer->index / 250) << 8) | (peer->index % 250 + 1));
+
+  memset (&remote, 0, sizeof (remote));
+  remote.sin_family = AF_INET;
+  remote.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  remote.sin_port = htons (swarm->port);
+
+  fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || bind (fd, (struct sockaddr*)&local, sizeof (local)) != 0)
+    {
+      fprintf (stderr, "peer %d: couldn't bind: %s\n", peer->index, tr_strerror (errno));
+      if (fd >= 0)
+        evutil_closesocket (fd);
+      ++peer->swarm->closed;
+      return;
+    }
+
+  evutil_make_socket_nonblocking (fd);
+  peer->bev = bufferevent_socket_new (swarm->base, fd, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_setcb (peer->bev, onPeerRead, NULL, onPeerEvent, peer);
+  bufferevent_enable (peer->bev, EV_READ | EV_WRITE);
+
+  /* the plaintext handshake, with no extensions */
+  out = bufferevent_get_output (peer->bev);
+  evbuffer_add (out, "\023BitTorrent protocol", 20);
+  evbuffer_add (out, "\0\0\0\0\0\0\0\0", 8);
+  evbuffer_add (out, swarm->info_hash, SHA_DIGEST_LENGTH);
+  tr_snprintf (peer_id, sizeof (peer_id), "-SW0001-%012d", peer->index);
+  evbuffer_add (out, peer_id, PEER_ID_LEN);
+
+  if (bufferevent_socket_connect (peer->bev, (struct sockaddr*)&remote, sizeof (remote)) != 0)
+    {
+      bufferevent_free (peer->bev);
+      peer->bev = NULL;
+      ++peer->swarm->closed;
+    }
+}
+
+static void
+peerDestruct (struct sim_peer * peer)
+{
+  if (peer->bev != NULL)
+    bufferevent_free (peer->bev);
+
+  tr_free (peer->queue);
+  tr_bitfieldDestruct (&peer->have);
+}
+
+static void
+swarmThreadFunc (void * vswarm)
+{
+  int i;
+  struct timeval interval;
+  struct swarm * swarm = vswarm;
+
+  swarm->base = event_base_new ();
+
+  swarm->peers = tr_new (struct sim_peer, swarm->peer_count);
+  for (i=0; i<swarm->peer_count; ++i)
+    {
+      peerConstruct (swarm, &swarm->peers[i], i);
+      peerConnect (&swarm->peers[i]);
+    }
+
+  interval.tv_sec = 0;
+  interval.tv_usec = TICK_MSEC * 1000;
+  swarm->tick = event_new (swarm->base, -1, EV_PERSIST, onTick, swarm);
+  event_add (swarm->tick, &interval);
+
+  event_base_dispatch (swarm->base);
+
+  event_free (swarm->tick);
+  for (i=0; i<swarm->peer_count; ++i)
+    peerDestruct (&swarm->peers[i]);
+  tr_free (swarm->peers);
+  event_base_free (swarm->base);
+  swarm->done = true;
+}
+
+/***
+****  Measurements
+***/
+
+static uint64_t
+processCpuUsec (void)
+{
+#ifndef _WIN32
+  struct rusage r;
+  getrusage (RUSAGE_SELF, &r);
+  return (uint64_t)(r.ru_utime.tv_sec + r.ru_stime.tv_sec) * 1000000u
+       + r.ru_utime.tv_usec + r.ru_stime.tv_usec;
+#else
+  return 0;
+#endif
+}
+
+/* resident memory in bytes, or 0 if we can't tell */
+static uint64_t
+residentBytes (void)
+{
+  uint64_t bytes = 0;
+#ifdef __linux__
+  unsigned long size;
+  unsigned long resident;
+  FILE * fp = fopen ("/proc/self/statm", "r");
+
+  if (fp != NULL)
+    {
+      if (fscanf (fp, "%lu %lu", &size, &resident) == 2)
+        bytes = (uint64_t)resident * sysconf (_SC_PAGESIZE);
+      fclose (fp);
+    }
+#endif
+  return bytes;
+}
+
+struct session_sample
+{
+  tr_session * session;
+  uint64_t thread_cpu_usec;
+  uint64_t lag_count;
+  uint64_t lag_sum_usec;
+  int64_t lag_buckets[16];
+  int64_t lag_bounds[16];
+  size_t lag_bucket_count;
+  bool done;
+};
+
+static void
+sampleSessionThread (void * vsample)
+{
+  tr_variant top;
+  tr_variant * lag;
+  tr_variant * list;
+  struct session_sample * sample = vsample;
+  const char * key = "transmission_event_loop_lag_seconds";
+
+#if defined (CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  if (!clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts))
+    sample->thread_cpu_usec = (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+#endif
+
+  tr_variantInitDict (&top, 0);
+  tr_metricsToVariant (sample->session, &top);
+  if (tr_variantDictFindDict (&top, tr_quark_new (key, strlen (key)), &lag))
+    {
+      size_t i;
+      int64_t i64;
+
+      if (tr_variantDictFindInt (lag, tr_quark_new ("count", 5), &i64))
+        sample->lag_count = i64;
+      if (tr_variantDictFindInt (lag, tr_quark_new ("sum_usec", 8), &i64))
+        sample->lag_sum_usec = i64;
+
+      if (tr_variantDictFindList (lag, tr_quark_new ("buckets", 7), &list))
+        {
+          sample->lag_bucket_count = MIN (tr_variantListSize (list), 16);
+          for (i=0; i<sample->lag_bucket_count; ++i)
+            tr_variantGetInt (tr_variantListChild (list, i), &sample->lag_buckets[i]);
+        }
+
+      if (tr_variantDictFindList (lag, tr_quark_new ("bounds_usec", 11), &list))
+        for (i=0; i<sample->lag_bucket_count; ++i)
+          tr_variantGetInt (tr_variantListChild (list, i), &sample->lag_bounds[i]);
+    }
+  tr_variantFree (&top);
+
+  sample->done = true;
+}
+
+static void
+takeSample (tr_session * session, struct session_sample * sample)
+{
+  memset (sample, 0, sizeof (struct session_sample));
+  sample->session = session;
+  tr_runInEventThread (session, sampleSessionThread, sample);
+  while (!sample->done)
+    tr_wait_msec (10);
+}
+
+static void
+printLag (const struct session_sample * a, const struct session_sample * b)
+{
+  size_t i;
+  const uint64_t count = b->lag_count - a->lag_count;
+
+  if (count == 0)
+    {
+      printf ("event loop lag:     n/a\n");
+      return;
+    }
+
+  printf ("event loop lag:     %.1f ms mean, p99 ",
+          (b->lag_sum_usec - a->lag_sum_usec) / 1000.0 / count);
+
+  for (i=0; i<b->lag_bucket_count; ++i)
+    if ((uint64_t)(b->lag_buckets[i] - a->lag_buckets[i]) * 100 >= count * 99)
+      break;
+
+  if (i < b->lag_bucket_count)
+    printf ("<= %.0f ms\n", b->lag_bounds[i] / 1000.0);
+  else
+    printf ("> %.0f ms\n", b->lag_bounds[b->lag_bucket_count-1] / 1000.0);
+}
+
+/* where the peers' time went, per tr_peer_stall */
+static void
+printStalls (tr_torrent * tor, tr_direction dir)
+{
+  int i;
+  uint64_t total = 0;
+  const char * delim = "";
+  const tr_stat * st = tr_torrentStat (tor);
+  static const char * names[TR_PEER_STALL_COUNT] = { "uninterested", "choked", "speed limit",
+                                                     "moving", "no requests",
+                                                     "buffer full", "disk", "peer" };
+
+  for (i=0; i<TR_PEER_STALL_COUNT; ++i)
+    total += st->stallMsec[dir][i];
+
+  printf ("%s", dir == TR_UP ? "upload stalls:      " : "download stalls:    ");
+  if (total == 0)
+    printf ("n/a");
+  for (i=0; total>0 && i<TR_PEER_STALL_COUNT; ++i)
+    if (st->stallMsec[dir][i] > 0)
+      {
+        printf ("%s%.0f%% %s", delim, (100.0 * st->stallMsec[dir][i]) / total, names[i]);
+        delim = ", ";
+      }
+  printf ("\n");
+}
+
+/***
+****
+***/
+
+static tr_torrent *
+createTorrent (tr_session * session, const struct swarm * swarm)
+{
+  char * payload_dir;
+  char * payload;
+  char * torrent_file;
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  tr_metainfo_builder * builder;
+  const char * sandbox = tr_sessionGetConfigDir (session);
+
+  /* when the peers are seeding, keep the payload out of the session's way */
+  if (swarm->upload)
+    payload_dir = tr_strdup (tr_sessionGetDownloadDir (session));
+  else
+    payload_dir = tr_buildPath (sandbox, "payload", NULL);
+  tr_sys_dir_create (payload_dir, TR_SYS_DIR_CREATE_PARENTS, 0700, NULL);
+  payload = tr_buildPath (payload_dir, "swarm-bench.dat", NULL);
+  torrent_file = tr_buildPath (sandbox, "swarm-bench.torrent", NULL);
+
+  if (!writePayloadFile (payload, swarm->total_size))
+    {
+      fprintf (stderr, "Couldn't write \"%s\": %s\n", payload, tr_strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+
+  builder = tr_metaInfoBuilderCreate (payload);
+  tr_makeMetaInfo (builder, torrent_file, NULL, 0, NULL, false);
+  while (!builder->isDone)
+    tr_wait_msec (50);
+  if (builder->result != TR_MAKEMETA_OK)
+    {
+      fprintf (stderr, "Couldn't create \"%s\"\n", torrent_file);
+      exit (EXIT_FAILURE);
+    }
+  tr_metaInfoBuilderFree (builder);
+
+  if (!swarm->upload)
+    tr_sys_path_remove (payload, NULL);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfoFromFile (ctor, torrent_file);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, NULL, NULL);
+  tr_ctorFree (ctor);
+  assert (tor != NULL);
+
+  libttest_blockingTorrentVerify (tor);
+  tr_torrentStart (tor);
+
+  tr_free (torrent_file);
+  tr_free (payload);
+  tr_free (payload_dir);
+  return tor;
+}
+
+static tr_session *
+createSession (const struct swarm * swarm)
+{
+  tr_variant settings;
+  tr_session * session;
+  const int peer_limit = swarm->peer_count + 20;
+
+  tr_variantInitDict (&settings, 10);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_port, swarm->port);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_limit_global, peer_limit);
+  tr_variantDictAddInt (&settings, TR_KEY_peer_limit_per_torrent, peer_limit);
+  tr_variantDictAddInt (&settings, TR_KEY_upload_slots_per_torrent, swarm->peer_count);
+  tr_variantDictAddInt (&settings, TR_KEY_encryption, TR_CLEAR_PREFERRED);
+  tr_variantDictAddBool (&settings, TR_KEY_utp_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&settings, TR_KEY_pex_enabled, false);
+  session = libttest_session_init (&settings);
+  tr_variantFree (&settings);
+
+  return session;
+}
+
+int
+main (int argc, const char ** argv)
+{
+  int c;
+  const char * optarg;
+  int seconds = 60;
+  int size_mib = 128;
+  struct swarm swarm;
+  tr_session * session;
+  tr_torrent * tor;
+  struct session_sample sample_begin;
+  struct session_sample sample_end;
+  uint64_t process_cpu;
+  uint64_t rss_begin;
+  uint64_t rss_peers = 0;
+  uint64_t begin;
+  uint64_t end;
+  double secs;
+  double gb;
+
+  memset (&swarm, 0, sizeof (struct swarm));
+  swarm.peer_count = 20;
+  swarm.port = 51999;
+  swarm.availability = -1;
+
+  while ((c = tr_getopt (getUsage (), argc, argv, options, &optarg)))
+    {
+      switch (c)
+        {
+          case 'a': swarm.availability = atoi (optarg); break;
+          case 'b': swarm.bandwidth_Bps = atoi (optarg) * 1024; break;
+          case 'l': swarm.latency_msec = atoi (optarg); break;
+          case 'n': swarm.peer_count = MAX (1, atoi (optarg)); break;
+          case 'p': swarm.port = atoi (optarg); break;
+          case 's': size_mib = MAX (1, atoi (optarg)); break;
+          case 't': seconds = MAX (1, atoi (optarg)); break;
+          case 'u': swarm.upload = true; break;
+          default:
+            tr_getopt_usage (MY_NAME, getUsage (), options);
+            return EXIT_FAILURE;
+        }
+    }
+
+  /* by default the seeding peers each have half of the pieces
+     and the leeching peers have none */
+  if (swarm.availability < 0)
+    swarm.availability = swarm.upload ? 0 : 50;
+
+  srand (1);
+  initPattern ();
+  swarm.total_size = (uint64_t)size_mib * 1024 * 1024;
+
+  session = createSession (&swarm);
+  tor = createTorrent (session, &swarm);
+  memcpy (swarm.info_hash, tor->info.hash, SHA_DIGEST_LENGTH);
+  swarm.piece_size = tor->info.pieceSize;
+  swarm.piece_count = tor->info.pieceCount;
+  swarm.block_count = (swarm.total_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  assert (tor->blockSize == BLOCK_SIZE);
+
+  printf ("%d peers %s %d MiB, %d ms latency, %d KiB/s each, %d%% availability\n",
+          swarm.peer_count, swarm.upload ? "leeching" : "seeding", size_mib,
+          swarm.latency_msec, swarm.bandwidth_Bps / 1024, swarm.availability);
+
+  rss_begin = residentBytes ();
+  takeSample (session, &sample_begin);
+  process_cpu = processCpuUsec ();
+  begin = now_usec ();
+
+  tr_threadNew (swarmThreadFunc, &swarm);
+
+  for (;;)
+    {
+      tr_wait_msec (50);
+      end = now_usec ();
+
+      if (!rss_peers && swarm.handshaken + swarm.closed >= swarm.peer_count)
+        rss_peers = residentBytes ();
+
+      if (end - begin >= (uint64_t)seconds * 1000000u)
+        break;
+
+      if (swarm.closed >= swarm.peer_count)
+        break;
+
+      if (!swarm.upload && tr_torrentStat (tor)->leftUntilDone == 0)
+        break;
+    }
+
+  takeSample (session, &sample_end);
+  process_cpu = processCpuUsec () - process_cpu;
+  swarm.stop = true;
+  while (!swarm.done)
+    tr_wait_msec (10);
+
+  /* time the transfer from its first byte, since the session
+     can take a while to unchoke leeching peers */
+  if (swarm.first_byte_usec)
+    begin = swarm.first_byte_usec;
+  secs = MAX (end - begin, 1) / 1000000.0;
+  gb = swarm.payload_bytes / 1000000000.0;
+
+  printf ("peers connected:    %d of %d\n", swarm.handshaken, swarm.peer_count);
+  printf ("payload:            %.1f MiB in %.2f s\n", swarm.payload_bytes / 1048576.0, secs);
+  printf ("throughput:         %.1f MiB/s\n", swarm.payload_bytes / 1048576.0 / secs);
+  if (gb > 0)
+    printf ("cpu per GB:         %.2f s in the session thread, %.2f s in the process\n",
+            (sample_end.thread_cpu_usec - sample_begin.thread_cpu_usec) / 1000000.0 / gb,
+            process_cpu / 1000000.0 / gb);
+  printLag (&sample_begin, &sample_end);
+  printStalls (tor, swarm.upload ? TR_UP : TR_DOWN);
+  if (rss_begin && rss_peers > rss_begin)
+    printf ("memory per peer:    %.1f KiB\n", (rss_peers - rss_begin) / 1024.0 / swarm.peer_count);
+  else
+    printf ("memory per peer:    n/a\n");
+  if (!swarm.upload)
+    printf ("download complete:  %s\n", tr_torrentStat (tor)->leftUntilDone == 0 ? "yes" : "no");
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  tr_free (pattern);
+  return 0;
+}
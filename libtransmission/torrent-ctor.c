@@ -133,11 +133,24 @@ int
 tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
                             const char * filename)
 {
-    uint8_t * metainfo;
-    size_t    len;
     int       err;
+    size_t    len;
+    uint8_t * metainfo = tr_loadFile (filename, &len);
+
+    err = tr_ctorSetMetainfoFromFileContents (ctor, filename, metainfo, len);
+
+    tr_free (metainfo);
+    return err;
+}
+
+int
+tr_ctorSetMetainfoFromFileContents (tr_ctor       * ctor,
+                                    const char    * filename,
+                                    const uint8_t * metainfo,
+                                    size_t          len)
+{
+    int err;
 
-    metainfo = tr_loadFile (filename, &len);
     if (metainfo && len)
         err = tr_ctorSetMetainfo (ctor, metainfo, len);
     else
@@ -167,7 +180,6 @@ tr_ctorSetMetainfoFromFile (tr_ctor *    ctor,
         }
     }
 
-    tr_free (metainfo);
     return err;
 }
 
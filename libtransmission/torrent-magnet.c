@@ -8,17 +8,20 @@
  */
 
 #include <assert.h>
-#include <string.h> /* memcpy (), memset (), memcmp () */
+#include <string.h> /* memcpy (), memmove (), memset (), memcmp () */
 
 #include <event2/buffer.h>
 
 #include "transmission.h"
-#include "crypto.h" /* tr_sha1 () */
+#include "bitfield.h"
+#include "crypto.h" /* tr_sha1_init () */
 #include "file.h"
 #include "log.h"
 #include "magnet.h"
 #include "metainfo.h"
+#include "ptrarray.h"
 #include "resume.h"
+#include "session.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
 #include "utils.h"
@@ -58,11 +61,23 @@ struct tr_incomplete_metadata
   /** sorted from least to most recently requested */
   struct metadata_node * piecesNeeded;
   int piecesNeededCount;
+
+  /* the pieces we've received so far */
+  tr_bitfield have;
+
+  /* the checksum is computed as the pieces arrive: `sha' has seen
+     everything before piece `hashedCount', so when the last piece
+     comes in there's little left to hash */
+  tr_sha1_ctx_t sha;
+  int hashedCount;
 };
 
 static void
 incompleteMetadataFree (struct tr_incomplete_metadata * m)
 {
+  if (m->sha != NULL)
+    tr_sha1_final (m->sha, NULL);
+  tr_bitfieldDestruct (&m->have);
   tr_free (m->metadata);
   tr_free (m->piecesNeeded);
   tr_free (m);
@@ -86,6 +101,9 @@ tr_torrentSetMetadataSizeHint (tr_torrent * tor, int size)
           m->metadata_size = size;
           m->piecesNeededCount = n;
           m->piecesNeeded = tr_new (struct metadata_node, n);
+          tr_bitfieldConstruct (&m->have, n);
+          m->sha = tr_sha1_init ();
+          m->hashedCount = 0;
 
           for (i=0; i<n; ++i)
             {
@@ -144,55 +162,266 @@ ensureInfoDictOffsetIsCached (tr_torrent * tor)
     }
 }
 
-void*
-tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, int * len)
+/***
+****  Peers that join through magnet links ask for the info dict a piece at
+****  a time, so the most recently served info dicts are kept in memory
+****  instead of reading the .torrent file again for every piece.
+****  Pieces are handed out as references into the cached entry, which
+****  lives until it's been evicted and the last reference is drained.
+***/
+
+enum
 {
-  char * ret = NULL;
+  METADATA_CACHE_MAX_BYTES = 8 * 1024 * 1024,
 
-  assert (tr_isTorrent (tor));
-  assert (piece >= 0);
-  assert (len != NULL);
+  /* bigger info dicts are read from the file as before */
+  METADATA_CACHE_MAX_ENTRY_BYTES = METADATA_CACHE_MAX_BYTES / 4
+};
 
-  if (tr_torrentHasMetadata (tor))
+struct metadata_cache_entry
+{
+  uint8_t hash[SHA_DIGEST_LENGTH];
+  uint8_t * bytes;
+  int len;
+
+  /* one for being in the cache, plus one per evbuffer reference */
+  int refcount;
+};
+
+struct tr_metadata_cache
+{
+  tr_ptrArray entries; /* struct metadata_cache_entry*, most recently used first */
+  size_t bytes;
+};
+
+static void
+metadataCacheEntryUnref (struct metadata_cache_entry * entry)
+{
+  if (--entry->refcount == 0)
     {
-      tr_sys_file_t fd;
+      tr_free (entry->bytes);
+      tr_free (entry);
+    }
+}
 
-      ensureInfoDictOffsetIsCached (tor);
+static void
+onMetadataReferenceDone (const void * data UNUSED, size_t len UNUSED, void * ventry)
+{
+  metadataCacheEntryUnref (ventry);
+}
 
-      assert (tor->infoDictLength > 0);
-      assert (tor->infoDictOffset >= 0);
+static struct metadata_cache_entry *
+metadataCacheGet (tr_torrent * tor)
+{
+  int i, n;
+  uint64_t got;
+  tr_sys_file_t fd;
+  struct metadata_cache_entry * entry;
+  struct tr_metadata_cache * cache = tor->session->metadataCache;
 
-      fd = tr_sys_file_open (tor->info.torrent, TR_SYS_FILE_READ, 0, NULL);
-      if (fd != TR_BAD_SYS_FILE)
+  if (cache == NULL)
+    {
+      cache = tor->session->metadataCache = tr_new0 (struct tr_metadata_cache, 1);
+      cache->entries = TR_PTR_ARRAY_INIT;
+    }
+
+  for (i=0, n=tr_ptrArraySize (&cache->entries); i<n; ++i)
+    {
+      entry = tr_ptrArrayNth (&cache->entries, i);
+
+      if (!memcmp (entry->hash, tor->info.hash, SHA_DIGEST_LENGTH))
         {
-          const int o = piece  * METADATA_PIECE_SIZE;
+          tr_ptrArrayRemove (&cache->entries, i);
+          tr_ptrArrayInsert (&cache->entries, entry, 0);
+          return entry;
+        }
+    }
 
-          if (tr_sys_file_seek (fd, tor->infoDictOffset + o, TR_SEEK_SET, NULL, NULL))
-            {
-              const int l = o + METADATA_PIECE_SIZE <= tor->infoDictLength
-                          ? METADATA_PIECE_SIZE
-                          : tor->infoDictLength - o;
+  if (tor->infoDictLength > METADATA_CACHE_MAX_ENTRY_BYTES)
+    return NULL;
 
-              if (0<l && l<=METADATA_PIECE_SIZE)
-                {
-                  char * buf = tr_new (char, l);
-                  uint64_t n;
-                  if (tr_sys_file_read (fd, buf, l, &n, NULL) && n == (unsigned int) l)
-                    {
-                      *len = l;
-                      ret = buf;
-                      buf = NULL;
-                    }
+  fd = tr_sys_file_open (tor->info.torrent, TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
+  if (fd == TR_BAD_SYS_FILE)
+    return NULL;
 
-                  tr_free (buf);
-                }
-            }
+  entry = tr_new0 (struct metadata_cache_entry, 1);
+  entry->bytes = tr_new (uint8_t, tor->infoDictLength);
+  entry->len = tor->infoDictLength;
+  entry->refcount = 1;
+  memcpy (entry->hash, tor->info.hash, SHA_DIGEST_LENGTH);
+
+  if (!tr_sys_file_read_at (fd, entry->bytes, entry->len, tor->infoDictOffset, &got, NULL)
+      || got != (uint64_t) entry->len)
+    {
+      tr_sys_file_close (fd, NULL);
+      metadataCacheEntryUnref (entry);
+      return NULL;
+    }
+
+  tr_sys_file_close (fd, NULL);
+
+  tr_ptrArrayInsert (&cache->entries, entry, 0);
+  cache->bytes += entry->len;
+
+  while (cache->bytes > METADATA_CACHE_MAX_BYTES)
+    {
+      struct metadata_cache_entry * oldest = tr_ptrArrayPop (&cache->entries);
+      cache->bytes -= oldest->len;
+      metadataCacheEntryUnref (oldest);
+    }
+
+  return entry;
+}
+
+void
+tr_metadataCacheFree (tr_session * session)
+{
+  struct tr_metadata_cache * cache = session->metadataCache;
+
+  if (cache != NULL)
+    {
+      while (!tr_ptrArrayEmpty (&cache->entries))
+        metadataCacheEntryUnref (tr_ptrArrayPop (&cache->entries));
+
+      tr_ptrArrayDestruct (&cache->entries, NULL);
+      tr_free (cache);
+      session->metadataCache = NULL;
+    }
+}
+
+uint64_t
+tr_metadataGetMemoryUsage (tr_session * session)
+{
+  uint64_t bytes = 0;
+  tr_torrent * tor = NULL;
+
+  if (session->metadataCache != NULL)
+    bytes += session->metadataCache->bytes;
+
+  while ((tor = tr_torrentNext (session, tor)))
+    if (tor->incompleteMetadata != NULL)
+      bytes += tor->incompleteMetadata->metadata_size;
+
+  return bytes;
+}
+
+int
+tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, struct evbuffer * out)
+{
+  int o, l;
+  struct metadata_cache_entry * entry;
+
+  assert (tr_isTorrent (tor));
+  assert (piece >= 0);
+  assert (out != NULL);
+
+  if (!tr_torrentHasMetadata (tor))
+    return 0;
+
+  ensureInfoDictOffsetIsCached (tor);
 
-          tr_sys_file_close (fd, NULL);
+  assert (tor->infoDictLength > 0);
+  assert (tor->infoDictOffset >= 0);
+
+  o = piece * METADATA_PIECE_SIZE;
+  l = o + METADATA_PIECE_SIZE <= tor->infoDictLength
+    ? METADATA_PIECE_SIZE
+    : tor->infoDictLength - o;
+
+  if (l <= 0 || l > METADATA_PIECE_SIZE)
+    return 0;
+
+  if ((entry = metadataCacheGet (tor)) != NULL)
+    {
+      ++entry->refcount;
+      if (evbuffer_add_reference (out, entry->bytes + o, l, onMetadataReferenceDone, entry) != 0)
+        {
+          metadataCacheEntryUnref (entry);
+          return 0;
         }
     }
+  else
+    {
+      uint64_t n = 0;
+      struct evbuffer_iovec iovec;
+      tr_sys_file_t fd = tr_sys_file_open (tor->info.torrent, TR_SYS_FILE_READ, 0, NULL);
+
+      if (fd == TR_BAD_SYS_FILE)
+        return 0;
+
+      evbuffer_reserve_space (out, l, &iovec, 1);
+      if (!tr_sys_file_read_at (fd, iovec.iov_base, l, tor->infoDictOffset + o, &n, NULL))
+        n = 0;
+      tr_sys_file_close (fd, NULL);
+
+      if (n != (uint64_t) l)
+        return 0;
+
+      iovec.iov_len = l;
+      evbuffer_commit_space (out, &iovec, 1);
+    }
+
+  return l;
+}
+
+/* feed any newly-contiguous pieces to the running checksum */
+static void
+hashContiguousPieces (struct tr_incomplete_metadata * m)
+{
+  while (m->hashedCount < m->pieceCount && tr_bitfieldHas (&m->have, m->hashedCount))
+    {
+      const int offset = m->hashedCount * METADATA_PIECE_SIZE;
+      const int len = MIN (METADATA_PIECE_SIZE, m->metadata_size - offset);
+
+      tr_sha1_update (m->sha, m->metadata + offset, len);
+      ++m->hashedCount;
+    }
+}
+
+static void
+resetIncompleteMetadata (struct tr_incomplete_metadata * m)
+{
+  int i;
+  const int n = m->pieceCount;
+
+  for (i=0; i<n; ++i)
+    {
+      m->piecesNeeded[i].piece = i;
+      m->piecesNeeded[i].requestedAt = 0;
+    }
+  m->piecesNeededCount = n;
+
+  tr_bitfieldSetHasNone (&m->have);
+  tr_sha1_final (m->sha, NULL);
+  m->sha = tr_sha1_init ();
+  m->hashedCount = 0;
+}
+
+/**
+ * Write the stub .torrent back out with the info dict in it.
+ * The info dict's bytes are already at hand, so note where they
+ * landed in the file instead of re-reading it in findInfoDictOffset ().
+ */
+static bool
+saveTorrentFile (tr_torrent * tor, const tr_variant * metainfo)
+{
+  bool saved = false;
+  struct evbuffer * buf = tr_variantToBuf (metainfo, TR_VARIANT_FMT_BENC);
+  const struct tr_incomplete_metadata * m = tor->incompleteMetadata;
+
+  if (!tr_variantBufToFile (buf, tor->info.torrent))
+    {
+      const size_t len = evbuffer_get_length (buf);
+      const char * contents = (const char*) evbuffer_pullup (buf, -1);
+      const char * info = tr_memmem (contents, len, (const char*) m->metadata, m->metadata_size);
+
+      tor->infoDictOffset = info != NULL ? info - contents : 0;
+      tor->infoDictOffsetIsCached = info != NULL;
+      saved = true;
+    }
 
-    return ret;
+  evbuffer_free (buf);
+  return saved;
 }
 
 void
@@ -216,13 +445,21 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
     return;
 
   /* do we need this piece? */
+  if ((piece < 0) || (piece >= m->pieceCount) || tr_bitfieldHas (&m->have, piece))
+    return;
   for (i=0; i<m->piecesNeededCount; ++i)
     if (m->piecesNeeded[i].piece == piece)
       break;
   if (i==m->piecesNeededCount)
     return;
 
+  /* every piece but the last one must be full-sized */
+  if (len != MIN (METADATA_PIECE_SIZE, m->metadata_size - offset))
+    return;
+
   memcpy (m->metadata + offset, data, len);
+  tr_bitfieldAdd (&m->have, piece);
+  hashContiguousPieces (m);
 
   tr_removeElementFromArray (m->piecesNeeded, i,
                              sizeof (struct metadata_node),
@@ -238,22 +475,28 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
       bool metainfoParsed = false;
       uint8_t sha1[SHA_DIGEST_LENGTH];
 
-      /* we've got a complete set of metainfo... see if it passes the checksum test */
+      /* we've got a complete set of metainfo... see if it passes the checksum test.
+         all the pieces are in, so the running checksum has seen all of them */
       dbgmsg (tor, "metainfo piece %d was the last one", piece);
-      tr_sha1 (sha1, m->metadata, m->metadata_size, NULL);
+      assert (m->hashedCount == m->pieceCount);
+      tr_sha1_final (m->sha, sha1);
+      m->sha = NULL;
       if ((checksumPassed = !memcmp (sha1, tor->info.hash, SHA_DIGEST_LENGTH)))
         {
-          /* checksum passed; now try to parse it as benc */
-          tr_variant infoDict;
-          const int err = tr_variantFromBenc (&infoDict, m->metadata, m->metadata_size);
-          dbgmsg (tor, "err is %d", err);
-          if ((metainfoParsed = !err))
-            {
-              /* yay we have bencoded metainfo... merge it into our .torrent file */
-              tr_variant newMetainfo;
-              char * path = tr_strdup (tor->info.torrent);
+          tr_variant newMetainfo;
+          char * path = tr_strdup (tor->info.torrent);
 
-              if (!tr_variantFromFile (&newMetainfo, TR_VARIANT_FMT_BENC, path))
+          if (!tr_variantFromFile (&newMetainfo, TR_VARIANT_FMT_BENC, path))
+            {
+              int err;
+              tr_variant * infoDict;
+
+              /* checksum passed; now parse it straight into our .torrent's info dict */
+              tr_variantDictRemove (&newMetainfo, TR_KEY_info);
+              infoDict = tr_variantDictAdd (&newMetainfo, TR_KEY_info);
+              err = tr_variantFromBenc (infoDict, m->metadata, m->metadata_size);
+              dbgmsg (tor, "err is %d", err);
+              if ((metainfoParsed = !err))
                 {
                   bool hasInfo;
                   tr_info info;
@@ -264,7 +507,6 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
                   tr_torrentRemoveResume (tor);
 
                   dbgmsg (tor, "Saving completed metadata to \"%s\"", path);
-                  tr_variantMergeDicts (tr_variantDictAddDict (&newMetainfo, TR_KEY_info, 0), &infoDict);
 
                   memset (&info, 0, sizeof (tr_info));
                   success = tr_metainfoParse (tor->session, &newMetainfo, &info, &hasInfo, &infoDictLength);
@@ -282,18 +524,17 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
                       tor->infoDictLength = infoDictLength;
 
                       /* save the new .torrent file */
-                      tr_variantToFile (&newMetainfo, TR_VARIANT_FMT_BENC, tor->info.torrent);
+                      saveTorrentFile (tor, &newMetainfo);
                       tr_sessionSetTorrentFile (tor->session, tor->info.hashString, tor->info.torrent);
                       tr_torrentGotNewInfoDict (tor);
                       tr_torrentSetDirty (tor);
                     }
-
-                  tr_variantFree (&newMetainfo);
                 }
 
-              tr_variantFree (&infoDict);
-              tr_free (path);
+              tr_variantFree (&newMetainfo);
             }
+
+          tr_free (path);
         }
 
       if (success)
@@ -306,14 +547,9 @@ tr_torrentSetMetadataPiece (tr_torrent  * tor, int piece, const void  * data, in
         }
         else /* drat. */
         {
-          const int n = m->pieceCount;
-          for (i=0; i<n; ++i)
-            {
-              m->piecesNeeded[i].piece = i;
-              m->piecesNeeded[i].requestedAt = 0;
-            }
-          m->piecesNeededCount = n;
-          dbgmsg (tor, "metadata error; trying again. %d pieces left", n);
+          /* we can't tell which piece was bad, so start over */
+          resetIncompleteMetadata (m);
+          dbgmsg (tor, "metadata error; trying again. %d pieces left", m->piecesNeededCount);
 
           tr_logAddError ("magnet status: checksum passed %d, metainfo parsed %d",
                   (int)checksumPassed, (int)metainfoParsed);
@@ -353,6 +589,32 @@ tr_torrentGetNextMetadataRequest (tr_torrent * tor, time_t now, int * setme_piec
   return have_request;
 }
 
+void
+tr_torrentMetadataPieceRejected (tr_torrent * tor, int piece)
+{
+  int i;
+  struct tr_incomplete_metadata * m;
+
+  assert (tr_isTorrent (tor));
+
+  m = tor->incompleteMetadata;
+  if (m == NULL)
+    return;
+
+  for (i=0; i<m->piecesNeededCount; ++i)
+    if (m->piecesNeeded[i].piece == piece)
+      break;
+  if (i==m->piecesNeededCount)
+    return;
+
+  /* let the next peer ask for it right away */
+  memmove (m->piecesNeeded + 1, m->piecesNeeded, sizeof (struct metadata_node) * i);
+  m->piecesNeeded[0].piece = piece;
+  m->piecesNeeded[0].requestedAt = 0;
+
+  dbgmsg (tor, "metadata piece %d was rejected", piece);
+}
+
 double
 tr_torrentGetMetadataPercent (const tr_torrent * tor)
 {
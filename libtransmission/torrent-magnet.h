@@ -22,12 +22,27 @@ enum
     METADATA_PIECE_SIZE = (1024 * 16)
 };
 
-void* tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, int * len);
+struct evbuffer;
+
+/**
+ * @brief append one of the torrent's metadata pieces to `out'
+ * @return the piece's length, or 0 if it couldn't be read
+ */
+int tr_torrentGetMetadataPiece (tr_torrent * tor, int piece, struct evbuffer * out);
+
+/** @brief free the session's cache of info dicts that were served to peers */
+void tr_metadataCacheFree (tr_session * session);
+
+/** @return the bytes held by that cache and by magnet links' partial info dicts */
+uint64_t tr_metadataGetMemoryUsage (tr_session * session);
 
 void tr_torrentSetMetadataPiece (tr_torrent * tor, int piece, const void * data, int len);
 
 bool tr_torrentGetNextMetadataRequest (tr_torrent * tor, time_t now, int * setme);
 
+/** @brief a peer said no, so make the piece available to other peers right away */
+void tr_torrentMetadataPieceRejected (tr_torrent * tor, int piece);
+
 void tr_torrentSetMetadataSizeHint (tr_torrent * tor, int metadata_size);
 
 double tr_torrentGetMetadataPercent (const tr_torrent * tor);
@@ -17,6 +17,7 @@
 #include <unistd.h> /* fork (), execvp (), _exit () */
 
 #include <assert.h>
+#include <ctype.h> /* isxdigit () */
 #include <math.h>
 #include <stdarg.h>
 #include <string.h> /* memcmp */
@@ -31,6 +32,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* for tr_sha1 */
+#include "delete.h"
 #include "error.h"
 #include "fdlimit.h" /* tr_fdTorrentClose */
 #include "file.h"
@@ -42,7 +44,9 @@
 #include "peer-mgr.h"
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
 #include "ptrarray.h"
+#include "relocate.h"
 #include "resume.h"
+#include "scrub.h"
 #include "session.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
@@ -80,12 +84,174 @@ tr_torrentId (const tr_torrent * tor)
   return tor ? tor->uniqueId : -1;
 }
 
+/***
+****  Torrent Index
+***/
+
+enum
+{
+  MIN_TORRENT_BUCKET_COUNT = 64,
+
+  /* how far ahead of the streaming position to read, by default */
+  DEFAULT_STREAMING_WINDOW = 16 * 1024 * 1024
+};
+
+static inline size_t
+getIdBucket (const tr_session * session, int id)
+{
+  return ((size_t)id * 2654435761u) & (session->torrentIndex.bucketCount - 1);
+}
+
+/* SHA1 digests are already well-distributed */
+static inline size_t
+getHashBucket (const tr_session * session, const uint8_t * hash)
+{
+  const size_t h = ((size_t)hash[0] << 24) | ((size_t)hash[1] << 16)
+                 | ((size_t)hash[2] << 8) | (size_t)hash[3];
+
+  return h & (session->torrentIndex.bucketCount - 1);
+}
+
+static void
+torrentIndexLink (tr_session * session, tr_torrent * tor)
+{
+  size_t bucket;
+
+  bucket = getIdBucket (session, tor->uniqueId);
+  tor->idNext = session->torrentIndex.byId[bucket];
+  session->torrentIndex.byId[bucket] = tor;
+
+  bucket = getHashBucket (session, tor->info.hash);
+  tor->hashNext = session->torrentIndex.byHash[bucket];
+  session->torrentIndex.byHash[bucket] = tor;
+
+  bucket = getHashBucket (session, tor->obfuscatedHash);
+  tor->obfuscatedHashNext = session->torrentIndex.byObfuscatedHash[bucket];
+  session->torrentIndex.byObfuscatedHash[bucket] = tor;
+}
+
+/* rebuild the index from session->torrentList with a new bucket count */
+static void
+torrentIndexRehash (tr_session * session, size_t bucketCount)
+{
+  tr_torrent * tor;
+
+  tr_free (session->torrentIndex.byId);
+  tr_free (session->torrentIndex.byHash);
+  tr_free (session->torrentIndex.byObfuscatedHash);
+
+  session->torrentIndex.byId = tr_new0 (tr_torrent*, bucketCount);
+  session->torrentIndex.byHash = tr_new0 (tr_torrent*, bucketCount);
+  session->torrentIndex.byObfuscatedHash = tr_new0 (tr_torrent*, bucketCount);
+  session->torrentIndex.bucketCount = bucketCount;
+
+  for (tor=session->torrentList; tor!=NULL; tor=tor->next)
+    torrentIndexLink (session, tor);
+}
+
+/* add a torrent that's just been added to session->torrentList */
+static void
+torrentIndexAdd (tr_session * session, tr_torrent * tor)
+{
+  const size_t bucketCount = session->torrentIndex.bucketCount;
+
+  if ((size_t)session->torrentCount > bucketCount)
+    torrentIndexRehash (session, MAX (MIN_TORRENT_BUCKET_COUNT, bucketCount * 2));
+  else
+    torrentIndexLink (session, tor);
+}
+
+static void
+torrentIndexRemove (tr_session * session, tr_torrent * tor)
+{
+  tr_torrent ** walk;
+
+  walk = &session->torrentIndex.byId[getIdBucket (session, tor->uniqueId)];
+  while (*walk != tor)
+    walk = &(*walk)->idNext;
+  *walk = tor->idNext;
+
+  walk = &session->torrentIndex.byHash[getHashBucket (session, tor->info.hash)];
+  while (*walk != tor)
+    walk = &(*walk)->hashNext;
+  *walk = tor->hashNext;
+
+  walk = &session->torrentIndex.byObfuscatedHash[getHashBucket (session, tor->obfuscatedHash)];
+  while (*walk != tor)
+    walk = &(*walk)->obfuscatedHashNext;
+  *walk = tor->obfuscatedHashNext;
+}
+
+/***
+****  Queue Order
+***/
+
+/* bring queue[begin..end)'s queuePositions up to date after a move */
+static void
+queueRenumber (tr_session * session, int begin, int end)
+{
+  int i;
+  const time_t now = tr_time ();
+
+  for (i=begin; i<end; ++i)
+    {
+      tr_torrent * tor = session->queue[i];
+
+      if (tor->queuePosition != i)
+        {
+          tor->queuePosition = i;
+          tor->anyDate = now;
+        }
+    }
+}
+
+/* add a torrent that's just been added to session->torrentList */
+static void
+queueAppend (tr_session * session, tr_torrent * tor)
+{
+  const int n = session->torrentCount;
+
+  if (session->queueAlloc < n)
+    {
+      session->queueAlloc = MAX (MIN_TORRENT_BUCKET_COUNT, session->queueAlloc * 2);
+      session->queue = tr_renew (tr_torrent *, session->queue, session->queueAlloc);
+    }
+
+  session->queue[n-1] = tor;
+  tor->queuePosition = n-1;
+}
+
+/* remove a torrent that's just been removed from session->torrentList */
+static void
+queueRemove (tr_session * session, tr_torrent * tor)
+{
+  const int pos = tor->queuePosition;
+  const int n = session->torrentCount;
+
+  assert (session->queue[pos] == tor);
+
+  memmove (session->queue + pos,
+           session->queue + pos + 1,
+           sizeof (tr_torrent *) * (n - pos));
+  queueRenumber (session, pos, n);
+
+  if (tr_torrentIsQueued (tor))
+    session->queuedCount--;
+}
+
+/***
+****
+***/
+
 tr_torrent*
 tr_torrentFindFromId (tr_session * session, int id)
 {
-  tr_torrent * tor = NULL;
+  tr_torrent * tor;
 
-  while ((tor = tr_torrentNext (session, tor)))
+  if (session->torrentIndex.bucketCount == 0)
+    return NULL;
+
+  for (tor=session->torrentIndex.byId[getIdBucket (session, id)]; tor!=NULL; tor=tor->idNext)
     if (tor->uniqueId == id)
       return tor;
 
@@ -95,24 +261,31 @@ tr_torrentFindFromId (tr_session * session, int id)
 tr_torrent*
 tr_torrentFindFromHashString (tr_session *  session, const char * str)
 {
-  tr_torrent * tor = NULL;
+  const char * walk;
+  uint8_t hash[SHA_DIGEST_LENGTH];
 
-  while ((tor = tr_torrentNext (session, tor)))
-    if (!evutil_ascii_strcasecmp (str, tor->info.hashString))
-      return tor;
+  for (walk=str; *walk!='\0'; ++walk)
+    if (!isxdigit ((unsigned char)*walk))
+      return NULL;
 
-  return NULL;
+  if (walk - str != SHA_DIGEST_LENGTH * 2)
+    return NULL;
+
+  tr_hex_to_sha1 (hash, str);
+  return tr_torrentFindFromHash (session, hash);
 }
 
 tr_torrent*
 tr_torrentFindFromHash (tr_session * session, const uint8_t * torrentHash)
 {
-  tr_torrent * tor = NULL;
+  tr_torrent * tor;
 
-  while ((tor = tr_torrentNext (session, tor)))
-    if (*tor->info.hash == *torrentHash)
-      if (!memcmp (tor->info.hash, torrentHash, SHA_DIGEST_LENGTH))
-        return tor;
+  if (session->torrentIndex.bucketCount == 0)
+    return NULL;
+
+  for (tor=session->torrentIndex.byHash[getHashBucket (session, torrentHash)]; tor!=NULL; tor=tor->hashNext)
+    if (!memcmp (tor->info.hash, torrentHash, SHA_DIGEST_LENGTH))
+      return tor;
 
   return NULL;
 }
@@ -136,9 +309,13 @@ tr_torrent*
 tr_torrentFindFromObfuscatedHash (tr_session * session,
                                   const uint8_t * obfuscatedTorrentHash)
 {
-  tr_torrent * tor = NULL;
+  tr_torrent * tor;
 
-  while ((tor = tr_torrentNext (session, tor)))
+  if (session->torrentIndex.bucketCount == 0)
+    return NULL;
+
+  for (tor=session->torrentIndex.byObfuscatedHash[getHashBucket (session, obfuscatedTorrentHash)];
+       tor!=NULL; tor=tor->obfuscatedHashNext)
     if (!memcmp (tor->obfuscatedHash, obfuscatedTorrentHash, SHA_DIGEST_LENGTH))
       return tor;
 
@@ -302,6 +479,7 @@ tr_torrentSetRatioMode (tr_torrent *  tor, tr_ratiolimit mode)
     {
       tor->ratioLimitMode = mode;
 
+      tr_torrentSeedLimitChanged (tor);
       tr_torrentSetDirty (tor);
     }
 }
@@ -323,6 +501,7 @@ tr_torrentSetRatioLimit (tr_torrent * tor, double desiredRatio)
     {
       tor->desiredRatio = desiredRatio;
 
+      tr_torrentSeedLimitChanged (tor);
       tr_torrentSetDirty (tor);
     }
 }
@@ -411,6 +590,7 @@ tr_torrentSetIdleMode (tr_torrent *  tor, tr_idlelimit mode)
     {
       tor->idleLimitMode = mode;
 
+      tr_torrentSeedLimitChanged (tor);
       tr_torrentSetDirty (tor);
     }
 }
@@ -432,6 +612,7 @@ tr_torrentSetIdleLimit (tr_torrent * tor, uint16_t idleMinutes)
     {
       tor->idleLimitMinutes = idleMinutes;
 
+      tr_torrentSeedLimitChanged (tor);
       tr_torrentSetDirty (tor);
     }
 }
@@ -471,26 +652,56 @@ tr_torrentGetSeedIdle (const tr_torrent * tor, uint16_t * idleMinutes)
   return isLimited;
 }
 
+/* the soonest the idle limit can be reached, if the torrent has one.
+   new activity only pushes it back */
 static bool
-tr_torrentIsSeedIdleLimitDone (tr_torrent * tor)
+tr_torrentGetSeedIdleDeadline (const tr_torrent * tor, time_t * deadline)
 {
   uint16_t idleMinutes;
-  return tr_torrentGetSeedIdle (tor, &idleMinutes)
-    && difftime (tr_time (), MAX (tor->startDate, tor->activityDate)) >= idleMinutes * 60u;
+
+  if (!tr_torrentGetSeedIdle (tor, &idleMinutes))
+    return false;
+
+  *deadline = MAX (tor->startDate, tor->activityDate) + idleMinutes * 60;
+  return true;
+}
+
+static bool
+tr_torrentIsSeedIdleLimitDone (tr_torrent * tor)
+{
+  time_t deadline;
+  return tr_torrentGetSeedIdleDeadline (tor, &deadline) && tr_time () >= deadline;
 }
 
 /***
 ****
 ***/
 
+void
+tr_torrentSeedLimitChanged (tr_torrent * tor)
+{
+  tor->seedLimitCheckAt = 0;
+}
+
+/**
+ * This is called every bandwidth pulse, so usually it returns right away.
+ * The ratio limit can only be reached when the torrent uploads or its
+ * limits change, and both call tr_torrentSeedLimitChanged (). The idle
+ * limit can't be reached before its deadline.
+ */
 void
 tr_torrentCheckSeedLimit (tr_torrent * tor)
 {
+  time_t deadline;
+
   assert (tr_isTorrent (tor));
 
   if (!tor->isRunning || tor->isStopping || !tr_torrentIsSeed (tor))
     return;
 
+  if (tr_time () < tor->seedLimitCheckAt)
+    return;
+
   /* if we're seeding and reach our seed ratio limit, stop the torrent */
   if (tr_torrentIsSeedRatioDone (tor))
     {
@@ -514,6 +725,31 @@ tr_torrentCheckSeedLimit (tr_torrent * tor)
       if (tor->idle_limit_hit_func != NULL)
         tor->idle_limit_hit_func (tor, tor->idle_limit_hit_func_user_data);
     }
+  else if (tr_torrentGetSeedIdleDeadline (tor, &deadline))
+    {
+      tor->seedLimitCheckAt = deadline;
+    }
+  else
+    {
+      tor->seedLimitCheckAt = INT_MAX; /* until something changes */
+    }
+}
+
+void
+tr_torrentUpdateActiveTime (tr_torrent * tor)
+{
+  const time_t now = tr_time ();
+
+  if (tor->activeSince != 0 && now > tor->activeSince)
+    {
+      if (tor->activeWasSeed)
+        tor->secondsSeeding += now - tor->activeSince;
+      else
+        tor->secondsDownloading += now - tor->activeSince;
+    }
+
+  tor->activeSince = tor->isRunning ? now : 0;
+  tor->activeWasSeed = tr_torrentIsSeed (tor);
 }
 
 /***
@@ -554,7 +790,6 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
     {
       case TR_TRACKER_PEERS:
         {
-          size_t i;
           const int8_t seedProbability = event->seedProbability;
           const bool allAreSeeds = seedProbability == 100;
 
@@ -563,8 +798,7 @@ onTrackerResponse (tr_torrent * tor, const tr_tracker_event * event, void * unus
           else
             tr_logAddTorDbg (tor, "Got %"TR_PRIuSIZE" peers from tracker", event->pexCount);
 
-          for (i = 0; i < event->pexCount; ++i)
-            tr_peerMgrAddPex (tor, TR_PEER_FROM_TRACKER, &event->pex[i], seedProbability);
+          tr_peerMgrAddPexList (tor, TR_PEER_FROM_TRACKER, event->pex, event->pexCount, NULL, seedProbability);
 
           break;
         }
@@ -754,6 +988,22 @@ tr_getBlockSize (uint32_t pieceSize)
 
 static void refreshCurrentDir (tr_torrent * tor);
 
+/* where tr_torrentFindFile2 () found a file */
+enum tr_file_location
+{
+  TR_FILE_LOCATION_UNKNOWN = 0,
+  TR_FILE_LOCATION_DOWNLOAD_DIR,
+  TR_FILE_LOCATION_INCOMPLETE_DIR,
+  TR_FILE_LOCATION_INCOMPLETE_DIR_PART,
+  TR_FILE_LOCATION_DOWNLOAD_DIR_PART
+};
+
+static void
+torrentForgetFileLocations (tr_torrent * tor)
+{
+  memset (tor->fileLocations, TR_FILE_LOCATION_UNKNOWN, tor->info.fileCount);
+}
+
 static void
 torrentInitFromInfo (tr_torrent * tor)
 {
@@ -804,9 +1054,17 @@ torrentInitFromInfo (tr_torrent * tor)
 
   tr_cpConstruct (&tor->completion, tor);
 
+  /* a magnet link is initialized again once its metainfo arrives */
+  tr_free (tor->fileLocations);
+  tor->fileLocations = tr_new0 (uint8_t, info->fileCount);
+  tr_free (tor->sharedFiles);
+  tor->sharedFiles = tr_new0 (struct tr_shared_file, info->fileCount);
+  tr_ioFreeSharedFileIndex (tor->session);
+
   tr_torrentInitFilePieces (tor);
 
   tor->completeness = tr_cpGetStatus (&tor->completion);
+  tr_torrentUpdateActiveTime (tor);
 }
 
 static void tr_torrentFireMetadataCompleted (tr_torrent * tor);
@@ -847,6 +1105,89 @@ setLocalErrorIfFilesDisappeared (tr_torrent * tor)
   return disappeared;
 }
 
+bool
+tr_torrentLoadPieceHashes (tr_torrent * tor)
+{
+  tr_variant top;
+  tr_variant * infoDict;
+  const uint8_t * raw;
+  const uint8_t * map;
+  size_t len;
+  size_t map_len;
+  tr_info * inf = &tor->info;
+
+  if ((inf->pieceHashes != NULL) || !inf->pieceCount)
+    return true;
+
+  if ((map = tr_mapFile (inf->torrent, &map_len)) != NULL)
+    {
+      /* leave the hashes where they are in the mapped file */
+      if (!tr_variantFromBencInPlace (&top, map, map_len))
+        {
+          if (tr_variantDictFindDict (&top, TR_KEY_info, &infoDict)
+              && tr_variantDictFindRaw (infoDict, TR_KEY_pieces, &raw, &len)
+              && (len == (size_t)inf->pieceCount * SHA_DIGEST_LENGTH))
+            {
+              inf->pieceHashes = (uint8_t*) raw;
+              tor->torrentFileMap = map;
+              tor->torrentFileMapSize = map_len;
+            }
+
+          tr_variantFree (&top);
+        }
+
+      if (tor->torrentFileMap == NULL)
+        tr_unmapFile (map, map_len);
+    }
+  else if (!tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, inf->torrent))
+    {
+      if (tr_variantDictFindDict (&top, TR_KEY_info, &infoDict)
+          && tr_variantDictFindRaw (infoDict, TR_KEY_pieces, &raw, &len)
+          && (len == (size_t)inf->pieceCount * SHA_DIGEST_LENGTH))
+        inf->pieceHashes = tr_memdup (raw, len);
+
+      tr_variantFree (&top);
+    }
+
+  return inf->pieceHashes != NULL;
+}
+
+static void
+freePieceHashes (tr_torrent * tor)
+{
+  if (tor->torrentFileMap != NULL)
+    {
+      tr_unmapFile (tor->torrentFileMap, tor->torrentFileMapSize);
+      tor->torrentFileMap = NULL;
+      tor->torrentFileMapSize = 0;
+    }
+  else
+    {
+      tr_free (tor->info.pieceHashes);
+    }
+
+  tor->info.pieceHashes = NULL;
+}
+
+void
+tr_torrentUnloadPieceHashes (tr_torrent * tor)
+{
+  /* only drop the hashes if we can get them back later */
+  if ((tor->info.pieceHashes != NULL) && tr_sys_path_exists (tor->info.torrent, NULL))
+    freePieceHashes (tor);
+}
+
+static bool
+setLocalErrorIfPieceHashesMissing (tr_torrent * tor)
+{
+  const bool missing = !tr_torrentLoadPieceHashes (tor);
+
+  if (missing)
+    tr_torrentSetLocalError (tor, _("Couldn't read piece hashes from \"%s\""), tor->info.torrent);
+
+  return missing;
+}
+
 static void
 torrentInit (tr_torrent * tor, const tr_ctor * ctor)
 {
@@ -865,6 +1206,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
   tor->uniqueId = nextUniqueId++;
   tor->magicNumber = TORRENT_MAGIC_NUMBER;
   tor->queuePosition = session->torrentCount;
+  tor->streamingWindow = DEFAULT_STREAMING_WINDOW;
 
   tr_sha1 (tor->obfuscatedHash, "req2", 4,
            tor->info.hash, SHA_DIGEST_LENGTH,
@@ -932,16 +1274,13 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
   /* add the torrent to tr_session.torrentList */
   session->torrentCount++;
   if (session->torrentList == NULL)
-    {
-      session->torrentList = tor;
-    }
+    session->torrentList = tor;
   else
-    {
-      tr_torrent * it = session->torrentList;
-      while (it->next != NULL)
-        it = it->next;
-      it->next = tor;
-    }
+    session->torrentListTail->next = tor;
+  session->torrentListTail = tor;
+  torrentIndexAdd (session, tor);
+  tr_ioFreeSharedFileIndex (session);
+  queueAppend (session, tor);
 
   /* if we don't have a local .torrent file already, assume the torrent is new */
   isNewTorrent = !tr_sys_path_exists (tor->info.torrent, NULL);
@@ -971,6 +1310,11 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
     {
       tr_torrentStart (tor);
     }
+  else
+    {
+      /* nobody needs the piece hashes of a stopped torrent */
+      tr_torrentUnloadPieceHashes (tor);
+    }
 
   tr_sessionUnlock (session);
 }
@@ -1148,12 +1492,24 @@ tr_torrentInfo (const tr_torrent * tor)
   return tr_isTorrent (tor) ? &tor->info : NULL;
 }
 
+/* the snapshot is good for the rest of the second, unless the torrent
+   has been started, stopped, queued, moved or has hit an error since --
+   those are cheap to check and are what callers notice right away */
+static bool
+statIsCurrent (const tr_torrent * tor)
+{
+  const tr_stat * s = &tor->stats;
+
+  return (tor->lastStatTime == tr_time ())
+      && (s->activity == tr_torrentGetActivity (tor))
+      && (s->error == tor->error)
+      && (s->queuePosition == tor->queuePosition);
+}
+
 const tr_stat *
 tr_torrentStatCached (tr_torrent * tor)
 {
-  const time_t now = tr_time ();
-
-  return tr_isTorrent (tor) && (now == tor->lastStatTime)
+  return tr_isTorrent (tor) && statIsCurrent (tor)
        ? &tor->stats
        : tr_torrentStat (tor);
 }
@@ -1252,10 +1608,12 @@ tr_torrentStat (tr_torrent * tor)
   unsigned int pieceUploadSpeed_Bps;
   unsigned int pieceDownloadSpeed_Bps;
   struct tr_swarm_stats swarm_stats;
+  tr_stat old;
   int i;
 
   assert (tr_isTorrent (tor));
 
+  old = tor->stats;
   tor->lastStatTime = tr_time ();
 
   if (tor->swarm != NULL)
@@ -1276,6 +1634,16 @@ tr_torrentStat (tr_torrent * tor)
   s->peersSendingToUs    = swarm_stats.activePeerCount[TR_DOWN];
   s->peersGettingFromUs  = swarm_stats.activePeerCount[TR_UP];
   s->webseedsSendingToUs = swarm_stats.activeWebseedCount;
+  s->wastedBytes         = swarm_stats.wastedBytes;
+  s->cpuTimeMsec         = tor->cpuUsec / 1000u;
+  s->diskReadBytes       = tor->diskReadBytes;
+  s->diskReadOps         = tor->diskReadOps;
+  s->diskWriteBytes      = tor->diskWriteBytes;
+  s->diskWriteOps        = tor->diskWriteOps;
+  s->fileOpens           = tor->fileOpens;
+  s->openFiles           = tr_fdTorrentGetOpenFileCount (tor->session, tor->uniqueId);
+  s->cacheBytes          = tor->cacheBytes;
+  memcpy (s->stallMsec, tor->stallMsec, sizeof (s->stallMsec));
   for (i=0; i<TR_PEER_FROM__MAX; i++)
     s->peersFrom[i] = swarm_stats.peerFromCount[i];
 
@@ -1293,10 +1661,13 @@ tr_torrentStat (tr_torrent * tor)
   s->leftUntilDone       = tr_torrentGetLeftUntilDone (tor);
   s->sizeWhenDone        = tr_cpSizeWhenDone (&tor->completion);
   s->recheckProgress     = s->activity == TR_STATUS_CHECK ? getVerifyProgress (tor) : 0;
+  s->isRelocating        = tor->isRelocating;
+  s->relocateProgress    = tor->isRelocating ? tr_relocateGetProgress (tor) : 0;
   s->activityDate        = tor->activityDate;
   s->addedDate           = tor->addedDate;
   s->doneDate            = tor->doneDate;
   s->startDate           = tor->startDate;
+  tr_torrentUpdateActiveTime (tor);
   s->secondsSeeding      = tor->secondsSeeding;
   s->secondsDownloading  = tor->secondsDownloading;
   s->idleSecs            = torrentGetIdleSecs (tor);
@@ -1388,53 +1759,53 @@ tr_torrentStat (tr_torrent * tor)
   assert (s->leftUntilDone <= s->sizeWhenDone);
   assert (s->desiredAvailable <= s->leftUntilDone);
 
+  if (memcmp (&old, s, sizeof (tr_stat)))
+    tor->statGeneration = ++tor->session->statGeneration;
+
   return s;
 }
 
-/***
-****
-***/
-
-static uint64_t
-countFileBytesCompleted (const tr_torrent * tor, tr_file_index_t index)
+int
+tr_sessionGetTorrentStats (tr_session  * session,
+                           tr_torrent ** torrents,
+                           int           torrentCount,
+                           tr_stat     * setme,
+                           uint64_t    * generation)
 {
-  uint64_t total = 0;
-  const tr_file * f = &tor->info.files[index];
+  int i;
+  int n = 0;
+  tr_torrent * tor = NULL;
+  const uint64_t since = generation != NULL ? *generation : 0;
 
-  if (f->length)
-    {
-      tr_block_index_t first;
-      tr_block_index_t last;
-      tr_torGetFileBlockRange (tor, index, &first, &last);
+  assert (tr_isSession (session));
+  assert (torrentCount == 0 || setme != NULL);
 
-      if (first == last)
-        {
-          if (tr_torrentBlockIsComplete (tor, first))
-            total = f->length;
-        }
-      else
-        {
-          /* the first block */
-          if (tr_torrentBlockIsComplete (tor, first))
-            total += tor->blockSize - (f->offset % tor->blockSize);
+  tr_sessionLock (session);
 
-          /* the middle blocks */
-          if (first + 1 < last)
-            {
-              uint64_t u = tr_bitfieldCountRange (&tor->completion.blockBitfield, first+1, last);
-              u *= tor->blockSize;
-              total += u;
-            }
+  for (i=0; i<torrentCount; ++i)
+    {
+      if (torrents != NULL)
+        tor = torrents[i];
+      else if ((tor = tr_torrentNext (session, tor)) == NULL)
+        break;
 
-          /* the last block */
-          if (tr_torrentBlockIsComplete (tor, last))
-            total += (f->offset + f->length) - ((uint64_t)tor->blockSize * last);
-        }
+      tr_torrentStatCached (tor);
+
+      if (tor->statGeneration > since || since == 0)
+        setme[n++] = tor->stats;
     }
 
-  return total;
+  if (generation != NULL)
+    *generation = session->statGeneration;
+
+  tr_sessionUnlock (session);
+  return n;
 }
 
+/***
+****
+***/
+
 tr_file_stat *
 tr_torrentFiles (const tr_torrent * tor,
                  tr_file_index_t  * fileCount)
@@ -1449,7 +1820,7 @@ tr_torrentFiles (const tr_torrent * tor,
 
   for (i=0; i<n; ++i, ++walk)
     {
-      const uint64_t b = isSeed ? tor->info.files[i].length : countFileBytesCompleted (tor, i);
+      const uint64_t b = isSeed ? tor->info.files[i].length : tr_cpFileBytesCompleted (&tor->completion, i);
       walk->bytesCompleted = b;
       walk->progress = tor->info.files[i].length > 0 ? ((float)b / tor->info.files[i].length) : 1.0f;
     }
@@ -1567,7 +1938,6 @@ freeTorrent (tr_torrent * tor)
   tr_torrent * t;
   tr_session * session = tor->session;
   tr_info * inf = &tor->info;
-  const time_t now = tr_time ();
 
   assert (!tor->isRunning);
 
@@ -1578,19 +1948,32 @@ freeTorrent (tr_torrent * tor)
   tr_announcerRemoveTorrent (session->announcer, tor);
 
   tr_cpDestruct (&tor->completion);
+  tr_ioFreeHashers (tor);
 
+  tr_free (tor->fileLocations);
+  tr_free (tor->sharedFiles);
+  tr_ioFreeSharedFileIndex (session);
   tr_free (tor->downloadDir);
   tr_free (tor->incompleteDir);
 
+  if (tr_variantIsDict (&tor->rpcFieldRevisions))
+    tr_variantFree (&tor->rpcFieldRevisions);
+
+  torrentIndexRemove (session, tor);
+
   if (tor == session->torrentList)
     {
       session->torrentList = tor->next;
+      if (tor == session->torrentListTail)
+        session->torrentListTail = NULL;
     }
   else for (t = session->torrentList; t != NULL; t = t->next)
     {
       if (t->next == tor)
         {
           t->next = tor->next;
+          if (tor == session->torrentListTail)
+            session->torrentListTail = t;
           break;
         }
     }
@@ -1600,19 +1983,12 @@ freeTorrent (tr_torrent * tor)
   session->torrentCount--;
 
   /* resequence the queue positions */
-  t = NULL;
-  while ((t = tr_torrentNext (session, t)))
-    {
-      if (t->queuePosition > tor->queuePosition)
-        {
-          t->queuePosition--;
-          t->anyDate = now;
-        }
-    }
+  queueRemove (session, tor);
   assert (queueIsSequenced (session));
 
   tr_bandwidthDestruct (&tor->bandwidth);
 
+  freePieceHashes (tor);
   tr_metainfoFree (inf);
   memset (tor, ~0, sizeof (tr_torrent));
   tr_free (tor);
@@ -1643,6 +2019,8 @@ torrentStartImpl (void * vtor)
   tor->isRunning = true;
   tor->completeness = tr_cpGetStatus (&tor->completion);
   tor->startDate = tor->anyDate = now;
+  tr_torrentUpdateActiveTime (tor);
+  tr_torrentSeedLimitChanged (tor);
   tr_torrentClearError (tor);
   tor->finishedSeedingByIdle = false;
 
@@ -1722,6 +2100,9 @@ torrentStart (tr_torrent * tor, bool bypass_queue)
   if (setLocalErrorIfFilesDisappeared (tor))
     return;
 
+  if (setLocalErrorIfPieceHashesMissing (tor))
+    return;
+
   /* otherwise, start it now... */
   tr_sessionLock (tor->session);
 
@@ -1739,6 +2120,7 @@ torrentStart (tr_torrent * tor, bool bypass_queue)
    * was missed to ensure that we didn't think someone was cheating. */
   tr_torrentUnsetPeerId (tor);
   tor->isRunning = true;
+  tr_torrentUpdateActiveTime (tor);
   tr_torrentSetDirty (tor);
   tr_runInEventThread (tor->session, torrentStartImpl, tor);
 
@@ -1762,6 +2144,7 @@ tr_torrentStartNow (tr_torrent * tor)
 struct verify_data
 {
   bool aborted;
+  bool incremental;
   tr_torrent * tor;
   tr_verify_done_func callback_func;
   void * callback_data;
@@ -1785,6 +2168,11 @@ onVerifyDoneThreadFunc (void * vdata)
       torrentStart (tor, false);
     }
 
+  /* an aborted verify can mean the torrent's being removed,
+     so don't touch it. If it was stopped, that unloaded the hashes */
+  if (!data->aborted && !tor->isRunning && !tr_torrentIsQueued (tor) && (tor->verifyState == TR_VERIFY_NONE))
+    tr_torrentUnloadPieceHashes (tor);
+
   tr_free (data);
 }
 
@@ -1813,29 +2201,50 @@ verifyTorrent (void * vdata)
     tr_torrentStop (tor);
   tor->startAfterVerify = startAfter;
 
-  if (setLocalErrorIfFilesDisappeared (tor))
+  /* look for the files from scratch */
+  torrentForgetFileLocations (tor);
+
+  if (setLocalErrorIfFilesDisappeared (tor) || setLocalErrorIfPieceHashesMissing (tor))
     tor->startAfterVerify = false;
   else
-    tr_verifyAdd (tor, onVerifyDone, data);
+    tr_verifyAdd (tor, data->incremental, onVerifyDone, data);
 
   tr_sessionUnlock (tor->session);
 }
 
-void
-tr_torrentVerify (tr_torrent           * tor,
-                  tr_verify_done_func    callback_func,
-                  void                 * callback_data)
+static void
+queueVerify (tr_torrent           * tor,
+             bool                   incremental,
+             tr_verify_done_func    callback_func,
+             void                 * callback_data)
 {
   struct verify_data * data;
 
   data = tr_new (struct verify_data, 1);
   data->tor = tor;
   data->aborted = false;
+  data->incremental = incremental;
   data->callback_func = callback_func;
   data->callback_data = callback_data;
   tr_runInEventThread (tor->session, verifyTorrent, data);
 }
 
+void
+tr_torrentVerify (tr_torrent           * tor,
+                  tr_verify_done_func    callback_func,
+                  void                 * callback_data)
+{
+  queueVerify (tor, false, callback_func, callback_data);
+}
+
+void
+tr_torrentVerifyIncremental (tr_torrent           * tor,
+                             tr_verify_done_func    callback_func,
+                             void                 * callback_data)
+{
+  queueVerify (tor, true, callback_func, callback_data);
+}
+
 void
 tr_torrentSave (tr_torrent * tor)
 {
@@ -1848,6 +2257,18 @@ tr_torrentSave (tr_torrent * tor)
     }
 }
 
+void
+tr_torrentSaveAsync (tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  if (tor->isDirty)
+    {
+      tor->isDirty = false;
+      tr_torrentSaveResumeAsync (tor);
+    }
+}
+
 static void
 stopTorrent (void * vtor)
 {
@@ -1859,14 +2280,24 @@ stopTorrent (void * vtor)
   tr_torrentLock (tor);
 
   tr_verifyRemove (tor);
+  tr_scrubRemove (tor);
+  tr_torrentUnloadPieceHashes (tor);
+  tr_ioFreeHashers (tor);
   tr_peerMgrStopTorrent (tor);
   tr_announcerTorrentStopped (tor);
   tr_cacheFlushTorrent (tor->session->cache, tor);
 
   tr_fdTorrentClose (tor->session, tor->uniqueId);
 
+  /* on shutdown, let the resume workers write the files in parallel;
+     tr_resumeClose () waits for them */
   if (!tor->isDeleting)
-    tr_torrentSave (tor);
+    {
+      if (tor->session->isClosing)
+        tr_torrentSaveAsync (tor);
+      else
+        tr_torrentSave (tor);
+    }
 
   torrentSetQueued (tor, false);
 
@@ -1892,6 +2323,7 @@ tr_torrentStop (tr_torrent * tor)
 
       tor->isRunning = false;
       tor->isStopping = false;
+      tr_torrentUpdateActiveTime (tor);
       tr_torrentSetDirty (tor);
       tr_runInEventThread (tor->session, stopTorrent, tor);
 
@@ -1907,13 +2339,15 @@ closeTorrent (void * vtor)
 
   assert (tr_isTorrent (tor));
 
-  d = tr_variantListAddDict (&tor->session->removedTorrents, 2);
+  d = tr_variantListAddDict (&tor->session->removedTorrents, 3);
   tr_variantDictAddInt (d, TR_KEY_id, tor->uniqueId);
   tr_variantDictAddInt (d, TR_KEY_date, tr_time ());
+  tr_variantDictAddInt (d, TR_KEY_revision, tor->session->torrentGetRevision);
 
   tr_logAddTorInfo (tor, "%s", _("Removing torrent"));
 
   tor->magnetVerify = false;
+  tr_relocateRemove (tor);
   stopTorrent (tor);
 
   if (tor->isDeleting)
@@ -2159,6 +2593,8 @@ tr_torrentRecheckCompleteness (tr_torrent * tor)
                           getCompletionString (completeness));
 
       tor->completeness = completeness;
+      tr_torrentUpdateActiveTime (tor);
+      tr_torrentSeedLimitChanged (tor);
       tr_fdTorrentClose (tor->session, tor->uniqueId);
 
       if (tr_torrentIsSeed (tor))
@@ -2409,7 +2845,92 @@ tr_torrentSetPriority (tr_torrent * tor, tr_priority_t priority)
 ***/
 
 void
-tr_torrentSetPeerLimit (tr_torrent * tor,
+tr_torrentSetSequentialDownload (tr_torrent * tor, bool enabled)
+{
+  assert (tr_isTorrent (tor));
+
+  if (tor->isSequential != enabled)
+    {
+      tor->isSequential = enabled;
+      tr_peerMgrRebuildRequests (tor);
+    }
+}
+
+bool
+tr_torrentIsSequentialDownload (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->isSequential;
+}
+
+void
+tr_torrentSetStreamingPosition (tr_torrent * tor, uint64_t position)
+{
+  assert (tr_isTorrent (tor));
+
+  if (tor->streamingPosition != position)
+    {
+      tor->streamingPosition = position;
+
+      if (tor->isSequential)
+        tr_peerMgrRebuildRequests (tor);
+    }
+}
+
+uint64_t
+tr_torrentGetStreamingPosition (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->streamingPosition;
+}
+
+void
+tr_torrentSetStreamingWindow (tr_torrent * tor, uint64_t bytes)
+{
+  assert (tr_isTorrent (tor));
+
+  if (tor->streamingWindow != bytes)
+    {
+      tor->streamingWindow = bytes;
+
+      if (tor->isSequential)
+        tr_peerMgrRebuildRequests (tor);
+    }
+}
+
+uint64_t
+tr_torrentGetStreamingWindow (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->streamingWindow;
+}
+
+/* turning it off is picked up by the peer-mgr's next rechoke */
+void
+tr_torrentSetSuperSeeding (tr_torrent * tor, bool enabled)
+{
+  assert (tr_isTorrent (tor));
+
+  tor->isSuperSeeding = enabled;
+}
+
+bool
+tr_torrentIsSuperSeeding (const tr_torrent * tor)
+{
+  assert (tr_isTorrent (tor));
+
+  return tor->isSuperSeeding;
+}
+
+/***
+****
+***/
+
+void
+tr_torrentSetPeerLimit (tr_torrent * tor,
                         uint16_t     maxConnectedPeers)
 {
   assert (tr_isTorrent (tor));
@@ -2815,56 +3336,6 @@ tr_torrentGetBytesLeftToAllocate (const tr_torrent * tor)
 *****  Removing the torrent's local data
 ****/
 
-static bool
-isJunkFile (const char * base)
-{
-  int i;
-  static const char * files[] = { ".DS_Store", "desktop.ini", "Thumbs.db" };
-  static const int file_count = sizeof (files) / sizeof (files[0]);
-
-  for (i=0; i<file_count; ++i)
-    if (!strcmp (base, files[i]))
-      return true;
-
-#ifdef __APPLE__
-  /* check for resource forks. <http://support.apple.com/kb/TA20578> */
-  if (!memcmp (base, "._", 2))
-    return true;
-#endif
-
-  return false;
-}
-
-static void
-removeEmptyFoldersAndJunkFiles (const char * folder)
-{
-  tr_sys_dir_t odir;
-
-  if ((odir = tr_sys_dir_open (folder, NULL)) != TR_BAD_SYS_DIR)
-    {
-      const char * name;
-      while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
-        {
-          if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
-            {
-              tr_sys_path_info info;
-              char * filename = tr_buildPath (folder, name, NULL);
-
-              if (tr_sys_path_get_info (filename, 0, &info, NULL) &&
-                  info.type == TR_SYS_PATH_IS_DIRECTORY)
-                removeEmptyFoldersAndJunkFiles (filename);
-              else if (isJunkFile (name))
-                tr_sys_path_remove (filename, NULL);
-
-              tr_free (filename);
-            }
-        }
-
-      tr_sys_path_remove (folder, NULL);
-      tr_sys_dir_close (odir, NULL);
-    }
-}
-
 /**
  * This convoluted code does something (seemingly) simple:
  * remove the torrent's local files.
@@ -2873,14 +3344,15 @@ removeEmptyFoldersAndJunkFiles (const char * folder)
  * 1. Try to preserve the directory hierarchy in the recycle bin.
  * 2. If there are nontorrent files, don't delete them...
  * 3. ...unless the other files are "junk", such as .DS_Store
+ *
+ * Only the quick part happens here: the files are renamed into a
+ * tmpdir, and the deletion itself is handed to tr_deleteAdd ().
  */
 static void
 deleteLocalData (tr_torrent * tor, tr_fileFunc func)
 {
-  int i, n;
   tr_file_index_t f;
   char * base;
-  tr_sys_dir_t odir;
   char * tmpdir = NULL;
   tr_ptrArray files = TR_PTR_ARRAY_INIT;
   tr_ptrArray folders = TR_PTR_ARRAY_INIT;
@@ -2933,52 +3405,8 @@ deleteLocalData (tr_torrent * tor, tr_fileFunc func)
         }
     }
 
-  /***
-  ****  Remove tmpdir.
-  ****
-  ****  Try deleting the top-level files & folders to preserve
-  ****  the directory hierarchy in the recycle bin.
-  ****  If case that fails -- for example, rmdir () doesn't
-  ****  delete nonempty folders -- go from the bottom up too.
-  ***/
-
-  /* try deleting the local data's top-level files & folders */
-  if ((odir = tr_sys_dir_open (tmpdir, NULL)) != TR_BAD_SYS_DIR)
-    {
-      const char * name;
-      while ((name = tr_sys_dir_read_name (odir, NULL)) != NULL)
-        {
-          if (strcmp (name, ".") != 0 && strcmp (name, "..") != 0)
-            {
-              char * file = tr_buildPath (tmpdir, name, NULL);
-              func (file);
-              tr_free (file);
-            }
-        }
-      tr_sys_dir_close (odir, NULL);
-    }
-
-  /* go from the bottom up */
-  for (i=0, n=tr_ptrArraySize (&files); i<n; ++i)
-    {
-      char * walk = tr_strdup (tr_ptrArrayNth (&files, i));
-      while (tr_sys_path_exists (walk, NULL) && !tr_sys_path_is_same (tmpdir, walk, NULL))
-        {
-          char * tmp = tr_sys_path_dirname (walk, NULL);
-          func (walk);
-          tr_free (walk);
-          walk = tmp;
-        }
-      tr_free (walk);
-    }
-
-  /***
-  ****  The local data has been removed.
-  ****  What's left in top are empty folders, junk, and user-generated files.
-  ****  Remove the first two categories and leave the third.
-  ***/
-
-  /* build a list of 'top's child directories that belong to this torrent */
+  /* build a list of 'top's child directories that belong to this torrent,
+     so the worker can remove them once they hold nothing but junk */
   for (f=0; f<tor->info.fileCount; ++f)
     {
       char * dir;
@@ -3012,14 +3440,7 @@ deleteLocalData (tr_torrent * tor, tr_fileFunc func)
       tr_free (dir);
     }
 
-  for (i=0, n=tr_ptrArraySize (&folders); i<n; ++i)
-    removeEmptyFoldersAndJunkFiles (tr_ptrArrayNth (&folders, i));
-
-  /* cleanup */
-  tr_sys_path_remove (tmpdir, NULL);
-  tr_free (tmpdir);
-  tr_ptrArrayDestruct (&folders, tr_free);
-  tr_ptrArrayDestruct (&files, tr_free);
+  tr_deleteAdd (tor->session, tr_torrentName (tor), tmpdir, &files, &folders, func);
 }
 
 static void
@@ -3027,14 +3448,12 @@ tr_torrentDeleteLocalData (tr_torrent * tor, tr_fileFunc func)
 {
   assert (tr_isTorrent (tor));
 
-  if (func == NULL)
-    func = remove;
-
   /* close all the files because we're about to delete them */
   tr_cacheFlushTorrent (tor->session->cache, tor);
   tr_fdTorrentClose (tor->session, tor->uniqueId);
 
   deleteLocalData (tor, func);
+  torrentForgetFileLocations (tor);
 }
 
 /***
@@ -3053,12 +3472,9 @@ struct LocationData
 static void
 setLocation (void * vdata)
 {
-  bool err = false;
   struct LocationData * data = vdata;
   tr_torrent * tor = data->tor;
-  const bool do_move = data->move_from_old_location;
   const char * location = data->location;
-  double bytesHandled = 0;
   tr_torrentLock (tor);
 
   assert (tr_isTorrent (tor));
@@ -3068,79 +3484,59 @@ setLocation (void * vdata)
 
   tr_sys_dir_create (location, TR_SYS_DIR_CREATE_PARENTS, 0777, NULL);
 
-  if (!tr_sys_path_is_same (location, tor->currentDir, NULL))
-    {
-      tr_file_index_t i;
+  /* the new location supersedes any move that's still in progress */
+  tr_relocateRemove (tor);
+  tr_scrubRemove (tor);
 
-      /* bad idea to move files while they're being verified... */
-      tr_verifyRemove (tor);
-
-      /* try to move the files.
-       * FIXME: there are still all kinds of nasty cases, like what
-       * if the target directory runs out of space halfway through... */
-      for (i=0; !err && i<tor->info.fileCount; ++i)
+  if (data->move_from_old_location && !tr_sys_path_is_same (location, tor->currentDir, NULL))
+    {
+      /* the files are copied in the background if they need to be,
+         and the rest is done by tr_torrentRelocated () at the cut-over */
+      tr_relocateAdd (tor, location, data->setme_progress, data->setme_state);
+    }
+  else
+    {
+      if (data->move_from_old_location)
         {
-          char * sub;
-          const char * oldbase;
-          const tr_file * f = &tor->info.files[i];
-
-          if (tr_torrentFindFile2 (tor, i, &oldbase, &sub, NULL))
-            {
-              char * oldpath = tr_buildPath (oldbase, sub, NULL);
-              char * newpath = tr_buildPath (location, sub, NULL);
-
-              tr_logAddDebug ("Found file #%d: %s", (int)i, oldpath);
-
-              if (do_move && !tr_sys_path_is_same (oldpath, newpath, NULL))
-                {
-                  bool renamed = false;
-                  errno = 0;
-                  tr_logAddTorInfo (tor, "moving \"%s\" to \"%s\"", oldpath, newpath);
-                  if (tr_moveFile (oldpath, newpath, &renamed))
-                    {
-                      err = true;
-                      tr_logAddTorErr (tor, "error moving \"%s\" to \"%s\": %s",
-                                       oldpath, newpath, tr_strerror (errno));
-                    }
-                }
-
-              tr_free (newpath);
-              tr_free (oldpath);
-              tr_free (sub);
-            }
-
-          if (data->setme_progress != NULL)
-            {
-              bytesHandled += f->length;
-              *data->setme_progress = bytesHandled / tor->info.totalSize;
-            }
+          tr_free (tor->incompleteDir);
+          tor->incompleteDir = NULL;
+          tor->currentDir = tor->downloadDir;
         }
-
-      if (!err)
+      else if (!tr_sys_path_is_same (location, tor->currentDir, NULL))
         {
-          /* blow away the leftover subdirectories in the old location */
-          if (do_move)
-            tr_torrentDeleteLocalData (tor, remove);
-
-          /* set the new location and reverify */
+          tr_verifyRemove (tor);
           tr_torrentSetDownloadDir (tor, location);
         }
+
+      torrentForgetFileLocations (tor);
+
+      if (data->setme_state != NULL)
+        *data->setme_state = TR_LOC_DONE;
     }
 
-  if (!err && do_move)
+  /* cleanup */
+  tr_torrentUnlock (tor);
+  tr_free (data->location);
+  tr_free (data);
+}
+
+void
+tr_torrentRelocated (tr_torrent * tor, const char * location)
+{
+  assert (tr_isTorrent (tor));
+
+  if (location != NULL)
     {
+      /* blow away the leftover subdirectories in the old location */
+      tr_torrentDeleteLocalData (tor, remove);
+
+      tr_torrentSetDownloadDir (tor, location);
       tr_free (tor->incompleteDir);
       tor->incompleteDir = NULL;
       tor->currentDir = tor->downloadDir;
     }
 
-  if (data->setme_state != NULL)
-    *data->setme_state = err ? TR_LOC_ERROR : TR_LOC_DONE;
-
-  /* cleanup */
-  tr_torrentUnlock (tor);
-  tr_free (data->location);
-  tr_free (data);
+  torrentForgetFileLocations (tor);
 }
 
 void
@@ -3170,10 +3566,42 @@ tr_torrentSetLocation (tr_torrent       * tor,
   tr_runInEventThread (tor->session, setLocation, data);
 }
 
+void
+tr_torrentSetLocationPaused (tr_torrent * tor, bool paused)
+{
+  assert (tr_isTorrent (tor));
+
+  tr_relocateSetPaused (tor, paused);
+}
+
 /***
 ****
 ***/
 
+/* files whose extents average less than this are reported as fragmented */
+#define FRAGMENTED_EXTENT_SIZE (1024 * 1024)
+
+/* log how many pieces the file system split a newly-completed file into */
+static void
+reportFragmentation (const tr_torrent * tor, const tr_file * f, const char * filename)
+{
+  size_t extents;
+  tr_sys_file_t fd;
+
+  if ((fd = tr_sys_file_open (filename, TR_SYS_FILE_READ, 0, NULL)) == TR_BAD_SYS_FILE)
+    return;
+
+  if (tr_sys_file_get_extent_count (fd, &extents, NULL) && extents > 0)
+    {
+      if (extents > 1 && f->length / extents < FRAGMENTED_EXTENT_SIZE)
+        tr_logAddTorInfo (tor, "\"%s\" is fragmented into %"TR_PRIuSIZE" extents", f->name, extents);
+      else
+        tr_logAddTorDbg (tor, "\"%s\" is in %"TR_PRIuSIZE" extents", f->name, extents);
+    }
+
+  tr_sys_file_close (fd, NULL);
+}
+
 static void
 tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileIndex)
 {
@@ -3211,12 +3639,21 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileIndex)
               tr_error_free (error);
             }
 
+          tor->fileLocations[fileIndex] = TR_FILE_LOCATION_UNKNOWN;
           tr_free (newpath);
           tr_free (oldpath);
         }
 
       tr_free (sub);
     }
+
+  if (tr_torrentFindFile2 (tor, fileIndex, &base, &sub, NULL))
+    {
+      char * filename = tr_buildPath (base, sub, NULL);
+      reportFragmentation (tor, f, filename);
+      tr_free (filename);
+      tr_free (sub);
+    }
 }
 
 static void
@@ -3281,6 +3718,9 @@ tr_torrentGotBlock (tr_torrent * tor, tr_block_index_t block)
       tr_torrentSetDirty (tor);
 
       p = tr_torBlockPiece (tor, block);
+
+      if (tor->isRelocating)
+        tr_relocatePieceChanged (tor, p);
       if (tr_torrentPieceIsComplete (tor, p))
         {
           tr_logAddTorDbg (tor, "[LAZY] checking just-completed piece %"TR_PRIuSIZE, (size_t)p);
@@ -3312,70 +3752,76 @@ tr_torrentGotBlock (tr_torrent * tor, tr_block_index_t block)
 ****
 ***/
 
+/* returns the directory for a file location, or NULL if it has none.
+   subpath is set to the file's name or to its .part name in *part */
+static const char *
+getFileLocation (const tr_torrent * tor, tr_file_index_t fileNum,
+                 int location, const char ** subpath, char ** part)
+{
+  const char * dir;
+
+  if ((location == TR_FILE_LOCATION_DOWNLOAD_DIR) || (location == TR_FILE_LOCATION_DOWNLOAD_DIR_PART))
+    dir = tor->downloadDir;
+  else
+    dir = tor->incompleteDir;
+
+  if (location < TR_FILE_LOCATION_INCOMPLETE_DIR_PART)
+    {
+      *subpath = tor->info.files[fileNum].name;
+    }
+  else
+    {
+      if (*part == NULL)
+        *part = tr_torrentBuildPartial (tor, fileNum);
+      *subpath = *part;
+    }
+
+  return dir;
+}
+
 bool
 tr_torrentFindFile2 (const tr_torrent * tor, tr_file_index_t fileNum,
                      const char ** base, char ** subpath, time_t * mtime)
 {
+  int i;
   char * part = NULL;
-  const tr_file * file;
   const char * b = NULL;
   const char * s = NULL;
   tr_sys_path_info file_info;
+  uint8_t * location;
 
   assert (tr_isTorrent (tor));
   assert (fileNum < tor->info.fileCount);
 
-  file = &tor->info.files[fileNum];
+  location = &tor->fileLocations[fileNum];
 
-  /* look in the download dir... */
-  if (b == NULL)
-    {
-      char * filename = tr_buildPath (tor->downloadDir, file->name, NULL);
-      if (tr_sys_path_get_info (filename, 0, &file_info, NULL))
-        {
-          b = tor->downloadDir;
-          s = file->name;
-        }
-      tr_free (filename);
-    }
+  /* if we've found the file before, trust that
+     unless the caller needs a fresh stat () for its mtime */
+  if ((*location != TR_FILE_LOCATION_UNKNOWN) && (mtime == NULL))
+    b = getFileLocation (tor, fileNum, *location, &s, &part);
 
-  /* look in the incomplete dir... */
-  if ((b == NULL) && (tor->incompleteDir != NULL))
+  /* look in the download dir, then the incomplete dir,
+     then for a .part file in the incomplete dir and the download dir */
+  for (i=TR_FILE_LOCATION_DOWNLOAD_DIR; (b == NULL) && (i<=TR_FILE_LOCATION_DOWNLOAD_DIR_PART); ++i)
     {
-      char * filename = tr_buildPath (tor->incompleteDir, file->name, NULL);
-      if (tr_sys_path_get_info (filename, 0, &file_info, NULL))
-        {
-          b = tor->incompleteDir;
-          s = file->name;
-        }
-      tr_free (filename);
-    }
+      const char * dir = getFileLocation (tor, fileNum, i, &s, &part);
 
-  if (b == NULL)
-    part = tr_torrentBuildPartial (tor, fileNum);
-
-  /* look for a .part file in the incomplete dir... */
-  if ((b == NULL) && (tor->incompleteDir != NULL))
-    {
-      char * filename = tr_buildPath (tor->incompleteDir, part, NULL);
-      if (tr_sys_path_get_info (filename, 0, &file_info, NULL))
+      if (dir != NULL)
         {
-          b = tor->incompleteDir;
-          s = part;
+          char * filename = tr_buildPath (dir, s, NULL);
+          if (tr_sys_path_get_info (filename, 0, &file_info, NULL))
+            {
+              b = dir;
+              *location = i;
+            }
+          tr_free (filename);
         }
-      tr_free (filename);
     }
 
-  /* look for a .part file in the download dir... */
   if (b == NULL)
     {
-      char * filename = tr_buildPath (tor->downloadDir, part, NULL);
-      if (tr_sys_path_get_info (filename, 0, &file_info, NULL))
-        {
-          b = tor->downloadDir;
-          s = part;
-        }
-      tr_free (filename);
+      *location = TR_FILE_LOCATION_UNKNOWN;
+      s = NULL;
     }
 
   /* return the results */
@@ -3414,6 +3860,9 @@ refreshCurrentDir (tr_torrent * tor)
 {
   const char * dir = NULL;
 
+  /* the directories may have changed, so the cached locations are stale */
+  torrentForgetFileLocations (tor);
+
   if (tor->incompleteDir == NULL)
     dir = tor->downloadDir;
   else if (!tr_torrentHasMetadata (tor)) /* no files to find */
@@ -3449,30 +3898,25 @@ compareTorrentByQueuePosition (const void * va, const void * vb)
 static bool
 queueIsSequenced (tr_session * session)
 {
-  int i;
   int n;
-  bool is_sequenced;
-  tr_torrent ** torrents;
+  int queued;
+  tr_torrent * tor;
 
   n = 0;
-  torrents = tr_sessionGetTorrents (session, &n);
-  qsort (torrents, n, sizeof (tr_torrent *), compareTorrentByQueuePosition);
-
-#if 0
-  fprintf (stderr, "%s", "queue: ");
-  for (i=0; i<n; ++i)
-    fprintf (stderr, "%d ", tmp[i]->queuePosition);
-  fputc ('\n', stderr);
-#endif
-
-  /* test them */
-  is_sequenced = true;
-  for (i=0; is_sequenced && i<n; ++i)
-    if (torrents[i]->queuePosition != i)
-      is_sequenced = false;
+  queued = 0;
+  tor = NULL;
+  while ((tor = tr_torrentNext (session, tor)))
+    {
+      if ((tor->queuePosition < 0) || (tor->queuePosition >= session->torrentCount))
+        return false;
+      if (session->queue[tor->queuePosition] != tor)
+        return false;
+      if (tr_torrentIsQueued (tor))
+        ++queued;
+      ++n;
+    }
 
-  tr_free (torrents);
-  return is_sequenced;
+  return (n == session->torrentCount) && (queued == session->queuedCount);
 }
 #endif
 
@@ -3485,58 +3929,100 @@ tr_torrentGetQueuePosition (const tr_torrent * tor)
 void
 tr_torrentSetQueuePosition (tr_torrent * tor, int pos)
 {
-  int back = -1;
-  tr_torrent * walk;
+  tr_session * session = tor->session;
+  tr_torrent ** queue = session->queue;
   const int old_pos = tor->queuePosition;
-  const time_t now = tr_time ();
 
   if (pos < 0)
     pos = 0;
+  if (pos > session->torrentCount - 1)
+    pos = session->torrentCount - 1;
 
-  tor->queuePosition = -1;
-
-  walk = NULL;
-  while ((walk = tr_torrentNext (tor->session, walk)))
+  /* slide the torrents in between over by one */
+  if (pos < old_pos)
     {
-      if (old_pos < pos)
-        {
-          if ((old_pos <= walk->queuePosition) && (walk->queuePosition <= pos))
-            {
-              walk->queuePosition--;
-              walk->anyDate = now;
-            }
-        }
+      memmove (queue + pos + 1, queue + pos, sizeof (tr_torrent *) * (old_pos - pos));
+      queue[pos] = tor;
+      queueRenumber (session, pos, old_pos + 1);
+    }
+  else if (pos > old_pos)
+    {
+      memmove (queue + old_pos, queue + old_pos + 1, sizeof (tr_torrent *) * (pos - old_pos));
+      queue[pos] = tor;
+      queueRenumber (session, old_pos, pos + 1);
+    }
 
-      if (old_pos > pos)
-        {
-          if ((pos <= walk->queuePosition) && (walk->queuePosition < old_pos))
-            {
-              walk->queuePosition++;
-              walk->anyDate = now;
-            }
-        }
+  tor->anyDate = tr_time ();
 
-      if (back < walk->queuePosition)
-        {
-          back = walk->queuePosition;
-        }
+  assert (queueIsSequenced (session));
+}
+
+/* Move a batch of torrents to the top or bottom of the queue in a single
+   pass, keeping their relative order. This is what repeatedly calling
+   tr_torrentSetQueuePosition () would do, but O(n) instead of O(n*k) */
+static void
+queueMoveToEnd (tr_torrent ** torrents, int n, bool to_top)
+{
+  int i;
+  int j;
+  int count;
+  bool * moving;
+  tr_torrent ** tmp;
+  tr_session * session;
+  const time_t now = tr_time ();
+
+  if (n < 1)
+    return;
+
+  session = torrents[0]->session;
+  count = session->torrentCount;
+
+  moving = tr_new0 (bool, count);
+  for (i=0; i<n; ++i)
+    {
+      moving[torrents[i]->queuePosition] = true;
+      torrents[i]->anyDate = now;
     }
 
-  tor->queuePosition = MIN (pos, (back+1));
-  tor->anyDate = now;
+  tmp = tr_new (tr_torrent *, count);
+  j = 0;
+  for (i=0; i<count; ++i)
+    if (moving[i] == to_top)
+      tmp[j++] = session->queue[i];
+  for (i=0; i<count; ++i)
+    if (moving[i] != to_top)
+      tmp[j++] = session->queue[i];
+  memcpy (session->queue, tmp, sizeof (tr_torrent *) * count);
+  queueRenumber (session, 0, count);
+
+  tr_free (tmp);
+  tr_free (moving);
+
+  assert (queueIsSequenced (session));
+}
+
+/* move a torrent one step, i.e. swap it with its neighbor */
+static void
+queueStep (tr_torrent * tor, int step)
+{
+  tr_session * session = tor->session;
+  const int pos = tor->queuePosition;
+  const int new_pos = pos + step;
 
-  assert (queueIsSequenced (tor->session));
+  if ((0 <= new_pos) && (new_pos < session->torrentCount))
+    {
+      session->queue[pos] = session->queue[new_pos];
+      session->queue[new_pos] = tor;
+      queueRenumber (session, MIN (pos, new_pos), MAX (pos, new_pos) + 1);
+    }
+
+  tor->anyDate = tr_time ();
 }
 
 void
-tr_torrentsQueueMoveTop (tr_torrent ** torrents_in, int n)
+tr_torrentsQueueMoveTop (tr_torrent ** torrents, int n)
 {
-  int i;
-  tr_torrent ** torrents = tr_memdup (torrents_in, sizeof (tr_torrent *) * n);
-  qsort (torrents, n, sizeof (tr_torrent *), compareTorrentByQueuePosition);
-  for (i=n-1; i>=0; --i)
-    tr_torrentSetQueuePosition (torrents[i], 0);
-  tr_free (torrents);
+  queueMoveToEnd (torrents, n, true);
 }
 
 void
@@ -3548,9 +4034,11 @@ tr_torrentsQueueMoveUp (tr_torrent ** torrents_in, int n)
   torrents = tr_memdup (torrents_in, sizeof (tr_torrent *) * n);
   qsort (torrents, n, sizeof (tr_torrent *), compareTorrentByQueuePosition);
   for (i=0; i<n; ++i)
-    tr_torrentSetQueuePosition (torrents[i], torrents[i]->queuePosition - 1);
+    queueStep (torrents[i], -1);
 
   tr_free (torrents);
+
+  assert ((n < 1) || queueIsSequenced (torrents_in[0]->session));
 }
 
 void
@@ -3562,23 +4050,17 @@ tr_torrentsQueueMoveDown (tr_torrent ** torrents_in, int n)
   torrents = tr_memdup (torrents_in, sizeof (tr_torrent *) * n);
   qsort (torrents, n, sizeof (tr_torrent *), compareTorrentByQueuePosition);
   for (i=n-1; i>=0; --i)
-    tr_torrentSetQueuePosition (torrents[i], torrents[i]->queuePosition + 1);
+    queueStep (torrents[i], +1);
 
   tr_free (torrents);
+
+  assert ((n < 1) || queueIsSequenced (torrents_in[0]->session));
 }
 
 void
-tr_torrentsQueueMoveBottom (tr_torrent ** torrents_in, int n)
+tr_torrentsQueueMoveBottom (tr_torrent ** torrents, int n)
 {
-  int i;
-  tr_torrent ** torrents;
-
-  torrents = tr_memdup (torrents_in, sizeof (tr_torrent *) * n);
-  qsort (torrents, n, sizeof (tr_torrent *), compareTorrentByQueuePosition);
-  for (i=0; i<n; ++i)
-    tr_torrentSetQueuePosition (torrents[i], INT_MAX);
-
-  tr_free (torrents);
+  queueMoveToEnd (torrents, n, false);
 }
 
 static void
@@ -3590,6 +4072,7 @@ torrentSetQueued (tr_torrent * tor, bool queued)
   if (tr_torrentIsQueued (tor) != queued)
     {
       tor->isQueued = queued;
+      tor->session->queuedCount += queued ? 1 : -1;
       tor->anyDate = tr_time ();
       tr_torrentSetDirty (tor);
     }
@@ -3737,7 +4220,8 @@ renameTorrentFileString (tr_torrent       * tor,
     }
   else
     { 
-      tr_free (file->name);
+      if (file->is_renamed)
+        tr_free (file->name);
       file->name = name;
       file->is_renamed = true;
     }
@@ -3785,13 +4269,19 @@ torrentRenamePath (void * vdata)
         {
           size_t i;
 
+          /* the queued writes still have the old names */
+          tr_cacheFlushTorrent (tor->session->cache, tor);
+
           error = renamePath (tor, oldpath, newname);
 
           if (!error)
             {
               /* update tr_info.files */
               for (i=0; i<n; ++i)
-                renameTorrentFileString(tor, oldpath, newname, file_indices[i]);
+                {
+                  renameTorrentFileString(tor, oldpath, newname, file_indices[i]);
+                  tor->fileLocations[file_indices[i]] = TR_FILE_LOCATION_UNKNOWN;
+                }
 
               /* update tr_info.name if user changed the toplevel */
               if ((n == tor->info.fileCount) && (strchr(oldpath,'/')==NULL))
@@ -33,6 +33,13 @@ void        tr_ctorSetSave (tr_ctor * ctor,
 
 int         tr_ctorGetSave (const tr_ctor * ctor);
 
+/* like tr_ctorSetMetainfoFromFile (), for when the caller
+   has already read the file's contents into memory */
+int         tr_ctorSetMetainfoFromFileContents (tr_ctor       * ctor,
+                                                const char    * filename,
+                                                const uint8_t * metainfo,
+                                                size_t          len);
+
 void        tr_ctorInitTorrentPriorities (const tr_ctor * ctor, tr_torrent * tor);
 
 void        tr_ctorInitTorrentWanted (const tr_ctor * ctor, tr_torrent * tor);
@@ -108,9 +115,18 @@ void             tr_torrentSetChecked (tr_torrent * tor, time_t when);
 
 void             tr_torrentCheckSeedLimit (tr_torrent * tor);
 
+/** note that something a seed limit depends on has changed, e.g. the uploaded bytes */
+void             tr_torrentSeedLimitChanged (tr_torrent * tor);
+
+/** bring secondsSeeding and secondsDownloading up to date */
+void             tr_torrentUpdateActiveTime (tr_torrent * tor);
+
 /** save a torrent's .resume file if it's changed since the last time it was saved */
 void             tr_torrentSave (tr_torrent * tor);
 
+/** like tr_torrentSave (), but the file is written in the background */
+void             tr_torrentSaveAsync (tr_torrent * tor);
+
 void             tr_torrentSetLocalError (tr_torrent * tor, const char * fmt, ...) TR_GNUC_PRINTF (2, 3);
 
 
@@ -175,10 +191,31 @@ struct tr_torrent
      * This field is lazy-generated and might not be initialized yet. */
     int infoDictOffset;
 
+    /* When the piece hashes are read back in from the .torrent file,
+     * info.pieceHashes points into this read-only mapping of it, so the
+     * kernel can page them out while the torrent's idle. */
+    const uint8_t * torrentFileMap;
+    size_t torrentFileMapSize;
+
+    /* Pieces whose blocks have been hashed as they were written.
+     * See tr_ioHashBlock (). */
+    struct tr_piece_hasher * pieceHashers;
+    int pieceHasherCount;
+
     /* Where the files are now.
      * This pointer will be equal to downloadDir or incompleteDir */
     const char * currentDir;
 
+    /* Where tr_torrentFindFile2 () last found each file, so that it
+     * needn't stat () every candidate each time. One tr_file_location
+     * per file; see torrent.c */
+    uint8_t * fileLocations;
+
+    /* For files we don't have, an identical and complete file in another
+     * torrent that can be linked in its place. One per file; see
+     * tr_ioFindSharedFile () */
+    struct tr_shared_file * sharedFiles;
+
     /* How many bytes we ask for per request */
     uint32_t                   blockSize;
     tr_block_index_t           blockCount;
@@ -209,6 +246,18 @@ struct tr_torrent
     uint64_t                   corruptCur;
     uint64_t                   corruptPrev;
 
+    /* what the torrent has cost us since it was loaded. see tr_stat.
+       the disk counts are only touched under tr_fdLock (), since the
+       cache's writer threads update them too */
+    uint64_t                   cpuUsec;
+    uint64_t                   diskReadBytes;
+    uint64_t                   diskReadOps;
+    uint64_t                   diskWriteBytes;
+    uint64_t                   diskWriteOps;
+    uint64_t                   fileOpens;
+    uint64_t                   cacheBytes;
+    uint64_t                   stallMsec[2][TR_PEER_STALL_COUNT];
+
     uint64_t                   etaDLSpeedCalculatedAt;
     unsigned int               etaDLSpeed_Bps;
     uint64_t                   etaULSpeedCalculatedAt;
@@ -220,11 +269,34 @@ struct tr_torrent
     time_t                     startDate;
     time_t                     anyDate;
 
+    /* these don't include the time since activeSince;
+       tr_torrentUpdateActiveTime () adds it in */
     int                        secondsDownloading;
     int                        secondsSeeding;
+    time_t                     activeSince; /* 0 if the torrent wasn't running */
+    bool                       activeWasSeed;
+
+    /* tr_torrentCheckSeedLimit () can't find a limit reached before this.
+       0 means that the next check can't be skipped */
+    time_t                     seedLimitCheckAt;
 
     int                        queuePosition;
 
+    /* see tr_torrentSetSequentialDownload () */
+    bool                       isSequential;
+    uint64_t                   streamingPosition;
+    uint64_t                   streamingWindow;
+
+    /* see tr_torrentSetSuperSeeding () */
+    bool                       isSuperSeeding;
+
+    /* the next piece for the background scrub to check. see scrub.h */
+    tr_piece_index_t           scrubPiece;
+
+    /* field quark -> [ value hash, revision it last changed in ],
+       used by torrent-get to only send changed fields */
+    tr_variant                 rpcFieldRevisions;
+
     tr_torrent_metadata_func    metadata_func;
     void                      * metadata_func_user_data;
 
@@ -243,8 +315,13 @@ struct tr_torrent
     bool                       isRunning;
     bool                       isStopping;
     bool                       isDeleting;
+    bool                       isRelocating;
     bool                       startAfterVerify;
     bool                       isDirty;
+
+    /* SHA1 of the .resume file's contents the last time it was saved,
+       so that saving an unchanged torrent doesn't rewrite the file */
+    uint8_t                    resumeHash[SHA_DIGEST_LENGTH];
     bool                       isQueued;
 
     bool                       magnetVerify;
@@ -258,8 +335,16 @@ struct tr_torrent
     time_t                     lastStatTime;
     tr_stat                    stats;
 
+    /* the session's statGeneration when `stats' last changed */
+    uint64_t                   statGeneration;
+
     tr_torrent *               next;
 
+    /* the next torrent in the same tr_session.torrentIndex buckets */
+    tr_torrent *               idNext;
+    tr_torrent *               hashNext;
+    tr_torrent *               obfuscatedHashNext;
+
     int                        uniqueId;
 
     struct tr_bandwidth        bandwidth;
@@ -334,6 +419,13 @@ tr_torrentIsSeed (const tr_torrent * tor)
     return tr_torrentGetCompleteness(tor) != TR_LEECH;
 }
 
+/* true if peers connecting now get super-seeded */
+static inline bool
+tr_torrentIsSuperSeedingNow (const tr_torrent * tor)
+{
+    return tor->isSuperSeeding && (tr_torrentGetCompleteness(tor) == TR_SEED);
+}
+
 static inline bool tr_torrentIsPrivate (const tr_torrent * tor)
 {
     return (tor != NULL) && tor->info.isPrivate;
@@ -411,6 +503,13 @@ void tr_torrentGotBlock (tr_torrent * tor, tr_block_index_t blockIndex);
 bool tr_torrentFindFile2 (const tr_torrent *, tr_file_index_t fileNo,
                           const char ** base, char ** subpath, time_t * mtime);
 
+/**
+ * @brief called by relocate.c once a torrent's files have been moved.
+ *
+ * @param location the torrent's new location, or NULL if the move failed
+ */
+void tr_torrentRelocated (tr_torrent * tor, const char * location);
+
 
 /* Returns a newly-allocated version of the tr_file.name string
  * that's been modified to denote that it's not a complete file yet.
@@ -438,6 +537,25 @@ bool tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex);
 
 time_t tr_torrentGetFileMTime (const tr_torrent * tor, tr_file_index_t i);
 
+/**
+ * Makes sure tor->info.pieceHashes is loaded, reading it back in
+ * from the torrent's .torrent file if it was dropped.
+ * Returns false if the hashes couldn't be read.
+ */
+bool tr_torrentLoadPieceHashes (tr_torrent * tor);
+
+/** Frees or unmaps tor->info.pieceHashes if they can be loaded again later. */
+void tr_torrentUnloadPieceHashes (tr_torrent * tor);
+
+static inline const uint8_t *
+tr_torrentPieceHash (const tr_torrent * tor, tr_piece_index_t piece)
+{
+  assert (tor->info.pieceHashes != NULL);
+  assert (piece < tor->info.pieceCount);
+
+  return tor->info.pieceHashes + (size_t)piece * SHA_DIGEST_LENGTH;
+}
+
 uint64_t tr_torrentGetCurrentSizeOnDisk (const tr_torrent * tor);
 
 bool tr_torrentIsStalled (const tr_torrent * tor);
@@ -486,10 +604,16 @@ tr_torrentMissingBytesInPiece (const tr_torrent * tor, tr_piece_index_t i)
   return tr_cpMissingBytesInPiece (&tor->completion, i);
 }
 
-static inline void *
-tr_torrentCreatePieceBitfield (const tr_torrent * tor, size_t * byte_count)
+static inline const void *
+tr_torrentGetPieceBitfield (const tr_torrent * tor, size_t * byte_count)
+{
+  return tr_cpGetPieceBitfield (&tor->completion, byte_count);
+}
+
+static inline const char *
+tr_torrentGetPieceBitfieldBase64 (const tr_torrent * tor)
 {
-  return tr_cpCreatePieceBitfield (&tor->completion, byte_count);
+  return tr_cpGetPieceBitfieldBase64 (&tor->completion);
 }
 
 static inline uint64_t
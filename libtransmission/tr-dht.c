@@ -52,6 +52,7 @@
 #include "crypto.h"
 #include "file.h"
 #include "log.h"
+#include "metrics.h"
 #include "net.h"
 #include "peer-mgr.h" /* tr_peerMgrCompactToPex () */
 #include "platform.h" /* tr_threadNew () */
@@ -65,6 +66,14 @@
 static struct event *dht_timer = NULL;
 static unsigned char myid[20];
 static tr_session *session = NULL;
+static time_t next_save_at = 0;
+
+/* How often we save our routing table, so that a crash or a kill
+   doesn't lose it. */
+#define DHT_SAVE_INTERVAL_SEC (15 * 60)
+
+/* How many saved nodes we ping at a time when warm starting. */
+#define BOOTSTRAP_BATCH_SIZE 8
 
 static void timer_callback (evutil_socket_t s, short type, void *ignore);
 
@@ -183,11 +192,12 @@ dht_bootstrap (void *closure)
 
         /* Our DHT code is able to take up to 9 nodes in a row without
            dropping any. After that, it takes some time to split buckets.
-           So ping the first 8 nodes quickly, then slow down. */
-        if (i < 8)
-            nap (2);
-        else
-            nap (15);
+           So ping the saved nodes in batches of 8, and give each batch's
+           replies a moment to settle before sending the next one. */
+        if ((i + 1) % BOOTSTRAP_BATCH_SIZE != 0)
+            continue;
+
+        nap (2);
 
         if (bootstrap_done (session, 0))
             break;
@@ -324,6 +334,8 @@ tr_dhtInit (tr_session *ss)
     cl->len6 = len6;
     tr_threadNew (dht_bootstrap, cl);
 
+    next_save_at = tr_time () + DHT_SAVE_INTERVAL_SEC;
+
     dht_timer = evtimer_new (session->event_base, timer_callback, session);
     tr_timerAdd (dht_timer, 0, tr_cryptoWeakRandInt (1000000));
 
@@ -337,19 +349,9 @@ tr_dhtInit (tr_session *ss)
     return -1;
 }
 
-void
-tr_dhtUninit (tr_session *ss)
+static void
+dht_save_nodes (tr_session *ss)
 {
-    if (session != ss)
-        return;
-
-    tr_logAddNamedDbg ("DHT", "Uninitializing DHT");
-
-    if (dht_timer != NULL) {
-        event_free (dht_timer);
-        dht_timer = NULL;
-    }
-
     /* Since we only save known good nodes, avoid erasing older data if we
        don't know enough nodes. */
     if ((tr_dhtStatus (ss, AF_INET, NULL) < TR_DHT_FIREWALLED) &&
@@ -389,6 +391,22 @@ tr_dhtUninit (tr_session *ss)
         tr_variantFree (&benc);
         tr_free (dat_file);
     }
+}
+
+void
+tr_dhtUninit (tr_session *ss)
+{
+    if (session != ss)
+        return;
+
+    tr_logAddNamedDbg ("DHT", "Uninitializing DHT");
+
+    if (dht_timer != NULL) {
+        event_free (dht_timer);
+        dht_timer = NULL;
+    }
+
+    dht_save_nodes (ss);
 
     dht_uninit ();
     tr_logAddNamedDbg ("DHT", "Done uninitializing DHT");
@@ -521,14 +539,13 @@ callback (void *ignore UNUSED, int event,
         tor = tr_torrentFindFromHash (session, info_hash);
         if (tor && tr_torrentAllowsDHT (tor))
         {
-            size_t i, n;
+            size_t n;
             tr_pex * pex;
             if (event == DHT_EVENT_VALUES)
                 pex = tr_peerMgrCompactToPex (data, data_len, NULL, 0, &n);
             else
                 pex = tr_peerMgrCompact6ToPex (data, data_len, NULL, 0, &n);
-            for (i=0; i<n; ++i)
-                tr_peerMgrAddPex (tor, TR_PEER_FROM_DHT, pex+i, -1);
+            tr_peerMgrAddPexList (tor, TR_PEER_FROM_DHT, pex, n, NULL, -1);
             tr_free (pex);
             tr_logAddTorDbg (tor, "Learned %d %s peers from DHT",
                     (int)n,
@@ -593,35 +610,107 @@ tr_dhtAnnounce (tr_torrent *tor, int af, bool announce)
     return ret;
 }
 
-void
-tr_dhtUpkeep (tr_session * session)
+/* How many of our searches may run at once, per address family.
+   The DHT code refuses new searches once its table is full, so we
+   stay well below DHT_MAX_SEARCHES and let the running ones finish. */
+#define MAX_CONCURRENT_SEARCHES 64
+
+/* How many searches we start per address family each second.
+   Torrents that are due wait their turn, so announces get spread
+   out instead of all firing at startup. */
+#define MAX_SEARCHES_PER_UPKEEP 2
+
+struct dht_candidate
 {
+    tr_torrent * tor;
+    int peerCount;
+    time_t announceAt;
+};
+
+/* torrents that know of the fewest peers go first */
+static int
+compareCandidates (const void * va, const void * vb)
+{
+    const struct dht_candidate * a = va;
+    const struct dht_candidate * b = vb;
+
+    if (a->peerCount != b->peerCount)
+        return a->peerCount < b->peerCount ? -1 : 1;
+
+    if (a->announceAt != b->announceAt)
+        return a->announceAt < b->announceAt ? -1 : 1;
+
+    return 0;
+}
+
+static void
+dhtUpkeepFamily (tr_session * session, int af, const time_t now)
+{
+    int i;
+    int n = 0;
+    int running = 0;
+    int budget;
     tr_torrent * tor = NULL;
-    const time_t now = tr_time ();
+    struct dht_candidate * candidates;
+
+    candidates = tr_new (struct dht_candidate, tr_sessionCountTorrents (session));
 
     while ((tor = tr_torrentNext (session, tor)))
     {
-        if (!tor->isRunning || !tr_torrentAllowsDHT (tor))
+        tr_swarm_stats stats;
+        const time_t at = af == AF_INET6 ? tor->dhtAnnounce6At
+                                         : tor->dhtAnnounceAt;
+
+        if (af == AF_INET6 ? tor->dhtAnnounce6InProgress
+                           : tor->dhtAnnounceInProgress)
+            ++running;
+
+        if (!tor->isRunning || !tr_torrentAllowsDHT (tor) || (at > now))
             continue;
 
-        if (tor->dhtAnnounceAt <= now)
-        {
-            const int rc = tr_dhtAnnounce (tor, AF_INET, 1);
+        tr_swarmGetStats (tor->swarm, &stats);
+        candidates[n].tor = tor;
+        candidates[n].peerCount = stats.peerCount;
+        candidates[n].announceAt = at;
+        ++n;
+    }
 
-            tor->dhtAnnounceAt = now + ((rc == 0)
-                                     ? 5 + tr_cryptoWeakRandInt (5)
-                                     : 25 * 60 + tr_cryptoWeakRandInt (3*60));
-        }
+    budget = MIN (MAX_SEARCHES_PER_UPKEEP, MAX_CONCURRENT_SEARCHES - running);
 
-        if (tor->dhtAnnounce6At <= now)
-        {
-            const int rc = tr_dhtAnnounce (tor, AF_INET6, 1);
+    if (n > budget)
+        qsort (candidates, n, sizeof (struct dht_candidate), compareCandidates);
 
-            tor->dhtAnnounce6At = now + ((rc == 0)
-                                      ? 5 + tr_cryptoWeakRandInt (5)
-                                      : 25 * 60 + tr_cryptoWeakRandInt (3*60));
-        }
+    for (i=0; i<n && i<budget; ++i)
+    {
+        const int rc = tr_dhtAnnounce (candidates[i].tor, af, 1);
+        const time_t next = now + ((rc == 0)
+                                   ? 5 + tr_cryptoWeakRandInt (5)
+                                   : 25 * 60 + tr_cryptoWeakRandInt (3*60));
+
+        if (af == AF_INET6)
+            candidates[i].tor->dhtAnnounce6At = next;
+        else
+            candidates[i].tor->dhtAnnounceAt = next;
+    }
+
+    tr_free (candidates);
+}
+
+void
+tr_dhtUpkeep (tr_session * session)
+{
+    const time_t now = tr_time ();
+
+    if (!tr_dhtEnabled (session))
+        return;
+
+    if (next_save_at <= now) {
+        next_save_at = now + DHT_SAVE_INTERVAL_SEC;
+        dht_save_nodes (session);
     }
+
+    dhtUpkeepFamily (session, AF_INET, now);
+    dhtUpkeepFamily (session, AF_INET6, now);
 }
 
 void
@@ -658,7 +747,9 @@ tr_dhtCallback (unsigned char *buf, int buflen,
 static void
 timer_callback (evutil_socket_t s UNUSED, short type UNUSED, void *session)
 {
+    const uint64_t started = tr_metricsNow ();
     tr_dhtCallback (NULL, 0, NULL, 0, session);
+    tr_metricsCallbackDone (session, TR_HISTOGRAM_DHT_TIMER, started);
 }
 
 /* This function should return true when a node is blacklisted.  We do
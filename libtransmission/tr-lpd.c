@@ -62,7 +62,8 @@ THE SOFTWARE.
 * @file tr-lpd.c
 *
 * This module implements the Local Peer Discovery (LPD) protocol as supported by the
-* uTorrent client application. A typical LPD datagram is 119 bytes long.
+* uTorrent client application. A typical LPD datagram is 119 bytes long, plus
+* 52 bytes for each additional torrent announced in it.
 *
 * $Id$
 */
@@ -82,7 +83,10 @@ static tr_port lpd_port;
 static tr_torrent* lpd_torStaticType UNUSED; /* just a helper for static type analysis */
 static tr_session* session;
 
-enum { lpd_maxDatagramLength = 200 }; /**<the size an LPD datagram must not exceed */
+enum {
+    lpd_maxDatagramLength = 1400, /**<the size an LPD datagram must not exceed; fits an Ethernet frame */
+    lpd_maxHashesPerDatagram = 20 /**<Infohash lines per announce, 52 bytes each */
+};
 const char lpd_mcastGroup[] = "239.192.152.143"; /**<LPD multicast group */
 const int lpd_mcastPort = 6771; /**<LPD source and destination UPD port */
 static struct sockaddr_in lpd_mcastAddr; /**<initialized from the above constants in tr_lpdInit */
@@ -104,7 +108,8 @@ enum lpd_enumTimeToLive {
 
 enum {
     lpd_announceInterval = 4 * 60, /**<4 min announce interval per torrent */
-    lpd_announceScope = lpd_ttlSameSubnet /**<the maximum scope for LPD datagrams */
+    lpd_announceScope = lpd_ttlSameSubnet, /**<the maximum scope for LPD datagrams */
+    lpd_maxDatagramsPerUpkeep = 5 /**<stay well below other nodes' flood protection */
 };
 
 
@@ -147,46 +152,46 @@ static int lpd_unsolicitedMsgCounter;
 
 /**
 * @brief Checks for BT-SEARCH method and separates the parameter section
-* @param[in] s The request string
+* @param[in] s The message, which needn't be zero-terminated
+* @param[in] len The length of the message
 * @param[out] ver If non-NULL, gets filled with protocol info from the request
-* @return Returns a relative pointer to the beginning of the parameter section;
-*         if result is NULL, s was invalid and no information will be returned
-* @remark Note that the returned pointer is only usable as long as the given
-*         pointer s is valid; that is, return storage is temporary.
+* @return Returns a pointer to the first parameter line; if result is NULL,
+*         s was invalid and no information will be returned
 *
-* Determines whether the given string checks out to be a valid BT-SEARCH message.
-* If so, the return value points to the beginning of the parameter section (note:
-* in this case the function returns a character sequence beginning with CRLF).
-* If parameter is not NULL, the declared protocol version is returned as part of
-* the lpd_protocolVersion structure.
+* Determines whether the given message checks out to be a valid BT-SEARCH message,
+* i.e. a request line, any number of "Name: Value" lines and a blank line, each
+* ending with CRLF. Anything after the blank line is ignored. The message is only
+* looked at, never copied.
 */
-static const char* lpd_extractHeader (const char* s, struct lpd_protocolVersion* const ver)
+static const char* lpd_extractHeader (const char* s, size_t len, struct lpd_protocolVersion* const ver)
 {
-    int major = -1, minor = -1;
-    size_t len;
+    static const char method[] = "BT-SEARCH * HTTP/";
+    const char* const end = s + len;
+    const char* walk = s + strlen (method);
+    int major = 0, minor = 0;
 
     assert (s != NULL);
-    len = strlen (s);
 
     /* something might be rotten with this chunk of data */
     if (len == 0 || len > lpd_maxDatagramLength)
         return NULL;
 
     /* now we can attempt to look up the BT-SEARCH header */
-    if (sscanf (s, "BT-SEARCH * HTTP/%d.%d" CRLF, &major, &minor) != 2)
+    if (len < strlen (method) || memcmp (s, method, strlen (method)) != 0)
         return NULL;
 
-    if (major < 0 || minor < 0)
+    if (walk == end || !isdigit ((unsigned char)*walk))
         return NULL;
+    for (; walk != end && isdigit ((unsigned char)*walk) && major < 1000; ++walk)
+        major = major * 10 + (*walk - '0');
 
-    {
-        /* a pair of blank lines at the end of the string, no place else */
-        const char* const two_blank = CRLF CRLF CRLF;
-        const char* const end = strstr (s, two_blank);
+    if (walk == end || *walk++ != '.' || walk == end || !isdigit ((unsigned char)*walk))
+        return NULL;
+    for (; walk != end && isdigit ((unsigned char)*walk) && minor < 1000; ++walk)
+        minor = minor * 10 + (*walk - '0');
 
-        if (end == NULL || strlen (end) > strlen (two_blank))
-            return NULL;
-    }
+    if (end - walk < 2 || memcmp (walk, CRLF, 2) != 0)
+        return NULL;
 
     if (ver != NULL)
     {
@@ -194,64 +199,62 @@ static const char* lpd_extractHeader (const char* s, struct lpd_protocolVersion*
         ver->minor = minor;
     }
 
-    /* separate the header, begins with CRLF */
-    return strstr (s, CRLF);
+    return walk + 2;
 }
 
 /**
-* @brief Return the value of a named parameter
-*
-* @param[in] str Input string of "\r\nName: Value" pairs without HTTP-style method part
-* @param[in] name Name of parameter to extract
-* @param[in] n Maximum available storage for value to return
-* @param[out] val Output parameter for the actual value
-* @return Returns 1 if value could be copied successfully
+* @brief Step to the next named parameter
 *
-* Extracts the associated value of a named parameter from a HTTP-style header by
-* performing the following steps:
-*   - assemble search string "\r\nName: " and locate position
-*   - copy back value from end to next "\r\n"
+* @param[in,out] walk The start of the current line; advanced to the next line
+* @param[in] end The end of the message
+* @param[out] name Gets the parameter's name, which is not zero-terminated
+* @param[out] name_len Gets the length of name
+* @param[out] val Gets the parameter's value, which is not zero-terminated
+* @param[out] val_len Gets the length of val
+* @return Returns 1 if a parameter was found, 0 at the blank line that ends the
+*         parameter section, or -1 if the message is malformed
 */
-static int lpd_extractParam (const char* const str, const char* const name, int n, char* const val)
+static int lpd_nextParam (const char** walk, const char* const end,
+                          const char** name, size_t* name_len,
+                          const char** val, size_t* val_len)
 {
-    /* configure maximum length of search string here */
-    enum { maxLength = 30 };
-    char sstr[maxLength] = { 0 };
-    const char* pos;
+    const char* const line = *walk;
+    const char* eol;
+    const char* colon;
 
-    assert (str != NULL && name != NULL);
-    assert (val != NULL);
+    assert (walk != NULL && *walk != NULL && end != NULL);
 
-    if (strlen (name) > maxLength - strlen (CRLF ": "))
-        return 0;
+    for (eol = line; end - eol >= 2 && memcmp (eol, CRLF, 2) != 0; ++eol)
+        ;
 
-    /* compose the string token to search for */
-    tr_snprintf (sstr, maxLength, CRLF "%s: ", name);
+    if (end - eol < 2)
+        return -1; /* the last line has to end with CRLF, too */
 
-    pos = strstr (str, sstr);
-    if (pos == NULL)
-        return 0; /* search was not successful */
+    *walk = eol + 2;
 
-    {
-        const char* const beg = pos + strlen (sstr);
-        const char* const new_line = strstr (beg, CRLF);
+    if (eol == line)
+        return 0;
 
-        /* the value is delimited by the next CRLF */
-        int len = new_line - beg;
+    colon = memchr (line, ':', eol - line);
+    if (colon == NULL)
+        return -1;
 
-        /* if value string hits the length limit n,
-         * leave space for a trailing '\0' character */
-        if (len < n--)
-            n = len;
+    *name = line;
+    *name_len = colon - line;
 
-        strncpy (val, beg, n);
-        val[n] = 0;
-    }
+    for (++colon; colon != eol && *colon == ' '; ++colon)
+        ;
 
-    /* we successfully returned the value string */
+    *val = colon;
+    *val_len = eol - colon;
     return 1;
 }
 
+static bool lpd_paramIs (const char* name, size_t name_len, const char* expected)
+{
+    return name_len == strlen (expected) && evutil_ascii_strncasecmp (name, expected, name_len) == 0;
+}
+
 /**
 * @} */
 
@@ -423,45 +426,55 @@ static inline void lpd_consistencyCheck (void)
 */
 
 /**
-* @brief Announce the given torrent on the local network
+* @brief Announce the given torrents on the local network in a single datagram
 *
-* @param[in] t Torrent to announce
+* @param[in] tors Torrents to announce
+* @param[in] n How many; at most lpd_maxHashesPerDatagram
 * @return Returns true on success
 *
-* Send a query for torrent t out to the LPD multicast group (or the LAN, for that
+* Send a query for the torrents out to the LPD multicast group (or the LAN, for that
 * matter). A listening client on the same network might react by adding us to his
-* peer pool for torrent t.
+* peer pool for those torrents. BEP 14 allows one Infohash line per torrent.
 */
-bool
-tr_lpdSendAnnounce (const tr_torrent* t)
+static bool
+lpd_sendAnnounce (const tr_torrent** tors, int n)
 {
-    size_t i;
-    const char fmt[] =
-        "BT-SEARCH * HTTP/%u.%u" CRLF
-        "Host: %s:%u" CRLF
-        "Port: %u" CRLF
-        "Infohash: %s" CRLF
-        CRLF
-        CRLF;
-
-    char hashString[lengthof (t->info.hashString)];
-    char query[lpd_maxDatagramLength + 1] = { 0 };
+    int i;
+    size_t j;
+    int len;
+    char query[lpd_maxDatagramLength + 1];
 
-    if (t == NULL)
-        return false;
-
-    /* make sure the hash string is normalized, just in case */
-    for (i = 0; i < sizeof hashString; i++)
-        hashString[i] = toupper (t->info.hashString[i]);
+    assert (n > 0 && n <= lpd_maxHashesPerDatagram);
 
     /* prepare a zero-terminated announce message */
-    tr_snprintf (query, lpd_maxDatagramLength + 1, fmt, 1, 1,
-                 lpd_mcastGroup, lpd_mcastPort, lpd_port, hashString);
+    len = tr_snprintf (query, sizeof query,
+                       "BT-SEARCH * HTTP/%u.%u" CRLF
+                       "Host: %s:%u" CRLF
+                       "Port: %u" CRLF,
+                       1, 1, lpd_mcastGroup, lpd_mcastPort, lpd_port);
 
-    /* actually send the query out using [lpd_socket2] */
+    for (i = 0; i < n; i++)
     {
-        const int len = strlen (query);
+        const char* const hashString = tors[i]->info.hashString;
+
+        memcpy (query + len, "Infohash: ", 10);
+        len += 10;
+
+        /* make sure the hash string is normalized, just in case */
+        for (j = 0; j < SHA_DIGEST_LENGTH * 2; j++)
+            query[len++] = toupper (hashString[j]);
+
+        memcpy (query + len, CRLF, 2);
+        len += 2;
+    }
 
+    memcpy (query + len, CRLF CRLF, 4);
+    len += 4;
+
+    assert (len <= lpd_maxDatagramLength);
+
+    /* actually send the query out using [lpd_socket2] */
+    {
         /* destination address info has already been set up in tr_lpdInit (),
          * so we refrain from preparing another sockaddr_in here */
         int res = sendto (lpd_socket2, query, len, 0,
@@ -471,62 +484,106 @@ tr_lpdSendAnnounce (const tr_torrent* t)
             return false;
     }
 
-    tr_logAddTorDbg (t, "LPD announce message away");
+    for (i = 0; i < n; i++)
+        tr_logAddTorDbg (tors[i], "LPD announce message away");
 
     return true;
 }
 
+/**
+* @brief Announce the given torrent on the local network
+*
+* @param[in] t Torrent to announce
+* @return Returns true on success
+*/
+bool
+tr_lpdSendAnnounce (const tr_torrent* t)
+{
+    if (t == NULL)
+        return false;
+
+    return lpd_sendAnnounce (&t, 1);
+}
+
 /**
 * @brief Process incoming unsolicited messages and add the peer to the announced
-* torrent if all checks are passed.
+* torrents if all checks are passed.
 *
 * @param[in,out] peer Adress information of the peer to add
 * @param[in] msg The announcement message to consider
-* @return Returns 0 if any input parameter or the announce was invalid, 1 if the peer
-* was successfully added, -1 if not; a non-null return value indicates a side-effect to
-* the peer in/out parameter.
+* @param[in] len The length of msg
+* @return Returns 0 if any input parameter or the announce was invalid, the number of
+* torrents the peer was added to if any, -1 if none; a non-null return value indicates
+* a side-effect to the peer in/out parameter.
 *
 * @note The port information gets added to the peer structure if tr_lpdConsiderAnnounce
 * is able to extract the necessary information from the announce message. That is, if
 * return != 0, the caller may retrieve the value from the passed structure.
 */
-static int tr_lpdConsiderAnnounce (tr_pex* peer, const char* const msg)
+static int tr_lpdConsiderAnnounce (tr_pex* peer, const char* const msg, size_t len)
 {
-    enum
-    {
-        maxValueLen = 25,
-        maxHashLen = lengthof (lpd_torStaticType->info.hashString)
-    };
-
     struct lpd_protocolVersion ver = { -1, -1 };
-    char value[maxValueLen] = { 0 };
-    char hashString[maxHashLen] = { 0 };
-    int res = 0, peerPort = 0;
+    const char* const end = msg + len;
+    const char* params;
+    const char* walk;
+    const char* name;
+    const char* val;
+    size_t name_len, val_len;
+    int res = 0, peerPort = -1;
+    int ret;
+
+    if (peer == NULL || msg == NULL)
+        return 0;
 
-    if (peer != NULL && msg != NULL)
-    {
-        tr_torrent* tor = NULL;
+    params = lpd_extractHeader (msg, len, &ver);
+    if (params == NULL || ver.major != 1) /* allow messages of protocol v1 */
+        return 0;
 
-        const char* params = lpd_extractHeader (msg, &ver);
-        if (params == NULL || ver.major != 1) /* allow messages of protocol v1 */
-            return 0;
+    /* save the effort to check Host, which seems to be optional anyway.
+     * Port may come after the Infohash lines, so look for it first */
+    walk = params;
+    while ((ret = lpd_nextParam (&walk, end, &name, &name_len, &val, &val_len)) > 0)
+    {
+        if (lpd_paramIs (name, name_len, "Port"))
+        {
+            /* determine announced peer port, refuse if value too large */
+            size_t i;
+            peerPort = 0;
+            for (i = 0; i < val_len && peerPort <= (in_port_t)-1; i++)
+            {
+                if (!isdigit ((unsigned char)val[i]))
+                    return 0;
+                peerPort = peerPort * 10 + (val[i] - '0');
+            }
+            if (val_len == 0 || peerPort > (in_port_t)-1)
+                return 0;
+        }
+    }
 
-        /* save the effort to check Host, which seems to be optional anyway */
+    if (ret < 0 || peerPort < 0)
+        return 0;
 
-        if (lpd_extractParam (params, "Port", maxValueLen, value) == 0)
-            return 0;
+    peer->port = htons (peerPort);
+    res = -1; /* signal caller side-effect to peer->port via return != 0 */
 
-        /* determine announced peer port, refuse if value too large */
-        if (sscanf (value, "%d", &peerPort) != 1 || peerPort > (in_port_t)-1)
-            return 0;
+    walk = params;
+    while (lpd_nextParam (&walk, end, &name, &name_len, &val, &val_len) > 0)
+    {
+        size_t i;
+        tr_torrent* tor;
+        uint8_t hash[SHA_DIGEST_LENGTH];
 
-        peer->port = htons (peerPort);
-        res = -1; /* signal caller side-effect to peer->port via return != 0 */
+        if (!lpd_paramIs (name, name_len, "Infohash") || val_len != SHA_DIGEST_LENGTH * 2)
+            continue;
 
-        if (lpd_extractParam (params, "Infohash", maxHashLen, hashString) == 0)
-            return res;
+        for (i = 0; i < val_len; i++)
+            if (!isxdigit ((unsigned char)val[i]))
+                break;
+        if (i != val_len)
+            continue;
 
-        tor = tr_torrentFindFromHashString (session, hashString);
+        tr_hex_to_sha1 (hash, val);
+        tor = tr_torrentFindFromHash (session, hash);
 
         if (tr_isTorrent (tor) && tr_torrentAllowsLPD (tor))
         {
@@ -537,10 +594,10 @@ static int tr_lpdConsiderAnnounce (tr_pex* peer, const char* const msg)
 
             /* periodic reconnectPulse () deals with the rest... */
 
-            return 1;
+            res = res < 0 ? 1 : res + 1;
         }
         else
-            tr_logAddNamedDbg ("LPD", "Cannot serve torrent #%s", hashString);
+            tr_logAddNamedDbg ("LPD", "Cannot serve torrent #%.*s", (int)val_len, val);
     }
 
     return res;
@@ -562,48 +619,49 @@ static int tr_lpdConsiderAnnounce (tr_pex* peer, const char* const msg)
 static int
 tr_lpdAnnounceMore (const time_t now, const int interval)
 {
-    tr_torrent* tor = NULL;
+    int announcePrio;
     int announcesSent = 0;
+    int datagramsSent = 0;
+    int n = 0;
+    const tr_torrent* batch[lpd_maxHashesPerDatagram];
 
     if (!tr_isSession (session))
         return -1;
 
-    while ((tor = tr_torrentNext (session, tor))
-          && tr_sessionAllowsLPD (session))
+    /* issue #3208: prioritize downloads before seeds.
+     * The torrents that are due get packed into as few datagrams as possible;
+     * whatever doesn't fit into this interval's datagrams waits for the next one. */
+    for (announcePrio = 1; announcePrio <= 2 && tr_sessionAllowsLPD (session); announcePrio++)
     {
-        if (tr_isTorrent (tor))
+        tr_torrent* tor = NULL;
+        const tr_torrent_activity activity = announcePrio == 1 ? TR_STATUS_DOWNLOAD
+                                                               : TR_STATUS_SEED;
+
+        while (datagramsSent < lpd_maxDatagramsPerUpkeep
+               && (tor = tr_torrentNext (session, tor)) != NULL)
         {
-            int announcePrio = 0;
+            if (!tr_isTorrent (tor) || !tr_torrentAllowsLPD (tor))
+                continue;
 
-            if (!tr_torrentAllowsLPD (tor))
+            if (tor->lpdAnnounceAt > now || tr_torrentGetActivity (tor) != activity)
                 continue;
 
-            /* issue #3208: prioritize downloads before seeds */
-            switch (tr_torrentGetActivity (tor))
-            {
-            case TR_STATUS_DOWNLOAD:
-                announcePrio = 1;
-                break;
-            case TR_STATUS_SEED:
-                announcePrio = 2;
-                break;
-            default: /* fall through */
-                break;
-            }
+            batch[n++] = tor;
+            tor->lpdAnnounceAt = now + lpd_announceInterval * announcePrio;
 
-            if (announcePrio > 0 && tor->lpdAnnounceAt <= now)
+            if (n == lpd_maxHashesPerDatagram)
             {
-                if (tr_lpdSendAnnounce (tor))
-                    announcesSent++;
-
-                tor->lpdAnnounceAt = now +
-                    lpd_announceInterval * announcePrio;
-
-                break; /* that's enough; for this interval */
+                if (lpd_sendAnnounce (batch, n))
+                    announcesSent += n;
+                datagramsSent++;
+                n = 0;
             }
         }
     }
 
+    if (n > 0 && lpd_sendAnnounce (batch, n))
+        announcesSent += n;
+
     /* perform housekeeping for the flood protection mechanism */
     {
         const int maxAnnounceCap = interval * lpd_announceCapFactor;
@@ -643,8 +701,7 @@ static void event_callback (evutil_socket_t s UNUSED, short type, void* ignore U
         struct sockaddr_in foreignAddr;
         int addrLen = sizeof foreignAddr;
 
-        /* be paranoid enough about zero terminating the foreign string */
-        char foreignMsg[lpd_maxDatagramLength + 1] = { 0 };
+        char foreignMsg[lpd_maxDatagramLength];
 
         /* process local announcement from foreign peer */
         int res = recvfrom (lpd_socket, foreignMsg, lpd_maxDatagramLength,
@@ -663,7 +720,7 @@ static void event_callback (evutil_socket_t s UNUSED, short type, void* ignore U
                 };
 
             foreignPeer.addr.addr.addr4 = foreignAddr.sin_addr;
-            if (tr_lpdConsiderAnnounce (&foreignPeer, foreignMsg) != 0)
+            if (tr_lpdConsiderAnnounce (&foreignPeer, foreignMsg, res) != 0)
                 return; /* OK so far, no log message */
         }
 
@@ -21,6 +21,10 @@ THE SOFTWARE.
 
 */
 
+#if defined (HAVE_RECVMMSG) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* glibc's sys/socket.h needs this to pick up recvmmsg */
+#endif
+
 #include <assert.h>
 #include <string.h> /* memcmp (), memcpy (), memset () */
 #include <stdlib.h> /* malloc (), free () */
@@ -187,22 +191,18 @@ rebind_ipv6 (tr_session *ss, bool force)
     }
 }
 
-static void
-event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+enum
 {
-    int rc;
-    socklen_t fromlen;
-    unsigned char buf[4096];
-    struct sockaddr_storage from;
-    tr_session *ss = sv;
-
-    assert (tr_isSession (sv));
-    assert (type == EV_READ);
+    UDP_PACKET_SIZE = 4096,
 
-    fromlen = sizeof (from);
-    rc = recvfrom (s, buf, 4096 - 1, 0,
-                (struct sockaddr*)&from, &fromlen);
+    /* how many datagrams to read per recvmmsg () call */
+    UDP_BATCH_SIZE = 16
+};
 
+static void
+handlePacket (tr_session * ss, unsigned char * buf, int rc,
+              const struct sockaddr * from, socklen_t fromlen)
+{
     /* Since most packets we receive here are ÂµTP, make quick inline
        checks for the other protocols.  The logic is as follows:
        - all DHT packets start with 'd';
@@ -214,7 +214,7 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
         if (buf[0] == 'd') {
             if (tr_sessionAllowsDHT (ss)) {
                 buf[rc] = '\0'; /* required by the DHT code */
-                tr_dhtCallback (buf, rc, (struct sockaddr*)&from, fromlen, sv);
+                tr_dhtCallback (buf, rc, (struct sockaddr*)from, fromlen, ss);
             }
         } else if (rc >= 8 &&
                    buf[0] == 0 && buf[1] == 0 && buf[2] == 0 && buf[3] <= 3) {
@@ -223,7 +223,7 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
                 tr_logAddNamedDbg ("UDP", "Couldn't parse UDP tracker packet.");
         } else {
             if (tr_sessionIsUTPEnabled (ss)) {
-                rc = tr_utpPacket (buf, rc, (struct sockaddr*)&from, fromlen, ss);
+                rc = tr_utpPacket (buf, rc, (struct sockaddr*)from, fromlen, ss);
                 if (!rc)
                     tr_logAddNamedDbg ("UDP", "Unexpected UDP packet");
             }
@@ -231,6 +231,64 @@ event_callback (evutil_socket_t s, short type UNUSED, void *sv)
     }
 }
 
+#ifdef HAVE_RECVMMSG
+
+/* Read as many as UDP_BATCH_SIZE queued datagrams in one system call.
+   These only ever get used from the libevent thread. */
+static void
+event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+{
+    int i;
+    int n;
+    static unsigned char bufs[UDP_BATCH_SIZE][UDP_PACKET_SIZE];
+    static struct sockaddr_storage froms[UDP_BATCH_SIZE];
+    static struct iovec iovs[UDP_BATCH_SIZE];
+    static struct mmsghdr msgs[UDP_BATCH_SIZE];
+    tr_session *ss = sv;
+
+    assert (tr_isSession (sv));
+    assert (type == EV_READ);
+
+    memset (msgs, 0, sizeof (msgs));
+    for (i=0; i<UDP_BATCH_SIZE; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = UDP_PACKET_SIZE - 1;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &froms[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof (froms[i]);
+    }
+
+    n = recvmmsg (s, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+    for (i=0; i<n; ++i)
+        handlePacket (ss, bufs[i], msgs[i].msg_len,
+                      (struct sockaddr*)&froms[i], msgs[i].msg_hdr.msg_namelen);
+}
+
+#else
+
+static void
+event_callback (evutil_socket_t s, short type UNUSED, void *sv)
+{
+    int rc;
+    socklen_t fromlen;
+    unsigned char buf[UDP_PACKET_SIZE];
+    struct sockaddr_storage from;
+    tr_session *ss = sv;
+
+    assert (tr_isSession (sv));
+    assert (type == EV_READ);
+
+    fromlen = sizeof (from);
+    rc = recvfrom (s, buf, UDP_PACKET_SIZE - 1, 0,
+                (struct sockaddr*)&from, &fromlen);
+
+    handlePacket (ss, buf, rc, (struct sockaddr*)&from, fromlen);
+}
+
+#endif
+
 void
 tr_udpInit (tr_session *ss)
 {
@@ -21,7 +21,13 @@ THE SOFTWARE.
 
 */
 
+#if defined (HAVE_SENDMMSG) && !defined (_GNU_SOURCE)
+ #define _GNU_SOURCE /* glibc's sys/socket.h needs this to pick up sendmmsg */
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <string.h> /* memcpy () */
 
 #include <event2/event.h>
 
@@ -29,6 +35,7 @@ THE SOFTWARE.
 
 #include "transmission.h"
 #include "log.h"
+#include "metrics.h"
 #include "net.h"
 #include "session.h"
 #include "crypto.h" /* tr_cryptoWeakRandInt () */
@@ -86,6 +93,8 @@ struct UTPSocket *UTP_Create (SendToProc *send_to_proc UNUSED,
 
 void tr_utpClose (tr_session * ss UNUSED) { }
 
+void tr_utpWakeTimer (tr_session * ss UNUSED) { }
+
 void tr_utpSendTo (void *closure UNUSED,
                   const unsigned char *buf UNUSED, size_t buflen UNUSED,
                   const struct sockaddr *to UNUSED, socklen_t tolen UNUSED) { }
@@ -98,6 +107,109 @@ void tr_utpSendTo (void *closure UNUSED,
 
 static struct event *utp_timer = NULL;
 
+#ifdef HAVE_SENDMMSG
+
+/* libutp hands us one datagram at a time, often dozens in a row while
+   it's processing a packet or checking timeouts. Rather than a sendto ()
+   for each, they're copied into this pool and go out together in a
+   sendmmsg () once the event loop gets back around to us, or sooner if
+   the pool fills up. These only ever get used from the libevent thread. */
+
+enum
+{
+    UTP_SEND_BATCH = 32,
+
+    /* libutp's packets are never bigger than an Ethernet MTU */
+    UTP_SEND_SLOT_SIZE = 1536
+};
+
+static struct event *utp_flush_event = NULL;
+static int send_count = 0;
+static int send_fds[UTP_SEND_BATCH];
+static unsigned char send_bufs[UTP_SEND_BATCH][UTP_SEND_SLOT_SIZE];
+static struct sockaddr_storage send_tos[UTP_SEND_BATCH];
+static struct iovec send_iovs[UTP_SEND_BATCH];
+static struct mmsghdr send_msgs[UTP_SEND_BATCH];
+
+static void
+flush_sends (void)
+{
+    int i;
+
+    /* consecutive datagrams for the same socket share a sendmmsg () */
+    for (i=0; i<send_count; )
+    {
+        int n;
+        int rc;
+
+        for (n=1; i+n<send_count && send_fds[i+n]==send_fds[i]; )
+            ++n;
+
+        rc = sendmmsg (send_fds[i], send_msgs + i, n, 0);
+        if (rc <= 0)
+        {
+            /* just like a lost packet, libutp will resend what it needs */
+            dbgmsg ("sendmmsg failed: %s", tr_strerror (errno));
+            rc = n;
+        }
+
+        i += rc;
+    }
+
+    send_count = 0;
+}
+
+static void
+flush_callback (evutil_socket_t s UNUSED, short type UNUSED, void *closure UNUSED)
+{
+    flush_sends ();
+}
+
+static void
+queue_send (tr_session *ss, int fd, const unsigned char *buf, size_t buflen,
+            const struct sockaddr *to, socklen_t tolen)
+{
+    struct mmsghdr * msg;
+
+    if (utp_flush_event == NULL)
+        utp_flush_event = event_new (ss->event_base, -1, 0, flush_callback, NULL);
+
+    if (utp_flush_event == NULL || buflen > UTP_SEND_SLOT_SIZE || tolen > sizeof (send_tos[0]))
+    {
+        flush_sends ();
+        sendto (fd, buf, buflen, 0, to, tolen);
+        return;
+    }
+
+    memcpy (send_bufs[send_count], buf, buflen);
+    memcpy (&send_tos[send_count], to, tolen);
+    send_fds[send_count] = fd;
+    send_iovs[send_count].iov_base = send_bufs[send_count];
+    send_iovs[send_count].iov_len = buflen;
+    msg = &send_msgs[send_count];
+    memset (msg, 0, sizeof (*msg));
+    msg->msg_hdr.msg_name = &send_tos[send_count];
+    msg->msg_hdr.msg_namelen = tolen;
+    msg->msg_hdr.msg_iov = &send_iovs[send_count];
+    msg->msg_hdr.msg_iovlen = 1;
+
+    if (++send_count == UTP_SEND_BATCH)
+        flush_sends ();
+    else if (send_count == 1)
+        event_active (utp_flush_event, 0, 0);
+}
+
+#else
+
+static void
+queue_send (tr_session *ss UNUSED, int fd, const unsigned char *buf, size_t buflen,
+            const struct sockaddr *to, socklen_t tolen)
+{
+    sendto (fd, buf, buflen, 0, to, tolen);
+}
+
+#endif
+
 static void
 incoming (void *closure, struct UTPSocket *s)
 {
@@ -131,9 +243,9 @@ tr_utpSendTo (void *closure, const unsigned char *buf, size_t buflen,
     tr_session *ss = closure;
 
     if (to->sa_family == AF_INET && ss->udp_socket)
-        sendto (ss->udp_socket, buf, buflen, 0, to, tolen);
+        queue_send (ss, ss->udp_socket, buf, buflen, to, tolen);
     else if (to->sa_family == AF_INET6 && ss->udp_socket)
-        sendto (ss->udp6_socket, buf, buflen, 0, to, tolen);
+        queue_send (ss, ss->udp6_socket, buf, buflen, to, tolen);
 }
 
 static void
@@ -160,23 +272,45 @@ static void
 timer_callback (int s UNUSED, short type UNUSED, void *closure)
 {
     tr_session *ss = closure;
+    const uint64_t started = tr_metricsNow ();
     UTP_CheckTimeouts ();
-    reset_timer (ss);
+
+    /* Once the last socket is gone there's nothing left to time out,
+       so let the timer lapse until a packet or a new outgoing
+       connection wakes it up again. */
+    if (UTP_GetSocketCount () > 0)
+        reset_timer (ss);
+
+    tr_metricsCallbackDone (ss, TR_HISTOGRAM_UTP_TIMER, started);
 }
 
-int
-tr_utpPacket (const unsigned char *buf, size_t buflen,
-             const struct sockaddr *from, socklen_t fromlen,
-             tr_session *ss)
+void
+tr_utpWakeTimer (tr_session *ss)
 {
-    if (!ss->isClosed && !utp_timer)
+    if (ss->isClosed)
+        return;
+
+    if (utp_timer == NULL)
     {
         utp_timer = evtimer_new (ss->event_base, timer_callback, ss);
         if (utp_timer == NULL)
-            return -1;
-        reset_timer (ss);
+            return;
     }
 
+    if (!evtimer_pending (utp_timer, NULL))
+        reset_timer (ss);
+}
+
+int
+tr_utpPacket (const unsigned char *buf, size_t buflen,
+             const struct sockaddr *from, socklen_t fromlen,
+             tr_session *ss)
+{
+    tr_utpWakeTimer (ss);
+
+    if (!ss->isClosed && utp_timer == NULL)
+        return -1;
+
     return UTP_IsIncomingUTP (incoming, tr_utpSendTo, ss,
                              buf, buflen, from, fromlen);
 }
@@ -189,6 +323,16 @@ tr_utpClose (tr_session * session UNUSED)
         evtimer_del (utp_timer);
         utp_timer = NULL;
     }
+
+#ifdef HAVE_SENDMMSG
+    flush_sends ();
+
+    if (utp_flush_event)
+    {
+        event_free (utp_flush_event);
+        utp_flush_event = NULL;
+    }
+#endif
 }
 
 #endif /* #ifndef WITH_UTP ... else */
@@ -34,6 +34,8 @@ int tr_utpPacket (const unsigned char *buf, size_t buflen,
 
 void tr_utpClose (tr_session *);
 
+void tr_utpWakeTimer (tr_session *);
+
 void tr_utpSendTo (void *closure, const unsigned char *buf, size_t buflen,
                   const struct sockaddr *to, socklen_t tolen);
 
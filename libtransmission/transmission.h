@@ -105,7 +105,11 @@ typedef enum
 {
     TR_PREALLOCATE_NONE   = 0,
     TR_PREALLOCATE_SPARSE = 1,
-    TR_PREALLOCATE_FULL   = 2
+    TR_PREALLOCATE_FULL   = 2,
+
+    /* reserve space in large extents just ahead of where data's written,
+       without changing the file's size. Like _NONE where that's unsupported */
+    TR_PREALLOCATE_INCREMENTAL = 3
 }
 tr_preallocation_mode;
 
@@ -547,6 +551,94 @@ void  tr_sessionSetLPDEnabled (tr_session * session, bool enabled);
 void  tr_sessionSetCacheLimit_MB (tr_session * session, int mb);
 int   tr_sessionGetCacheLimit_MB (const tr_session * session);
 
+/**
+ * @brief Set the size of the cache of clean blocks served to peers.
+ *
+ * This is separate from the write cache. Zero disables it.
+ */
+void  tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb);
+int   tr_sessionGetReadCacheLimit_MB (const tr_session * session);
+
+/**
+ * @brief Set a limit on the memory used by the caches, peers' buffers and metadata.
+ *
+ * While they add up to more than this, libtransmission flushes the caches
+ * early, keeps peers' output buffers small, and doesn't take on new peers.
+ * Zero means no limit.
+ */
+void  tr_sessionSetMemoryBudget_MB (tr_session * session, int mb);
+int   tr_sessionGetMemoryBudget_MB (const tr_session * session);
+
+/** @brief Get how many block reads the read cache has served or missed */
+void  tr_sessionGetReadCacheStats (const tr_session * session,
+                                   uint64_t         * hits,
+                                   uint64_t         * misses);
+
+/**
+ * @brief Set how many torrents may be verified at once.
+ *
+ * Torrents whose data lives on the same device are never verified
+ * at the same time, so extra threads only help with multiple disks.
+ */
+void  tr_sessionSetVerifyThreadCount (tr_session * session, int count);
+int   tr_sessionGetVerifyThreadCount (const tr_session * session);
+
+/**
+ * @brief Keep torrent data out of the operating system's page cache.
+ *
+ * When enabled, pieces that are read, written or verified are dropped
+ * from the page cache once they've been used, and peers are no longer
+ * sent blocks with sendfile (). This keeps memory use predictable on
+ * seedboxes that serve far more data than they have RAM; the session's
+ * own read cache (see tr_sessionSetReadCacheLimit_MB ()) then holds the
+ * blocks that are worth keeping.
+ */
+void  tr_sessionSetPageCacheBypassEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsPageCacheBypassEnabled (const tr_session * session);
+
+/**
+ * @brief Among equally rare pieces, download the ones next to pieces
+ *        that have already been started.
+ *
+ * Normally ties between pieces are broken at random, which scatters the
+ * blocks in the write cache across the torrent and flushes them as many
+ * short writes. Growing the pieces that are already under way instead
+ * lets the cache write long contiguous runs, which matters on spinning
+ * disks.
+ */
+void  tr_sessionSetPieceLocalityEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsPieceLocalityEnabled (const tr_session * session);
+
+/**
+ * @brief Re-hash seeding torrents' data in the background.
+ *
+ * A full verify stops the torrent and reads everything as fast as it
+ * can. The scrub instead works through each seeding torrent a batch of
+ * pieces at a time, no faster than the scrub speed limit, and steps
+ * aside whenever the torrent's disk has writes waiting. Pieces that
+ * fail are marked as missing so they're downloaded again; the torrent
+ * keeps running. Each torrent's place in the scrub is saved in its
+ * resume file so a restart picks up where it left off.
+ */
+void  tr_sessionSetScrubEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsScrubEnabled (const tr_session * session);
+
+void         tr_sessionSetScrubSpeed_KBps (tr_session * session, unsigned int KBps);
+unsigned int tr_sessionGetScrubSpeed_KBps (const tr_session * session);
+
+/**
+ * @brief Hash verified data straight from memory-mapped files.
+ *
+ * Instead of reading each file into a buffer, verification maps it a
+ * large window at a time, tells the OS it'll be read sequentially, asks
+ * for the pages ahead of the hashing and lets go of the ones behind it.
+ * This saves a copy per byte, which helps on fast disks; on slow ones
+ * the disk is the limit either way. Off by default, since a file that's
+ * truncated by another program midway through would crash the process.
+ */
+void  tr_sessionSetVerifyMmapEnabled (tr_session * session, bool enabled);
+bool  tr_sessionIsVerifyMmapEnabled (const tr_session * session);
+
 tr_encryption_mode tr_sessionGetEncryption (tr_session * session);
 void               tr_sessionSetEncryption (tr_session * session,
                                             tr_encryption_mode    mode);
@@ -1068,6 +1160,22 @@ tr_parse_result;
 tr_parse_result  tr_torrentParse (const tr_ctor  * ctor,
                                   tr_info        * setme_info_or_NULL);
 
+/**
+ * @brief Parses just the parts of a .torrent that don't grow with the torrent.
+ *
+ * This fills in the same fields as tr_torrentParse (), except that there
+ * are no files or pieces, and totalSize is 0 for multi-file torrents.
+ * The file list and piece hashes are skipped over rather than parsed,
+ * so this is much quicker for big torrents.
+ *
+ * @param benc         the .torrent file's contents
+ * @param setme_info   on success, should be freed with tr_metainfoFree ()
+ * @return true on success
+ */
+bool tr_metainfoParseBrief (const void * benc,
+                            size_t       benc_len,
+                            tr_info    * setme_info);
+
 /** @brief free a metainfo
     @see tr_torrentParse */
 void tr_metainfoFree (tr_info * inf);
@@ -1101,7 +1209,15 @@ tr_torrent * tr_torrentNew (const tr_ctor   * ctor,
 
 typedef int (*tr_fileFunc) (const char * filename);
 
-/** @brief Removes our .torrent and .resume files for this torrent */
+/**
+ * @brief Removes our .torrent and .resume files for this torrent
+ *
+ * If removeLocalData is true, the torrent's files are deleted too.
+ * That happens in a libtransmission worker thread after this returns,
+ * so removeFunc (`remove' if NULL) is called from that thread, not from
+ * the caller's or the libtransmission thread. It mustn't touch anything
+ * that isn't safe to use from another thread, e.g. the client's prefs.
+ */
 void tr_torrentRemove (tr_torrent  * torrent,
                        bool          removeLocalData,
                        tr_fileFunc   removeFunc);
@@ -1186,6 +1302,16 @@ void tr_torrentSetLocation (tr_torrent       * torrent,
                             volatile double  * setme_progress,
                             volatile int     * setme_state);
 
+/**
+ * @brief Pause or resume a move started by tr_torrentSetLocation ().
+ *
+ * Moves between filesystems copy the torrent's data in the background,
+ * and the torrent keeps using its old location until the copy is done.
+ * Pausing the copy doesn't affect the torrent itself.
+ */
+void tr_torrentSetLocationPaused (tr_torrent * torrent,
+                                  bool         paused);
+
 uint64_t tr_torrentGetBytesLeftToAllocate (const tr_torrent * torrent);
 
 /**
@@ -1344,6 +1470,35 @@ void tr_torrentSetFileDLs (tr_torrent             * torrent,
                            tr_file_index_t          fileCount,
                            bool                     do_download);
 
+/**
+ * @brief Download the torrent in order, for playing it while it downloads.
+ *
+ * The pieces in a read-ahead window, starting at the first missing piece
+ * at or after the streaming position, are downloaded before any others
+ * and in order. The rest of the torrent is still downloaded rarest first.
+ */
+void     tr_torrentSetSequentialDownload (tr_torrent * torrent, bool enabled);
+bool     tr_torrentIsSequentialDownload  (const tr_torrent * torrent);
+
+/** @brief Set where in the torrent playback is, in bytes from its beginning */
+void     tr_torrentSetStreamingPosition  (tr_torrent * torrent, uint64_t position);
+uint64_t tr_torrentGetStreamingPosition  (const tr_torrent * torrent);
+
+/** @brief Set how many bytes past the streaming position to read ahead */
+void     tr_torrentSetStreamingWindow    (tr_torrent * torrent, uint64_t bytes);
+uint64_t tr_torrentGetStreamingWindow    (const tr_torrent * torrent);
+
+/**
+ * @brief Super-seed the torrent (BEP 16) while we have all of it.
+ *
+ * Peers that connect are told we have nothing, then offered one piece
+ * at a time, a new one once the last has been passed on to another peer.
+ * This takes less upload to get a first full copy into a new swarm.
+ * Only peers that connect while it's on are super-seeded.
+ */
+void     tr_torrentSetSuperSeeding       (tr_torrent * torrent, bool enabled);
+bool     tr_torrentIsSuperSeeding        (const tr_torrent * torrent);
+
 
 const tr_info * tr_torrentInfo (const tr_torrent * torrent);
 
@@ -1523,8 +1678,48 @@ bool tr_torrentCanManualUpdate (const tr_torrent * torrent);
 ****  tr_peer_stat
 ***/
 
+/**
+ * Why a peer's piece data isn't flowing faster in one direction.
+ * Each connected peer is put in one of these states every half second;
+ * they're checked in this order and the first that applies wins.
+ * See tr_peer_stat.stallMsec.
+ */
+typedef enum
+{
+    /* the receiving side doesn't want any of the sender's pieces */
+    TR_PEER_STALL_UNINTERESTED,
+
+    /* the sending side has the receiving side choked */
+    TR_PEER_STALL_CHOKED,
+
+    /* the peer's, torrent's, or session's speed limit ran out */
+    TR_PEER_STALL_BANDWIDTH,
+
+    /* nothing's holding it back on our side; data is moving */
+    TR_PEER_STALL_NONE,
+
+    /* unchoked and interested, but no block requests are waiting */
+    TR_PEER_STALL_NO_REQUESTS,
+
+    /* uploads: our buffer to the peer is full and isn't draining */
+    TR_PEER_STALL_OUTBUF,
+
+    /* uploads: there are requests and room to send, but the blocks
+       are still waiting to be read from disk or the cache */
+    TR_PEER_STALL_DISK,
+
+    /* downloads: our requests are out, but the peer isn't answering */
+    TR_PEER_STALL_PEER,
+
+    TR_PEER_STALL_COUNT
+}
+tr_peer_stall;
+
 typedef struct tr_peer_stat
 {
+    /* unique within the session for as long as this peer's connected */
+    uint32_t id;
+
     bool  isUTP;
 
     bool  isEncrypted;
@@ -1568,6 +1763,10 @@ typedef struct tr_peer_stat
 
     /* how many requests we've made and are currently awaiting a response for */
     int      pendingReqsToPeer;
+
+    /* milliseconds this peer has spent in each tr_peer_stall state since
+       it connected, indexed by tr_direction and then tr_peer_stall */
+    uint64_t stallMsec[2][TR_PEER_STALL_COUNT];
 }
 tr_peer_stat;
 
@@ -1614,6 +1813,15 @@ typedef struct
     /* human-readable string identifying the tracker */
     char host[1024];
 
+    /* smoothed time in milliseconds that this tracker's host takes to
+       answer an announce, or 0 if it hasn't answered one yet */
+    int hostAnnounceLatencyMsec;
+
+    /* how many announces and scrapes to this tracker's host are
+       in flight, and how many it's currently allowed at once */
+    int hostRequestsInFlight;
+    int hostRequestLimit;
+
     /* the full announce URL */
     char announce[1024];
 
@@ -1768,6 +1976,16 @@ void tr_torrentVerify (tr_torrent           * torrent,
                        tr_verify_done_func    callback_func_or_NULL,
                        void                 * callback_data_or_NULL);
 
+/**
+ * Like tr_torrentVerify(), but trusts the previous check of any piece
+ * whose files haven't been modified since it was last checked.
+ * Only pieces that were never checked or that touch a changed file
+ * are re-hashed.
+ */
+void tr_torrentVerifyIncremental (tr_torrent           * torrent,
+                                  tr_verify_done_func    callback_func_or_NULL,
+                                  void                 * callback_data_or_NULL);
+
 /***********************************************************************
  * tr_info
  **********************************************************************/
@@ -1776,7 +1994,7 @@ void tr_torrentVerify (tr_torrent           * torrent,
 typedef struct tr_file
 {
     uint64_t          length;      /* Length of the file, in bytes */
-    char *            name;        /* Path to the file */
+    char *            name;        /* Path to the file. Don't free this; see tr_info.fileNames */
     int8_t            priority;    /* TR_PRI_HIGH, _NORMAL, or _LOW */
     int8_t            dnd;         /* "do not download" flag */
     int8_t            is_renamed;  /* true if we're using a different path from the one in the metainfo; ie, if the user has renamed it */
@@ -1790,7 +2008,6 @@ tr_file;
 typedef struct tr_piece
 {
     time_t   timeChecked;              /* the last time we tested this piece */
-    uint8_t  hash[SHA_DIGEST_LENGTH];  /* pieces hash */
     int8_t   priority;                 /* TR_PRI_HIGH, _NORMAL, or _LOW */
     int8_t   dnd;                      /* "do not download" flag */
 }
@@ -1817,8 +2034,18 @@ struct tr_info
     char             * comment;
     char             * creator;
     tr_file          * files;
+
+    /* One allocation holding the files' names as given in the metainfo.
+     * Unless a file's been renamed, its `name' points in here.
+     * CLIENT CODE: NOT USE THIS FIELD. */
+    char             * fileNames;
     tr_piece         * pieces;
 
+    /* The pieces' SHA1 hashes, pieceCount * SHA_DIGEST_LENGTH bytes.
+     * Stopped torrents don't keep these in memory, so this is NULL
+     * until libtransmission reads them back in from the .torrent file. */
+    uint8_t          * pieceHashes;
+
     /* these trackers are sorted by tier */
     tr_tracker_info  * trackers;
 
@@ -1916,6 +2143,14 @@ typedef struct tr_stat
         @see tr_stat.activity */
     float recheckProgress;
 
+    /** True while tr_torrentSetLocation () is moving the torrent's data */
+    bool isRelocating;
+
+    /** When tr_stat.isRelocating is true, this is how much of the
+        torrent's data has been copied to its new location.
+        Range is [0..1] */
+    float relocateProgress;
+
     /** How much has been downloaded of the entire torrent.
         Range is [0..1] */
     float percentComplete;
@@ -1996,6 +2231,39 @@ typedef struct tr_stat
         grow very large. */
     uint64_t    corruptEver;
 
+    /** Byte count of the piece data that arrived after another peer had
+        already sent it, such as the losing copy of an endgame block that
+        was requested from two peers. Counted since the torrent started. */
+    uint64_t    wastedBytes;
+
+    /** Milliseconds of the libtransmission thread's time spent on this
+        torrent's peer messages, piece hashing and choking, since the
+        torrent was loaded. Useful for finding the torrents that keep a
+        busy session busy. */
+    uint64_t    cpuTimeMsec;
+
+    /** Bytes and calls to read or write this torrent's files since it
+        was loaded. Reads served from the cache aren't counted. */
+    uint64_t    diskReadBytes;
+    uint64_t    diskReadOps;
+    uint64_t    diskWriteBytes;
+    uint64_t    diskWriteOps;
+
+    /** Number of times one of this torrent's files had to be opened
+        since the torrent was loaded, because it wasn't already open. */
+    uint64_t    fileOpens;
+
+    /** Number of this torrent's files that are open right now. */
+    int         openFiles;
+
+    /** Bytes of this torrent's blocks in the cache right now. */
+    uint64_t    cacheBytes;
+
+    /** tr_peer_stat.stallMsec summed over all the peers this torrent
+        has had since it was loaded, so a minute with ten peers counts
+        as ten minutes. Indexed by tr_direction and then tr_peer_stall. */
+    uint64_t    stallMsec[2][TR_PEER_STALL_COUNT];
+
     /** Byte count of all data you've ever uploaded for this torrent. */
     uint64_t    uploadedEver;
 
@@ -2069,6 +2337,26 @@ const tr_stat * tr_torrentStat (tr_torrent * torrent);
     reduce the CPU load if you're calling tr_torrentStat () frequently. */
 const tr_stat * tr_torrentStatCached (tr_torrent * torrent);
 
+/**
+ * @brief Like tr_torrentStatCached (), but for many torrents at once
+ *        while holding the session lock only once.
+ *
+ * @param torrents     the torrents to get, or NULL for all of them
+ * @param torrentCount how many torrents are in `torrents', or, if it's NULL,
+ *                     how many stats `setme' has room for
+ * @param setme        filled in with copies of the torrents' stats.
+ *                     Use tr_stat.id to tell which torrent each one is for.
+ * @param generation   if not NULL, only the torrents whose stats changed after
+ *                     `*generation' are filled in, and `*generation' is then
+ *                     updated for next time. Start with 0 to get them all.
+ * @return the number of stats filled in.
+ */
+int tr_sessionGetTorrentStats (tr_session  * session,
+                               tr_torrent ** torrents,
+                               int           torrentCount,
+                               tr_stat     * setme,
+                               uint64_t    * generation);
+
 /** @deprecated */
 void tr_torrentSetAddedDate (tr_torrent * torrent,
                              time_t       addedDate);
@@ -15,6 +15,9 @@
 
 #include <event2/dns.h>
 #include <event2/event.h>
+#ifdef TR_IOCP
+ #include <event2/thread.h> /* evthread_use_windows_threads () */
+#endif
 
 #include "transmission.h"
 #include "log.h"
@@ -132,6 +135,13 @@ piperead (int s, char *buf, int len)
 ****
 ***/
 
+struct tr_run_data
+{
+    void  (*func)(void *);
+    void *  user_data;
+    struct tr_run_data * next;
+};
+
 typedef struct tr_event_handle
 {
     uint8_t      die;
@@ -141,15 +151,14 @@ typedef struct tr_event_handle
     tr_thread *  thread;
     struct event_base * base;
     struct event * pipeEvent;
+
+    /* functions waiting to be run in the libevent thread, oldest first.
+       the pipe only gets a byte when this goes from empty to non-empty */
+    struct tr_run_data * queueHead;
+    struct tr_run_data * queueTail;
 }
 tr_event_handle;
 
-struct tr_run_data
-{
-    void  (*func)(void *);
-    void *  user_data;
-};
-
 #define dbgmsg(...) \
     do { \
         if (tr_logGetDeepEnabled ()) \
@@ -181,13 +190,25 @@ readFromPipe (evutil_socket_t   fd,
     {
         case 'r': /* run in libevent thread */
         {
-            struct tr_run_data data;
-            const size_t       nwant = sizeof (data);
-            const ssize_t      ngot = piperead (fd, &data, nwant);
-            if (!eh->die && (ngot == (ssize_t)nwant))
+            struct tr_run_data * data;
+
+            /* take everything that's queued up. anything queued while
+               we're running these will ring the doorbell again */
+            tr_lockLock (eh->lock);
+            data = eh->queueHead;
+            eh->queueHead = eh->queueTail = NULL;
+            tr_lockUnlock (eh->lock);
+
+            while (data != NULL)
             {
-                dbgmsg ("invoking function in libevent thread");
-              (data.func)(data.user_data);
+                struct tr_run_data * next = data->next;
+                if (!eh->die)
+                {
+                    dbgmsg ("invoking function in libevent thread");
+                    (data->func)(data->user_data);
+                }
+                tr_free (data);
+                data = next;
             }
             break;
         }
@@ -228,7 +249,24 @@ libeventThreadFunc (void * veh)
 #endif
 
     /* create the libevent bases */
+#ifdef TR_IOCP
+    {
+        /* start the base with an I/O completion port, so that the peers'
+           bufferevents do overlapped I/O */
+        struct event_config * config = event_config_new ();
+
+        event_config_set_flag (config, EVENT_BASE_FLAG_STARTUP_IOCP);
+        base = event_base_new_with_config (config);
+        event_config_free (config);
+
+        if (base == NULL) {
+            tr_logAddError ("Unable to start libevent with IOCP; falling back to select ()");
+            base = event_base_new ();
+        }
+    }
+#else
     base = event_base_new ();
+#endif
 
     /* set the struct's fields */
     eh->base = base;
@@ -246,6 +284,12 @@ libeventThreadFunc (void * veh)
         event_base_dispatch (base);
 
     /* shut down the thread */
+    while (eh->queueHead != NULL)
+    {
+        struct tr_run_data * next = eh->queueHead->next;
+        tr_free (eh->queueHead);
+        eh->queueHead = next;
+    }
     tr_lockFree (eh->lock);
     event_base_free (base);
     eh->session->events = NULL;
@@ -265,6 +309,13 @@ tr_eventInit (tr_session * session)
     if (pipe (eh->fds) == -1)
       tr_logAddError ("Unable to write to pipe() in libtransmission: %s", tr_strerror(errno));
     eh->session = session;
+
+#ifdef TR_IOCP
+    /* libevent's IOCP code needs its locking, which has to be turned on
+       before any libevent structure that's shared between threads exists */
+    evthread_use_windows_threads ();
+#endif
+
     eh->thread = tr_threadNew (libeventThreadFunc, eh);
 
     /* wait until the libevent thread is running */
@@ -312,26 +363,33 @@ tr_runInEventThread (tr_session * session,
     }
   else
     {
-      int fd;
-      char ch;
-      ssize_t res_1;
-      ssize_t res_2;
+      bool wasEmpty;
       tr_event_handle * e = session->events;
-      struct tr_run_data data;
+      struct tr_run_data * data = tr_new (struct tr_run_data, 1);
+
+      data->func = func;
+      data->user_data = user_data;
+      data->next = NULL;
 
       tr_lockLock (e->lock);
 
-      fd = e->fds[1];
-      ch = 'r';
-      res_1 = pipewrite (fd, &ch, 1);
+      wasEmpty = e->queueHead == NULL;
+      if (wasEmpty)
+        e->queueHead = data;
+      else
+        e->queueTail->next = data;
+      e->queueTail = data;
 
-      data.func = func;
-      data.user_data = user_data;
-      res_2 = pipewrite (fd, &data, sizeof (data));
+      /* only wake up the libevent thread if it isn't already
+         going to look at the queue */
+      if (wasEmpty)
+        {
+          const char ch = 'r';
 
-      tr_lockUnlock (e->lock);
+          if (pipewrite (e->fds[1], &ch, 1) == -1)
+            tr_logAddError ("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
+        }
 
-      if ((res_1 == -1) || (res_2 == -1))
-        tr_logAddError ("Unable to write to libtransmisison event queue: %s", tr_strerror(errno));
+      tr_lockUnlock (e->lock);
     }
 }
@@ -51,6 +51,17 @@ test_base64 (void)
   check_int_eq (5, len);
   tr_free (in);
   tr_free (out);
+
+  /* wrapped lines and missing padding */
+  in = tr_base64_decode ("WU9Z\r\nTyE", -1, &len);
+  check_streq ("YOYO!", in);
+  check_int_eq (5, len);
+  tr_free (in);
+  in = tr_base64_decode ("YWJjZGVmZ2hpamtsbW5vcHFyc3R1dnd4eXo=", -1, &len);
+  check_streq ("abcdefghijklmnopqrstuvwxyz", in);
+  check_int_eq (26, len);
+  tr_free (in);
+
   out = tr_base64_encode (NULL, 0, &len);
   check (out == NULL);
   check_int_eq (0, len);
@@ -279,6 +279,59 @@ tr_loadFile (const char * path,
   return buf;
 }
 
+const uint8_t*
+tr_mapFile (const char * path,
+            size_t     * size)
+{
+  const uint8_t * map;
+  tr_sys_path_info info;
+  tr_sys_file_t fd;
+  tr_error * error = NULL;
+
+  if (!tr_sys_path_get_info (path, 0, &info, &error))
+    {
+      errno = error->code;
+      tr_error_free (error);
+      return NULL;
+    }
+
+  /* there's nothing to map in an empty file */
+  if (info.type != TR_SYS_PATH_IS_FILE || info.size == 0 || info.size > SIZE_MAX)
+    {
+      errno = EINVAL;
+      return NULL;
+    }
+
+  fd = tr_sys_file_open (path, TR_SYS_FILE_READ, 0, &error);
+  if (fd == TR_BAD_SYS_FILE)
+    {
+      errno = error->code;
+      tr_error_free (error);
+      return NULL;
+    }
+
+  /* the mapping outlives the descriptor */
+  map = tr_sys_file_map_for_reading (fd, 0, info.size, &error);
+  tr_sys_file_close (fd, NULL);
+  if (map == NULL)
+    {
+      errno = error->code;
+      tr_error_free (error);
+      return NULL;
+    }
+
+  *size = info.size;
+  return map;
+}
+
+void
+tr_unmapFile (const uint8_t * map,
+              size_t          size)
+{
+  if (map != NULL)
+    tr_sys_file_unmap (map, size, NULL);
+}
+
 char*
 tr_buildPath (const char *first_element, ...)
 {
@@ -530,8 +583,8 @@ tr_str_has_suffix (const char *str, const char *suffix)
 *****
 ****/
 
-uint64_t
-tr_time_msec (void)
+static uint64_t
+wallClockMsec (void)
 {
   struct timeval tv;
 
@@ -539,6 +592,48 @@ tr_time_msec (void)
   return (uint64_t) tv.tv_sec * 1000 + (tv.tv_usec / 1000);
 }
 
+/* A monotonic clock, preferring a coarse one: the rate and timeout code
+   that calls this doesn't need better than a few msec, and coarse
+   clocks are cheaper to read. Returns 0 if there isn't one. */
+static uint64_t
+monotonicMsec (void)
+{
+#if defined (_WIN32)
+  return GetTickCount64 ();
+#elif defined (HAVE_CLOCK_GETTIME) && (defined (CLOCK_MONOTONIC_COARSE) || defined (CLOCK_MONOTONIC))
+  struct timespec ts;
+ #ifdef CLOCK_MONOTONIC_COARSE
+  if (clock_gettime (CLOCK_MONOTONIC_COARSE, &ts) != 0)
+ #endif
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+      return 0;
+  return (uint64_t) ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+#else
+  return 0;
+#endif
+}
+
+uint64_t
+tr_time_msec (void)
+{
+  static bool have_offset = false;
+  static uint64_t offset = 0;
+  uint64_t now = monotonicMsec ();
+
+  if (now == 0)
+    return wallClockMsec ();
+
+  /* start out at the wall-clock time, so the numbers look like
+     the ones callers are used to, and then never jump */
+  if (!have_offset)
+    {
+      offset = wallClockMsec () - now;
+      have_offset = true;
+    }
+
+  return now + offset;
+}
+
 void
 tr_wait_msec (long int msec)
 {
@@ -852,39 +947,65 @@ tr_base64_encode (const void * input, int length, int * setme_len)
   return ret;
 }
 
+/* returns the 6-bit value of a base64 digit, or -1 if `c' isn't one */
+static inline int
+base64_value (unsigned char c)
+{
+  if ('A' <= c && c <= 'Z') return c - 'A';
+  if ('a' <= c && c <= 'z') return c - 'a' + 26;
+  if ('0' <= c && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+/* Decoding is done by hand in a single pass rather than through a BIO
+ * chain: torrent-add's "metainfo" argument can be megabytes of
+ * unwrapped base64, which BIO_f_base64 () used to fail on the first
+ * time around and then decode all over again. Line breaks and other
+ * whitespace are skipped; decoding stops at padding or any other
+ * character that isn't part of the base64 alphabet. */
 char *
 tr_base64_decode (const void * input,
                   int          length,
                   int *        setme_len)
 {
+  int i;
+  int bits = 0;
+  int retlen = 0;
+  uint32_t acc = 0;
   char * ret;
-  BIO * b64;
-  BIO * bmem;
-  int retlen;
+  const unsigned char * in = input;
 
   if (length < 1)
     length = strlen (input);
 
-  ret = tr_new0 (char, length);
-  b64 = BIO_new (BIO_f_base64 ());
-  bmem = BIO_new_mem_buf ((unsigned char*)input, length);
-  bmem = BIO_push (b64, bmem);
-  retlen = BIO_read (bmem, ret, length);
-  if (!retlen)
+  ret = tr_new0 (char, length + 1);
+
+  for (i=0; i<length; ++i)
     {
-      /* try again, but with the BIO_FLAGS_BASE64_NO_NL flag */
-      BIO_free_all (bmem);
-      b64 = BIO_new (BIO_f_base64 ());
-      BIO_set_flags (b64, BIO_FLAGS_BASE64_NO_NL);
-      bmem = BIO_new_mem_buf ((unsigned char*)input, length);
-      bmem = BIO_push (b64, bmem);
-      retlen = BIO_read (bmem, ret, length);
+      const int val = base64_value (in[i]);
+
+      if (val < 0)
+        {
+          if (in[i] == '\r' || in[i] == '\n' || in[i] == ' ' || in[i] == '\t')
+            continue;
+          break;
+        }
+
+      acc = (acc << 6) | (uint32_t)val;
+      bits += 6;
+
+      if (bits >= 8)
+        {
+          bits -= 8;
+          ret[retlen++] = (char)((acc >> bits) & 0xFF);
+        }
     }
 
   if (setme_len)
     *setme_len = retlen;
 
-  BIO_free_all (bmem);
   return ret;
 }
 
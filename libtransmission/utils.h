@@ -134,6 +134,16 @@ bool tr_wildmat (const char * text, const char * pattern) TR_GNUC_NONNULL (1,2);
 uint8_t* tr_loadFile (const char * filename, size_t * size) TR_GNUC_MALLOC
                                                              TR_GNUC_NONNULL (1);
 
+/**
+ * @brief Maps a file read-only into memory, so its pages come
+ * straight from the page cache instead of being copied.
+ * Release it with tr_unmapFile ().
+ * On failure, NULL is returned and errno is set. Empty files can't be mapped.
+ */
+const uint8_t* tr_mapFile (const char * filename, size_t * size) TR_GNUC_NONNULL (1);
+
+void tr_unmapFile (const uint8_t * map, size_t size);
+
 
 /** @brief build a filename from a series of elements using the
            platform's correct directory separator. */
@@ -165,7 +175,14 @@ void tr_timerAdd (struct event * timer, int seconds, int microseconds) TR_GNUC_N
 void tr_timerAddMsec (struct event * timer, int milliseconds) TR_GNUC_NONNULL (1);
 
 
-/** @brief return the current date in milliseconds */
+/**
+ * @brief return a millisecond counter for timing intervals
+ *
+ * This starts out near the current date in milliseconds, but it comes
+ * from a monotonic clock where there is one, so setting the system
+ * clock doesn't make it jump. It can be a few msec coarse.
+ * Use it to measure rates and timeouts, not to tell the date.
+ */
 uint64_t tr_time_msec (void);
 
 /** @brief sleep the specified number of milliseconds */
@@ -122,6 +122,168 @@ err:
   return EILSEQ;
 }
 
+/* find the end of the bencoded value at `buf' without building anything */
+static int
+tr_bencSkip (const uint8_t  * buf,
+             const uint8_t  * bufend,
+             const uint8_t ** setme_end)
+{
+  int depth = 0;
+
+  do
+    {
+      if (buf >= bufend)
+        return EILSEQ;
+
+      if (*buf == 'i')
+        {
+          const uint8_t * end = memchr (buf, 'e', bufend - buf);
+          if (end == NULL)
+            return EILSEQ;
+          buf = end + 1;
+        }
+      else if (*buf == 'l' || *buf == 'd')
+        {
+          ++depth;
+          ++buf;
+        }
+      else if (*buf == 'e')
+        {
+          if (depth == 0)
+            return EILSEQ;
+          --depth;
+          ++buf;
+        }
+      else
+        {
+          const uint8_t * str;
+          size_t str_len;
+
+          if (tr_bencParseStr (buf, bufend, &buf, &str, &str_len))
+            return EILSEQ;
+        }
+    }
+  while (depth > 0);
+
+  *setme_end = buf;
+  return 0;
+}
+
+bool
+tr_variantBencDictFindValue (const void   * buf_in,
+                             size_t         buflen,
+                             const tr_quark key,
+                             const void  ** setme_val,
+                             size_t       * setme_len)
+{
+  size_t key_len;
+  const char * key_str = tr_quark_get_string (key, &key_len);
+  const uint8_t * buf = buf_in;
+  const uint8_t * bufend = buf + buflen;
+
+  if (buflen == 0 || *buf != 'd')
+    return false;
+
+  ++buf;
+
+  while (buf < bufend && *buf != 'e')
+    {
+      const uint8_t * str;
+      const uint8_t * val;
+      size_t str_len;
+
+      if (tr_bencParseStr (buf, bufend, &val, &str, &str_len))
+        return false;
+
+      if (tr_bencSkip (val, bufend, &buf))
+        return false;
+
+      if (str_len == key_len && !memcmp (str, key_str, key_len))
+        {
+          *setme_val = val;
+          *setme_len = buf - val;
+          return true;
+        }
+    }
+
+  return false;
+}
+
+bool
+tr_variantBencDictFindRaw (const void     * buf,
+                           size_t           buflen,
+                           const tr_quark   key,
+                           const uint8_t ** setme_raw,
+                           size_t         * setme_len)
+{
+  size_t len;
+  const void * val;
+  const uint8_t * end;
+
+  if (!tr_variantBencDictFindValue (buf, buflen, key, &val, &len))
+    return false;
+
+  return !tr_bencParseStr (val, (const uint8_t*)val + len, &end, setme_raw, setme_len);
+}
+
+bool
+tr_variantBencDictFindInt (const void     * buf,
+                           size_t           buflen,
+                           const tr_quark   key,
+                           int64_t        * setme)
+{
+  size_t len;
+  const void * val;
+  const uint8_t * end;
+
+  if (!tr_variantBencDictFindValue (buf, buflen, key, &val, &len))
+    return false;
+
+  return !tr_bencParseInt (val, (const uint8_t*)val + len, &end, setme);
+}
+
+size_t
+tr_variantBencDictForeach (const void             * buf_in,
+                           size_t                   buflen,
+                           tr_variantBencDictFunc   func,
+                           void                   * user_data)
+{
+  const uint8_t * buf = buf_in;
+  const uint8_t * bufend = buf + buflen;
+
+  if (buflen == 0 || *buf != 'd')
+    return 0;
+
+  /* walk it once first, so that `func' only sees well-formed dicts */
+  for (++buf; buf < bufend && *buf != 'e';)
+    {
+      const uint8_t * str;
+      const uint8_t * val;
+      size_t str_len;
+
+      if (tr_bencParseStr (buf, bufend, &val, &str, &str_len) || tr_bencSkip (val, bufend, &buf))
+        return 0;
+    }
+
+  if (buf >= bufend)
+    return 0;
+
+  bufend = buf + 1;
+
+  for (buf=(const uint8_t*)buf_in+1; *buf != 'e';)
+    {
+      const uint8_t * str;
+      const uint8_t * val;
+      size_t str_len;
+
+      tr_bencParseStr (buf, bufend, &val, &str, &str_len);
+      tr_bencSkip (val, bufend, &buf);
+      func (str, str_len, val, buf - val, user_data);
+    }
+
+  return bufend - (const uint8_t*)buf_in;
+}
+
 static tr_variant*
 get_node (tr_ptrArray * stack, tr_quark * key, tr_variant * top, int * err)
 {
@@ -162,7 +324,8 @@ int
 tr_variantParseBenc (const void    * buf_in,
                      const void    * bufend_in,
                      tr_variant    * top,
-                     const char   ** setme_end)
+                     const char   ** setme_end,
+                     bool            in_place)
 {
   int err = 0;
   const uint8_t * buf = buf_in;
@@ -247,7 +410,12 @@ tr_variantParseBenc (const void    * buf_in,
           if (!key && !tr_ptrArrayEmpty(&stack) && tr_variantIsDict(tr_ptrArrayBack(&stack)))
             key = tr_quark_new (str, str_len);
           else if ((v = get_node (&stack, &key, top, &err)))
-            tr_variantInitStr (v, str, str_len);
+            {
+              if (in_place)
+                tr_variantInitRawView (v, str, str_len);
+              else
+                tr_variantInitStr (v, str, str_len);
+            }
         }
       else /* invalid bencoded text... march past it */
         {
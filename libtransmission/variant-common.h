@@ -61,7 +61,12 @@ int tr_bencParseStr (const uint8_t *  buf,
 int tr_variantParseBenc (const void     * buf,
                          const void     * end,
                          tr_variant     * top,
-                         const char ** setme_end);
+                         const char ** setme_end,
+                         bool            in_place);
+
+/* a string that points into someone else's buffer and
+   isn't NUL-terminated. See tr_variantFromBencInPlace () */
+void tr_variantInitRawView (tr_variant * initme, const void * raw, size_t raw_len);
 
 
 
@@ -473,11 +473,36 @@ jsonPopParent (struct jsonWalk * data)
   tr_free (tr_list_pop_front (&data->parents));
 }
 
+/* write `i' in decimal, ending at `end'.
+   returns where the number starts */
+static char *
+formatInt (char * end, int64_t i)
+{
+  char * walk = end;
+  uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i;
+
+  do
+    {
+      *--walk = '0' + (u % 10);
+      u /= 10;
+    }
+  while (u != 0);
+
+  if (i < 0)
+    *--walk = '-';
+
+  return walk;
+}
+
 static void
 jsonIntFunc (const tr_variant * val, void * vdata)
 {
+  char buf[32];
+  char * end = buf + sizeof (buf);
+  char * begin = formatInt (end, val->val.i);
   struct jsonWalk * data = vdata;
-  evbuffer_add_printf (data->out, "%" PRId64, val->val.i);
+
+  evbuffer_add (data->out, begin, end - begin);
   jsonChildFunc (data);
 }
 
@@ -501,14 +526,69 @@ jsonRealFunc (const tr_variant * val,
 {
   struct jsonWalk * data = vdata;
 
-  if (fabs (val->val.d - (int)val->val.d) < 0.00001)
-    evbuffer_add_printf (data->out, "%d", (int)val->val.d);
+  const double d = val->val.d;
+
+  if (fabs (d - (int)d) < 0.00001)
+    {
+      char buf[32];
+      char * end = buf + sizeof (buf);
+      char * begin = formatInt (end, (int)d);
+      evbuffer_add (data->out, begin, end - begin);
+    }
+  else if (fabs (d) < 1000000000.0)
+    {
+      /* like "%.4f" of tr_truncd (d, 4): truncate to four decimal places,
+         but first round off floating-point noise so that 0.29 doesn't
+         become 0.2899. This skips printf and always uses a '.' */
+      char buf[32];
+      char * end = buf + sizeof (buf);
+      char * begin;
+      const double scaled = fabs (d) * 10000.0;
+      int64_t n = (int64_t) scaled;
+
+      if ((n + 1) - scaled < 1e-10 + scaled * 1e-15)
+        ++n;
+
+      begin = formatInt (end, n % 10000 + 10000) + 1; /* keep the leading zeroes */
+      *--begin = '.';
+      begin = formatInt (begin, n / 10000);
+      if (d < 0)
+        *--begin = '-';
+
+      evbuffer_add (data->out, begin, end - begin);
+    }
   else
-    evbuffer_add_printf (data->out, "%.4f", tr_truncd (val->val.d, 4));
+    {
+      evbuffer_add_printf (data->out, "%.4f", tr_truncd (d, 4));
+    }
 
   jsonChildFunc (data);
 }
 
+#define ONES UINT64_C (0x0101010101010101)
+#define HIGHS UINT64_C (0x8080808080808080)
+
+/* nonzero if any of the word's bytes is zero */
+#define HAS_ZERO_BYTE(w) (((w) - ONES) & ~(w) & HIGHS)
+
+/**
+ * Check eight bytes at once for anything that jsonStringFunc ()
+ * writes as something other than itself: control characters,
+ * quotes, backslashes, and the start of multibyte UTF-8 sequences.
+ */
+static inline bool
+isPlainWord (const unsigned char * str)
+{
+  uint64_t w;
+
+  memcpy (&w, str, sizeof (w));
+
+  return !(w & HIGHS)
+      && !(((w - ONES * 0x20) & ~w) & HIGHS)
+      && !HAS_ZERO_BYTE (w ^ (ONES * '"'))
+      && !HAS_ZERO_BYTE (w ^ (ONES * '\\'));
+}
+
 static void
 jsonStringFunc (const tr_variant * val,
                 void             * vdata)
@@ -527,7 +607,8 @@ jsonStringFunc (const tr_variant * val,
   it = (const unsigned char *) str;
   end = it + len;
 
-  evbuffer_reserve_space (data->out, len * 4, vec, 1);
+  /* +2 for the quotes */
+  evbuffer_reserve_space (data->out, len * 4 + 2, vec, 1);
   out = vec[0].iov_base;
   outend = out + vec[0].iov_len;
 
@@ -536,6 +617,17 @@ jsonStringFunc (const tr_variant * val,
 
   for (; it!=end; ++it)
     {
+      /* names and paths are mostly plain ASCII, so copy that in bulk */
+      while (end - it >= 8 && isPlainWord (it))
+        {
+          memcpy (outwalk, it, 8);
+          outwalk += 8;
+          it += 8;
+        }
+
+      if (it == end)
+        break;
+
       switch (*it)
         {
           case '\b': *outwalk++ = '\\'; *outwalk++ = 'b'; break;
@@ -431,6 +431,40 @@ testMerge (void)
   return 0;
 }
 
+static int
+testTableToDicts (void)
+{
+  size_t len;
+  int64_t i;
+  const char * s;
+  tr_variant top;
+  tr_variant * list;
+  tr_variant * d;
+  const char * in = "{ \"torrents\": [ [ \"id\", \"name\" ], [ 1, \"a\" ], [ 2, \"b\" ] ] }";
+  const char * objects = "{ \"torrents\": [ { \"id\": 1 } ] }";
+
+  check_int_eq (0, tr_variantFromJson (&top, in, strlen (in)));
+  check (tr_variantDictFindList (&top, TR_KEY_torrents, &list));
+  check (tr_variantListTableToDicts (list));
+  check (tr_variantDictFindList (&top, TR_KEY_torrents, &list));
+  check_int_eq (2, tr_variantListSize (list));
+  d = tr_variantListChild (list, 1);
+  check (tr_variantIsDict (d));
+  check (tr_variantDictFindInt (d, TR_KEY_id, &i));
+  check_int_eq (2, i);
+  check (tr_variantDictFindStr (d, TR_KEY_name, &s, &len));
+  check_streq ("b", s);
+  tr_variantFree (&top);
+
+  /* lists of objects are left alone */
+  check_int_eq (0, tr_variantFromJson (&top, objects, strlen (objects)));
+  check (tr_variantDictFindList (&top, TR_KEY_torrents, &list));
+  check (!tr_variantListTableToDicts (list));
+  check (tr_variantIsDict (tr_variantListChild (list, 0)));
+  tr_variantFree (&top);
+  return 0;
+}
+
 static int
 testStackSmash (void)
 {
@@ -546,6 +580,186 @@ testParse2 (void)
   return 0;
 }
 
+static int
+testStrView (void)
+{
+  int len;
+  char * benc;
+  size_t strLen;
+  const char * strVal;
+  tr_variant top;
+  tr_variant * list;
+  const char * words = "a string that is long enough to need the heap";
+  const tr_quark key = tr_quark_new ("key", -1);
+
+  tr_variantInitDict (&top, 0);
+  tr_variantDictAddStrView (&top, key, words);
+  check (tr_variantDictFindStr (&top, key, &strVal, &strLen));
+  check (strVal == words);
+  check_int_eq (strlen (words), strLen);
+
+  /* replacing a view doesn't free what it pointed to */
+  tr_variantDictAddStr (&top, key, words);
+  check (tr_variantDictFindStr (&top, key, &strVal, NULL));
+  check (strVal != words);
+  check_streq (words, strVal);
+  tr_variantDictAddStrView (&top, key, NULL);
+  check (tr_variantDictFindStr (&top, key, &strVal, &strLen));
+  check_streq ("", strVal);
+  check_int_eq (0, strLen);
+
+  list = tr_variantDictAddList (&top, TR_KEY_files, 1);
+  tr_variantListAddStrView (list, "abc");
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  check_streq ("d5:filesl3:abce3:key0:e", benc);
+  tr_free (benc);
+
+  tr_variantFree (&top);
+  return 0;
+}
+
+static int
+testDictIndex (void)
+{
+  int i;
+  int64_t intVal;
+  tr_variant top;
+  tr_quark keys[200];
+  const int n = sizeof (keys) / sizeof (keys[0]);
+
+  for (i=0; i<n; ++i)
+    {
+      char buf[32];
+      tr_snprintf (buf, sizeof (buf), "dict-index-key-%d", i);
+      keys[i] = tr_quark_new (buf, -1);
+    }
+
+  /* big enough to be indexed */
+  tr_variantInitDict (&top, 0);
+  for (i=0; i<n; ++i)
+    tr_variantDictAddInt (&top, keys[i], i);
+  for (i=0; i<n; ++i)
+    {
+      check (tr_variantDictFindInt (&top, keys[i], &intVal));
+      check_int_eq (i, intVal);
+    }
+
+  /* removals keep the index in sync */
+  for (i=0; i<n; i+=2)
+    check (tr_variantDictRemove (&top, keys[i]));
+  check_int_eq (n/2, top.val.l.count);
+  for (i=0; i<n; ++i)
+    {
+      const bool found = tr_variantDictFindInt (&top, keys[i], &intVal);
+      check (found == (i % 2 == 1));
+      if (found)
+        check_int_eq (i, intVal);
+    }
+
+  /* so do re-adds and replacements */
+  for (i=0; i<n; ++i)
+    tr_variantDictAddInt (&top, keys[i], -i);
+  check_int_eq (n, top.val.l.count);
+  for (i=0; i<n; ++i)
+    {
+      check (tr_variantDictFindInt (&top, keys[i], &intVal));
+      check_int_eq (-i, intVal);
+    }
+
+  tr_variantFree (&top);
+  return 0;
+}
+
+static int
+testInPlace (void)
+{
+  tr_variant top;
+  tr_variant * child;
+  const uint8_t * raw;
+  size_t len;
+  const char * benc = "d4:long26:abcdefghijklmnopqrstuvwxyz5:short3:abce";
+  const char * longStr = strstr (benc, "abcdefghij");
+
+  check (!tr_variantFromBencInPlace (&top, benc, strlen (benc)));
+
+  /* long strings point into the buffer... */
+  check ((child = tr_variantDictFind (&top, tr_quark_new ("long", 4))) != NULL);
+  check (tr_variantGetRaw (child, &raw, &len));
+  check_int_eq (26, len);
+  check ((const char*) raw == longStr);
+
+  /* ...short ones are copied */
+  check ((child = tr_variantDictFind (&top, tr_quark_new ("short", 5))) != NULL);
+  check (tr_variantGetRaw (child, &raw, &len));
+  check_int_eq (3, len);
+  check (memcmp (raw, "abc", 3) == 0);
+  check (raw[3] == '\0');
+
+  tr_variantFree (&top);
+  return 0;
+}
+
+static int
+testBencDictFind (void)
+{
+  int64_t i;
+  size_t len;
+  const uint8_t * raw;
+  const char * benc = "d8:intervali1800e4:listli1ei2ee5:peers6:abcdefe";
+  const size_t benc_len = strlen (benc);
+
+  /* strings are found in place... */
+  check (tr_variantBencDictFindRaw (benc, benc_len, TR_KEY_peers, &raw, &len));
+  check_int_eq (6, len);
+  check ((const char*) raw == strstr (benc, "abcdef"));
+
+  /* ...and so are ints, skipping over the other values */
+  check (tr_variantBencDictFindInt (benc, benc_len, TR_KEY_interval, &i));
+  check_int_eq (1800, i);
+
+  /* wrong types and missing keys aren't found */
+  check (!tr_variantBencDictFindRaw (benc, benc_len, TR_KEY_interval, &raw, &len));
+  check (!tr_variantBencDictFindInt (benc, benc_len, TR_KEY_peers, &i));
+  check (!tr_variantBencDictFindInt (benc, benc_len, TR_KEY_complete, &i));
+
+  /* and a truncated dict doesn't read past its end */
+  check (!tr_variantBencDictFindRaw (benc, benc_len - 4, TR_KEY_peers, &raw, &len));
+  check (!tr_variantBencDictFindRaw ("", 0, TR_KEY_peers, &raw, &len));
+
+  return 0;
+}
+
+static void
+appendEntry (const uint8_t * key, size_t key_len, const uint8_t * val, size_t val_len, void * vbuf)
+{
+  evbuffer_add_printf (vbuf, "[%*.*s=%*.*s]",
+                       (int)key_len, (int)key_len, (const char*)key,
+                       (int)val_len, (int)val_len, (const char*)val);
+}
+
+static int
+testBencDictForeach (void)
+{
+  char * str;
+  struct evbuffer * buf = evbuffer_new ();
+  const char * benc = "d8:intervali1800e4:listli1ei2ee5:peers6:abcdefetrailing";
+
+  /* each key comes with its value's bytes, and the dict's length excludes what follows it */
+  check_int_eq (strlen (benc) - 8, tr_variantBencDictForeach (benc, strlen (benc), appendEntry, buf));
+  str = evbuffer_free_to_str (buf);
+  check_streq ("[interval=i1800e][list=li1ei2ee][peers=6:abcdef]", str);
+  tr_free (str);
+
+  /* a broken dict isn't walked at all */
+  buf = evbuffer_new ();
+  check_int_eq (0, tr_variantBencDictForeach (benc, 30, appendEntry, buf));
+  check_int_eq (0, tr_variantBencDictForeach ("li1ee", 5, appendEntry, buf));
+  check_int_eq (0, evbuffer_get_length (buf));
+  evbuffer_free (buf);
+
+  return 0;
+}
+
 int
 main (void)
 {
@@ -554,8 +768,14 @@ main (void)
                                     testParse,
                                     testJSON,
                                     testMerge,
+                                    testTableToDicts,
                                     testBool,
                                     testParse2,
+                                    testStrView,
+                                    testDictIndex,
+                                    testInPlace,
+                                    testBencDictFind,
+                                    testBencDictForeach,
                                     testStackSmash };
   return runTests (tests, NUM_TESTS (tests));
 }
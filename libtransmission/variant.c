@@ -89,6 +89,7 @@ tr_variant_string_get_string (const struct tr_variant_string * str)
       case TR_STRING_TYPE_BUF: ret = str->str.buf; break;
       case TR_STRING_TYPE_HEAP: ret = str->str.str; break;
       case TR_STRING_TYPE_QUARK: ret = str->str.str; break;
+      case TR_STRING_TYPE_VIEW: ret = str->str.str; break;
       default: ret = NULL;
     }
 
@@ -106,6 +107,17 @@ tr_variant_string_set_quark (struct tr_variant_string  * str,
   str->str.str = tr_quark_get_string (quark, &str->len);
 }
 
+static void
+tr_variant_string_set_view (struct tr_variant_string  * str,
+                            const char                * bytes)
+{
+  tr_variant_string_clear (str);
+
+  str->type = TR_STRING_TYPE_VIEW;
+  str->str.str = bytes != NULL ? bytes : "";
+  str->len = strlen (str->str.str);
+}
+
 static void
 tr_variant_string_set_string (struct tr_variant_string  * str,
                               const char                * bytes,
@@ -149,18 +161,130 @@ getStr (const tr_variant * v)
   return tr_variant_string_get_string (&v->val.s);
 }
 
+/**
+*** Small dicts are searched linearly. Once a dict has DICT_INDEX_MIN
+*** children, it gets a hash index of its keys: an open-addressed table
+*** of (child position + 1), with 0 marking an empty slot, that's kept
+*** at most half full. It's built lazily by the first lookup and kept in
+*** sync by tr_variantDictAdd () and tr_variantDictRemove ().
+**/
+
+enum
+{
+  DICT_INDEX_MIN = 16
+};
+
+static size_t
+dictIndexSlot (const tr_variant * dict, const tr_quark key)
+{
+  return (size_t)(key * 2654435761u) & (dict->val.l.index_size - 1);
+}
+
+static void
+dictIndexInsert (tr_variant * dict, size_t pos)
+{
+  size_t slot = dictIndexSlot (dict, dict->val.l.vals[pos].key);
+
+  while (dict->val.l.index[slot] != 0)
+    slot = (slot + 1) & (dict->val.l.index_size - 1);
+
+  dict->val.l.index[slot] = pos + 1;
+}
+
+static void
+dictIndexRebuild (tr_variant * dict)
+{
+  size_t i;
+  size_t n = 32;
+
+  while (n < dict->val.l.count * 2)
+    n *= 2u;
+
+  tr_free (dict->val.l.index);
+  dict->val.l.index = tr_new0 (size_t, n);
+  dict->val.l.index_size = n;
+
+  for (i=0; i<dict->val.l.count; ++i)
+    dictIndexInsert (dict, i);
+}
+
+/* returns the index slot that holds child `pos' */
+static size_t
+dictIndexFindSlot (const tr_variant * dict, size_t pos)
+{
+  size_t slot = dictIndexSlot (dict, dict->val.l.vals[pos].key);
+
+  while (dict->val.l.index[slot] != pos + 1)
+    slot = (slot + 1) & (dict->val.l.index_size - 1);
+
+  return slot;
+}
+
+/* empty a slot, shifting later entries of its probe run back into it */
+static void
+dictIndexErase (tr_variant * dict, size_t slot)
+{
+  size_t * index = dict->val.l.index;
+  const size_t mask = dict->val.l.index_size - 1;
+  size_t next = slot;
+
+  for (;;)
+    {
+      size_t home;
+
+      index[slot] = 0;
+
+      for (;;)
+        {
+          next = (next + 1) & mask;
+          if (index[next] == 0)
+            return;
+
+          /* can the entry at `next' be moved back to `slot'? */
+          home = dictIndexSlot (dict, dict->val.l.vals[index[next] - 1].key);
+          if (slot <= next ? (home <= slot || home > next)
+                           : (home <= slot && home > next))
+            break;
+        }
+
+      index[slot] = index[next];
+      slot = next;
+    }
+}
+
 static int
-dictIndexOf (const tr_variant * dict, const tr_quark key)
+dictIndexOf (const tr_variant * cdict, const tr_quark key)
 {
-  if (tr_variantIsDict (dict))
+  if (tr_variantIsDict (cdict))
     {
-      const tr_variant * walk;
-      const tr_variant * const begin = dict->val.l.vals;
-      const tr_variant * const end = begin + dict->val.l.count;
+      tr_variant * dict = (tr_variant*) cdict;
+
+      if (dict->val.l.count >= DICT_INDEX_MIN)
+        {
+          size_t slot;
+
+          if (dict->val.l.index == NULL)
+            dictIndexRebuild (dict);
+
+          for (slot = dictIndexSlot (dict, key);
+               dict->val.l.index[slot] != 0;
+               slot = (slot + 1) & (dict->val.l.index_size - 1))
+            {
+              const size_t pos = dict->val.l.index[slot] - 1;
+              if (dict->val.l.vals[pos].key == key)
+                return pos;
+            }
+        }
+      else
+        {
+          const tr_variant * walk;
+          const tr_variant * const begin = dict->val.l.vals;
+          const tr_variant * const end = begin + dict->val.l.count;
 
-      for (walk=begin; walk!=end; ++walk)
-        if (walk->key == key)
-          return walk - begin;
+          for (walk=begin; walk!=end; ++walk)
+            if (walk->key == key)
+              return walk - begin;
+        }
     }
 
   return -1;
@@ -405,6 +529,31 @@ tr_variantInitStr (tr_variant * v, const void * str, int len)
   tr_variant_string_set_string (&v->val.s, str, len);
 }
 
+void
+tr_variantInitStrView (tr_variant * v, const char * str)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_STR);
+  tr_variant_string_set_view (&v->val.s, str);
+}
+
+void
+tr_variantInitRawView (tr_variant * v, const void * raw, size_t raw_len)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_STR);
+
+  /* short strings fit in the variant itself anyway */
+  if (raw_len < sizeof (v->val.s.str.buf))
+    {
+      tr_variant_string_set_string (&v->val.s, raw, raw_len);
+    }
+  else
+    {
+      v->val.s.type = TR_STRING_TYPE_VIEW;
+      v->val.s.str.str = raw;
+      v->val.s.len = raw_len;
+    }
+}
+
 void
 tr_variantInitBool (tr_variant * v, bool value)
 {
@@ -525,6 +674,15 @@ tr_variantListAddStr (tr_variant  * list,
   return child;
 }
 
+tr_variant *
+tr_variantListAddStrView (tr_variant  * list,
+                          const char  * val)
+{
+  tr_variant * child = tr_variantListAdd (list);
+  tr_variantInitStrView (child, val);
+  return child;
+}
+
 tr_variant *
 tr_variantListAddQuark (tr_variant     * list,
                         const tr_quark   val)
@@ -575,6 +733,15 @@ tr_variantDictAdd (tr_variant      * dict,
   val = dict->val.l.vals + dict->val.l.count++;
   tr_variantInit (val, TR_VARIANT_TYPE_INT);
   val->key = key;
+
+  if (dict->val.l.index != NULL)
+    {
+      if (dict->val.l.count * 2 > dict->val.l.index_size)
+        dictIndexRebuild (dict);
+      else
+        dictIndexInsert (dict, dict->val.l.count - 1);
+    }
+
   return val;
 }
 
@@ -654,6 +821,16 @@ tr_variantDictAddStr (tr_variant      * dict,
   return child;
 }
 
+tr_variant*
+tr_variantDictAddStrView (tr_variant      * dict,
+                          const tr_quark    key,
+                          const char      * val)
+{
+  tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
+  tr_variantInitStrView (child, val);
+  return child;
+}
+
 tr_variant*
 tr_variantDictAddRaw (tr_variant      * dict,
                       const tr_quark    key,
@@ -696,6 +873,13 @@ tr_variantDictRemove (tr_variant     * dict,
     {
       const int last = dict->val.l.count - 1;
 
+      if (dict->val.l.index != NULL)
+        {
+          dictIndexErase (dict, dictIndexFindSlot (dict, i));
+          if (i != last)
+            dict->val.l.index[dictIndexFindSlot (dict, last)] = i + 1;
+        }
+
       tr_variantFree (&dict->val.l.vals[i]);
 
       if (i != last)
@@ -908,6 +1092,7 @@ static void
 freeContainerEndFunc (const tr_variant * v, void * unused UNUSED)
 {
   tr_free (v->val.l.vals);
+  tr_free (v->val.l.index);
 }
 
 static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
@@ -1074,6 +1259,58 @@ tr_variantMergeDicts (tr_variant * target, const tr_variant * source)
     }
 }
 
+bool
+tr_variantListTableToDicts (tr_variant * list)
+{
+  size_t i, j;
+  size_t keyCount;
+  size_t rowCount;
+  tr_quark * keys;
+  tr_variant dicts;
+  tr_variant * header;
+  tr_quark listKey;
+
+  if (!tr_variantIsList (list) || !tr_variantIsList (header = tr_variantListChild (list, 0)))
+    return false;
+
+  listKey = list->key;
+  keyCount = tr_variantListSize (header);
+  keys = tr_new (tr_quark, keyCount);
+  for (j=0; j<keyCount; ++j)
+    {
+      size_t len = 0;
+      const char * str = "";
+      tr_variantGetStr (tr_variantListChild (header, j), &str, &len);
+      keys[j] = tr_quark_new (str, len);
+    }
+
+  rowCount = tr_variantListSize (list);
+  tr_variantInitList (&dicts, rowCount - 1);
+  for (i=1; i<rowCount; ++i)
+    {
+      tr_variant * row = tr_variantListChild (list, i);
+      tr_variant * d = tr_variantListAddDict (&dicts, keyCount);
+
+      if (tr_variantIsList (row))
+        {
+          for (j=0; j<keyCount && j<row->val.l.count; ++j)
+            {
+              tr_variant * value = &row->val.l.vals[j];
+              tr_variant * child = tr_variantDictAdd (d, keys[j]);
+              *child = *value;
+              child->key = keys[j];
+              tr_variantInit (value, TR_VARIANT_TYPE_INT);
+            }
+        }
+    }
+
+  tr_free (keys);
+  tr_variantFree (list);
+  *list = dicts;
+  list->key = listKey;
+  return true;
+}
+
 /***
 ****
 ***/
@@ -1125,6 +1362,19 @@ int
 tr_variantToFile (const tr_variant  * v,
                   tr_variant_fmt      fmt,
                   const char        * filename)
+{
+  int err;
+  struct evbuffer * buf = tr_variantToBuf (v, fmt);
+
+  err = tr_variantBufToFile (buf, filename);
+
+  evbuffer_free (buf);
+  return err;
+}
+
+int
+tr_variantBufToFile (struct evbuffer * buf,
+                     const char      * filename)
 {
   char * tmp;
   tr_sys_file_t fd;
@@ -1144,9 +1394,8 @@ tr_variantToFile (const tr_variant  * v,
     {
       uint64_t nleft;
 
-      /* save the variant to a temporary file */
+      /* save the buffer to a temporary file */
       {
-        struct evbuffer * buf = tr_variantToBuf (v, fmt);
         const char * walk = (const char *) evbuffer_pullup (buf, -1);
         nleft = evbuffer_get_length (buf);
 
@@ -1162,8 +1411,6 @@ tr_variantToFile (const tr_variant  * v,
             nleft -= n;
             walk += n;
           }
-
-        evbuffer_free (buf);
       }
 
       tr_sys_file_close (fd, NULL);
@@ -1214,8 +1461,21 @@ tr_variantFromFile (tr_variant      * setme,
   int err;
   size_t buflen;
   uint8_t * buf;
+  const uint8_t * map;
   const int old_errno = errno;
 
+  errno = 0;
+
+  /* .torrent and .resume files are parsed straight from the page cache.
+     The JSON parser's strtod () calls need a NUL-terminated buffer, so it gets a copy */
+  if (fmt == TR_VARIANT_FMT_BENC && (map = tr_mapFile (filename, &buflen)) != NULL)
+    {
+      err = tr_variantFromBuf (setme, fmt, map, buflen, filename, NULL);
+      tr_unmapFile (map, buflen);
+      errno = old_errno;
+      return err;
+    }
+
   errno = 0;
   buf = tr_loadFile (filename, &buflen);
 
@@ -1229,6 +1489,14 @@ tr_variantFromFile (tr_variant      * setme,
   return err;
 }
 
+int
+tr_variantFromBencInPlace (tr_variant  * setme,
+                           const void  * buf,
+                           size_t        buflen)
+{
+  return tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, NULL, true);
+}
+
 int
 tr_variantFromBuf (tr_variant      * setme,
                    tr_variant_fmt    fmt,
@@ -1252,7 +1520,7 @@ tr_variantFromBuf (tr_variant      * setme,
         break;
 
       default /* TR_VARIANT_FMT_BENC */:
-        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end);
+        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end, false);
         break;
     }
 
@@ -35,7 +35,8 @@ typedef enum
 {
   TR_STRING_TYPE_QUARK,
   TR_STRING_TYPE_HEAP,
-  TR_STRING_TYPE_BUF
+  TR_STRING_TYPE_BUF,
+  TR_STRING_TYPE_VIEW
 }
 tr_string_type;
 
@@ -88,6 +89,8 @@ typedef struct tr_variant
           size_t alloc;
           size_t count;
           struct tr_variant * vals;
+          size_t * index; /* dicts only: open-addressed key index, or NULL */
+          size_t index_size;
         } l;
     }
   val;
@@ -112,6 +115,10 @@ int tr_variantToFile (const tr_variant * variant,
                       tr_variant_fmt     fmt,
                       const char       * filename);
 
+/* saves the output of tr_variantToBuf () the same way tr_variantToFile () does */
+int tr_variantBufToFile (struct evbuffer * buf,
+                         const char      * filename);
+
 char* tr_variantToStr (const tr_variant * variant,
                        tr_variant_fmt     fmt,
                        int              * len);
@@ -132,6 +139,51 @@ int tr_variantFromBuf (tr_variant     * setme,
                        const char     * optional_source,
                        const char    ** setme_end);
 
+/* Find `key' in the bencoded dict in `buf' and get the bencoded bytes of
+ * its value. The other values are skipped over, not parsed, so this is a
+ * cheap way to pull a few small fields out of a big dict. */
+bool tr_variantBencDictFindValue (const void   * buf,
+                                  size_t         buflen,
+                                  const tr_quark key,
+                                  const void  ** setme_val,
+                                  size_t       * setme_len);
+
+/* Like tr_variantBencDictFindValue (), for a value that's a string.
+ * `setme_raw' points into `buf' and isn't NUL-terminated. */
+bool tr_variantBencDictFindRaw (const void     * buf,
+                                size_t           buflen,
+                                const tr_quark   key,
+                                const uint8_t ** setme_raw,
+                                size_t         * setme_len);
+
+/* Like tr_variantBencDictFindValue (), for a value that's an int */
+bool tr_variantBencDictFindInt (const void     * buf,
+                                size_t           buflen,
+                                const tr_quark   key,
+                                int64_t        * setme);
+
+typedef void (*tr_variantBencDictFunc)(const uint8_t * key,
+                                       size_t          key_len,
+                                       const uint8_t * val,
+                                       size_t          val_len,
+                                       void          * user_data);
+
+/* Call `func' with each key of the bencoded dict in `buf' and the bencoded
+ * bytes of its value, in the order they're stored. As with
+ * tr_variantBencDictFindValue (), the values aren't parsed.
+ * @return the length of the dict, or 0 if `buf' doesn't start with one */
+size_t tr_variantBencDictForeach (const void             * buf,
+                                  size_t                   buflen,
+                                  tr_variantBencDictFunc   func,
+                                  void                   * user_data);
+
+/* Like tr_variantFromBenc (), but long strings aren't copied: they point
+ * into `buf', which must outlive `setme', and aren't NUL-terminated.
+ * Only read them with tr_variantGetRaw (). */
+int tr_variantFromBencInPlace (tr_variant * setme,
+                               const void * buf,
+                               size_t       buflen);
+
 static inline int
 tr_variantFromBenc (tr_variant * setme,
                     const void * buf,
@@ -208,6 +260,11 @@ void         tr_variantInitStr         (tr_variant       * initme,
 void         tr_variantInitQuark       (tr_variant       * initme,
                                         const tr_quark     quark);
 
+/* like tr_variantInitStr (), but `str' is referenced rather than copied,
+   so it must be NUL-terminated and outlive the variant */
+void         tr_variantInitStrView     (tr_variant       * initme,
+                                        const char       * str);
+
 void         tr_variantInitRaw         (tr_variant       * initme,
                                         const void       * raw,
                                         size_t             raw_len);
@@ -297,6 +354,9 @@ tr_variant * tr_variantListAddStr      (tr_variant       * list,
 tr_variant * tr_variantListAddQuark    (tr_variant       * list,
                                         const tr_quark     addme);
 
+tr_variant * tr_variantListAddStrView  (tr_variant       * list,
+                                        const char       * addme);
+
 tr_variant * tr_variantListAddRaw      (tr_variant       * list,
                                         const void       * addme_value,
                                         size_t             addme_len);
@@ -354,6 +414,10 @@ tr_variant * tr_variantDictAddStr      (tr_variant       * dict,
                                         const tr_quark     key,
                                         const char       * value);
 
+tr_variant * tr_variantDictAddStrView  (tr_variant       * dict,
+                                        const tr_quark     key,
+                                        const char       * value);
+
 tr_variant * tr_variantDictAddQuark    (tr_variant       * dict,
                                         const tr_quark     key,
                                         const tr_quark     val);
@@ -413,6 +477,14 @@ bool         tr_variantDictFindRaw     (tr_variant       * dict,
 void         tr_variantMergeDicts      (tr_variant       * dict_target,
                                         const tr_variant * dict_source);
 
+/**
+ * @brief turn a table -- a list of keys followed by lists of their
+ *        values, as sent by torrent-get's "table" format -- into a
+ *        list of dictionaries, in place. The values are moved, not copied.
+ * @return false, leaving `list' alone, if it isn't a table
+ */
+bool         tr_variantListTableToDicts (tr_variant      * list);
+
 /***
 ****
 ****
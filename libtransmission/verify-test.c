@@ -0,0 +1,73 @@
+/*
+ * This file Copyright (C) 2014 Mnemosyne LLC
+ *
+ * It may be used under the GNU GPL versions 2 or 3
+ * or any future license endorsed by Mnemosyne LLC.
+ *
+ * $Id$
+ */
+
+#include <stdio.h> /* remove () */
+
+#include "transmission.h"
+#include "file.h"
+#include "torrent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+static int
+test_verify_finds_corruption_impl (bool use_map)
+{
+  tr_piece_index_t p;
+  tr_sys_file_t fd;
+  char * filename;
+  tr_torrent * tor;
+  tr_session * session = libttest_session_init (NULL);
+
+  tr_sessionSetVerifyMmapEnabled (session, use_map);
+  check (tr_sessionIsVerifyMmapEnabled (session) == use_map);
+
+  tor = libttest_zero_torrent_init (session);
+  libttest_zero_torrent_populate (tor, true);
+  check_int_eq (TR_SEED, tr_torrentGetCompleteness (tor));
+
+  /* flip a byte in the middle of the second piece and verify again */
+  filename = tr_torrentFindFile (tor, 0);
+  check (filename != NULL);
+  fd = tr_sys_file_open (filename, TR_SYS_FILE_WRITE, 0, NULL);
+  check (fd != TR_BAD_SYS_FILE);
+  check (tr_sys_file_write_at (fd, "\1", 1, tor->info.pieceSize + 100, NULL, NULL));
+  tr_sys_file_close (fd, NULL);
+  tr_free (filename);
+
+  libttest_blockingTorrentVerify (tor);
+
+  check (!tr_torrentPieceIsComplete (tor, 1));
+  for (p=0; p<tor->info.pieceCount; ++p)
+    if (p != 1)
+      check (tr_torrentPieceIsComplete (tor, p));
+
+  tr_torrentRemove (tor, true, remove);
+  libttest_session_close (session);
+  return 0;
+}
+
+static int
+test_verify_finds_corruption (void)
+{
+  int ret;
+
+  if ((ret = test_verify_finds_corruption_impl (false)))
+    return ret;
+
+  return test_verify_finds_corruption_impl (true);
+}
+
+int
+main (void)
+{
+  const testFunc tests[] = { test_verify_finds_corruption };
+
+  return runTests (tests, NUM_TESTS (tests));
+}
@@ -10,19 +10,19 @@
 #include <string.h> /* memcmp () */
 #include <stdlib.h> /* free () */
 
-#ifdef HAVE_POSIX_FADVISE
- #define _XOPEN_SOURCE 600
- #include <fcntl.h> /* posix_fadvise () */
-#endif
-
 #include <openssl/sha.h>
 
 #include "transmission.h"
+#include "cache.h" /* tr_cacheGetWriteQueueBytes () */
 #include "completion.h"
+#include "crypto.h" /* tr_sha1_init () */
 #include "file.h"
+#include "inout.h" /* tr_ioLinkSharedFile () */
 #include "list.h"
 #include "log.h"
+#include "metrics.h"
 #include "platform.h" /* tr_lock () */
+#include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
@@ -33,31 +33,157 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100,
+
+  /* how far ahead of the hashing to ask the OS to read.
+     this keeps the disk busy while we're hashing the previous chunk */
+  VERIFY_READAHEAD_BYTES = 1024 * 1024 * 4,
+
+  /* flushing downloaded data matters more than verifying, so between
+     pieces we let a backlog of the cache's writes to the same device
+     drain before reading more. an active download keeps a little queued
+     all the time, so only a backlog past this counts, and the yielding
+     is capped per second so that verify still makes progress */
+  WRITE_BACKLOG_BYTES = 1024 * 1024 * 4,
+  MAX_MSEC_PER_SECOND_TO_YIELD_TO_WRITES = 200,
+  MSEC_TO_SLEEP_WHILE_YIELDING = 10,
+
+  /* with tr_sessionIsVerifyMmapEnabled (), how much of a file is mapped
+     at once. a multiple of every platform's mapping granularity */
+  VERIFY_MAP_WINDOW_BYTES = 1024 * 1024 * 32
+};
+
+/* the window of a file that's currently mapped for hashing */
+struct verify_map
+{
+  const uint8_t * base;
+  uint64_t offset;
+  uint64_t len;
 };
 
+static void
+verifyUnmap (struct verify_map * map)
+{
+  if (map->base != NULL)
+    {
+      tr_sys_file_unmap (map->base, map->len, NULL);
+      map->base = NULL;
+    }
+}
+
+/* returns the mapped data at `pos', shortening `len' to what's mapped of it,
+   or NULL if it couldn't be mapped. fileSize is the file's size on disk,
+   since touching a mapping past the end of the file raises SIGBUS */
+static const uint8_t *
+verifyMap (struct verify_map * map, tr_sys_file_t fd, uint64_t fileSize,
+           uint64_t pos, uint64_t * len)
+{
+  if (pos >= fileSize)
+    return NULL;
+
+  if (map->base == NULL || pos < map->offset || pos >= map->offset + map->len)
+    {
+      verifyUnmap (map);
+      map->offset = pos - pos % VERIFY_MAP_WINDOW_BYTES;
+      map->len = MIN (VERIFY_MAP_WINDOW_BYTES, fileSize - map->offset);
+      map->base = tr_sys_file_map_for_reading (fd, map->offset, map->len, NULL);
+      if (map->base == NULL)
+        return NULL;
+      tr_sys_file_advise_map (map->base, map->len, TR_SYS_FILE_MAP_SEQUENTIAL, NULL);
+    }
+
+  *len = MIN (*len, map->offset + map->len - pos);
+  return map->base + (pos - map->offset);
+}
+
+/* `second' and `slept' carry this second's yielding between calls */
+static void
+yieldToWrites (const tr_torrent * tor, const struct write_queue * queue,
+               time_t * second, int * slept)
+{
+  const time_t now = tr_time ();
+
+  if (*second != now)
+    {
+      *second = now;
+      *slept = 0;
+    }
+
+  while (*slept < MAX_MSEC_PER_SECOND_TO_YIELD_TO_WRITES
+         && tr_cacheGetWriteQueueBytes (tor->session->cache, queue) > WRITE_BACKLOG_BYTES)
+    {
+      tr_wait_msec (MSEC_TO_SLEEP_WHILE_YIELDING);
+      *slept += MSEC_TO_SLEEP_WHILE_YIELDING;
+    }
+}
+
+/* true if none of the files touched by this piece have changed
+ * since the piece was last checked. fileIndex is the piece's first file. */
+static bool
+pieceIsUnchanged (const tr_torrent  * tor,
+                  tr_piece_index_t    pieceIndex,
+                  tr_file_index_t     fileIndex,
+                  tr_file_index_t   * mtimeIndex,
+                  time_t            * mtime)
+{
+  tr_file_index_t f;
+  const tr_info * inf = &tor->info;
+  const time_t timeChecked = inf->pieces[pieceIndex].timeChecked;
+
+  if (!timeChecked)
+    return false;
+
+  for (f=fileIndex; f<inf->fileCount && inf->files[f].firstPiece<=pieceIndex; ++f)
+    {
+      /* most pieces share their file with the previous piece,
+       * so only stat each file once */
+      if (*mtimeIndex != f)
+        {
+          *mtimeIndex = f;
+          *mtime = tr_torrentGetFileMTime (tor, f);
+        }
+
+      /* a missing file counts as a change */
+      if (!*mtime || (*mtime > timeChecked))
+        return false;
+    }
+
+  return true;
+}
+
 static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+verifyTorrent (tr_torrent * tor, bool incremental,
+               const struct write_queue * writeQueue, bool * stopFlag)
 {
   time_t end;
-  SHA_CTX sha;
+  tr_sha1_ctx_t sha;
   tr_sys_file_t fd = TR_BAD_SYS_FILE;
+  struct verify_map map = { NULL, 0, 0 };
+  uint64_t fileSize = 0;
   uint64_t filePos = 0;
+  uint64_t prefetchedTo = 0;
   bool changed = 0;
   bool hadPiece = 0;
+  bool skipPiece = false;
   time_t lastSleptAt = 0;
+  time_t yieldSecond = 0;
+  int yieldMsec = 0;
+  time_t mtime = 0;
+  tr_file_index_t mtimeIndex = tor->info.fileCount;
   uint32_t piecePos = 0;
   tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
+  tr_file_index_t prevFileIndex = tor->info.fileCount;
   tr_piece_index_t pieceIndex = 0;
   const time_t begin = tr_time ();
   const size_t buflen = 1024 * 128; /* 128 KiB buffer */
   uint8_t * buffer = tr_valloc (buflen);
+  const bool useMap = tr_sessionIsVerifyMmapEnabled (tor->session);
 
-  SHA1_Init (&sha);
+  sha = tr_sha1_init ();
 
   tr_logAddTorDbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
+  if (!incremental)
+    tr_torrentSetChecked (tor, 0);
   while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
     {
       uint64_t leftInPiece;
@@ -67,35 +193,72 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
 
       /* if we're starting a new piece... */
       if (piecePos == 0)
-        hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+        {
+          hadPiece = tr_torrentPieceIsComplete (tor, pieceIndex);
+          skipPiece = incremental && pieceIsUnchanged (tor, pieceIndex, fileIndex, &mtimeIndex, &mtime);
+        }
 
       /* if we're starting a new file... */
-      if (filePos == 0 && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
+      if (!skipPiece && fd == TR_BAD_SYS_FILE && fileIndex != prevFileIndex)
         {
           char * filename = tr_torrentFindFile (tor, fileIndex);
           fd = filename == NULL ? TR_BAD_SYS_FILE : tr_sys_file_open (filename,
                TR_SYS_FILE_READ | TR_SYS_FILE_SEQUENTIAL, 0, NULL);
           tr_free (filename);
           prevFileIndex = fileIndex;
+          prefetchedTo = 0;
+
+          if (useMap && fd != TR_BAD_SYS_FILE)
+            {
+              tr_sys_path_info info;
+              fileSize = tr_sys_file_get_info (fd, &info, NULL) ? info.size : 0;
+            }
         }
 
       /* figure out how much we can read this pass */
       leftInPiece = tr_torPieceCountBytes (tor, pieceIndex) - piecePos;
       leftInFile = file->length - filePos;
       bytesThisPass = MIN (leftInFile, leftInPiece);
-      bytesThisPass = MIN (bytesThisPass, buflen);
+      if (!skipPiece && !useMap)
+        bytesThisPass = MIN (bytesThisPass, buflen);
+
+      /* top off the readahead window once half of it has been consumed */
+      if (!skipPiece && fd != TR_BAD_SYS_FILE && prefetchedTo < file->length
+                                && prefetchedTo < filePos + VERIFY_READAHEAD_BYTES / 2)
+        {
+          const uint64_t prefetchFrom = MAX (prefetchedTo, filePos);
+          const uint64_t prefetchLen = MIN (file->length, filePos + VERIFY_READAHEAD_BYTES) - prefetchFrom;
+          if (map.base != NULL && prefetchFrom >= map.offset && prefetchFrom + prefetchLen <= map.offset + map.len)
+            tr_sys_file_advise_map (map.base + (prefetchFrom - map.offset), prefetchLen, TR_SYS_FILE_MAP_WILLNEED, NULL);
+          else
+            tr_sys_file_prefetch (fd, prefetchFrom, prefetchLen, NULL);
+          prefetchedTo = prefetchFrom + prefetchLen;
+        }
 
-      /* read a bit */
-      if (fd != TR_BAD_SYS_FILE)
+      /* read a bit, or hash it right out of the mapping */
+      if (!skipPiece && fd != TR_BAD_SYS_FILE)
         {
-          uint64_t numRead;
-          if (tr_sys_file_read_at (fd, buffer, bytesThisPass, filePos, &numRead, NULL) && numRead > 0)
+          uint64_t numRead = 0;
+          const uint8_t * data = NULL;
+
+          if (useMap)
+            data = verifyMap (&map, fd, fileSize, filePos, &bytesThisPass);
+
+          if (data != NULL)
+            numRead = bytesThisPass;
+          else if (tr_sys_file_read_at (fd, buffer, MIN (bytesThisPass, buflen), filePos, &numRead, NULL))
+            data = buffer;
+
+          if (data != NULL && numRead > 0)
             {
               bytesThisPass = numRead;
-              SHA1_Update (&sha, buffer, bytesThisPass);
-#if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
-              posix_fadvise (fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
-#endif
+              tr_sha1_update (sha, data, bytesThisPass);
+              tr_metricsAdd (tor->session, TR_METRIC_VERIFY_BYTES, bytesThisPass);
+
+              /* we're done with these pages */
+              if (data != buffer)
+                tr_sys_file_advise_map (data, bytesThisPass, TR_SYS_FILE_MAP_DONTNEED, NULL);
+              tr_sys_file_drop_cache (fd, filePos, bytesThisPass, NULL);
             }
         }
 
@@ -105,15 +268,22 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
       piecePos += bytesThisPass;
       filePos += bytesThisPass;
 
+      /* if we're finishing a piece we trust from the last check... */
+      if (leftInPiece == 0 && skipPiece)
+        {
+          pieceIndex++;
+          piecePos = 0;
+        }
+
       /* if we're finishing a piece... */
-      if (leftInPiece == 0)
+      else if (leftInPiece == 0)
         {
           time_t now;
           bool hasPiece;
           uint8_t hash[SHA_DIGEST_LENGTH];
 
-          SHA1_Final (hash, &sha);
-          hasPiece = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
+          hasPiece = tr_sha1_final (sha, hash)
+                  && !memcmp (hash, tr_torrentPieceHash (tor, pieceIndex), SHA_DIGEST_LENGTH);
 
           if (hasPiece || hadPiece)
             {
@@ -122,6 +292,7 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
             }
 
           tr_torrentSetPieceChecked (tor, pieceIndex);
+          tr_metricsAdd (tor->session, TR_METRIC_VERIFY_PIECES, 1);
           now = tr_time ();
           tor->anyDate = now;
 
@@ -133,7 +304,9 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
               tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
             }
 
-          SHA1_Init (&sha);
+          yieldToWrites (tor, writeQueue, &yieldSecond, &yieldMsec);
+
+          sha = tr_sha1_init ();
           pieceIndex++;
           piecePos = 0;
         }
@@ -141,6 +314,7 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
       /* if we're finishing a file... */
       if (leftInFile == 0)
         {
+          verifyUnmap (&map);
           if (fd != TR_BAD_SYS_FILE)
             {
               tr_sys_file_close (fd, NULL);
@@ -152,8 +326,10 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
     }
 
   /* cleanup */
+  verifyUnmap (&map);
   if (fd != TR_BAD_SYS_FILE)
     tr_sys_file_close (fd, NULL);
+  tr_sha1_final (sha, NULL);
   free (buffer);
 
   /* stopwatch */
@@ -175,12 +351,38 @@ struct verify_node
   tr_verify_done_func   callback_func;
   void                * callback_data;
   uint64_t              current_size;
+  bool                  incremental;
+
+  /* the cache's writes to the torrent's device. found when the torrent's
+     queued, since the torrent's folder can change under the worker.
+     there's one queue per device, so this doubles as the device's id */
+  const struct write_queue * write_queue;
+};
+
+/* each worker thread verifies one torrent at a time.
+ * workers never verify two torrents on the same device at once,
+ * since that would just make the disk seek back and forth. */
+struct verify_worker
+{
+  struct verify_node   node;
+  bool                 stop;
 };
 
-static struct verify_node currentNode;
 static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+static tr_list * workerList = NULL;
+static int workerCount = 0;
+
+/* link in the files that other torrents already have, so that they
+   verify as ours. this looks at the other torrents, so it's done when
+   the torrent's queued in the libevent thread */
+static void
+linkSharedFiles (tr_torrent * tor)
+{
+  tr_file_index_t i;
+
+  for (i=0; i<tor->info.fileCount; ++i)
+    tr_ioLinkSharedFile (tor, i);
+}
 
 static tr_lock*
 getVerifyLock (void)
@@ -193,9 +395,61 @@ getVerifyLock (void)
   return lock;
 }
 
+static bool
+isDeviceBusy (const struct verify_node * node)
+{
+  tr_list * l;
+
+  for (l=workerList; l!=NULL; l=l->next)
+    {
+      const struct verify_worker * w = l->data;
+
+      if ((w->node.torrent != NULL) && (w->node.write_queue == node->write_queue))
+        return true;
+    }
+
+  return false;
+}
+
+/* find the highest-priority queued torrent that isn't sharing a device
+ * with one that's already being verified */
+static struct verify_node *
+getNextNode (void)
+{
+  tr_list * l;
+
+  for (l=verifyList; l!=NULL; l=l->next)
+    {
+      struct verify_node * node = l->data;
+
+      if (!isDeviceBusy (node))
+        return node;
+    }
+
+  return NULL;
+}
+
+static struct verify_worker *
+findWorker (const tr_torrent * tor)
+{
+  tr_list * l;
+
+  for (l=workerList; l!=NULL; l=l->next)
+    {
+      struct verify_worker * w = l->data;
+
+      if (w->node.torrent == tor)
+        return w;
+    }
+
+  return NULL;
+}
+
 static void
-verifyThreadFunc (void * unused UNUSED)
+verifyThreadFunc (void * vworker)
 {
+  struct verify_worker * worker = vworker;
+
   for (;;)
     {
       int changed = 0;
@@ -203,34 +457,34 @@ verifyThreadFunc (void * unused UNUSED)
       struct verify_node * node;
 
       tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
+      worker->stop = false;
+      worker->node.torrent = NULL;
+      node = getNextNode ();
       if (node == NULL)
-        {
-          currentNode.torrent = NULL;
-          break;
-        }
+        break;
 
-      currentNode = *node;
-      tor = currentNode.torrent;
+      worker->node = *node;
+      tor = worker->node.torrent;
       tr_list_remove_data (&verifyList, node);
       tr_free (node);
       tr_lockUnlock (getVerifyLock ());
 
       tr_logAddTorInfo (tor, "%s", _("Verifying torrent"));
       tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
+      changed = verifyTorrent (tor, worker->node.incremental, worker->node.write_queue, &worker->stop);
       tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
       assert (tr_isTorrent (tor));
 
-      if (!stopCurrent && changed)
+      if (!worker->stop && changed)
         tr_torrentSetDirty (tor);
 
-      if (currentNode.callback_func)
-        (*currentNode.callback_func)(tor, stopCurrent, currentNode.callback_data);
+      if (worker->node.callback_func)
+        (*worker->node.callback_func)(tor, worker->stop, worker->node.callback_data);
     }
 
-  verifyThread = NULL;
+  tr_list_remove_data (&workerList, worker);
+  --workerCount;
+  tr_free (worker);
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -256,6 +510,7 @@ compareVerifyByPriorityAndSize (const void * va, const void * vb)
 
 void
 tr_verifyAdd (tr_torrent           * tor,
+              bool                   incremental,
               tr_verify_done_func    callback_func,
               void                 * callback_data)
 {
@@ -264,17 +519,26 @@ tr_verifyAdd (tr_torrent           * tor,
   assert (tr_isTorrent (tor));
   tr_logAddTorInfo (tor, "%s", _("Queued for verification"));
 
+  linkSharedFiles (tor);
+
   node = tr_new (struct verify_node, 1);
   node->torrent = tor;
   node->callback_func = callback_func;
   node->callback_data = callback_data;
   node->current_size = tr_torrentGetCurrentSizeOnDisk (tor);
+  node->incremental = incremental;
+  node->write_queue = tr_cacheGetWriteQueue (tor->session->cache, tor);
 
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
   tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  if (workerCount < tr_sessionGetVerifyThreadCount (tor->session))
+    {
+      struct verify_worker * worker = tr_new0 (struct verify_worker, 1);
+      tr_list_append (&workerList, worker);
+      ++workerCount;
+      tr_threadNew (verifyThreadFunc, worker);
+    }
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -294,12 +558,13 @@ tr_verifyRemove (tr_torrent * tor)
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  if (findWorker (tor) != NULL)
     {
-      stopCurrent = true;
+      struct verify_worker * worker;
 
-      while (stopCurrent)
+      while ((worker = findWorker (tor)) != NULL)
         {
+          worker->stop = true;
           tr_lockUnlock (lock);
           tr_wait_msec (100);
           tr_lockLock (lock);
@@ -326,9 +591,12 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
+  tr_list * l;
+
   tr_lockLock (getVerifyLock ());
 
-  stopCurrent = true;
+  for (l=workerList; l!=NULL; l=l->next)
+    ((struct verify_worker*)l->data)->stop = true;
   tr_list_free (&verifyList, tr_free);
 
   tr_lockUnlock (getVerifyLock ());
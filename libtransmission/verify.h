@@ -20,6 +20,7 @@
  */
 
 void tr_verifyAdd (tr_torrent           * tor,
+                   bool                   incremental,
                    tr_verify_done_func    callback_func,
                    void                 * callback_user_data);
 
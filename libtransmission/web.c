@@ -8,19 +8,25 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h> /* strlen (), strstr () */
 
 #ifdef _WIN32
   #include <ws2tcpip.h>
+  #define WAKEUP_SOCKETPAIR_AF AF_INET
 #else
-  #include <sys/select.h>
+  #include <sys/socket.h> /* send (), recv () */
+  #define WAKEUP_SOCKETPAIR_AF AF_UNIX
 #endif
 
 #include <curl/curl.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h> /* evutil_socketpair () */
 
 #include "transmission.h"
+#include "dns-cache.h"
 #include "file.h"
 #include "list.h"
 #include "log.h"
@@ -37,9 +43,30 @@
  #define USE_LIBCURL_SOCKOPT
 #endif
 
+#if LIBCURL_VERSION_NUM >= 0x071503 /* CURLOPT_RESOLVE was added in 7.21.3 */
+ #define USE_LIBCURL_RESOLVE
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072B00 /* CURLPIPE_MULTIPLEX was added in 7.43.0 */
+ #define USE_LIBCURL_MULTIPLEX
+#endif
+
 enum
 {
-  THREADFUNC_MAX_SLEEP_MSEC = 200,
+  /* how long to wait before unpausing speed-limited webseed transfers */
+  UNPAUSE_INTERVAL_MSEC = 200,
+
+  /* how many idle connections libcurl may keep open for reuse.
+     Its default scales with the number of running transfers, which
+     is too few to keep webseed connections alive between requests. */
+  MAX_CACHED_CONNECTIONS = 32,
+
+  /* on shutdown, how many connections to open to each tracker.
+     The rest of its "stopped" announces wait to reuse one of them. */
+  MAX_HOST_CONNECTIONS_WHEN_CLOSING = 4,
+
+  /* how many finished easy handles to keep for the next tasks */
+  MAX_IDLE_EASY_HANDLES = 16
 };
 
 #if 0
@@ -72,6 +99,9 @@ struct tr_web_task
   char * url;
   char * range;
   char * cookies;
+  char * host;
+  struct curl_slist * resolve;
+  bool used_dns_cache;
   tr_session * session;
   tr_web_done_func done_func;
   void * done_func_user_data;
@@ -84,6 +114,9 @@ task_free (struct tr_web_task * task)
 {
   if (task->freebuf)
     evbuffer_free (task->freebuf);
+  if (task->resolve)
+    curl_slist_free_all (task->resolve);
+  tr_free (task->host);
   tr_free (task->cookies);
   tr_free (task->range);
   tr_free (task->url);
@@ -102,9 +135,27 @@ struct tr_web
   bool curl_ssl_verify;
   char * curl_ca_bundle;
   int close_mode;
+  int taskCount;
   struct tr_web_task * tasks;
+  tr_list * running; /* the tasks that have been given to curl */
   tr_lock * taskLock;
   char * cookie_filename;
+  time_t cookie_mtime;
+  tr_session * session;
+
+  CURLM * multi;
+
+  /* the easy handles share their DNS, TLS session and cookie caches.
+     Only the web thread uses them, so this needs no lock callbacks */
+  CURLSH * share;
+  tr_list * idle_easy;
+  int idle_easy_count;
+
+  struct event_base * base;
+  struct event * timer_event;
+  struct event * pause_event;
+  struct event * wakeup_event;
+  evutil_socket_t wakeup_fds[2];
 };
 
 /***
@@ -124,7 +175,10 @@ writeFunc (void * ptr, size_t size, size_t nmemb, void * vtask)
 
       if (tor && !tr_bandwidthClamp (&tor->bandwidth, TR_DOWN, nmemb))
         {
+          struct tr_web * web = task->session->web;
           tr_list_append (&paused_easy_handles, task->curl_easy);
+          if (!evtimer_pending (web->pause_event, NULL))
+            tr_timerAddMsec (web->pause_event, UNPAUSE_INTERVAL_MSEC);
           return CURL_WRITEFUNC_PAUSE;
         }
     }
@@ -156,6 +210,13 @@ sockoptfunction (void * vtask, curl_socket_t fd, curlsocktype purpose UNUSED)
 }
 #endif
 
+/* once the session starts closing, only "stopped" announces are worth sending */
+static bool
+isNeededWhenClosing (const char * url)
+{
+  return strstr (url, "event=stopped") != NULL;
+}
+
 static long
 getTimeoutFromURL (const struct tr_web_task * task)
 {
@@ -163,6 +224,7 @@ getTimeoutFromURL (const struct tr_web_task * task)
   const tr_session * session = task->session;
 
   if (!session || session->isClosed) timeout = 20L;
+  else if (session->isClosing) timeout = MAX (1L, (long)(session->closeDeadline - time (NULL)));
   else if (strstr (task->url, "scrape") != NULL) timeout = 30L;
   else if (strstr (task->url, "announce") != NULL) timeout = 90L;
   else timeout = 240L;
@@ -170,12 +232,130 @@ getTimeoutFromURL (const struct tr_web_task * task)
   return timeout;
 }
 
+#ifdef USE_LIBCURL_RESOLVE
+
+/* Point libcurl at the session's DNS cache, which is shared with the UDP
+   announcer and outlives libcurl's own one-minute cache. */
+static void
+dnsCacheApply (struct tr_web_task * task)
+{
+  int port;
+  char * host = NULL;
+  char * entry;
+  tr_address addr;
+
+  if (tr_urlParse (task->url, -1, NULL, &host, &port, NULL) || (host == NULL))
+    return;
+
+  /* no point in caching numeric hosts */
+  if (tr_address_from_string (&addr, host))
+    {
+      tr_free (host);
+      return;
+    }
+
+  task->host = host;
+  task->used_dns_cache = tr_dnsCacheLookup (task->session, host, &addr, NULL);
+
+  /* CURLOPT_RESOLVE entries never expire from the multi handle's cache,
+     so when we don't have an address, clear out any we gave it earlier */
+  if (task->used_dns_cache)
+    entry = tr_strdup_printf ("%s:%d:%s", host, port, tr_address_to_string (&addr));
+  else
+    entry = tr_strdup_printf ("-%s:%d", host, port);
+
+  task->resolve = curl_slist_append (NULL, entry);
+  curl_easy_setopt (task->curl_easy, CURLOPT_RESOLVE, task->resolve);
+  tr_free (entry);
+}
+
+static void
+dnsCacheUpdate (struct tr_web_task * task, CURL * e)
+{
+  if (task->host == NULL)
+    return;
+
+  if (task->used_dns_cache)
+    {
+      /* the cached address may be stale; look it up again next time */
+      if (!task->did_connect)
+        tr_dnsCacheRemove (task->session, task->host);
+    }
+  else if (task->did_connect)
+    {
+      long redirects = 0;
+      char * ip = NULL;
+      tr_address addr;
+
+      /* after a redirect, the primary ip belongs to some other host */
+      curl_easy_getinfo (e, CURLINFO_REDIRECT_COUNT, &redirects);
+      curl_easy_getinfo (e, CURLINFO_PRIMARY_IP, &ip);
+      if (!redirects && (ip != NULL) && tr_address_from_string (&addr, ip))
+        tr_dnsCacheAdd (task->session, task->host, &addr);
+    }
+}
+
+#endif
+
+/* reuse an idle easy handle if there is one. Its connections were
+   left in the multi handle's cache; this saves setting up a new handle */
+static CURL *
+getEasy (struct tr_web * web)
+{
+  CURL * e = tr_list_pop_front (&web->idle_easy);
+
+  if (e != NULL)
+    {
+      --web->idle_easy_count;
+    }
+  else
+    {
+      e = curl_easy_init ();
+      curl_easy_setopt (e, CURLOPT_SHARE, web->share);
+    }
+
+  return e;
+}
+
+static void
+releaseEasy (struct tr_web * web, CURL * e, bool reuse)
+{
+  if (reuse && web->idle_easy_count < MAX_IDLE_EASY_HANDLES)
+    {
+      /* this keeps the share */
+      curl_easy_reset (e);
+      tr_list_prepend (&web->idle_easy, e);
+      ++web->idle_easy_count;
+    }
+  else
+    {
+      curl_easy_cleanup (e);
+    }
+}
+
+/* the cookie jar is shared by all the handles, so only
+   read cookies.txt again when it's been changed */
+static const char *
+getCookieFile (struct tr_web * web)
+{
+  tr_sys_path_info info;
+
+  if (!tr_sys_path_get_info (web->cookie_filename, 0, &info, NULL))
+    return "";
+
+  if (info.last_modified_at == web->cookie_mtime)
+    return ""; /* turns on the cookie engine without reading anything */
+
+  web->cookie_mtime = info.last_modified_at;
+  return web->cookie_filename;
+}
+
 static CURL *
 createEasy (tr_session * s, struct tr_web * web, struct tr_web_task * task)
 {
   bool is_default_value;
   const tr_address * addr;
-  CURL * e = task->curl_easy = curl_easy_init ();
+  CURL * e = task->curl_easy = getEasy (web);
 
   task->timeout_secs = getTimeoutFromURL (task);
 
@@ -214,15 +394,27 @@ createEasy (tr_session * s, struct tr_web * web, struct tr_web_task * task)
     curl_easy_setopt (e, CURLOPT_COOKIE, task->cookies);
 
   if (web->cookie_filename != NULL)
-    curl_easy_setopt (e, CURLOPT_COOKIEFILE, web->cookie_filename);
+    curl_easy_setopt (e, CURLOPT_COOKIEFILE, getCookieFile (web));
 
   if (task->range != NULL)
     {
       curl_easy_setopt (e, CURLOPT_RANGE, task->range);
       /* don't bother asking the server to compress webseed fragments */
       curl_easy_setopt (e, CURLOPT_ENCODING, "identity");
+#ifdef USE_LIBCURL_MULTIPLEX
+      /* webseed requests all go to the same few servers, so prefer
+         waiting for a multiplexed HTTP/2 stream over a new connection */
+      curl_easy_setopt (e, CURLOPT_PIPEWAIT, 1L);
+ #if LIBCURL_VERSION_NUM >= 0x072F00 /* CURL_HTTP_VERSION_2TLS was added in 7.47.0 */
+      curl_easy_setopt (e, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+ #endif
+#endif
     }
 
+#ifdef USE_LIBCURL_RESOLVE
+  dnsCacheApply (task);
+#endif
+
   return e;
 }
 
@@ -253,6 +445,7 @@ task_finish_func (void * vtask)
 ****/
 
 static void tr_webThreadFunc (void * vsession);
+static void webWakeup (struct tr_web * web);
 
 static struct tr_web_task *
 tr_webRunImpl (tr_session         * session,
@@ -266,7 +459,7 @@ tr_webRunImpl (tr_session         * session,
 {
   struct tr_web_task * task = NULL;
 
-  if (!session->isClosing)
+  if (!session->isClosing || isNeededWhenClosing (url))
     {
       if (session->web == NULL)
         {
@@ -291,6 +484,7 @@ tr_webRunImpl (tr_session         * session,
       task->next = session->web->tasks;
       session->web->tasks = task;
       tr_lockUnlock (session->web->taskLock);
+      webWakeup (session->web);
     }
 
   return task;
@@ -334,46 +528,240 @@ tr_webRunWebseed (tr_torrent        * tor,
                         buffer);
 }
 
-/**
- * Portability wrapper for select ().
- *
- * http://msdn.microsoft.com/en-us/library/ms740141%28VS.85%29.aspx
- * On win32, any two of the parameters, readfds, writefds, or exceptfds,
- * can be given as null. At least one must be non-null, and any non-null
- * descriptor set must contain at least one handle to a socket.
- */
+/****
+*****
+****/
+
 static void
-tr_select (int nfds,
-           fd_set * r_fd_set, fd_set * w_fd_set, fd_set * c_fd_set,
-           struct timeval  * t)
+webWakeup (struct tr_web * web)
 {
-#ifdef _WIN32
-  if (!r_fd_set->fd_count && !w_fd_set->fd_count && !c_fd_set->fd_count)
+  const char ch = '\0';
+
+  /* if this fails, it's because there's already a wakeup pending */
+  send (web->wakeup_fds[1], &ch, 1, 0);
+}
+
+/* take a task away from curl and hand it back to its caller */
+static void
+webFinishTask (struct tr_web * web, struct tr_web_task * task, bool completed)
+{
+  CURL * e = task->curl_easy;
+
+  curl_multi_remove_handle (web->multi, e);
+  tr_list_remove_data (&paused_easy_handles, e);
+  tr_list_remove_data (&web->running, task);
+  releaseEasy (web, e, completed);
+  task->curl_easy = NULL;
+  tr_runInEventThread (task->session, task_finish_func, task);
+  --web->taskCount;
+}
+
+/* pump completed tasks from the multi */
+static void
+webProcessCompleted (struct tr_web * web)
+{
+  int unused;
+  CURLMsg * msg;
+
+  while ((msg = curl_multi_info_read (web->multi, &unused)))
     {
-      const long int msec = t->tv_sec*1000 + t->tv_usec/1000;
-      tr_wait_msec (msec);
+      if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
+        {
+          double total_time;
+          struct tr_web_task * task;
+          long req_bytes_sent;
+          CURL * e = msg->easy_handle;
+          curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
+          assert (e == task->curl_easy);
+          curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
+          curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
+          curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
+          task->did_connect = task->code>0 || req_bytes_sent>0;
+          task->did_timeout = !task->code && (total_time >= task->timeout_secs);
+#ifdef USE_LIBCURL_RESOLVE
+          dnsCacheUpdate (task, e);
+#endif
+          webFinishTask (web, task, true);
+        }
     }
-  else if (select (0, r_fd_set->fd_count ? r_fd_set : NULL,
-                      w_fd_set->fd_count ? w_fd_set : NULL,
-                      c_fd_set->fd_count ? c_fd_set : NULL, t) < 0)
+
+  if ((web->close_mode == TR_WEB_CLOSE_WHEN_IDLE) && (web->tasks == NULL) && (web->taskCount == 0))
+    event_base_loopbreak (web->base);
+}
+
+/* libcurl wants us to watch (or stop watching) one of its sockets */
+static void onSocketEvent (evutil_socket_t fd, short what, void * vweb);
+
+static int
+onCurlSocket (CURL           * e UNUSED,
+              curl_socket_t    s,
+              int              what,
+              void           * vweb,
+              void           * vevent)
+{
+  struct tr_web * web = vweb;
+  struct event * ev = vevent;
+
+  if (what == CURL_POLL_REMOVE)
     {
-      char errstr[512];
-      const int e = EVUTIL_SOCKET_ERROR ();
-      tr_net_strerror (errstr, sizeof (errstr), e);
-      dbgmsg ("Error: select (%d) %s", e, errstr);
+      if (ev != NULL)
+        {
+          event_free (ev);
+          curl_multi_assign (web->multi, s, NULL);
+        }
     }
-#else
-  select (nfds, r_fd_set, w_fd_set, c_fd_set, t);
+  else
+    {
+      short events = EV_PERSIST;
+      if (what & CURL_POLL_IN)
+        events |= EV_READ;
+      if (what & CURL_POLL_OUT)
+        events |= EV_WRITE;
+
+      if (ev != NULL)
+        {
+          event_del (ev);
+          event_assign (ev, web->base, s, events, onSocketEvent, web);
+        }
+      else
+        {
+          ev = event_new (web->base, s, events, onSocketEvent, web);
+          curl_multi_assign (web->multi, s, ev);
+        }
+
+      event_add (ev, NULL);
+    }
+
+  return 0;
+}
+
+static void
+onSocketEvent (evutil_socket_t fd, short what, void * vweb)
+{
+  int unused;
+  int action = 0;
+  struct tr_web * web = vweb;
+
+  if (what & EV_READ)
+    action |= CURL_CSELECT_IN;
+  if (what & EV_WRITE)
+    action |= CURL_CSELECT_OUT;
+
+  curl_multi_socket_action (web->multi, fd, action, &unused);
+  webProcessCompleted (web);
+}
+
+/* libcurl wants to be called back in `timeout_ms' */
+static int
+onCurlTimer (CURLM * multi UNUSED, long timeout_ms, void * vweb)
+{
+  struct tr_web * web = vweb;
+
+  if (timeout_ms < 0)
+    evtimer_del (web->timer_event);
+  else
+    tr_timerAddMsec (web->timer_event, timeout_ms);
+
+  return 0;
+}
+
+static void
+onTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vweb)
+{
+  int unused;
+  struct tr_web * web = vweb;
+
+  curl_multi_socket_action (web->multi, CURL_SOCKET_TIMEOUT, 0, &unused);
+  webProcessCompleted (web);
+}
+
+/* unpause any paused curl handles */
+static void
+onPauseTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vweb UNUSED)
+{
+  CURL * handle;
+  tr_list * tmp;
+
+  /* swap paused_easy_handles to prevent oscillation
+     between writeFunc and this loop */
+  tmp = paused_easy_handles;
+  paused_easy_handles = NULL;
+
+  while ((handle = tr_list_pop_front (&tmp)))
+    curl_easy_pause (handle, CURLPAUSE_CONT);
+}
+
+/* new tasks have been queued, or we've been asked to close */
+static void
+onWakeup (evutil_socket_t fd, short what UNUSED, void * vweb)
+{
+  char buf[64];
+  struct tr_web * web = vweb;
+  struct tr_web_task * task;
+
+  while (recv (fd, buf, sizeof (buf), 0) > 0)
+    ;
+
+  if (web->close_mode == TR_WEB_CLOSE_NOW)
+    {
+      event_base_loopbreak (web->base);
+      return;
+    }
+
+  /* closing down: don't wait on the transfers that no longer matter,
+     and send the "stopped" announces a few at a time per tracker */
+  if (web->close_mode == TR_WEB_CLOSE_WHEN_IDLE)
+    {
+      tr_list * l;
+
+      for (l=web->running; l!=NULL; )
+        {
+          task = l->data;
+          l = l->next;
+
+          if (!isNeededWhenClosing (task->url))
+            {
+              dbgmsg ("cancelling task on close: [%s]", task->url);
+              webFinishTask (web, task, false);
+            }
+        }
+
+#if LIBCURL_VERSION_NUM >= 0x071E00 /* CURLMOPT_MAX_HOST_CONNECTIONS was added in 7.30.0 */
+      curl_multi_setopt (web->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)MAX_HOST_CONNECTIONS_WHEN_CLOSING);
 #endif
+    }
+
+  /* add tasks from the queue */
+  tr_lockLock (web->taskLock);
+  while (web->tasks != NULL)
+    {
+      /* pop the task */
+      task = web->tasks;
+      web->tasks = task->next;
+      task->next = NULL;
+
+      if (web->close_mode == TR_WEB_CLOSE_WHEN_IDLE && !isNeededWhenClosing (task->url))
+        {
+          dbgmsg ("dropping task on close: [%s]", task->url);
+          tr_runInEventThread (task->session, task_finish_func, task);
+          continue;
+        }
+
+      dbgmsg ("adding task to curl: [%s]", task->url);
+      curl_multi_add_handle (web->multi, createEasy (web->session, web, task));
+      tr_list_prepend (&web->running, task);
+      ++web->taskCount;
+    }
+  tr_lockUnlock (web->taskLock);
+
+  webProcessCompleted (web);
 }
 
 static void
 tr_webThreadFunc (void * vsession)
 {
   char * str;
-  CURLM * multi;
   struct tr_web * web;
-  int taskCount = 0;
   struct tr_web_task * task;
   tr_session * session = vsession;
 
@@ -383,6 +771,7 @@ tr_webThreadFunc (void * vsession)
     curl_global_init (0);
 
   web = tr_new0 (struct tr_web, 1);
+  web->session = session;
   web->close_mode = ~0;
   web->taskLock = tr_lockNew ();
   web->tasks = NULL;
@@ -402,110 +791,39 @@ tr_webThreadFunc (void * vsession)
     web->cookie_filename = tr_strdup (str);
   tr_free (str);
 
-  multi = curl_multi_init ();
-  session->web = web;
-
-  for (;;)
-    {
-      long msec;
-      int unused;
-      CURLMsg * msg;
-      CURLMcode mcode;
-
-      if (web->close_mode == TR_WEB_CLOSE_NOW)
-        break;
-      if ((web->close_mode == TR_WEB_CLOSE_WHEN_IDLE) && (web->tasks == NULL))
-        break;
-
-      /* add tasks from the queue */
-      tr_lockLock (web->taskLock);
-      while (web->tasks != NULL)
-        {
-          /* pop the task */
-          task = web->tasks;
-          web->tasks = task->next;
-          task->next = NULL;
-
-          dbgmsg ("adding task to curl: [%s]", task->url);
-          curl_multi_add_handle (multi, createEasy (session, web, task));
-          /*fprintf (stderr, "adding a task.. taskCount is now %d\n", taskCount);*/
-          ++taskCount;
-        }
-      tr_lockUnlock (web->taskLock);
-
-      /* unpause any paused curl handles */
-      if (paused_easy_handles != NULL)
-        {
-          CURL * handle;
-          tr_list * tmp;
-
-          /* swap paused_easy_handles to prevent oscillation
-             between writeFunc this while loop */
-          tmp = paused_easy_handles;
-          paused_easy_handles = NULL;
-
-          while ((handle = tr_list_pop_front (&tmp)))
-            curl_easy_pause (handle, CURLPAUSE_CONT);
-        }
+  /* the web thread has its own event loop: libcurl tells us which
+     sockets to watch, and we tell it when one is ready */
+  web->base = event_base_new ();
+  if (evutil_socketpair (WAKEUP_SOCKETPAIR_AF, SOCK_STREAM, 0, web->wakeup_fds) == -1)
+    tr_logAddNamedError ("web", "Unable to create wakeup socketpair: %s", tr_strerror (errno));
+  evutil_make_socket_nonblocking (web->wakeup_fds[0]);
+  evutil_make_socket_nonblocking (web->wakeup_fds[1]);
+  web->wakeup_event = event_new (web->base, web->wakeup_fds[0], EV_READ | EV_PERSIST, onWakeup, web);
+  event_add (web->wakeup_event, NULL);
+  web->timer_event = evtimer_new (web->base, onTimer, web);
+  web->pause_event = evtimer_new (web->base, onPauseTimer, web);
+
+  web->share = curl_share_init ();
+  curl_share_setopt (web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt (web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt (web->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+
+  web->multi = curl_multi_init ();
+  curl_multi_setopt (web->multi, CURLMOPT_SOCKETFUNCTION, onCurlSocket);
+  curl_multi_setopt (web->multi, CURLMOPT_SOCKETDATA, web);
+  curl_multi_setopt (web->multi, CURLMOPT_TIMERFUNCTION, onCurlTimer);
+  curl_multi_setopt (web->multi, CURLMOPT_TIMERDATA, web);
+  curl_multi_setopt (web->multi, CURLMOPT_MAXCONNECTS, (long)MAX_CACHED_CONNECTIONS);
+#ifdef USE_LIBCURL_MULTIPLEX
+  curl_multi_setopt (web->multi, CURLMOPT_PIPELINING, (long)CURLPIPE_MULTIPLEX);
+#endif
 
-      /* maybe wait a little while before calling curl_multi_perform () */
-      msec = 0;
-      curl_multi_timeout (multi, &msec);
-      if (msec < 0)
-        msec = THREADFUNC_MAX_SLEEP_MSEC;
-      if (session->isClosed)
-        msec = 100; /* on shutdown, call perform () more frequently */
-      if (msec > 0)
-        {
-          int usec;
-          int max_fd;
-          struct timeval t;
-          fd_set r_fd_set, w_fd_set, c_fd_set;
-
-          max_fd = 0;
-          FD_ZERO (&r_fd_set);
-          FD_ZERO (&w_fd_set);
-          FD_ZERO (&c_fd_set);
-          curl_multi_fdset (multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd);
-
-          if (msec > THREADFUNC_MAX_SLEEP_MSEC)
-            msec = THREADFUNC_MAX_SLEEP_MSEC;
-
-          usec = msec * 1000;
-          t.tv_sec =  usec / 1000000;
-          t.tv_usec = usec % 1000000;
-          tr_select (max_fd+1, &r_fd_set, &w_fd_set, &c_fd_set, &t);
-        }
+  session->web = web;
 
-      /* call curl_multi_perform () */
-      do
-        mcode = curl_multi_perform (multi, &unused);
-      while (mcode == CURLM_CALL_MULTI_PERFORM);
+  /* pick up anything that was queued while we were starting up */
+  webWakeup (web);
 
-      /* pump completed tasks from the multi */
-      while ((msg = curl_multi_info_read (multi, &unused)))
-        {
-          if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
-            {
-              double total_time;
-              struct tr_web_task * task;
-              long req_bytes_sent;
-              CURL * e = msg->easy_handle;
-              curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
-              assert (e == task->curl_easy);
-              curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
-              curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
-              curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
-              task->did_connect = task->code>0 || req_bytes_sent>0;
-              task->did_timeout = !task->code && (total_time >= task->timeout_secs);
-              curl_multi_remove_handle (multi, e);
-              tr_list_remove_data (&paused_easy_handles, e);
-              curl_easy_cleanup (e);
-              tr_runInEventThread (task->session, task_finish_func, task);
-              --taskCount;
-            }
-        }
-    }
+  event_base_dispatch (web->base);
 
   /* Discard any remaining tasks.
    * This is rare, but can happen on shutdown with unresponsive trackers. */
@@ -516,10 +834,25 @@ tr_webThreadFunc (void * vsession)
       dbgmsg ("Discarding task \"%s\"", task->url);
       task_free (task);
     }
+  while ((task = tr_list_pop_front (&web->running)) != NULL)
+    {
+      dbgmsg ("Discarding task \"%s\"", task->url);
+      curl_multi_remove_handle (web->multi, task->curl_easy);
+      curl_easy_cleanup (task->curl_easy);
+      task_free (task);
+    }
 
   /* cleanup */
   tr_list_free (&paused_easy_handles, NULL);
-  curl_multi_cleanup (multi);
+  tr_list_free (&web->idle_easy, (TrListForeachFunc)curl_easy_cleanup);
+  curl_multi_cleanup (web->multi);
+  curl_share_cleanup (web->share);
+  event_free (web->pause_event);
+  event_free (web->timer_event);
+  event_free (web->wakeup_event);
+  event_base_free (web->base);
+  evutil_closesocket (web->wakeup_fds[0]);
+  evutil_closesocket (web->wakeup_fds[1]);
   tr_lockFree (web->taskLock);
   tr_free (web->curl_ca_bundle);
   tr_free (web->cookie_filename);
@@ -534,6 +867,7 @@ tr_webClose (tr_session * session, tr_web_close_mode close_mode)
   if (session->web != NULL)
     {
       session->web->close_mode = close_mode;
+      webWakeup (session->web);
 
       if (close_mode == TR_WEB_CLOSE_NOW)
         while (session->web != NULL)
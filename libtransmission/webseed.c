@@ -38,6 +38,8 @@ struct tr_webseed_task
   uint32_t             block_size;
   struct tr_web_task * web_task;
   long                 response_code;
+  uint64_t             started_msec;
+  uint64_t             first_byte_msec;
 };
 
 struct tr_webseed
@@ -58,6 +60,12 @@ struct tr_webseed
   int                  idle_connections;
   int                  active_transfers;
   char              ** file_urls;
+
+  /* tuned from how this mirror has been performing */
+  int                  max_connections;
+  int                  pieces_per_request;
+  uint64_t             rtt_msec;
+  uint64_t             connection_Bps;
 };
 
 enum
@@ -68,7 +76,24 @@ enum
 
   MAX_CONSECUTIVE_FAILURES = 5,
 
-  MAX_WEBSEED_CONNECTIONS = 4
+  /* how many ranges we fetch from a mirror in parallel.
+     We start in the middle and adjust from there. */
+  MIN_WEBSEED_CONNECTIONS = 1,
+  INITIAL_WEBSEED_CONNECTIONS = 4,
+  MAX_WEBSEED_CONNECTIONS = 8,
+
+  /* the most pieces a single range request may cover.
+     We start in the middle and adjust from there. */
+  INITIAL_PIECES_PER_REQUEST = 4,
+  MAX_PIECES_PER_REQUEST = 16,
+
+  /* size ranges so that each one takes at least this long to transfer,
+     or eight round-trips, whichever is longer */
+  TARGET_REQUEST_MSEC = 3000,
+
+  /* a mirror is only steered endgame blocks if its download speed is
+     at least this percentage of the fastest mirror's */
+  ENDGAME_SPEED_PERCENT = 75
 };
 
 /***
@@ -91,13 +116,10 @@ fire_client_got_rejs (tr_torrent        * tor,
   tr_block_index_t i;
   tr_peer_event e = TR_PEER_EVENT_INIT;
   e.eventType = TR_PEER_CLIENT_GOT_REJ;
-  tr_torrentGetBlockLocation (tor, block, &e.pieceIndex, &e.offset, &e.length);
-  for (i = 1; i <= count; i++)
+  for (i=0; i<count; ++i)
     {
-      if (i == count)
-        e.length = tr_torBlockCountBytes (tor, block + count - 1);
+      tr_torrentGetBlockLocation (tor, block + i, &e.pieceIndex, &e.offset, &e.length);
       publish (w, &e);
-      e.offset += e.length;
     }
 }
 
@@ -110,13 +132,10 @@ fire_client_got_blocks (tr_torrent        * tor,
   tr_block_index_t i;
   tr_peer_event e = TR_PEER_EVENT_INIT;
   e.eventType = TR_PEER_CLIENT_GOT_BLOCK;
-  tr_torrentGetBlockLocation (tor, block, &e.pieceIndex, &e.offset, &e.length);
-  for (i = 1; i <= count; i++)
+  for (i=0; i<count; ++i)
     {
-      if (i == count)
-        e.length = tr_torBlockCountBytes (tor, block + count - 1);
+      tr_torrentGetBlockLocation (tor, block + i, &e.pieceIndex, &e.offset, &e.length);
       publish (w, &e);
-      e.offset += e.length;
     }
 }
 
@@ -139,10 +158,8 @@ struct write_block_data
   int                  torrent_id;
   struct tr_webseed  * webseed;
   struct evbuffer    * content;
-  tr_piece_index_t     piece_index;
   tr_block_index_t     block_index;
   tr_block_index_t     count;
-  uint32_t             block_offset;
 };
 
 static void
@@ -156,17 +173,18 @@ write_block_func (void * vdata)
   tor = tr_torrentFindFromId (data->session, data->torrent_id);
   if (tor != NULL)
     {
-      const uint32_t block_size = tor->blockSize;
-      uint32_t len = evbuffer_get_length (buf);
-      const uint32_t offset_end = data->block_offset + len;
+      tr_block_index_t i;
       tr_cache * cache = data->session->cache;
-      const tr_piece_index_t piece = data->piece_index;
 
-      while (len > 0)
+      /* a request can span several pieces, so locate each block on its own */
+      for (i=0; i<data->count; ++i)
         {
-          const uint32_t bytes_this_pass = MIN (len, block_size);
-          tr_cacheWriteBlock (cache, tor, piece, offset_end - len, bytes_this_pass, buf);
-          len -= bytes_this_pass;
+          tr_piece_index_t piece;
+          uint32_t offset;
+          uint32_t length;
+
+          tr_torrentGetBlockLocation (tor, data->block_index + i, &piece, &offset, &length);
+          tr_cacheWriteBlock (cache, tor, piece, offset, length, buf);
         }
 
       fire_client_got_blocks (tor, w, data->block_index, data->count);
@@ -235,6 +253,9 @@ on_content_changed (struct evbuffer                * buf,
       uint32_t len;
       struct tr_webseed * w = task->webseed;
 
+      if (!task->first_byte_msec)
+        task->first_byte_msec = tr_time_msec ();
+
       tr_bandwidthUsed (&w->bandwidth, TR_DOWN, n_added, true, tr_time_msec ());
       fire_client_got_piece_data (w, n_added);
       len = evbuffer_get_length (buf);
@@ -273,10 +294,8 @@ on_content_changed (struct evbuffer                * buf,
 
           data = tr_new (struct write_block_data, 1);
           data->webseed = task->webseed;
-          data->piece_index = task->piece_index;
           data->block_index = task->block + task->blocks_done;
           data->count = completed;
-          data->block_offset = task->piece_offset + task->blocks_done * block_size;
           data->content = evbuffer_new ();
           data->torrent_id = w->torrent_id;
           data->session = w->session;
@@ -296,6 +315,125 @@ on_content_changed (struct evbuffer                * buf,
 
 static void task_request_next_chunk (struct tr_webseed_task * task);
 
+static bool
+is_fast_enough_for_endgame (const tr_torrent * tor, const tr_webseed * w)
+{
+  unsigned int i;
+  double fastest = 0;
+  double * speeds = tr_peerMgrWebSpeeds_KBps (tor);
+  const double mine = toSpeedKBps (tr_bandwidthGetPieceSpeed_Bps (&w->bandwidth, tr_time_msec (), TR_DOWN));
+
+  for (i=0; i<tor->info.webseedCount; ++i)
+    fastest = MAX (fastest, speeds[i]);
+
+  tr_free (speeds);
+  return mine * 100 >= fastest * ENDGAME_SPEED_PERCENT;
+}
+
+/* Fold what we learned from a finished range into the mirror's tuning.
+   Ranges are sized so that request overhead is small next to transfer time.
+   If round-trips still dominate, we open another connection. If a
+   connection runs at less than half the usual speed, the mirror is
+   saturated, so we drop one. */
+static void
+on_task_finished (tr_torrent                    * tor,
+                  tr_webseed                    * w,
+                  const struct tr_webseed_task  * t,
+                  uint32_t                        bytes)
+{
+  uint64_t Bps;
+  uint64_t rtt;
+  uint64_t target_msec;
+  uint64_t transfer_msec;
+  int pieces;
+  const uint64_t now = tr_time_msec ();
+  const uint64_t first_byte = t->first_byte_msec ? t->first_byte_msec : now;
+  const uint64_t prev_Bps = w->connection_Bps;
+
+  if (!t->started_msec || (first_byte < t->started_msec))
+    return;
+
+  rtt = first_byte - t->started_msec;
+  transfer_msec = MAX (now - first_byte, 1);
+  Bps = (bytes * (uint64_t)1000) / transfer_msec;
+
+  w->rtt_msec = w->rtt_msec ? (w->rtt_msec * 7 + rtt) / 8 : rtt;
+  w->connection_Bps = prev_Bps ? (prev_Bps * 7 + Bps) / 8 : Bps;
+
+  target_msec = MAX ((uint64_t)TARGET_REQUEST_MSEC, w->rtt_msec * 8);
+  pieces = (w->connection_Bps * target_msec / 1000) / tor->info.pieceSize;
+  w->pieces_per_request = MAX (1, MIN (pieces, MAX_PIECES_PER_REQUEST));
+
+  if (prev_Bps && (Bps * 2 < prev_Bps))
+    w->max_connections = MAX (w->max_connections - 1, MIN_WEBSEED_CONNECTIONS);
+  else if (rtt * 4 > transfer_msec)
+    w->max_connections = MIN (w->max_connections + 1, MAX_WEBSEED_CONNECTIONS);
+}
+
+/* Fold the block spans in `blocks' into at most `max_spans' larger ones.
+   The spans are in priority order, so the first `max_spans' distinct ones
+   anchor the requests and later ones are kept only if they sit right next
+   to an anchor. The rest are handed back to the peer manager.
+   Returns the number of spans left at the front of `blocks'. */
+static int
+merge_spans (tr_torrent        * tor,
+             tr_webseed        * w,
+             tr_block_index_t  * blocks,
+             int                 count,
+             int                 max_spans)
+{
+  int i;
+  int j;
+  const int n = MIN (count, max_spans);
+  const tr_block_index_t max_blocks = (tor->info.pieceSize / tor->blockSize) * w->pieces_per_request;
+  bool merged = true;
+  bool * used = tr_new0 (bool, count);
+
+  for (i=0; i<n; ++i)
+    used[i] = true;
+
+  /* keep sweeping until nothing else fits, since growing one span
+     can make it touch a leftover that didn't touch it before */
+  while (merged)
+    {
+      merged = false;
+
+      for (i=n; i<count; ++i)
+        {
+          const tr_block_index_t b = blocks[i*2];
+          const tr_block_index_t be = blocks[i*2+1];
+
+          if (used[i])
+            continue;
+
+          for (j=0; j<n; ++j)
+            {
+              tr_block_index_t * span = blocks + j*2;
+
+              if (span[1] - span[0] + 1 + (be - b + 1) > max_blocks)
+                continue;
+
+              if (span[1] + 1 == b)
+                span[1] = be;
+              else if (be + 1 == span[0])
+                span[0] = b;
+              else
+                continue;
+
+              used[i] = merged = true;
+              break;
+            }
+        }
+    }
+
+  for (i=n; i<count; ++i)
+    if (!used[i])
+      fire_client_got_rejs (tor, w, blocks[i*2], blocks[i*2+1] - blocks[i*2] + 1);
+
+  tr_free (used);
+  return n;
+}
+
 static void
 on_idle (tr_webseed * w)
 {
@@ -317,24 +455,32 @@ on_idle (tr_webseed * w)
     }
   else
     {
-      want = MAX_WEBSEED_CONNECTIONS - running_tasks;
+      want = w->max_connections - running_tasks;
       w->retry_challenge = running_tasks + w->idle_connections + 1;
     }
 
+  /* in the endgame, leave the remaining blocks to the fastest mirror */
+  if (tor && (want > 0) && tr_peerMgrIsEndgame (tor) && !is_fast_enough_for_endgame (tor, w))
+    want = 0;
+
   if (tor && tor->isRunning && !tr_torrentIsSeed (tor) && (want > 0))
     {
       int i;
       int got = 0;
+      int span_count = 0;
       tr_block_index_t * blocks = NULL;
 
-      blocks = tr_new (tr_block_index_t, want*2);
-      tr_peerMgrGetNextRequests (tor, &w->parent, want, blocks, &got, true);
+      /* ask for a span per piece we'd like in each request,
+         so that neighbouring ones can be folded together */
+      blocks = tr_new (tr_block_index_t, want*w->pieces_per_request*2);
+      tr_peerMgrGetNextRequests (tor, &w->parent, want*w->pieces_per_request, blocks, &got, true);
+      span_count = merge_spans (tor, w, blocks, got, want);
 
-      w->idle_connections -= MIN (w->idle_connections, got);
-      if (w->retry_tickcount >= FAILURE_RETRY_INTERVAL && got == want)
+      w->idle_connections -= MIN (w->idle_connections, span_count);
+      if (w->retry_tickcount >= FAILURE_RETRY_INTERVAL && span_count == want)
         w->retry_tickcount = 0;
 
-      for (i=0; i<got; ++i)
+      for (i=0; i<span_count; ++i)
         {
           const tr_block_index_t b = blocks[i*2];
           const tr_block_index_t be = blocks[i*2+1];
@@ -395,6 +541,9 @@ web_response_func (tr_session    * session,
           const tr_block_index_t blocks_remain = (t->length + tor->blockSize - 1)
                                                    / tor->blockSize - t->blocks_done;
 
+          /* back off hard: the mirror is struggling or refusing us */
+          w->max_connections = MAX (w->max_connections / 2, MIN_WEBSEED_CONNECTIONS);
+
           if (blocks_remain)
             fire_client_got_rejs (tor, w, t->block + t->blocks_done, blocks_remain);
 
@@ -424,17 +573,23 @@ web_response_func (tr_session    * session,
             {
               if (buf_len)
                 {
+                  tr_piece_index_t piece;
+                  uint32_t offset;
+                  uint32_t length;
+
                   /* on_content_changed () will not write a block if it is smaller than
                      the torrent's block size, i.e. the torrent's very last block */
+                  tr_torrentGetBlockLocation (tor, t->block + t->blocks_done,
+                                              &piece, &offset, &length);
                   tr_cacheWriteBlock (session->cache, tor,
-                                      t->piece_index, t->piece_offset + bytes_done,
-                                      buf_len, t->content);
+                                      piece, offset, buf_len, t->content);
 
                   fire_client_got_blocks (tor, t->webseed,
                                           t->block + t->blocks_done, 1);
                 }
 
               ++w->idle_connections;
+              on_task_finished (tor, w, t, t->length);
 
               tr_list_remove_data (&w->tasks, t);
               evbuffer_free (t->content);
@@ -493,11 +648,19 @@ task_request_next_chunk (struct tr_webseed_task * t)
       if (!urls[file_index])
         urls[file_index] = evbuffer_free_to_str (make_url (t->webseed, file));
 
+      if (!t->started_msec)
+        t->started_msec = tr_time_msec ();
+
       tr_snprintf (range, sizeof range, "%"PRIu64"-%"PRIu64,
                    file_offset, file_offset + this_pass - 1);
 
+      /* the web thread may start writing into t->content right away,
+         and on_content_changed () needs t->web_task, so hold the
+         session lock until it's set */
+      tr_sessionLock (tor->session);
       t->web_task = tr_webRunWebseed (tor, urls[file_index], range,
                                       web_response_func, t, t->content);
+      tr_sessionUnlock (tor->session);
     }
 }
 
@@ -613,6 +776,8 @@ tr_webseedNew (struct tr_torrent  * tor,
   w->callback = callback;
   w->callback_data = callback_data;
   w->file_urls = tr_new0 (char *, inf->fileCount);
+  w->max_connections = INITIAL_WEBSEED_CONNECTIONS;
+  w->pieces_per_request = INITIAL_PIECES_PER_REQUEST;
   //tr_rcConstruct (&w->download_rate);
   tr_bandwidthConstruct (&w->bandwidth, tor->session, &tor->bandwidth);
   w->timer = evtimer_new (w->session->event_base, webseed_timer_func, w);
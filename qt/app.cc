@@ -184,7 +184,7 @@ MyApp :: MyApp (int& argc, char ** argv):
   mySession->refreshSessionStats ();
 
   // when torrents are added to the watch directory, tell the session
-  connect (myWatchDir, SIGNAL (torrentFileAdded (QString)), this, SLOT (addTorrent (QString)));
+  connect (myWatchDir, SIGNAL (torrentFilesAdded (QStringList)), this, SLOT (addTorrents (QStringList)));
 
   // init from preferences
   QList<int> initKeys;
@@ -406,9 +406,10 @@ MyApp :: refreshTorrents ()
 {
   // usually we just poll the torrents that have shown recent activity,
   // but we also periodically ask for updates on the others to ensure
-  // nothing's falling through the cracks.
+  // nothing's falling through the cracks. Servers that can send just
+  // what's changed since the last poll don't need the full refresh.
   const time_t now = time (NULL);
-  if (myLastFullUpdateTime + 60 >= now)
+  if (mySession->hasTorrentRevisions () || (myLastFullUpdateTime + 60 >= now))
     {
       mySession->refreshActiveTorrents ();
     }
@@ -432,6 +433,28 @@ MyApp :: addTorrent (const QString& key)
     addTorrent (addme);
 }
 
+void
+MyApp :: addTorrents (const QStringList& keys)
+{
+  if (myPrefs->getBool (Prefs :: OPTIONS_PROMPT))
+    {
+      foreach (const QString& key, keys)
+        addTorrent (key);
+      return;
+    }
+
+  QList<AddData> adds;
+  foreach (const QString& key, keys)
+    {
+      const AddData addme (key);
+      if (addme.type != addme.NONE)
+        adds << addme;
+    }
+
+  mySession->addTorrents (adds);
+  raise ();
+}
+
 void
 MyApp :: addTorrent (const AddData& addme)
 {
@@ -12,6 +12,7 @@
 
 #include <QApplication>
 #include <QSet>
+#include <QStringList>
 #include <QTimer>
 #include <QTranslator>
 
@@ -64,6 +65,7 @@ class MyApp: public QApplication
   public slots:
     void addTorrent (const QString&);
     void addTorrent (const AddData&);
+    void addTorrents (const QStringList&);
 
   private:
     void maybeUpdateBlocklist ();
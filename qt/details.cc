@@ -110,7 +110,16 @@ class PeerItem: public QTreeWidgetItem
 
   public:
 
-    void refresh (const Peer& p) { peer = p; }
+    // returns true if anything shown in the row has changed
+    bool refresh (const Peer& p)
+    {
+      const bool changed = p.rateToPeer.Bps () != peer.rateToPeer.Bps ()
+                        || p.rateToClient.Bps () != peer.rateToClient.Bps ()
+                        || p.progress != peer.progress
+                        || p.flagStr != peer.flagStr;
+      peer = p;
+      return changed;
+    }
 
     void setStatus (const QString& s) { status = s; }
 
@@ -840,7 +849,7 @@ Details :: refresh ()
 
       foreach (const Peer& peer, peers)
         {
-          const QString key = idStr + ":" + peer.address;
+          const QString key = idStr + ":" + (peer.id >= 0 ? QString::number (peer.id) : peer.address);
           PeerItem * item = (PeerItem*) myPeers.value (key, 0);
 
           if (item == 0) // new peer has connected
@@ -857,10 +866,14 @@ Details :: refresh ()
               item->setText (COL_CLIENT, peer.clientName);
               newItems << item;
             }
+          else if (!item->refresh (peer)) // nothing to redraw
+            {
+              peers2.insert (key, item);
+              continue;
+            }
 
           const QString code = peer.flagStr;
           item->setStatus (code);
-          item->refresh (peer);
 
           QString codeTip;
           foreach (QChar ch, code)
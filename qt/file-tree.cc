@@ -416,7 +416,8 @@ FileTreeItem :: isComplete () const
 FileTreeModel :: FileTreeModel (QObject *parent, bool isEditable):
   QAbstractItemModel(parent),
   myRootItem (new FileTreeItem),
-  myIsEditable (isEditable)
+  myIsEditable (isEditable),
+  myIsResetting (false)
 {
 }
 
@@ -592,30 +593,20 @@ FileTreeModel :: clearSubtree (const QModelIndex& top)
 void
 FileTreeModel :: clear ()
 {
-  beginResetModel ();
+  if (!myIsResetting)
+    beginResetModel ();
   clearSubtree (QModelIndex());
+  myIndexCache.clear ();
+  myFilenames.clear ();
+  myPendingChanges.clear ();
+  myIsResetting = false;
   endResetModel ();
 }
 
 FileTreeItem *
 FileTreeModel :: findItemForFileIndex (int fileIndex) const
 {
-  FileTreeItem * ret = 0;
-
-  QModelIndexList indices = match (index (0,COL_FILE_INDEX),
-                                   Qt::DisplayRole,
-                                   fileIndex,
-                                   1,
-                                   Qt::MatchFlags (Qt::MatchExactly | Qt::MatchRecursive));
-
-  if (!indices.isEmpty ())
-    {
-      QModelIndex& index = indices.front ();
-      if (index.isValid())
-        ret = itemFromIndex (index);
-    }
-
-  return ret;
+  return myIndexCache.value (fileIndex, 0);
 }
 
 void
@@ -630,24 +621,44 @@ FileTreeModel :: addFile (int                   fileIndex,
 {
   bool added = false;
   FileTreeItem * item;
-  QStringList tokens = filename.split (QChar::fromLatin1('/'));
 
   item = findItemForFileIndex (fileIndex);
 
   if (item) // this file is already in the tree, we've added this 
     {
-      while (!tokens.isEmpty())
+      // the path only needs walking if a file or folder has been renamed
+      if (myFilenames.value (fileIndex) == filename)
         {
-          const QString token = tokens.takeLast();
-          const std::pair<int,int> changed = item->update (token, wanted, priority, have, updateFields);
+          const std::pair<int,int> changed = item->update (item->name(), wanted, priority, have, updateFields);
           if (changed.first >= 0)
-            dataChanged (indexOf (item, changed.first), indexOf (item, changed.second));
-          item = item->parent();
+            markChanged (item, changed);
+        }
+      else
+        {
+          QStringList tokens = filename.split (QChar::fromLatin1('/'));
+          while (!tokens.isEmpty())
+            {
+              const QString token = tokens.takeLast();
+              const std::pair<int,int> changed = item->update (token, wanted, priority, have, updateFields);
+              if (changed.first >= 0)
+                markChanged (item, changed);
+              item = item->parent();
+            }
+          assert (item == myRootItem);
+          myFilenames.insert (fileIndex, filename);
         }
-      assert (item == myRootItem);
     }
   else // we haven't build the FileTreeItems for these tokens yet
     {
+      QStringList tokens = filename.split (QChar::fromLatin1('/'));
+
+      // building a whole tree row by row is slow, so announce it all at once
+      if (myIndexCache.isEmpty() && !myIsResetting)
+        {
+          beginResetModel ();
+          myIsResetting = true;
+        }
+
       item = myRootItem;
       while (!tokens.isEmpty())
         {
@@ -659,13 +670,15 @@ FileTreeModel :: addFile (int                   fileIndex,
               QModelIndex parentIndex (indexOf(item, 0));
               const int n (item->childCount());
 
-              beginInsertRows (parentIndex, n, n);
+              if (!myIsResetting)
+                beginInsertRows (parentIndex, n, n);
               if (tokens.isEmpty())
                 child = new FileTreeItem (token, fileIndex, totalSize);
               else
                 child = new FileTreeItem (token);
               item->appendChild (child);
-              endInsertRows ();
+              if (!myIsResetting)
+                endInsertRows ();
 
               rowsAdded.append (indexOf(child, 0));
             }
@@ -677,13 +690,97 @@ FileTreeModel :: addFile (int                   fileIndex,
           assert (item->fileIndex() == fileIndex);
           assert (item->totalSize() == totalSize);
 
+          myIndexCache.insert (fileIndex, item);
+          myFilenames.insert (fileIndex, filename);
+
           const std::pair<int,int> changed = item->update (item->name(), wanted, priority, have, added || updateFields);
           if (changed.first >= 0)
-            dataChanged (indexOf (item, changed.first), indexOf (item, changed.second));
+            markChanged (item, changed);
         }
     }
 }
 
+void
+FileTreeModel :: markChanged (FileTreeItem * item, const std::pair<int,int>& columns)
+{
+  std::pair<int,int> range (columns);
+
+  if (myIsResetting)
+    return;
+
+  // a file's progress, size, wanted and priority are summed up in its folders
+  while (item && item != myRootItem)
+    {
+      QHash<FileTreeItem*,std::pair<int,int> >::iterator it = myPendingChanges.find (item);
+
+      if (it == myPendingChanges.end())
+        {
+          myPendingChanges.insert (item, range);
+        }
+      else if (it->first <= range.first && range.second <= it->second)
+        {
+          break; // this item and its folders are already marked
+        }
+      else
+        {
+          it->first = std::min (it->first, range.first);
+          it->second = std::max (it->second, range.second);
+        }
+
+      if (range.second < COL_SIZE)
+        break;
+
+      range.first = std::max (range.first, int(COL_SIZE));
+      item = item->parent();
+    }
+}
+
+void
+FileTreeModel :: emitPendingChanges ()
+{
+  if (myIsResetting)
+    {
+      myIsResetting = false;
+      myPendingChanges.clear ();
+      endResetModel ();
+      return;
+    }
+
+  // emit one dataChanged() per folder, spanning all of its changed children
+  typedef QHash<FileTreeItem*, std::pair<std::pair<int,int>,std::pair<int,int> > > spans_t;
+  spans_t spans;
+
+  for (QHash<FileTreeItem*,std::pair<int,int> >::const_iterator it (myPendingChanges.constBegin()), end (myPendingChanges.constEnd()); it != end; ++it)
+    {
+      const int row = it.key()->row();
+      spans_t::iterator span = spans.find (it.key()->parent());
+
+      if (span == spans.end())
+        {
+          spans.insert (it.key()->parent(), std::make_pair (std::make_pair (row, row), it.value()));
+        }
+      else
+        {
+          span->first.first = std::min (span->first.first, row);
+          span->first.second = std::max (span->first.second, row);
+          span->second.first = std::min (span->second.first, it.value().first);
+          span->second.second = std::max (span->second.second, it.value().second);
+        }
+    }
+
+  myPendingChanges.clear ();
+
+  for (spans_t::const_iterator it (spans.constBegin()), end (spans.constEnd()); it != end; ++it)
+    {
+      FileTreeItem * parent = it.key();
+      const std::pair<int,int>& rows = it.value().first;
+      const std::pair<int,int>& columns = it.value().second;
+
+      dataChanged (createIndex (rows.first, columns.first, parent->child (rows.first)),
+                   createIndex (rows.second, columns.second, parent->child (rows.second)));
+    }
+}
+
 void
 FileTreeModel :: parentsChanged (const QModelIndex& index, int column)
 {
@@ -992,13 +1089,15 @@ FileTreeView :: eventFilter (QObject * o, QEvent * event)
 void
 FileTreeView :: update (const FileList& files, bool updateFields)
 {
-  foreach (const TrFile file, files)
-    {
-      QList<QModelIndex> added;
-      myModel.addFile (file.index, file.filename, file.wanted, file.priority, file.size, file.have, added, updateFields);
-      foreach (QModelIndex i, added)
-        expand (myProxy->mapFromSource(i));
-    }
+  QList<QModelIndex> added;
+
+  foreach (const TrFile& file, files)
+    myModel.addFile (file.index, file.filename, file.wanted, file.priority, file.size, file.have, added, updateFields);
+
+  myModel.emitPendingChanges ();
+
+  foreach (const QModelIndex& i, added)
+    expand (myProxy->mapFromSource(i));
 }
 
 void
@@ -123,12 +123,14 @@ class FileTreeModel: public QAbstractItemModel
                   uint64_t size, uint64_t have,
                   QList<QModelIndex>& rowsAdded,
                   bool torrentChanged);
+    void emitPendingChanges ();
 
   private:
     void clearSubtree (const QModelIndex &);
     QModelIndex indexOf (FileTreeItem *, int column) const;
     void parentsChanged (const QModelIndex &, int column);
     void subtreeChanged (const QModelIndex &, int column);
+    void markChanged (FileTreeItem *, const std::pair<int,int>& columns);
     FileTreeItem * findItemForFileIndex (int fileIndex) const;
     FileTreeItem * itemFromIndex (const QModelIndex&) const;
 
@@ -136,6 +138,14 @@ class FileTreeModel: public QAbstractItemModel
     FileTreeItem * myRootItem;
     const bool myIsEditable;
 
+    // the file items by file index, and the filename each was last given
+    QHash<int,FileTreeItem*> myIndexCache;
+    QHash<int,QString> myFilenames;
+
+    // the items changed since the last emitPendingChanges()
+    QHash<FileTreeItem*,std::pair<int,int> > myPendingChanges;
+    bool myIsResetting;
+
   public slots:
     void clicked (const QModelIndex & index);
     void doubleClicked (const QModelIndex & index);
@@ -12,6 +12,7 @@
 #include <QLabel>
 #include <QHBoxLayout>
 #include <QLineEdit>
+#include <QSet>
 #include <QStylePainter>
 #include <QString>
 #include <QtGui>
@@ -22,6 +23,7 @@
 #include "filterbar.h"
 #include "hig.h"
 #include "prefs.h"
+#include "torrent.h"
 #include "torrent-filter.h"
 #include "torrent-model.h"
 #include "utils.h"
@@ -296,100 +298,164 @@ namespace
       name[0] = name[0].toUpper ();
     return name;
   }
+
+  void setCount (QStandardItem * item, int count, const QString& countString)
+  {
+    const QVariant old (item->data (TorrentCountRole));
+
+    if (!old.isValid () || old.toInt () != count)
+      {
+        item->setData (count, TorrentCountRole);
+        item->setData (countString, TorrentCountStringRole);
+      }
+  }
 }
 
 void
-FilterBar :: refreshTrackers ()
+FilterBar :: addCounts (const TorrentCounts& counts, int delta)
 {
-  Favicons& favicons = dynamic_cast<MyApp*> (QApplication::instance ())->favicons;
-  const int firstTrackerRow = 2; // skip over the "All" and separator...
+  for (int mode=0; mode<FilterMode::NUM_MODES; ++mode)
+    if (counts.modes & (1<<mode))
+      myTorrentsPerMode[mode] += delta;
 
-  // pull info from the tracker model...
-  QSet<QString> oldHosts;
-  for (int row=firstTrackerRow; ; ++row)
+  // count the torrent once per readable name, even if several of its hosts share one
+  QSet<QString> names;
+  foreach (QString host, counts.hosts)
     {
-      QModelIndex index = myTrackerModel->index (row, 0);
-      if (!index.isValid ())
-        break;
-      oldHosts << index.data (TrackerRole).toString ();
-    }
+      const QString name = readableHostName (host);
+      if (names.contains (name))
+        continue;
+      names.insert (name);
 
-  // pull the new stats from the torrent model...
-  QSet<QString> newHosts;
-  QMap<QString,int> torrentsPerHost;
-  for (int row=0; ; ++row)
-    {
-      QModelIndex index = myTorrents.index (row, 0);
-      if (!index.isValid ())
-        break;
-      const Torrent * tor = index.data (TorrentModel::TorrentRole).value<const Torrent*> ();
-      QSet<QString> torrentNames;
-      foreach (QString host, tor->hosts ())
+      int& n = myTorrentsPerName[name];
+      n += delta;
+      if (n <= 0)
         {
-          newHosts.insert (host);
-          torrentNames.insert (readableHostName (host));
+          myTorrentsPerName.remove (name);
+          myHostForName.remove (name);
+        }
+      else if (!myHostForName.contains (name))
+        {
+          myHostForName.insert (name, host);
         }
-      foreach (QString name, torrentNames)
-        ++torrentsPerHost[name];
     }
+}
 
-  // update the "All" row
-  myTrackerModel->setData (myTrackerModel->index (0,0), myTorrents.rowCount (), TorrentCountRole);
-  myTrackerModel->setData (myTrackerModel->index (0,0), getCountString (myTorrents.rowCount ()), TorrentCountStringRole);
-
-  // rows to update
-  foreach (QString host, oldHosts & newHosts)
+// returns true if the torrent's contribution to the counts changed
+bool
+FilterBar :: updateCounts (const Torrent * tor)
+{
+  TorrentCounts& counts (myTorrentCounts[tor->id ()]);
+  if (counts.revision == tor->revision ())
+    return false;
+
+  TorrentCounts next;
+  next.revision = tor->revision ();
+  next.hosts = tor->hosts ();
+  for (int mode=0; mode<FilterMode::NUM_MODES; ++mode)
+    if (myFilter.activityFilterAcceptsTorrent (tor, mode))
+      next.modes |= (1<<mode);
+
+  const bool changed = counts.modes != next.modes || counts.hosts != next.hosts;
+  if (changed)
     {
-      const QString name = readableHostName (host);
-      QStandardItem * row = myTrackerModel->findItems (name).front ();
-      const int count = torrentsPerHost[name];
-      row->setData (count, TorrentCountRole);
-      row->setData (getCountString (count), TorrentCountStringRole);
-      row->setData (favicons.findFromHost (host), Qt::DecorationRole);
+      addCounts (counts, -1);
+      addCounts (next, 1);
     }
 
-  // rows to remove
-  foreach (QString host, oldHosts - newHosts)
+  counts = next;
+  return changed;
+}
+
+bool
+FilterBar :: updateCounts (int firstRow, int lastRow)
+{
+  bool changed = false;
+
+  for (int row=firstRow; row<=lastRow; ++row)
     {
-      const QString name = readableHostName (host);
-      QStandardItem * item = myTrackerModel->findItems (name).front ();
-      if (!item->data (TrackerRole).toString ().isEmpty ()) // don't remove "All"
-        myTrackerModel->removeRows (item->row (), 1);
+      const Torrent * tor = myTorrents.index (row, 0).data (TorrentModel::TorrentRole).value<const Torrent*> ();
+      if (tor != 0)
+        changed |= updateCounts (tor);
     }
 
-  // rows to add
+  return changed;
+}
+
+void
+FilterBar :: rebuildCounts ()
+{
+  myTorrentCounts.clear ();
+  myTorrentsPerMode.fill (0, FilterMode::NUM_MODES);
+  myTorrentsPerName.clear ();
+  myHostForName.clear ();
+
+  updateCounts (0, myTorrents.rowCount () - 1);
+}
+
+void
+FilterBar :: refreshTrackers ()
+{
+  Favicons& favicons = dynamic_cast<MyApp*> (QApplication::instance ())->favicons;
+  const int firstTrackerRow = 2; // skip over the "All" and separator...
+
+  // update the "All" row
+  setCount (myTrackerModel->item (0), myTorrents.rowCount (), getCountString (myTorrents.rowCount ()));
+
+  // both the rows and the counts are sorted by name, so walk them together
   bool anyAdded = false;
-  foreach (QString host, newHosts - oldHosts)
+  int row = firstTrackerRow;
+  QMap<QString,int>::const_iterator it = myTorrentsPerName.constBegin ();
+  for (;;)
     {
-      const QString name = readableHostName (host);
+      const bool newNamesDone = it == myTorrentsPerName.constEnd ();
+      const bool oldNamesDone = row >= myTrackerModel->rowCount ();
+      int cmp;
 
-      if (!myTrackerModel->findItems (name).isEmpty ())
-        continue;
+      if (newNamesDone && oldNamesDone)
+        break;
 
-      // find the sorted position to add this row
-      int i = firstTrackerRow;
-      for (int n=myTrackerModel->rowCount (); i<n; ++i)
+      if (newNamesDone)
+        cmp = -1;
+      else if (oldNamesDone)
+        cmp = 1;
+      else
+        cmp = myTrackerModel->item (row)->text ().compare (it.key ());
+
+      if (cmp < 0) // nobody uses this tracker anymore
         {
-          const QString rowName = myTrackerModel->index (i,0).data (Qt::DisplayRole).toString ();
-          if (rowName >= name)
-            break;
+          myTrackerModel->removeRows (row, 1);
+        }
+      else if (cmp > 0) // a new tracker
+        {
+          const QString host = myHostForName.value (it.key ());
+          QStandardItem * item = new QStandardItem (favicons.findFromHost (host), it.key ());
+          item->setData (host, TrackerRole);
+          setCount (item, it.value (), getCountString (it.value ()));
+          myTrackerModel->insertRow (row++, item);
+          anyAdded = true;
+          ++it;
+        }
+      else
+        {
+          setCount (myTrackerModel->item (row++), it.value (), getCountString (it.value ()));
+          ++it;
         }
-
-      // add the row
-      QStandardItem * row = new QStandardItem (favicons.findFromHost (host), name);
-      const int count = torrentsPerHost[host];
-      row->setData (count, TorrentCountRole);
-      row->setData (getCountString (count), TorrentCountStringRole);
-      row->setData (favicons.findFromHost (host), Qt::DecorationRole);
-      row->setData (host, TrackerRole);
-      myTrackerModel->insertRow (i, row);
-      anyAdded = true;
     }
 
   if (anyAdded) // the one added might match our filter...
     refreshPref (Prefs::FILTER_TRACKERS);
 }
 
+void
+FilterBar :: onFaviconReady (const QString& host)
+{
+  Favicons& favicons = dynamic_cast<MyApp*> (QApplication::instance ())->favicons;
+
+  foreach (QStandardItem * item, myTrackerModel->findItems (readableHostName (host)))
+    if (item->data (TrackerRole).toString () == host)
+      item->setData (favicons.findFromHost (host), Qt::DecorationRole);
+}
 
 FilterBarComboBox *
 FilterBar :: createTrackerCombo (QStandardItemModel * model)
@@ -424,7 +490,8 @@ FilterBar :: FilterBar (Prefs& prefs, TorrentModel& torrents, TorrentFilter& fil
   myTorrents (torrents),
   myFilter (filter),
   myRecountTimer (new QTimer (this)),
-  myIsBootstrapping (true)
+  myIsBootstrapping (true),
+  myTorrentsPerMode (FilterMode::NUM_MODES, 0)
 {
   QHBoxLayout * h = new QHBoxLayout (this);
   const int hmargin = qMax (int (HIG::PAD), style ()->pixelMetric (QStyle::PM_LayoutHorizontalSpacing));
@@ -465,10 +532,14 @@ FilterBar :: FilterBar (Prefs& prefs, TorrentModel& torrents, TorrentFilter& fil
   connect (&myFilter, SIGNAL (rowsRemoved (const QModelIndex&,int,int)), this, SLOT (refreshCountLabel ()));
   connect (&myTorrents, SIGNAL (modelReset ()), this, SLOT (onTorrentModelReset ()));
   connect (&myTorrents, SIGNAL (rowsInserted (const QModelIndex&,int,int)), this, SLOT (onTorrentModelRowsInserted (const QModelIndex&,int,int)));
+  connect (&myTorrents, SIGNAL (rowsAboutToBeRemoved (const QModelIndex&,int,int)), this, SLOT (onTorrentModelRowsAboutToBeRemoved (const QModelIndex&,int,int)));
   connect (&myTorrents, SIGNAL (rowsRemoved (const QModelIndex&,int,int)), this, SLOT (onTorrentModelRowsRemoved (const QModelIndex&,int,int)));
   connect (&myTorrents, SIGNAL (dataChanged (const QModelIndex&,const QModelIndex&)), this, SLOT (onTorrentModelDataChanged (const QModelIndex&,const QModelIndex&)));
   connect (myRecountTimer, SIGNAL (timeout ()), this, SLOT (recount ()));
+  connect (&dynamic_cast<MyApp*> (QApplication::instance ())->favicons, SIGNAL (pixmapReady (const QString&)),
+           this, SLOT (onFaviconReady (const QString&)));
 
+  rebuildCounts ();
   recountSoon ();
   refreshTrackers ();
   refreshCountLabel ();
@@ -568,10 +639,43 @@ FilterBar :: onActivityIndexChanged (int i)
 ****
 ***/
 
-void FilterBar :: onTorrentModelReset () { recountSoon (); }
-void FilterBar :: onTorrentModelRowsInserted (const QModelIndex&, int, int) { recountSoon (); }
-void FilterBar :: onTorrentModelRowsRemoved (const QModelIndex&, int, int) { recountSoon (); }
-void FilterBar :: onTorrentModelDataChanged (const QModelIndex&, const QModelIndex&) { recountSoon (); }
+void
+FilterBar :: onTorrentModelReset ()
+{
+  rebuildCounts ();
+  recountSoon ();
+}
+
+void
+FilterBar :: onTorrentModelRowsInserted (const QModelIndex&, int first, int last)
+{
+  updateCounts (first, last);
+  recountSoon (); // the "All" counts changed even if nothing else did
+}
+
+void
+FilterBar :: onTorrentModelRowsAboutToBeRemoved (const QModelIndex&, int first, int last)
+{
+  for (int row=first; row<=last; ++row)
+    {
+      const Torrent * tor = myTorrents.index (row, 0).data (TorrentModel::TorrentRole).value<const Torrent*> ();
+      if (tor != 0 && myTorrentCounts.contains (tor->id ()))
+        addCounts (myTorrentCounts.take (tor->id ()), -1);
+    }
+}
+
+void
+FilterBar :: onTorrentModelRowsRemoved (const QModelIndex&, int, int)
+{
+  recountSoon ();
+}
+
+void
+FilterBar :: onTorrentModelDataChanged (const QModelIndex& topLeft, const QModelIndex& bottomRight)
+{
+  if (updateCounts (topLeft.row (), bottomRight.row ()))
+    recountSoon ();
+}
 
 void
 FilterBar :: recountSoon ()
@@ -587,16 +691,16 @@ FilterBar :: recount ()
 {
   QAbstractItemModel * model = myActivityCombo->model ();
 
-  int torrentsPerMode[FilterMode::NUM_MODES] = {};
-  myFilter.countTorrentsPerMode (torrentsPerMode);
-
   for (int row=0, n=model->rowCount (); row<n; ++row)
     {
       QModelIndex index = model->index (row, 0);
       const int mode = index.data (ActivityRole).toInt ();
-      const int count = torrentsPerMode [mode];
-      model->setData (index, count, TorrentCountRole);
-      model->setData (index, getCountString (count), TorrentCountStringRole);
+      const int count = myTorrentsPerMode[mode];
+      if (index.data (TorrentCountRole) != count)
+        {
+          model->setData (index, count, TorrentCountRole);
+          model->setData (index, getCountString (count), TorrentCountStringRole);
+        }
     }
 
   refreshTrackers ();
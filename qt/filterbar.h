@@ -11,7 +11,11 @@
 #define QTR_FILTERBAR_H
 
 #include <QComboBox>
+#include <QHash>
 #include <QItemDelegate>
+#include <QMap>
+#include <QStringList>
+#include <QVector>
 #include <QWidget>
 
 class QLabel;
@@ -21,6 +25,7 @@ class QStandardItemModel;
 class QTimer;
 
 class Prefs;
+class Torrent;
 class TorrentFilter;
 class TorrentModel;
 
@@ -72,6 +77,21 @@ class FilterBar: public QWidget
     void refreshTrackers ();
     QString getCountString (int n) const;
 
+    // what one torrent adds to the counts below
+    struct TorrentCounts
+    {
+      TorrentCounts (): revision (0), modes (0) {}
+
+      quint64 revision;
+      QStringList hosts;
+      int modes; // bitmask of the FilterModes it matches
+    };
+
+    void addCounts (const TorrentCounts& counts, int delta);
+    bool updateCounts (const Torrent * tor);
+    bool updateCounts (int firstRow, int lastRow);
+    void rebuildCounts ();
+
   private:
     Prefs& myPrefs;
     TorrentModel& myTorrents;
@@ -82,6 +102,13 @@ class FilterBar: public QWidget
     QStandardItemModel * myTrackerModel;
     QTimer * myRecountTimer;
     bool myIsBootstrapping;
+
+    // kept up to date as torrents change so the filter combos
+    // don't have to walk all the torrents to refresh their counts
+    QHash<int,TorrentCounts> myTorrentCounts;
+    QVector<int> myTorrentsPerMode;
+    QMap<QString,int> myTorrentsPerName; // readable tracker name -> count
+    QMap<QString,QString> myHostForName;
     QLineEdit * myLineEdit;
 
   private slots:
@@ -92,9 +119,11 @@ class FilterBar: public QWidget
     void onTrackerIndexChanged (int index);
     void onTorrentModelReset ();
     void onTorrentModelRowsInserted (const QModelIndex&, int, int);
+    void onTorrentModelRowsAboutToBeRemoved (const QModelIndex&, int, int);
     void onTorrentModelRowsRemoved (const QModelIndex&, int, int);
     void onTorrentModelDataChanged (const QModelIndex&, const QModelIndex&);
     void onTextChanged (const QString&);
+    void onFaviconReady (const QString& host);
 };
 
 #endif
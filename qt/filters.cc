@@ -35,10 +35,11 @@ const QString SortMode::names[NUM_MODES] =
 {
   "sort-by-activity",
   "sort-by-age",
+  "sort-by-cpu-time",
   "sort-by-eta",
   "sort-by-name",
   "sort-by-progress",
-  "sort-by-queue"
+  "sort-by-queue",
   "sort-by-ratio",
   "sort-by-size",
   "sort-by-state",
@@ -40,7 +40,7 @@ class SortMode
     SortMode( int mode=SORT_BY_ID ): myMode(mode) {}
     SortMode( const QString& name ): myMode(modeFromName(name)) {}
     static const QString names[];
-    enum { SORT_BY_ACTIVITY, SORT_BY_AGE, SORT_BY_ETA, SORT_BY_NAME,
+    enum { SORT_BY_ACTIVITY, SORT_BY_AGE, SORT_BY_CPU_TIME, SORT_BY_ETA, SORT_BY_NAME,
            SORT_BY_PROGRESS, SORT_BY_QUEUE, SORT_BY_RATIO, SORT_BY_SIZE,
            SORT_BY_STATE, SORT_BY_ID, NUM_MODES };
     static int modeFromName( const QString& name );
@@ -148,6 +148,7 @@ TrMainWindow :: TrMainWindow (Session& session, Prefs& prefs, TorrentModel& mode
   connect (ui.action_CompactView, SIGNAL (toggled (bool)), this, SLOT (setCompactView (bool)));
   connect (ui.action_SortByActivity, SIGNAL (toggled (bool)), this, SLOT (onSortByActivityToggled (bool)));
   connect (ui.action_SortByAge,      SIGNAL (toggled (bool)), this, SLOT (onSortByAgeToggled (bool)));
+  connect (ui.action_SortByCpuTime,  SIGNAL (toggled (bool)), this, SLOT (onSortByCpuTimeToggled (bool)));
   connect (ui.action_SortByETA,      SIGNAL (toggled (bool)), this, SLOT (onSortByETAToggled (bool)));
   connect (ui.action_SortByName,     SIGNAL (toggled (bool)), this, SLOT (onSortByNameToggled (bool)));
   connect (ui.action_SortByProgress, SIGNAL (toggled (bool)), this, SLOT (onSortByProgressToggled (bool)));
@@ -207,6 +208,7 @@ TrMainWindow :: TrMainWindow (Session& session, Prefs& prefs, TorrentModel& mode
   QActionGroup * actionGroup = new QActionGroup (this);
   actionGroup->addAction (ui.action_SortByActivity);
   actionGroup->addAction (ui.action_SortByAge);
+  actionGroup->addAction (ui.action_SortByCpuTime);
   actionGroup->addAction (ui.action_SortByETA);
   actionGroup->addAction (ui.action_SortByName);
   actionGroup->addAction (ui.action_SortByProgress);
@@ -514,6 +516,7 @@ TrMainWindow :: setSortPref (int i)
 }
 void TrMainWindow :: onSortByActivityToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_ACTIVITY); }
 void TrMainWindow :: onSortByAgeToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_AGE); }
+void TrMainWindow :: onSortByCpuTimeToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_CPU_TIME); }
 void TrMainWindow :: onSortByETAToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_ETA); }
 void TrMainWindow :: onSortByNameToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_NAME); }
 void TrMainWindow :: onSortByProgressToggled (bool b) { if (b) setSortPref (SortMode::SORT_BY_PROGRESS); }
@@ -1034,6 +1037,7 @@ TrMainWindow :: refreshPref (int key)
         i = myPrefs.get<SortMode> (key).mode ();
         ui.action_SortByActivity->setChecked (i == SortMode::SORT_BY_ACTIVITY);
         ui.action_SortByAge->setChecked (i == SortMode::SORT_BY_AGE);
+        ui.action_SortByCpuTime->setChecked (i == SortMode::SORT_BY_CPU_TIME);
         ui.action_SortByETA->setChecked (i == SortMode::SORT_BY_ETA);
         ui.action_SortByName->setChecked (i == SortMode::SORT_BY_NAME);
         ui.action_SortByProgress->setChecked (i == SortMode::SORT_BY_PROGRESS);
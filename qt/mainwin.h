@@ -133,6 +133,7 @@ class TrMainWindow: public QMainWindow
     void setSortAscendingPref (bool);
     void onSortByActivityToggled (bool);
     void onSortByAgeToggled (bool);
+    void onSortByCpuTimeToggled (bool);
     void onSortByETAToggled (bool);
     void onSortByNameToggled (bool);
     void onSortByProgressToggled (bool);
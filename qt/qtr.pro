@@ -16,7 +16,7 @@ QT += network dbus
 PKGCONFIG = fontconfig libcurl openssl libevent
 
 greaterThan(QT_MAJOR_VERSION, 4) {
-    QT += widgets
+    QT += widgets concurrent
 }
 
 TRANSMISSION_TOP = ..
@@ -13,6 +13,7 @@
 #include <QApplication>
 #include <QByteArray>
 #include <QClipboard>
+#include <QtConcurrentRun>
 #include <QCoreApplication>
 #include <QDesktopServices>
 #include <QMessageBox>
@@ -27,8 +28,6 @@
 
 #include <curl/curl.h>
 
-#include <event2/buffer.h>
-
 #include <libtransmission/transmission.h>
 #include <libtransmission/rpcimpl.h>
 #include <libtransmission/utils.h> // tr_free
@@ -81,6 +80,16 @@ namespace
     foreach (tr_quark key, keys)
       tr_variantListAddQuark (list, key);
   }
+
+  // ask for the torrents as rows of values instead of objects, so that
+  // the field names aren't repeated for every torrent. processResponse ()
+  // turns them back into objects; older servers just send objects
+  void
+  addFields (tr_variant * args, const KeyList& keys)
+  {
+    addList (tr_variantDictAddList (args, TR_KEY_fields, 0), keys);
+    tr_variantDictAddStr (args, TR_KEY_format, "table");
+  }
 }
 
 /***
@@ -255,7 +264,9 @@ Session :: Session (const char * configDir, Prefs& prefs):
   myPrefs (prefs),
   mySession (0),
   myConfigDir (QString::fromUtf8 (configDir)),
-  myNAM (0)
+  myNAM (0),
+  myRpcVersion (0),
+  myTorrentRevision (0)
 {
   myStats.ratio = TR_RATIO_NA;
   myStats.uploadedBytes = 0;
@@ -269,11 +280,28 @@ Session :: Session (const char * configDir, Prefs& prefs):
 
   connect (this, SIGNAL (responseReceived (const QByteArray&)),
            this, SLOT (onResponseReceived (const QByteArray&)));
+
+  // local responses are handed over from the libtransmission thread
+  qRegisterMetaType<tr_variant*> ("tr_variant*");
+  connect (this, SIGNAL (localResponseReceived (tr_variant*)),
+           this, SLOT (onLocalResponseReceived (tr_variant*)));
 }
 
 Session :: ~Session ()
 {
     stop ();
+
+    foreach (QFutureWatcher<tr_variant*> * watcher, myPendingResponses)
+      {
+        watcher->waitForFinished ();
+        tr_variant * top = watcher->result ();
+        if (top != 0)
+          {
+            tr_variantFree (top);
+            delete top;
+          }
+        delete watcher;
+      }
 }
 
 QNetworkAccessManager *
@@ -300,6 +328,9 @@ Session :: networkAccessManager ()
 void
 Session :: stop ()
 {
+  myRpcVersion = 0;
+  myTorrentRevision = 0;
+
   if (myNAM != 0)
     {
       myNAM->deleteLater ();
@@ -535,7 +566,7 @@ Session :: refreshTorrents (const QSet<int>& ids)
       tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
       tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
       tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
-      addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
+      addFields (args, getStatKeys ());
       addOptionalIds (args, ids);
       exec (&top);
       tr_variantFree (&top);
@@ -551,7 +582,7 @@ Session :: refreshExtraStats (const QSet<int>& ids)
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
   tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
   addOptionalIds (args, ids);
-  addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys () + getExtraStatKeys ());
+  addFields (args, getStatKeys () + getExtraStatKeys ());
   exec (&top);
   tr_variantFree (&top);
 }
@@ -585,8 +616,16 @@ Session :: refreshActiveTorrents ()
   tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_SOME_TORRENTS);
   tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 2));
-  tr_variantDictAddStr (args, TR_KEY_ids, "recently-active");
-  addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
+  if (hasTorrentRevisions ())
+    {
+      // ask for every torrent, but only for what's changed since last time
+      tr_variantDictAddInt (args, TR_KEY_revision, myTorrentRevision);
+    }
+  else
+    {
+      tr_variantDictAddStr (args, TR_KEY_ids, "recently-active");
+    }
+  addFields (args, getStatKeys ());
   exec (&top);
   tr_variantFree (&top);
 }
@@ -599,7 +638,7 @@ Session :: refreshAllTorrents ()
   tr_variantDictAddQuark (&top, TR_KEY_method, TR_KEY_torrent_get);
   tr_variantDictAddInt (&top, TR_KEY_tag, TAG_ALL_TORRENTS);
   tr_variant * args (tr_variantDictAddDict (&top, TR_KEY_arguments, 1));
-  addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ());
+  addFields (args, getStatKeys ());
   exec (&top);
   tr_variantFree (&top);
 }
@@ -611,7 +650,7 @@ Session :: initTorrents (const QSet<int>& ids)
   const int tag (ids.isEmpty () ? TAG_ALL_TORRENTS : TAG_SOME_TORRENTS);
   tr_variant * args (buildRequest ("torrent-get", top, tag));
   addOptionalIds (args, ids);
-  addList (tr_variantDictAddList (args, TR_KEY_fields, 0), getStatKeys ()+getInfoKeys ());
+  addFields (args, getStatKeys ()+getInfoKeys ());
   exec (&top);
   tr_variantFree (&top);
 }
@@ -656,13 +695,21 @@ Session :: updateBlocklist ()
 void
 Session :: exec (const tr_variant * request)
 {
-  char * str = tr_variantToStr (request, TR_VARIANT_FMT_JSON_LEAN, NULL);
-  exec (str);
-  tr_free (str);
+  if (mySession)
+    {
+      // no need for a round trip through JSON when the session is our own
+      tr_rpc_request_exec (mySession, const_cast<tr_variant*> (request), localSessionCallback, this);
+    }
+  else
+    {
+      char * str = tr_variantToStr (request, TR_VARIANT_FMT_JSON_LEAN, NULL);
+      exec (str);
+      tr_free (str);
+    }
 }
 
 void
-Session :: localSessionCallback (tr_session * s, struct evbuffer * json, void * vself)
+Session :: localSessionCallback (tr_session * s, tr_variant * response, void * vself)
 {
   Q_UNUSED (s);
 
@@ -670,8 +717,15 @@ Session :: localSessionCallback (tr_session * s, struct evbuffer * json, void *
 
   /* this callback is invoked in the libtransmission thread, so we don't want
      to process the response here... let's push it over to the Qt thread. */
-  self->responseReceived (QByteArray ( (const char *)evbuffer_pullup (json, -1),
-                                     (int)evbuffer_get_length (json)));
+  self->localResponseReceived (response);
+}
+
+void
+Session :: onLocalResponseReceived (tr_variant * response)
+{
+  processResponse (response);
+  tr_variantFree (response);
+  tr_free (response);
 }
 
 #define REQUEST_DATA_PROPERTY_KEY "requestData"
@@ -681,7 +735,12 @@ Session :: exec (const char * json)
 {
   if (mySession )
     {
-      tr_rpc_request_exec_json (mySession, json, strlen (json), localSessionCallback, this);
+      tr_variant top;
+      if (!tr_variantFromJson (&top, json, strlen (json)))
+        {
+          exec (&top);
+          tr_variantFree (&top);
+        }
     }
   else if (!myUrl.isEmpty ())
     {
@@ -739,11 +798,7 @@ Session :: onFinished (QNetworkReply * reply)
     }
     else
     {
-        const QByteArray response (reply->readAll ());
-        const char * json (response.constData ());
-        int jsonLength (response.size ());
-        if (jsonLength>0 && json[jsonLength-1] == '\n') --jsonLength;
-        parseResponse (json, jsonLength);
+        parseResponse (reply->readAll ());
         emit (error(QNetworkReply::NoError));
     }
 
@@ -753,36 +808,102 @@ Session :: onFinished (QNetworkReply * reply)
 void
 Session :: onResponseReceived (const QByteArray& utf8)
 {
-  parseResponse (utf8.constData (), utf8.length ());
+  parseResponse (utf8);
+}
+
+namespace
+{
+  // runs in a worker thread, so that big torrent-get responses
+  // don't freeze the UI while they're being parsed
+  tr_variant *
+  parseJson (const QByteArray& json)
+  {
+    int jsonLength (json.size ());
+    if (jsonLength>0 && json[jsonLength-1] == '\n')
+      --jsonLength;
+
+    tr_variant * top = new tr_variant;
+    if (tr_variantFromJson (top, json.constData (), jsonLength))
+      {
+        delete top;
+        top = 0;
+      }
+
+    return top;
+  }
+}
+
+void
+Session :: parseResponse (const QByteArray& json)
+{
+  QFutureWatcher<tr_variant*> * watcher = new QFutureWatcher<tr_variant*> (this);
+  connect (watcher, SIGNAL (finished ()), this, SLOT (onResponseParsed ()));
+  myPendingResponses.append (watcher);
+  watcher->setFuture (QtConcurrent::run (parseJson, json));
+}
+
+void
+Session :: onResponseParsed ()
+{
+  // handle the responses in the order they arrived,
+  // even if a later one finished parsing first
+  while (!myPendingResponses.isEmpty () && myPendingResponses.first ()->isFinished ())
+    {
+      QFutureWatcher<tr_variant*> * watcher = myPendingResponses.takeFirst ();
+      tr_variant * top = watcher->result ();
+      watcher->deleteLater ();
+
+      if (top != 0)
+        {
+          processResponse (top);
+          tr_variantFree (top);
+          delete top;
+        }
+    }
 }
 
 void
-Session :: parseResponse (const char * json, size_t jsonLength)
+Session :: processResponse (tr_variant * top)
 {
-    tr_variant top;
-    const int err (tr_variantFromJson (&top, json, jsonLength));
-    if (!err)
+  if (tr_variantIsList (top))
+    {
+      // a batch's responses come back in the order of its requests
+      tr_variant * child;
+      for (int i=0; (child = tr_variantListChild (top, i)); ++i)
+        processResponse (child);
+      return;
+    }
+
     {
         int64_t tag = -1;
         const char * result = NULL;
         tr_variant * args = NULL;
 
-        tr_variantDictFindInt (&top, TR_KEY_tag, &tag);
-        tr_variantDictFindStr (&top, TR_KEY_result, &result, NULL);
-        tr_variantDictFindDict (&top, TR_KEY_arguments, &args);
+        tr_variantDictFindInt (top, TR_KEY_tag, &tag);
+        tr_variantDictFindStr (top, TR_KEY_result, &result, NULL);
+        tr_variantDictFindDict (top, TR_KEY_arguments, &args);
+
+        // torrent lists are asked for in the "table" format; see addFields ()
+        tr_variant * torrents;
+        if (args && tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
+            tr_variantListTableToDicts (torrents);
 
         emit executed (tag, result, args);
 
-        tr_variant * torrents;
         const char * str;
 
-        if (tr_variantDictFindInt (&top, TR_KEY_tag, &tag))
+        if (tr_variantDictFindInt (top, TR_KEY_tag, &tag))
         {
             switch (tag)
             {
                 case TAG_SOME_TORRENTS:
                 case TAG_ALL_TORRENTS:
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args)) {
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args)) {
+                        int64_t revision;
+                        if (tr_variantDictFindInt (args, TR_KEY_revision, &revision))
+                            // a revision that went backwards means the server restarted,
+                            // so start over and get everything on the next poll
+                            myTorrentRevision = revision > myTorrentRevision ? revision : 0;
                         if (tr_variantDictFindList (args, TR_KEY_torrents, &torrents))
                             emit torrentsUpdated (torrents, tag==TAG_ALL_TORRENTS);
                         if (tr_variantDictFindList (args, TR_KEY_removed, &torrents))
@@ -791,18 +912,18 @@ Session :: parseResponse (const char * json, size_t jsonLength)
                     break;
 
                 case TAG_SESSION_STATS:
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args))
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args))
                         updateStats (args);
                     break;
 
                 case TAG_SESSION_INFO:
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args))
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args))
                         updateInfo (args);
                     break;
 
                 case TAG_BLOCKLIST_UPDATE: {
                     int64_t intVal = 0;
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args))
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args))
                         if (tr_variantDictFindInt (args, TR_KEY_blocklist_size, &intVal))
                             setBlocklistSize (intVal);
                     break;
@@ -812,7 +933,7 @@ Session :: parseResponse (const char * json, size_t jsonLength)
                   {
                     int64_t id = 0;
                     const char * result = 0;
-                    if (tr_variantDictFindStr (&top, TR_KEY_result, &result, 0) && strcmp (result, "success"))
+                    if (tr_variantDictFindStr (top, TR_KEY_result, &result, 0) && strcmp (result, "success"))
                       {
                         const char * path = "";
                         const char * name = "";
@@ -841,7 +962,7 @@ Session :: parseResponse (const char * json, size_t jsonLength)
 
                 case TAG_PORT_TEST: {
                     bool isOpen = 0;
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args))
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args))
                         tr_variantDictFindBool (args, TR_KEY_port_is_open, &isOpen);
                     emit portTested ( (bool)isOpen);
                     break;
@@ -852,7 +973,7 @@ Session :: parseResponse (const char * json, size_t jsonLength)
                     tr_variant * torrents;
                     tr_variant * child;
                     const char * str;
-                    if (tr_variantDictFindDict (&top, TR_KEY_arguments, &args)
+                    if (tr_variantDictFindDict (top, TR_KEY_arguments, &args)
                         && tr_variantDictFindList (args, TR_KEY_torrents, &torrents)
                         && ( (child = tr_variantListChild (torrents, 0)))
                         && tr_variantDictFindStr (child, TR_KEY_magnetLink, &str, NULL))
@@ -862,7 +983,7 @@ Session :: parseResponse (const char * json, size_t jsonLength)
 
                 case TAG_ADD_TORRENT:
                     str = "";
-                    if (tr_variantDictFindStr (&top, TR_KEY_result, &str, NULL) && strcmp (str, "success")) {
+                    if (tr_variantDictFindStr (top, TR_KEY_result, &str, NULL) && strcmp (str, "success")) {
                         QMessageBox * d = new QMessageBox (QMessageBox::Information,
                                                            tr ("Add Torrent"),
                                                            QString::fromUtf8 (str),
@@ -877,7 +998,6 @@ Session :: parseResponse (const char * json, size_t jsonLength)
                     break;
             }
         }
-        tr_variantFree (&top);
     }
 }
 
@@ -1006,6 +1126,9 @@ Session :: updateInfo (tr_variant * d)
   if (tr_variantDictFindStr (d, TR_KEY_version, &str, NULL) && (mySessionVersion != str))
     mySessionVersion = str;
 
+  if (tr_variantDictFindInt (d, TR_KEY_rpc_version, &i))
+    myRpcVersion = i;
+
   //std::cerr << "Session :: updateInfo end" << std::endl;
   connect (&myPrefs, SIGNAL (changed (int)), this, SLOT (updatePref (int)));
 
@@ -1021,14 +1144,14 @@ Session :: setBlocklistSize (int64_t i)
 }
 
 void
-Session :: addTorrent (const AddData& addMe)
+Session :: initAddRequest (tr_variant * top, const AddData& addMe)
 {
   const QByteArray b64 = addMe.toBase64 ();
 
-  tr_variant top, *args;
-  tr_variantInitDict (&top, 2);
-  tr_variantDictAddStr (&top, TR_KEY_method, "torrent-add");
-  args = tr_variantDictAddDict (&top, TR_KEY_arguments, 2);
+  tr_variant * args;
+  tr_variantInitDict (top, 2);
+  tr_variantDictAddStr (top, TR_KEY_method, "torrent-add");
+  args = tr_variantDictAddDict (top, TR_KEY_arguments, 2);
   tr_variantDictAddBool (args, TR_KEY_paused, !myPrefs.getBool (Prefs::START));
 
   switch (addMe.type)
@@ -1050,11 +1173,42 @@ Session :: addTorrent (const AddData& addMe)
         std::cerr << "Unhandled AddData type: " << addMe.type << std::endl;
         break;
     }
+}
 
+void
+Session :: addTorrent (const AddData& addMe)
+{
+  tr_variant top;
+  initAddRequest (&top, addMe);
   exec (&top);
   tr_variantFree (&top);
 }
 
+void
+Session :: addTorrents (const QList<AddData>& addMe)
+{
+  if (!hasRequestBatches ())
+    {
+      foreach (const AddData& a, addMe)
+        addTorrent (a);
+      return;
+    }
+
+  // send them in batches, so that adding thousands of torrents
+  // takes a few round trips instead of thousands of them
+  const int batchSize = 100;
+  for (int i=0; i<addMe.size (); i+=batchSize)
+    {
+      const int n = qMin (batchSize, addMe.size () - i);
+      tr_variant top;
+      tr_variantInitList (&top, n);
+      for (int j=0; j<n; ++j)
+        initAddRequest (tr_variantListAdd (&top), addMe[i+j]);
+      exec (&top);
+      tr_variantFree (&top);
+    }
+}
+
 void
 Session :: addNewlyCreatedTorrent (const QString& filename, const QString& localPath)
 {
@@ -14,6 +14,8 @@
 #include <QSet>
 #include <QBuffer>
 #include <QFileInfoList>
+#include <QFutureWatcher>
+#include <QList>
 #include <QNetworkAccessManager>
 #include <QString>
 #include <QStringList>
@@ -29,7 +31,6 @@ class AddData;
 
 extern "C"
 {
-  struct evbuffer;
   struct tr_variant;
 }
 
@@ -71,11 +72,19 @@ class Session: public QObject
     /** returns true if isServer () is true or if the remote address is the localhost */
     bool isLocal () const;
 
+    /** returns true if the server can send just the torrent fields that changed since the last poll */
+    bool hasTorrentRevisions () const { return myRpcVersion >= 16; }
+
+    /** returns true if the server takes a list of requests in a single call */
+    bool hasRequestBatches () const { return myRpcVersion >= 16; }
+
   private:
     void updateStats (struct tr_variant * args);
     void updateInfo (struct tr_variant * args);
-    void parseResponse (const char * json, size_t len);
-    static void localSessionCallback (tr_session *, struct evbuffer *, void *);
+    void parseResponse (const QByteArray& json);
+    void processResponse (struct tr_variant * top);
+    void initAddRequest (struct tr_variant * top, const AddData& addMe);
+    static void localSessionCallback (tr_session *, struct tr_variant *, void *);
 
   public:
     void exec (const char * json);
@@ -117,6 +126,7 @@ class Session: public QObject
     void initTorrents (const QSet<int>& ids = QSet<int> ());
     void addNewlyCreatedTorrent (const QString& filename, const QString& localPath);
     void addTorrent (const AddData& addme);
+    void addTorrents (const QList<AddData>& addme);
     void removeTorrents (const QSet<int>& torrentIds, bool deleteFiles=false);
     void verifyTorrents (const QSet<int>& torrentIds);
     void reannounceTorrents (const QSet<int>& torrentIds);
@@ -129,9 +139,12 @@ class Session: public QObject
   private slots:
     void onFinished (QNetworkReply * reply);
     void onResponseReceived (const QByteArray& json);
+    void onLocalResponseReceived (struct tr_variant * response);
+    void onResponseParsed ();
 
   signals:
     void responseReceived (const QByteArray& json);
+    void localResponseReceived (struct tr_variant * response);
     void executed (int64_t tag, const QString& result, struct tr_variant * arguments);
     void sourceChanged ();
     void portTested (bool isOpen);
@@ -156,6 +169,9 @@ class Session: public QObject
     QStringList myIdleJSON;
     QUrl myUrl;
     QNetworkAccessManager * myNAM;
+    QList<QFutureWatcher<struct tr_variant*>*> myPendingResponses;
+    int64_t myRpcVersion;
+    int64_t myTorrentRevision;
     struct tr_session_stats myStats;
     struct tr_session_stats myCumulativeStats;
     QString mySessionVersion;
@@ -53,13 +53,13 @@ TorrentDelegateMin :: sizeHint (const QStyleOptionViewItem & option,
   QFont nameFont (option.font);
   const QFontMetrics nameFM (nameFont);
   const bool isMagnet (!tor.hasMetadata());
-  const QString nameStr = (isMagnet ? progressString (tor) : tor.name());
+  const QString nameStr = (isMagnet ? cache (tor).progress : tor.name());
   const int nameWidth = nameFM.width (nameStr);
 
   QFont statusFont (option.font);
   statusFont.setPointSize (int (option.font.pointSize() * 0.85));
   const QFontMetrics statusFM (statusFont);
-  const QString statusStr (shortStatusString (tor));
+  const QString statusStr (cache (tor).shortStatus);
   const int statusWidth = statusFM.width (statusStr);
 
   const QSize m (margin (*style));
@@ -82,12 +82,12 @@ TorrentDelegateMin :: drawTorrent (QPainter                   * painter,
   QFont nameFont (option.font);
   const QFontMetrics nameFM (nameFont);
   const bool isMagnet (!tor.hasMetadata());
-  const QString nameStr = (isMagnet ? progressString (tor) : tor.name());
+  const QString nameStr = (isMagnet ? cache (tor).progress : tor.name());
 
   QFont statusFont (option.font);
   statusFont.setPointSize (int (option.font.pointSize() * 0.85));
   const QFontMetrics statusFM (statusFont);
-  const QString statusStr (shortStatusString (tor));
+  const QString statusStr (cache (tor).shortStatus);
   const QSize statusSize (statusFM.size (0, statusStr));
 
   painter->save();
@@ -278,6 +278,40 @@ TorrentDelegate :: statusString (const Torrent& tor) const
 ****
 ***/
 
+TorrentDelegate :: Cache&
+TorrentDelegate :: cache (const Torrent& tor) const
+{
+  double seedRatio (0);
+  const bool hasSeedRatio (tor.getSeedRatio (seedRatio));
+  Cache& c (myCache[tor.id ()]);
+
+  // the seed ratio can change with the session's prefs, not just the torrent
+  if (c.revision != tor.revision () || c.hasSeedRatio != hasSeedRatio || c.seedRatio != seedRatio)
+    {
+      c.revision = tor.revision ();
+      c.hasSeedRatio = hasSeedRatio;
+      c.seedRatio = seedRatio;
+      c.status = statusString (tor);
+      c.progress = progressString (tor);
+      c.shortStatus = shortStatusString (tor);
+      c.sizeHint = QSize ();
+    }
+
+  return c;
+}
+
+void
+TorrentDelegate :: pruneCache (const QModelIndex& index) const
+{
+  // forget removed torrents once they outnumber the ones still shown
+  if (myCache.size () > 2 * index.model ()->rowCount () + 64)
+    myCache.clear ();
+}
+
+/***
+****
+***/
+
 namespace
 {
   int MAX3 (int a, int b, int c)
@@ -301,11 +335,11 @@ TorrentDelegate :: sizeHint (const QStyleOptionViewItem& option, const Torrent&
   QFont statusFont (option.font);
   statusFont.setPointSize (int (option.font.pointSize () * 0.9));
   const QFontMetrics statusFM (statusFont);
-  const QString statusStr (statusString (tor));
+  const QString statusStr (cache (tor).status);
   const int statusWidth = statusFM.width (statusStr);
   QFont progressFont (statusFont);
   const QFontMetrics progressFM (progressFont);
-  const QString progressStr (progressString (tor));
+  const QString progressStr (cache (tor).progress);
   const int progressWidth = progressFM.width (progressStr);
   const QSize m (margin (*style));
   return QSize (m.width()*2 + iconSize + GUI_PAD + MAX3 (nameWidth, statusWidth, progressWidth),
@@ -318,7 +352,16 @@ TorrentDelegate :: sizeHint (const QStyleOptionViewItem  & option,
                              const QModelIndex           & index) const
 {
   const Torrent * tor (index.data (TorrentModel::TorrentRole).value<const Torrent*>());
-  return sizeHint (option, *tor);
+  pruneCache (index);
+
+  Cache& c (cache (*tor));
+  if (!c.sizeHint.isValid () || c.font != option.font)
+    {
+      c.sizeHint = sizeHint (option, *tor);
+      c.font = option.font;
+    }
+
+  return c.sizeHint;
 }
 
 void
@@ -327,6 +370,7 @@ TorrentDelegate :: paint (QPainter                    * painter,
                           const QModelIndex           & index) const
 {
   const Torrent * tor (index.data (TorrentModel::TorrentRole).value<const Torrent*>());
+  pruneCache (index);
   painter->save ();
   painter->setClipRect (option.rect);
   drawTorrent (painter, option, *tor);
@@ -367,10 +411,10 @@ TorrentDelegate :: drawTorrent (QPainter                   * painter,
   QFont statusFont (option.font);
   statusFont.setPointSize (int (option.font.pointSize () * 0.9));
   const QFontMetrics statusFM (statusFont);
-  const QString statusStr (progressString (tor));
+  const QString statusStr (cache (tor).progress);
   QFont progressFont (statusFont);
   const QFontMetrics progressFM (progressFont);
-  const QString progressStr (statusString (tor));
+  const QString progressStr (cache (tor).status);
   const bool isPaused (tor.isPaused ());
 
   painter->save ();
@@ -10,6 +10,8 @@
 #ifndef QTR_TORRENT_DELEGATE_H
 #define QTR_TORRENT_DELEGATE_H
 
+#include <QFont>
+#include <QHash>
 #include <QStyledItemDelegate>
 #include <QSize>
 
@@ -30,6 +32,29 @@ class TorrentDelegate: public QStyledItemDelegate
   protected:
     QStyleOptionProgressBar * myProgressBarStyle;
 
+  protected:
+    // The display strings and size hint of one row. These are rebuilt
+    // only when the torrent's revision, the seed ratio, or the font changes.
+    struct Cache
+    {
+      Cache (): revision (0), hasSeedRatio (false), seedRatio (0) {}
+
+      quint64 revision;
+      bool hasSeedRatio;
+      double seedRatio;
+      QString status;
+      QString progress;
+      QString shortStatus;
+      QFont font;
+      QSize sizeHint;
+    };
+
+    Cache& cache (const Torrent& tor) const;
+    void pruneCache (const QModelIndex& index) const;
+
+  private:
+    mutable QHash<int,Cache> myCache;
+
   protected:
     QString statusString (const Torrent& tor) const;
     QString progressString (const Torrent& tor) const;
@@ -19,12 +19,17 @@
 #include "utils.h"
 
 TorrentFilter :: TorrentFilter (Prefs& prefs):
-  myPrefs (prefs)
+  myPrefs (prefs),
+  myRefilterTimer (this)
 {
   // listen for changes to the preferences to know when to refilter / resort
   connect (&myPrefs, SIGNAL(changed(int)), this, SLOT(refreshPref(int)));
 
-  setDynamicSortFilter (true);
+  // rather than have QSortFilterProxyModel resort and refilter on each
+  // dataChanged(), do it once after the model's done updating
+  setDynamicSortFilter (false);
+  myRefilterTimer.setSingleShot (true);
+  connect (&myRefilterTimer, SIGNAL(timeout()), this, SLOT(invalidate()));
 
   // initialize our state from the current prefs
   QList<int> initKeys;
@@ -40,6 +45,28 @@ TorrentFilter :: ~TorrentFilter ()
 {
 }
 
+void
+TorrentFilter :: setSourceModel (QAbstractItemModel * sourceModel)
+{
+  if (this->sourceModel () != 0)
+    disconnect (this->sourceModel (), 0, this, SLOT(refilterSoon()));
+
+  QSortFilterProxyModel::setSourceModel (sourceModel);
+
+  if (sourceModel != 0)
+    {
+      connect (sourceModel, SIGNAL(dataChanged(const QModelIndex&,const QModelIndex&)), this, SLOT(refilterSoon()));
+      connect (sourceModel, SIGNAL(rowsInserted(const QModelIndex&,int,int)), this, SLOT(refilterSoon()));
+    }
+}
+
+void
+TorrentFilter :: refilterSoon ()
+{
+  if (!myRefilterTimer.isActive ())
+    myRefilterTimer.start (0);
+}
+
 void
 TorrentFilter :: refreshPref (int key)
 {
@@ -97,6 +124,11 @@ TorrentFilter :: lessThan (const QModelIndex& left, const QModelIndex& right) co
           val = compare (a->sizeWhenDone(), b->sizeWhenDone());
         break;
 
+      case SortMode :: SORT_BY_CPU_TIME:
+        if (!val)
+          val = compare (a->cpuTime(), b->cpuTime());
+        break;
+
       case SortMode :: SORT_BY_AGE:
         val = compare (a->dateAdded().toTime_t(), b->dateAdded().toTime_t());
         break;
@@ -12,6 +12,7 @@
 
 #include <QSortFilterProxyModel>
 #include <QMetaType>
+#include <QTimer>
 #include <QVariant>
 
 class QString;
@@ -32,9 +33,11 @@ class TorrentFilter: public QSortFilterProxyModel
   public:
     enum TextMode { FILTER_BY_NAME, FILTER_BY_FILES, FILTER_BY_TRACKER };
     int hiddenRowCount () const;
+    virtual void setSourceModel (QAbstractItemModel * sourceModel);
 
   private slots:
     void refreshPref (int key);
+    void refilterSoon ();
 
   protected:
     virtual bool filterAcceptsRow (int, const QModelIndex&) const;
@@ -49,6 +52,7 @@ class TorrentFilter: public QSortFilterProxyModel
 
   private:
     Prefs& myPrefs;
+    QTimer myRefilterTimer;
 };
 
 #endif
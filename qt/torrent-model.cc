@@ -7,6 +7,7 @@
  * $Id$
  */
 
+#include <algorithm> // std::sort()
 #include <cassert>
 #include <iostream>
 
@@ -81,7 +82,8 @@ TorrentModel :: addTorrent (Torrent * t)
 }
 
 TorrentModel :: TorrentModel (Prefs& prefs):
-  myPrefs (prefs)
+  myPrefs (prefs),
+  myIsUpdating (false)
 {
 }
 
@@ -116,13 +118,39 @@ void
 TorrentModel :: onTorrentChanged (int torrentId)
 {
   const int row (myIdToRow.value (torrentId, -1));
-  if (row >= 0)
+  if (row < 0)
+    return;
+
+  if (myIsUpdating)
+    {
+      myChangedRows.insert (row);
+    }
+  else
     {
       QModelIndex qmi (index (row, 0));
       emit dataChanged (qmi, qmi);
     }
 }
 
+void
+TorrentModel :: emitChangedRows ()
+{
+  QList<int> rows (myChangedRows.toList ());
+  myChangedRows.clear ();
+  std::sort (rows.begin (), rows.end ());
+
+  // one dataChanged() per run of adjacent rows
+  for (int i=0, n=rows.size(); i<n; )
+    {
+      int j = i;
+      while (j+1<n && rows[j+1]==rows[j]+1)
+        ++j;
+
+      emit dataChanged (index (rows[i], 0), index (rows[j], 0));
+      i = j + 1;
+    }
+}
+
 void
 TorrentModel :: removeTorrents (tr_variant * torrents)
 {
@@ -148,6 +176,8 @@ TorrentModel :: updateTorrents (tr_variant * torrents, bool isCompleteList)
   if  (isCompleteList)
     oldIds = getIds ();
 
+  myIsUpdating = true;
+
   if (tr_variantIsList (torrents))
     {
       size_t i (0);
@@ -183,6 +213,9 @@ TorrentModel :: updateTorrents (tr_variant * torrents, bool isCompleteList)
         }
     }
 
+  myIsUpdating = false;
+  emitChangedRows ();
+
   if (!newTorrents.isEmpty ())
     {
       const int oldCount (rowCount ());
@@ -38,6 +38,11 @@ class TorrentModel: public QAbstractListModel
     torrents_t myTorrents;
     Prefs& myPrefs;
 
+    // while updateTorrents() is running, changed rows are collected
+    // here and announced together once it's done
+    bool myIsUpdating;
+    QSet<int> myChangedRows;
+
   public:
     void clear ();
     bool hasTorrent (const QString& hashString) const;
@@ -52,6 +57,7 @@ class TorrentModel: public QAbstractListModel
   private:
     void addTorrent (Torrent *);
     QSet<int> getIds () const;
+    void emitChangedRows ();
 
   public:
     void getTransferSpeed (Speed  & uploadSpeed,
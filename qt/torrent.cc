@@ -31,6 +31,7 @@
 
 Torrent :: Torrent (Prefs& prefs, int id):
   magnetTorrent (false),
+  myRevision (++myNextRevision),
   myPrefs (prefs)
 {
 #ifndef NDEBUG
@@ -50,6 +51,8 @@ Torrent :: ~Torrent ()
 ****
 ***/
 
+quint64 Torrent :: myNextRevision = 0;
+
 Torrent :: Property
 Torrent :: myProperties[] =
 {
@@ -85,6 +88,7 @@ Torrent :: myProperties[] =
   { DOWNLOADED_EVER, TR_KEY_downloadedEver, QVariant::ULongLong, STAT },
   { UPLOADED_EVER, TR_KEY_uploadedEver, QVariant::ULongLong, STAT },
   { FAILED_EVER, TR_KEY_corruptEver, QVariant::ULongLong, STAT_EXTRA },
+  { CPU_TIME, TR_KEY_cpuTime, QVariant::ULongLong, STAT },
   { TRACKERS, TR_KEY_trackers, QVariant::StringList, STAT },
   { HOSTS, TR_KEY_NONE, QVariant::StringList, DERIVED },
   { TRACKERSTATS, TR_KEY_trackerStats, TrTypes::TrackerStatsList, STAT_EXTRA },
@@ -367,7 +371,9 @@ Torrent :: hasFileSubstring (const QString& substr) const
 bool
 Torrent :: hasTrackerSubstring (const QString& substr) const
 {
-  foreach (QString s, myValues[TRACKERS].toStringList())
+  // the hosts are parsed once, when the trackers change,
+  // and filtering only ever asks for a host
+  foreach (const QString& s, myValues[HOSTS].toStringList())
     if (s.contains (substr, Qt::CaseInsensitive))
       return true;
 
@@ -719,6 +725,9 @@ Torrent :: update (tr_variant * d)
           const char * str;
           Peer peer;
 
+          peer.id = -1;
+          if (tr_variantDictFindInt (child, TR_KEY_id, &i))
+            peer.id = i;
           if (tr_variantDictFindStr(child, TR_KEY_address, &str, &len))
             peer.address = QString::fromUtf8 (str, len);
           if (tr_variantDictFindStr(child, TR_KEY_clientName, &str, &len))
@@ -757,7 +766,10 @@ Torrent :: update (tr_variant * d)
     }
 
   if (changed)
-    emit torrentChanged (id ());
+    {
+      myRevision = ++myNextRevision;
+      emit torrentChanged (id ());
+    }
 
   if (!was_seed && isSeed() && (old_verified_size>0))
     emit torrentCompleted (id ());
@@ -49,6 +49,7 @@ struct Peer
   bool isUploadingTo;
   bool peerIsChoked;
   bool peerIsInterested;
+  int id; // or -1 if the server's too old to send one
   QString address;
   QString clientName;
   QString flagStr;
@@ -153,6 +154,7 @@ class Torrent: public QObject
       DOWNLOADED_EVER,
       UPLOADED_EVER,
       FAILED_EVER,
+      CPU_TIME,
       TRACKERS,
       HOSTS,
       TRACKERSTATS,
@@ -208,8 +210,10 @@ class Torrent: public QObject
     };
 
     static Property myProperties[];
+    static quint64 myNextRevision;
 
     bool magnetTorrent;
+    quint64 myRevision;
 
   public:
     typedef QList<tr_quark> KeyList;
@@ -273,6 +277,7 @@ class Torrent: public QObject
     uint64_t downloadedEver () const { return getSize (DOWNLOADED_EVER); }
     uint64_t uploadedEver () const { return getSize (UPLOADED_EVER); }
     uint64_t failedEver () const { return getSize (FAILED_EVER); }
+    uint64_t cpuTime () const { return getSize (CPU_TIME); } /* msec */
     int compareTracker (const Torrent&) const;
     int compareSeedRatio (const Torrent&) const;
     int compareRatio (const Torrent&) const;
@@ -329,6 +334,10 @@ class Torrent: public QObject
     bool isQueued () const { return isWaitingToDownload() || isWaitingToSeed(); }
     void notifyComplete () const;
 
+    // changes whenever update() changes anything, and is never reused
+    // by another torrent, so views can use it to tell if a cache is stale
+    quint64 revision () const { return myRevision; }
+
   public:
     void update (tr_variant * dict);
     void setMagnet (bool magnet) { magnetTorrent = magnet; }
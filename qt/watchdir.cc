@@ -25,8 +25,19 @@
 
 WatchDir :: WatchDir (const TorrentModel& model):
   myModel (model),
-  myWatcher (0)
+  myWatcher (0),
+  myScanTimer (new QTimer (this)),
+  myRetryTimer (new QTimer (this))
 {
+  myScanTimer->setSingleShot (true);
+  myScanTimer->setInterval (500);
+  connect (myScanTimer, SIGNAL(timeout()), this, SLOT(rescan()));
+
+  // restarted by every file that isn't ready yet, so a burst of
+  // half-written files is retried together once the burst is over
+  myRetryTimer->setSingleShot (true);
+  myRetryTimer->setInterval (5000);
+  connect (myRetryTimer, SIGNAL(timeout()), this, SLOT(onRetryTimeout()));
 }
 
 WatchDir :: ~WatchDir ()
@@ -61,23 +72,15 @@ WatchDir :: metainfoTest (const QString& filename) const
   return ret;
 }
 
-void
-WatchDir :: onTimeout ()
-{
-  QTimer * t = qobject_cast<QTimer*>(sender());
-  const QString filename = t->objectName ();
-
-  if (metainfoTest (filename) == OK)
-    emit torrentFileAdded( filename );
-
-  t->deleteLater( );
-}
-
 void
 WatchDir :: setPath (const QString& path, bool isEnabled)
 {
   // clear out any remnants of the previous watcher, if any
+  myScanTimer->stop ();
+  myRetryTimer->stop ();
   myWatchDirFiles.clear ();
+  myRetryFiles.clear ();
+  myPath = path;
   if (myWatcher)
     {
       delete myWatcher;
@@ -92,51 +95,78 @@ WatchDir :: setPath (const QString& path, bool isEnabled)
       connect (myWatcher, SIGNAL(directoryChanged(const QString&)),
                this, SLOT(watcherActivated(const QString&)));
       //std::cerr << "watching " << qPrintable(path) << " for new .torrent files" << std::endl;
-      watcherActivated (path); // trigger the watchdir for .torrent files in there already
+      rescan (); // trigger the watchdir for .torrent files in there already
     }
 }
 
 void
 WatchDir :: watcherActivated (const QString& path)
 {
-  const QDir dir(path);
+  Q_UNUSED (path);
+
+  // dropping many files in at once fires this once per file,
+  // so wait for things to settle and then rescan just once
+  myScanTimer->start ();
+}
+
+void
+WatchDir :: rescan ()
+{
+  const QDir dir (myPath);
 
   // get the list of files currently in the watch directory
-  QSet<QString> files;
-  foreach (QString str, dir.entryList (QDir::Readable|QDir::Files))
-    files.insert (str);
-
-  // try to add any new files which end in .torrent
-  const QSet<QString> newFiles (files - myWatchDirFiles);
-  const QString torrentSuffix = QString::fromUtf8 (".torrent");
-  foreach (QString name, newFiles)
+  QStringList files (dir.entryList (QStringList () << QString::fromUtf8 ("*.torrent"),
+                                    QDir::Readable|QDir::Files, QDir::Unsorted));
+  files.sort ();
+
+  // walk both sorted lists together to find the new files
+  QStringList added;
+  QStringList::const_iterator old (myWatchDirFiles.constBegin ());
+  foreach (const QString& name, files)
     {
-      if (name.endsWith (torrentSuffix, Qt::CaseInsensitive))
+      while (old != myWatchDirFiles.constEnd () && *old < name)
+        ++old;
+
+      if (old != myWatchDirFiles.constEnd () && *old == name)
+        continue;
+
+      const QString filename = dir.absoluteFilePath (name);
+      switch (metainfoTest (filename))
         {
-          const QString filename = dir.absoluteFilePath (name);
-          switch (metainfoTest (filename))
-            {
-              case OK:
-                emit torrentFileAdded (filename);
-                break;
-
-              case DUPLICATE:
-                break;
-
-              case ERROR:
-                {
-                  // give the .torrent a few seconds to finish downloading
-                  QTimer * t = new QTimer (this);
-                  t->setObjectName (dir.absoluteFilePath (name));
-                  t->setSingleShot (true);
-                  connect( t, SIGNAL(timeout()), this, SLOT(onTimeout()));
-                  t->start (5000);
-                }
-            }
+          case OK:
+            added << filename;
+            break;
+
+          case DUPLICATE:
+            break;
+
+          case ERROR:
+            // give the .torrent a few seconds to finish downloading
+            myRetryFiles << filename;
+            myRetryTimer->start ();
+            break;
         }
     }
 
   // update our file list so that we can use it
   // for comparison the next time around
   myWatchDirFiles = files;
+
+  if (!added.isEmpty ())
+    emit torrentFilesAdded (added);
+}
+
+void
+WatchDir :: onRetryTimeout ()
+{
+  QStringList added;
+
+  foreach (const QString& filename, myRetryFiles)
+    if (metainfoTest (filename) == OK)
+      added << filename;
+
+  myRetryFiles.clear ();
+
+  if (!added.isEmpty ())
+    emit torrentFilesAdded (added);
 }
@@ -11,11 +11,12 @@
 #define QTR_WATCHDIR_H
 
 #include <QObject>
-#include <QSet>
 #include <QString>
+#include <QStringList>
 
 class TorrentModel;
 class QFileSystemWatcher;
+class QTimer;
 
 class WatchDir: public QObject
 {
@@ -33,16 +34,21 @@ class WatchDir: public QObject
     int metainfoTest (const QString& filename) const;
 
   signals:
-    void torrentFileAdded (QString filename);
+    void torrentFilesAdded (const QStringList& filenames);
 
   private slots:
     void watcherActivated (const QString& path);
-    void onTimeout ();
+    void rescan ();
+    void onRetryTimeout ();
 
   private:
     const TorrentModel& myModel;
-    QSet<QString> myWatchDirFiles;
+    QString myPath;
+    QStringList myWatchDirFiles; // sorted, so that rescans can be merged in one pass
+    QStringList myRetryFiles;
     QFileSystemWatcher * myWatcher;
+    QTimer * myScanTimer;
+    QTimer * myRetryTimer;
 };
 
 #endif
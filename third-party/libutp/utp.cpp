@@ -2798,6 +2798,11 @@ void UTP_CheckTimeouts()
 	}
 }
 
+size_t UTP_GetSocketCount()
+{
+	return g_utp_sockets.GetCount();
+}
+
 size_t UTP_GetPacketSize(UTPSocket *socket)
 {
 	return socket->get_packet_size();
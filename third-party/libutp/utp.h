@@ -121,6 +121,9 @@ void UTP_RBDrained(struct UTPSocket *socket);
 // Call periodically to process timeouts and other periodic events
 void UTP_CheckTimeouts(void);
 
+// Returns the number of sockets that still need UTP_CheckTimeouts
+size_t UTP_GetSocketCount(void);
+
 // Retrieves the peer address of the specified socket, stores this address in the
 // sockaddr structure pointed to by the addr argument, and stores the length of this
 // address in the object pointed to by the addrlen argument.
@@ -31,6 +31,7 @@ static bool showVersion = false;
 static const char * comment = NULL;
 static const char * outfile = NULL;
 static const char * infile = NULL;
+static const char * reusefile = NULL;
 static uint32_t piecesize_kib = 0;
 
 static tr_option options[] =
@@ -40,6 +41,7 @@ static tr_option options[] =
   { 's', "piecesize", "Set how many KiB each piece should be, overriding the preferred default", "s", 1, "<size in KiB>" },
   { 'c', "comment", "Add a comment", "c", 1, "<comment>" },
   { 't', "tracker", "Add a tracker's announce URL", "t", 1, "<url>" },
+  { 'r', "reuse", "Reuse the piece hashes of this torrent, made from the same unchanged files", "r", 1, "<torrent>" },
   { 'V', "version", "Show version number and exit", "V", 0, NULL },
   { 0, NULL, NULL, NULL, 0, NULL }
 };
@@ -72,6 +74,10 @@ parseCommandLine (int argc, const char ** argv)
             outfile = optarg;
             break;
 
+          case 'r':
+            reusefile = optarg;
+            break;
+
           case 'c':
             comment = optarg;
             break;
@@ -189,6 +195,30 @@ main (int argc, char * argv[])
   if (piecesize_kib != 0)
     tr_metaInfoBuilderSetPieceSize (b, piecesize_kib * KiB);
 
+  if (reusefile != NULL)
+    {
+      tr_info inf;
+      tr_ctor * ctor = tr_ctorNew (NULL);
+
+      tr_ctorSetMetainfoFromFile (ctor, reusefile);
+      if (tr_torrentParse (ctor, &inf) != TR_PARSE_OK)
+        {
+          printf ("\nWARNING: couldn't read \"%s\"; hashing every piece\n", reusefile);
+        }
+      else
+        {
+          /* unless told otherwise, use the piece size that lets us reuse hashes */
+          if (piecesize_kib == 0)
+            tr_metaInfoBuilderSetPieceSize (b, inf.pieceSize);
+          printf (" reusing %"PRIu32" of %"PRIu32" piece hashes ...",
+                  tr_metaInfoBuilderReuseInfo (b, &inf), b->pieceCount);
+          tr_metainfoFree (&inf);
+        }
+      fflush (stdout);
+
+      tr_ctorFree (ctor);
+    }
+
   tr_makeMetaInfo (b, outfile, trackers, trackerCount, comment, isPrivate);
   while (!b->isDone)
     {
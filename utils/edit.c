@@ -11,6 +11,10 @@
 #include <string.h> /* strlen (), strstr (), strcmp () */
 #include <stdlib.h> /* EXIT_FAILURE */
 
+#ifndef _WIN32
+ #include <pthread.h>
+#endif
+
 #include <event2/buffer.h>
 
 #include <libtransmission/transmission.h>
@@ -22,6 +26,7 @@
 #define MY_NAME "transmission-edit"
 
 static int fileCount = 0;
+static int jobCount = 1;
 static bool showVersion = false;
 static const char ** files = NULL;
 static const char * add = NULL;
@@ -32,6 +37,7 @@ static tr_option options[] =
 {
   { 'a', "add", "Add a tracker's announce URL", "a", 1, "<url>" },
   { 'd', "delete", "Delete a tracker's announce URL", "d", 1, "<url>" },
+  { 'j', "jobs", "Edit this many files at once", "j", 1, "<count>" },
   { 'r', "replace", "Search and replace a substring in the announce URLs", "r", 1, "<old> <new>" },
   { 'V', "version", "Show version number and exit", "V", 0, NULL },
   { 0, NULL, NULL, NULL, 0, NULL }
@@ -61,6 +67,12 @@ parseCommandLine (int argc, const char ** argv)
             deleteme = optarg;
             break;
 
+          case 'j':
+            jobCount = atoi (optarg);
+            if (jobCount < 1)
+              return 1;
+            break;
+
           case 'r':
             replace[0] = optarg;
             c = tr_getopt (getUsage (), argc, argv, options, &optarg);
@@ -86,15 +98,15 @@ parseCommandLine (int argc, const char ** argv)
 }
 
 static bool
-removeURL (tr_variant * metainfo, const char * url)
+removeURL (tr_variant * metainfo, const char * url, struct evbuffer * log)
 {
   const char * str;
-  tr_variant * announce_list;
+  tr_variant * announce_list = NULL;
   bool changed = false;
 
   if (tr_variantDictFindStr (metainfo, TR_KEY_announce, &str, NULL) && !strcmp (str, url))
     {
-      printf ("\tRemoved \"%s\" from \"announce\"\n", str);
+      evbuffer_add_printf (log, "\tRemoved \"%s\" from \"announce\"\n", str);
       tr_variantDictRemove (metainfo, TR_KEY_announce);
       changed = true;
     }
@@ -111,7 +123,7 @@ removeURL (tr_variant * metainfo, const char * url)
             {
               if (tr_variantGetStr (node, &str, NULL) && !strcmp (str, url))
                 {
-                  printf ("\tRemoved \"%s\" from \"announce-list\" tier #%d\n", str, (tierIndex+1));
+                  evbuffer_add_printf (log, "\tRemoved \"%s\" from \"announce-list\" tier #%d\n", str, (tierIndex+1));
                   tr_variantListRemove (tier, nodeIndex);
                   changed = true;
                 }
@@ -120,7 +132,7 @@ removeURL (tr_variant * metainfo, const char * url)
 
           if (tr_variantListSize (tier) == 0)
             {
-              printf ("\tNo URLs left in tier #%d... removing tier\n", (tierIndex+1));
+              evbuffer_add_printf (log, "\tNo URLs left in tier #%d... removing tier\n", (tierIndex+1));
               tr_variantListRemove (announce_list, tierIndex);
             }
           else
@@ -131,7 +143,7 @@ removeURL (tr_variant * metainfo, const char * url)
 
       if (tr_variantListSize (announce_list) == 0)
         {
-          printf ("\tNo tiers left... removing announce-list\n");
+          evbuffer_add_printf (log, "\tNo tiers left... removing announce-list\n");
           tr_variantDictRemove (metainfo, TR_KEY_announce_list);
         }
     }
@@ -150,7 +162,7 @@ removeURL (tr_variant * metainfo, const char * url)
               if (tr_variantGetStr (node, &str, NULL))
                 {
                   tr_variantDictAddStr (metainfo, TR_KEY_announce, str);
-                  printf ("\tAdded \"%s\" to announce\n", str);
+                  evbuffer_add_printf (log, "\tAdded \"%s\" to announce\n", str);
                 }
             }
         }
@@ -180,7 +192,7 @@ replaceSubstr (const char * str, const char * in, const char * out)
 }
 
 static bool
-replaceURL (tr_variant * metainfo, const char * in, const char * out)
+replaceURL (tr_variant * metainfo, const char * in, const char * out, struct evbuffer * log)
 {
   const char * str;
   tr_variant * announce_list;
@@ -189,7 +201,7 @@ replaceURL (tr_variant * metainfo, const char * in, const char * out)
   if (tr_variantDictFindStr (metainfo, TR_KEY_announce, &str, NULL) && strstr (str, in))
     {
       char * newstr = replaceSubstr (str, in, out);
-      printf ("\tReplaced in \"announce\": \"%s\" --> \"%s\"\n", str, newstr);
+      evbuffer_add_printf (log, "\tReplaced in \"announce\": \"%s\" --> \"%s\"\n", str, newstr);
       tr_variantDictAddStr (metainfo, TR_KEY_announce, newstr);
       tr_free (newstr);
       changed = true;
@@ -208,7 +220,7 @@ replaceURL (tr_variant * metainfo, const char * in, const char * out)
               if (tr_variantGetStr (node, &str, NULL) && strstr (str, in))
                 {
                   char * newstr = replaceSubstr (str, in, out);
-                  printf ("\tReplaced in \"announce-list\" tier %d: \"%s\" --> \"%s\"\n", tierCount, str, newstr);
+                  evbuffer_add_printf (log, "\tReplaced in \"announce-list\" tier %d: \"%s\" --> \"%s\"\n", tierCount, str, newstr);
                   tr_variantFree (node);
                   tr_variantInitStr (node, newstr, -1);
                   tr_free (newstr);
@@ -240,7 +252,7 @@ announce_list_has_url (tr_variant * announce_list, const char * url)
 }
 
 static bool
-addURL (tr_variant * metainfo, const char * url)
+addURL (tr_variant * metainfo, const char * url, struct evbuffer * log)
 {
   const char * announce = NULL;
   tr_variant * announce_list = NULL;
@@ -251,7 +263,7 @@ addURL (tr_variant * metainfo, const char * url)
   if (!had_announce && !had_announce_list)
     {
       /* this new tracker is the only one, so add it to "announce"... */
-      printf ("\tAdded \"%s\" in \"announce\"\n", url);
+      evbuffer_add_printf (log, "\tAdded \"%s\" in \"announce\"\n", url);
       tr_variantDictAddStr (metainfo, TR_KEY_announce, url);
       changed = true;
     }
@@ -276,7 +288,7 @@ addURL (tr_variant * metainfo, const char * url)
         {
           tr_variant * tier = tr_variantListAddList (announce_list, 1);
           tr_variantListAddStr (tier, url);
-          printf ("\tAdded \"%s\" to \"announce-list\" tier %"TR_PRIuSIZE"\n", url, tr_variantListSize (announce_list));
+          evbuffer_add_printf (log, "\tAdded \"%s\" to \"announce-list\" tier %"TR_PRIuSIZE"\n", url, tr_variantListSize (announce_list));
           changed = true;
         }
     }
@@ -284,11 +296,317 @@ addURL (tr_variant * metainfo, const char * url)
   return changed;
 }
 
+static bool
+editMetainfo (tr_variant * metainfo, struct evbuffer * log)
+{
+  bool changed = false;
+
+  if (deleteme != NULL)
+    changed |= removeURL (metainfo, deleteme, log);
+
+  if (add != NULL)
+    changed |= addURL (metainfo, add, log);
+
+  if (replace[0] && replace[1])
+    changed |= replaceURL (metainfo, replace[0], replace[1], log);
+
+  return changed;
+}
+
+/***
+****  Editing files
+***/
+
+enum edit_result
+{
+  EDIT_UNCHANGED,
+  EDIT_CHANGED,
+  EDIT_ERROR,
+  EDIT_NEEDS_FULL_PARSE
+};
+
+#ifdef _WIN32
+ /* no worker threads here; --jobs is ignored and the files are edited in turn */
+ #define lockLock(lock)
+ #define lockUnlock(lock)
+#else
+ #define lockLock(lock) pthread_mutex_lock (&(lock))
+ #define lockUnlock(lock) pthread_mutex_unlock (&(lock))
+
+/* guards the file queue, the output, and changedCount */
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Parsing dicts adds their keys to libtransmission's quark table,
+   which isn't thread-safe, so the workers take turns at it */
+static pthread_mutex_t parseLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int nextFile = 0;
+static int changedCount = 0;
+
+/* the top-level keys that editMetainfo () can change, in benc's sort order */
+static const tr_quark trackerKeys[] = { TR_KEY_announce, TR_KEY_announce_list };
+#define TRACKER_KEY_COUNT (sizeof (trackerKeys) / sizeof (trackerKeys[0]))
+
+static int
+findTrackerKey (const uint8_t * key, size_t key_len)
+{
+  size_t i;
+
+  for (i=0; i<TRACKER_KEY_COUNT; ++i)
+    {
+      size_t len;
+      const char * str = tr_quark_get_string (trackerKeys[i], &len);
+      if (len == key_len && !memcmp (str, key, len))
+        return i;
+    }
+
+  return -1;
+}
+
+/* true if the tracker key sorts before `key' */
+static bool
+isTrackerKeyBefore (size_t i, const uint8_t * key, size_t key_len)
+{
+  size_t len;
+  const char * str = tr_quark_get_string (trackerKeys[i], &len);
+  const int cmp = memcmp (str, key, MIN (len, key_len));
+
+  return cmp < 0 || (cmp == 0 && len < key_len);
+}
+
+struct splice_data
+{
+  tr_variant trackers;
+  struct evbuffer * out;
+  bool written[TRACKER_KEY_COUNT];
+  bool ok;
+};
+
+static bool
+isAnnounceList (tr_variant * list)
+{
+  int i, j;
+  tr_variant * tier;
+  tr_variant * node;
+
+  if (!tr_variantIsList (list))
+    return false;
+
+  for (i=0; (tier = tr_variantListChild (list, i)); ++i)
+    {
+      if (!tr_variantIsList (tier))
+        return false;
+
+      for (j=0; (node = tr_variantListChild (tier, j)); ++j)
+        if (!tr_variantIsString (node))
+          return false;
+    }
+
+  return true;
+}
+
+static void
+readTrackerEntry (const uint8_t * key, size_t key_len, const uint8_t * val, size_t val_len, void * vdata)
+{
+  tr_variant * v;
+  struct splice_data * data = vdata;
+  const int i = findTrackerKey (key, key_len);
+
+  if (i < 0 || !data->ok)
+    return;
+
+  v = tr_variantDictAdd (&data->trackers, trackerKeys[i]);
+
+  /* these are small, so the lock isn't held long */
+  lockLock (parseLock);
+  data->ok = !tr_variantFromBenc (v, val, val_len);
+  lockUnlock (parseLock);
+
+  /* anything unexpected (like a dict, with its quarks) is left to the full parse */
+  if (data->ok)
+    data->ok = trackerKeys[i] == TR_KEY_announce ? tr_variantIsString (v) : isAnnounceList (v);
+
+  if (!data->ok)
+    tr_variantDictRemove (&data->trackers, trackerKeys[i]);
+}
+
+static void
+writeTrackerEntries (struct splice_data * data, const uint8_t * before, size_t before_len)
+{
+  size_t i;
+
+  for (i=0; i<TRACKER_KEY_COUNT; ++i)
+    {
+      tr_variant * v;
+
+      if (data->written[i] || (before != NULL && !isTrackerKeyBefore (i, before, before_len)))
+        continue;
+
+      data->written[i] = true;
+
+      if ((v = tr_variantDictFind (&data->trackers, trackerKeys[i])) != NULL)
+        {
+          size_t len;
+          const char * key = tr_quark_get_string (trackerKeys[i], &len);
+          struct evbuffer * benc = tr_variantToBuf (v, TR_VARIANT_FMT_BENC);
+
+          evbuffer_add_printf (data->out, "%"TR_PRIuSIZE":", len);
+          evbuffer_add (data->out, key, len);
+          evbuffer_add_buffer (data->out, benc);
+          evbuffer_free (benc);
+        }
+    }
+}
+
+static void
+writeEntry (const uint8_t * key, size_t key_len, const uint8_t * val UNUSED, size_t val_len, void * vdata)
+{
+  struct splice_data * data = vdata;
+
+  writeTrackerEntries (data, key, key_len);
+
+  /* the value's bytes follow the key's */
+  if (findTrackerKey (key, key_len) < 0)
+    {
+      evbuffer_add_printf (data->out, "%"TR_PRIuSIZE":", key_len);
+      evbuffer_add (data->out, key, key_len + val_len);
+    }
+}
+
+/**
+ * Edit the announce URLs without parsing or re-encoding the rest of the
+ * file, which is mostly the "info" dict. The other top-level entries are
+ * copied over byte for byte, and the new tracker entries are spliced in
+ * where benc's key order puts them.
+ */
+static enum edit_result
+editInPlace (const char * filename, struct evbuffer * log)
+{
+  size_t len;
+  size_t dict_len;
+  uint8_t * buf;
+  enum edit_result ret = EDIT_UNCHANGED;
+  struct splice_data data;
+
+  if ((buf = tr_loadFile (filename, &len)) == NULL)
+    {
+      evbuffer_add_printf (log, "\tError reading file\n");
+      return EDIT_ERROR;
+    }
+
+  memset (&data, 0, sizeof (data));
+  tr_variantInitDict (&data.trackers, TRACKER_KEY_COUNT);
+  data.ok = true;
+
+  dict_len = tr_variantBencDictForeach (buf, len, readTrackerEntry, &data);
+
+  if (!dict_len || !data.ok)
+    {
+      ret = EDIT_NEEDS_FULL_PARSE;
+    }
+  else if (editMetainfo (&data.trackers, log))
+    {
+      data.out = evbuffer_new ();
+      evbuffer_add (data.out, "d", 1);
+      tr_variantBencDictForeach (buf, dict_len, writeEntry, &data);
+      writeTrackerEntries (&data, NULL, 0);
+      evbuffer_add (data.out, buf + dict_len - 1, len - dict_len + 1);
+
+      if (tr_variantBufToFile (data.out, filename))
+        {
+          evbuffer_add_printf (log, "\tError saving file\n");
+          ret = EDIT_ERROR;
+        }
+      else
+        {
+          ret = EDIT_CHANGED;
+        }
+
+      evbuffer_free (data.out);
+    }
+
+  tr_variantFree (&data.trackers);
+  tr_free (buf);
+  return ret;
+}
+
+static enum edit_result
+editFullParse (const char * filename, struct evbuffer * log)
+{
+  tr_variant top;
+  enum edit_result ret = EDIT_UNCHANGED;
+
+  lockLock (parseLock);
+
+  if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+    {
+      evbuffer_add_printf (log, "\tError reading file\n");
+      ret = EDIT_ERROR;
+    }
+  else
+    {
+      if (editMetainfo (&top, log))
+        {
+          if (tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename))
+            {
+              evbuffer_add_printf (log, "\tError saving file\n");
+              ret = EDIT_ERROR;
+            }
+          else
+            {
+              ret = EDIT_CHANGED;
+            }
+        }
+
+      tr_variantFree (&top);
+    }
+
+  lockUnlock (parseLock);
+  return ret;
+}
+
+static void *
+editFiles (void * unused UNUSED)
+{
+  for (;;)
+    {
+      int i;
+      struct evbuffer * log;
+      enum edit_result result;
+
+      lockLock (queueLock);
+      i = nextFile < fileCount ? nextFile++ : -1;
+      lockUnlock (queueLock);
+
+      if (i < 0)
+        break;
+
+      log = evbuffer_new ();
+      if ((result = editInPlace (files[i], log)) == EDIT_NEEDS_FULL_PARSE)
+        result = editFullParse (files[i], log);
+
+      /* print each file's messages together */
+      lockLock (queueLock);
+      printf ("%s\n", files[i]);
+      fwrite (evbuffer_pullup (log, -1), 1, evbuffer_get_length (log), stdout);
+      if (result == EDIT_CHANGED)
+        ++changedCount;
+      lockUnlock (queueLock);
+
+      evbuffer_free (log);
+    }
+
+  return NULL;
+}
+
 int
 main (int argc, char * argv[])
 {
+#ifndef _WIN32
   int i;
-  int changedCount = 0;
+  pthread_t * threads;
+#endif
 
 #ifdef _WIN32
   tr_win32_make_args_utf8 (&argc, &argv);
@@ -323,37 +641,22 @@ main (int argc, char * argv[])
       return EXIT_FAILURE;
     }
 
-  for (i=0; i<fileCount; ++i)
-    {
-      tr_variant top;
-      bool changed = false;
-      const char * filename = files[i];
-
-      printf ("%s\n", filename);
-
-      if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
-        {
-          printf ("\tError reading file\n");
-          continue;
-        }
-
-      if (deleteme != NULL)
-        changed |= removeURL (&top, deleteme);
-
-      if (add != NULL)
-        changed = addURL (&top, add);
-
-      if (replace[0] && replace[1])
-        changed |= replaceURL (&top, replace[0], replace[1]);
+#ifndef _WIN32
+  /* this thread is one of the workers */
+  jobCount = MIN (jobCount, fileCount);
+  threads = tr_new (pthread_t, jobCount);
+  for (i=1; i<jobCount; ++i)
+    if (pthread_create (&threads[i], NULL, editFiles, NULL))
+      jobCount = i;
+#endif
 
-      if (changed)
-        {
-          ++changedCount;
-          tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename);
-        }
+  editFiles (NULL);
 
-      tr_variantFree (&top);
-    }
+#ifndef _WIN32
+  for (i=1; i<jobCount; ++i)
+    pthread_join (threads[i], NULL);
+  tr_free (threads);
+#endif
 
   printf ("Changed %d files\n", changedCount);
 
@@ -31,6 +31,7 @@
 
 static tr_option options[] =
 {
+  { 'b', "brief", "Leave out the file list; much faster for big torrents", "b", 0, NULL },
   { 'm', "magnet", "Give a magnet link for the specified torrent", "m", 0, NULL },
   { 's', "scrape", "Ask the torrent's trackers how many peers are in the torrent's swarm", "s", 0, NULL },
   { 'V', "version", "Show version number and exit", "V", 0, NULL },
@@ -40,13 +41,15 @@ static tr_option options[] =
 static const char *
 getUsage (void)
 {
-  return "Usage: " MY_NAME " [options] <.torrent file>";
+  return "Usage: " MY_NAME " [options] <.torrent file> [<.torrent file> ...]";
 }
 
+static bool briefFlag = false;
 static bool magnetFlag = false;
 static bool scrapeFlag = false;
 static bool showVersion = false;
-const char * filename = NULL;
+static const char ** filenames = NULL;
+static int filenameCount = 0;
 
 static int
 parseCommandLine (int argc, const char ** argv)
@@ -58,6 +61,10 @@ parseCommandLine (int argc, const char ** argv)
     {
       switch (c)
         {
+          case 'b':
+            briefFlag = true;
+            break;
+
           case 'm':
             magnetFlag = true;
             break;
@@ -71,7 +78,8 @@ parseCommandLine (int argc, const char ** argv)
             break;
 
           case TR_OPT_UNK:
-            filename = optarg;
+            filenames = tr_renew (const char*, filenames, filenameCount + 1);
+            filenames[filenameCount++] = optarg;
             break;
 
           default:
@@ -99,7 +107,7 @@ compare_files_by_name (const void * va, const void * vb)
 }
 
 static void
-showInfo (const tr_info * inf)
+showInfo (const tr_info * inf, bool brief)
 {
   unsigned int i;
   char buf[128];
@@ -127,7 +135,8 @@ showInfo (const tr_info * inf)
     printf ("  Comment: %s\n", inf->comment);
   printf ("  Piece Count: %d\n", inf->pieceCount);
   printf ("  Piece Size: %s\n", tr_formatter_mem_B (buf, inf->pieceSize, sizeof (buf)));
-  printf ("  Total Size: %s\n", tr_formatter_size_B (buf, inf->totalSize, sizeof (buf)));
+  if (!brief || !inf->isFolder)
+    printf ("  Total Size: %s\n", tr_formatter_size_B (buf, inf->totalSize, sizeof (buf)));
   printf ("  Privacy: %s\n", inf->isPrivate ? "Private torrent" : "Public torrent");
 
   /**
@@ -162,6 +171,9 @@ showInfo (const tr_info * inf)
   ***  Files
   **/
 
+  if (brief)
+    return;
+
   printf ("\nFILES\n\n");
   files = tr_new (tr_file*, inf->fileCount);
   for (i=0; i<inf->fileCount; ++i)
@@ -282,46 +294,40 @@ doScrape (const tr_info * inf)
     }
 }
 
-int
-main (int argc, char * argv[])
+static int
+showFile (const char * filename)
 {
-  int err;
   tr_info inf;
-  tr_ctor * ctor;
+  bool parsed;
 
-#ifdef _WIN32
-  tr_win32_make_args_utf8 (&argc, &argv);
-#endif
+  /* magnet links and scrapes don't need the file list either */
+  const bool brief = briefFlag || magnetFlag || scrapeFlag;
 
-  tr_logSetLevel (TR_LOG_ERROR);
-  tr_formatter_mem_init (MEM_K, MEM_K_STR, MEM_M_STR, MEM_G_STR, MEM_T_STR);
-  tr_formatter_size_init (DISK_K, DISK_K_STR, DISK_M_STR, DISK_G_STR, DISK_T_STR);
-  tr_formatter_speed_init (SPEED_K, SPEED_K_STR, SPEED_M_STR, SPEED_G_STR, SPEED_T_STR);
+  if (brief)
+    {
+      size_t len;
+      uint8_t * buf = NULL;
+      const uint8_t * benc = tr_mapFile (filename, &len);
 
-  if (parseCommandLine (argc, (const char**)argv))
-    return EXIT_FAILURE;
+      if (benc == NULL)
+        benc = buf = tr_loadFile (filename, &len);
 
-  if (showVersion)
-    {
-      fprintf (stderr, MY_NAME" "LONG_VERSION_STRING"\n");
-      return EXIT_SUCCESS;
-    }
+      parsed = benc != NULL && tr_metainfoParseBrief (benc, len, &inf);
 
-  /* make sure the user specified a filename */
-  if (!filename)
+      if (buf != NULL)
+        tr_free (buf);
+      else
+        tr_unmapFile (benc, len);
+    }
+  else
     {
-      fprintf (stderr, "ERROR: No .torrent file specified.\n");
-      tr_getopt_usage (MY_NAME, getUsage (), options);
-      fprintf (stderr, "\n");
-      return EXIT_FAILURE;
+      tr_ctor * ctor = tr_ctorNew (NULL);
+      tr_ctorSetMetainfoFromFile (ctor, filename);
+      parsed = tr_torrentParse (ctor, &inf) == TR_PARSE_OK;
+      tr_ctorFree (ctor);
     }
 
-  /* try to parse the .torrent file */
-  ctor = tr_ctorNew (NULL);
-  tr_ctorSetMetainfoFromFile (ctor, filename);
-  err = tr_torrentParse (ctor, &inf);
-  tr_ctorFree (ctor);
-  if (err)
+  if (!parsed)
     {
       fprintf (stderr, "Error parsing .torrent file \"%s\"\n", filename);
       return EXIT_FAILURE;
@@ -341,7 +347,7 @@ main (int argc, char * argv[])
       if (scrapeFlag)
         doScrape (&inf);
       else
-        showInfo (&inf);
+        showInfo (&inf, brief);
     }
 
   /* cleanup */
@@ -349,3 +355,44 @@ main (int argc, char * argv[])
   tr_metainfoFree (&inf);
   return EXIT_SUCCESS;
 }
+
+int
+main (int argc, char * argv[])
+{
+  int i;
+  int status = EXIT_SUCCESS;
+
+#ifdef _WIN32
+  tr_win32_make_args_utf8 (&argc, &argv);
+#endif
+
+  tr_logSetLevel (TR_LOG_ERROR);
+  tr_formatter_mem_init (MEM_K, MEM_K_STR, MEM_M_STR, MEM_G_STR, MEM_T_STR);
+  tr_formatter_size_init (DISK_K, DISK_K_STR, DISK_M_STR, DISK_G_STR, DISK_T_STR);
+  tr_formatter_speed_init (SPEED_K, SPEED_K_STR, SPEED_M_STR, SPEED_G_STR, SPEED_T_STR);
+
+  if (parseCommandLine (argc, (const char**)argv))
+    return EXIT_FAILURE;
+
+  if (showVersion)
+    {
+      fprintf (stderr, MY_NAME" "LONG_VERSION_STRING"\n");
+      return EXIT_SUCCESS;
+    }
+
+  /* make sure the user specified a filename */
+  if (filenameCount == 0)
+    {
+      fprintf (stderr, "ERROR: No .torrent file specified.\n");
+      tr_getopt_usage (MY_NAME, getUsage (), options);
+      fprintf (stderr, "\n");
+      return EXIT_FAILURE;
+    }
+
+  /* keep going past bad files, but remember them in the exit status */
+  for (i=0; i<filenameCount; ++i)
+    status |= showFile (filenames[i]);
+
+  tr_free (filenames);
+  return status;
+}
@@ -169,6 +169,7 @@ Prefs._SortDescending     = 'descending';
 Prefs._SortMethod         = 'sort_method';
 Prefs._SortByAge          = 'age';
 Prefs._SortByActivity     = 'activity';
+Prefs._SortByCpuTime      = 'cpu_time';
 Prefs._SortByName         = 'name';
 Prefs._SortByQueue        = 'queue_order';
 Prefs._SortBySize         = 'size';
@@ -584,51 +584,121 @@ function Inspector(controller) {
     *****  PEERS PAGE
     ****/
 
+    getPeerKey = function(peer) {
+        // older servers don't send peer ids
+        return peer.id !== undefined ? 'id' + peer.id : peer.address + ':' + peer.port;
+    },
+
+    getPeerCells = function(peer) {
+        var fmt = Transmission.fmt;
+
+        return [ (peer.isEncrypted ? '<div class="encrypted-peer-cell" title="Encrypted Connection">'
+                                   : '<div class="unencrypted-peer-cell">') + '</div>',
+                 (peer.rateToPeer ? fmt.speedBps(peer.rateToPeer) : ''),
+                 (peer.rateToClient ? fmt.speedBps(peer.rateToClient) : ''),
+                 Math.floor(peer.progress*100) + '%',
+                 fmt.peerStatus(peer.flagStr),
+                 sanitizeText(peer.address),
+                 sanitizeText(peer.clientName) ];
+    },
+
+    createPeerGroup = function(tor, showName) {
+        var group = { rows: { } },
+            div = document.createElement('div');
+
+        div.className = 'inspector_group';
+        if (showName)
+            $(div).append($('<div class="inspector_torrent_label"></div>').text(tor.getName()));
+
+        // firefox won't paint the top border if the div is empty
+        group.spacer = document.createElement('br');
+        div.appendChild(group.spacer);
+
+        group.table = $('<table class="peer_list">' +
+                        '<tr class="inspector_peer_entry even">' +
+                        '<th class="encryptedCol"></th>' +
+                        '<th class="upCol">Up</th>' +
+                        '<th class="downCol">Down</th>' +
+                        '<th class="percentCol">%</th>' +
+                        '<th class="statusCol">Status</th>' +
+                        '<th class="addressCol">Address</th>' +
+                        '<th class="clientCol">Client</th>' +
+                        '</tr></table>')[0];
+        div.appendChild(group.table);
+
+        data.elements.peers_list.appendChild(div);
+        return group;
+    },
+
+    createPeerRow = function(group) {
+        var i, td,
+            row = { cells: [ ], values: [ ] },
+            classes = [ '', '', '', 'percentCol', '', '', 'clientCol' ];
+
+        row.tr = document.createElement('tr');
+        for (i=0; i<classes.length; ++i) {
+            td = document.createElement('td');
+            td.className = classes[i];
+            row.tr.appendChild(td);
+            row.cells.push(td);
+        }
+        group.table.appendChild(row.tr);
+        return row;
+    },
+
+    /* The rows are kept between refreshes and keyed by peer,
+       so only the cells whose text has changed get touched. */
     updatePeersPage = function() {
-        var i, k, tor, peers, peer, parity,
-            html = [],
-            fmt = Transmission.fmt,
-            peers_list = data.elements.peers_list,
-            torrents = data.torrents;
+        var i, k, tor, peers, peer, group, row, key, cells, seen, parity,
+            torrents = data.torrents,
+            groupsKey = $.map(torrents, function(t) {return t.getId();}).join(',');
+
+        // start over when the selection changes
+        if (data.peerGroupsKey !== groupsKey) {
+            data.peerGroupsKey = groupsKey;
+            data.peerGroups = [ ];
+            $(data.elements.peers_list).empty();
+            for (k=0; tor=torrents[k]; ++k)
+                data.peerGroups.push(createPeerGroup(tor, torrents.length > 1));
+        }
 
         for (k=0; tor=torrents[k]; ++k)
         {
-            peers = tor.getPeers();
-            html.push('<div class="inspector_group">');
-            if (torrents.length > 1) {
-                html.push('<div class="inspector_torrent_label">', sanitizeText(tor.getName()), '</div>');
+            group = data.peerGroups[k];
+            peers = tor.getPeers() || [ ];
+            seen = { };
+
+            for (i=0; peer=peers[i]; ++i) {
+                key = getPeerKey(peer);
+                seen[key] = true;
+                row = group.rows[key] || (group.rows[key] = createPeerRow(group));
+                cells = getPeerCells(peer);
+                $.each(cells, function(c, html) {
+                    if (row.values[c] !== html) {
+                        row.values[c] = html;
+                        row.cells[c].innerHTML = html;
+                    }
+                });
             }
-            if (!peers || !peers.length) {
-                html.push('<br></div>'); // firefox won't paint the top border if the div is empty
-                continue;
+
+            // remove the peers that have disconnected
+            for (key in group.rows) {
+                if (group.rows.hasOwnProperty(key) && !seen[key]) {
+                    group.table.removeChild(group.rows[key].tr);
+                    delete group.rows[key];
+                }
             }
-            html.push('<table class="peer_list">',
-                   '<tr class="inspector_peer_entry even">',
-                   '<th class="encryptedCol"></th>',
-                   '<th class="upCol">Up</th>',
-                   '<th class="downCol">Down</th>',
-                   '<th class="percentCol">%</th>',
-                   '<th class="statusCol">Status</th>',
-                   '<th class="addressCol">Address</th>',
-                   '<th class="clientCol">Client</th>',
-                   '</tr>');
-            for (i=0; peer=peers[i]; ++i) {
-                parity = (i%2) ? 'odd' : 'even';
-                html.push('<tr class="inspector_peer_entry ', parity, '">',
-                       '<td>', (peer.isEncrypted ? '<div class="encrypted-peer-cell" title="Encrypted Connection">'
-                                                 : '<div class="unencrypted-peer-cell">'), '</div>', '</td>',
-                       '<td>', (peer.rateToPeer ? fmt.speedBps(peer.rateToPeer) : ''), '</td>',
-                       '<td>', (peer.rateToClient ? fmt.speedBps(peer.rateToClient) : ''), '</td>',
-                       '<td class="percentCol">', Math.floor(peer.progress*100), '%', '</td>',
-                       '<td>', fmt.peerStatus(peer.flagStr), '</td>',
-                       '<td>', sanitizeText(peer.address), '</td>',
-                       '<td class="clientCol">', sanitizeText(peer.clientName), '</td>',
-                       '</tr>');
+
+            // the header is row 0
+            for (i=1; row=group.table.rows[i]; ++i) {
+                parity = 'inspector_peer_entry ' + ((i%2) ? 'even' : 'odd');
+                if (row.className !== parity)
+                    row.className = parity;
             }
-            html.push('</table></div>');
-        }
 
-        setInnerHTML(peers_list, html.join(''));
+            group.table.style.display = peers.length ? '' : 'none';
+            group.spacer.style.display = peers.length ? 'none' : '';
+        }
     },
 
     /****
@@ -121,20 +121,43 @@ TransmissionRemote.prototype =
 	},
 
 	updateTorrents: function(torrentIds, fields, callback, context) {
+		var remote = this;
 		var o = {
 			method: 'torrent-get',
 				'arguments': {
-				'fields': fields
+				'fields': fields,
+				'format': 'table'
 			}
 		};
 		if (torrentIds)
 			o['arguments'].ids = torrentIds;
 		this.sendRequest(o, function(response) {
 			var args = response['arguments'];
-			callback.call(context,args.torrents,args.removed);
+			callback.call(context,remote.tableToObjects(args.torrents),args.removed);
 		});
 	},
 
+	/*
+	 * In the 'table' format, the first row holds the field names
+	 * and each row after it holds one torrent's values.
+	 * Older servers send a list of objects, which is returned as-is.
+	 */
+	tableToObjects: function(rows) {
+		var i, j, o, keys, objects = [];
+
+		if (!rows || !rows.length || !$.isArray(rows[0]))
+			return rows;
+
+		keys = rows[0];
+		for (i=1; i<rows.length; ++i) {
+			o = {};
+			for (j=0; j<keys.length; ++j)
+				o[keys[j]] = rows[i][j];
+			objects.push(o);
+		}
+		return objects;
+	},
+
 	getFreeSpace: function(dir, callback, context) {
 		var remote = this;
 		var o = {
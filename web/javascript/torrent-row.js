@@ -384,18 +384,37 @@ TorrentRow.prototype =
 		this._view = view;
 		this._torrent = torrent;
 		this._element = view.createRow();
+		this._isStale = false;
 		this.render(controller);
-		$(this._torrent).bind('dataChanged.torrentRowListener',function(){row.render(controller);});
+		$(this._torrent).bind('dataChanged.torrentRowListener',function(){row.onTorrentChanged(controller);});
 
 	},
 	getElement: function() {
 		return this._element;
 	},
+	onTorrentChanged: function(controller) {
+		// offscreen rows wait until they're scrolled into view
+		if (controller.isRowVisible(this))
+			this.render(controller);
+		else
+			this._isStale = true;
+	},
 	render: function(controller) {
 		var tor = this.getTorrent();
+		this._isStale = false;
 		if (tor)
 			this._view.render(controller, tor, this.getElement());
 	},
+	renderIfStale: function(controller) {
+		if (this._isStale)
+			this.render(controller);
+	},
+	getIndex: function() {
+		return this._index;
+	},
+	setIndex: function(index) {
+		this._index = index;
+	},
 	isSelected: function() {
 		return this.getElement().className.indexOf('selected') !== -1;
 	},
@@ -56,6 +56,7 @@ Torrent.Fields.Metadata = [
 
 // commonly used fields which need to be periodically refreshed
 Torrent.Fields.Stats = [
+	'cpuTime',
 	'error',
 	'errorString',
 	'eta',
@@ -209,6 +210,7 @@ Torrent.prototype =
 
 	// simple accessors
 	getComment: function() { return this.fields.comment; },
+	getCpuTime: function() { return this.fields.cpuTime; },
 	getCreator: function() { return this.fields.creator; },
 	getDateAdded: function() { return this.fields.addedDate; },
 	getDateCreated: function() { return this.fields.dateCreated; },
@@ -429,6 +431,14 @@ Torrent.compareBySize = function(ta, tb)
     return (a - b) || Torrent.compareByName(ta, tb);
 }
 
+Torrent.compareByCpuTime = function(ta, tb)
+{
+	var a = ta.getCpuTime(),
+	    b = tb.getCpuTime();
+
+	return (a - b) || Torrent.compareByName(ta, tb);
+};
+
 Torrent.compareTorrents = function(a, b, sortMethod, sortDirection)
 {
 	var i;
@@ -441,6 +451,9 @@ Torrent.compareTorrents = function(a, b, sortMethod, sortDirection)
 		case Prefs._SortByAge:
 			i = Torrent.compareByAge(a,b);
 			break;
+		case Prefs._SortByCpuTime:
+			i = Torrent.compareByCpuTime(a,b);
+			break;
 		case Prefs._SortByQueue:
 			i = Torrent.compareByQueue(a,b);
 			break;
@@ -482,6 +495,9 @@ Torrent.sortTorrents = function(torrents, sortMethod, sortDirection)
 		case Prefs._SortByAge:
 			torrents.sort(this.compareByAge);
 			break;
+		case Prefs._SortByCpuTime:
+			torrents.sort(this.compareByCpuTime);
+			break;
 		case Prefs._SortByQueue:
 			torrents.sort(this.compareByQueue);
 			break;
@@ -82,6 +82,8 @@ Transmission.prototype =
 			$('#torrent_container').bind('dragover', $.proxy(this.dragenter,this));
 			$('#torrent_container').bind('dragenter', $.proxy(this.dragenter,this));
 			$('#torrent_container').bind('drop', $.proxy(this.drop,this));
+			$('#torrent_container').scroll($.proxy(this.onTorrentListMoved,this));
+			$(window).resize($.proxy(this.onTorrentListMoved,this));
 			$('#inspector_link').click( $.proxy(this.toggleInspector,this) );
 
 			this.setupSearchBox();
@@ -767,6 +769,8 @@ Transmission.prototype =
 		var i, o, t, id, needed, needinfo = [],
 		    callback, fields;
 
+		delete this._visibleRowRange;
+
 		for (i=0; o=updates[i]; ++i)
 		{
 			id = o.id;
@@ -1374,6 +1378,87 @@ Transmission.prototype =
 	*****
 	****/
 
+	/*
+	 * Only the rows on or near the screen are rendered as soon as their
+	 * torrent changes. The others are marked stale and are rendered when
+	 * they're scrolled into view, so that the cost of an update follows
+	 * what's visible rather than how many torrents there are.
+	 */
+
+	getVisibleRowRange: function()
+	{
+		var e, mid, top, bottom, first,
+		    rows = this._rows,
+		    lo = 0,
+		    hi = rows.length,
+		    container = $('#torrent_container')[0];
+
+		if (this._visibleRowRange)
+			return this._visibleRowRange;
+
+		// include a screenful above and below as a margin
+		top = container.scrollTop - container.clientHeight;
+		bottom = container.scrollTop + 2 * container.clientHeight;
+
+		// the first row that ends below the top...
+		while (lo < hi) {
+			mid = (lo + hi) >> 1;
+			e = rows[mid].getElement();
+			if (e.offsetTop + e.offsetHeight < top)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		first = lo;
+
+		// ...and the first row that starts below the bottom
+		hi = rows.length;
+		while (lo < hi) {
+			mid = (lo + hi) >> 1;
+			if (rows[mid].getElement().offsetTop <= bottom)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		this._visibleRowRange = { first: first, last: lo - 1 };
+		return this._visibleRowRange;
+	},
+
+	isRowVisible: function(row)
+	{
+		var range, i = row.getIndex();
+
+		if (isMobileDevice || (i === undefined))
+			return true;
+
+		range = this.getVisibleRowRange();
+		return (range.first <= i) && (i <= range.last);
+	},
+
+	renderStaleRows: function()
+	{
+		var i, range;
+
+		clearTimeout(this.renderStaleRowsTimer);
+		delete this.renderStaleRowsTimer;
+
+		range = this.getVisibleRowRange();
+		for (i=range.first; i<=range.last; ++i)
+			this._rows[i].renderIfStale(this);
+	},
+
+	onTorrentListMoved: function()
+	{
+		delete this._visibleRowRange;
+
+		if (!this.renderStaleRowsTimer) {
+			var callback = $.proxy(this.renderStaleRows,this),
+			    msec = 50;
+			this.renderStaleRowsTimer = setTimeout(callback, msec);
+		}
+	},
+
 	refilterSoon: function()
 	{
 		if (!this.refilterTimer) {
@@ -1511,13 +1596,13 @@ Transmission.prototype =
 		// update our implementation fields
 		this._rows = rows;
 		this.dirtyTorrents = {};
-
-		// jquery's even/odd starts with 1 not 0, so invert its logic
-		e = []
 		for (i=0; row=rows[i]; ++i)
-			e.push(row.getElement());
-		$(e).filter(":odd").addClass('even'); 
-		$(e).filter(":even").removeClass('even'); 
+			row.setIndex(i);
+
+		// rows that were offscreen may have been moved into view
+		delete this._visibleRowRange;
+		if (!isMobileDevice)
+			this.renderStaleRows();
 
 		// sync gui
 		this.updateStatusbar();